@@ -0,0 +1,177 @@
+/**
+ * @file bench_topology.c
+ * @brief Shared fixture for the router benchmarks.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_multi.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_utils.h"
+
+/* Normally defined by sr_main.c, which the benchmarks don't link. */
+volatile sig_atomic_t srShutdownRequested = 0;
+volatile sig_atomic_t srStatsRequested = 0;
+volatile sig_atomic_t srReloadRequests = 0;
+
+static const uint8_t internalMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x01 };
+static const uint8_t externalMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x02, 0x01 };
+static const uint8_t neighbourMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x09, 0x09 };
+
+static void benchTcpChecksum(uint8_t *frame);
+
+/** Normally defined by sr_main.c; the fixture's table matches its interfaces. */
+int sr_verify_routing_table(struct sr_instance *sr)
+{
+   (void) sr;
+   return 0;
+}
+
+void BenchSetupRouter(struct sr_instance *sr, bool natEnabled, struct sr_multi *multi)
+{
+   struct in_addr dest, gw, mask;
+
+   memset(sr, 0, sizeof(*sr));
+   sr->sockfd = -1;
+   sr->multi = multi;
+
+   sr_add_interface(sr, BENCH_INTERNAL_IFACE);
+   sr_set_ether_addr(sr, internalMac);
+   sr_set_ether_ip(sr, htonl(BENCH_INTERNAL_IP));
+   sr_add_interface(sr, BENCH_EXTERNAL_IFACE);
+   sr_set_ether_addr(sr, externalMac);
+   sr_set_ether_ip(sr, htonl(BENCH_EXTERNAL_IP));
+
+   dest.s_addr = htonl(BENCH_INTERNAL_IP & 0xFFFFFF00);
+   gw.s_addr = 0;
+   mask.s_addr = htonl(0xFFFFFF00);
+   sr_add_rt_entry(sr, dest, gw, mask, BENCH_INTERNAL_IFACE);
+   dest.s_addr = 0;
+   gw.s_addr = htonl(BENCH_EXTERNAL_GATEWAY);
+   mask.s_addr = 0;
+   sr_add_rt_entry(sr, dest, gw, mask, BENCH_EXTERNAL_IFACE);
+
+   if (natEnabled)
+   {
+      sr->nat = malloc(sizeof(sr_nat_t));
+      assert(sr->nat);
+      if (multi)
+      {
+         sr_nat_init_state(sr->nat);
+      }
+      else
+      {
+         sr_nat_init(sr->nat);
+      }
+      sr->nat->routerState = sr;
+      sr->nat->icmpTimeout = 60;
+      sr->nat->tcpEstablishedTimeout = 7440;
+      sr->nat->tcpTransitoryTimeout = 300;
+      sr->nat->tcpTimeWaitTimeout = 4;
+   }
+
+   sr_init(sr);
+   BenchRefreshNeighbours(sr);
+
+   if (multi)
+   {
+      sr_multi_add(multi, sr);
+   }
+}
+
+/**
+ * BenchRefreshNeighbours()
+ * @brief (Re)caches the gateway and the 64 internal hosts, as if they had
+ *        just answered ARP requests.
+ */
+void BenchRefreshNeighbours(struct sr_instance *sr)
+{
+   uint32_t host;
+
+   sr_arpcache_insert(&(sr->cache), (unsigned char *) neighbourMac, BENCH_EXTERNAL_GATEWAY,
+      BENCH_EXTERNAL_IFACE);
+   for (host = 0; host < 64; host++)
+   {
+      sr_arpcache_insert(&(sr->cache), (unsigned char *) neighbourMac,
+         BENCH_INTERNAL_HOST_BASE + host, BENCH_INTERNAL_IFACE);
+   }
+}
+
+/**
+ * BenchBuildTcpFrame()
+ * @brief Builds a checksummed Ethernet/IP/TCP frame addressed to the router.
+ * @note Addresses are in host byte order, ports in host byte order.
+ */
+void BenchBuildTcpFrame(struct sr_instance *sr, uint8_t *frame, const char *receivingInterface,
+   uint32_t sourceIp, uint16_t sourcePort, uint32_t destinationIp, uint16_t destinationPort,
+   uint16_t controlBits)
+{
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+
+   memset(frame, 0, BENCH_TCP_FRAME_LEN);
+   memcpy(ethernetHeader->ether_dhost, sr_get_interface(sr, receivingInterface)->addr, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, neighbourMac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_ip);
+
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t));
+   ipHeader->ip_ttl = 64;
+   ipHeader->ip_p = ip_protocol_tcp;
+   ipHeader->ip_src = htonl(sourceIp);
+   ipHeader->ip_dst = htonl(destinationIp);
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+
+   tcpHeader->sourcePort = htons(sourcePort);
+   tcpHeader->destinationPort = htons(destinationPort);
+   tcpHeader->offset_controlBits = htons((5 << 12) | controlBits);
+   tcpHeader->window = htons(65535);
+   benchTcpChecksum(frame);
+}
+
+/**
+ * BenchSetTcpSequence()
+ * @brief Sets the sequence and acknowledgment numbers of a frame built by
+ *        BenchBuildTcpFrame() and checksums it again.
+ * @note Numbers are in host byte order.
+ */
+void BenchSetTcpSequence(uint8_t *frame, uint32_t sequence, uint32_t acknowledgment)
+{
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+
+   tcpHeader->sequenceNumber = htonl(sequence);
+   tcpHeader->acknowledgmentNumber = htonl(acknowledgment);
+   benchTcpChecksum(frame);
+}
+
+static void benchTcpChecksum(uint8_t *frame)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+   uint8_t pseudo[sizeof(sr_tcp_ip_pseudo_hdr_t) + sizeof(sr_tcp_hdr_t)];
+   sr_tcp_ip_pseudo_hdr_t *pseudoHeader = (sr_tcp_ip_pseudo_hdr_t *) pseudo;
+
+   tcpHeader->checksum = 0;
+   pseudoHeader->sourceAddress = ipHeader->ip_src;
+   pseudoHeader->destinationAddress = ipHeader->ip_dst;
+   pseudoHeader->zeros = 0;
+   pseudoHeader->protocol = ip_protocol_tcp;
+   pseudoHeader->tcpLength = htons(sizeof(sr_tcp_hdr_t));
+   memcpy(pseudo + sizeof(sr_tcp_ip_pseudo_hdr_t), tcpHeader, sizeof(sr_tcp_hdr_t));
+   tcpHeader->checksum = cksum(pseudo, sizeof(pseudo));
+}
+
+double BenchNow(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file bench_topology.h
+ * @brief Shared fixture for the router benchmarks.
+ *
+ * Builds a router without a VNS connection: eth1 (internal, 10.0.1.1/24)
+ * and eth2 (external, 172.64.3.1, default route via 172.64.3.10) with the
+ * next hops already in the ARP cache. Unless a benchmark links the real VNS
+ * client, sr_send_packet() is replaced by a counting sink (bench_sink.c), so
+ * it measures only the router's own work.
+ * Passing an sr_multi makes the router use its shared timer thread instead
+ * of starting ARP and NAT threads of its own.
+ */
+
+#ifndef BENCH_TOPOLOGY_H
+#define BENCH_TOPOLOGY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "sr_router.h"
+
+#define BENCH_INTERNAL_IFACE     "eth1"
+#define BENCH_EXTERNAL_IFACE     "eth2"
+#define BENCH_INTERNAL_IP        (0x0A000101) /* 10.0.1.1 */
+#define BENCH_INTERNAL_HOST_BASE (0x0A000164) /* 10.0.1.100 */
+#define BENCH_EXTERNAL_IP        (0xAC400301) /* 172.64.3.1 */
+#define BENCH_EXTERNAL_GATEWAY   (0xAC40030A) /* 172.64.3.10 */
+#define BENCH_SERVER_IP          (0x6B177383) /* 107.23.115.131 */
+
+#define BENCH_TCP_FRAME_LEN      (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t))
+
+#define BENCH_LAST_FRAME_MAX     (1514)
+
+/** Frames handed to the counting sink since start-up. */
+extern uint64_t benchPacketsSent;
+/** Start of the last frame sent, and the interface it went out of. */
+extern uint8_t benchLastFrame[BENCH_LAST_FRAME_MAX];
+extern char benchLastInterface[sr_IFACE_NAMELEN];
+
+void BenchSetupRouter(struct sr_instance *sr, bool natEnabled, struct sr_multi *multi);
+void BenchRefreshNeighbours(struct sr_instance *sr);
+void BenchBuildTcpFrame(struct sr_instance *sr, uint8_t *frame, const char *receivingInterface,
+   uint32_t sourceIp, uint16_t sourcePort, uint32_t destinationIp, uint16_t destinationPort,
+   uint16_t controlBits);
+void BenchSetTcpSequence(uint8_t *frame, uint32_t sequence, uint32_t acknowledgment);
+double BenchNow(void);
+
+#endif /* BENCH_TOPOLOGY_H */
@@ -0,0 +1,296 @@
+/**
+ * @file bench_vns.c
+ * @brief Drives the real VNS client through a socket pair.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "bench_vns.h"
+#include "sr_if.h"
+#include "sr_utils.h"
+#include "vnscommand.h"
+
+#define SERVER_PORT     (80)
+#define PING_ID         (0x4f4c)
+#define MAX_MESSAGE     (10000)
+
+static const uint8_t hostMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x09, 0x09 };
+
+static void recordProbe(bench_probe_stats_t *stats, double sentAt, double *samples)
+{
+   double ms = (BenchNow() - sentAt) * 1000.0;
+
+   if (samples)
+   {
+      samples[stats->answered] = ms;
+   }
+   stats->answered++;
+   stats->sumMs += ms;
+   if (ms > stats->maxMs)
+   {
+      stats->maxMs = ms;
+   }
+}
+
+static bool writeAll(int fd, const uint8_t *buf, unsigned int length)
+{
+   while (length > 0)
+   {
+      ssize_t written = write(fd, buf, length);
+      if (written <= 0)
+      {
+         return false;
+      }
+      buf += written;
+      length -= written;
+   }
+   return true;
+}
+
+static bool readAll(int fd, uint8_t *buf, unsigned int length)
+{
+   while (length > 0)
+   {
+      ssize_t got = read(fd, buf, length);
+      if (got <= 0)
+      {
+         return false;
+      }
+      buf += got;
+      length -= got;
+   }
+   return true;
+}
+
+static bool sendFrame(bench_vns_peer_t *peer, const uint8_t *frame, unsigned int length)
+{
+   uint8_t message[sizeof(c_packet_header) + BENCH_TCP_FRAME_LEN + sizeof(sr_arp_hdr_t)];
+   c_packet_header *header = (c_packet_header *) message;
+
+   header->mLen = htonl(sizeof(c_packet_header) + length);
+   header->mType = htonl(VNSPACKET);
+   memset(header->mInterfaceName, 0, sizeof(header->mInterfaceName));
+   strcpy(header->mInterfaceName, BENCH_INTERNAL_IFACE);
+   memcpy(message + sizeof(c_packet_header), frame, length);
+
+   if (!writeAll(peer->fd, message, sizeof(c_packet_header) + length))
+   {
+      return false;
+   }
+   peer->offered++;
+   return true;
+}
+
+static void *readerThread(void *arg)
+{
+   bench_vns_peer_t *peer = arg;
+   uint8_t message[MAX_MESSAGE];
+
+   for (;;)
+   {
+      uint32_t length;
+      uint8_t *frame = message + sizeof(c_packet_header);
+      sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+      unsigned int frameLength;
+
+      if (!readAll(peer->fd, message, 4))
+      {
+         return NULL;
+      }
+      length = ntohl(*(uint32_t *) message);
+      if ((length < sizeof(c_packet_header) + sizeof(sr_ethernet_hdr_t))
+         || (length > sizeof(message)) || !readAll(peer->fd, message + 4, length - 4))
+      {
+         return NULL;
+      }
+      frameLength = length - sizeof(c_packet_header);
+
+      if (ntohs(ethernetHeader->ether_type) == ethertype_arp)
+      {
+         /* Requests are answered in order, so the nth reply answers the nth. */
+         if (peer->arp.answered < BENCH_VNS_MAX_PROBES)
+         {
+            recordProbe(&peer->arp, peer->arpSent[peer->arp.answered], NULL);
+         }
+      }
+      else if (frameLength >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+         + sizeof(sr_icmp_t0_hdr_t))
+      {
+         sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+         sr_icmp_t0_hdr_t *icmpHeader = (sr_icmp_t0_hdr_t *) (((uint8_t *) ipHeader)
+            + sizeof(sr_ip_hdr_t));
+
+         if ((ipHeader->ip_p == ip_protocol_icmp) && (icmpHeader->icmp_type == icmp_type_echo_reply)
+            && (ntohs(icmpHeader->ident) == PING_ID))
+         {
+            recordProbe(&peer->ping, peer->pingSent[ntohs(icmpHeader->seq_num)], peer->pingMs);
+         }
+         else if (ipHeader->ip_p == ip_protocol_tcp)
+         {
+            peer->forwarded++;
+         }
+      }
+   }
+}
+
+/**
+ * BenchVnsAttach()
+ * @brief Connects the router to a new socket pair and starts the reader.
+ * @param sr router set up with BenchSetupRouter(); its sockfd is replaced.
+ * @param socketBuffer send and receive buffer size to ask for, or 0.
+ */
+bench_vns_peer_t *BenchVnsAttach(struct sr_instance *sr, int socketBuffer)
+{
+   bench_vns_peer_t *peer = calloc(1, sizeof(bench_vns_peer_t));
+   int sockets[2];
+
+   if ((peer == NULL) || (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0))
+   {
+      free(peer);
+      return NULL;
+   }
+   if (socketBuffer > 0)
+   {
+      setsockopt(sockets[0], SOL_SOCKET, SO_RCVBUF, &socketBuffer, sizeof(socketBuffer));
+      setsockopt(sockets[1], SOL_SOCKET, SO_SNDBUF, &socketBuffer, sizeof(socketBuffer));
+   }
+
+   sr->sockfd = peer->routerFd = sockets[0];
+   peer->fd = sockets[1];
+   pthread_create(&peer->reader, NULL, readerThread, peer);
+   return peer;
+}
+
+/** Sends a transit TCP SYN from internal host (flow % 64) to BENCH_SERVER_IP. */
+bool BenchVnsSendTransit(bench_vns_peer_t *peer, struct sr_instance *sr, uint64_t flow)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+
+   BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + (flow % 64),
+      1024 + (flow / 64) % 60000, BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+   return sendFrame(peer, frame, sizeof(frame));
+}
+
+/** Sends an echo request to the router's internal address. */
+bool BenchVnsSendPing(bench_vns_peer_t *peer, struct sr_instance *sr)
+{
+   uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t0_hdr_t)];
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_icmp_t0_hdr_t *icmpHeader = (sr_icmp_t0_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+
+   if (peer->ping.sent >= BENCH_VNS_MAX_PROBES)
+   {
+      return true;
+   }
+
+   memset(frame, 0, sizeof(frame));
+   memcpy(ethernetHeader->ether_dhost, sr_get_interface(sr, BENCH_INTERNAL_IFACE)->addr,
+      ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, hostMac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_ip);
+
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t0_hdr_t));
+   ipHeader->ip_ttl = 64;
+   ipHeader->ip_p = ip_protocol_icmp;
+   ipHeader->ip_src = htonl(BENCH_INTERNAL_HOST_BASE);
+   ipHeader->ip_dst = htonl(BENCH_INTERNAL_IP);
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+
+   icmpHeader->icmp_type = icmp_type_echo_request;
+   icmpHeader->ident = htons(PING_ID);
+   icmpHeader->seq_num = htons((uint16_t) peer->ping.sent);
+   icmpHeader->icmp_sum = cksum(icmpHeader, sizeof(sr_icmp_t0_hdr_t));
+
+   peer->pingSent[peer->ping.sent++] = BenchNow();
+   return sendFrame(peer, frame, sizeof(frame));
+}
+
+/** Sends a broadcast ARP request for the router's internal address. */
+bool BenchVnsSendArpRequest(bench_vns_peer_t *peer, struct sr_instance *sr)
+{
+   uint8_t frame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+
+   if (peer->arp.sent >= BENCH_VNS_MAX_PROBES)
+   {
+      return true;
+   }
+
+   memset(ethernetHeader->ether_dhost, 0xFF, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, hostMac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_arp);
+
+   arpHeader->ar_hrd = htons(arp_hrd_ethernet);
+   arpHeader->ar_pro = htons(ethertype_ip);
+   arpHeader->ar_hln = ETHER_ADDR_LEN;
+   arpHeader->ar_pln = IP_ADDR_LEN;
+   arpHeader->ar_op = htons(arp_op_request);
+   memcpy(arpHeader->ar_sha, hostMac, ETHER_ADDR_LEN);
+   arpHeader->ar_sip = htonl(BENCH_INTERNAL_HOST_BASE);
+   memset(arpHeader->ar_tha, 0, ETHER_ADDR_LEN);
+   arpHeader->ar_tip = sr_get_interface(sr, BENCH_INTERNAL_IFACE)->ip;
+
+   peer->arpSent[peer->arp.sent++] = BenchNow();
+   return sendFrame(peer, frame, sizeof(frame));
+}
+
+/** Ends the session: sr_read_from_server() returns 0 once it gets here. */
+void BenchVnsFinish(bench_vns_peer_t *peer)
+{
+   c_close goodbye;
+
+   memset(&goodbye, 0, sizeof(goodbye));
+   goodbye.mLen = htonl(sizeof(goodbye));
+   goodbye.mType = htonl(VNSCLOSE);
+   strcpy(goodbye.mErrorMessage, "benchmark over");
+   writeAll(peer->fd, (uint8_t *) &goodbye, sizeof(goodbye));
+}
+
+/** Waits for the reader to see everything the router sent; results are final after this. */
+void BenchVnsStop(bench_vns_peer_t *peer)
+{
+   shutdown(peer->routerFd, SHUT_WR);
+   pthread_join(peer->reader, NULL);
+}
+
+/** Closes both ends and frees the peer; call BenchVnsStop() first. */
+void BenchVnsDetach(bench_vns_peer_t *peer)
+{
+   close(peer->routerFd);
+   close(peer->fd);
+   free(peer);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+
+   return (x > y) - (x < y);
+}
+
+/**
+ * BenchVnsPercentileMs()
+ * @brief Ping round trip at the given fraction (0.5 for the median).
+ * @note Sorts the samples; call once the reader has stopped.
+ */
+double BenchVnsPercentileMs(bench_vns_peer_t *peer, double fraction)
+{
+   uint64_t index;
+
+   if (peer->ping.answered == 0)
+   {
+      return 0.0;
+   }
+   qsort(peer->pingMs, peer->ping.answered, sizeof(double), compareDoubles);
+   index = (uint64_t) (fraction * (peer->ping.answered - 1) + 0.5);
+   return peer->pingMs[index];
+}
@@ -0,0 +1,60 @@
+/**
+ * @file bench_vns.h
+ * @brief Drives the real VNS client through a socket pair.
+ *
+ * For benchmarks that link sr_vns_comm.c instead of the counting sink: the
+ * router reads VNSPACKETs from one end of a socket pair set up by
+ * BenchVnsAttach(), the benchmark writes frames into the other end, and a
+ * reader thread takes what the router sends back. It counts forwarded TCP
+ * and times the answers to echo requests (by sequence number) and ARP
+ * requests (in order). Frames go in on BENCH_INTERNAL_IFACE.
+ *
+ * Typical use: attach, start a thread that sends and ends with
+ * BenchVnsFinish(), run sr_read_from_server() until it returns 0, join that
+ * thread, then BenchVnsStop(), read the results and BenchVnsDetach().
+ */
+
+#ifndef BENCH_VNS_H
+#define BENCH_VNS_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "bench_topology.h"
+
+#define BENCH_VNS_MAX_PROBES     (65536)
+
+typedef struct
+{
+   uint64_t sent;
+   uint64_t answered;
+   double sumMs;
+   double maxMs;
+} bench_probe_stats_t;
+
+typedef struct
+{
+   int fd; /**< Our end of the socket pair. */
+   int routerFd;
+   pthread_t reader;
+
+   uint64_t offered; /**< Frames written. */
+   uint64_t forwarded; /**< TCP segments the router sent back. */
+   bench_probe_stats_t ping;
+   bench_probe_stats_t arp;
+   double pingSent[BENCH_VNS_MAX_PROBES];
+   double arpSent[BENCH_VNS_MAX_PROBES];
+   double pingMs[BENCH_VNS_MAX_PROBES]; /**< Round trip of each answered ping, in order. */
+} bench_vns_peer_t;
+
+bench_vns_peer_t *BenchVnsAttach(struct sr_instance *sr, int socketBuffer);
+bool BenchVnsSendTransit(bench_vns_peer_t *peer, struct sr_instance *sr, uint64_t flow);
+bool BenchVnsSendPing(bench_vns_peer_t *peer, struct sr_instance *sr);
+bool BenchVnsSendArpRequest(bench_vns_peer_t *peer, struct sr_instance *sr);
+void BenchVnsFinish(bench_vns_peer_t *peer);
+void BenchVnsStop(bench_vns_peer_t *peer);
+void BenchVnsDetach(bench_vns_peer_t *peer);
+double BenchVnsPercentileMs(bench_vns_peer_t *peer, double fraction);
+
+#endif /* BENCH_VNS_H */
@@ -0,0 +1,218 @@
+/**
+ * @file deterministic_bench.c
+ * @brief Compares the deterministic NAT (-K) with the stateful mapping
+ *        table: the cost of finding a mapping from an inbound packet's
+ *        external port, and the memory behind the table.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Internal hosts open a number of TCP connections each to a server,
+ * which answers every one, so all are established. Then, per mode:
+ *    - "create": each new mapping (outbound SYN);
+ *    - "lookup": sr_nat_lookup_external() of random mapped ports, the
+ *      external to internal step of every inbound packet;
+ *    - "inbound": whole inbound ACKs on random connections, translated and
+ *      forwarded to the internal host.
+ * In deterministic mode every mapping must use a port of its host's block.
+ *
+ * Usage: deterministic_bench [connections per host] [inbound packets]
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+
+#define HOSTS              (50)
+#define PORTS_PER_HOST     (SR_NAT_PORT_POOL_SIZE / HOSTS)
+#define DEFAULT_SOCKETS    (150)
+#define DEFAULT_PACKETS    (200000)
+#define FIRST_SOCKET       (20000)
+#define SERVER_PORT        (443)
+
+typedef struct
+{
+   const char *name;
+   bool deterministic;
+   double createNs;
+   double lookupNs;
+   double inboundNs;
+   size_t tableBytes; /**< Mappings and connections. */
+   size_t indexBytes; /**< The deterministic NAT's table by port. */
+} deterministicRun_t;
+
+static unsigned int socketsPerHost = DEFAULT_SOCKETS;
+static unsigned int packets = DEFAULT_PACKETS;
+
+/** Same sequence in both modes. */
+static uint32_t benchRandom(uint32_t *state)
+{
+   *state = *state * 1103515245 + 12345;
+   return *state >> 8;
+}
+
+/** Internal hosts need a route of their own, as in a VNS routing table. */
+static void addHostRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, mask;
+   unsigned int host;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (host = 0; host < HOSTS; host++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + host);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+}
+
+static bool runMode(deterministicRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   unsigned int mappings = HOSTS * socketsPerHost;
+   uint16_t *externalPorts = malloc(mappings * sizeof(uint16_t));
+   sr_nat_mapping_t *mapping;
+   sr_nat_connection_t *connection;
+   unsigned int i, host;
+   uint32_t random = 1;
+   uint64_t before;
+   double start;
+   bool correct = true;
+
+   assert(externalPorts);
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   addHostRoutes(&sr);
+   if (run->deterministic)
+   {
+      sr_nat_set_deterministic(sr.nat, BENCH_INTERNAL_HOST_BASE, HOSTS, PORTS_PER_HOST);
+   }
+
+   start = BenchNow();
+   for (i = 0; i < mappings; i++)
+   {
+      BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + i % HOSTS,
+         FIRST_SOCKET + i / HOSTS, BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+      sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+   run->createNs = (BenchNow() - start) * 1e9 / mappings;
+
+   for (i = 0; i < mappings; i++)
+   {
+      host = i % HOSTS;
+      mapping = sr_nat_lookup_internal(sr.nat, htonl(BENCH_INTERNAL_HOST_BASE + host),
+         htons(FIRST_SOCKET + i / HOSTS), nat_mapping_tcp);
+      if (mapping == NULL)
+      {
+         fprintf(stderr, "%s: no mapping for connection %u\n", run->name, i);
+         return false;
+      }
+      externalPorts[i] = ntohs(mapping->aux_ext);
+      free(mapping);
+      if (run->deterministic && ((externalPorts[i] < STARTING_PORT_NUMBER + host * PORTS_PER_HOST)
+         || (externalPorts[i] >= STARTING_PORT_NUMBER + (host + 1) * PORTS_PER_HOST)))
+      {
+         fprintf(stderr, "%s: host %u mapped to port %u\n", run->name, host, externalPorts[i]);
+         correct = false;
+      }
+      BenchBuildTcpFrame(&sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, externalPorts[i], TCP_SYN_M | TCP_ACK_M);
+      sr_handlepacket(&sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+   }
+
+   start = BenchNow();
+   for (i = 0; i < packets; i++)
+   {
+      mapping = sr_nat_lookup_external(sr.nat,
+         htons(externalPorts[benchRandom(&random) % mappings]), nat_mapping_tcp);
+      free(mapping);
+   }
+   run->lookupNs = (BenchNow() - start) * 1e9 / packets;
+
+   random = 1;
+   before = benchPacketsSent;
+   start = BenchNow();
+   for (i = 0; i < packets; i++)
+   {
+      if ((i & 0xFFFF) == 0)
+      {
+         BenchRefreshNeighbours(&sr);
+      }
+      BenchBuildTcpFrame(&sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, externalPorts[benchRandom(&random) % mappings], TCP_ACK_M);
+      sr_handlepacket(&sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+   }
+   run->inboundNs = (BenchNow() - start) * 1e9 / packets;
+   if (benchPacketsSent - before != packets)
+   {
+      fprintf(stderr, "%s: %" PRIu64 " of %u inbound packets forwarded\n", run->name,
+         benchPacketsSent - before, packets);
+      correct = false;
+   }
+
+   run->tableBytes = 0;
+   for (mapping = sr.nat->mappings; mapping; mapping = mapping->next)
+   {
+      run->tableBytes += sizeof(sr_nat_mapping_t);
+      for (connection = mapping->conns; connection; connection = connection->next)
+      {
+         run->tableBytes += sizeof(sr_nat_connection_t);
+      }
+   }
+   run->indexBytes = run->deterministic ? SR_NAT_MAPPING_TYPES * (HOSTS * PORTS_PER_HOST
+      * sizeof(sr_nat_mapping_t *) + HOSTS * sizeof(uint16_t)) : 0;
+
+   free(externalPorts);
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   deterministicRun_t runs[] =
+   {
+      { "stateful", false },
+      { "deterministic", true }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      socketsPerHost = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      packets = atoi(argv[2]);
+   }
+   if ((socketsPerHost == 0) || (socketsPerHost > PORTS_PER_HOST) || (packets == 0))
+   {
+      fprintf(stderr, "connections per host must be between 1 and %u\n", PORTS_PER_HOST);
+      return 2;
+   }
+
+   printf("%u hosts x %u established TCP connections, %u ports per host in deterministic mode\n",
+      HOSTS, socketsPerHost, PORTS_PER_HOST);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runMode(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-13s %8.1f ns/create %8.1f ns/lookup %8.1f ns/inbound packet  %8zu bytes of"
+         " mappings + %7zu bytes of index\n", runs[i].name, runs[i].createNs, runs[i].lookupNs,
+         runs[i].inboundNs, runs[i].tableBytes, runs[i].indexBytes);
+   }
+   printf("deterministic lookup %.1fx faster, inbound packets %.1fx\n",
+      runs[0].lookupNs / runs[1].lookupNs, runs[0].inboundNs / runs[1].inboundNs);
+   return status;
+}
@@ -0,0 +1,285 @@
+/**
+ * @file eim_bench.c
+ * @brief Measures NAT ports, state and reachability for a peer-to-peer
+ *        workload with and without endpoint independent filtering (-F), and
+ *        checks hairpinning between two internal hosts.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Each internal host has one peer-to-peer socket. It connects out
+ * to a set of peers (SYN out, SYN/ACK in), then as many other peers, which
+ * only learned its external address and port, connect in (SYN in, SYN/ACK
+ * out from the host if the SYN got through). Reported per mode:
+ *    - external ports used, against the ports a NAT mapping each
+ *      destination separately would need;
+ *    - connections tracked and the memory behind them;
+ *    - how many of the unsolicited inbound connections reached the host.
+ * Then host A opens a connection to host B through B's external address and
+ * port: the SYN and B's SYN/ACK must come back out of the internal
+ * interface, translated, rather than leave through the uplink. Without -F
+ * the first SYN is held as a simultaneous open and only B's answer gets
+ * through, as for any unsolicited peer.
+ *
+ * Usage: eim_bench [hosts] [peers per host]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+
+#define DEFAULT_HOSTS      (50)
+#define DEFAULT_PEERS      (200)
+#define P2P_PORT           (6881)
+#define OUTBOUND_PEER_BASE (0x08000000) /* 8.0.0.0 */
+#define INBOUND_PEER_BASE  (0x09000000) /* 9.0.0.0 */
+#define PEER_PORT          (51413)
+
+typedef struct
+{
+   const char *name;
+   bool endpointIndependent;
+   unsigned int mappings;
+   unsigned int connections;
+   unsigned int connected;
+   size_t bytes; /**< Mappings, connections and queued SYNs. */
+   uint64_t inboundDelivered;
+   double nsPerPacket;
+   bool hairpinned;
+} eimRun_t;
+
+static unsigned int hosts = DEFAULT_HOSTS;
+static unsigned int peers = DEFAULT_PEERS;
+
+/** External port of an internal host's socket, host byte order. 0 if unmapped. */
+static uint16_t externalPort(struct sr_instance *sr, uint32_t hostIp)
+{
+   sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr->nat, htonl(hostIp), htons(P2P_PORT),
+      nat_mapping_tcp);
+   uint16_t port = 0;
+
+   if (mapping)
+   {
+      port = ntohs(mapping->aux_ext);
+      free(mapping);
+   }
+   return port;
+}
+
+/**
+ * The router sends to a route's gateway, so like a VNS routing table, give 
+ * each internal host a route of its own to be reachable from outside.
+ */
+static void addHostRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, mask;
+   unsigned int host;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (host = 0; host < hosts; host++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + host);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+}
+
+static void countState(struct sr_instance *sr, eimRun_t *run)
+{
+   sr_nat_mapping_t *mapping;
+   sr_nat_connection_t *connection;
+
+   run->mappings = run->connections = run->connected = 0;
+   run->bytes = 0;
+   pthread_mutex_lock(&(sr->nat->lock));
+   for (mapping = sr->nat->mappings; mapping; mapping = mapping->next)
+   {
+      run->mappings++;
+      run->bytes += sizeof(sr_nat_mapping_t);
+      for (connection = mapping->conns; connection; connection = connection->next)
+      {
+         run->connections++;
+         run->bytes += sizeof(sr_nat_connection_t);
+         if (connection->connectionState == nat_conn_connected)
+         {
+            run->connected++;
+         }
+         if (connection->queuedInboundSyn)
+         {
+            run->bytes += ntohs(connection->queuedInboundSyn->ip_len);
+         }
+      }
+   }
+   pthread_mutex_unlock(&(sr->nat->lock));
+}
+
+/**
+ * Sends frame in from the given interface.
+ * @return true if it left through the internal interface to hostIp:hostPort.
+ */
+static bool deliveredTo(struct sr_instance *sr, uint8_t *frame, char *iface,
+   uint32_t hostIp, uint16_t hostPort)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (benchLastFrame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+   uint64_t before = benchPacketsSent;
+
+   sr_handlepacket(sr, frame, BENCH_TCP_FRAME_LEN, iface);
+   return (benchPacketsSent == before + 1) && (strcmp(benchLastInterface, BENCH_INTERNAL_IFACE) == 0)
+      && (ipHeader->ip_dst == htonl(hostIp)) && (tcpHeader->destinationPort == htons(hostPort));
+}
+
+/** A connects to B through B's external port; B answers. Both must arrive. */
+static bool checkHairpin(struct sr_instance *sr, eimRun_t *run)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint32_t hostA = BENCH_INTERNAL_HOST_BASE, hostB = BENCH_INTERNAL_HOST_BASE + 1;
+   uint16_t portA = externalPort(sr, hostA), portB = externalPort(sr, hostB);
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (benchLastFrame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+   bool synArrived, synAckArrived;
+
+   BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, hostA, P2P_PORT, BENCH_EXTERNAL_IP, portB,
+      TCP_SYN_M);
+   synArrived = deliveredTo(sr, frame, BENCH_INTERNAL_IFACE, hostB, P2P_PORT);
+   if (synArrived && ((ipHeader->ip_src != htonl(BENCH_EXTERNAL_IP))
+      || (tcpHeader->sourcePort != htons(portA))))
+   {
+      fprintf(stderr, "%s: hairpinned SYN not from A's external address and port\n", run->name);
+      return false;
+   }
+
+   BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, hostB, P2P_PORT, BENCH_EXTERNAL_IP, portA,
+      TCP_SYN_M | TCP_ACK_M);
+   synAckArrived = deliveredTo(sr, frame, BENCH_INTERNAL_IFACE, hostA, P2P_PORT);
+
+   if ((synArrived != run->endpointIndependent) || !synAckArrived)
+   {
+      fprintf(stderr, "%s: hairpin SYN %s, SYN/ACK %s\n", run->name,
+         synArrived ? "delivered" : "held", synAckArrived ? "delivered" : "lost");
+      return false;
+   }
+   return true;
+}
+
+static bool runPeers(eimRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   unsigned int host, peer;
+   uint64_t packets = 0;
+   double start, elapsed = 0;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   sr.nat->endpointIndependentFiltering = run->endpointIndependent;
+   addHostRoutes(&sr);
+   run->inboundDelivered = 0;
+
+   for (peer = 0; peer < peers; peer++)
+   {
+      BenchRefreshNeighbours(&sr);
+      start = BenchNow();
+      for (host = 0; host < hosts; host++)
+      {
+         uint32_t hostIp = BENCH_INTERNAL_HOST_BASE + host;
+         uint32_t outboundPeer = OUTBOUND_PEER_BASE + host * peers + peer;
+         uint32_t inboundPeer = INBOUND_PEER_BASE + host * peers + peer;
+         uint16_t port;
+
+         /* Out to a peer, and its answer. */
+         BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, hostIp, P2P_PORT, outboundPeer,
+            PEER_PORT, TCP_SYN_M);
+         sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+         port = externalPort(&sr, hostIp);
+         BenchBuildTcpFrame(&sr, frame, BENCH_EXTERNAL_IFACE, outboundPeer, PEER_PORT,
+            BENCH_EXTERNAL_IP, port, TCP_SYN_M | TCP_ACK_M);
+         sr_handlepacket(&sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+
+         /* In from a peer the host never contacted; the host answers if
+          * the SYN reached it. */
+         BenchBuildTcpFrame(&sr, frame, BENCH_EXTERNAL_IFACE, inboundPeer, PEER_PORT,
+            BENCH_EXTERNAL_IP, port, TCP_SYN_M);
+         if (deliveredTo(&sr, frame, BENCH_EXTERNAL_IFACE, hostIp, P2P_PORT))
+         {
+            run->inboundDelivered++;
+            BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, hostIp, P2P_PORT, inboundPeer,
+               PEER_PORT, TCP_SYN_M | TCP_ACK_M);
+            sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+            packets++;
+         }
+         packets += 3;
+      }
+      elapsed += BenchNow() - start;
+      sr_multi_advance(&multi, 1);
+   }
+   run->nsPerPacket = packets ? elapsed * 1e9 / packets : 0;
+
+   countState(&sr, run);
+   if (run->mappings != hosts)
+   {
+      fprintf(stderr, "%s: %u mappings for %u sockets\n", run->name, run->mappings, hosts);
+      correct = false;
+   }
+   if (run->inboundDelivered != (run->endpointIndependent ? (uint64_t) hosts * peers : 0))
+   {
+      fprintf(stderr, "%s: %" PRIu64 " unsolicited connections reached their host\n", run->name,
+         run->inboundDelivered);
+      correct = false;
+   }
+
+   run->hairpinned = checkHairpin(&sr, run);
+   sr_multi_destroy(&multi);
+   return correct && run->hairpinned;
+}
+
+int main(int argc, char **argv)
+{
+   eimRun_t runs[] =
+   {
+      { "default", false },
+      { "eif", true }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      hosts = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      peers = atoi(argv[2]);
+   }
+   if ((hosts < 2) || (hosts > 64))
+   {
+      fprintf(stderr, "hosts must be between 2 and 64\n");
+      return 2;
+   }
+
+   printf("%u internal hosts, one socket each: %u peers contacted and %u unsolicited peers per host\n",
+      hosts, peers, peers);
+   printf("a NAT mapping per destination would need %u external ports (pool of %u)\n",
+      hosts * peers * 2, SR_NAT_PORT_POOL_SIZE);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runPeers(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-8s %4u ports %7u connections (%7u up) %9zu bytes  %7" PRIu64
+         " of %u inbound reached the host  %6.1f ns/packet  hairpin %s\n", runs[i].name,
+         runs[i].mappings, runs[i].connections, runs[i].connected, runs[i].bytes,
+         runs[i].inboundDelivered, hosts * peers, runs[i].nsPerPacket,
+         runs[i].hairpinned ? "ok" : "FAILED");
+   }
+   return status;
+}
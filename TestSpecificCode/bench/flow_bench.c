@@ -0,0 +1,363 @@
+/**
+ * @file flow_bench.c
+ * @brief Measures what flow export (sr_flow.c) costs the packet path and
+ *        checks that the records add up to the traffic sent.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Two workloads, each timed without and with export:
+ *    - "forwarded": no NAT; internal hosts send TCP segments on a set of
+ *      flows to a server, counted in the forwarded flow table. The clock
+ *      moves on a second at a time, so long flows are reported at the
+ *      active timeout, and finally past the idle timeout so every flow ends;
+ *    - "nat": the same flows as NAT connections, opened with SYN and
+ *      SYN/ACK, then segments in both directions. The NAT's counts are
+ *      flushed as the router would at shutdown.
+ * With export, the file is decoded: packets and bytes of the records must
+ * equal what was sent each way, with nothing lost. Finally records are sent
+ * to a UDP collector on the loopback and decoded from the datagrams.
+ *
+ * Usage: flow_bench [flows] [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_codec.h"
+#include "sr_flow.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+
+#define DEFAULT_FLOWS      (1000)
+#define DEFAULT_PACKETS    (200000)
+#define HOSTS              (50)
+#define FIRST_SOCKET       (20000)
+#define SERVER_PORT        (443)
+#define ACTIVE_TIMEOUT_S   (30)
+#define SECONDS            (100) /**< Virtual time the packets are spread over. */
+#define COLLECTOR_RECORDS  (1000)
+#define IP_LEN             (BENCH_TCP_FRAME_LEN - sizeof(sr_ethernet_hdr_t))
+
+typedef struct
+{
+   const char *name;
+   bool nat;
+   bool exporting;
+   double nsPerPacket;
+   uint64_t sent[2]; /**< Packets out (from internal hosts) and back. */
+   uint64_t records;
+} flowRun_t;
+
+static unsigned int flows = DEFAULT_FLOWS;
+static unsigned int packets = DEFAULT_PACKETS;
+
+/** Internal hosts need a route of their own, as in a VNS routing table. */
+static void addHostRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, mask;
+   unsigned int host;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (host = 0; host < HOSTS; host++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + host);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+}
+
+/** External port of a flow's mapping, host byte order. 0 if unmapped. */
+static uint16_t externalPort(struct sr_instance *sr, unsigned int flow)
+{
+   sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr->nat,
+      htonl(BENCH_INTERNAL_HOST_BASE + flow % HOSTS), htons(FIRST_SOCKET + flow / HOSTS),
+      nat_mapping_tcp);
+   uint16_t port = 0;
+
+   if (mapping)
+   {
+      port = ntohs(mapping->aux_ext);
+      free(mapping);
+   }
+   return port;
+}
+
+/** Sends one segment of a flow, out from its host or back from the server. */
+static void sendSegment(struct sr_instance *sr, unsigned int flow, bool back, uint16_t port,
+   uint16_t controlBits)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+
+   if (back)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         sr->nat ? BENCH_EXTERNAL_IP : BENCH_INTERNAL_HOST_BASE + flow % HOSTS, port, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+   }
+   else
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + flow % HOSTS,
+         FIRST_SOCKET + flow / HOSTS, BENCH_SERVER_IP, SERVER_PORT, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+}
+
+static bool checkRecords(flowRun_t *run, const char *path)
+{
+   FILE *in = fopen(path, "rb");
+   sr_flow_record_t totals;
+   bool correct = true;
+
+   if ((in == NULL) || (sr_codec_flow_decode(in, NULL, &run->records, &totals) != 0))
+   {
+      fprintf(stderr, "%s: %s did not decode\n", run->name, path);
+      correct = false;
+   }
+   else if ((totals.packets != run->sent[0]) || (totals.octets != run->sent[0] * IP_LEN)
+      || (totals.reversePackets != (run->nat ? run->sent[1] : 0))
+      || (totals.reverseOctets != (run->nat ? run->sent[1] * IP_LEN : 0)))
+   {
+      fprintf(stderr, "%s: records count %" PRIu64 "/%" PRIu64 " packets out and %" PRIu64 "/%"
+         PRIu64 " back, sent %" PRIu64 " and %" PRIu64 "\n", run->name, totals.packets,
+         totals.octets, totals.reversePackets, totals.reverseOctets, run->sent[0], run->sent[1]);
+      correct = false;
+   }
+   if (in)
+   {
+      fclose(in);
+   }
+   unlink(path);
+   return correct;
+}
+
+static bool runFlows(flowRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   char path[64];
+   unsigned int i, second, flow;
+   uint16_t *ports = calloc(flows, sizeof(uint16_t));
+   sr_flow_t *exporter;
+   uint64_t before;
+   double start, elapsed = 0;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, run->nat, &multi);
+   addHostRoutes(&sr);
+   run->sent[0] = run->sent[1] = 0;
+
+   snprintf(path, sizeof(path), "/tmp/flow_bench.%d.ipfix", (int) getpid());
+   unlink(path);
+   if (run->exporting)
+   {
+      sr.flows = sr_flow_create(path, ACTIVE_TIMEOUT_S, 1);
+      if (sr.flows == NULL)
+      {
+         return false;
+      }
+   }
+
+   for (flow = 0; flow < flows; flow++)
+   {
+      if (run->nat)
+      {
+         sendSegment(&sr, flow, false, 0, TCP_SYN_M);
+         ports[flow] = externalPort(&sr, flow);
+         sendSegment(&sr, flow, true, ports[flow], TCP_SYN_M | TCP_ACK_M);
+         run->sent[0]++;
+         run->sent[1]++;
+      }
+      else
+      {
+         ports[flow] = FIRST_SOCKET + flow / HOSTS;
+      }
+   }
+
+   before = benchPacketsSent;
+   for (second = 0; second < SECONDS; second++)
+   {
+      BenchRefreshNeighbours(&sr);
+      start = BenchNow();
+      for (i = second * (packets / SECONDS); i < (second + 1) * (packets / SECONDS); i++)
+      {
+         /* Forwarded flows go one way; NAT connections alternate. */
+         bool back = run->nat && (i & 1);
+
+         sendSegment(&sr, i % flows, back, ports[i % flows], TCP_ACK_M);
+         run->sent[back]++;
+      }
+      elapsed += BenchNow() - start;
+      sr_multi_advance(&multi, 1);
+   }
+   run->nsPerPacket = elapsed * 1e9 / (SECONDS * (packets / SECONDS));
+   if (benchPacketsSent - before != SECONDS * (packets / SECONDS))
+   {
+      fprintf(stderr, "%s: %" PRIu64 " of %u packets forwarded\n", run->name,
+         benchPacketsSent - before, SECONDS * (packets / SECONDS));
+      correct = false;
+   }
+
+   if (run->exporting)
+   {
+      if (run->nat)
+      {
+         sr_nat_flush_flows(sr.nat);
+      }
+      else
+      {
+         sr_multi_advance(&multi, SR_FLOW_IDLE_TIMEOUT + 1);
+         if (sr.flows->tableUsed != 0)
+         {
+            fprintf(stderr, "%s: %u flows still tracked after the idle timeout\n", run->name,
+               sr.flows->tableUsed);
+            correct = false;
+         }
+      }
+      if (sr.flows->lost != 0)
+      {
+         fprintf(stderr, "%s: %" PRIu64 " records lost\n", run->name, sr.flows->lost);
+         correct = false;
+      }
+      exporter = sr.flows;
+      sr.flows = NULL;
+      sr_flow_destroy(exporter);
+      correct = checkRecords(run, path) && correct;
+   }
+
+   free(ports);
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+/** Exports records to a collector on the loopback and decodes what arrives. */
+static bool checkCollector(void)
+{
+   struct sockaddr_in address;
+   socklen_t addressLength = sizeof(address);
+   struct timeval timeout = { 1, 0 };
+   uint8_t datagram[SR_FLOW_MAX_MESSAGE];
+   char destination[64];
+   sr_flow_record_t record, totals;
+   sr_flow_t *exporter;
+   uint64_t records, expectedPackets = 0;
+   unsigned int i, datagrams = 0;
+   ssize_t received;
+   FILE *capture = tmpfile();
+   int collector = socket(AF_INET, SOCK_DGRAM, 0);
+   bool correct;
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if ((collector < 0) || (capture == NULL)
+      || (bind(collector, (struct sockaddr *) &address, sizeof(address)) != 0)
+      || (getsockname(collector, (struct sockaddr *) &address, &addressLength) != 0))
+   {
+      perror("collector");
+      return false;
+   }
+   setsockopt(collector, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   snprintf(destination, sizeof(destination), "udp:127.0.0.1:%u", ntohs(address.sin_port));
+
+   exporter = sr_flow_create(destination, ACTIVE_TIMEOUT_S, 7);
+   if (exporter == NULL)
+   {
+      return false;
+   }
+   memset(&record, 0, sizeof(record));
+   record.protocol = ip_protocol_udp;
+   record.endReason = SR_FLOW_END_IDLE;
+   for (i = 0; i < COLLECTOR_RECORDS; i++)
+   {
+      record.sourceIp = BENCH_INTERNAL_HOST_BASE + i % HOSTS;
+      record.destinationIp = BENCH_SERVER_IP;
+      record.sourcePort = FIRST_SOCKET + i;
+      record.destinationPort = 53;
+      record.packets = i + 1;
+      record.octets = (i + 1) * 100;
+      expectedPackets += record.packets;
+      sr_flow_export(exporter, &record);
+   }
+   sr_flow_destroy(exporter);
+
+   while ((received = recv(collector, datagram, sizeof(datagram), 0)) > 0)
+   {
+      fwrite(datagram, 1, received, capture);
+      datagrams++;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 100000;
+      setsockopt(collector, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   }
+   close(collector);
+
+   rewind(capture);
+   correct = (sr_codec_flow_decode(capture, NULL, &records, &totals) == 0)
+      && (records == COLLECTOR_RECORDS) && (totals.packets == expectedPackets)
+      && (totals.octets == expectedPackets * 100);
+   fclose(capture);
+   printf("collector: %u datagrams, %" PRIu64 " of %u records decoded, %s\n", datagrams, records,
+      COLLECTOR_RECORDS, correct ? "totals match" : "FAILED");
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   flowRun_t runs[] =
+   {
+      { "forwarded", false, false },
+      { "forwarded", false, true },
+      { "nat", true, false },
+      { "nat", true, true }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      flows = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      packets = atoi(argv[2]);
+   }
+   if ((flows == 0) || (flows > HOSTS * (SR_NAT_PORT_POOL_SIZE / HOSTS))
+      || (packets < SECONDS))
+   {
+      fprintf(stderr, "flows must be between 1 and %u, packets at least %u\n",
+         HOSTS * (SR_NAT_PORT_POOL_SIZE / HOSTS), SECONDS);
+      return 2;
+   }
+
+   printf("%u TCP flows from %u hosts, %u packets over %u s, active timeout %u s\n", flows, HOSTS,
+      packets, SECONDS, ACTIVE_TIMEOUT_S);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runFlows(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-9s export %-3s %7.1f ns/packet", runs[i].name, runs[i].exporting ? "on" : "off",
+         runs[i].nsPerPacket);
+      if (runs[i].exporting)
+      {
+         printf(" (%+.1f)  %7" PRIu64 " records for %" PRIu64 " packets out, %" PRIu64 " back",
+            runs[i].nsPerPacket - runs[i - 1].nsPerPacket, runs[i].records, runs[i].sent[0],
+            runs[i].sent[1]);
+      }
+      printf("\n");
+   }
+
+   if (!checkCollector())
+   {
+      status = 1;
+   }
+   return status;
+}
@@ -0,0 +1,789 @@
+/**
+ * @file micro_bench.c
+ * @brief Times the router's building blocks one by one, and compares a
+ *        run's results with a baseline.
+ *
+ * Each case repeats one operation: checksums (cksum() on an IP header and
+ * a full frame, the TCP pseudo-header checksum), route lookups in tables
+ * of 2, 100 and 1000 routes, ARP cache lookups and inserts, NAT lookups in
+ * a table of 1000 mappings, mapping creation and expiry, sr_get_interface(),
+ * building and sending ARP requests and ICMP messages, and sr_send_packet()
+ * itself. It links the real VNS client, writing to /dev/null, so sending
+ * costs what it does in the router less the kernel's part.
+ *
+ * Timing is meant to hold still from run to run on one machine: the
+ * process is pinned to the CPU it started on, a case first runs in batches
+ * that double until one takes the time asked of a repetition, and keeps
+ * running until it has warmed up for WARMUP_MS, then runs the repetitions
+ * with that batch. The minimum, median and median absolute deviation of
+ * the nanoseconds per operation are reported. A fixed loop is timed before
+ * and after the cases; if its speed moved, or the CPU's frequency governor
+ * isn't "performance", the run says so (frequency scaling makes the other
+ * numbers wander). Cases that change the size of what they work on (NAT
+ * creation and expiry) run fixed batches instead, prepared untimed.
+ *
+ * With a file name the results are also written there as JSON, one case a
+ * line. "compare" reads two such files and flags every case whose median
+ * grew by more than the percentage given (default 10) and by more than
+ * three times the two runs' deviations together; it exits with 1 if any
+ * did. Keep a run on the machine in question as the baseline.
+ *
+ * Usage: micro_bench [repetitions] [ms per repetition] [json file]
+ *        micro_bench compare baseline.json current.json [percent]
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_arpcache.h"
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_utils.h"
+
+#define DEFAULT_REPETITIONS   (15)
+#define DEFAULT_REPETITION_MS (10)
+#define MAX_REPETITIONS       (101)
+#define WARMUP_MS             (50)
+#define MAX_CASES             (32)
+#define NAT_MAPPINGS          (1000)
+#define NAT_BATCH             (256)
+#define SPIN_ITERATIONS       (20000000)
+#define CLOCK_DRIFT           (0.05)
+#define DEFAULT_THRESHOLD     (10.0)
+#define NOISE_DEVIATIONS      (3.0)
+
+typedef struct
+{
+   const char *name;
+   void (*run)(uint64_t iterations);
+   /** Untimed, before each batch; NULL if none is needed. */
+   void (*prepare)(uint64_t iterations);
+   /** Operations per batch; 0 to size batches to the repetition time. */
+   uint64_t fixedBatch;
+} microCase_t;
+
+typedef struct
+{
+   char name[64];
+   uint64_t batch;
+   double minNs;
+   double medianNs;
+   double madNs;
+} microResult_t;
+
+typedef enum
+{
+   NAT_UNKNOWN,
+   NAT_BACKGROUND /**< Exactly the NAT_MAPPINGS TCP mappings of natFill(). */
+} natState_t;
+
+static struct sr_instance router; /**< NAT, the fixture's two routes. */
+static struct sr_instance routes100;
+static struct sr_instance routes1000;
+static sr_multi_t multi;
+
+static uint8_t ipHeaderBytes[sizeof(sr_ip_hdr_t)];
+static uint8_t fullFrame[1514];
+static uint8_t tcpFrame[BENCH_TCP_FRAME_LEN];
+static uint8_t tcpFullFrame[1514];
+static uint8_t inboundFrame[BENCH_TCP_FRAME_LEN];
+static uint8_t echoFrame[sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+   + offsetof(sr_icmp_t0_hdr_t, data) + 56];
+static struct sr_arpreq arpRequest;
+
+static natState_t natState = NAT_UNKNOWN;
+static uint16_t natExternalPorts[NAT_MAPPINGS];
+static uint16_t natNextIdent = 1;
+
+/** Results are added here so the compiler can't drop the work. */
+static volatile uint64_t sink;
+
+static uint64_t microNowNs(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+   return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * The cases
+ */
+
+static void runCksumIpHeader(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      ipHeaderBytes[0] = (uint8_t) i;
+      sink += cksum(ipHeaderBytes, sizeof(ipHeaderBytes));
+   }
+}
+
+static void runCksumFrame(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      fullFrame[0] = (uint8_t) i;
+      sink += cksum(fullFrame + sizeof(sr_ethernet_hdr_t), sizeof(fullFrame) - sizeof(sr_ethernet_hdr_t));
+   }
+}
+
+static void runTcpChecksum(uint64_t iterations)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (tcpFrame + sizeof(sr_ethernet_hdr_t));
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sink += TcpPerformIntegrityCheck(ipHeader, sizeof(tcpFrame) - sizeof(sr_ethernet_hdr_t));
+   }
+}
+
+static void runTcpChecksumFull(uint64_t iterations)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (tcpFullFrame + sizeof(sr_ethernet_hdr_t));
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sink += TcpPerformIntegrityCheck(ipHeader, sizeof(tcpFullFrame) - sizeof(sr_ethernet_hdr_t));
+   }
+}
+
+static void routeLookups(struct sr_instance *sr, uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      /* Half to internal hosts, half to the Internet. */
+      sink += (uintptr_t) IpGetPacketRoute(sr, (i & 1) ? BENCH_INTERNAL_HOST_BASE + (i & 63)
+         : BENCH_SERVER_IP + (uint32_t) i);
+   }
+}
+
+static void runRouteLookup2(uint64_t iterations)
+{
+   routeLookups(&router, iterations);
+}
+
+static void runRouteLookup100(uint64_t iterations)
+{
+   routeLookups(&routes100, iterations);
+}
+
+static void runRouteLookup1000(uint64_t iterations)
+{
+   routeLookups(&routes1000, iterations);
+}
+
+static void runArpLookupHit(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sr_arpentry_t *entry = sr_arpcache_lookup(&router.cache, BENCH_INTERNAL_HOST_BASE + (i & 63));
+      sink += entry->mac[5];
+      free(entry);
+   }
+}
+
+static void runArpLookupMiss(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sink += (uintptr_t) sr_arpcache_lookup(&router.cache, BENCH_SERVER_IP + (uint32_t) i);
+   }
+}
+
+static void runArpInsert(uint64_t iterations)
+{
+   static unsigned char mac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x09, 0x09 };
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      /* Refreshes an entry, as replies to the router's requests do. */
+      sink += (uintptr_t) sr_arpcache_insert(&router.cache, mac, BENCH_INTERNAL_HOST_BASE + (i & 63),
+         BENCH_INTERNAL_IFACE);
+   }
+}
+
+/** Empties the NAT table: every mapping of natFill() has no connection. */
+static void natClear(void)
+{
+   sr_clock_advance(router.nat->icmpTimeout + 1);
+   sr_nat_tick(router.nat);
+   natState = NAT_UNKNOWN;
+}
+
+/** Maps NAT_MAPPINGS internal TCP sockets; natExternalPorts gets their ports. */
+static void natFill(void)
+{
+   sr_nat_mapping_t *mapping;
+   unsigned int i;
+
+   natClear();
+   for (i = 0; i < NAT_MAPPINGS; i++)
+   {
+      mapping = sr_nat_insert_mapping(router.nat, htonl(BENCH_INTERNAL_HOST_BASE + i % 64),
+         htons(20000 + i / 64), nat_mapping_tcp);
+      natExternalPorts[i] = mapping->aux_ext;
+      free(mapping);
+   }
+   natState = NAT_BACKGROUND;
+}
+
+static void prepareNatBackground(uint64_t iterations)
+{
+   (void) iterations;
+   if (natState != NAT_BACKGROUND)
+   {
+      natFill();
+   }
+}
+
+static void runNatLookupInternal(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      unsigned int mapping = (i * 7919) % NAT_MAPPINGS;
+      sr_nat_mapping_t *copy = sr_nat_lookup_internal(router.nat,
+         htonl(BENCH_INTERNAL_HOST_BASE + mapping % 64), htons(20000 + mapping / 64),
+         nat_mapping_tcp);
+      sink += copy->aux_ext;
+      free(copy);
+   }
+}
+
+static void runNatLookupExternal(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sr_nat_mapping_t *copy = sr_nat_lookup_external(router.nat,
+         natExternalPorts[(i * 7919) % NAT_MAPPINGS], nat_mapping_tcp);
+      sink += copy->aux_int;
+      free(copy);
+   }
+}
+
+static void runNatCreate(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sr_nat_mapping_t *copy = sr_nat_insert_mapping(router.nat, htonl(BENCH_INTERNAL_HOST_BASE),
+         htons(natNextIdent++), nat_mapping_icmp);
+      sink += copy->aux_ext;
+      free(copy);
+   }
+   natState = NAT_UNKNOWN;
+}
+
+/** Echo mappings alone in the table, all past their timeout. */
+static void prepareNatExpire(uint64_t iterations)
+{
+   uint64_t i;
+
+   natClear();
+   for (i = 0; i < iterations; i++)
+   {
+      free(sr_nat_insert_mapping(router.nat, htonl(BENCH_INTERNAL_HOST_BASE),
+         htons(natNextIdent++), nat_mapping_icmp));
+   }
+   sr_clock_advance(router.nat->icmpTimeout + 1);
+}
+
+static void runNatExpire(uint64_t iterations)
+{
+   (void) iterations;
+   sr_nat_tick(router.nat);
+}
+
+static void runGetInterface(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sink += (uintptr_t) sr_get_interface(&router, (i & 1) ? BENCH_EXTERNAL_IFACE
+         : BENCH_INTERNAL_IFACE);
+   }
+}
+
+static void runArpRequestFrame(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      arpRequest.ip = BENCH_INTERNAL_HOST_BASE + 64 + (i & 63);
+      LinkSendArpRequest(&router, &arpRequest);
+   }
+}
+
+static void runIcmpUnreachableFrame(uint64_t iterations)
+{
+   sr_ip_hdr_t *original = (sr_ip_hdr_t *) (inboundFrame + sizeof(sr_ethernet_hdr_t));
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      IpSendTypeThreeIcmpPacket(&router, icmp_code_destination_host_unreachable, original);
+   }
+}
+
+static void runIcmpEchoReply(uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sr_handlepacket(&router, echoFrame, sizeof(echoFrame), BENCH_EXTERNAL_IFACE);
+   }
+}
+
+static void sendFrames(uint8_t *frame, unsigned int length, uint64_t iterations)
+{
+   uint64_t i;
+
+   for (i = 0; i < iterations; i++)
+   {
+      sink += sr_send_packet(&router, frame, length, BENCH_EXTERNAL_IFACE);
+   }
+}
+
+static void runSendPacket(uint64_t iterations)
+{
+   sendFrames(tcpFullFrame, 64, iterations);
+}
+
+static void runSendPacketFull(uint64_t iterations)
+{
+   sendFrames(tcpFullFrame, sizeof(tcpFullFrame), iterations);
+}
+
+static const microCase_t cases[] =
+{
+   { "cksum_ip_header", runCksumIpHeader, NULL, 0 },
+   { "cksum_1500", runCksumFrame, NULL, 0 },
+   { "tcp_checksum_40", runTcpChecksum, NULL, 0 },
+   { "tcp_checksum_1500", runTcpChecksumFull, NULL, 0 },
+   { "route_lookup_2", runRouteLookup2, NULL, 0 },
+   { "route_lookup_100", runRouteLookup100, NULL, 0 },
+   { "route_lookup_1000", runRouteLookup1000, NULL, 0 },
+   { "arp_lookup_hit", runArpLookupHit, NULL, 0 },
+   { "arp_lookup_miss", runArpLookupMiss, NULL, 0 },
+   { "arp_insert", runArpInsert, NULL, 0 },
+   { "nat_lookup_internal_1000", runNatLookupInternal, prepareNatBackground, 0 },
+   { "nat_lookup_external_1000", runNatLookupExternal, prepareNatBackground, 0 },
+   { "nat_create_over_1000", runNatCreate, prepareNatBackground, NAT_BATCH },
+   { "nat_expire", runNatExpire, prepareNatExpire, NAT_BATCH },
+   { "get_interface", runGetInterface, NULL, 0 },
+   { "arp_request_frame", runArpRequestFrame, NULL, 0 },
+   { "icmp_unreachable_frame", runIcmpUnreachableFrame, NULL, 0 },
+   { "icmp_echo_reply", runIcmpEchoReply, NULL, 0 },
+   { "send_packet_64", runSendPacket, NULL, 0 },
+   { "send_packet_1514", runSendPacketFull, NULL, 0 }
+};
+
+/*
+ * Fixture
+ */
+
+static void addRoutes(struct sr_instance *sr, unsigned int count)
+{
+   struct in_addr dest, gw, mask;
+   unsigned int i;
+
+   gw.s_addr = htonl(BENCH_EXTERNAL_GATEWAY);
+   mask.s_addr = htonl(0xFFFFFF00);
+   /* Beyond the fixture's two, which stay last. */
+   for (i = 2; i < count; i++)
+   {
+      dest.s_addr = htonl(0xC6000000 + (i << 8)); /* 198.x.y.0/24 */
+      sr_add_rt_entry(sr, dest, gw, mask, BENCH_EXTERNAL_IFACE);
+   }
+}
+
+/** A ping of the router's external address, which it answers itself. */
+static void buildEchoRequest(void)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (echoFrame + sizeof(sr_ethernet_hdr_t));
+   sr_icmp_t0_hdr_t *icmpHeader = (sr_icmp_t0_hdr_t *) (ipHeader + 1);
+
+   memcpy(echoFrame, inboundFrame, sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
+   ipHeader->ip_len = htons(sizeof(echoFrame) - sizeof(sr_ethernet_hdr_t));
+   ipHeader->ip_p = ip_protocol_icmp;
+   ipHeader->ip_sum = 0;
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+   icmpHeader->icmp_type = icmp_type_echo_request;
+   icmpHeader->icmp_code = 0;
+   /* Below the NAT's identifiers, so no mapping claims it. */
+   icmpHeader->ident = htons(1);
+   icmpHeader->seq_num = htons(1);
+   icmpHeader->icmp_sum = 0;
+   icmpHeader->icmp_sum = cksum(icmpHeader, sizeof(echoFrame) - sizeof(sr_ethernet_hdr_t)
+      - sizeof(sr_ip_hdr_t));
+}
+
+static void setUp(void)
+{
+   sr_ip_hdr_t *ipHeader;
+   unsigned int i;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&router, true, &multi);
+   BenchSetupRouter(&routes100, false, &multi);
+   BenchSetupRouter(&routes1000, false, &multi);
+   addRoutes(&routes100, 100);
+   addRoutes(&routes1000, 1000);
+   /* Everything sent goes to /dev/null through the real VNS client. */
+   router.sockfd = open("/dev/null", O_WRONLY);
+
+   for (i = 0; i < sizeof(fullFrame); i++)
+   {
+      fullFrame[i] = (uint8_t) (i * 31);
+   }
+   BenchBuildTcpFrame(&router, tcpFrame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE, 20000,
+      BENCH_SERVER_IP, 443, TCP_ACK_M);
+   memcpy(ipHeaderBytes, tcpFrame + sizeof(sr_ethernet_hdr_t), sizeof(ipHeaderBytes));
+   /* From the Internet, so answers to it take the default route. */
+   BenchBuildTcpFrame(&router, inboundFrame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, 443,
+      BENCH_EXTERNAL_IP, STARTING_PORT_NUMBER, TCP_ACK_M);
+
+   /* A full-sized segment, checksummed, leaving the router. */
+   BenchBuildTcpFrame(&router, tcpFullFrame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE, 20000,
+      BENCH_SERVER_IP, 443, TCP_ACK_M);
+   ipHeader = (sr_ip_hdr_t *) (tcpFullFrame + sizeof(sr_ethernet_hdr_t));
+   ipHeader->ip_len = htons(sizeof(tcpFullFrame) - sizeof(sr_ethernet_hdr_t));
+   ipHeader->ip_sum = 0;
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+   memcpy(((sr_ethernet_hdr_t *) tcpFullFrame)->ether_shost,
+      sr_get_interface(&router, BENCH_EXTERNAL_IFACE)->addr, ETHER_ADDR_LEN);
+
+   buildEchoRequest();
+   arpRequest.requestedInterface = sr_get_interface(&router, BENCH_INTERNAL_IFACE);
+}
+
+static void tearDown(void)
+{
+   close(router.sockfd);
+   router.sockfd = -1;
+   sr_multi_destroy(&multi);
+}
+
+/*
+ * Timing
+ */
+
+static int compareDoubles(const void *a, const void *b)
+{
+   double x = *(const double *) a, y = *(const double *) b;
+
+   return (x > y) - (x < y);
+}
+
+static double median(double *values, unsigned int count)
+{
+   qsort(values, count, sizeof(double), compareDoubles);
+   return (count % 2) ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+static uint64_t timeBatch(const microCase_t *microCase, uint64_t batch)
+{
+   uint64_t start;
+
+   if (microCase->prepare)
+   {
+      microCase->prepare(batch);
+   }
+   start = microNowNs();
+   microCase->run(batch);
+   return microNowNs() - start;
+}
+
+static void measure(const microCase_t *microCase, unsigned int repetitions, uint64_t repetitionNs,
+   microResult_t *result)
+{
+   double nsPerOp[MAX_REPETITIONS], deviations[MAX_REPETITIONS];
+   uint64_t batch = microCase->fixedBatch ? microCase->fixedBatch : 1;
+   uint64_t warmedNs = 0, elapsed;
+   unsigned int i;
+
+   /* Size the batch, then keep at it until warm. */
+   while ((elapsed = timeBatch(microCase, batch)) < repetitionNs && !microCase->fixedBatch)
+   {
+      warmedNs += elapsed;
+      batch *= 2;
+   }
+   for (warmedNs += elapsed; warmedNs < WARMUP_MS * 1000000ULL; warmedNs += elapsed)
+   {
+      elapsed = timeBatch(microCase, batch);
+   }
+
+   for (i = 0; i < repetitions; i++)
+   {
+      nsPerOp[i] = (double) timeBatch(microCase, batch) / batch;
+   }
+
+   strncpy(result->name, microCase->name, sizeof(result->name) - 1);
+   result->batch = batch;
+   result->medianNs = median(nsPerOp, repetitions);
+   result->minNs = nsPerOp[0];
+   for (i = 0; i < repetitions; i++)
+   {
+      deviations[i] = (nsPerOp[i] > result->medianNs) ? nsPerOp[i] - result->medianNs
+         : result->medianNs - nsPerOp[i];
+   }
+   result->madNs = median(deviations, repetitions);
+}
+
+/** Seconds a fixed loop takes: a rough reading of the CPU's speed. */
+static double spin(void)
+{
+   volatile uint64_t counter = 0;
+   uint64_t start = microNowNs();
+   unsigned int i;
+
+   for (i = 0; i < SPIN_ITERATIONS; i++)
+   {
+      counter += i;
+   }
+   return (microNowNs() - start) / 1e9;
+}
+
+static void readGovernor(int cpu, char *governor, size_t size)
+{
+   char path[128];
+   FILE *in;
+
+   snprintf(governor, size, "unknown");
+   snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor", cpu);
+   in = fopen(path, "r");
+   if (in)
+   {
+      if (fgets(governor, size, in))
+      {
+         governor[strcspn(governor, "\n")] = '\0';
+      }
+      fclose(in);
+   }
+}
+
+static int writeJson(const char *path, const microResult_t *results, unsigned int count,
+   unsigned int repetitions, uint64_t repetitionNs, int cpu, const char *governor, double drift)
+{
+   FILE *out = fopen(path, "w");
+   unsigned int i;
+
+   if (out == NULL)
+   {
+      perror(path);
+      return -1;
+   }
+   fprintf(out, "{\n");
+   fprintf(out, "  \"benchmark\": \"micro_bench\",\n");
+   fprintf(out, "  \"timestamp\": %lld,\n", (long long) time(NULL));
+   fprintf(out, "  \"cpu\": %d,\n", cpu);
+   fprintf(out, "  \"governor\": \"%s\",\n", governor);
+   fprintf(out, "  \"clock_drift\": %.4f,\n", drift);
+   fprintf(out, "  \"repetitions\": %u,\n", repetitions);
+   fprintf(out, "  \"repetition_ms\": %.1f,\n", repetitionNs / 1e6);
+   fprintf(out, "  \"results\": [\n");
+   for (i = 0; i < count; i++)
+   {
+      fprintf(out, "    {\"name\": \"%s\", \"batch\": %" PRIu64 ", \"min_ns\": %.3f, "
+         "\"median_ns\": %.3f, \"mad_ns\": %.3f}%s\n", results[i].name, results[i].batch,
+         results[i].minNs, results[i].medianNs, results[i].madNs, (i + 1 < count) ? "," : "");
+   }
+   fprintf(out, "  ]\n}\n");
+   return fclose(out);
+}
+
+/*
+ * Comparison
+ */
+
+/** Reads the results of a file written by writeJson(); returns how many, or -1. */
+static int readJson(const char *path, microResult_t *results, unsigned int max)
+{
+   char line[512];
+   const char *entry;
+   unsigned int count = 0;
+   FILE *in = fopen(path, "r");
+
+   if (in == NULL)
+   {
+      perror(path);
+      return -1;
+   }
+   while (fgets(line, sizeof(line), in) && (count < max))
+   {
+      entry = strstr(line, "{\"name\": ");
+      if (entry && (sscanf(entry, "{\"name\": \"%63[^\"]\", \"batch\": %" SCNu64 ", \"min_ns\": %lf, "
+         "\"median_ns\": %lf, \"mad_ns\": %lf", results[count].name, &results[count].batch,
+         &results[count].minNs, &results[count].medianNs, &results[count].madNs) == 5))
+      {
+         count++;
+      }
+   }
+   fclose(in);
+   return count;
+}
+
+static int compare(const char *baselinePath, const char *currentPath, double threshold)
+{
+   microResult_t baseline[MAX_CASES], current[MAX_CASES];
+   int baselineCount = readJson(baselinePath, baseline, MAX_CASES);
+   int currentCount = readJson(currentPath, current, MAX_CASES);
+   unsigned int regressions = 0;
+   int i, j;
+
+   if ((baselineCount <= 0) || (currentCount <= 0))
+   {
+      fprintf(stderr, "No results to compare\n");
+      return 2;
+   }
+
+   printf("%-26s %12s %12s %8s\n", "case", "baseline ns", "current ns", "change");
+   for (i = 0; i < currentCount; i++)
+   {
+      const char *verdict = "";
+      double change, noise;
+
+      for (j = 0; (j < baselineCount) && strcmp(baseline[j].name, current[i].name); j++)
+      {
+      }
+      if (j == baselineCount)
+      {
+         printf("%-26s %12s %12.2f %8s  new\n", current[i].name, "-", current[i].medianNs, "");
+         continue;
+      }
+      change = (current[i].medianNs - baseline[j].medianNs) * 100 / baseline[j].medianNs;
+      noise = NOISE_DEVIATIONS * (current[i].madNs + baseline[j].madNs);
+      if ((change > threshold) && (current[i].medianNs - baseline[j].medianNs > noise))
+      {
+         verdict = "  REGRESSION";
+         regressions++;
+      }
+      else if ((change < -threshold) && (baseline[j].medianNs - current[i].medianNs > noise))
+      {
+         verdict = "  faster";
+      }
+      printf("%-26s %12.2f %12.2f %+7.1f%%%s\n", current[i].name, baseline[j].medianNs,
+         current[i].medianNs, change, verdict);
+   }
+   for (j = 0; j < baselineCount; j++)
+   {
+      for (i = 0; (i < currentCount) && strcmp(baseline[j].name, current[i].name); i++)
+      {
+      }
+      if (i == currentCount)
+      {
+         printf("%-26s %12.2f %12s %8s  missing\n", baseline[j].name, baseline[j].medianNs, "-", "");
+      }
+   }
+   printf("%u regressions over %.1f%%\n", regressions, threshold);
+   return regressions ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int repetitions = DEFAULT_REPETITIONS, count = sizeof(cases) / sizeof(cases[0]);
+   uint64_t repetitionNs = DEFAULT_REPETITION_MS * 1000000ULL;
+   microResult_t results[MAX_CASES];
+   char governor[64];
+   double before, drift;
+   cpu_set_t cpus;
+   unsigned int i;
+   int cpu;
+
+   if ((argc > 1) && (strcmp(argv[1], "compare") == 0))
+   {
+      if ((argc < 4) || (argc > 5))
+      {
+         fprintf(stderr, "Usage: %s compare baseline.json current.json [percent]\n", argv[0]);
+         return 2;
+      }
+      return compare(argv[2], argv[3], (argc == 5) ? atof(argv[4]) : DEFAULT_THRESHOLD);
+   }
+   if (argc > 1)
+   {
+      repetitions = atoi(argv[1]);
+      if ((repetitions < 1) || (repetitions > MAX_REPETITIONS))
+      {
+         fprintf(stderr, "Repetitions must be from 1 to %u\n", MAX_REPETITIONS);
+         return 2;
+      }
+   }
+   if (argc > 2)
+   {
+      repetitionNs = (uint64_t) (atof(argv[2]) * 1e6);
+   }
+
+   /* Stay on one CPU, so caches and frequency don't change under a case. */
+   cpu = sched_getcpu();
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu, &cpus);
+   if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+   {
+      perror("sched_setaffinity");
+   }
+   readGovernor(cpu, governor, sizeof(governor));
+   if (strcmp(governor, "performance") != 0)
+   {
+      fprintf(stderr, "CPU %d frequency governor is %s, not performance: expect noise\n", cpu,
+         governor);
+   }
+
+   setUp();
+   before = spin();
+   printf("%u repetitions of %.1f ms on CPU %d\n", repetitions, repetitionNs / 1e6, cpu);
+   printf("%-26s %10s %10s %10s %8s\n", "case", "batch", "min ns", "median ns", "mad ns");
+   for (i = 0; i < count; i++)
+   {
+      measure(&cases[i], repetitions, repetitionNs, &results[i]);
+      printf("%-26s %10" PRIu64 " %10.2f %10.2f %8.2f\n", results[i].name, results[i].batch,
+         results[i].minNs, results[i].medianNs, results[i].madNs);
+   }
+   drift = spin() / before - 1;
+   if ((drift > CLOCK_DRIFT) || (drift < -CLOCK_DRIFT))
+   {
+      fprintf(stderr, "CPU speed moved %+.1f%% during the run: results are suspect\n", drift * 100);
+   }
+   tearDown();
+
+   if ((argc > 3) && (writeJson(argv[3], results, count, repetitions, repetitionNs, cpu, governor,
+      drift) != 0))
+   {
+      return 1;
+   }
+   return 0;
+}
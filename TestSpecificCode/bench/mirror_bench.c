@@ -0,0 +1,334 @@
+/**
+ * @file mirror_bench.c
+ * @brief Measures what port mirroring (sr_mirror.c) costs the packet path
+ *        and checks what reaches the analyzer.
+ *
+ * Internal hosts send TCP segments to a server, forwarded out of the
+ * external interface, timed with:
+ *    - no mirror sessions;
+ *    - a session whose filter matches nothing;
+ *    - every frame received on the internal interface mirrored to a ring,
+ *      read by a capture thread: every frame must be read intact or
+ *      counted as finding the ring full;
+ *    - the same frames mirrored out of the external interface: each must be
+ *      sent once more, and a copy must carry the mirror header;
+ *    - the segments to the server's port sent out of the external
+ *      interface, mirrored with a low cap: every segment must match, and
+ *      no more may be mirrored than a second's burst plus the cap for the
+ *      time taken.
+ * Last the sessions file is rewritten and read again on a (simulated)
+ * SIGHUP, and a bad file must leave the sessions as they were.
+ *
+ * Usage: mirror_bench [packets]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_mirror.h"
+#include "sr_multi.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+
+#define DEFAULT_PACKETS    (200000)
+#define HOSTS              (50)
+#define FIRST_SOCKET       (20000)
+#define SERVER_PORT        (443)
+#define CAP_BITS_PER_S     (1000000)
+
+typedef struct
+{
+   const char *name;
+   const char *session; /**< Line of the sessions file; NULL: none. */
+   bool matchesAll; /**< Every packet matches the session. */
+   double nsPerPacket;
+   uint64_t sent;
+   uint64_t mirrored;
+   uint64_t mirroredBytes;
+   uint64_t capped;
+   uint64_t ringFull;
+   uint64_t read; /**< By the capture thread. */
+} mirrorRun_t;
+
+typedef struct
+{
+   sr_mirror_ring_t *ring;
+   uint8_t direction; /**< Of every frame mirrored. */
+   bool stop;
+   uint64_t read;
+   uint64_t corrupt;
+} mirrorCapture_t;
+
+static unsigned int packets = DEFAULT_PACKETS;
+static char ringPath[64];
+static char configPath[64];
+
+static void writeConfig(const char *line)
+{
+   FILE *out = fopen(configPath, "w");
+
+   fprintf(out, "# mirror_bench\n%s\n", line);
+   fclose(out);
+}
+
+static void buildFrame(struct sr_instance *sr, uint8_t *frame, unsigned int i)
+{
+   BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + i % HOSTS,
+      FIRST_SOCKET + i % 1000, BENCH_SERVER_IP, SERVER_PORT, TCP_ACK_M);
+}
+
+/** Reads the ring as tools/mirror_capture does, checking each frame. */
+static void *captureThread(void *capturePtr)
+{
+   mirrorCapture_t *capture = (mirrorCapture_t *) capturePtr;
+   const struct timespec idle = { 0, 100000 };
+   const sr_mirror_slot_t *slot;
+   const sr_ip_hdr_t *packet;
+
+   while (1)
+   {
+      slot = sr_mirror_ring_next(capture->ring);
+      if (slot == NULL)
+      {
+         if (__atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE))
+         {
+            break;
+         }
+         nanosleep(&idle, NULL);
+         continue;
+      }
+      packet = (const sr_ip_hdr_t *) (slot->data + sizeof(sr_ethernet_hdr_t));
+      if ((slot->length != BENCH_TCP_FRAME_LEN) || (slot->captured != slot->length)
+         || (slot->direction != capture->direction) || (packet->ip_dst != htonl(BENCH_SERVER_IP)))
+      {
+         capture->corrupt++;
+      }
+      sr_mirror_ring_release(capture->ring, slot);
+      capture->read++;
+   }
+   return NULL;
+}
+
+/** A copy sent out of an interface must carry the header and the whole frame. */
+static bool checkEncapsulation(struct sr_instance *sr)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   const sr_ethernet_hdr_t *ethernetHeader = (const sr_ethernet_hdr_t *) benchLastFrame;
+   const sr_mirror_encap_hdr_t *header = (const sr_mirror_encap_hdr_t *) (ethernetHeader + 1);
+   uint64_t before = benchPacketsSent;
+
+   buildFrame(sr, frame, 0);
+   sr_mirror_frame(sr->mirror, SR_MIRROR_IN, BENCH_INTERNAL_IFACE, frame, sizeof(frame));
+   if ((benchPacketsSent != before + 1) || strcmp(benchLastInterface, BENCH_EXTERNAL_IFACE)
+      || (ethernetHeader->ether_type != htons(SR_MIRROR_ETHERTYPE))
+      || (header->direction != SR_MIRROR_IN) || header->truncated
+      || (ntohl(header->length) != sizeof(frame))
+      || memcmp(header + 1, frame, sizeof(frame)))
+   {
+      fprintf(stderr, "copy out of %s not as sent: ethertype 0x%04X, length %u\n",
+         benchLastInterface, ntohs(ethernetHeader->ether_type), ntohl(header->length));
+      return false;
+   }
+   return true;
+}
+
+static bool runMirror(mirrorRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   sr_mirror_session_t *session;
+   mirrorCapture_t capture;
+   pthread_t captureId;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint64_t before;
+   double start, elapsed;
+   unsigned int i;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   BenchRefreshNeighbours(&sr);
+
+   memset(&capture, 0, sizeof(capture));
+   if (run->session)
+   {
+      writeConfig(run->session);
+      sr.mirror = sr_mirror_create(&sr, configPath);
+      if (sr.mirror == NULL)
+      {
+         return false;
+      }
+      capture.ring = sr.mirror->config->sessions[0].ring;
+      capture.direction = sr.mirror->config->sessions[0].directions;
+      if (capture.ring)
+      {
+         pthread_create(&captureId, NULL, captureThread, &capture);
+      }
+   }
+
+   before = benchPacketsSent;
+   start = BenchNow();
+   for (i = 0; i < packets; i++)
+   {
+      buildFrame(&sr, frame, i);
+      sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+   elapsed = BenchNow() - start;
+   run->nsPerPacket = elapsed * 1e9 / packets;
+   run->sent = benchPacketsSent - before;
+
+   if (sr.mirror)
+   {
+      session = &sr.mirror->config->sessions[0];
+      run->mirrored = session->mirrored;
+      run->mirroredBytes = session->mirroredBytes;
+      run->capped = session->capped;
+      run->ringFull = session->ringFull;
+      if (capture.ring)
+      {
+         __atomic_store_n(&capture.stop, true, __ATOMIC_RELEASE);
+         pthread_join(captureId, NULL);
+         run->read = capture.read;
+         if ((run->mirrored != run->read) || (capture.corrupt != 0))
+         {
+            fprintf(stderr, "%s: %" PRIu64 " mirrored, %" PRIu64 " read, %" PRIu64
+               " ring full, %" PRIu64 " corrupt\n", run->name, run->mirrored, run->read,
+               run->ringFull, capture.corrupt);
+            correct = false;
+         }
+      }
+      else if (run->mirrored)
+      {
+         correct = checkEncapsulation(&sr);
+      }
+
+      if (session->bitsPerS == CAP_BITS_PER_S)
+      {
+         uint64_t limit = CAP_BITS_PER_S / 8 + (uint64_t) (CAP_BITS_PER_S / 8 * elapsed)
+            + BENCH_TCP_FRAME_LEN;
+
+         if ((run->mirroredBytes > limit) || (run->capped == 0))
+         {
+            fprintf(stderr, "%s: %" PRIu64 " bytes mirrored over %.3f s, at most %" PRIu64
+               " allowed, %" PRIu64 " capped\n", run->name, run->mirroredBytes, elapsed, limit,
+               run->capped);
+            correct = false;
+         }
+      }
+   }
+   if (run->matchesAll && (run->mirrored + run->ringFull + run->capped != packets))
+   {
+      fprintf(stderr, "%s: %" PRIu64 " mirrored, %" PRIu64 " ring full and %" PRIu64
+         " capped of %u\n", run->name, run->mirrored, run->ringFull, run->capped, packets);
+      correct = false;
+   }
+   if (run->sent != packets + (capture.ring ? 0 : run->mirrored))
+   {
+      fprintf(stderr, "%s: %" PRIu64 " frames sent for %u packets and %" PRIu64 " copies\n",
+         run->name, run->sent, packets, capture.ring ? 0 : run->mirrored);
+      correct = false;
+   }
+
+   sr_mirror_destroy(sr.mirror);
+   sr.mirror = NULL;
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+/** Sessions change on SIGHUP; a bad file leaves them alone. */
+static bool checkReload(void)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   writeConfig("eth1 in any eth2 1m");
+   sr.mirror = sr_mirror_create(&sr, configPath);
+   if (sr.mirror == NULL)
+   {
+      return false;
+   }
+
+   writeConfig("eth2 both 10.0.1.0/24:udp:53 eth1 10m\neth1 out any eth2 1g");
+   srReloadRequests++;
+   sr_mirror_tick(&sr);
+   if ((sr.mirror->config->count != 2) || (sr.mirror->config->directions != SR_MIRROR_BOTH)
+      || (sr.mirror->config->sessions[0].match.port != htons(53)))
+   {
+      fprintf(stderr, "reload: %u sessions\n", sr.mirror->config->count);
+      correct = false;
+   }
+
+   writeConfig("eth2 sideways any eth1 10m");
+   srReloadRequests++;
+   sr_mirror_tick(&sr);
+   if (sr.mirror->config->count != 2)
+   {
+      fprintf(stderr, "bad reload replaced the sessions\n");
+      correct = false;
+   }
+
+   sr_mirror_destroy(sr.mirror);
+   sr.mirror = NULL;
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   char sessions[5][128];
+   mirrorRun_t runs[] =
+   {
+      { "off", NULL, false },
+      { "no match", sessions[0], false },
+      { "to ring", sessions[1], true },
+      { "to interface", sessions[2], true },
+      { "capped", sessions[3], true }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+   snprintf(ringPath, sizeof(ringPath), "/tmp/mirror_bench.%d.ring", (int) getpid());
+   snprintf(configPath, sizeof(configPath), "/tmp/mirror_bench.%d.conf", (int) getpid());
+   snprintf(sessions[0], sizeof(sessions[0]), "eth1 in 192.0.2.0/24 ring:%s 10g", ringPath);
+   snprintf(sessions[1], sizeof(sessions[1]), "eth1 in any ring:%s 10g", ringPath);
+   snprintf(sessions[2], sizeof(sessions[2]), "eth1 in any eth2 10g");
+   snprintf(sessions[3], sizeof(sessions[3]), "eth2 out 107.23.115.131:tcp:%u ring:%s %u",
+      SERVER_PORT, ringPath, CAP_BITS_PER_S);
+
+   printf("%u packets from %u hosts forwarded\n", packets, HOSTS);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runMirror(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-13s %7.1f ns/packet (%+.1f)  %7" PRIu64 " frames mirrored, %" PRIu64
+         " read, %" PRIu64 " ring full, %" PRIu64 " capped\n", runs[i].name,
+         runs[i].nsPerPacket, runs[i].nsPerPacket - runs[0].nsPerPacket, runs[i].mirrored,
+         runs[i].read, runs[i].ringFull, runs[i].capped);
+   }
+   if (!checkReload())
+   {
+      status = 1;
+   }
+
+   unlink(ringPath);
+   unlink(configPath);
+   return status;
+}
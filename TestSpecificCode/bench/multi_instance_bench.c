@@ -0,0 +1,224 @@
+/**
+ * @file multi_instance_bench.c
+ * @brief Measures the cost of hosting many NAT routers in one process.
+ *
+ * For each instance count N, builds N isolated routers and reports:
+ *    - memory per instance (resident and virtual, from /proc/self/statm),
+ *    - threads in the process,
+ *    - forwarding throughput with traffic spread round-robin over all
+ *      instances (a fixed number of packets regardless of N),
+ *    - for shared timers, how long one tick of every instance takes.
+ * Each N is run twice, with per-instance ARP/NAT threads ("dedicated") and
+ * with one sr_multi timer thread ("shared"), each in a fresh child process.
+ * Every instance must end up with exactly its own flows in its NAT table.
+ *
+ * Usage: multi_instance_bench [N ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench_topology.h"
+#include "sr_multi.h"
+
+#define FLOWS_PER_INSTANCE    (32)
+#define TOTAL_PACKETS         (256 * 1024)
+#define SERVER_PORT           (80)
+#define MAX_COUNTS            (16)
+
+static const unsigned int defaultCounts[] = { 1, 16, 64, 256 };
+
+static void readMemory(double *residentKb, double *virtualKb)
+{
+   unsigned long size = 0, resident = 0;
+   long pageKb = sysconf(_SC_PAGESIZE) / 1024;
+   FILE *statm = fopen("/proc/self/statm", "r");
+
+   if (statm)
+   {
+      if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+      {
+         size = resident = 0;
+      }
+      fclose(statm);
+   }
+   *virtualKb = (double) size * pageKb;
+   *residentKb = (double) resident * pageKb;
+}
+
+static unsigned int readThreads(void)
+{
+   char line[128];
+   unsigned int threads = 0;
+   FILE *status = fopen("/proc/self/status", "r");
+
+   if (status)
+   {
+      while (fgets(line, sizeof(line), status))
+      {
+         if (sscanf(line, "Threads: %u", &threads) == 1)
+         {
+            break;
+         }
+      }
+      fclose(status);
+   }
+   return threads;
+}
+
+static unsigned int countMappings(struct sr_instance *sr)
+{
+   sr_nat_mapping_t *mapping;
+   unsigned int mappings = 0;
+
+   pthread_mutex_lock(&(sr->nat->lock));
+   for (mapping = sr->nat->mappings; mapping; mapping = mapping->next)
+   {
+      mappings++;
+   }
+   pthread_mutex_unlock(&(sr->nat->lock));
+   return mappings;
+}
+
+/** One measurement, in a child process so thread and memory counts start clean. */
+static int runInstances(unsigned int count, bool shared)
+{
+   struct sr_instance *routers;
+   sr_multi_t multi;
+   uint8_t frames[FLOWS_PER_INSTANCE][BENCH_TCP_FRAME_LEN];
+   uint8_t working[BENCH_TCP_FRAME_LEN];
+   double residentBefore, virtualBefore, residentAfter, virtualAfter;
+   double start, pps, tickMs = 0.0;
+   unsigned int i, flow, rounds, round;
+   int status = 0;
+
+   readMemory(&residentBefore, &virtualBefore);
+
+   if (shared && (sr_multi_init(&multi, true) != 0))
+   {
+      return 1;
+   }
+
+   routers = calloc(count, sizeof(struct sr_instance));
+   if (routers == NULL)
+   {
+      return 1;
+   }
+   for (i = 0; i < count; i++)
+   {
+      BenchSetupRouter(&routers[i], true, shared ? &multi : NULL);
+   }
+
+   readMemory(&residentAfter, &virtualAfter);
+
+   /* Every instance has the same addresses, so the frames can be shared. */
+   for (flow = 0; flow < FLOWS_PER_INSTANCE; flow++)
+   {
+      BenchBuildTcpFrame(&routers[0], frames[flow], BENCH_INTERNAL_IFACE,
+         BENCH_INTERNAL_HOST_BASE + (flow % 64), 1024 + flow, BENCH_SERVER_IP, SERVER_PORT,
+         TCP_SYN_M);
+   }
+   for (i = 0; i < count; i++)
+   {
+      for (flow = 0; flow < FLOWS_PER_INSTANCE; flow++)
+      {
+         memcpy(working, frames[flow], sizeof(working));
+         sr_handlepacket(&routers[i], working, sizeof(working), BENCH_INTERNAL_IFACE);
+      }
+   }
+
+   rounds = TOTAL_PACKETS / (count * FLOWS_PER_INSTANCE);
+   if (rounds == 0)
+   {
+      rounds = 1;
+   }
+   start = BenchNow();
+   for (round = 0; round < rounds; round++)
+   {
+      for (flow = 0; flow < FLOWS_PER_INSTANCE; flow++)
+      {
+         for (i = 0; i < count; i++)
+         {
+            memcpy(working, frames[flow], sizeof(working));
+            sr_handlepacket(&routers[i], working, sizeof(working), BENCH_INTERNAL_IFACE);
+         }
+      }
+   }
+   pps = ((double) rounds * count * FLOWS_PER_INSTANCE) / (BenchNow() - start);
+
+   if (shared)
+   {
+      start = BenchNow();
+      sr_multi_tick(&multi);
+      tickMs = (BenchNow() - start) * 1000.0;
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      if (countMappings(&routers[i]) != FLOWS_PER_INSTANCE)
+      {
+         fprintf(stderr, "instance %u has %u mappings, expected %u\n", i,
+            countMappings(&routers[i]), FLOWS_PER_INSTANCE);
+         status = 1;
+      }
+   }
+
+   printf("%6u %-10s %12.1f %12.1f %8u %12.0f %10.3f\n", count, shared ? "shared" : "dedicated",
+      (residentAfter - residentBefore) / count, (virtualAfter - virtualBefore) / count,
+      readThreads(), pps, tickMs);
+   fflush(stdout);
+
+   /* Dedicated threads cannot be stopped; the process exit cleans up. */
+   return status;
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int counts[MAX_COUNTS];
+   unsigned int numCounts = 0;
+   unsigned int i;
+   int mode;
+   int result = 0;
+
+   for (i = 1; (i < (unsigned int) argc) && (numCounts < MAX_COUNTS); i++)
+   {
+      counts[numCounts++] = atoi(argv[i]);
+   }
+   if (numCounts == 0)
+   {
+      numCounts = sizeof(defaultCounts) / sizeof(defaultCounts[0]);
+      memcpy(counts, defaultCounts, sizeof(defaultCounts));
+   }
+
+   printf("flows/instance=%u packets/run=%u\n", FLOWS_PER_INSTANCE, TOTAL_PACKETS);
+   printf("%6s %-10s %12s %12s %8s %12s %10s\n", "N", "timers", "RSS KB/inst", "VSZ KB/inst",
+      "threads", "pps", "tick ms");
+   fflush(stdout);
+
+   for (i = 0; i < numCounts; i++)
+   {
+      if (counts[i] == 0)
+      {
+         continue;
+      }
+      for (mode = 0; mode < 2; mode++)
+      {
+         int status;
+         pid_t child = fork();
+         if (child == 0)
+         {
+            _exit(runInstances(counts[i], mode == 1));
+         }
+         waitpid(child, &status, 0);
+         if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+         {
+            result = 1;
+         }
+      }
+   }
+
+   return result;
+}
@@ -0,0 +1,184 @@
+/**
+ * @file nat_sync_bench.c
+ * @brief Measures what NAT state replication costs the packet path.
+ *
+ * Pushes the same traffic through the router twice, first with replication
+ * off, then with a standby process attached:
+ *    - "setup": one outbound SYN per flow (a mapping and a connection are
+ *      created, i.e. two replicated events per packet).
+ *    - "steady": data packets on the established flows (no events).
+ * When the active side stops, the standby must take over with every flow.
+ *
+ * Usage: nat_sync_bench [flows] [data packets per flow]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bench_topology.h"
+#include "sr_nat_sync.h"
+
+#define DEFAULT_FLOWS            (5000)
+#define DEFAULT_PACKETS_PER_FLOW (4)
+#define SERVER_PORT              (80)
+#define SOCKET_TEMPLATE          "/tmp/sr_nat_sync_bench.%d"
+
+typedef struct
+{
+   double setupPps;
+   double steadyPps;
+} benchResult_t;
+
+static unsigned int flows = DEFAULT_FLOWS;
+static unsigned int packetsPerFlow = DEFAULT_PACKETS_PER_FLOW;
+
+static void flowEndpoint(unsigned int flow, uint32_t *ip, uint16_t *port)
+{
+   *ip = BENCH_INTERNAL_HOST_BASE + (flow % 64);
+   *port = 1024 + (flow / 64);
+}
+
+static benchResult_t runTraffic(struct sr_instance *sr)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint8_t working[BENCH_TCP_FRAME_LEN];
+   benchResult_t result;
+   unsigned int flow, packet;
+   double start;
+
+   start = BenchNow();
+   for (flow = 0; flow < flows; flow++)
+   {
+      uint32_t ip;
+      uint16_t port;
+      flowEndpoint(flow, &ip, &port);
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, ip, port, BENCH_SERVER_IP, SERVER_PORT,
+         TCP_SYN_M);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+   result.setupPps = flows / (BenchNow() - start);
+
+   start = BenchNow();
+   for (packet = 0; packet < packetsPerFlow; packet++)
+   {
+      for (flow = 0; flow < flows; flow++)
+      {
+         uint32_t ip;
+         uint16_t port;
+         flowEndpoint(flow, &ip, &port);
+         BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, ip, port, BENCH_SERVER_IP, SERVER_PORT,
+            TCP_ACK_M);
+         /* The router rewrites in place; keep building from a clean copy. */
+         memcpy(working, frame, sizeof(frame));
+         sr_handlepacket(sr, working, sizeof(working), BENCH_INTERNAL_IFACE);
+      }
+   }
+   result.steadyPps = ((double) flows * packetsPerFlow) / (BenchNow() - start);
+
+   return result;
+}
+
+/** Standby side: mirror until the active goes away, then report what we'd take over with. */
+static void runStandby(const char *socketPath)
+{
+   sr_nat_t nat;
+   sr_nat_mapping_t *mapping;
+   unsigned int mappings = 0, connections = 0;
+
+   sr_nat_init(&nat);
+   nat.timeoutsSuspended = true;
+   if (sr_nat_sync_run_standby(&nat, socketPath) != 0)
+   {
+      _exit(2);
+   }
+
+   pthread_mutex_lock(&(nat.lock));
+   for (mapping = nat.mappings; mapping; mapping = mapping->next)
+   {
+      sr_nat_connection_t *connection;
+      mappings++;
+      for (connection = mapping->conns; connection; connection = connection->next)
+      {
+         connections++;
+      }
+   }
+   pthread_mutex_unlock(&(nat.lock));
+
+   printf("standby took over with %u mappings, %u connections (expected %u/%u)\n",
+      mappings, connections, flows, flows);
+   fflush(stdout);
+   _exit(((mappings == flows) && (connections == flows)) ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+   struct sr_instance plain, replicated;
+   benchResult_t withoutSync, withSync;
+   char socketPath[64];
+   sr_nat_sync_t *sync;
+   uint64_t events, batches, bytes;
+   pid_t standby;
+   int status;
+
+   if (argc > 1) { flows = atoi(argv[1]); }
+   if (argc > 2) { packetsPerFlow = atoi(argv[2]); }
+   if ((flows == 0) || (flows > 64 * 60000) || (flows > LAST_PORT_NUMBER - STARTING_PORT_NUMBER))
+   {
+      fprintf(stderr, "flows must be between 1 and %d\n", LAST_PORT_NUMBER - STARTING_PORT_NUMBER);
+      return 1;
+   }
+
+   snprintf(socketPath, sizeof(socketPath), SOCKET_TEMPLATE, (int) getpid());
+
+   /* Fork before any router threads exist. */
+   standby = fork();
+   if (standby == 0)
+   {
+      runStandby(socketPath);
+   }
+
+   BenchSetupRouter(&plain, true, NULL);
+   withoutSync = runTraffic(&plain);
+
+   BenchSetupRouter(&replicated, true, NULL);
+   sync = sr_nat_sync_start_active(replicated.nat, socketPath);
+   if (sync == NULL)
+   {
+      return 1;
+   }
+   replicated.nat->sync = sync;
+   while (sync->peerFd < 0)
+   {
+      usleep(10000);
+   }
+   usleep(100000); /* let the (empty) initial resync go out */
+   withSync = runTraffic(&replicated);
+
+   /* Give the sender a moment to drain, then "fail". */
+   usleep(2 * SR_NAT_SYNC_BATCH_INTERVAL_MS * 1000);
+   pthread_mutex_lock(&(replicated.nat->lock));
+   replicated.nat->sync = NULL;
+   pthread_mutex_unlock(&(replicated.nat->lock));
+   events = sync->eventsSent;
+   batches = sync->batchesSent;
+   bytes = sync->bytesSent;
+   sr_nat_sync_stop(sync);
+   unlink(socketPath);
+
+   printf("flows=%u packets/flow=%u\n", flows, packetsPerFlow);
+   printf("%-12s %14s %14s\n", "", "setup pps", "steady pps");
+   printf("%-12s %14.0f %14.0f\n", "no sync", withoutSync.setupPps, withoutSync.steadyPps);
+   printf("%-12s %14.0f %14.0f\n", "sync", withSync.setupPps, withSync.steadyPps);
+   printf("%-12s %13.1f%% %13.1f%%\n", "overhead",
+      100.0 * (withoutSync.setupPps - withSync.setupPps) / withoutSync.setupPps,
+      100.0 * (withoutSync.steadyPps - withSync.steadyPps) / withoutSync.steadyPps);
+   printf("replicated %" PRIu64 " events in %" PRIu64 " batches, %" PRIu64 " bytes (%.2f bytes/event)\n",
+      events, batches, bytes, events ? (double) bytes / events : 0.0);
+   fflush(stdout);
+
+   waitpid(standby, &status, 0);
+   return (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : 1;
+}
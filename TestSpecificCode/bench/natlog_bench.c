@@ -0,0 +1,265 @@
+/**
+ * @file natlog_bench.c
+ * @brief Measures what the NAT mapping log (sr_natlog.c) costs the packet
+ *        path and checks that every mapping ends up in the files.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Each round, internal hosts open a new TCP connection from each of
+ * a range of ports (one new mapping per SYN), then the clock is advanced
+ * past the transitory timeout so the tick deletes them all again. The
+ * SYNs and the ticks are timed:
+ *    - "off": no log;
+ *    - "mappings": every create and delete logged, with small files so the
+ *      log rotates;
+ *    - "blocks": ports handed out in blocks, only blocks logged.
+ * The files written are then decoded: every event must be there (nothing
+ * lost to a full ring) and the first record must match the first SYN.
+ *
+ * Usage: natlog_bench [rounds] [mappings per round]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_codec.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_natlog.h"
+#include "sr_protocol.h"
+
+#define DEFAULT_ROUNDS     (100)
+#define DEFAULT_MAPPINGS   (1000)
+#define HOSTS              (50)
+#define SERVER_PORT        (80)
+#define ROTATE_BYTES       (256 * 1024)
+#define BLOCK_SIZE         (64)
+
+typedef struct
+{
+   const char *name;
+   bool logged;
+   unsigned int blockSize;
+   double createNs; /**< Per new mapping. */
+   double deleteNs; /**< Per mapping timed out. */
+   uint64_t records;
+   uint64_t bytes;
+   unsigned int files;
+} natLogRun_t;
+
+static unsigned int rounds = DEFAULT_ROUNDS;
+static unsigned int mappingsPerRound = DEFAULT_MAPPINGS;
+static char logDirectory[] = "/tmp/natlog_benchXXXXXX";
+
+/** Decodes every file of a series. @return false if any failed to decode. */
+static bool decodeSeries(const char *path, natLogRun_t *run, FILE *text)
+{
+   char name[SR_NATLOG_MAX_PATH + 16];
+   uint64_t records;
+   unsigned int number;
+   FILE *in;
+
+   run->records = 0;
+   run->bytes = 0;
+   for (number = 1; ; number++)
+   {
+      snprintf(name, sizeof(name), "%s.%06u", path, number);
+      in = fopen(name, "rb");
+      if (in == NULL)
+      {
+         break;
+      }
+      if (sr_codec_natlog_decode(in, text, &records) != 0)
+      {
+         fprintf(stderr, "%s didn't decode\n", name);
+         fclose(in);
+         return false;
+      }
+      fseek(in, 0, SEEK_END);
+      run->bytes += ftell(in);
+      run->records += records;
+      fclose(in);
+      unlink(name);
+   }
+   run->files = number - 1;
+   return true;
+}
+
+/** Checks the decoded text: counts per event, and the first record. */
+static bool checkText(FILE *text, natLogRun_t *run)
+{
+   char line[256], event[32], type[8], internal[64], external[64];
+   char expected[64];
+   uint64_t counts[2] = { 0, 0 };
+   bool first = true, correct = true;
+
+   snprintf(expected, sizeof(expected), "%u.%u.%u.%u%s", BENCH_INTERNAL_HOST_BASE >> 24,
+      (BENCH_INTERNAL_HOST_BASE >> 16) & 0xFF, (BENCH_INTERNAL_HOST_BASE >> 8) & 0xFF,
+      BENCH_INTERNAL_HOST_BASE & 0xFF, run->blockSize ? "" : ":1024");
+
+   rewind(text);
+   while (fgets(line, sizeof(line), text))
+   {
+      if (sscanf(line, "%*s %31s %7s %63s -> %63s", event, type, internal, external) != 4)
+      {
+         fprintf(stderr, "unexpected line: %s", line);
+         return false;
+      }
+      if (first && ((strcmp(event, run->blockSize ? "block-allocate" : "create") != 0)
+         || (strcmp(type, "tcp") != 0) || (strcmp(internal, expected) != 0)
+         || (strncmp(external, "172.64.3.1:5000", 15) != 0)))
+      {
+         fprintf(stderr, "first record: %s", line);
+         correct = false;
+      }
+      first = false;
+      counts[(strcmp(event, "create") == 0) || (strcmp(event, "block-allocate") == 0) ? 0 : 1]++;
+   }
+
+   if (run->blockSize == 0)
+   {
+      correct = correct && (counts[0] == (uint64_t) rounds * mappingsPerRound)
+         && (counts[1] == counts[0]);
+   }
+   else
+   {
+      /* Each host needs its ports for a round spread over whole blocks. */
+      uint64_t perRound = HOSTS * ((mappingsPerRound / HOSTS + BLOCK_SIZE - 1) / BLOCK_SIZE);
+      correct = correct && (counts[0] == rounds * perRound) && (counts[1] == counts[0]);
+   }
+   if (!correct)
+   {
+      fprintf(stderr, "%s: %" PRIu64 " opened and %" PRIu64 " closed in the log\n", run->name,
+         counts[0], counts[1]);
+   }
+   return correct;
+}
+
+static bool runMappings(natLogRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   char path[SR_NATLOG_MAX_PATH];
+   double createS = 0, deleteS = 0, start;
+   uint64_t lost = 0, before;
+   unsigned int round, i;
+   FILE *text;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   snprintf(path, sizeof(path), "%s/%s", logDirectory, run->name);
+   if (run->logged && (sr_nat_log_start(sr.nat, path, ROTATE_BYTES, run->blockSize) != 0))
+   {
+      return false;
+   }
+
+   for (round = 0; round < rounds; round++)
+   {
+      BenchRefreshNeighbours(&sr);
+      before = benchPacketsSent;
+      start = BenchNow();
+      for (i = 0; i < mappingsPerRound; i++)
+      {
+         BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + i % HOSTS,
+            1024 + i / HOSTS, BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+         sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+      }
+      createS += BenchNow() - start;
+      if (benchPacketsSent - before != mappingsPerRound)
+      {
+         fprintf(stderr, "%s: %" PRIu64 " of %u SYNs forwarded\n", run->name,
+            benchPacketsSent - before, mappingsPerRound);
+         correct = false;
+      }
+
+      start = BenchNow();
+      sr_multi_advance(&multi, sr.nat->tcpTransitoryTimeout + 1);
+      deleteS += BenchNow() - start;
+      if (sr.nat->mappings)
+      {
+         fprintf(stderr, "%s: mappings left after the timeout\n", run->name);
+         correct = false;
+      }
+   }
+   run->createNs = createS * 1e9 / ((double) rounds * mappingsPerRound);
+   run->deleteNs = deleteS * 1e9 / ((double) rounds * mappingsPerRound);
+
+   if (run->logged)
+   {
+      lost = sr.nat->log->lost;
+      sr_nat_log_stop(sr.nat);
+      text = tmpfile();
+      if ((text == NULL) || !decodeSeries(path, run, text) || !checkText(text, run))
+      {
+         correct = false;
+      }
+      if (text)
+      {
+         fclose(text);
+      }
+      if (lost)
+      {
+         fprintf(stderr, "%s: %" PRIu64 " records lost\n", run->name, lost);
+         correct = false;
+      }
+   }
+
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   natLogRun_t runs[] =
+   {
+      { "off", false, 0 },
+      { "mappings", true, 0 },
+      { "blocks", true, BLOCK_SIZE }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      rounds = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      mappingsPerRound = atoi(argv[2]);
+   }
+   if (mkdtemp(logDirectory) == NULL)
+   {
+      perror(logDirectory);
+      return 1;
+   }
+
+   printf("%u rounds of %u new TCP mappings from %u hosts, timed out after each round\n",
+      rounds, mappingsPerRound, HOSTS);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runMappings(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-9s %7.1f ns/create %7.1f ns/delete", runs[i].name, runs[i].createNs,
+         runs[i].deleteNs);
+      if (runs[i].logged)
+      {
+         printf("  %8" PRIu64 " records, %8" PRIu64 " bytes in %u files (%.1f bytes/record)",
+            runs[i].records, runs[i].bytes, runs[i].files,
+            runs[i].records ? (double) runs[i].bytes / runs[i].records : 0.0);
+      }
+      printf("\n");
+   }
+   printf("logging every mapping: %+.1f ns/create, %+.1f ns/delete\n",
+      runs[1].createNs - runs[0].createNs, runs[1].deleteNs - runs[0].deleteNs);
+
+   rmdir(logDirectory);
+   return status;
+}
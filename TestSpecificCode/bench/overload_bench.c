@@ -0,0 +1,178 @@
+/**
+ * @file overload_bench.c
+ * @brief Checks that the control plane survives a transit flood.
+ *
+ * The real VNS client reads from one end of a socket pair. A writer thread
+ * floods the other end with transit TCP SYNs from the internal hosts to
+ * BENCH_SERVER_IP as fast as the socket takes them, mixing in an echo
+ * request to the router every 64 frames and an ARP request for it every 256;
+ * a reader thread takes what the router sends back and times the answers.
+ * Scenarios:
+ *    - "off": no shedding; only measures the backlog the flood builds up.
+ *    - "on": high watermark at a quarter of that peak backlog, low at an
+ *      eighth (the kernel counts small messages at several times their size,
+ *      so the useful watermarks for a socket pair are far below TCP's).
+ * Reports frames offered, transit forwarded and shed, and how many pings and
+ * ARP requests were answered and how quickly.
+ *
+ * Usage: overload_bench [seconds]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench_vns.h"
+#include "sr_multi.h"
+#include "sr_router.h"
+
+#define DEFAULT_SECONDS    (1.0)
+#define PING_EVERY         (64)
+#define ARP_EVERY          (256)
+#define SOCKET_BUFFER      (1024 * 1024)
+
+typedef struct
+{
+   bench_vns_peer_t *peer;
+   struct sr_instance *sr;
+   double seconds;
+} overloadRun_t;
+
+typedef struct
+{
+   uint32_t highWatermark;
+   uint32_t lowWatermark;
+   uint64_t offered;
+   uint64_t forwarded;
+   sr_admission_t admission;
+   bench_probe_stats_t ping;
+   bench_probe_stats_t arp;
+} overloadResult_t;
+
+static void *writerThread(void *arg)
+{
+   overloadRun_t *run = arg;
+   bench_vns_peer_t *peer = run->peer;
+   double end = BenchNow() + run->seconds;
+
+   while (BenchNow() < end)
+   {
+      unsigned int i;
+
+      /* Check the clock once per 64 frames. */
+      for (i = 0; i < PING_EVERY; i++)
+      {
+         uint64_t n = peer->offered;
+         bool written;
+
+         if (n % ARP_EVERY == 0)
+         {
+            written = BenchVnsSendArpRequest(peer, run->sr);
+         }
+         else if (n % PING_EVERY == 0)
+         {
+            written = BenchVnsSendPing(peer, run->sr);
+         }
+         else
+         {
+            written = BenchVnsSendTransit(peer, run->sr, n);
+         }
+
+         if (!written)
+         {
+            return NULL;
+         }
+      }
+   }
+
+   BenchVnsFinish(peer);
+   return NULL;
+}
+
+static void runFlood(double seconds, uint32_t highWatermark, uint32_t lowWatermark,
+   overloadResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   overloadRun_t run;
+   pthread_t writer;
+
+   /* No timer thread: the neighbours stay cached for the whole run. */
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   sr_admission_init(&sr.admission, highWatermark, lowWatermark);
+
+   run.peer = BenchVnsAttach(&sr, SOCKET_BUFFER);
+   run.sr = &sr;
+   run.seconds = seconds;
+   pthread_create(&writer, NULL, writerThread, &run);
+
+   while (sr_read_from_server(&sr) == 1)
+   {
+   }
+
+   pthread_join(writer, NULL);
+   BenchVnsStop(run.peer);
+
+   result->highWatermark = highWatermark;
+   result->lowWatermark = sr.admission.lowWatermark;
+   result->offered = run.peer->offered;
+   result->forwarded = run.peer->forwarded;
+   result->admission = sr.admission;
+   result->ping = run.peer->ping;
+   result->arp = run.peer->arp;
+
+   BenchVnsDetach(run.peer);
+   sr_multi_destroy(&multi);
+}
+
+static void printResult(const char *scenario, const overloadResult_t *result)
+{
+   printf("%-4s %9" PRIu32 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %5" PRIu64
+      "/%-5" PRIu64 " %8.2f %8.2f %4" PRIu64 "/%-4" PRIu64 " %8.2f\n", scenario,
+      result->admission.peakBacklog, result->offered, result->forwarded,
+      result->admission.droppedTransit, result->admission.overloadEpisodes, result->ping.answered,
+      result->ping.sent, result->ping.answered ? result->ping.sumMs / result->ping.answered : 0.0,
+      result->ping.maxMs, result->arp.answered, result->arp.sent,
+      result->arp.answered ? result->arp.sumMs / result->arp.answered : 0.0);
+   fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+   double seconds = DEFAULT_SECONDS;
+   overloadResult_t off, on;
+   uint32_t high;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      seconds = atof(argv[1]);
+   }
+
+   /* An unreachable watermark measures the backlog without shedding. */
+   runFlood(seconds, UINT32_MAX, UINT32_MAX, &off);
+   high = off.admission.peakBacklog / 4;
+   runFlood(seconds, high, high / 2, &on);
+
+   printf("seconds=%.1f ping every %u frames, ARP every %u, watermarks %" PRIu32 "/%" PRIu32
+      " bytes\n", seconds, PING_EVERY, ARP_EVERY, on.highWatermark, on.lowWatermark);
+   printf("%-4s %9s %9s %9s %9s %9s %11s %8s %8s %9s %8s\n", "shed", "peak B", "offered",
+      "forwarded", "shed", "episodes", "pings", "mean ms", "max ms", "arp", "mean ms");
+   printResult("off", &off);
+   printResult("on", &on);
+
+   if ((off.ping.answered != off.ping.sent) || (on.ping.answered != on.ping.sent)
+      || (off.arp.answered != off.arp.sent) || (on.arp.answered != on.arp.sent))
+   {
+      fprintf(stderr, "control traffic went unanswered\n");
+      status = 1;
+   }
+   if ((off.admission.droppedTransit != 0) || (on.admission.droppedTransit == 0))
+   {
+      fprintf(stderr, "expected shedding only with watermarks set\n");
+      status = 1;
+   }
+
+   return status;
+}
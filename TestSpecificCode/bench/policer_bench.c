@@ -0,0 +1,280 @@
+/**
+ * @file policer_bench.c
+ * @brief Checks the per host limits of the NAT and measures what policing
+ *        costs per packet.
+ *
+ * Internal hosts open TCP connections through the NAT:
+ *    - "overhead": repeats one SYN through an unpoliced NAT and then through
+ *      one whose limits are never reached, and reports the time per packet.
+ *    - "packet rate": one host floods while a second sends one segment a
+ *      millisecond, for a few seconds of virtual time. The flooder must get
+ *      a second's burst plus the rate through; the other host must lose
+ *      nothing.
+ *    - "bit rate": the same flood against a bit rate instead.
+ *    - "mapping cap": a host opens connections from many ports. Only the cap
+ *      may be mapped, the rest are refused, and once the mappings time out
+ *      the host may map again.
+ *    - "mapping rate": a host opens a connection from a new port every
+ *      100 us, well over the rate. It must get a second's burst plus the
+ *      rate of them.
+ *
+ * The policer reads the virtual clock, so the rates are checked against
+ * virtual seconds and come out the same on any machine.
+ *
+ * Usage: policer_bench [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_policer.h"
+#include "sr_protocol.h"
+
+#define DEFAULT_PACKETS      (1000000)
+#define SERVER_PORT          (80)
+#define FLOOD_S              (3) /* Virtual seconds. */
+#define FLOOD_PACKETS_PER_S  (100000)
+#define POLITE_PACKETS_PER_S (1000)
+#define PACKET_RATE          (2000)
+#define BIT_RATE             (6400000) /* 20000 of our 40 byte datagrams a second */
+#define MAPPING_CAP          (50)
+#define MAPPING_RATE         (100)
+#define MAPPING_ATTEMPTS_PER_S (10000)
+#define RATE_TOLERANCE       (0.1)
+
+static uint8_t flooderFrame[BENCH_TCP_FRAME_LEN];
+static uint8_t politeFrame[BENCH_TCP_FRAME_LEN];
+
+static void forward(struct sr_instance *sr, const uint8_t *templateFrame)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+
+   memcpy(frame, templateFrame, sizeof(frame));
+   sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+}
+
+static double forwardMany(struct sr_instance *sr, unsigned int packets)
+{
+   double start = BenchNow();
+   unsigned int i;
+
+   for (i = 0; i < packets; i++)
+   {
+      forward(sr, flooderFrame);
+   }
+   return (BenchNow() - start) * 1e9 / packets;
+}
+
+static void setLimits(struct sr_instance *sr, uint64_t packetsPerS, uint64_t bitsPerS,
+   unsigned int mappings, uint64_t mappingsPerS)
+{
+   sr_policer_limits_t limits = { packetsPerS, bitsPerS, mappings, mappingsPerS };
+
+   sr_policer_destroy(sr->nat->policer);
+   sr->nat->policer = sr_policer_create(&limits);
+}
+
+static unsigned int countMappings(struct sr_instance *sr, uint32_t host)
+{
+   sr_nat_mapping_t *mapping;
+   unsigned int count = 0;
+
+   for (mapping = sr->nat->mappings; mapping; mapping = mapping->next)
+   {
+      if (mapping->ip_int == htonl(host))
+      {
+         count++;
+      }
+   }
+   return count;
+}
+
+static bool withinRate(const char *name, uint64_t passed, double rate, double seconds)
+{
+   /* A full bucket to start with, then the rate. */
+   double expected = rate * (1.0 + seconds);
+   bool correct = (passed >= expected * (1.0 - RATE_TOLERANCE))
+      && (passed <= expected * (1.0 + RATE_TOLERANCE));
+
+   printf("%s: %" PRIu64 " passed in %.2f s, expected about %.0f%s\n", name, passed, seconds,
+      expected, correct ? "" : " (WRONG)");
+   return correct;
+}
+
+/** Moves on to the next virtual second, keeping the neighbours resolved. */
+static void nextSecond(struct sr_instance *sr, sr_multi_t *multi)
+{
+   sr_multi_advance(multi, 1);
+   BenchRefreshNeighbours(sr);
+}
+
+/**
+ * Floods from one host for FLOOD_S virtual seconds, with a second host
+ * sending once a millisecond.
+ * @param seconds set to the virtual time between the first packet and the
+ *        last.
+ * @return false if the polite host lost anything.
+ */
+static bool flood(struct sr_instance *sr, sr_multi_t *multi, uint64_t *flooderPassed,
+   double *seconds)
+{
+   uint64_t politeSent = 0, politePassed = 0, before;
+   unsigned int second, i;
+
+   *flooderPassed = 0;
+   for (second = 0; second < FLOOD_S; second++)
+   {
+      if (second > 0)
+      {
+         nextSecond(sr, multi);
+      }
+      for (i = 0; i < FLOOD_PACKETS_PER_S; i++)
+      {
+         before = benchPacketsSent;
+         forward(sr, flooderFrame);
+         *flooderPassed += benchPacketsSent - before;
+
+         if (i % (FLOOD_PACKETS_PER_S / POLITE_PACKETS_PER_S) == 0)
+         {
+            before = benchPacketsSent;
+            forward(sr, politeFrame);
+            politePassed += benchPacketsSent - before;
+            politeSent++;
+         }
+      }
+   }
+   *seconds = FLOOD_S - 1;
+
+   if (politePassed != politeSent)
+   {
+      fprintf(stderr, "the polite host got %" PRIu64 " of %" PRIu64 " through\n", politePassed,
+         politeSent);
+      return false;
+   }
+   return true;
+}
+
+/** Sends SYNs from consecutive ports. @return how many were forwarded. */
+static uint64_t openConnections(struct sr_instance *sr, uint32_t host, uint16_t firstPort,
+   unsigned int count)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint64_t before = benchPacketsSent;
+   unsigned int i;
+
+   for (i = 0; i < count; i++)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, host, firstPort + i, BENCH_SERVER_IP,
+         SERVER_PORT, TCP_SYN_M);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+   return benchPacketsSent - before;
+}
+
+int main(int argc, char **argv)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   sr_policer_host_t host;
+   unsigned int packets = DEFAULT_PACKETS;
+   uint32_t capHost = BENCH_INTERNAL_HOST_BASE + 2;
+   uint32_t rateHost = BENCH_INTERNAL_HOST_BASE + 3;
+   double plainNs, policedNs, seconds;
+   uint64_t passed;
+   unsigned int second;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+
+   /* No timer thread: timeouts run only when the clock is advanced. */
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   BenchBuildTcpFrame(&sr, flooderFrame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE, 1024,
+      BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+   BenchBuildTcpFrame(&sr, politeFrame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + 1, 1024,
+      BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+
+   forwardMany(&sr, packets / 10);
+   plainNs = forwardMany(&sr, packets);
+   setLimits(&sr, 1000000000, 1000000000000ULL, 0, 0);
+   forwardMany(&sr, packets / 10);
+   policedNs = forwardMany(&sr, packets);
+   printf("overhead: %u packets, %.1f ns/packet unpoliced, %.1f ns/packet policed (+%.1f)\n",
+      packets, plainNs, policedNs, policedNs - plainNs);
+
+   setLimits(&sr, PACKET_RATE, 0, 0, 0);
+   if (!flood(&sr, &multi, &passed, &seconds) || !withinRate("packet rate", passed, PACKET_RATE, seconds))
+   {
+      status = 1;
+   }
+
+   setLimits(&sr, 0, BIT_RATE, 0, 0);
+   if (!flood(&sr, &multi, &passed, &seconds)
+      || !withinRate("bit rate", passed, BIT_RATE / (8.0 * (BENCH_TCP_FRAME_LEN
+         - sizeof(sr_ethernet_hdr_t))), seconds))
+   {
+      status = 1;
+   }
+
+   setLimits(&sr, 0, 0, MAPPING_CAP, 0);
+   passed = openConnections(&sr, capHost, 2000, MAPPING_CAP * 4);
+   sr_policer_host(sr.nat->policer, htonl(capHost), &host);
+   printf("mapping cap: %" PRIu64 " of %u connections opened, %u mappings, %" PRIu64 " refused\n",
+      passed, MAPPING_CAP * 4, countMappings(&sr, capHost),
+      host.violations[SR_POLICER_MAPPING_LIMIT]);
+   if ((passed != MAPPING_CAP) || (countMappings(&sr, capHost) != MAPPING_CAP)
+      || (host.mappings != MAPPING_CAP)
+      || (host.violations[SR_POLICER_MAPPING_LIMIT] != MAPPING_CAP * 3))
+   {
+      fprintf(stderr, "the mapping cap was not enforced\n");
+      status = 1;
+   }
+
+   /* Let the half open connections time out, then map again. */
+   sr_multi_advance(&multi, sr.nat->tcpTransitoryTimeout + 2);
+   BenchRefreshNeighbours(&sr);
+   if (!sr_policer_host(sr.nat->policer, htonl(capHost), &host))
+   {
+      /* Quiet for longer than SR_POLICER_IDLE_S with nothing mapped: forgotten. */
+      host.mappings = 0;
+   }
+   passed = openConnections(&sr, capHost, 3000, MAPPING_CAP);
+   printf("mapping cap: %u mappings after timing out, then %" PRIu64 " of %u opened\n",
+      host.mappings, passed, MAPPING_CAP);
+   if ((host.mappings != 0) || (passed != MAPPING_CAP))
+   {
+      fprintf(stderr, "timed out mappings were not given back\n");
+      status = 1;
+   }
+
+   setLimits(&sr, 0, 0, 0, MAPPING_RATE);
+   passed = 0;
+   for (second = 0; second < FLOOD_S; second++)
+   {
+      if (second > 0)
+      {
+         nextSecond(&sr, &multi);
+      }
+      passed += openConnections(&sr, rateHost, 10000 + second * MAPPING_ATTEMPTS_PER_S,
+         MAPPING_ATTEMPTS_PER_S);
+   }
+   if (!withinRate("mapping rate", passed, MAPPING_RATE, FLOOD_S - 1))
+   {
+      status = 1;
+   }
+
+   printf("policer counters: ");
+   sr_policer_print(&sr, stdout);
+
+   sr_multi_destroy(&multi);
+   return status;
+}
@@ -0,0 +1,241 @@
+/**
+ * @file reader_bench.c
+ * @brief Compares the classic VNS read path with the adaptive reader.
+ *
+ * The real VNS client reads from one end of a socket pair (bench_vns.c).
+ * Each scenario runs with three read paths:
+ *    - "classic": two blocking reads per message (no -P).
+ *    - "block": the adaptive reader without busy-polling (-P 0).
+ *    - "spin": the adaptive reader busy-polling for up to 50 us (-P 50).
+ * Scenarios:
+ *    - "paced": echo requests to the router, one every 200 us; measures
+ *      wake-up latency when the socket is mostly empty.
+ *    - "flood": transit TCP SYNs as fast as the socket takes them, with an
+ *      echo request every 64 frames; measures throughput.
+ * Reports messages handled per read, transit forwarded per second, ping
+ * round trip percentiles and where the reader spent its time.
+ *
+ * Usage: reader_bench [seconds] [paced pings]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench_vns.h"
+#include "sr_multi.h"
+#include "sr_router.h"
+#include "sr_vns_reader.h"
+
+#define DEFAULT_SECONDS       (1.0)
+#define DEFAULT_PACED_PINGS   (2000)
+#define PACED_INTERVAL_NS     (200 * 1000)
+#define PING_EVERY            (64)
+#define SPIN_BUDGET_US        (50)
+#define SOCKET_BUFFER         (1024 * 1024)
+
+typedef struct
+{
+   const char *name;
+   int spinBudgetUs; /**< -1 for the classic read path. */
+} readMode_t;
+
+typedef struct
+{
+   bench_vns_peer_t *peer;
+   struct sr_instance *sr;
+   bool flood;
+   double seconds;
+   unsigned int pings;
+} readerRun_t;
+
+typedef struct
+{
+   double seconds;
+   uint64_t forwarded;
+   bench_probe_stats_t ping;
+   double p50Ms;
+   double p99Ms;
+   sr_vns_reader_t reader; /**< Counters only; zero for the classic path. */
+} readerResult_t;
+
+static const readMode_t modes[] =
+{
+   { "classic", -1 },
+   { "block", 0 },
+   { "spin", SPIN_BUDGET_US }
+};
+
+static void *writerThread(void *arg)
+{
+   readerRun_t *run = arg;
+   bench_vns_peer_t *peer = run->peer;
+
+   if (run->flood)
+   {
+      double end = BenchNow() + run->seconds;
+
+      while (BenchNow() < end)
+      {
+         unsigned int i;
+
+         for (i = 0; i < PING_EVERY; i++)
+         {
+            uint64_t n = peer->offered;
+
+            if (!((n % PING_EVERY == 0) ? BenchVnsSendPing(peer, run->sr)
+               : BenchVnsSendTransit(peer, run->sr, n)))
+            {
+               return NULL;
+            }
+         }
+      }
+   }
+   else
+   {
+      struct timespec interval = { 0, PACED_INTERVAL_NS };
+      unsigned int i;
+
+      for (i = 0; i < run->pings; i++)
+      {
+         if (!BenchVnsSendPing(peer, run->sr))
+         {
+            return NULL;
+         }
+         nanosleep(&interval, NULL);
+      }
+   }
+
+   BenchVnsFinish(peer);
+   return NULL;
+}
+
+static void runReader(const readMode_t *mode, bool flood, double seconds, unsigned int pings,
+   readerResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   readerRun_t run;
+   pthread_t writer;
+   double started;
+
+   /* No timer thread: the neighbours stay cached for the whole run. */
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   sr_admission_init(&sr.admission, 0, 0);
+   if (mode->spinBudgetUs >= 0)
+   {
+      sr.reader = sr_vns_reader_create(mode->spinBudgetUs);
+   }
+
+   run.peer = BenchVnsAttach(&sr, SOCKET_BUFFER);
+   run.sr = &sr;
+   run.flood = flood;
+   run.seconds = seconds;
+   run.pings = pings;
+   started = BenchNow();
+   pthread_create(&writer, NULL, writerThread, &run);
+
+   while (sr_read_from_server(&sr) == 1)
+   {
+   }
+
+   result->seconds = BenchNow() - started;
+   pthread_join(writer, NULL);
+   BenchVnsStop(run.peer);
+
+   result->forwarded = run.peer->forwarded;
+   result->ping = run.peer->ping;
+   result->p50Ms = BenchVnsPercentileMs(run.peer, 0.50);
+   result->p99Ms = BenchVnsPercentileMs(run.peer, 0.99);
+   if (sr.reader)
+   {
+      result->reader = *sr.reader;
+      sr_vns_reader_destroy(sr.reader);
+      sr.reader = NULL;
+   }
+   else
+   {
+      memset(&result->reader, 0, sizeof(result->reader));
+   }
+
+   BenchVnsDetach(run.peer);
+   sr_multi_destroy(&multi);
+}
+
+static void printResult(const char *scenario, const readMode_t *mode,
+   const readerResult_t *result)
+{
+   const sr_vns_reader_t *reader = &result->reader;
+
+   /* The classic path always makes two reads per message. */
+   double perRead = reader->reads ? (double) reader->messages / reader->reads : 0.5;
+
+   printf("%-6s %-8s %9.2f %10.0f %5" PRIu64 "/%-5" PRIu64 " %8.3f %8.3f %8.3f %9.1f %9.1f %9.1f\n",
+      scenario, mode->name, perRead, result->forwarded / result->seconds, result->ping.answered,
+      result->ping.sent, result->p50Ms, result->p99Ms, result->ping.maxMs, reader->pollNs / 1e6,
+      reader->blockNs / 1e6, reader->processNs / 1e6);
+   fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+   double seconds = DEFAULT_SECONDS;
+   unsigned int pings = DEFAULT_PACED_PINGS;
+   readerResult_t paced[sizeof(modes) / sizeof(modes[0])];
+   readerResult_t flood[sizeof(modes) / sizeof(modes[0])];
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      seconds = atof(argv[1]);
+   }
+   if (argc > 2)
+   {
+      pings = atoi(argv[2]);
+   }
+   if (pings > BENCH_VNS_MAX_PROBES)
+   {
+      pings = BENCH_VNS_MAX_PROBES;
+   }
+
+   for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+   {
+      runReader(&modes[i], false, seconds, pings, &paced[i]);
+      runReader(&modes[i], true, seconds, pings, &flood[i]);
+   }
+
+   printf("seconds=%.1f paced pings=%u every %u us, flood ping every %u frames, spin %u us\n",
+      seconds, pings, PACED_INTERVAL_NS / 1000, PING_EVERY, SPIN_BUDGET_US);
+   printf("%-6s %-8s %9s %10s %11s %8s %8s %8s %9s %9s %9s\n", "load", "reads", "msg/read",
+      "fwd/s", "pings", "p50 ms", "p99 ms", "max ms", "poll ms", "block ms", "proc ms");
+   for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+   {
+      printResult("paced", &modes[i], &paced[i]);
+   }
+   for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+   {
+      printResult("flood", &modes[i], &flood[i]);
+   }
+
+   for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+   {
+      if ((paced[i].ping.answered != paced[i].ping.sent)
+         || (flood[i].ping.answered != flood[i].ping.sent))
+      {
+         fprintf(stderr, "%s: pings went unanswered\n", modes[i].name);
+         status = 1;
+      }
+      if ((modes[i].spinBudgetUs >= 0) && (flood[i].reader.messages <= flood[i].reader.reads))
+      {
+         fprintf(stderr, "%s: a flood should bring in several messages per read\n",
+            modes[i].name);
+         status = 1;
+      }
+   }
+
+   return status;
+}
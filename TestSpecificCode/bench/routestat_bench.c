@@ -0,0 +1,394 @@
+/**
+ * @file routestat_bench.c
+ * @brief Measures what per-route counters (sr_routestat.c) cost and checks
+ *        they add up.
+ *
+ * Three parts:
+ *    - "forwarding": ROUTES extra host routes via the external gateway;
+ *      internal hosts send TCP segments to them, route k getting about
+ *      1 / (k + 1) of the traffic, over SECONDS virtual seconds, timed
+ *      without and with counters. With counters, every route's total must
+ *      equal what was sent by it, the top routes must be the heaviest, and
+ *      the interval dumps in the log must add up to everything sent;
+ *    - "threads": 1 to THREADS threads count directly against the routes
+ *      while another thread keeps reading the totals, which must never go
+ *      down, and must end at what the threads counted;
+ *    - "shared": the same counting into one array shared by all threads
+ *      with atomic adds, for comparison.
+ *
+ * Usage: routestat_bench [packets]
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_protocol.h"
+#include "sr_routestat.h"
+#include "sr_rt.h"
+
+#define DEFAULT_PACKETS    (100000)
+#define ROUTES             (1000)
+#define FIRST_ROUTE        (0x14000000) /* 20.0.0.0 */
+#define HOSTS              (50)
+#define SECONDS            (60)
+#define INTERVAL_S         (10)
+#define THREADS            (4)
+#define THREAD_COUNTS      (2000000) /**< Counted by each thread. */
+#define IP_LEN             (BENCH_TCP_FRAME_LEN - sizeof(sr_ethernet_hdr_t))
+
+typedef struct
+{
+   sr_routestat_t *stats; /**< NULL: count into shared instead. */
+   uint64_t *shared;
+   const struct sr_rt **routes;
+   unsigned int routeCount;
+   unsigned int first; /**< Route the thread starts at. */
+   double seconds;
+} countThread_t;
+
+typedef struct
+{
+   sr_routestat_t *stats;
+   unsigned int routeCount;
+   bool stop;
+   bool wentDown;
+   uint64_t reads;
+} readThread_t;
+
+static unsigned int packets = DEFAULT_PACKETS;
+
+/** Internal hosts need a route of their own, as in a VNS routing table. */
+static void addRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, gateway, mask;
+   unsigned int route;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (route = 0; route < HOSTS; route++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + route);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+
+   gateway.s_addr = htonl(BENCH_EXTERNAL_GATEWAY);
+   for (route = 0; route < ROUTES; route++)
+   {
+      dest.s_addr = htonl(FIRST_ROUTE + route);
+      sr_add_rt_entry(sr, dest, gateway, mask, BENCH_EXTERNAL_IFACE);
+   }
+}
+
+/** Route of the i-th packet: route k about 1 / (k + 1) of the time. */
+static unsigned int packetRoute(unsigned int i)
+{
+   uint64_t hash = (i + 1) * 0x9E3779B97F4A7C15ULL;
+   double u = (double) (hash >> 11) / (double) (1ULL << 53);
+
+   /* Inverse of the harmonic distribution's CDF, near enough. */
+   unsigned int route = (unsigned int) (exp(u * log(ROUTES + 1.0)) - 1.0);
+   return (route < ROUTES) ? route : ROUTES - 1;
+}
+
+/** Adds up the "sent by route" lines of the interval dumps. */
+static uint64_t loggedPackets(const char *path)
+{
+   FILE *log = fopen(path, "r");
+   char line[256];
+   uint64_t total = 0, packets, bytes;
+
+   if (log == NULL)
+   {
+      return 0;
+   }
+   while (fgets(line, sizeof(line), log))
+   {
+      if (sscanf(line, " %" SCNu64 " packets, %" SCNu64 " bytes sent by route", &packets,
+         &bytes) == 2)
+      {
+         total += packets;
+      }
+   }
+   fclose(log);
+   return total;
+}
+
+static bool runForwarding(bool counting, double *nsPerPacket)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   sr_routestat_entry_t top[SR_ROUTESTAT_TOP_N];
+   sr_routestat_counts_t total;
+   const struct sr_rt *route;
+   uint64_t *sent = calloc(ROUTES, sizeof(uint64_t));
+   uint64_t expected[SR_ROUTESTAT_TOP_N], before, forwarded = 0;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   char path[64];
+   unsigned int i, j, second, routeIndex, used;
+   double start, elapsed = 0;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   addRoutes(&sr);
+
+   snprintf(path, sizeof(path), "/tmp/routestat_bench.%d.log", (int) getpid());
+   unlink(path);
+   if (counting)
+   {
+      sr.routeStats = sr_routestat_create(INTERVAL_S, path);
+      assert(sr.routeStats);
+   }
+
+   before = benchPacketsSent;
+   for (second = 0; second < SECONDS; second++)
+   {
+      BenchRefreshNeighbours(&sr);
+      start = BenchNow();
+      for (i = second * (packets / SECONDS); i < (second + 1) * (packets / SECONDS); i++)
+      {
+         routeIndex = packetRoute(i);
+         BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + i % HOSTS,
+            20000 + i % 1000, FIRST_ROUTE + routeIndex, 80, TCP_ACK_M);
+         sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+         sent[routeIndex]++;
+      }
+      elapsed += BenchNow() - start;
+      sr_multi_advance(&multi, 1);
+   }
+   forwarded = benchPacketsSent - before;
+   *nsPerPacket = elapsed * 1e9 / (SECONDS * (packets / SECONDS));
+   if (forwarded != SECONDS * (packets / SECONDS))
+   {
+      fprintf(stderr, "%" PRIu64 " of %u packets forwarded\n", forwarded,
+         SECONDS * (packets / SECONDS));
+      correct = false;
+   }
+
+   if (counting)
+   {
+      for (route = sr.routing_table; route; route = route->next)
+      {
+         uint32_t destination = ntohl(route->dest.s_addr);
+         uint64_t want = ((destination >= FIRST_ROUTE) && (destination < FIRST_ROUTE + ROUTES))
+            ? sent[destination - FIRST_ROUTE] : 0;
+
+         sr_routestat_total(sr.routeStats, route->id, total);
+         if ((total[SR_ROUTESTAT_PACKETS] != want) || (total[SR_ROUTESTAT_BYTES] != want * IP_LEN))
+         {
+            fprintf(stderr, "route %u counted %" PRIu64 " packets, %" PRIu64 " bytes; sent %"
+               PRIu64 "\n", route->id, total[SR_ROUTESTAT_PACKETS], total[SR_ROUTESTAT_BYTES],
+               want);
+            correct = false;
+         }
+      }
+
+      /* The heaviest counts, whichever of equal routes the report picked. */
+      memset(expected, 0, sizeof(expected));
+      for (i = 0; i < ROUTES; i++)
+      {
+         for (j = 0; j < SR_ROUTESTAT_TOP_N; j++)
+         {
+            if (sent[i] > expected[j])
+            {
+               memmove(&expected[j + 1], &expected[j],
+                  (SR_ROUTESTAT_TOP_N - j - 1) * sizeof(uint64_t));
+               expected[j] = sent[i];
+               break;
+            }
+         }
+      }
+      used = sr_routestat_top(sr.routeStats, sr.routing_table, top, SR_ROUTESTAT_TOP_N);
+      for (j = 0; j < SR_ROUTESTAT_TOP_N; j++)
+      {
+         if ((j >= used) || (top[j].packets != expected[j]))
+         {
+            fprintf(stderr, "top route %u: %" PRIu64 " packets, expected %" PRIu64 "\n", j,
+               (j < used) ? top[j].packets : 0, expected[j]);
+            correct = false;
+         }
+      }
+      sr_routestat_print(&sr, stdout);
+
+      /* The last dump covers up to the end of the traffic. */
+      sr_multi_advance(&multi, INTERVAL_S);
+      if (loggedPackets(path) != forwarded)
+      {
+         fprintf(stderr, "interval dumps add up to %" PRIu64 " of %" PRIu64 " packets\n",
+            loggedPackets(path), forwarded);
+         correct = false;
+      }
+      unlink(path);
+   }
+
+   free(sent);
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+static void *countThread(void *threadPtr)
+{
+   countThread_t *thread = (countThread_t *) threadPtr;
+   unsigned int i, index = thread->first;
+   double start = BenchNow();
+
+   for (i = 0; i < THREAD_COUNTS; i++)
+   {
+      if (thread->stats)
+      {
+         sr_routestat_count(thread->stats, thread->routes[index], IP_LEN);
+      }
+      else
+      {
+         uint64_t *counts = &thread->shared[thread->routes[index]->id * SR_ROUTESTAT_METRICS];
+
+         __atomic_add_fetch(&counts[SR_ROUTESTAT_PACKETS], 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&counts[SR_ROUTESTAT_BYTES], IP_LEN, __ATOMIC_RELAXED);
+      }
+      /* Hot routes, as in the forwarding workload. */
+      index = (index + 1) & 7;
+   }
+   thread->seconds = BenchNow() - start;
+   return NULL;
+}
+
+static void *readThread(void *readerPtr)
+{
+   readThread_t *reader = (readThread_t *) readerPtr;
+   uint64_t *last = calloc(reader->routeCount, sizeof(uint64_t));
+   sr_routestat_counts_t total;
+   unsigned int id;
+
+   while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE))
+   {
+      for (id = 0; id < reader->routeCount; id++)
+      {
+         sr_routestat_total(reader->stats, id, total);
+         if (total[SR_ROUTESTAT_PACKETS] < last[id])
+         {
+            reader->wentDown = true;
+         }
+         last[id] = total[SR_ROUTESTAT_PACKETS];
+      }
+      reader->reads++;
+   }
+   free(last);
+   return NULL;
+}
+
+/** Counts from threads threads; returns ns per count per thread. */
+static bool runThreads(struct sr_instance *sr, unsigned int threads, bool shared,
+   double *nsPerCount)
+{
+   const struct sr_rt *routes[ROUTES + HOSTS];
+   countThread_t counters[THREADS];
+   pthread_t counterIds[THREADS], readerId;
+   readThread_t reader;
+   sr_routestat_counts_t total;
+   sr_routestat_t *stats = shared ? NULL : sr_routestat_create(0, NULL);
+   uint64_t *sharedCounts = calloc((ROUTES + HOSTS) * SR_ROUTESTAT_METRICS, sizeof(uint64_t));
+   const struct sr_rt *route;
+   unsigned int routeCount = 0, i;
+   double seconds = 0;
+   bool correct = true;
+
+   for (route = sr->routing_table; route; route = route->next)
+   {
+      routes[routeCount++] = route;
+   }
+
+   memset(&reader, 0, sizeof(reader));
+   reader.stats = stats;
+   reader.routeCount = routeCount;
+   if (stats)
+   {
+      pthread_create(&readerId, NULL, readThread, &reader);
+   }
+   for (i = 0; i < threads; i++)
+   {
+      counters[i].stats = stats;
+      counters[i].shared = sharedCounts;
+      counters[i].routes = routes;
+      counters[i].routeCount = routeCount;
+      counters[i].first = i;
+      pthread_create(&counterIds[i], NULL, countThread, &counters[i]);
+   }
+   for (i = 0; i < threads; i++)
+   {
+      pthread_join(counterIds[i], NULL);
+      seconds += counters[i].seconds;
+   }
+   *nsPerCount = seconds * 1e9 / ((double) threads * THREAD_COUNTS);
+
+   if (stats)
+   {
+      uint64_t counted = 0;
+
+      __atomic_store_n(&reader.stop, true, __ATOMIC_RELEASE);
+      pthread_join(readerId, NULL);
+      for (i = 0; i < routeCount; i++)
+      {
+         sr_routestat_total(stats, i, total);
+         counted += total[SR_ROUTESTAT_PACKETS];
+      }
+      if (reader.wentDown || (counted != (uint64_t) threads * THREAD_COUNTS))
+      {
+         fprintf(stderr, "%u threads: %" PRIu64 " of %" PRIu64 " counts%s\n", threads, counted,
+            (uint64_t) threads * THREAD_COUNTS, reader.wentDown ? ", totals went down" : "");
+         correct = false;
+      }
+      sr_routestat_destroy(stats);
+   }
+   free(sharedCounts);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   struct sr_instance sr;
+   double off, on, perCount;
+   unsigned int threads;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+   if (packets < SECONDS)
+   {
+      fprintf(stderr, "packets must be at least %u\n", SECONDS);
+      return 2;
+   }
+
+   printf("%u packets over %u routes in %u s\n", packets, ROUTES, SECONDS);
+   if (!runForwarding(false, &off) || !runForwarding(true, &on))
+   {
+      status = 1;
+   }
+   printf("forwarding  counters off %7.1f ns/packet, on %7.1f ns/packet (%+.1f)\n", off, on,
+      on - off);
+
+   /* Routes to count against, outside any router. */
+   memset(&sr, 0, sizeof(sr));
+   addRoutes(&sr);
+   for (threads = 1; threads <= THREADS; threads *= 2)
+   {
+      if (!runThreads(&sr, threads, false, &perCount))
+      {
+         status = 1;
+      }
+      printf("threads %u   per-thread %5.2f ns/count", threads, perCount);
+      runThreads(&sr, threads, true, &perCount);
+      printf(", shared atomic %5.2f ns/count\n", perCount);
+   }
+   return status;
+}
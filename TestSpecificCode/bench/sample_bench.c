@@ -0,0 +1,369 @@
+/**
+ * @file sample_bench.c
+ * @brief Measures what packet sampling (sr_sample.c) costs the packet path
+ *        and checks what reaches an sFlow collector.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Internal hosts open TCP connections through the NAT to a server,
+ * then segments go both ways over SECONDS virtual seconds, timed with
+ * sampling off and at a few rates. A collector thread receives the
+ * datagrams on the loopback and decodes them. With sampling:
+ *    - the frames sampled must be one in rate, within four standard
+ *      deviations of a binomial count;
+ *    - every flow sample that arrives must carry the next hop and the NAT
+ *      translation, as every frame is translated and sent on;
+ *    - every sample the sampler queued must arrive, and the last counter
+ *      samples must add up to the frames received.
+ *
+ * Usage: sample_bench [packets]
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+#include "sr_sample.h"
+
+#define DEFAULT_PACKETS    (200000)
+#define FLOWS              (1000)
+#define HOSTS              (50)
+#define FIRST_SOCKET       (20000)
+#define SERVER_PORT        (443)
+#define SECONDS            (100) /**< Virtual time the packets are spread over. */
+#define DRAIN_TIMEOUT_MS   (2000) /**< Longest wait for the writer or the collector. */
+
+typedef struct
+{
+   unsigned int rate; /**< 0: sampling off. */
+   double nsPerPacket;
+   uint64_t received; /**< Frames the sampler counted in. */
+   uint64_t taken;
+   uint64_t dropped;
+   sr_sample_totals_t totals;
+} sampleRun_t;
+
+typedef struct
+{
+   int socket;
+   bool stop;
+   sr_sample_totals_t totals;
+   uint64_t malformed;
+   uint64_t datagrams; /**< Received, read by the main thread. */
+} sampleCollector_t;
+
+static unsigned int packets = DEFAULT_PACKETS;
+
+/** Internal hosts need a route of their own, as in a VNS routing table. */
+static void addHostRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, mask;
+   unsigned int host;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (host = 0; host < HOSTS; host++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + host);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+}
+
+/** External port of a flow's mapping, host byte order. 0 if unmapped. */
+static uint16_t externalPort(struct sr_instance *sr, unsigned int flow)
+{
+   sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr->nat,
+      htonl(BENCH_INTERNAL_HOST_BASE + flow % HOSTS), htons(FIRST_SOCKET + flow / HOSTS),
+      nat_mapping_tcp);
+   uint16_t port = 0;
+
+   if (mapping)
+   {
+      port = ntohs(mapping->aux_ext);
+      free(mapping);
+   }
+   return port;
+}
+
+/** Sends one segment of a flow, out from its host or back from the server. */
+static void sendSegment(struct sr_instance *sr, unsigned int flow, bool back, uint16_t port,
+   uint16_t controlBits)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+
+   if (back)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, port, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+   }
+   else
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + flow % HOSTS,
+         FIRST_SOCKET + flow / HOSTS, BENCH_SERVER_IP, SERVER_PORT, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+}
+
+static void *collectorThread(void *collectorPtr)
+{
+   sampleCollector_t *collector = (sampleCollector_t *) collectorPtr;
+   uint8_t datagram[SR_SAMPLE_MAX_DATAGRAM];
+   ssize_t received;
+
+   while (!__atomic_load_n(&collector->stop, __ATOMIC_ACQUIRE))
+   {
+      received = recv(collector->socket, datagram, sizeof(datagram), 0);
+      if ((received > 0)
+         && (sr_sample_decode(datagram, received, NULL, &collector->totals) != 0))
+      {
+         collector->malformed++;
+      }
+      if (received > 0)
+      {
+         __atomic_add_fetch(&collector->datagrams, 1, __ATOMIC_RELEASE);
+      }
+   }
+   return NULL;
+}
+
+/** Waits for the collector to receive the datagrams sent. false on timeout. */
+static bool waitForDatagrams(sampleCollector_t *collector, uint64_t sent)
+{
+   unsigned int waited;
+
+   for (waited = 0; __atomic_load_n(&collector->datagrams, __ATOMIC_ACQUIRE) < sent; waited++)
+   {
+      if (waited == DRAIN_TIMEOUT_MS)
+      {
+         return false;
+      }
+      usleep(1000);
+   }
+   return true;
+}
+
+/** Opens a collector on the loopback; its address goes in name. */
+static bool openCollector(sampleCollector_t *collector, char *name, size_t nameSize)
+{
+   struct sockaddr_in address;
+   socklen_t addressLength = sizeof(address);
+   struct timeval timeout = { 0, 100000 };
+   int bufferSize = 4 * 1024 * 1024;
+
+   memset(collector, 0, sizeof(*collector));
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   collector->socket = socket(AF_INET, SOCK_DGRAM, 0);
+   if ((collector->socket < 0)
+      || (bind(collector->socket, (struct sockaddr *) &address, sizeof(address)) != 0)
+      || (getsockname(collector->socket, (struct sockaddr *) &address, &addressLength) != 0))
+   {
+      perror("collector");
+      return false;
+   }
+   setsockopt(collector->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+   setsockopt(collector->socket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+   snprintf(name, nameSize, "127.0.0.1:%u", ntohs(address.sin_port));
+   return true;
+}
+
+static bool checkSamples(sampleRun_t *run, uint64_t queued, unsigned int interfaces)
+{
+   double expected = (double) run->received / run->rate;
+   uint64_t counted = 0;
+   unsigned int i;
+   bool correct = true;
+
+   if (fabs(run->taken - expected) > 4 * sqrt(expected) + 1)
+   {
+      fprintf(stderr, "1 in %u: %" PRIu64 " of %" PRIu64 " frames sampled, expected %.0f\n",
+         run->rate, run->taken, run->received, expected);
+      correct = false;
+   }
+   if ((run->totals.flowSamples + run->totals.counterSamples != queued)
+      || (run->totals.forwarded != run->totals.flowSamples)
+      || (run->totals.translated != run->totals.flowSamples)
+      || (run->totals.samplingRate != run->rate))
+   {
+      fprintf(stderr, "1 in %u: %" PRIu64 " flow and %" PRIu64 " counter samples of %" PRIu64
+         " arrived, %" PRIu64 " forwarded, %" PRIu64 " translated\n", run->rate,
+         run->totals.flowSamples, run->totals.counterSamples, queued, run->totals.forwarded,
+         run->totals.translated);
+      correct = false;
+   }
+   for (i = 0; i < SR_SAMPLE_MAX_INTERFACES; i++)
+   {
+      counted += run->totals.inPackets[i];
+   }
+   if ((interfaces != 2) || (counted != run->received))
+   {
+      fprintf(stderr, "1 in %u: counter samples show %" PRIu64 " of %" PRIu64 " frames in on %u"
+         " interfaces\n", run->rate, counted, run->received, interfaces);
+      correct = false;
+   }
+   return correct;
+}
+
+static bool runSampling(sampleRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   sampleCollector_t collector;
+   pthread_t collectorId;
+   char name[SR_SAMPLE_MAX_COLLECTOR];
+   uint16_t ports[FLOWS];
+   unsigned int i, second, flow;
+   uint64_t before, queued, sent;
+   unsigned int interfaces;
+   double start, elapsed = 0;
+   bool correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   addHostRoutes(&sr);
+
+   if (run->rate != 0)
+   {
+      if (!openCollector(&collector, name, sizeof(name)))
+      {
+         return false;
+      }
+      pthread_create(&collectorId, NULL, collectorThread, &collector);
+      sr.sampler = sr_sample_create(run->rate, name, 1);
+      if (sr.sampler == NULL)
+      {
+         return false;
+      }
+   }
+
+   for (flow = 0; flow < FLOWS; flow++)
+   {
+      sendSegment(&sr, flow, false, 0, TCP_SYN_M);
+      ports[flow] = externalPort(&sr, flow);
+      sendSegment(&sr, flow, true, ports[flow], TCP_SYN_M | TCP_ACK_M);
+   }
+
+   before = benchPacketsSent;
+   for (second = 0; second < SECONDS; second++)
+   {
+      BenchRefreshNeighbours(&sr);
+      start = BenchNow();
+      for (i = second * (packets / SECONDS); i < (second + 1) * (packets / SECONDS); i++)
+      {
+         sendSegment(&sr, i % FLOWS, i & 1, ports[i % FLOWS], TCP_ACK_M);
+      }
+      elapsed += BenchNow() - start;
+      sr_multi_advance(&multi, 1);
+   }
+   run->nsPerPacket = elapsed * 1e9 / (SECONDS * (packets / SECONDS));
+   if (benchPacketsSent - before != SECONDS * (packets / SECONDS))
+   {
+      fprintf(stderr, "1 in %u: %" PRIu64 " of %u packets forwarded\n", run->rate,
+         benchPacketsSent - before, SECONDS * (packets / SECONDS));
+      correct = false;
+   }
+
+   if (run->rate != 0)
+   {
+      sr_sample_t *sampler = sr.sampler;
+
+      /* A last round of counter samples, with every frame counted, once the
+       * writer has emptied the queue so they aren't dropped. */
+      if (!sr_sample_flush(sampler, DRAIN_TIMEOUT_MS))
+      {
+         fprintf(stderr, "1 in %u: sampler did not drain its queue\n", run->rate);
+         correct = false;
+      }
+      sr_multi_advance(&multi, SR_SAMPLE_COUNTER_INTERVAL);
+      sr.sampler = NULL;
+      for (i = 0; i < sampler->interfaceCount; i++)
+      {
+         run->received += sampler->packets[i][SR_SAMPLE_IN];
+      }
+      run->taken = sampler->flowSequence + sampler->dropped;
+      run->dropped = sampler->dropped;
+      queued = sampler->flowSequence + sampler->counterSequence;
+      interfaces = sampler->interfaceCount;
+
+      if (!sr_sample_flush(sampler, DRAIN_TIMEOUT_MS))
+      {
+         fprintf(stderr, "1 in %u: sampler did not send its counter samples\n", run->rate);
+         correct = false;
+      }
+      sent = __atomic_load_n(&sampler->datagrams, __ATOMIC_RELAXED);
+      sr_sample_destroy(sampler);
+      if (!waitForDatagrams(&collector, sent))
+      {
+         fprintf(stderr, "1 in %u: %" PRIu64 " of %" PRIu64 " datagrams reached the collector\n",
+            run->rate, __atomic_load_n(&collector.datagrams, __ATOMIC_ACQUIRE), sent);
+         correct = false;
+      }
+      __atomic_store_n(&collector.stop, true, __ATOMIC_RELEASE);
+      pthread_join(collectorId, NULL);
+      close(collector.socket);
+      run->totals = collector.totals;
+
+      correct = checkSamples(run, queued, interfaces) && correct && (collector.malformed == 0);
+   }
+
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   sampleRun_t runs[] =
+   {
+      { 0 },
+      { 1000 },
+      { 100 },
+      { 10 }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+   if (packets < SECONDS)
+   {
+      fprintf(stderr, "packets must be at least %u\n", SECONDS);
+      return 2;
+   }
+
+   printf("%u packets on %u NAT connections over %u s\n", packets, FLOWS, SECONDS);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runSampling(&runs[i]))
+      {
+         status = 1;
+      }
+      if (runs[i].rate == 0)
+      {
+         printf("sampling off     %7.1f ns/packet\n", runs[i].nsPerPacket);
+      }
+      else
+      {
+         printf("sampling 1/%-5u %7.1f ns/packet (%+.1f)  %6" PRIu64 " of %" PRIu64
+            " frames sampled, %" PRIu64 " dropped, %" PRIu64 " flow and %" PRIu64
+            " counter samples in %" PRIu64 " datagrams\n", runs[i].rate, runs[i].nsPerPacket,
+            runs[i].nsPerPacket - runs[0].nsPerPacket, runs[i].taken, runs[i].received,
+            runs[i].dropped, runs[i].totals.flowSamples, runs[i].totals.counterSamples,
+            runs[i].totals.datagrams);
+      }
+   }
+   return status;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file sched_bench.c
+ * @brief Measures per-packet latency jitter with and without a scheduling
+ *        profile.
+ *
+ * The real VNS client reads from one end of a socket pair (bench_vns.c)
+ * while one CPU hog per online CPU competes for the processors. A writer
+ * sends echo requests to the router at a fixed interval and the harness
+ * times each reply. The harness threads run at SCHED_FIFO 60 when allowed,
+ * so only the router's own scheduling differs between the scenarios:
+ *    - "default": the router thread at the default policy, memory unlocked.
+ *    - "profile": the -S profile under test (by default the reader pinned
+ *      to CPU 0 at SCHED_FIFO 50, memory locked and 16 MB prefaulted).
+ * Reports round trip percentiles, maximum and standard deviation. If the
+ * kernel refuses the profile (no CAP_SYS_NICE or RLIMIT_MEMLOCK too low)
+ * the profile scenario is skipped rather than failed.
+ *
+ * Usage: sched_bench [pings] [interval us] [profile]
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bench_vns.h"
+#include "sr_multi.h"
+#include "sr_router.h"
+#include "sr_sched.h"
+
+#define DEFAULT_PINGS         (5000)
+#define DEFAULT_INTERVAL_US   (100)
+#define DEFAULT_PROFILE       "reader=0:50,lock,prefault=16384"
+#define HARNESS_PRIORITY      (60)
+#define MAX_HOGS              (64)
+
+typedef struct
+{
+   bench_vns_peer_t *peer;
+   struct sr_instance *sr;
+   unsigned int pings;
+   unsigned int intervalUs;
+} schedRun_t;
+
+typedef struct
+{
+   bool ran;
+   bench_probe_stats_t ping;
+   double p50Ms;
+   double p99Ms;
+   double p999Ms;
+   double stddevMs;
+} schedResult_t;
+
+static volatile bool hogsStop;
+
+static void raisePriority(pthread_t thread)
+{
+   struct sched_param parameters;
+
+   memset(&parameters, 0, sizeof(parameters));
+   parameters.sched_priority = HARNESS_PRIORITY;
+   pthread_setschedparam(thread, SCHED_FIFO, &parameters);
+}
+
+/** Starts a thread at the default policy on any CPU, whatever the caller's settings. */
+static void startThread(pthread_t *thread, void *(*function)(void *), void *arg,
+   const cpu_set_t *cpus)
+{
+   pthread_attr_t attributes;
+   struct sched_param parameters;
+
+   memset(&parameters, 0, sizeof(parameters));
+   pthread_attr_init(&attributes);
+   pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+   pthread_attr_setschedpolicy(&attributes, SCHED_OTHER);
+   pthread_attr_setschedparam(&attributes, &parameters);
+   pthread_attr_setaffinity_np(&attributes, sizeof(*cpus), cpus);
+   pthread_create(thread, &attributes, function, arg);
+   pthread_attr_destroy(&attributes);
+}
+
+static void *hogThread(void *arg)
+{
+   volatile uint64_t spins = 0;
+
+   (void) arg;
+   while (!hogsStop)
+   {
+      spins++;
+   }
+   return NULL;
+}
+
+static void *writerThread(void *arg)
+{
+   schedRun_t *run = arg;
+   struct timespec interval = { 0, run->intervalUs * 1000L };
+   unsigned int i;
+
+   raisePriority(pthread_self());
+   for (i = 0; i < run->pings; i++)
+   {
+      if (!BenchVnsSendPing(run->peer, run->sr))
+      {
+         return NULL;
+      }
+      nanosleep(&interval, NULL);
+   }
+
+   BenchVnsFinish(run->peer);
+   return NULL;
+}
+
+static double standardDeviation(const double *samples, uint64_t count)
+{
+   double sum = 0.0, squares = 0.0, mean;
+   uint64_t i;
+
+   if (count == 0)
+   {
+      return 0.0;
+   }
+   for (i = 0; i < count; i++)
+   {
+      sum += samples[i];
+   }
+   mean = sum / count;
+   for (i = 0; i < count; i++)
+   {
+      squares += (samples[i] - mean) * (samples[i] - mean);
+   }
+   return sqrt(squares / count);
+}
+
+/** Puts the calling thread and the process back the way they started. */
+static void resetProfile(const cpu_set_t *originalCpus)
+{
+   struct sched_param parameters;
+   sr_sched_profile_t none;
+
+   memset(&parameters, 0, sizeof(parameters));
+   pthread_setschedparam(pthread_self(), SCHED_OTHER, &parameters);
+   pthread_setaffinity_np(pthread_self(), sizeof(*originalCpus), originalCpus);
+   munlockall();
+
+   sr_sched_profile_init(&none);
+   sr_sched_configure(&none);
+}
+
+static void runPings(const char *profileSpec, unsigned int pings, unsigned int intervalUs,
+   schedResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   schedRun_t run;
+   pthread_t writer;
+   pthread_t hogs[MAX_HOGS];
+   long hogCount = sysconf(_SC_NPROCESSORS_ONLN);
+   cpu_set_t originalCpus;
+   long i;
+
+   memset(result, 0, sizeof(*result));
+   pthread_getaffinity_np(pthread_self(), sizeof(originalCpus), &originalCpus);
+
+   if (profileSpec)
+   {
+      sr_sched_profile_t profile;
+
+      sr_sched_profile_init(&profile);
+      if (sr_sched_parse(&profile, profileSpec) != 0)
+      {
+         fprintf(stderr, "bad profile %s\n", profileSpec);
+         exit(1);
+      }
+      sr_sched_configure(&profile);
+      sr_sched_lock_memory();
+   }
+
+   /* No timer thread: the neighbours stay cached for the whole run. */
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   sr_admission_init(&sr.admission, 0, 0);
+
+   if (profileSpec)
+   {
+      sr_sched_apply(pthread_self(), SR_SCHED_READER);
+      if (sr_sched_verify(stdout) != 0)
+      {
+         printf("profile not granted; skipping\n");
+         resetProfile(&originalCpus);
+         sr_multi_destroy(&multi);
+         return;
+      }
+   }
+
+   /* Threads created from here on would inherit the router's settings; undo them. */
+   run.peer = BenchVnsAttach(&sr, 0);
+   run.sr = &sr;
+   run.pings = pings;
+   run.intervalUs = intervalUs;
+   pthread_setaffinity_np(run.peer->reader, sizeof(originalCpus), &originalCpus);
+   raisePriority(run.peer->reader);
+
+   hogsStop = false;
+   if ((hogCount < 1) || (hogCount > MAX_HOGS))
+   {
+      hogCount = (hogCount < 1) ? 1 : MAX_HOGS;
+   }
+   for (i = 0; i < hogCount; i++)
+   {
+      startThread(&hogs[i], hogThread, NULL, &originalCpus);
+   }
+   startThread(&writer, writerThread, &run, &originalCpus);
+
+   while (sr_read_from_server(&sr) == 1)
+   {
+   }
+
+   pthread_join(writer, NULL);
+   hogsStop = true;
+   for (i = 0; i < hogCount; i++)
+   {
+      pthread_join(hogs[i], NULL);
+   }
+   BenchVnsStop(run.peer);
+
+   result->ran = true;
+   result->ping = run.peer->ping;
+   result->stddevMs = standardDeviation(run.peer->pingMs, run.peer->ping.answered);
+   result->p50Ms = BenchVnsPercentileMs(run.peer, 0.50);
+   result->p99Ms = BenchVnsPercentileMs(run.peer, 0.99);
+   result->p999Ms = BenchVnsPercentileMs(run.peer, 0.999);
+
+   BenchVnsDetach(run.peer);
+   sr_multi_destroy(&multi);
+   if (profileSpec)
+   {
+      resetProfile(&originalCpus);
+   }
+}
+
+static void printResult(const char *scenario, const schedResult_t *result)
+{
+   if (!result->ran)
+   {
+      printf("%-8s %11s\n", scenario, "skipped");
+      return;
+   }
+   printf("%-8s %5" PRIu64 "/%-5" PRIu64 " %8.3f %8.3f %8.3f %8.3f %8.3f\n", scenario,
+      result->ping.answered, result->ping.sent, result->p50Ms, result->p99Ms, result->p999Ms,
+      result->ping.maxMs, result->stddevMs);
+   fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int pings = DEFAULT_PINGS;
+   unsigned int intervalUs = DEFAULT_INTERVAL_US;
+   const char *profileSpec = DEFAULT_PROFILE;
+   schedResult_t standard, profiled;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      pings = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      intervalUs = atoi(argv[2]);
+   }
+   if (argc > 3)
+   {
+      profileSpec = argv[3];
+   }
+   if (pings > BENCH_VNS_MAX_PROBES)
+   {
+      pings = BENCH_VNS_MAX_PROBES;
+   }
+
+   runPings(NULL, pings, intervalUs, &standard);
+   runPings(profileSpec, pings, intervalUs, &profiled);
+
+   printf("pings=%u every %u us, %ld CPU hogs, profile %s\n", pings, intervalUs,
+      sysconf(_SC_NPROCESSORS_ONLN), profileSpec);
+   printf("%-8s %11s %8s %8s %8s %8s %8s\n", "sched", "pings", "p50 ms", "p99 ms", "p99.9 ms",
+      "max ms", "sd ms");
+   printResult("default", &standard);
+   printResult("profile", &profiled);
+
+   if ((standard.ping.answered != standard.ping.sent)
+      || (profiled.ran && (profiled.ping.answered != profiled.ping.sent)))
+   {
+      fprintf(stderr, "pings went unanswered\n");
+      status = 1;
+   }
+
+   return status;
+}
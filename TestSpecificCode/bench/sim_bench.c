@@ -0,0 +1,204 @@
+/**
+ * @file sim_bench.c
+ * @brief Runs multi-router topologies in the in-process simulator.
+ *
+ * Topology: host A -- R1 -- R2 -- ... -- RK -- host B, where A
+ * (192.168.0.2) sends TCP SYNs to B (172.16.0.2) and B answers each with a
+ * SYN/ACK. Routers are joined by 10.1.i.0 links. Scenarios:
+ *    - "chain": K routers, lossless 1 Gb/s links with 1 ms delay.
+ *    - "nat+loss": NAT on R1 and 1% loss on every link.
+ *    - determinism: "nat+loss" twice with the same seed must give identical
+ *      results.
+ * Each run also idles for an hour of virtual time so every router's timeouts
+ * are ticked 3600 times. Reports replies, round trip times, virtual vs wall
+ * time and events processed per second.
+ *
+ * Usage: sim_bench [routers ...]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_sim.h"
+
+#define MAX_COUNTS         (16)
+#define PACKETS            (2000)
+#define SEND_INTERVAL      (0.001)
+#define IDLE_SECONDS       (3600.0)
+#define LOSS_RATE          (0.01)
+#define SEED               (144)
+#define SERVER_PORT        (80)
+
+#define HOST_A_IP          (0xC0A80002) /* 192.168.0.2 */
+#define HOST_A_GATEWAY     (0xC0A80001) /* 192.168.0.1 */
+#define HOST_B_IP          (0xAC100002) /* 172.16.0.2 */
+#define HOST_B_GATEWAY     (0xAC100001) /* 172.16.0.1 */
+#define LINK_NET(i)        (0x0A010000 | ((i) << 8)) /* 10.1.i.0 */
+
+typedef struct
+{
+   uint64_t sent;
+   uint64_t replies;
+   double firstRtt;
+   double meanRtt;
+   double virtualTime;
+   double wallTime;
+   uint64_t events;
+   uint64_t framesLost;
+} simResult_t;
+
+static const unsigned int defaultCounts[] = { 1, 8, 64 };
+
+static double wallNow(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void runChain(unsigned int routers, bool nat, double lossRate, simResult_t *result)
+{
+   sr_sim_link_params_t params = { 1e9, 0.001, lossRate, 0 };
+   sr_sim_node_t **chain = calloc(routers, sizeof(sr_sim_node_t *));
+   sr_sim_node_t *hostA, *hostB;
+   sr_sim_link_t *link;
+   sr_sim_t *sim;
+   double start;
+   unsigned int i;
+
+   start = wallNow();
+   sim = SimCreate(SEED);
+
+   hostA = SimAddHost(sim, "A", HOST_A_IP, HOST_A_GATEWAY, false);
+   hostB = SimAddHost(sim, "B", HOST_B_IP, HOST_B_GATEWAY, true);
+
+   for (i = 0; i < routers; i++)
+   {
+      char name[16];
+      bool last = (i == routers - 1);
+
+      snprintf(name, sizeof(name), "R%u", i + 1);
+      chain[i] = SimAddRouter(sim, name, nat && (i == 0));
+
+      /* eth1 faces A, eth2 faces B. */
+      SimAddRouterInterface(sim, chain[i], "eth1", (i == 0) ? HOST_A_GATEWAY : LINK_NET(i) | 2);
+      SimAddRouterInterface(sim, chain[i], "eth2", last ? HOST_B_GATEWAY : LINK_NET(i + 1) | 1);
+
+      if (i == 0)
+      {
+         SimAddRoute(chain[i], HOST_A_IP, 0xFFFFFFFF, HOST_A_IP, "eth1");
+      }
+      else
+      {
+         /* Host routes back: A, and R1's external address for NAT replies. */
+         SimAddRoute(chain[i], HOST_A_IP, 0xFFFFFFFF, LINK_NET(i) | 1, "eth1");
+         SimAddRoute(chain[i], LINK_NET(1) | 1, 0xFFFFFFFF, LINK_NET(i) | 1, "eth1");
+      }
+      SimAddRoute(chain[i], 0, 0, last ? HOST_B_IP : LINK_NET(i + 1) | 2, "eth2");
+
+      if (i > 0)
+      {
+         SimConnect(sim, chain[i - 1], "eth2", chain[i], "eth1", &params);
+      }
+   }
+   SimConnect(sim, hostA, SR_SIM_HOST_IFACE, chain[0], "eth1", &params);
+   SimConnect(sim, chain[routers - 1], "eth2", hostB, SR_SIM_HOST_IFACE, &params);
+
+   for (i = 0; i < PACKETS; i++)
+   {
+      SimHostSendTcp(sim, hostA, sim->now + SEND_INTERVAL * (i + 1), HOST_B_IP, 1024 + i,
+         SERVER_PORT, TCP_SYN_M);
+   }
+   SimRunUntilIdle(sim, 60.0);
+   SimRun(sim, sim->now + IDLE_SECONDS);
+
+   result->sent = hostA->host.stats.tcpSent;
+   result->replies = hostA->host.stats.repliesReceived;
+   result->firstRtt = hostA->host.stats.firstRtt;
+   result->meanRtt = result->replies ? hostA->host.stats.rttSum / result->replies : 0.0;
+   result->virtualTime = sim->now;
+   result->events = sim->eventsProcessed;
+   result->framesLost = 0;
+   for (link = sim->links; link; link = link->next)
+   {
+      result->framesLost += link->stats.framesLost;
+   }
+
+   SimDestroy(sim);
+   free(chain);
+   result->wallTime = wallNow() - start;
+}
+
+static void printResult(unsigned int routers, const char *scenario, const simResult_t *result)
+{
+   printf("%4u %-9s %6" PRIu64 " %7" PRIu64 " %6" PRIu64 " %9.3f %9.3f %10.0f %8.3f %10.0f %10.0f\n",
+      routers, scenario, result->sent, result->replies, result->framesLost,
+      result->firstRtt * 1000.0, result->meanRtt * 1000.0, result->virtualTime, result->wallTime,
+      result->virtualTime / result->wallTime, result->events / result->wallTime);
+   fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+   unsigned int counts[MAX_COUNTS];
+   unsigned int numCounts = 0;
+   unsigned int i;
+   int status = 0;
+
+   for (i = 1; (i < (unsigned int) argc) && (numCounts < MAX_COUNTS); i++)
+   {
+      counts[numCounts++] = atoi(argv[i]);
+   }
+   if (numCounts == 0)
+   {
+      numCounts = sizeof(defaultCounts) / sizeof(defaultCounts[0]);
+      memcpy(counts, defaultCounts, sizeof(defaultCounts));
+   }
+
+   printf("packets=%u interval=%.0f ms loss=%.0f%% idle=%.0f s seed=%u\n", PACKETS,
+      SEND_INTERVAL * 1000.0, LOSS_RATE * 100.0, IDLE_SECONDS, SEED);
+   printf("%4s %-9s %6s %7s %6s %9s %9s %10s %8s %10s %10s\n", "K", "scenario", "sent", "replies",
+      "lost", "first ms", "mean ms", "virtual s", "wall s", "speedup", "events/s");
+   fflush(stdout);
+
+   for (i = 0; i < numCounts; i++)
+   {
+      simResult_t chain, lossy, again;
+
+      if (counts[i] == 0)
+      {
+         continue;
+      }
+
+      runChain(counts[i], false, 0.0, &chain);
+      printResult(counts[i], "chain", &chain);
+      if (chain.replies != chain.sent)
+      {
+         fprintf(stderr, "chain of %u: %" PRIu64 " replies to %" PRIu64 " SYNs\n", counts[i],
+            chain.replies, chain.sent);
+         status = 1;
+      }
+
+      runChain(counts[i], true, LOSS_RATE, &lossy);
+      printResult(counts[i], "nat+loss", &lossy);
+      if ((lossy.replies == 0) || (lossy.framesLost == 0))
+      {
+         fprintf(stderr, "chain of %u with loss: %" PRIu64 " replies, %" PRIu64 " lost\n",
+            counts[i], lossy.replies, lossy.framesLost);
+         status = 1;
+      }
+
+      runChain(counts[i], true, LOSS_RATE, &again);
+      if ((again.sent != lossy.sent) || (again.replies != lossy.replies)
+         || (again.framesLost != lossy.framesLost) || (again.meanRtt != lossy.meanRtt)
+         || (again.events != lossy.events))
+      {
+         fprintf(stderr, "chain of %u: two runs with seed %u differ\n", counts[i], SEED);
+         status = 1;
+      }
+   }
+
+   return status;
+}
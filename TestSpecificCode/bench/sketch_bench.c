@@ -0,0 +1,263 @@
+/**
+ * @file sketch_bench.c
+ * @brief Measures what heavy-hitter counting costs per packet and checks
+ *        that it finds the heavy flows.
+ *
+ * Forwards TCP segments from the internal to the external interface. Flows
+ * are drawn from a Zipf distribution (exponent 1.1) over many flows, so a
+ * few carry much of the traffic while most are seen a handful of times,
+ * and each flow has its own segment size so the byte ranking differs from
+ * the packet ranking. The same sequence is forwarded without and with a
+ * sketch, reporting the time per packet of each.
+ *
+ * The flows counted on the way in are then compared with exact counts: the
+ * true top SR_SKETCH_TOP_K flows by packets and by bytes must be the ones
+ * reported (allowing for ties within the error bound), and no estimate may
+ * be below its true count or above it by more than the bound.
+ *
+ * Usage: sketch_bench [packets] [flows]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_topology.h"
+#include "sr_multi.h"
+#include "sr_sketch.h"
+#include "sr_utils.h"
+
+#define DEFAULT_PACKETS    (1000000)
+#define DEFAULT_FLOWS      (100000)
+#define ZIPF_EXPONENT      (1.1)
+#define SERVER_PORT        (80)
+#define HOSTS              (250)
+#define MAX_FRAME_LEN      (1514)
+
+typedef struct
+{
+   uint8_t header[BENCH_TCP_FRAME_LEN]; /**< With its own IP length and checksum. */
+   uint16_t length; /**< Whole frame. */
+   uint64_t packets; /**< Exact counts. */
+   uint64_t bytes;
+} sketchFlow_t;
+
+static sketchFlow_t *flowTable;
+static uint32_t *sequence;
+
+static void buildFlows(struct sr_instance *sr, unsigned int flows)
+{
+   unsigned int i;
+
+   flowTable = calloc(flows, sizeof(sketchFlow_t));
+   for (i = 0; i < flows; i++)
+   {
+      sketchFlow_t *flow = &flowTable[i];
+      sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (flow->header + sizeof(sr_ethernet_hdr_t));
+      unsigned int payload = (i * 2654435761U) % (MAX_FRAME_LEN - BENCH_TCP_FRAME_LEN);
+
+      BenchBuildTcpFrame(sr, flow->header, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + (i % HOSTS),
+         1024 + i / HOSTS, BENCH_SERVER_IP, SERVER_PORT, 0);
+      flow->length = BENCH_TCP_FRAME_LEN + payload;
+      ipHeader->ip_len = htons(flow->length - sizeof(sr_ethernet_hdr_t));
+      ipHeader->ip_sum = 0;
+      ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+   }
+}
+
+/** Draws the flow of every packet up front so the runs time only the router. */
+static void buildSequence(unsigned int packets, unsigned int flows)
+{
+   double *cumulative = malloc(flows * sizeof(double));
+   double total = 0.0;
+   unsigned int seed = 1;
+   unsigned int i;
+
+   for (i = 0; i < flows; i++)
+   {
+      total += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+      cumulative[i] = total;
+   }
+
+   sequence = malloc(packets * sizeof(uint32_t));
+   for (i = 0; i < packets; i++)
+   {
+      double target = total * rand_r(&seed) / ((double) RAND_MAX + 1.0);
+      unsigned int low = 0, high = flows - 1;
+
+      while (low < high)
+      {
+         unsigned int middle = (low + high) / 2;
+
+         if (cumulative[middle] < target)
+         {
+            low = middle + 1;
+         }
+         else
+         {
+            high = middle;
+         }
+      }
+      sequence[i] = low;
+      flowTable[low].packets++;
+      flowTable[low].bytes += flowTable[low].length - sizeof(sr_ethernet_hdr_t);
+   }
+   free(cumulative);
+}
+
+static double forwardAll(struct sr_instance *sr, unsigned int packets)
+{
+   static uint8_t frame[MAX_FRAME_LEN];
+   double start = BenchNow();
+   unsigned int i;
+
+   for (i = 0; i < packets; i++)
+   {
+      const sketchFlow_t *flow = &flowTable[sequence[i]];
+
+      memcpy(frame, flow->header, BENCH_TCP_FRAME_LEN);
+      sr_handlepacket(sr, frame, flow->length, BENCH_INTERNAL_IFACE);
+   }
+   return (BenchNow() - start) * 1e9 / packets;
+}
+
+static uint64_t trueCount(unsigned int flow, sr_sketch_metric_t metric)
+{
+   return (metric == SR_SKETCH_PACKETS) ? flowTable[flow].packets : flowTable[flow].bytes;
+}
+
+/** Finds which flow a flow key was built from. */
+static unsigned int flowOf(const sr_sketch_key_t *key)
+{
+   unsigned int host = ntohl(key->source) - BENCH_INTERNAL_HOST_BASE;
+
+   return (ntohs(key->sourcePort) - 1024) * HOSTS + host;
+}
+
+/**
+ * Checks one top table against the exact counts.
+ * @return true if it holds the true heaviest flows, allowing for flows
+ *         whose counts are within the error bound of the cut-off.
+ */
+static bool checkTop(struct sr_instance *sr, sr_sketch_metric_t metric, unsigned int flows,
+   uint64_t bound)
+{
+   sr_sketch_entry_t entries[SR_SKETCH_TOP_K];
+   unsigned int count, i, j, rank;
+   uint64_t cutoff;
+   bool correct = true;
+
+   count = sr_sketch_top(sr->sketch, sr_get_interface(sr, BENCH_INTERNAL_IFACE), SR_SKETCH_IN,
+      SR_SKETCH_FLOW, metric, entries);
+   if (count != SR_SKETCH_TOP_K)
+   {
+      fprintf(stderr, "only %u flows reported by %s\n", count,
+         (metric == SR_SKETCH_PACKETS) ? "packets" : "bytes");
+      return false;
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      uint64_t actual = trueCount(flowOf(&entries[i].key), metric);
+
+      if ((entries[i].estimate < actual) || (entries[i].estimate > actual + bound))
+      {
+         fprintf(stderr, "estimate %" PRIu64 " for a flow of %" PRIu64 " is out of bounds\n",
+            entries[i].estimate, actual);
+         correct = false;
+      }
+   }
+
+   /* Any flow heavier than the smallest reported one by more than the bound
+    * must have been reported. */
+   cutoff = entries[count - 1].estimate;
+   for (i = 0; i < flows; i++)
+   {
+      if (trueCount(i, metric) > cutoff + bound)
+      {
+         for (j = 0; (j < count) && (flowOf(&entries[j].key) != i); j++)
+         {
+         }
+         if (j == count)
+         {
+            fprintf(stderr, "flow %u (%" PRIu64 ") is missing\n", i, trueCount(i, metric));
+            correct = false;
+         }
+      }
+   }
+
+   printf("top flows by %s:", (metric == SR_SKETCH_PACKETS) ? "packets" : "bytes");
+   for (rank = 0; rank < count; rank++)
+   {
+      printf(" %u", flowOf(&entries[rank].key));
+   }
+   printf("\n");
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   unsigned int packets = DEFAULT_PACKETS;
+   unsigned int flows = DEFAULT_FLOWS;
+   uint64_t totalBytes = 0;
+   uint64_t packetBound, byteBound;
+   double plainNs, sketchNs;
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      flows = atoi(argv[2]);
+   }
+
+   /* No timer thread: the neighbours stay cached for the whole run. */
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+   buildFlows(&sr, flows);
+   buildSequence(packets, flows);
+
+   forwardAll(&sr, packets / 10);
+   plainNs = forwardAll(&sr, packets);
+
+   /* Warm up the sketch's memory, then count from scratch. */
+   sr.sketch = sr_sketch_create(0, NULL);
+   forwardAll(&sr, packets / 10);
+   sr_sketch_destroy(sr.sketch);
+   sr.sketch = sr_sketch_create(0, NULL);
+   sketchNs = forwardAll(&sr, packets);
+
+   for (i = 0; i < flows; i++)
+   {
+      totalBytes += flowTable[i].bytes;
+   }
+   /* Both directions went into the sketch, three keys each. */
+   packetBound = (uint64_t) ceil(M_E * 2 * SR_SKETCH_KINDS * packets / SR_SKETCH_WIDTH);
+   byteBound = (uint64_t) ceil(M_E * 2 * SR_SKETCH_KINDS * totalBytes / SR_SKETCH_WIDTH);
+
+   printf("packets=%u flows=%u zipf %.1f, sketch %u x %u cells, %zu KB\n", packets, flows,
+      ZIPF_EXPONENT, SR_SKETCH_DEPTH, SR_SKETCH_WIDTH, sizeof(sr_sketch_t) / 1024);
+   printf("forwarding: %.1f ns/packet without, %.1f ns/packet with sketch (+%.1f)\n", plainNs,
+      sketchNs, sketchNs - plainNs);
+   printf("error bound: %" PRIu64 " packets, %" PRIu64 " bytes\n", packetBound, byteBound);
+
+   if (!checkTop(&sr, SR_SKETCH_PACKETS, flows, packetBound)
+      || !checkTop(&sr, SR_SKETCH_BYTES, flows, byteBound))
+   {
+      fprintf(stderr, "heavy hitters were not found\n");
+      status = 1;
+   }
+
+   sr_sketch_destroy(sr.sketch);
+   sr.sketch = NULL;
+   sr_multi_destroy(&multi);
+   free(sequence);
+   free(flowTable);
+   return status;
+}
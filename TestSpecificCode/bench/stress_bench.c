@@ -0,0 +1,536 @@
+/**
+ * @file stress_bench.c
+ * @brief Drives the ARP cache and NAT table from many threads while the
+ *        timer sweeps them, for races (under ThreadSanitizer) and for how
+ *        throughput scales with the thread count.
+ *
+ * Worker threads share one router and mix, at random over HOPS next hops
+ * (more than the ARP cache holds, so entries are evicted) and NAT_SOCKETS
+ * internal ICMP sockets:
+ *    - forwarding a datagram to a next hop through IpForwardIpPacket(): ARP
+ *      lookup, and on a miss sr_arpcache_queuereq() and the first request;
+ *    - answering for a next hop as the ARP reply handler does:
+ *      sr_arpcache_insert(), sending what was queued, sr_arpreq_destroy();
+ *    - NAT lookups by internal socket, creating the mapping if missing;
+ *    - NAT lookups by external port.
+ * Meanwhile a timer thread runs the router's shared timers through
+ * sr_multi_advance(), a virtual second at a time, every sweep interval:
+ * with the default 1 ms, ARP entries expire every 15 ms, requests give up
+ * (and send ICMP unreachables) after 5 ms and idle ICMP mappings go after
+ * 60 ms, so expiry races lookups and inserts all the time.
+ *
+ * After each run the timers are stopped and the clock run on until every
+ * entry, request and mapping has expired. The run fails if a lookup
+ * returned something other than what was asked for, a frame went to the
+ * wrong next hop, more was delivered than forwarded, two mappings shared an
+ * external port or anything was left over.
+ *
+ * "check" runs once, with the timer sweeping every SWEEP_CHECK_US. "make
+ * bench-tsan" builds this file with -fsanitize=thread and runs it that
+ * way; ThreadSanitizer makes the exit status non-zero for any race it saw.
+ * The router's messages on stderr are discarded, and results and failures
+ * go to stdout.
+ * Otherwise it runs with 1, 2, 4, ... threads up to the maximum and reports
+ * operations per second, the speedup over one thread and the sweeps done.
+ *
+ * Usage: stress_bench [seconds per run] [max threads] [sweep interval us]
+ *        stress_bench check [seconds] [threads]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_arpcache.h"
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_utils.h"
+
+#define DEFAULT_SECONDS     (1.0)
+#define DEFAULT_MAX_THREADS (8)
+#define DEFAULT_SWEEP_US    (1000)
+#define CHECK_SECONDS       (2.0)
+#define CHECK_THREADS       (4)
+#define SWEEP_CHECK_US      (100)
+#define MAX_THREADS         (64)
+
+#define HOPS                (128)
+#define HOP_BASE            (0xC6120000) /* 198.18.0.0 */
+#define NAT_SOCKETS         (4096)
+#define NAT_HOSTS           (64)
+#define DATAGRAM_LEN        (64)
+
+/** Virtual seconds that expire everything: mappings, entries, requests and
+ *  the requests for the ICMP errors sent when those give up. */
+#define DRAIN_SECONDS       (60 + 15 + 2 * 6 + 2)
+
+typedef struct
+{
+   uint64_t forwarded;
+   uint64_t replies;
+   uint64_t natInternal;
+   uint64_t natInternalHits;
+   uint64_t natExternal;
+   uint64_t natExternalHits;
+   uint64_t wrongLookups;
+} workerCounts_t;
+
+typedef struct
+{
+   pthread_t thread;
+   unsigned int id;
+   workerCounts_t counts;
+} worker_t;
+
+static struct sr_instance router;
+static sr_multi_t multi;
+static pthread_barrier_t startBarrier;
+static volatile int stopWorkers;
+static volatile int stopTimer;
+static unsigned int sweepUs;
+static uint64_t sweeps;
+
+/* Filled in by sr_send_packet() from any thread. */
+static uint64_t sentDelivered;
+static uint64_t sentMisdelivered;
+static uint64_t sentUnreachable;
+static uint64_t sentArpRequests;
+
+static void hopMac(unsigned int hop, uint8_t *mac)
+{
+   mac[0] = 0x02;
+   mac[1] = 0x00;
+   mac[2] = 0x00;
+   mac[3] = 0x5E;
+   mac[4] = (uint8_t) (hop >> 8);
+   mac[5] = (uint8_t) hop;
+}
+
+/** Thread-safe sink in place of bench_sink.c: sorts what the router sends. */
+int sr_send_packet(struct sr_instance *sr, uint8_t *buf, unsigned int len, const char *iface)
+{
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) buf;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (buf + sizeof(sr_ethernet_hdr_t));
+   uint8_t mac[ETHER_ADDR_LEN];
+   uint32_t hop;
+
+   (void) sr;
+   (void) iface;
+   if (ntohs(ethernetHeader->ether_type) == ethertype_arp)
+   {
+      __atomic_add_fetch(&sentArpRequests, 1, __ATOMIC_RELAXED);
+   }
+   else if (ipHeader->ip_p == ip_protocol_icmp)
+   {
+      __atomic_add_fetch(&sentUnreachable, 1, __ATOMIC_RELAXED);
+   }
+   else
+   {
+      hop = ntohl(ipHeader->ip_dst) - HOP_BASE;
+      hopMac(hop, mac);
+      if ((hop < HOPS) && (len == sizeof(sr_ethernet_hdr_t) + DATAGRAM_LEN)
+         && (memcmp(ethernetHeader->ether_dhost, mac, ETHER_ADDR_LEN) == 0))
+      {
+         __atomic_add_fetch(&sentDelivered, 1, __ATOMIC_RELAXED);
+      }
+      else
+      {
+         __atomic_add_fetch(&sentMisdelivered, 1, __ATOMIC_RELAXED);
+      }
+   }
+   return 0;
+}
+
+/** Normally defined by sr_vns_comm.c; this benchmark never has a session. */
+int sr_read_from_server(struct sr_instance *sr)
+{
+   (void) sr;
+   return 0;
+}
+
+static uint32_t nextRandom(uint32_t *state)
+{
+   uint32_t x = *state;
+
+   x ^= x << 13;
+   x ^= x >> 17;
+   x ^= x << 5;
+   *state = x;
+   return x;
+}
+
+/** Forwards a datagram from the server to a next hop, as if from eth1. */
+static void forward(uint8_t *datagram, unsigned int hop)
+{
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) datagram;
+
+   ipHeader->ip_ttl = 64;
+   ipHeader->ip_dst = htonl(HOP_BASE + hop);
+   IpForwardIpPacket(&router, ipHeader, DATAGRAM_LEN,
+      sr_get_interface(&router, BENCH_INTERNAL_IFACE));
+}
+
+/** A next hop answers our ARP request: what the ARP reply handler does. */
+static void answer(unsigned int hop)
+{
+   uint8_t mac[ETHER_ADDR_LEN];
+   struct sr_arpreq *request;
+   struct sr_packet *packet;
+
+   hopMac(hop, mac);
+   request = sr_arpcache_insert(&(router.cache), mac, HOP_BASE + hop, BENCH_EXTERNAL_IFACE);
+   if (request == NULL)
+   {
+      return;
+   }
+   while ((packet = request->packets) != NULL)
+   {
+      memcpy(((sr_ethernet_hdr_t *) packet->buf)->ether_dhost, mac, ETHER_ADDR_LEN);
+      sr_send_packet(&router, packet->buf, packet->len, packet->iface);
+      request->packets = packet->next;
+      free(packet->buf);
+      free(packet->iface);
+      free(packet);
+   }
+   sr_arpreq_destroy(&(router.cache), request);
+}
+
+static void natInternal(workerCounts_t *counts, unsigned int socket)
+{
+   uint32_t ip = htonl(BENCH_INTERNAL_HOST_BASE + socket % NAT_HOSTS);
+   uint16_t ident = htons((uint16_t) (socket / NAT_HOSTS + 1));
+   sr_nat_mapping_t *copy = sr_nat_lookup_internal(router.nat, ip, ident, nat_mapping_icmp);
+
+   counts->natInternal++;
+   if (copy != NULL)
+   {
+      counts->natInternalHits++;
+   }
+   else
+   {
+      copy = sr_nat_insert_mapping(router.nat, ip, ident, nat_mapping_icmp);
+   }
+   if ((copy != NULL)
+      && ((copy->ip_int != ip) || (copy->aux_int != ident) || (copy->type != nat_mapping_icmp)))
+   {
+      counts->wrongLookups++;
+   }
+   free(copy);
+}
+
+static void natExternal(workerCounts_t *counts, unsigned int offset)
+{
+   uint16_t port = htons((uint16_t) (STARTING_PORT_NUMBER + offset));
+   sr_nat_mapping_t *copy = sr_nat_lookup_external(router.nat, port, nat_mapping_icmp);
+
+   counts->natExternal++;
+   if (copy != NULL)
+   {
+      counts->natExternalHits++;
+      if ((copy->aux_ext != port) || (copy->type != nat_mapping_icmp))
+      {
+         counts->wrongLookups++;
+      }
+      free(copy);
+   }
+}
+
+static void *workerThread(void *worker_ptr)
+{
+   worker_t *worker = worker_ptr;
+   uint8_t datagram[DATAGRAM_LEN];
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) datagram;
+   uint32_t random = 2463534242u + worker->id * 7919u;
+   uint32_t draw;
+
+   memset(datagram, 0, sizeof(datagram));
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(DATAGRAM_LEN);
+   ipHeader->ip_p = ip_protocol_udp;
+   ipHeader->ip_src = htonl(BENCH_SERVER_IP);
+
+   pthread_barrier_wait(&startBarrier);
+   while (!__atomic_load_n(&stopWorkers, __ATOMIC_RELAXED))
+   {
+      draw = nextRandom(&random);
+      switch (draw % 20)
+      {
+         case 0: case 1: case 2: case 3: case 4:
+         case 5: case 6: case 7: case 8: case 9:
+            forward(datagram, (draw >> 8) % HOPS);
+            worker->counts.forwarded++;
+            break;
+
+         case 10: case 11:
+            answer((draw >> 8) % HOPS);
+            worker->counts.replies++;
+            break;
+
+         case 12: case 13: case 14: case 15: case 16:
+            natInternal(&worker->counts, (draw >> 8) % NAT_SOCKETS);
+            break;
+
+         default:
+            natExternal(&worker->counts, (draw >> 8) % (2 * NAT_SOCKETS));
+            break;
+      }
+   }
+   return NULL;
+}
+
+/** The shared timer thread, with each second shortened to sweepUs. */
+static void *timerThread(void *unused)
+{
+   struct timespec interval = { sweepUs / 1000000, (sweepUs % 1000000) * 1000L };
+
+   (void) unused;
+   while (!__atomic_load_n(&stopTimer, __ATOMIC_RELAXED))
+   {
+      sr_multi_advance(&multi, 1);
+      __atomic_add_fetch(&sweeps, 1, __ATOMIC_RELAXED);
+      if (sweepUs > 0)
+      {
+         nanosleep(&interval, NULL);
+      }
+   }
+   return NULL;
+}
+
+/** @return mappings sharing an external port with another; NAT locked by caller. */
+static unsigned int duplicatePorts(void)
+{
+   static uint8_t used[65536];
+   sr_nat_mapping_t *mapping;
+   unsigned int duplicates = 0;
+
+   memset(used, 0, sizeof(used));
+   for (mapping = router.nat->mappings; mapping != NULL; mapping = mapping->next)
+   {
+      if (used[ntohs(mapping->aux_ext)]++)
+      {
+         duplicates++;
+      }
+   }
+   return duplicates;
+}
+
+/** @return what expiry left behind: valid entries, requests and mappings. */
+static unsigned int leftOver(void)
+{
+   struct sr_arpreq *request;
+   sr_nat_mapping_t *mapping;
+   unsigned int count = 0;
+   int i;
+
+   pthread_mutex_lock(&(router.cache.lock));
+   for (i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      count += router.cache.entries[i].valid ? 1 : 0;
+   }
+   for (request = router.cache.requests; request != NULL; request = request->next)
+   {
+      count++;
+   }
+   pthread_mutex_unlock(&(router.cache.lock));
+
+   pthread_mutex_lock(&(router.nat->lock));
+   for (mapping = router.nat->mappings; mapping != NULL; mapping = mapping->next)
+   {
+      count++;
+   }
+   pthread_mutex_unlock(&(router.nat->lock));
+   return count;
+}
+
+/**
+ * Runs the workers and the timer for a while, then expires everything.
+ * @return 0 if every check held, -1 otherwise.
+ */
+static int run(unsigned int threads, double seconds, workerCounts_t *total, double *opsPerSecond,
+   double *sweepsPerSecond)
+{
+   static worker_t workers[MAX_THREADS];
+   struct timespec length = { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) };
+   pthread_t timer;
+   unsigned int i, duplicates, left;
+   uint64_t operations;
+   double start, elapsed;
+   int ret = 0;
+
+   __atomic_store_n(&sentDelivered, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&sentMisdelivered, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&sentUnreachable, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&sentArpRequests, 0, __ATOMIC_RELAXED);
+   __atomic_store_n(&sweeps, 0, __ATOMIC_RELAXED);
+   stopWorkers = 0;
+   stopTimer = 0;
+
+   pthread_barrier_init(&startBarrier, NULL, threads + 1);
+   for (i = 0; i < threads; i++)
+   {
+      memset(&workers[i], 0, sizeof(workers[i]));
+      workers[i].id = i;
+      pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]);
+   }
+   pthread_create(&timer, NULL, timerThread, NULL);
+
+   pthread_barrier_wait(&startBarrier);
+   start = BenchNow();
+   nanosleep(&length, NULL);
+   __atomic_store_n(&stopWorkers, 1, __ATOMIC_RELAXED);
+   for (i = 0; i < threads; i++)
+   {
+      pthread_join(workers[i].thread, NULL);
+   }
+   elapsed = BenchNow() - start;
+   __atomic_store_n(&stopTimer, 1, __ATOMIC_RELAXED);
+   pthread_join(timer, NULL);
+   pthread_barrier_destroy(&startBarrier);
+
+   memset(total, 0, sizeof(*total));
+   for (i = 0; i < threads; i++)
+   {
+      total->forwarded += workers[i].counts.forwarded;
+      total->replies += workers[i].counts.replies;
+      total->natInternal += workers[i].counts.natInternal;
+      total->natInternalHits += workers[i].counts.natInternalHits;
+      total->natExternal += workers[i].counts.natExternal;
+      total->natExternalHits += workers[i].counts.natExternalHits;
+      total->wrongLookups += workers[i].counts.wrongLookups;
+   }
+   operations = total->forwarded + total->replies + total->natInternal + total->natExternal;
+   *opsPerSecond = operations / elapsed;
+   *sweepsPerSecond = __atomic_load_n(&sweeps, __ATOMIC_RELAXED) / elapsed;
+
+   pthread_mutex_lock(&(router.nat->lock));
+   duplicates = duplicatePorts();
+   pthread_mutex_unlock(&(router.nat->lock));
+
+   sr_multi_advance(&multi, DRAIN_SECONDS);
+   left = leftOver();
+
+   if (total->wrongLookups != 0)
+   {
+      printf("FAIL: %" PRIu64 " lookups returned another entry\n", total->wrongLookups);
+      ret = -1;
+   }
+   if (sentMisdelivered != 0)
+   {
+      printf("FAIL: %" PRIu64 " frames sent to the wrong next hop\n", sentMisdelivered);
+      ret = -1;
+   }
+   if (sentDelivered > total->forwarded)
+   {
+      printf("FAIL: %" PRIu64 " datagrams delivered of %" PRIu64 " forwarded\n",
+         sentDelivered, total->forwarded);
+      ret = -1;
+   }
+   if (duplicates != 0)
+   {
+      printf("FAIL: %u mappings share an external port\n", duplicates);
+      ret = -1;
+   }
+   if (left != 0)
+   {
+      printf("FAIL: %u entries, requests or mappings never expired\n", left);
+      ret = -1;
+   }
+   return ret;
+}
+
+static int check(double seconds, unsigned int threads)
+{
+   workerCounts_t total;
+   double opsPerSecond, sweepsPerSecond;
+
+   sweepUs = SWEEP_CHECK_US;
+   printf("Checking %u threads for %.1f s, sweeping every %u us\n", threads, seconds, sweepUs);
+   if (run(threads, seconds, &total, &opsPerSecond, &sweepsPerSecond) != 0)
+   {
+      return 1;
+   }
+   printf("%" PRIu64 " forwarded (%" PRIu64 " delivered, %" PRIu64 " unreachable sent, %" PRIu64
+      " ARP requests), %" PRIu64 " replies, %" PRIu64 " NAT lookups, %.0f sweeps\n",
+      total.forwarded, sentDelivered, sentUnreachable, sentArpRequests, total.replies,
+      total.natInternal + total.natExternal, sweepsPerSecond * seconds);
+   printf("check passed\n");
+   return 0;
+}
+
+static int scale(double seconds, unsigned int maxThreads)
+{
+   workerCounts_t total;
+   double opsPerSecond, sweepsPerSecond, baseline = 0;
+   unsigned int threads;
+   int ret = 0;
+
+   printf("%u next hops, %u NAT sockets, a virtual second every %u us, %.1f s a run\n\n", HOPS,
+      NAT_SOCKETS, sweepUs, seconds);
+   printf("%-8s %12s %12s %8s %10s %9s %8s\n", "threads", "ops/s", "ops/s/thr", "speedup",
+      "sweeps/s", "delivered", "nat hit");
+   for (threads = 1; threads <= maxThreads; threads *= 2)
+   {
+      if (run(threads, seconds, &total, &opsPerSecond, &sweepsPerSecond) != 0)
+      {
+         ret = 1;
+      }
+      if (threads == 1)
+      {
+         baseline = opsPerSecond;
+      }
+      printf("%-8u %12.0f %12.0f %7.2fx %10.0f %8.1f%% %7.1f%%\n", threads, opsPerSecond,
+         opsPerSecond / threads, opsPerSecond / baseline, sweepsPerSecond,
+         100.0 * sentDelivered / total.forwarded, 100.0 * total.natInternalHits / total.natInternal);
+   }
+   return ret;
+}
+
+int main(int argc, char **argv)
+{
+   bool checking = (argc > 1) && (strcmp(argv[1], "check") == 0);
+   int first = checking ? 2 : 1;
+   double seconds = (argc > first) ? atof(argv[first]) : (checking ? CHECK_SECONDS : DEFAULT_SECONDS);
+   unsigned int threads = (argc > first + 1) ? (unsigned int) atoi(argv[first + 1])
+      : (checking ? CHECK_THREADS : DEFAULT_MAX_THREADS);
+   unsigned int hop;
+   struct in_addr dest, mask;
+
+   sweepUs = (!checking && argc > 3) ? (unsigned int) atoi(argv[3]) : DEFAULT_SWEEP_US;
+   if ((seconds <= 0) || (threads == 0) || (threads > MAX_THREADS))
+   {
+      fprintf(stderr, "usage: stress_bench [seconds per run] [max threads (1-%d)]"
+         " [sweep interval us]\n       stress_bench check [seconds] [threads]\n", MAX_THREADS);
+      return 1;
+   }
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&router, true, &multi);
+
+   /* A host route per next hop, which is its own gateway. */
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (hop = 0; hop < HOPS; hop++)
+   {
+      dest.s_addr = htonl(HOP_BASE + hop);
+      sr_add_rt_entry(&router, dest, dest, mask, BENCH_EXTERNAL_IFACE);
+   }
+
+   /* The router reports every ARP request it gives up on to stderr. Under
+    * ThreadSanitizer, "make bench-tsan" sends its reports to stdout. */
+   fflush(stdout);
+   if (freopen("/dev/null", "w", stderr) == NULL)
+   {
+      perror("freopen");
+   }
+   return checking ? check(seconds, threads) : scale(seconds, threads);
+}
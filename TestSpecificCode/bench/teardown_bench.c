@@ -0,0 +1,264 @@
+/**
+ * @file teardown_bench.c
+ * @brief Checks that closed TCP connections give their NAT ports back after
+ *        the short TIME_WAIT timeout, and reports port use.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Internal hosts open short connections (SYN, SYN/ACK, ACK) at a
+ * steady rate and end them in one of four ways:
+ *    - the internal host closes first, the final ACK goes out;
+ *    - the server closes first, the final ACK comes in;
+ *    - the server resets the connection;
+ *    - the internal host half closes and the server never does ("abandoned").
+ * After every tick the NAT may hold no more ports than the closed
+ * connections of the last TIME_WAIT plus the abandoned ones, which keep
+ * theirs for the transitory timeout. Once traffic stops, only the abandoned
+ * mappings may be left after TIME_WAIT, and none after the transitory
+ * timeout. Every segment must be forwarded.
+ *
+ * The same traffic is then run with TIME_WAIT as long as the transitory
+ * timeout, which is how long closed connections held their ports before,
+ * for comparison.
+ *
+ * Usage: teardown_bench [connections per second] [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+
+#define DEFAULT_RATE        (20)
+#define DEFAULT_SECONDS     (120)
+#define HOSTS               (50)
+#define SERVER_PORT         (80)
+#define TIME_WAIT_TIMEOUT   (4)
+#define TRANSITORY_TIMEOUT  (300)
+#define CLIENT_ISN          (1000)
+#define SERVER_ISN          (5000)
+
+typedef enum
+{
+   CLOSE_CLIENT_FIRST,
+   CLOSE_SERVER_FIRST,
+   CLOSE_RESET,
+   CLOSE_ABANDONED,
+   CLOSE_KINDS
+} closeKind_t;
+
+typedef struct
+{
+   unsigned int peakPorts;
+   unsigned int connections[CLOSE_KINDS];
+   uint64_t segments;
+   uint64_t forwarded;
+   bool correct;
+} teardownResult_t;
+
+static unsigned int rate = DEFAULT_RATE;
+static unsigned int seconds = DEFAULT_SECONDS;
+
+static unsigned int countTcpMappings(struct sr_instance *sr)
+{
+   sr_nat_mapping_t *mapping;
+   unsigned int count = 0;
+
+   for (mapping = sr->nat->mappings; mapping; mapping = mapping->next)
+   {
+      if (mapping->type == nat_mapping_tcp)
+      {
+         count++;
+      }
+   }
+   return count;
+}
+
+/** Sends one segment of a connection through the router. */
+static void segment(struct sr_instance *sr, teardownResult_t *result, uint32_t host, uint16_t port,
+   uint16_t externalPort, bool outbound, uint16_t controlBits, uint32_t sequence,
+   uint32_t acknowledgment)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint64_t before = benchPacketsSent;
+
+   if (outbound)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, host, port, BENCH_SERVER_IP,
+         SERVER_PORT, controlBits);
+   }
+   else
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, externalPort, controlBits);
+   }
+   BenchSetTcpSequence(frame, sequence, acknowledgment);
+   sr_handlepacket(sr, frame, sizeof(frame), outbound ? BENCH_INTERNAL_IFACE : BENCH_EXTERNAL_IFACE);
+
+   result->segments++;
+   result->forwarded += benchPacketsSent - before;
+}
+
+static void runConnection(struct sr_instance *sr, teardownResult_t *result, unsigned int number)
+{
+   uint32_t host = BENCH_INTERNAL_HOST_BASE + number % HOSTS;
+   uint16_t port = 1024 + number / HOSTS;
+   closeKind_t kind = (number % 10 < 4) ? CLOSE_CLIENT_FIRST
+      : (number % 10 < 8) ? CLOSE_SERVER_FIRST : (number % 10 == 8) ? CLOSE_RESET : CLOSE_ABANDONED;
+   sr_nat_mapping_t *mapping;
+   uint16_t external;
+
+   segment(sr, result, host, port, 0, true, TCP_SYN_M, CLIENT_ISN, 0);
+   mapping = sr_nat_lookup_internal(sr->nat, htonl(host), htons(port), nat_mapping_tcp);
+   if (mapping == NULL)
+   {
+      result->correct = false;
+      return;
+   }
+   external = ntohs(mapping->aux_ext);
+   free(mapping);
+
+   segment(sr, result, host, port, external, false, TCP_SYN_M | TCP_ACK_M, SERVER_ISN, CLIENT_ISN + 1);
+   segment(sr, result, host, port, external, true, TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 1);
+
+   switch (kind)
+   {
+      case CLOSE_CLIENT_FIRST:
+         segment(sr, result, host, port, external, true, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1,
+            SERVER_ISN + 1);
+         segment(sr, result, host, port, external, false, TCP_ACK_M, SERVER_ISN + 1, CLIENT_ISN + 2);
+         segment(sr, result, host, port, external, false, TCP_FIN_M | TCP_ACK_M, SERVER_ISN + 1,
+            CLIENT_ISN + 2);
+         segment(sr, result, host, port, external, true, TCP_ACK_M, CLIENT_ISN + 2, SERVER_ISN + 2);
+         break;
+      case CLOSE_SERVER_FIRST:
+         segment(sr, result, host, port, external, false, TCP_FIN_M | TCP_ACK_M, SERVER_ISN + 1,
+            CLIENT_ISN + 1);
+         segment(sr, result, host, port, external, true, TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 2);
+         segment(sr, result, host, port, external, true, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1,
+            SERVER_ISN + 2);
+         segment(sr, result, host, port, external, false, TCP_ACK_M, SERVER_ISN + 2, CLIENT_ISN + 2);
+         break;
+      case CLOSE_RESET:
+         segment(sr, result, host, port, external, false, TCP_RST_M, SERVER_ISN + 1, 0);
+         break;
+      default:
+         segment(sr, result, host, port, external, true, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1,
+            SERVER_ISN + 1);
+         segment(sr, result, host, port, external, false, TCP_ACK_M, SERVER_ISN + 1, CLIENT_ISN + 2);
+         break;
+   }
+   result->connections[kind]++;
+}
+
+static void runTraffic(unsigned int timeWaitTimeout, teardownResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   unsigned int second, i, number = 0, ports, bound, abandoned;
+
+   memset(result, 0, sizeof(*result));
+   result->correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+   sr.nat->tcpTransitoryTimeout = TRANSITORY_TIMEOUT;
+   sr.nat->tcpTimeWaitTimeout = timeWaitTimeout;
+
+   for (second = 0; second < seconds; second++)
+   {
+      BenchRefreshNeighbours(&sr);
+      for (i = 0; i < rate; i++)
+      {
+         runConnection(&sr, result, number++);
+      }
+      sr_multi_advance(&multi, 1);
+
+      /* Closed connections of the last TIME_WAIT (and the tick it ends in),
+       * and every abandoned one so far. */
+      ports = countTcpMappings(&sr);
+      bound = rate * ((timeWaitTimeout + 2 < second + 1) ? timeWaitTimeout + 2 : second + 1)
+         + result->connections[CLOSE_ABANDONED];
+      if (ports > result->peakPorts)
+      {
+         result->peakPorts = ports;
+      }
+      if (ports > bound)
+      {
+         fprintf(stderr, "%u ports held at %u s, at most %u expected\n", ports, second + 1, bound);
+         result->correct = false;
+      }
+   }
+
+   /* Quiet: past TIME_WAIT only the abandoned connections are left. */
+   sr_multi_advance(&multi, timeWaitTimeout + 1);
+   BenchRefreshNeighbours(&sr);
+   abandoned = (timeWaitTimeout < TRANSITORY_TIMEOUT) ? result->connections[CLOSE_ABANDONED]
+      : countTcpMappings(&sr);
+   if (countTcpMappings(&sr) != abandoned)
+   {
+      fprintf(stderr, "%u ports held after TIME_WAIT, %u abandoned connections\n",
+         countTcpMappings(&sr), abandoned);
+      result->correct = false;
+   }
+
+   printf("TIME_WAIT %3u s: ", timeWaitTimeout);
+   sr_nat_print(&sr, stdout);
+
+   sr_multi_advance(&multi, TRANSITORY_TIMEOUT + 1);
+   if (countTcpMappings(&sr) != 0)
+   {
+      fprintf(stderr, "%u ports held after the transitory timeout\n", countTcpMappings(&sr));
+      result->correct = false;
+   }
+
+   if ((timeWaitTimeout < TRANSITORY_TIMEOUT)
+      && ((sr.nat->portStats.closedByFin
+         != result->connections[CLOSE_CLIENT_FIRST] + result->connections[CLOSE_SERVER_FIRST])
+      || (sr.nat->portStats.closedByReset != result->connections[CLOSE_RESET])))
+   {
+      fprintf(stderr, "%" PRIu64 " closed by FIN and %" PRIu64 " by RST, expected %u and %u\n",
+         sr.nat->portStats.closedByFin, sr.nat->portStats.closedByReset,
+         result->connections[CLOSE_CLIENT_FIRST] + result->connections[CLOSE_SERVER_FIRST],
+         result->connections[CLOSE_RESET]);
+      result->correct = false;
+   }
+   if (result->forwarded != result->segments)
+   {
+      fprintf(stderr, "%" PRIu64 " of %" PRIu64 " segments forwarded\n", result->forwarded,
+         result->segments);
+      result->correct = false;
+   }
+
+   sr_multi_destroy(&multi);
+}
+
+int main(int argc, char **argv)
+{
+   teardownResult_t fast, slow;
+
+   if (argc > 1)
+   {
+      rate = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      seconds = atoi(argv[2]);
+   }
+
+   runTraffic(TIME_WAIT_TIMEOUT, &fast);
+   runTraffic(TRANSITORY_TIMEOUT, &slow);
+
+   printf("%u connections/s for %u s (%u client close, %u server close, %u reset, %u abandoned)\n",
+      rate, seconds, fast.connections[CLOSE_CLIENT_FIRST], fast.connections[CLOSE_SERVER_FIRST],
+      fast.connections[CLOSE_RESET], fast.connections[CLOSE_ABANDONED]);
+   printf("peak TCP ports held: %u with a %u s TIME_WAIT, %u when closed connections wait %u s\n",
+      fast.peakPorts, TIME_WAIT_TIMEOUT, slow.peakPorts, TRANSITORY_TIMEOUT);
+
+   return fast.correct ? 0 : 1;
+}
@@ -0,0 +1,301 @@
+/**
+ * @file timeout_bench.c
+ * @brief Runs hours of ARP and NAT timeouts in virtual time.
+ *
+ * The router uses the virtual clock (sr_clock.h) and an sr_multi without a
+ * timer thread, so sr_multi_advance() fires every timeout synchronously.
+ *    - "nat": establishes flows spread over a window of virtual time, then
+ *      runs past the established connection timeout (7440 s), checking
+ *      after every tick that exactly the flows idle for longer than the
+ *      timeout are gone. Reports the cost of the ticks, including the
+ *      slowest one, and the largest number of flows expired by one tick.
+ *    - "arp": lets the cache expire, sends a packet to the now unknown
+ *      gateway and counts the ARP retransmissions until the request is
+ *      abandoned.
+ * Both run twice and must give identical results.
+ *
+ * Usage: timeout_bench [flows] [window seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+
+#define DEFAULT_FLOWS            (10000)
+#define DEFAULT_WINDOW           (1000)
+#define SERVER_PORT              (80)
+#define ESTABLISHED_TIMEOUT      (7440)
+#define ARP_SETTLE_SECONDS       (30)
+
+typedef struct
+{
+   unsigned int virtualSeconds;
+   double wallSeconds;
+   double slowestTickMs;
+   unsigned int largestExpiry;
+   uint64_t digest; /**< Sum of expiry time times flows expired. */
+   bool correct;
+} natResult_t;
+
+typedef struct
+{
+   unsigned int arpRequests;
+   unsigned int abandonedAfter;
+   bool correct;
+} arpResult_t;
+
+static unsigned int flows = DEFAULT_FLOWS;
+static unsigned int window = DEFAULT_WINDOW;
+
+static unsigned int countConnections(struct sr_instance *sr)
+{
+   sr_nat_mapping_t *mapping;
+   sr_nat_connection_t *connection;
+   unsigned int connections = 0;
+
+   pthread_mutex_lock(&(sr->nat->lock));
+   for (mapping = sr->nat->mappings; mapping; mapping = mapping->next)
+   {
+      for (connection = mapping->conns; connection; connection = connection->next)
+      {
+         connections++;
+      }
+   }
+   pthread_mutex_unlock(&(sr->nat->lock));
+   return connections;
+}
+
+static void openFlow(struct sr_instance *sr, unsigned int flow)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint32_t ip = BENCH_INTERNAL_HOST_BASE + (flow % 64);
+   uint16_t port = 1024 + flow / 64;
+   sr_nat_mapping_t *mapping;
+
+   BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, ip, port, BENCH_SERVER_IP, SERVER_PORT,
+      TCP_SYN_M);
+   sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+
+   mapping = sr_nat_lookup_internal(sr->nat, htonl(ip), htons(port), nat_mapping_tcp);
+   if (mapping)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, ntohs(mapping->aux_ext), TCP_SYN_M | TCP_ACK_M);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+      free(mapping);
+   }
+}
+
+static void runNat(natResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   unsigned int flow, opened = 0, second, remaining;
+   unsigned int lastOpened;
+   double start;
+
+   memset(result, 0, sizeof(*result));
+   result->correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, true, &multi);
+
+   start = BenchNow();
+
+   /* Flow f is opened at second (f * window / flows). The neighbours keep
+    * answering ARP while flows are being opened. */
+   for (second = 0; second < window; second++)
+   {
+      BenchRefreshNeighbours(&sr);
+      while ((opened < flows) && ((uint64_t) opened * window / flows == second))
+      {
+         openFlow(&sr, opened++);
+      }
+      sr_multi_advance(&multi, 1);
+   }
+   lastOpened = (flows > 0) ? (unsigned int) ((uint64_t) (flows - 1) * window / flows) : 0;
+
+   if (countConnections(&sr) != flows)
+   {
+      fprintf(stderr, "nat: %u of %u flows established\n", countConnections(&sr), flows);
+      result->correct = false;
+   }
+
+   remaining = flows;
+   for (; second <= lastOpened + ESTABLISHED_TIMEOUT + 1; second++)
+   {
+      double tickStart = BenchNow();
+      double tickMs;
+      unsigned int expected = 0;
+      unsigned int now;
+
+      sr_multi_advance(&multi, 1);
+      tickMs = (BenchNow() - tickStart) * 1000.0;
+      if (tickMs > result->slowestTickMs)
+      {
+         result->slowestTickMs = tickMs;
+      }
+
+      /* The clock now reads second + 1; a flow dies once idle for more than the timeout. */
+      now = second + 1;
+      if (now + window > ESTABLISHED_TIMEOUT)
+      {
+         unsigned int connections = countConnections(&sr);
+
+         for (flow = 0; flow < flows; flow++)
+         {
+            if (now - (unsigned int) ((uint64_t) flow * window / flows) <= ESTABLISHED_TIMEOUT)
+            {
+               expected++;
+            }
+         }
+         if (connections != expected)
+         {
+            fprintf(stderr, "nat: %u connections at %u s, expected %u\n", connections, now,
+               expected);
+            result->correct = false;
+            break;
+         }
+         if (remaining - connections > result->largestExpiry)
+         {
+            result->largestExpiry = remaining - connections;
+         }
+         result->digest += (uint64_t) now * (remaining - connections);
+         remaining = connections;
+      }
+   }
+
+   result->virtualSeconds = sr_clock_now() - SR_CLOCK_VIRTUAL_EPOCH;
+   result->wallSeconds = BenchNow() - start;
+   if (remaining != 0)
+   {
+      result->correct = false;
+   }
+
+   sr_multi_destroy(&multi);
+   sr_nat_destroy(sr.nat);
+   free(sr.nat);
+   sr_clock_use_wall();
+}
+
+static bool gatewayRequestPending(struct sr_instance *sr)
+{
+   struct sr_arpreq *request;
+
+   for (request = sr->cache.requests; request; request = request->next)
+   {
+      if (request->ip == BENCH_EXTERNAL_GATEWAY)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+static void runArp(arpResult_t *result)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+   uint64_t sentBefore;
+   struct sr_arpentry *entry;
+   unsigned int second;
+
+   memset(result, 0, sizeof(*result));
+   result->correct = true;
+
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(&multi, false);
+   BenchSetupRouter(&sr, false, &multi);
+
+   sr_multi_advance(&multi, (unsigned int) SR_ARPCACHE_TO + 1);
+   entry = sr_arpcache_lookup(&sr.cache, BENCH_EXTERNAL_GATEWAY);
+   if (entry)
+   {
+      fprintf(stderr, "arp: gateway still cached after %.0f s\n", SR_ARPCACHE_TO + 1);
+      free(entry);
+      result->correct = false;
+   }
+
+   /* Only the gateway is looked up: the reply would go to an expired host too. */
+   sentBefore = benchPacketsSent;
+   BenchBuildTcpFrame(&sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE, 1024,
+      BENCH_SERVER_IP, SERVER_PORT, TCP_SYN_M);
+   sr_handlepacket(&sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+
+   for (second = 1; (second <= ARP_SETTLE_SECONDS) && gatewayRequestPending(&sr); second++)
+   {
+      /* The tick that abandons the request sends an ICMP error instead. */
+      result->arpRequests = benchPacketsSent - sentBefore;
+      sr_multi_advance(&multi, 1);
+   }
+   result->abandonedAfter = second - 1;
+   if (gatewayRequestPending(&sr))
+   {
+      fprintf(stderr, "arp: request for the gateway still pending after %u s\n",
+         ARP_SETTLE_SECONDS);
+      result->correct = false;
+   }
+
+   sr_multi_destroy(&multi);
+   sr_clock_use_wall();
+}
+
+int main(int argc, char **argv)
+{
+   natResult_t nat, natAgain;
+   arpResult_t arp, arpAgain;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      flows = atoi(argv[1]);
+   }
+   if (argc > 2)
+   {
+      window = atoi(argv[2]);
+   }
+   if (window == 0)
+   {
+      window = 1;
+   }
+
+   printf("flows=%u window=%u s established timeout=%u s\n", flows, window, ESTABLISHED_TIMEOUT);
+
+   runNat(&nat);
+   runNat(&natAgain);
+   printf("nat: %u virtual s in %.3f wall s (%.0fx), slowest tick %.3f ms, "
+      "up to %u flows expired per tick\n", nat.virtualSeconds, nat.wallSeconds,
+      nat.virtualSeconds / nat.wallSeconds, nat.slowestTickMs, nat.largestExpiry);
+   if (!nat.correct || !natAgain.correct)
+   {
+      status = 1;
+   }
+   if ((nat.digest != natAgain.digest) || (nat.virtualSeconds != natAgain.virtualSeconds))
+   {
+      fprintf(stderr, "nat: two runs expired flows differently\n");
+      status = 1;
+   }
+
+   runArp(&arp);
+   runArp(&arpAgain);
+   printf("arp: gateway expired after %.0f s, %u ARP requests, abandoned after %u s\n",
+      SR_ARPCACHE_TO, arp.arpRequests, arp.abandonedAfter);
+   if (!arp.correct || !arpAgain.correct)
+   {
+      status = 1;
+   }
+   if ((arp.arpRequests != arpAgain.arpRequests) || (arp.abandonedAfter != arpAgain.abandonedAfter))
+   {
+      fprintf(stderr, "arp: two runs differ\n");
+      status = 1;
+   }
+
+   return status;
+}
@@ -0,0 +1,369 @@
+/**
+ * @file trace_bench.c
+ * @brief Measures what packet tracing (sr_trace.c) costs packets that
+ *        aren't traced, and checks the traces of those that are.
+ *
+ * Runs in virtual time (sr_clock.h) with an sr_multi without a timer
+ * thread. Internal hosts open TCP connections through the NAT to a server,
+ * then segments go both ways, timed with:
+ *    - no tracing (no -A);
+ *    - filters read but all used up;
+ *    - a filter armed that matches none of the packets.
+ * Then the SYNs opening connections from one host are traced, and the
+ * trace log read back: each trace must show the frame received, the new
+ * NAT connection and mapping, the route, the next hop's address and the
+ * frame sent, in that order. Last more packets are traced than there
+ * are records, without a dump: the rest must be counted, not traced.
+ *
+ * Usage: trace_bench [packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "bench_topology.h"
+#include "sr_clock.h"
+#include "sr_multi.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_rt.h"
+#include "sr_trace.h"
+
+#define DEFAULT_PACKETS    (200000)
+#define FLOWS              (1000)
+#define HOSTS              (50)
+#define FIRST_SOCKET       (20000)
+#define SERVER_PORT        (443)
+#define TRACED_SYNS        (5)
+
+typedef struct
+{
+   const char *name;
+   const char *filter; /**< Line of the filters file; NULL: no tracing. */
+   double nsPerPacket;
+} traceRun_t;
+
+static unsigned int packets = DEFAULT_PACKETS;
+static char configPath[64];
+static char logPath[64];
+
+static void writeConfig(const char *line)
+{
+   FILE *out = fopen(configPath, "w");
+
+   fprintf(out, "# trace_bench\n%s\n", line);
+   fclose(out);
+}
+
+/** Internal hosts need a route of their own, as in a VNS routing table. */
+static void addHostRoutes(struct sr_instance *sr)
+{
+   struct in_addr dest, mask;
+   unsigned int host;
+
+   mask.s_addr = htonl(0xFFFFFFFF);
+   for (host = 0; host < HOSTS; host++)
+   {
+      dest.s_addr = htonl(BENCH_INTERNAL_HOST_BASE + host);
+      sr_add_rt_entry(sr, dest, dest, mask, BENCH_INTERNAL_IFACE);
+   }
+}
+
+/** External port of a flow's mapping, host byte order. 0 if unmapped. */
+static uint16_t externalPort(struct sr_instance *sr, unsigned int flow)
+{
+   sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr->nat,
+      htonl(BENCH_INTERNAL_HOST_BASE + flow % HOSTS), htons(FIRST_SOCKET + flow / HOSTS),
+      nat_mapping_tcp);
+   uint16_t port = 0;
+
+   if (mapping)
+   {
+      port = ntohs(mapping->aux_ext);
+      free(mapping);
+   }
+   return port;
+}
+
+/** Sends one segment of a flow, out from its host or back from the server. */
+static void sendSegment(struct sr_instance *sr, unsigned int flow, bool back, uint16_t port,
+   uint16_t controlBits)
+{
+   uint8_t frame[BENCH_TCP_FRAME_LEN];
+
+   if (back)
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_EXTERNAL_IFACE, BENCH_SERVER_IP, SERVER_PORT,
+         BENCH_EXTERNAL_IP, port, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_EXTERNAL_IFACE);
+   }
+   else
+   {
+      BenchBuildTcpFrame(sr, frame, BENCH_INTERNAL_IFACE, BENCH_INTERNAL_HOST_BASE + flow % HOSTS,
+         FIRST_SOCKET + flow / HOSTS, BENCH_SERVER_IP, SERVER_PORT, controlBits);
+      sr_handlepacket(sr, frame, sizeof(frame), BENCH_INTERNAL_IFACE);
+   }
+}
+
+/** Opens the flows; ports gets their external ports. */
+static void openFlows(struct sr_instance *sr, uint16_t *ports, unsigned int first,
+   unsigned int count)
+{
+   unsigned int flow;
+
+   for (flow = first; flow < first + count; flow++)
+   {
+      sendSegment(sr, flow, false, 0, TCP_SYN_M);
+      ports[flow] = externalPort(sr, flow);
+      sendSegment(sr, flow, true, ports[flow], TCP_SYN_M | TCP_ACK_M);
+   }
+}
+
+static void setUp(struct sr_instance *sr, sr_multi_t *multi)
+{
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   sr_multi_init(multi, false);
+   BenchSetupRouter(sr, true, multi);
+   addHostRoutes(sr);
+   BenchRefreshNeighbours(sr);
+}
+
+static bool runTracing(traceRun_t *run)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint16_t ports[FLOWS];
+   uint64_t before;
+   double start;
+   unsigned int i;
+   bool correct = true;
+
+   setUp(&sr, &multi);
+   openFlows(&sr, ports, 0, FLOWS);
+   if (run->filter)
+   {
+      writeConfig(run->filter);
+      sr.trace = sr_trace_create(configPath, logPath, 0);
+      if (sr.trace == NULL)
+      {
+         return false;
+      }
+      /* Use up a filter that takes any packet. */
+      sendSegment(&sr, 0, false, 0, TCP_ACK_M);
+   }
+
+   before = benchPacketsSent;
+   start = BenchNow();
+   for (i = 0; i < packets; i++)
+   {
+      sendSegment(&sr, i % FLOWS, i & 1, ports[i % FLOWS], TCP_ACK_M);
+   }
+   run->nsPerPacket = (BenchNow() - start) * 1e9 / packets;
+   if (benchPacketsSent - before != packets)
+   {
+      fprintf(stderr, "%s: %" PRIu64 " of %u packets forwarded\n", run->name,
+         benchPacketsSent - before, packets);
+      correct = false;
+   }
+   if (sr.trace && (sr.trace->traced != (strncmp(run->filter, "any", 3) == 0)))
+   {
+      fprintf(stderr, "%s: %" PRIu64 " packets traced\n", run->name, sr.trace->traced);
+      correct = false;
+   }
+
+   sr_trace_destroy(sr.trace);
+   sr.trace = NULL;
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+/** Checks a trace's stages come in the order a new outbound connection takes. */
+static bool checkTrace(const char *stages, const char *text, unsigned int number)
+{
+   static const char * const expected[] = { "rx", "nat", "route", "arp", "tx" };
+   const char *at = stages;
+   unsigned int i;
+
+   for (i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+   {
+      at = strstr(at, expected[i]);
+      if (at == NULL)
+      {
+         fprintf(stderr, "trace %u: no %s in order in \"%s\"\n", number, expected[i], stages);
+         return false;
+      }
+   }
+   if ((strncmp(stages, "rx ", 3) != 0) || (strcmp(stages + strlen(stages) - 3, "tx ") != 0)
+      || (strstr(text, "new connection with") == NULL)
+      || (strstr(text, "outbound by mapping") == NULL))
+   {
+      fprintf(stderr, "trace %u: stages \"%s\"\n", number, stages);
+      return false;
+   }
+   return true;
+}
+
+/** Traces SYNs from one host and reads the log back. */
+static bool checkTraces(void)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint16_t ports[FLOWS];
+   char filter[64], line[512], stages[512] = "", text[4096] = "";
+   unsigned int traces = 0;
+   uint64_t written;
+   bool correct = true;
+   FILE *in;
+
+   setUp(&sr, &multi);
+   snprintf(filter, sizeof(filter), "eth1 %u 10.0.1.100:tcp:%u", TRACED_SYNS, SERVER_PORT);
+   writeConfig(filter);
+   unlink(logPath);
+   sr.trace = sr_trace_create(configPath, logPath, 0);
+   if (sr.trace == NULL)
+   {
+      return false;
+   }
+
+   /* Flows 0, HOSTS, 2 * HOSTS... are from 10.0.1.100. */
+   openFlows(&sr, ports, 0, (TRACED_SYNS + 2) * HOSTS);
+   written = sr_trace_dump(sr.trace);
+   if ((written != TRACED_SYNS) || (sr.trace->remaining != 0))
+   {
+      fprintf(stderr, "%" PRIu64 " traces written, %u still to trace\n", written,
+         sr.trace->remaining);
+      correct = false;
+   }
+   sr_trace_destroy(sr.trace);
+   sr.trace = NULL;
+   sr_multi_destroy(&multi);
+
+   in = fopen(logPath, "r");
+   if (in == NULL)
+   {
+      perror(logPath);
+      return false;
+   }
+   while (fgets(line, sizeof(line), in))
+   {
+      char stage[16];
+      double offset;
+
+      if (strncmp(line, "Packet ", 7) == 0)
+      {
+         if (traces && !checkTrace(stages, text, traces))
+         {
+            correct = false;
+         }
+         traces++;
+         stages[0] = '\0';
+         text[0] = '\0';
+      }
+      else if (sscanf(line, " %lf us %15s", &offset, stage) == 2)
+      {
+         strncat(stages, stage, sizeof(stages) - strlen(stages) - 2);
+         strcat(stages, " ");
+         strncat(text, line, sizeof(text) - strlen(text) - 1);
+      }
+   }
+   fclose(in);
+   if ((traces == 0) || !checkTrace(stages, text, traces))
+   {
+      correct = false;
+   }
+   if (traces != TRACED_SYNS)
+   {
+      fprintf(stderr, "%u traces in %s, expected %u\n", traces, logPath, TRACED_SYNS);
+      correct = false;
+   }
+   return correct;
+}
+
+/** Past the records available, matches are counted and not traced. */
+static bool checkFull(void)
+{
+   struct sr_instance sr;
+   sr_multi_t multi;
+   uint16_t ports[FLOWS];
+   char filter[64];
+   bool correct = true;
+
+   setUp(&sr, &multi);
+   openFlows(&sr, ports, 0, FLOWS);
+   snprintf(filter, sizeof(filter), "any %u any", SR_TRACE_MAX_PACKETS + 100);
+   writeConfig(filter);
+   sr.trace = sr_trace_create(configPath, logPath, 0);
+   if (sr.trace == NULL)
+   {
+      return false;
+   }
+   openFlows(&sr, ports, 0, (SR_TRACE_MAX_PACKETS + 100) / 2);
+   if ((sr.trace->traced != SR_TRACE_MAX_PACKETS) || (sr.trace->unrecorded != 100))
+   {
+      fprintf(stderr, "%" PRIu64 " traced and %" PRIu64 " not of %u\n", sr.trace->traced,
+         sr.trace->unrecorded, SR_TRACE_MAX_PACKETS + 100);
+      correct = false;
+   }
+
+   /* SIGHUP arms the filters again; the dump frees every record. */
+   srReloadRequests++;
+   sr_trace_tick(&sr);
+   sr_trace_dump(sr.trace);
+   openFlows(&sr, ports, 0, 10);
+   if (sr.trace->traced != SR_TRACE_MAX_PACKETS + 20)
+   {
+      fprintf(stderr, "%" PRIu64 " traced after a reload and dump\n", sr.trace->traced);
+      correct = false;
+   }
+
+   sr_trace_destroy(sr.trace);
+   sr.trace = NULL;
+   sr_multi_destroy(&multi);
+   return correct;
+}
+
+int main(int argc, char **argv)
+{
+   traceRun_t runs[] =
+   {
+      { "off", NULL },
+      { "used up", "any 1 any" },
+      { "no match", "eth1 1000 192.0.2.0/24:tcp" }
+   };
+   unsigned int i;
+   int status = 0;
+
+   if (argc > 1)
+   {
+      packets = atoi(argv[1]);
+   }
+   snprintf(configPath, sizeof(configPath), "/tmp/trace_bench.%d.conf", (int) getpid());
+   snprintf(logPath, sizeof(logPath), "/tmp/trace_bench.%d.log", (int) getpid());
+
+   printf("%u packets on %u NAT connections\n", packets, FLOWS);
+   for (i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+   {
+      if (!runTracing(&runs[i]))
+      {
+         status = 1;
+      }
+      printf("%-9s %7.1f ns/packet (%+.1f)\n", runs[i].name, runs[i].nsPerPacket,
+         runs[i].nsPerPacket - runs[0].nsPerPacket);
+   }
+   if (!checkTraces() || !checkFull())
+   {
+      status = 1;
+   }
+   else
+   {
+      printf("%u SYNs traced as expected; records run out and are freed by a dump\n",
+         TRACED_SYNS);
+   }
+
+   unlink(configPath);
+   unlink(logPath);
+   return status;
+}
@@ -0,0 +1,94 @@
+#------------------------------------------------------------------------------
+# File: BenchMakefile.mk
+#
+# Builds the benchmarks in TestSpecificCode/bench. Each benchmark links the
+# router sources (without the VNS client and main) plus bench_topology.c and
+# the counting sink in place of the VNS client, except the simulator
+# benchmarks, which link TestSpecificCode/sim instead, and the VNS
+# benchmarks, which link the real VNS client and the loopback peer in
+# TestSpecificCode/vns, and the stress benchmarks, which send from many
+# threads and so bring a sink of their own. "tsan" builds the stress
+# benchmark with ThreadSanitizer and runs its check. Run from the project
+# root: make bench (or make bench-tsan)
+#------------------------------------------------------------------------------
+
+SILENCE = @
+
+CC = gcc
+CFLAGS = -O2 -g -Wall -std=c99 -D_GNU_SOURCE -D_LINUX_ -I. -ITestSpecificCode/bench
+LIBS = -lm -lpthread
+# names the router's functions in the watchdog's stack dumps
+LDFLAGS = -rdynamic
+
+BENCH_DIR = TestSpecificCode/bench
+SIM_DIR = TestSpecificCode/sim
+VNS_DIR = TestSpecificCode/vns
+BENCH_BIN_DIR = bin/bench
+
+ROUTER_SRCS = sr_router.c sr_if.c sr_rt.c sr_utils.c sr_arpcache.c sr_nat.c sr_nat_sync.c sr_multi.c sr_clock.c sr_admission.c sr_vns_reader.c sr_sched.c sr_watchdog.c sr_sketch.c sr_policer.c sr_natlog.c sr_codec.c sr_flow.c sr_sample.c sr_routestat.c sr_mirror.c sr_trace.c
+BENCH_COMMON = $(BENCH_DIR)/bench_topology.c $(BENCH_DIR)/bench_sink.c
+SIM_COMMON = $(SIM_DIR)/sr_sim.c
+VNS_COMMON = $(BENCH_DIR)/bench_topology.c $(BENCH_DIR)/bench_vns.c $(VNS_DIR)/vns_peer.c sr_vns_comm.c sr_upgrade.c sr_dumper.c sha1.c
+
+# Add new benchmarks here
+BENCHES = nat_sync_bench multi_instance_bench timeout_bench watchdog_bench sketch_bench policer_bench \
+   teardown_bench natlog_bench eim_bench deterministic_bench flow_bench sample_bench \
+   routestat_bench mirror_bench trace_bench
+SIM_BENCHES = sim_bench
+VNS_BENCHES = vns_batch_bench overload_bench reader_bench sched_bench micro_bench
+STRESS_BENCHES = stress_bench
+
+BENCH_TARGETS = $(addprefix $(BENCH_BIN_DIR)/,$(BENCHES) $(SIM_BENCHES) $(VNS_BENCHES) $(STRESS_BENCHES))
+SIM_TARGETS = $(addprefix $(BENCH_BIN_DIR)/,$(SIM_BENCHES))
+VNS_TARGETS = $(addprefix $(BENCH_BIN_DIR)/,$(VNS_BENCHES))
+STRESS_TARGETS = $(addprefix $(BENCH_BIN_DIR)/,$(STRESS_BENCHES))
+
+# Races show up at any optimisation level; -O1 keeps the reports readable.
+TSAN_CFLAGS = $(filter-out -O2,$(CFLAGS)) -O1 -fsanitize=thread
+STRESS_TSAN = $(BENCH_BIN_DIR)/stress_bench_tsan
+
+# Not run by "run": waits for a router to connect.
+VNS_PEER = $(BENCH_BIN_DIR)/vns_loopback_peer
+
+all : $(BENCH_TARGETS) $(VNS_PEER)
+
+$(BENCH_BIN_DIR)/% : $(BENCH_DIR)/%.c $(BENCH_COMMON) $(ROUTER_SRCS) $(wildcard *.h) $(BENCH_DIR)/bench_topology.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(CFLAGS) $(LDFLAGS) -o $@ $< $(BENCH_COMMON) $(ROUTER_SRCS) $(LIBS)
+
+$(SIM_TARGETS) : $(BENCH_BIN_DIR)/% : $(BENCH_DIR)/%.c $(SIM_COMMON) $(ROUTER_SRCS) $(wildcard *.h) $(SIM_DIR)/sr_sim.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(CFLAGS) -I$(SIM_DIR) -o $@ $< $(SIM_COMMON) $(ROUTER_SRCS) $(LIBS)
+
+$(VNS_TARGETS) : $(BENCH_BIN_DIR)/% : $(BENCH_DIR)/%.c $(VNS_COMMON) $(ROUTER_SRCS) $(wildcard *.h) $(BENCH_DIR)/bench_topology.h $(BENCH_DIR)/bench_vns.h $(VNS_DIR)/vns_peer.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(CFLAGS) -I$(VNS_DIR) -o $@ $< $(VNS_COMMON) $(ROUTER_SRCS) $(LIBS)
+
+$(STRESS_TARGETS) : $(BENCH_BIN_DIR)/% : $(BENCH_DIR)/%.c $(BENCH_DIR)/bench_topology.c $(ROUTER_SRCS) $(wildcard *.h) $(BENCH_DIR)/bench_topology.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(CFLAGS) $(LDFLAGS) -o $@ $< $(BENCH_DIR)/bench_topology.c $(ROUTER_SRCS) $(LIBS)
+
+$(STRESS_TSAN) : $(BENCH_DIR)/stress_bench.c $(BENCH_DIR)/bench_topology.c $(ROUTER_SRCS) $(wildcard *.h) $(BENCH_DIR)/bench_topology.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(TSAN_CFLAGS) $(LDFLAGS) -o $@ $< $(BENCH_DIR)/bench_topology.c $(ROUTER_SRCS) $(LIBS)
+
+$(VNS_PEER) : $(VNS_DIR)/vns_loopback_peer.c $(VNS_DIR)/vns_peer.c $(VNS_DIR)/vns_peer.h sr_utils.c vnscommand.h
+	@echo Linking $(notdir $@)
+	$(SILENCE)mkdir -p $(BENCH_BIN_DIR)
+	$(SILENCE)$(CC) $(CFLAGS) -I$(VNS_DIR) -o $@ $(VNS_DIR)/vns_loopback_peer.c $(VNS_DIR)/vns_peer.c sr_utils.c $(LIBS)
+
+run : all
+	$(SILENCE)for bench in $(BENCH_TARGETS); do echo "== $$bench"; $$bench || exit 1; done
+
+tsan : $(STRESS_TSAN)
+	$(SILENCE)TSAN_OPTIONS="log_path=stdout $$TSAN_OPTIONS" $(STRESS_TSAN) check
+
+clean :
+	$(SILENCE)$(RM) -r $(BENCH_BIN_DIR)
+
+.PHONY : all run tsan clean
@@ -20,7 +20,7 @@ TEST_TARGET = $(COMPONENT_NAME)_tests
 
 SRC_DIRS = 
 
-SRC_FILES = sr_router.c sr_arpcache.c sr_utils.c sr_if.c sr_rt.c
+SRC_FILES = sr_router.c sr_arpcache.c sr_admission.c sr_vns_reader.c sr_utils.c sr_if.c sr_rt.c sr_nat.c sr_nat_sync.c sr_clock.c sr_sched.c sr_watchdog.c sr_sketch.c sr_policer.c sr_natlog.c sr_codec.c sr_flow.c sr_sample.c sr_routestat.c sr_mirror.c sr_trace.c
 
 TEST_SRC_DIRS = $(TESTING_DIR)/tests
 
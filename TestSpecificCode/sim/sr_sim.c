@@ -0,0 +1,885 @@
+/**
+ * @file sr_sim.c
+ * @brief In-process network simulator for multi-router scale tests.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_sim.h"
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_nat.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define SIM_INITIAL_EVENTS       (1024)
+#define SIM_INITIAL_NODES        (16)
+#define SIM_HOST_TTL             (255)
+#define SIM_STAMP_LEN            (sizeof(double))
+#define SIM_TCP_FRAME_LEN        (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) \
+                                 + sizeof(sr_tcp_hdr_t) + SIM_STAMP_LEN)
+#define SIM_ARP_FRAME_LEN        (sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+
+#define SIM_DEFAULT_ICMP_TIMEOUT             (60)
+#define SIM_DEFAULT_TCP_ESTABLISHED_TIMEOUT  (7440)
+#define SIM_DEFAULT_TCP_TRANSITORY_TIMEOUT   (300)
+#define SIM_DEFAULT_TCP_TIME_WAIT_TIMEOUT    (4)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+typedef enum
+{
+   sim_event_tick,
+   sim_event_deliver, /**< Frame arrives at a port. */
+   sim_event_host_send, /**< Host hands a frame to its interface. */
+   sim_event_host_arp_retry
+} sr_sim_event_type_t;
+
+struct sr_sim_event
+{
+   double time;
+   uint64_t sequence;
+   sr_sim_event_type_t type;
+   void *target; /**< sr_sim_port_t for deliveries, sr_sim_node_t for host events. */
+   uint8_t *frame;
+   unsigned int length;
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables & Constants
+ *-----------------------------------------------------------------------------
+ */
+
+/** sr_send_packet() only gets the router, so the simulator must be found globally. */
+static sr_sim_t *activeSim = NULL;
+
+static const uint8_t broadcastMac[ETHER_ADDR_LEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+/** Normally defined by sr_main.c, which the simulator doesn't link. */
+volatile sig_atomic_t srShutdownRequested = 0;
+volatile sig_atomic_t srStatsRequested = 0;
+volatile sig_atomic_t srReloadRequests = 0;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static time_t simClockSource(void *sim_ptr);
+static void simSchedule(sr_sim_t *sim, double time, sr_sim_event_type_t type, void *target,
+   uint8_t *frame, unsigned int length);
+static bool simEventBefore(const sr_sim_event_t *a, const sr_sim_event_t *b);
+static sr_sim_event_t simPop(sr_sim_t *sim);
+static void simDispatch(sr_sim_t *sim, sr_sim_event_t *event);
+
+static sr_sim_node_t *simNewNode(sr_sim_t *sim, const char *name);
+static sr_sim_port_t *simGetPort(sr_sim_node_t *node, const char *iface, bool create);
+static sr_sim_port_t *simFindRouterPort(sr_sim_t *sim, struct sr_instance *sr, const char *iface);
+static void simNextMac(sr_sim_t *sim, uint8_t *mac);
+static void simTransmit(sr_sim_t *sim, sr_sim_port_t *port, const uint8_t *frame, unsigned int length);
+
+static void simHostReceive(sr_sim_t *sim, sr_sim_node_t *node, uint8_t *frame, unsigned int length);
+static void simHostSend(sr_sim_t *sim, sr_sim_node_t *node, uint8_t *frame, unsigned int length);
+static void simHostSendArp(sr_sim_t *sim, sr_sim_node_t *node, uint16_t op, const uint8_t *targetMac,
+   uint32_t targetIp);
+static uint8_t *simBuildTcpFrame(sr_sim_node_t *node, uint32_t destination, uint16_t sourcePort,
+   uint16_t destinationPort, uint16_t controlBits, double stamp);
+static void simTcpChecksum(sr_ip_hdr_t *ipHeader);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * SimCreate()\n
+ * @brief Creates an empty simulation at virtual time 0.
+ * @param seed seed for the loss generator.
+ * @return the simulation. Only one may exist at a time.
+ */
+sr_sim_t *SimCreate(unsigned int seed)
+{
+   sr_sim_t *sim;
+
+   assert(activeSim == NULL);
+
+   sim = calloc(1, sizeof(sr_sim_t));
+   assert(sim);
+   sim->seed = seed;
+   sim->nextMac = 1;
+   sim->nodes = malloc(SIM_INITIAL_NODES * sizeof(sr_sim_node_t *));
+   sim->events = malloc(SIM_INITIAL_EVENTS * sizeof(sr_sim_event_t));
+   sim->eventCapacity = SIM_INITIAL_EVENTS;
+   assert(sim->nodes && sim->events);
+
+   /* Routers' timeouts are driven from the event queue, not a thread, and
+    * everything they stamp reads the simulation's clock. */
+   sr_clock_set_source(simClockSource, sim);
+   sr_multi_init(&sim->multi, false);
+   simSchedule(sim, SR_SIM_TICK_INTERVAL, sim_event_tick, NULL, NULL, 0);
+
+   activeSim = sim;
+   return sim;
+}
+
+/**
+ * SimDestroy()\n
+ * @brief Releases the simulation, its routers, hosts, links and pending events.
+ */
+void SimDestroy(sr_sim_t *sim)
+{
+   unsigned int i;
+
+   assert(sim == activeSim);
+
+   for (i = 0; i < sim->numEvents; i++)
+   {
+      free(sim->events[i].frame);
+   }
+   free(sim->events);
+
+   for (i = 0; i < sim->numNodes; i++)
+   {
+      sr_sim_node_t *node = sim->nodes[i];
+
+      if (node->router)
+      {
+         struct sr_instance *sr = node->router;
+         struct sr_arpreq *request;
+
+         if (sr->nat)
+         {
+            sr_nat_destroy(sr->nat);
+            free(sr->nat);
+         }
+         while ((request = sr->cache.requests) != NULL)
+         {
+            sr_arpreq_destroy(&sr->cache, request);
+         }
+         sr_arpcache_destroy(&sr->cache);
+         while (sr->if_list)
+         {
+            struct sr_if *next = sr->if_list->next;
+            free(sr->if_list);
+            sr->if_list = next;
+         }
+         while (sr->routing_table)
+         {
+            struct sr_rt *next = sr->routing_table->next;
+            free(sr->routing_table);
+            sr->routing_table = next;
+         }
+         free(sr);
+      }
+      while (node->host.pending)
+      {
+         sr_sim_pending_t *next = node->host.pending->next;
+         free(node->host.pending->frame);
+         free(node->host.pending);
+         node->host.pending = next;
+      }
+      free(node);
+   }
+   free(sim->nodes);
+
+   while (sim->links)
+   {
+      sr_sim_link_t *next = sim->links->next;
+      free(sim->links);
+      sim->links = next;
+   }
+
+   sr_multi_destroy(&sim->multi);
+   sr_clock_use_wall();
+   free(sim);
+   activeSim = NULL;
+}
+
+/**
+ * SimAddRouter()\n
+ * @brief Adds a router with no interfaces or routes.
+ * @param natEnabled true to run NAT with the usual default timeouts ("eth1"
+ *        is the internal interface).
+ */
+sr_sim_node_t *SimAddRouter(sr_sim_t *sim, const char *name, bool natEnabled)
+{
+   sr_sim_node_t *node = simNewNode(sim, name);
+   struct sr_instance *sr = calloc(1, sizeof(struct sr_instance));
+
+   assert(sr);
+   sr->sockfd = -1;
+   strncpy(sr->host, name, sizeof(sr->host) - 1);
+   sr->multi = &sim->multi;
+
+   if (natEnabled)
+   {
+      sr->nat = malloc(sizeof(sr_nat_t));
+      assert(sr->nat);
+      sr_nat_init_state(sr->nat);
+      sr->nat->routerState = sr;
+      sr->nat->icmpTimeout = SIM_DEFAULT_ICMP_TIMEOUT;
+      sr->nat->tcpEstablishedTimeout = SIM_DEFAULT_TCP_ESTABLISHED_TIMEOUT;
+      sr->nat->tcpTransitoryTimeout = SIM_DEFAULT_TCP_TRANSITORY_TIMEOUT;
+      sr->nat->tcpTimeWaitTimeout = SIM_DEFAULT_TCP_TIME_WAIT_TIMEOUT;
+   }
+
+   sr_init(sr);
+   sr_multi_add(&sim->multi, sr);
+
+   node->router = sr;
+   return node;
+}
+
+/**
+ * SimAddRouterInterface()\n
+ * @brief Adds an interface with a generated MAC address to a router.
+ */
+void SimAddRouterInterface(sr_sim_t *sim, sr_sim_node_t *router, const char *iface, uint32_t ip)
+{
+   uint8_t mac[ETHER_ADDR_LEN];
+
+   assert(router->router);
+   simNextMac(sim, mac);
+   sr_add_interface(router->router, iface);
+   sr_set_ether_addr(router->router, mac);
+   sr_set_ether_ip(router->router, htonl(ip));
+   simGetPort(router, iface, true);
+}
+
+/**
+ * SimAddRoute()\n
+ * @brief Adds a static route. The gateway must be the next hop's address,
+ *        even for directly connected destinations.
+ */
+void SimAddRoute(sr_sim_node_t *router, uint32_t destination, uint32_t mask, uint32_t gateway,
+   const char *iface)
+{
+   struct in_addr dest, gw, netmask;
+   char name[sr_IFACE_NAMELEN];
+
+   assert(router->router);
+   dest.s_addr = htonl(destination);
+   gw.s_addr = htonl(gateway);
+   netmask.s_addr = htonl(mask);
+   strncpy(name, iface, sizeof(name) - 1);
+   name[sizeof(name) - 1] = '\0';
+   sr_add_rt_entry(router->router, dest, gw, netmask, name);
+}
+
+/**
+ * SimAddHost()\n
+ * @brief Adds a host with a single interface, SR_SIM_HOST_IFACE.
+ * @param echo true to answer every TCP SYN with a SYN/ACK.
+ */
+sr_sim_node_t *SimAddHost(sr_sim_t *sim, const char *name, uint32_t ip, uint32_t gateway, bool echo)
+{
+   sr_sim_node_t *node = simNewNode(sim, name);
+
+   node->host.ip = htonl(ip);
+   node->host.gatewayIp = htonl(gateway);
+   node->host.echo = echo;
+   node->host.arpSentAt = -1.0;
+   node->host.stats.firstRtt = -1.0;
+   simNextMac(sim, node->host.mac);
+   simGetPort(node, SR_SIM_HOST_IFACE, true);
+
+   return node;
+}
+
+/**
+ * SimConnect()\n
+ * @brief Connects two interfaces with a full duplex link. Each direction
+ *        gets the same parameters and its own queue.
+ * @return the a-to-b direction; its next field is the b-to-a direction.
+ */
+sr_sim_link_t *SimConnect(sr_sim_t *sim, sr_sim_node_t *a, const char *aIface, sr_sim_node_t *b,
+   const char *bIface, const sr_sim_link_params_t *params)
+{
+   sr_sim_port_t *portA = simGetPort(a, aIface, a->router == NULL);
+   sr_sim_port_t *portB = simGetPort(b, bIface, b->router == NULL);
+   sr_sim_link_t *forward = calloc(1, sizeof(sr_sim_link_t));
+   sr_sim_link_t *reverse = calloc(1, sizeof(sr_sim_link_t));
+
+   assert(portA && portB && forward && reverse);
+   assert((portA->out == NULL) && (portB->out == NULL));
+
+   forward->params = *params;
+   forward->to = portB;
+   reverse->params = *params;
+   reverse->to = portA;
+   portA->out = forward;
+   portB->out = reverse;
+
+   reverse->next = sim->links;
+   forward->next = reverse;
+   sim->links = forward;
+
+   return forward;
+}
+
+/**
+ * SimHostSendTcp()\n
+ * @brief Schedules a TCP segment from a host. The segment carries its send
+ *        time so the host can time the reply.
+ * @param when virtual time to send at; must not be in the past.
+ */
+void SimHostSendTcp(sr_sim_t *sim, sr_sim_node_t *host, double when, uint32_t destination,
+   uint16_t sourcePort, uint16_t destinationPort, uint16_t controlBits)
+{
+   uint8_t *frame;
+
+   assert(host->router == NULL);
+   assert(when >= sim->now);
+
+   frame = simBuildTcpFrame(host, htonl(destination), htons(sourcePort), htons(destinationPort),
+      controlBits, when);
+   simSchedule(sim, when, sim_event_host_send, host, frame, SIM_TCP_FRAME_LEN);
+}
+
+/**
+ * SimRun()\n
+ * @brief Processes every event up to and including the given virtual time.
+ */
+void SimRun(sr_sim_t *sim, double until)
+{
+   while ((sim->numEvents > 0) && (sim->events[0].time <= until))
+   {
+      sr_sim_event_t event = simPop(sim);
+      simDispatch(sim, &event);
+   }
+
+   if (sim->now < until)
+   {
+      sim->now = until;
+   }
+}
+
+/**
+ * SimRunUntilIdle()\n
+ * @brief Processes events until only router timeout ticks remain (or the
+ *        limit is reached). Retransmissions triggered by a tick count as
+ *        traffic, so lossy runs settle before this returns.
+ */
+void SimRunUntilIdle(sr_sim_t *sim, double limit)
+{
+   while ((sim->numEvents > 0) && (sim->events[0].time <= limit))
+   {
+      sr_sim_event_t event;
+
+      if (sim->trafficEvents == 0)
+      {
+         /* Give outstanding ARP requests the ticks they need to finish. */
+         bool requestsPending = false;
+         unsigned int i;
+         for (i = 0; (i < sim->numNodes) && !requestsPending; i++)
+         {
+            requestsPending = sim->nodes[i]->router && sim->nodes[i]->router->cache.requests;
+         }
+         if (!requestsPending)
+         {
+            break;
+         }
+      }
+
+      event = simPop(sim);
+      simDispatch(sim, &event);
+   }
+}
+
+/**
+ * sr_send_packet()\n
+ * @brief Replaces the VNS client: puts a router's frame on the simulated link.
+ */
+int sr_send_packet(struct sr_instance *sr, uint8_t *buf, unsigned int len, const char *iface)
+{
+   sr_sim_port_t *port;
+
+   assert(activeSim);
+   port = simFindRouterPort(activeSim, sr, iface);
+   if (port == NULL)
+   {
+      return -1;
+   }
+
+   simTransmit(activeSim, port, buf, len);
+   return 0;
+}
+
+/** Normally defined by sr_vns_comm.c; simulated routers never have a session. */
+int sr_read_from_server(struct sr_instance *sr)
+{
+   (void) sr;
+   return 0;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/** Whole virtual seconds since SR_CLOCK_VIRTUAL_EPOCH, as the routers see them. */
+static time_t simClockSource(void *sim_ptr)
+{
+   return SR_CLOCK_VIRTUAL_EPOCH + (time_t) ((sr_sim_t *) sim_ptr)->now;
+}
+
+static bool simEventBefore(const sr_sim_event_t *a, const sr_sim_event_t *b)
+{
+   return (a->time < b->time) || ((a->time == b->time) && (a->sequence < b->sequence));
+}
+
+static void simSchedule(sr_sim_t *sim, double time, sr_sim_event_type_t type, void *target,
+   uint8_t *frame, unsigned int length)
+{
+   unsigned int child;
+
+   if (sim->numEvents == sim->eventCapacity)
+   {
+      sim->eventCapacity *= 2;
+      sim->events = realloc(sim->events, sim->eventCapacity * sizeof(sr_sim_event_t));
+      assert(sim->events);
+   }
+
+   child = sim->numEvents++;
+   sim->events[child].time = time;
+   sim->events[child].sequence = sim->nextSequence++;
+   sim->events[child].type = type;
+   sim->events[child].target = target;
+   sim->events[child].frame = frame;
+   sim->events[child].length = length;
+
+   while (child > 0)
+   {
+      unsigned int parent = (child - 1) / 2;
+      sr_sim_event_t swap;
+
+      if (!simEventBefore(&sim->events[child], &sim->events[parent]))
+      {
+         break;
+      }
+      swap = sim->events[parent];
+      sim->events[parent] = sim->events[child];
+      sim->events[child] = swap;
+      child = parent;
+   }
+
+   if (type != sim_event_tick)
+   {
+      sim->trafficEvents++;
+   }
+}
+
+static sr_sim_event_t simPop(sr_sim_t *sim)
+{
+   sr_sim_event_t top = sim->events[0];
+   unsigned int parent = 0;
+
+   sim->events[0] = sim->events[--sim->numEvents];
+   while (1)
+   {
+      unsigned int smallest = parent;
+      unsigned int left = 2 * parent + 1;
+      unsigned int right = left + 1;
+      sr_sim_event_t swap;
+
+      if ((left < sim->numEvents) && simEventBefore(&sim->events[left], &sim->events[smallest]))
+      {
+         smallest = left;
+      }
+      if ((right < sim->numEvents) && simEventBefore(&sim->events[right], &sim->events[smallest]))
+      {
+         smallest = right;
+      }
+      if (smallest == parent)
+      {
+         break;
+      }
+      swap = sim->events[parent];
+      sim->events[parent] = sim->events[smallest];
+      sim->events[smallest] = swap;
+      parent = smallest;
+   }
+
+   if (top.type != sim_event_tick)
+   {
+      sim->trafficEvents--;
+   }
+   return top;
+}
+
+static void simDispatch(sr_sim_t *sim, sr_sim_event_t *event)
+{
+   sim->now = event->time;
+   sim->eventsProcessed++;
+
+   switch (event->type)
+   {
+      case sim_event_tick:
+         sr_multi_tick(&sim->multi);
+         simSchedule(sim, sim->now + SR_SIM_TICK_INTERVAL, sim_event_tick, NULL, NULL, 0);
+         break;
+
+      case sim_event_deliver:
+      {
+         sr_sim_port_t *port = (sr_sim_port_t *) event->target;
+         if (port->node->router)
+         {
+            sr_handlepacket(port->node->router, event->frame, event->length, port->iface);
+         }
+         else
+         {
+            simHostReceive(sim, port->node, event->frame, event->length);
+         }
+         free(event->frame);
+         break;
+      }
+
+      case sim_event_host_send:
+         /* Ownership of the frame passes to the host. */
+         simHostSend(sim, (sr_sim_node_t *) event->target, event->frame, event->length);
+         break;
+
+      case sim_event_host_arp_retry:
+      {
+         sr_sim_node_t *node = (sr_sim_node_t *) event->target;
+         if (!node->host.gatewayKnown && node->host.pending)
+         {
+            simHostSendArp(sim, node, arp_op_request, broadcastMac, node->host.gatewayIp);
+         }
+         break;
+      }
+   }
+}
+
+static sr_sim_node_t *simNewNode(sr_sim_t *sim, const char *name)
+{
+   sr_sim_node_t *node = calloc(1, sizeof(sr_sim_node_t));
+
+   assert(node);
+   strncpy(node->name, name, sizeof(node->name) - 1);
+
+   if ((sim->numNodes >= SIM_INITIAL_NODES) && ((sim->numNodes & (sim->numNodes - 1)) == 0))
+   {
+      sim->nodes = realloc(sim->nodes, 2 * sim->numNodes * sizeof(sr_sim_node_t *));
+      assert(sim->nodes);
+   }
+   sim->nodes[sim->numNodes++] = node;
+
+   return node;
+}
+
+static sr_sim_port_t *simGetPort(sr_sim_node_t *node, const char *iface, bool create)
+{
+   unsigned int i;
+
+   for (i = 0; i < node->numPorts; i++)
+   {
+      if (strncmp(node->ports[i].iface, iface, sr_IFACE_NAMELEN) == 0)
+      {
+         return &node->ports[i];
+      }
+   }
+
+   if (!create || (node->numPorts == SR_SIM_MAX_PORTS))
+   {
+      return NULL;
+   }
+
+   node->ports[node->numPorts].node = node;
+   strncpy(node->ports[node->numPorts].iface, iface, sr_IFACE_NAMELEN - 1);
+   return &node->ports[node->numPorts++];
+}
+
+static sr_sim_port_t *simFindRouterPort(sr_sim_t *sim, struct sr_instance *sr, const char *iface)
+{
+   unsigned int i;
+
+   for (i = 0; i < sim->numNodes; i++)
+   {
+      if (sim->nodes[i]->router == sr)
+      {
+         return simGetPort(sim->nodes[i], iface, false);
+      }
+   }
+   return NULL;
+}
+
+static void simNextMac(sr_sim_t *sim, uint8_t *mac)
+{
+   /* Locally administered, unicast. */
+   mac[0] = 0x02;
+   mac[1] = 0x00;
+   mac[2] = (sim->nextMac >> 24) & 0xFF;
+   mac[3] = (sim->nextMac >> 16) & 0xFF;
+   mac[4] = (sim->nextMac >> 8) & 0xFF;
+   mac[5] = sim->nextMac & 0xFF;
+   sim->nextMac++;
+}
+
+/**
+ * simTransmit()\n
+ * @brief Queues a copy of a frame on the port's outgoing link.
+ * @note A lost frame still occupies the link for its serialization time.
+ */
+static void simTransmit(sr_sim_t *sim, sr_sim_port_t *port, const uint8_t *frame, unsigned int length)
+{
+   sr_sim_link_t *link = port->out;
+   double start, serialization = 0.0;
+   uint8_t *copy;
+
+   if (link == NULL)
+   {
+      return;
+   }
+
+   start = (link->busyUntil > sim->now) ? link->busyUntil : sim->now;
+   if (link->params.bandwidthBps > 0.0)
+   {
+      serialization = (length * 8.0) / link->params.bandwidthBps;
+
+      if ((link->params.queueLimitBytes > 0)
+         && (((start - sim->now) * link->params.bandwidthBps / 8.0) + length
+            > link->params.queueLimitBytes))
+      {
+         link->stats.framesDropped++;
+         return;
+      }
+   }
+
+   link->busyUntil = start + serialization;
+   link->stats.framesSent++;
+   link->stats.bytesSent += length;
+
+   if ((link->params.lossRate > 0.0)
+      && ((rand_r(&sim->seed) / (RAND_MAX + 1.0)) < link->params.lossRate))
+   {
+      link->stats.framesLost++;
+      return;
+   }
+
+   copy = malloc(length);
+   assert(copy);
+   memcpy(copy, frame, length);
+   simSchedule(sim, link->busyUntil + link->params.delay, sim_event_deliver, link->to, copy, length);
+}
+
+static void simHostReceive(sr_sim_t *sim, sr_sim_node_t *node, uint8_t *frame, unsigned int length)
+{
+   sr_sim_host_t *host = &node->host;
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+
+   if ((length < sizeof(sr_ethernet_hdr_t))
+      || ((memcmp(ethernetHeader->ether_dhost, host->mac, ETHER_ADDR_LEN) != 0)
+         && (memcmp(ethernetHeader->ether_dhost, broadcastMac, ETHER_ADDR_LEN) != 0)))
+   {
+      return;
+   }
+
+   if ((ntohs(ethernetHeader->ether_type) == ethertype_arp) && (length >= SIM_ARP_FRAME_LEN))
+   {
+      sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+
+      if (arpHeader->ar_tip != host->ip)
+      {
+         return;
+      }
+
+      if (ntohs(arpHeader->ar_op) == arp_op_request)
+      {
+         simHostSendArp(sim, node, arp_op_reply, arpHeader->ar_sha, arpHeader->ar_sip);
+      }
+      else if ((ntohs(arpHeader->ar_op) == arp_op_reply) && (arpHeader->ar_sip == host->gatewayIp)
+         && !host->gatewayKnown)
+      {
+         memcpy(host->gatewayMac, arpHeader->ar_sha, ETHER_ADDR_LEN);
+         host->gatewayKnown = true;
+
+         while (host->pending)
+         {
+            sr_sim_pending_t *pending = host->pending;
+            host->pending = pending->next;
+            simHostSend(sim, node, pending->frame, pending->length);
+            free(pending);
+         }
+      }
+   }
+   else if ((ntohs(ethernetHeader->ether_type) == ethertype_ip) && (length >= SIM_TCP_FRAME_LEN))
+   {
+      sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+      sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+      uint16_t controlBits = ntohs(tcpHeader->offset_controlBits) & ~TCP_OFFSET_M;
+      double stamp;
+
+      if ((ipHeader->ip_dst != host->ip) || (ipHeader->ip_p != ip_protocol_tcp))
+      {
+         return;
+      }
+
+      host->stats.tcpReceived++;
+      memcpy(&stamp, ((uint8_t *) tcpHeader) + sizeof(sr_tcp_hdr_t), sizeof(stamp));
+
+      if ((controlBits & (TCP_SYN_M | TCP_ACK_M)) == (TCP_SYN_M | TCP_ACK_M))
+      {
+         double rtt = sim->now - stamp;
+         if (host->stats.repliesReceived == 0)
+         {
+            host->stats.firstRtt = rtt;
+         }
+         host->stats.repliesReceived++;
+         host->stats.rttSum += rtt;
+      }
+      else if ((controlBits & TCP_SYN_M) && host->echo)
+      {
+         uint8_t *reply = simBuildTcpFrame(node, ipHeader->ip_src, tcpHeader->destinationPort,
+            tcpHeader->sourcePort, TCP_SYN_M | TCP_ACK_M, stamp);
+         simHostSend(sim, node, reply, SIM_TCP_FRAME_LEN);
+      }
+   }
+}
+
+/**
+ * simHostSend()\n
+ * @brief Sends (and frees) a frame to the host's gateway, ARPing for it first if needed.
+ */
+static void simHostSend(sr_sim_t *sim, sr_sim_node_t *node, uint8_t *frame, unsigned int length)
+{
+   sr_sim_host_t *host = &node->host;
+
+   if (host->gatewayKnown)
+   {
+      memcpy(((sr_ethernet_hdr_t *) frame)->ether_dhost, host->gatewayMac, ETHER_ADDR_LEN);
+      host->stats.tcpSent++;
+      simTransmit(sim, &node->ports[0], frame, length);
+      free(frame);
+   }
+   else
+   {
+      sr_sim_pending_t *pending = malloc(sizeof(sr_sim_pending_t));
+      sr_sim_pending_t **tail = &host->pending;
+
+      assert(pending);
+      pending->frame = frame;
+      pending->length = length;
+      pending->next = NULL;
+      while (*tail)
+      {
+         tail = &((*tail)->next);
+      }
+      *tail = pending;
+
+      if ((host->arpSentAt < 0.0) || (sim->now - host->arpSentAt >= SR_SIM_ARP_RETRY))
+      {
+         simHostSendArp(sim, node, arp_op_request, broadcastMac, host->gatewayIp);
+      }
+   }
+}
+
+static void simHostSendArp(sr_sim_t *sim, sr_sim_node_t *node, uint16_t op, const uint8_t *targetMac,
+   uint32_t targetIp)
+{
+   uint8_t frame[SIM_ARP_FRAME_LEN];
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_arp_hdr_t *arpHeader = (sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+
+   memcpy(ethernetHeader->ether_dhost, targetMac, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, node->host.mac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_arp);
+
+   arpHeader->ar_hrd = htons(arp_hrd_ethernet);
+   arpHeader->ar_pro = htons(ethertype_ip);
+   arpHeader->ar_hln = ETHER_ADDR_LEN;
+   arpHeader->ar_pln = IP_ADDR_LEN;
+   arpHeader->ar_op = htons(op);
+   memcpy(arpHeader->ar_sha, node->host.mac, ETHER_ADDR_LEN);
+   arpHeader->ar_sip = node->host.ip;
+   memcpy(arpHeader->ar_tha, (op == arp_op_request) ? (const uint8_t *) "\0\0\0\0\0\0" : targetMac,
+      ETHER_ADDR_LEN);
+   arpHeader->ar_tip = targetIp;
+
+   if (op == arp_op_request)
+   {
+      node->host.arpSentAt = sim->now;
+      node->host.stats.arpRequestsSent++;
+      simSchedule(sim, sim->now + SR_SIM_ARP_RETRY, sim_event_host_arp_retry, node, NULL, 0);
+   }
+
+   simTransmit(sim, &node->ports[0], frame, sizeof(frame));
+}
+
+/**
+ * simBuildTcpFrame()\n
+ * @brief Builds a checksummed TCP segment from a host, with the stamp as payload.
+ * @note Addresses and ports in network byte order. The Ethernet destination
+ *       is filled in when the frame is sent.
+ */
+static uint8_t *simBuildTcpFrame(sr_sim_node_t *node, uint32_t destination, uint16_t sourcePort,
+   uint16_t destinationPort, uint16_t controlBits, double stamp)
+{
+   uint8_t *frame = calloc(1, SIM_TCP_FRAME_LEN);
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+
+   assert(frame);
+   memcpy(ethernetHeader->ether_shost, node->host.mac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_ip);
+
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t) + SIM_STAMP_LEN);
+   ipHeader->ip_ttl = SIM_HOST_TTL;
+   ipHeader->ip_p = ip_protocol_tcp;
+   ipHeader->ip_src = node->host.ip;
+   ipHeader->ip_dst = destination;
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+
+   tcpHeader->sourcePort = sourcePort;
+   tcpHeader->destinationPort = destinationPort;
+   tcpHeader->offset_controlBits = htons((5 << 12) | controlBits);
+   tcpHeader->window = htons(65535);
+   memcpy(((uint8_t *) tcpHeader) + sizeof(sr_tcp_hdr_t), &stamp, SIM_STAMP_LEN);
+   simTcpChecksum(ipHeader);
+
+   return frame;
+}
+
+static void simTcpChecksum(sr_ip_hdr_t *ipHeader)
+{
+   uint8_t pseudo[sizeof(sr_tcp_ip_pseudo_hdr_t) + sizeof(sr_tcp_hdr_t) + SIM_STAMP_LEN];
+   sr_tcp_ip_pseudo_hdr_t *pseudoHeader = (sr_tcp_ip_pseudo_hdr_t *) pseudo;
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+
+   tcpHeader->checksum = 0;
+   pseudoHeader->sourceAddress = ipHeader->ip_src;
+   pseudoHeader->destinationAddress = ipHeader->ip_dst;
+   pseudoHeader->zeros = 0;
+   pseudoHeader->protocol = ip_protocol_tcp;
+   pseudoHeader->tcpLength = htons(sizeof(sr_tcp_hdr_t) + SIM_STAMP_LEN);
+   memcpy(pseudo + sizeof(sr_tcp_ip_pseudo_hdr_t), tcpHeader, sizeof(sr_tcp_hdr_t) + SIM_STAMP_LEN);
+   tcpHeader->checksum = cksum(pseudo, sizeof(pseudo));
+}
@@ -0,0 +1,175 @@
+/**
+ * @file sr_sim.h
+ * @brief In-process network simulator for multi-router scale tests.
+ *
+ * Instantiates any number of routers (complete sr_instances, optionally with
+ * NAT) and synthetic hosts, and wires their interfaces together with
+ * point-to-point links that have a bandwidth, a propagation delay, a loss
+ * rate and an optional queue limit. Nothing touches the network:
+ * sr_send_packet() is provided here and hands frames to the simulated link.
+ *
+ * Everything runs on one thread under a virtual clock. Frame deliveries,
+ * host transmissions and the routers' once-a-second ARP/NAT timeouts (via an
+ * sr_multi without a timer thread) are events in a single queue processed in
+ * time order, ties broken by insertion order, and losses come from a seeded
+ * generator. Routers read the time through sr_clock, so ARP and NAT
+ * entries age in virtual time too. The same topology, traffic and seed
+ * always give the same
+ * result, however long the simulated run, and runs are far faster than real
+ * time.
+ *
+ * Hosts have one interface ("eth0") and a default gateway. They resolve the
+ * gateway with ARP, answer ARP requests for their own address and, when
+ * echoing, answer every TCP SYN with a SYN/ACK carrying the same payload.
+ * Packets sent by SimHostSendTcp() carry their virtual send time, so replies
+ * give round trip times.
+ *
+ * Addresses in this API are in host byte order.
+ */
+
+#ifndef SR_SIM_H
+#define SR_SIM_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "sr_router.h"
+#include "sr_multi.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_SIM_MAX_PORTS        (8)
+#define SR_SIM_HOST_IFACE       "eth0"
+#define SR_SIM_TICK_INTERVAL    (1.0)  /**< Virtual seconds between router timeout ticks. */
+#define SR_SIM_ARP_RETRY        (1.0)  /**< Virtual seconds between a host's ARP requests. */
+
+/*
+ * Public Types
+ */
+
+typedef struct sr_sim_link_params
+{
+   double bandwidthBps; /**< 0 for infinite. */
+   double delay; /**< Propagation delay in seconds. */
+   double lossRate; /**< Probability that a frame is lost, 0 to 1. */
+   unsigned int queueLimitBytes; /**< Bytes waiting to be serialized before tail drop. 0 for no limit. */
+} sr_sim_link_params_t;
+
+typedef struct sr_sim_link_stats
+{
+   uint64_t framesSent;
+   uint64_t bytesSent;
+   uint64_t framesLost;
+   uint64_t framesDropped; /**< Queue overflow. */
+} sr_sim_link_stats_t;
+
+typedef struct sr_sim_host_stats
+{
+   uint64_t arpRequestsSent;
+   uint64_t tcpSent;
+   uint64_t tcpReceived; /**< TCP segments addressed to this host. */
+   uint64_t repliesReceived; /**< SYN/ACKs answering one of our SYNs. */
+   double rttSum; /**< Sum of round trip times of those replies. */
+   double firstRtt; /**< Round trip time of the first reply, -1 if none yet. */
+} sr_sim_host_stats_t;
+
+struct sr_sim;
+struct sr_sim_node;
+struct sr_sim_link;
+
+typedef struct sr_sim_port
+{
+   struct sr_sim_node *node;
+   char iface[sr_IFACE_NAMELEN];
+   struct sr_sim_link *out; /**< Link carrying frames away from this port. */
+} sr_sim_port_t;
+
+typedef struct sr_sim_link
+{
+   sr_sim_link_params_t params;
+   sr_sim_port_t *to;
+   double busyUntil; /**< Virtual time the last queued frame finishes serializing. */
+   sr_sim_link_stats_t stats;
+   struct sr_sim_link *next;
+} sr_sim_link_t;
+
+typedef struct sr_sim_pending
+{
+   uint8_t *frame;
+   unsigned int length;
+   struct sr_sim_pending *next;
+} sr_sim_pending_t;
+
+typedef struct sr_sim_host
+{
+   uint32_t ip; /**< Network byte order. */
+   uint8_t mac[ETHER_ADDR_LEN];
+   uint32_t gatewayIp; /**< Network byte order. */
+   uint8_t gatewayMac[ETHER_ADDR_LEN];
+   bool gatewayKnown;
+   bool echo;
+   double arpSentAt;
+   sr_sim_pending_t *pending; /**< Frames waiting on the gateway's MAC. */
+   sr_sim_host_stats_t stats;
+} sr_sim_host_t;
+
+typedef struct sr_sim_node
+{
+   char name[32];
+   struct sr_instance *router; /**< NULL for hosts. */
+   sr_sim_host_t host;
+   sr_sim_port_t ports[SR_SIM_MAX_PORTS];
+   unsigned int numPorts;
+} sr_sim_node_t;
+
+typedef struct sr_sim_event sr_sim_event_t;
+
+typedef struct sr_sim
+{
+   double now; /**< Virtual time in seconds. */
+   uint64_t nextSequence;
+   unsigned int seed;
+
+   sr_sim_node_t **nodes;
+   unsigned int numNodes;
+   sr_sim_link_t *links;
+   sr_multi_t multi;
+   uint32_t nextMac;
+
+   /* Event queue: binary heap ordered by (time, sequence). */
+   sr_sim_event_t *events;
+   unsigned int numEvents;
+   unsigned int eventCapacity;
+   unsigned int trafficEvents; /**< Queued events other than timer ticks. */
+
+   uint64_t eventsProcessed;
+} sr_sim_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_sim_t *SimCreate(unsigned int seed);
+void SimDestroy(sr_sim_t *sim);
+
+sr_sim_node_t *SimAddRouter(sr_sim_t *sim, const char *name, bool natEnabled);
+void SimAddRouterInterface(sr_sim_t *sim, sr_sim_node_t *router, const char *iface, uint32_t ip);
+void SimAddRoute(sr_sim_node_t *router, uint32_t destination, uint32_t mask, uint32_t gateway,
+   const char *iface);
+sr_sim_node_t *SimAddHost(sr_sim_t *sim, const char *name, uint32_t ip, uint32_t gateway, bool echo);
+sr_sim_link_t *SimConnect(sr_sim_t *sim, sr_sim_node_t *a, const char *aIface, sr_sim_node_t *b,
+   const char *bIface, const sr_sim_link_params_t *params);
+
+void SimHostSendTcp(sr_sim_t *sim, sr_sim_node_t *host, double when, uint32_t destination,
+   uint16_t sourcePort, uint16_t destinationPort, uint16_t controlBits);
+
+void SimRun(sr_sim_t *sim, double until);
+void SimRunUntilIdle(sr_sim_t *sim, double limit);
+
+#endif /* SR_SIM_H */
@@ -0,0 +1,160 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "TestRouter.h"
+
+extern "C"
+{
+#include "sr_clock.h"
+}
+
+#define NEIGHBOUR     (0x0A000166) /* 10.0.1.102 */
+#define REVALIDATIONS (5)          /* MAX_NUM_ARP_TRANSMISSIONS */
+
+static const uint8_t neighbourMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x09, 0x66 };
+
+TEST_GROUP(ArpCacheTests)
+{
+   struct sr_instance sr;
+   char persistFile[64];
+   
+   void setup()
+   {
+      snprintf(persistFile, sizeof(persistFile), "/tmp/sr_arpcache_test.%d", (int) getpid());
+      sr.cache.persistFile = persistFile;
+      TestRouterSetup(&sr, false);
+      mock().ignoreOtherCalls();
+   }
+   
+   void teardown()
+   {
+      char tempFile[sizeof(persistFile) + 4];
+      
+      TestRouterTeardown(&sr);
+      mock().checkExpectations();
+      mock().clear();
+      
+      snprintf(tempFile, sizeof(tempFile), "%s.tmp", persistFile);
+      unlink(persistFile);
+      unlink(tempFile);
+   }
+   
+   /** Caches the neighbour, snapshots the cache and restarts the router. */
+   void restartWithNeighbour(const char *interface)
+   {
+      sr_arpcache_insert(&(sr.cache), (unsigned char *) neighbourMac, NEIGHBOUR, interface);
+      LONGS_EQUAL(0, sr_arpcache_save(&(sr.cache)));
+      TestRouterTeardown(&sr);
+      TestRouterSetup(&sr, false);
+   }
+   
+   sr_arpentry_t *entry(uint32_t ip)
+   {
+      for (int i = 0; i < SR_ARPCACHE_SZ; i++)
+      {
+         if (sr.cache.entries[i].valid && (sr.cache.entries[i].ip == ip))
+         {
+            return &(sr.cache.entries[i]);
+         }
+      }
+      return NULL;
+   }
+   
+   void tick(unsigned int seconds)
+   {
+      for (unsigned int i = 0; i < seconds; i++)
+      {
+         sr_clock_advance(1);
+         sr_arpcache_tick(&sr);
+      }
+   }
+   
+   /** From here on, any frame the router sends must have been expected. */
+   void expectOnly()
+   {
+      mock().checkExpectations();
+      mock().clear();
+   }
+};
+
+TEST(ArpCacheTests, SnapshotRestoredAsStale)
+{
+   restartWithNeighbour(TEST_INTERNAL_IFACE);
+   
+   sr_arpentry_t *restored = sr_arpcache_lookup(&(sr.cache), NEIGHBOUR);
+   CHECK(restored);
+   LONGS_EQUAL(1, restored->stale);
+   STRCMP_EQUAL(TEST_INTERNAL_IFACE, restored->iface);
+   MEMCMP_EQUAL(neighbourMac, restored->mac, ETHER_ADDR_LEN);
+   free(restored);
+   
+   /* Neighbours learned since are current. */
+   LONGS_EQUAL(0, entry(TEST_HOST_A)->stale);
+}
+
+TEST(ArpCacheTests, StaleEntryRevalidatedThenAgesOut)
+{
+   restartWithNeighbour(TEST_INTERNAL_IFACE);
+   
+   expectOnly();
+   mock().expectNCalls(REVALIDATIONS, "SendPacket")
+      .withParameter("Interface", TEST_INTERNAL_IFACE)
+      .withParameter("EthernetProtocol", ethertype_arp)
+      .withParameter("TargetProtocolAddress", (int) NEIGHBOUR)
+      .ignoreOtherParameters();
+   tick(REVALIDATIONS + 2);
+   mock().checkExpectations();
+   CHECK(entry(NEIGHBOUR));
+   
+   /* Never confirmed, so it expires like any other entry. */
+   tick(SR_ARPCACHE_TO - (REVALIDATIONS + 2) + 1);
+   CHECK(entry(NEIGHBOUR) == NULL);
+}
+
+TEST(ArpCacheTests, ConfirmedEntryNotRevalidated)
+{
+   restartWithNeighbour(TEST_INTERNAL_IFACE);
+   
+   /* A reply from the neighbour refreshes the entry. */
+   sr_arpcache_insert(&(sr.cache), (unsigned char *) neighbourMac, NEIGHBOUR, TEST_INTERNAL_IFACE);
+   LONGS_EQUAL(0, entry(NEIGHBOUR)->stale);
+   
+   expectOnly();
+   tick(REVALIDATIONS);
+}
+
+TEST(ArpCacheTests, EntryOnMissingInterfaceDropped)
+{
+   restartWithNeighbour("eth9");
+   CHECK(entry(NEIGHBOUR));
+   
+   expectOnly();
+   tick(1);
+   CHECK(entry(NEIGHBOUR) == NULL);
+}
+
+TEST(ArpCacheTests, OldSnapshotEntriesSkipped)
+{
+   sr_arpcache_insert(&(sr.cache), (unsigned char *) neighbourMac, NEIGHBOUR, TEST_INTERNAL_IFACE);
+   entry(NEIGHBOUR)->added -= SR_ARPCACHE_RESTORE_MAX_AGE + 1;
+   entry(TEST_HOST_A)->added -= SR_ARPCACHE_RESTORE_MAX_AGE;
+   LONGS_EQUAL(0, sr_arpcache_save(&(sr.cache)));
+   
+   /* Just the cache restarted, so only restored entries are in it. */
+   sr_arpcache_destroy(&(sr.cache));
+   sr_arpcache_init(&(sr.cache));
+   
+   CHECK(entry(NEIGHBOUR) == NULL);
+   CHECK(entry(TEST_HOST_A));
+   LONGS_EQUAL(1, entry(TEST_HOST_A)->stale);
+}
+
+TEST(ArpCacheTests, SaveWithoutFileIsNoop)
+{
+   sr.cache.persistFile = NULL;
+   LONGS_EQUAL(0, sr_arpcache_save(&(sr.cache)));
+   CHECK(access(persistFile, F_OK) != 0);
+}
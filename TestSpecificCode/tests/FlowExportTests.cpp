@@ -0,0 +1,158 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "TestRouter.h"
+
+extern "C"
+{
+#include "sr_clock.h"
+#include "sr_codec.h"
+#include "sr_flow.h"
+#include "sr_nat.h"
+}
+
+#define CLIENT_PORT    (4000)
+#define SERVER_PORT    (80)
+#define ACTIVE_TIMEOUT (10)
+#define SEGMENT_LEN    (sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t))
+
+TEST_GROUP(FlowExportTests)
+{
+   struct sr_instance sr;
+   char flowFile[64];
+   
+   void setup()
+   {
+      snprintf(flowFile, sizeof(flowFile), "/tmp/sr_flow_test.%d", (int) getpid());
+      unlink(flowFile);
+      mock().ignoreOtherCalls();
+   }
+   
+   void teardown()
+   {
+      sr_flow_destroy(sr.flows);
+      sr.flows = NULL;
+      TestRouterTeardown(&sr);
+      mock().checkExpectations();
+      mock().clear();
+      unlink(flowFile);
+   }
+   
+   void start(bool natEnabled)
+   {
+      sr.cache.persistFile = NULL;
+      TestRouterSetup(&sr, natEnabled);
+      sr.flows = sr_flow_create(flowFile, ACTIVE_TIMEOUT, 1);
+      CHECK(sr.flows);
+   }
+   
+   /** Host A's handshake with server one: two segments out, one back. */
+   void openConnection()
+   {
+      sr_nat_mapping_t *mapping;
+      uint16_t externalPort;
+      
+      TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+         SERVER_PORT, TCP_SYN_M, 1000, 0);
+      mapping = sr_nat_lookup_internal(sr.nat, htonl(TEST_HOST_A), htons(CLIENT_PORT), nat_mapping_tcp);
+      CHECK(mapping);
+      externalPort = ntohs(mapping->aux_ext);
+      free(mapping);
+      
+      TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+         externalPort, TCP_SYN_M | TCP_ACK_M, 5000, 1001);
+      TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+         SERVER_PORT, TCP_ACK_M, 1001, 5001);
+   }
+   
+   void tick(unsigned int seconds)
+   {
+      sr_clock_advance(seconds);
+      sr_nat_tick(sr.nat);
+   }
+   
+   /** Ends the exporter as the router does on shutdown; returns the records written. */
+   uint64_t finish(sr_flow_record_t *totals)
+   {
+      uint64_t records = 0;
+      FILE *in;
+      
+      if (sr.nat)
+      {
+         sr_nat_flush_flows(sr.nat);
+      }
+      sr_flow_destroy(sr.flows);
+      sr.flows = NULL;
+      
+      in = fopen(flowFile, "rb");
+      CHECK(in);
+      LONGS_EQUAL(0, sr_codec_flow_decode(in, NULL, &records, totals));
+      fclose(in);
+      return records;
+   }
+};
+
+TEST(FlowExportTests, ActiveTimeoutExportsRunningConnection)
+{
+   sr_flow_record_t totals;
+   
+   start(true);
+   openConnection();
+   
+   tick(ACTIVE_TIMEOUT - 1);
+   LONGS_EQUAL(0, sr.flows->head);
+   tick(1);
+   LONGS_EQUAL(1, sr.flows->head);
+   
+   /* Counting starts afresh: nothing more until the connection carries
+    * something again. */
+   tick(ACTIVE_TIMEOUT);
+   LONGS_EQUAL(1, sr.flows->head);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_ACK_M, 1001, 5001);
+   
+   /* Translated traffic is the NAT's to report, not the forwarded table's. */
+   LONGS_EQUAL(2, finish(&totals));
+   LONGS_EQUAL(3, totals.packets);
+   LONGS_EQUAL(3 * SEGMENT_LEN, totals.octets);
+   LONGS_EQUAL(1, totals.reversePackets);
+   LONGS_EQUAL(SEGMENT_LEN, totals.reverseOctets);
+}
+
+TEST(FlowExportTests, NatWithoutRouterStateExportsNothing)
+{
+   sr_flow_record_t totals;
+   
+   start(true);
+   openConnection();
+   
+   /* As for a NAT ticked on its own: no exporter to reach. */
+   sr.nat->routerState = NULL;
+   tick(ACTIVE_TIMEOUT);
+   LONGS_EQUAL(0, sr.flows->head);
+   sr.nat->routerState = &sr;
+   
+   /* What was counted is still reported at the end. */
+   LONGS_EQUAL(1, finish(&totals));
+   LONGS_EQUAL(2, totals.packets);
+}
+
+TEST(FlowExportTests, ForwardedFlowCountedOncePerDatagram)
+{
+   sr_flow_record_t totals;
+   
+   start(false);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_SYN_M, 1000, 0);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_ACK_M, 1001, 5001);
+   LONGS_EQUAL(1, sr.flows->tableUsed);
+   
+   LONGS_EQUAL(1, finish(&totals));
+   LONGS_EQUAL(2, totals.packets);
+   LONGS_EQUAL(2 * SEGMENT_LEN, totals.octets);
+   LONGS_EQUAL(0, totals.reversePackets);
+}
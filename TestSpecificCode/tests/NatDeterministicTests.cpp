@@ -0,0 +1,178 @@
+#include "CppUTest/TestHarness.h"
+#include <cstdlib>
+#include <arpa/inet.h>
+
+extern "C"
+{
+#include "sr_clock.h"
+#include "sr_nat.h"
+}
+
+#define FIRST_HOST     (0x0A000100) /* 10.0.1.0 */
+#define HOSTS          (4)
+#define PORTS_PER_HOST (3)
+
+TEST_GROUP(NatDeterministicTests)
+{
+   sr_nat_t nat;
+   
+   void setup()
+   {
+      sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+      sr_nat_init_state(&nat);
+      nat.icmpTimeout = 60;
+      LONGS_EQUAL(0, sr_nat_set_deterministic(&nat, FIRST_HOST, HOSTS, PORTS_PER_HOST));
+   }
+   
+   void teardown()
+   {
+      sr_nat_destroy(&nat);
+      sr_clock_use_wall();
+   }
+   
+   /** Maps host's identifier; returns the external one, or 0 if refused. */
+   uint16_t map(unsigned int host, uint16_t ident)
+   {
+      sr_nat_mapping_t *mapping = sr_nat_insert_mapping(&nat, htonl(FIRST_HOST + host), htons(ident),
+         nat_mapping_icmp);
+      uint16_t external = mapping ? ntohs(mapping->aux_ext) : 0;
+      
+      free(mapping);
+      return external;
+   }
+   
+   /** Returns the host owning an external identifier, or -1 if unmapped. */
+   int owner(uint16_t external)
+   {
+      sr_nat_mapping_t *mapping = sr_nat_lookup_external(&nat, htons(external), nat_mapping_icmp);
+      int host = mapping ? (int) (ntohl(mapping->ip_int) - FIRST_HOST) : -1;
+      
+      free(mapping);
+      return host;
+   }
+   
+   /** Ages out host's mapping of ident, and only that one. */
+   void expire(unsigned int host, uint16_t ident)
+   {
+      sr_clock_advance(nat.icmpTimeout);
+      for (sr_nat_mapping_t *mapping = nat.mappings; mapping; mapping = mapping->next)
+      {
+         if ((mapping->ip_int != htonl(FIRST_HOST + host)) || (mapping->aux_int != htons(ident)))
+         {
+            mapping->last_updated = sr_clock_now();
+         }
+      }
+      sr_clock_advance(1);
+      sr_nat_tick(&nat);
+   }
+};
+
+TEST(NatDeterministicTests, ParsesPrefixAndPorts)
+{
+   uint32_t firstHost;
+   unsigned int hosts, portsPerHost;
+   
+   LONGS_EQUAL(0, sr_nat_deterministic_parse("10.0.1.0/24:32", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(0x0A000100, firstHost);
+   LONGS_EQUAL(256, hosts);
+   LONGS_EQUAL(32, portsPerHost);
+   
+   /* The host bits are dropped, and the pool shared out evenly. */
+   LONGS_EQUAL(0, sr_nat_deterministic_parse("10.0.1.7/24", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(0x0A000100, firstHost);
+   LONGS_EQUAL(SR_NAT_PORT_POOL_SIZE / 256, portsPerHost);
+   
+   /* The longest prefix, and the shortest the pool still covers. */
+   LONGS_EQUAL(0, sr_nat_deterministic_parse("10.0.1.9/32", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(0x0A000109, firstHost);
+   LONGS_EQUAL(1, hosts);
+   LONGS_EQUAL(SR_NAT_PORT_POOL_SIZE, portsPerHost);
+   LONGS_EQUAL(0, sr_nat_deterministic_parse("10.0.0.0/19", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(8192, hosts);
+   LONGS_EQUAL(1, portsPerHost);
+}
+
+TEST(NatDeterministicTests, RejectsMalformedOrOversizedSpecs)
+{
+   uint32_t firstHost;
+   unsigned int hosts, portsPerHost;
+   
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1.0", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1/24", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("300.0.1.0/24", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1.0/17", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1.0/33", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1.0/24:0", &firstHost, &hosts, &portsPerHost));
+   
+   /* More ports than the pool has. */
+   LONGS_EQUAL(0, sr_nat_deterministic_parse("10.0.1.0/24:39", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.1.0/24:40", &firstHost, &hosts, &portsPerHost));
+   LONGS_EQUAL(-1, sr_nat_deterministic_parse("10.0.0.0/18", &firstHost, &hosts, &portsPerHost));
+}
+
+TEST(NatDeterministicTests, RejectsBlocksLargerThanPool)
+{
+   sr_nat_t other;
+   
+   sr_nat_init_state(&other);
+   LONGS_EQUAL(-1, sr_nat_set_deterministic(&other, FIRST_HOST, 0, 10));
+   LONGS_EQUAL(-1, sr_nat_set_deterministic(&other, FIRST_HOST, 10, 0));
+   LONGS_EQUAL(-1, sr_nat_set_deterministic(&other, FIRST_HOST, 100, SR_NAT_PORT_POOL_SIZE / 100 + 1));
+   CHECK(other.deterministic == NULL);
+   sr_nat_destroy(&other);
+}
+
+TEST(NatDeterministicTests, PortsStayInHostBlock)
+{
+   LONGS_EQUAL(STARTING_PORT_NUMBER + 2 * PORTS_PER_HOST, map(2, 1));
+   LONGS_EQUAL(STARTING_PORT_NUMBER + 2 * PORTS_PER_HOST + 1, map(2, 2));
+   LONGS_EQUAL(STARTING_PORT_NUMBER + 2 * PORTS_PER_HOST + 2, map(2, 3));
+   LONGS_EQUAL(STARTING_PORT_NUMBER, map(0, 1));
+   
+   /* A full block doesn't spill into a neighbour's. */
+   LONGS_EQUAL(0, map(2, 4));
+   LONGS_EQUAL(STARTING_PORT_NUMBER + 3 * PORTS_PER_HOST, map(3, 4));
+   
+   /* Hosts outside the range get nothing. */
+   LONGS_EQUAL(0, map(HOSTS, 1));
+   LONGS_EQUAL(0, map((unsigned int) -1, 1));
+}
+
+TEST(NatDeterministicTests, FreedPortsReusedRoundRobin)
+{
+   const uint16_t block = STARTING_PORT_NUMBER + PORTS_PER_HOST;
+   
+   LONGS_EQUAL(block, map(1, 1));
+   LONGS_EQUAL(block + 1, map(1, 2));
+   expire(1, 1);
+   CHECK(owner(block) == -1);
+   
+   /* Carries on from the last port, then wraps to the freed one. */
+   LONGS_EQUAL(block + 2, map(1, 3));
+   LONGS_EQUAL(block, map(1, 4));
+   LONGS_EQUAL(0, map(1, 5));
+}
+
+TEST(NatDeterministicTests, ExternalPortNamesHost)
+{
+   for (uint16_t ident = 1; ident <= PORTS_PER_HOST; ident++)
+   {
+      map(0, ident);
+      map(HOSTS - 1, ident);
+   }
+   
+   /* First and last port of the first and last blocks. */
+   LONGS_EQUAL(0, owner(STARTING_PORT_NUMBER));
+   LONGS_EQUAL(0, owner(STARTING_PORT_NUMBER + PORTS_PER_HOST - 1));
+   LONGS_EQUAL(HOSTS - 1, owner(STARTING_PORT_NUMBER + (HOSTS - 1) * PORTS_PER_HOST));
+   LONGS_EQUAL(HOSTS - 1, owner(STARTING_PORT_NUMBER + HOSTS * PORTS_PER_HOST - 1));
+   
+   /* An unused block, and ports either side of the range. */
+   LONGS_EQUAL(-1, owner(STARTING_PORT_NUMBER + PORTS_PER_HOST));
+   LONGS_EQUAL(-1, owner(STARTING_PORT_NUMBER + HOSTS * PORTS_PER_HOST));
+   LONGS_EQUAL(-1, owner(STARTING_PORT_NUMBER - 1));
+   
+   /* Each mapping type has slots of its own. */
+   sr_nat_mapping_t *mapping = sr_nat_lookup_external(&nat, htons(STARTING_PORT_NUMBER), nat_mapping_tcp);
+   CHECK(mapping == NULL);
+}
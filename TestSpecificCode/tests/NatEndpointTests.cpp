@@ -0,0 +1,191 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+#include <cstdlib>
+
+#include "TestRouter.h"
+
+extern "C"
+{
+#include "sr_nat.h"
+}
+
+#define CLIENT_PORT   (4000)
+#define SERVER_PORT   (80)
+#define UNMAPPED_PORT (40000)
+
+TEST_GROUP(NatEndpointTests)
+{
+   struct sr_instance sr;
+   
+   void setup()
+   {
+      sr.cache.persistFile = NULL;
+      TestRouterSetup(&sr, true);
+      mock().ignoreOtherCalls();
+   }
+   
+   void teardown()
+   {
+      TestRouterTeardown(&sr);
+      mock().checkExpectations();
+      mock().clear();
+   }
+   
+   /** Sends host's SYN to server one; returns the external port it got. */
+   uint16_t openMapping(uint32_t host, uint16_t port)
+   {
+      TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, host, port, TEST_SERVER_ONE, SERVER_PORT, TCP_SYN_M,
+         1000, 0);
+      return mappedPort(host, port);
+   }
+   
+   uint16_t mappedPort(uint32_t host, uint16_t port)
+   {
+      sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr.nat, htonl(host), htons(port),
+         nat_mapping_tcp);
+      uint16_t externalPort;
+      
+      CHECK(mapping);
+      externalPort = ntohs(mapping->aux_ext);
+      free(mapping);
+      return externalPort;
+   }
+   
+   /** From here on, any frame the router sends must have been expected. */
+   void expectOnly()
+   {
+      mock().checkExpectations();
+      mock().clear();
+   }
+   
+   void expectForward(const char *interface, uint32_t source, uint32_t destination)
+   {
+      mock().expectOneCall("SendPacket")
+         .withParameter("Interface", interface)
+         .withParameter("EthernetProtocol", ethertype_ip)
+         .withParameter("SourceAddress", (int) source)
+         .withParameter("DestinationAddress", (int) destination)
+         .ignoreOtherParameters();
+   }
+   
+   unsigned int countMappings()
+   {
+      unsigned int count = 0;
+      for (sr_nat_mapping_t *mapping = sr.nat->mappings; mapping; mapping = mapping->next)
+      {
+         count++;
+      }
+      return count;
+   }
+};
+
+TEST(NatEndpointTests, MappingReusedAcrossDestinations)
+{
+   expectOnly();
+   expectForward(TEST_EXTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_SERVER_ONE);
+   expectForward(TEST_EXTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_SERVER_TWO);
+   
+   uint16_t externalPort = openMapping(TEST_HOST_A, CLIENT_PORT);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_TWO, 443, TCP_SYN_M,
+      2000, 0);
+   
+   /* One mapping, one connection per destination. */
+   LONGS_EQUAL(1, countMappings());
+   LONGS_EQUAL(externalPort, mappedPort(TEST_HOST_A, CLIENT_PORT));
+   CHECK(sr.nat->mappings->conns && sr.nat->mappings->conns->next);
+   
+   /* Another socket of the same host gets a port of its own. */
+   expectForward(TEST_EXTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_SERVER_ONE);
+   CHECK(openMapping(TEST_HOST_A, CLIENT_PORT + 1) != externalPort);
+}
+
+TEST(NatEndpointTests, UnsolicitedSynQueuedWithoutEndpointIndependentFiltering)
+{
+   uint16_t externalPort = openMapping(TEST_HOST_A, CLIENT_PORT);
+   
+   /* Held as a possible simultaneous open, not forwarded. */
+   expectOnly();
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_TWO, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_SYN_M, 7000, 0);
+   
+   sr_nat_connection_t *connection = sr.nat->mappings->conns;
+   LONGS_EQUAL(nat_conn_inbound_syn_pending, connection->connectionState);
+   CHECK(connection->queuedInboundSyn != NULL);
+   
+   /* Nor is anything else from that host. */
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_TWO, SERVER_PORT + 1, TEST_EXTERNAL_IP,
+      externalPort, TCP_ACK_M, 7001, 0);
+}
+
+TEST(NatEndpointTests, UnsolicitedSynForwardedWithEndpointIndependentFiltering)
+{
+   sr.nat->endpointIndependentFiltering = true;
+   uint16_t externalPort = openMapping(TEST_HOST_A, CLIENT_PORT);
+   
+   expectOnly();
+   expectForward(TEST_INTERNAL_IFACE, TEST_SERVER_TWO, TEST_HOST_A);
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_TWO, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_SYN_M, 7000, 0);
+   
+   sr_nat_connection_t *connection = sr.nat->mappings->conns;
+   LONGS_EQUAL(nat_conn_inbound_syn_pending, connection->connectionState);
+   CHECK(connection->queuedInboundSyn == NULL);
+   
+   /* The internal host's answer completes the connection. */
+   expectForward(TEST_EXTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_SERVER_TWO);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_TWO, SERVER_PORT,
+      TCP_SYN_M | TCP_ACK_M, 1000, 7001);
+   LONGS_EQUAL(nat_conn_connected, connection->connectionState);
+   
+   /* Any host may reach the port, even untracked. */
+   expectForward(TEST_INTERNAL_IFACE, TEST_SERVER_ONE, TEST_HOST_A);
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT + 1, TEST_EXTERNAL_IP,
+      externalPort, TCP_ACK_M, 9000, 0);
+}
+
+TEST(NatEndpointTests, HairpinTranslatesBothLegs)
+{
+   sr.nat->endpointIndependentFiltering = true;
+   uint16_t portB = openMapping(TEST_HOST_B, CLIENT_PORT);
+   
+   /* A reaches B through B's external address and port, and B sees A's
+    * external address, not its internal one. */
+   expectOnly();
+   expectForward(TEST_INTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_HOST_B);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_EXTERNAL_IP, portB,
+      TCP_SYN_M, 1000, 0);
+   uint16_t portA = mappedPort(TEST_HOST_A, CLIENT_PORT);
+   mock().checkExpectations();
+   
+   /* B's answer to A's external port goes back to A the same way. */
+   expectForward(TEST_INTERNAL_IFACE, TEST_EXTERNAL_IP, TEST_HOST_A);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_B, CLIENT_PORT, TEST_EXTERNAL_IP, portA,
+      TCP_SYN_M | TCP_ACK_M, 5000, 1001);
+   mock().checkExpectations();
+   
+   for (sr_nat_mapping_t *mapping = sr.nat->mappings; mapping; mapping = mapping->next)
+   {
+      sr_nat_connection_t *connection = mapping->conns;
+      CHECK(connection);
+      LONGS_EQUAL(htonl(TEST_EXTERNAL_IP), connection->external.ipAddress);
+      LONGS_EQUAL(nat_conn_connected, connection->connectionState);
+   }
+}
+
+TEST(NatEndpointTests, UnmappedPortOnExternalAddressIsForRouter)
+{
+   openMapping(TEST_HOST_B, CLIENT_PORT);
+   
+   /* Not a hairpin: the router answers for itself, with port unreachable. */
+   expectOnly();
+   mock().expectOneCall("SendPacket")
+      .withParameter("Interface", TEST_INTERNAL_IFACE)
+      .withParameter("DestinationAddress", (int) TEST_HOST_A)
+      .withParameter("InternetProtocol", ip_protocol_icmp)
+      .withParameter("IcmpType", icmp_type_desination_unreachable)
+      .ignoreOtherParameters();
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_EXTERNAL_IP, UNMAPPED_PORT,
+      TCP_SYN_M, 1000, 0);
+   
+   LONGS_EQUAL(1, countMappings());
+}
@@ -0,0 +1,114 @@
+#include "CppUTest/TestHarness.h"
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern "C"
+{
+#include "sr_nat.h"
+#include "sr_nat_sync.h"
+#include "sr_router.h"
+}
+
+#define NUM_MAPPINGS (200)
+
+/* Defined by sr_main.c in the real router. */
+extern "C" volatile sig_atomic_t srShutdownRequested;
+extern "C" volatile sig_atomic_t srReloadRequests;
+volatile sig_atomic_t srShutdownRequested = 0;
+volatile sig_atomic_t srReloadRequests = 0;
+
+static char syncSocketPath[64];
+
+/**
+ * Runs an active router's NAT in a child process: creates "count" ICMP
+ * mappings, lets replication catch up, then dies without any goodbye.
+ */
+static pid_t startActive(unsigned int count, unsigned int startDelayMs)
+{
+   pid_t pid = fork();
+   if (pid == 0)
+   {
+      sr_nat_t nat;
+      
+      usleep(startDelayMs * 1000);
+      sr_nat_init(&nat);
+      nat.icmpTimeout = 60;
+      nat.sync = sr_nat_sync_start_active(&nat, syncSocketPath);
+      for (unsigned int i = 0; i < count; i++)
+      {
+         free(sr_nat_insert_mapping(&nat, htonl(0x0A000164 + i), htons(1000 + i), nat_mapping_icmp));
+      }
+      
+      sleep(1);
+      _exit(0);
+   }
+   return pid;
+}
+
+static unsigned int countMappings(sr_nat_t *nat)
+{
+   unsigned int count = 0;
+   for (sr_nat_mapping_t *mapping = nat->mappings; mapping; mapping = mapping->next)
+   {
+      count++;
+   }
+   return count;
+}
+
+TEST_GROUP(NatSyncTests)
+{
+   sr_nat_t standby;
+   
+   void setup()
+   {
+      snprintf(syncSocketPath, sizeof(syncSocketPath), "/tmp/sr_nat_sync_test.%d", (int) getpid());
+      /* No timeout thread: nothing may touch the fixture after teardown. */
+      sr_nat_init_state(&standby);
+      standby.timeoutsSuspended = true;
+   }
+   
+   void teardown()
+   {
+      sr_nat_destroy(&standby);
+      unlink(syncSocketPath);
+   }
+};
+
+TEST(NatSyncTests, StandbyTakesOverWithActiveMappings)
+{
+   int status;
+   pid_t active = startActive(NUM_MAPPINGS, 0);
+   
+   LONGS_EQUAL(0, sr_nat_sync_run_standby(&standby, syncSocketPath));
+   waitpid(active, &status, 0);
+   
+   LONGS_EQUAL(NUM_MAPPINGS, countMappings(&standby));
+   for (unsigned int i = 0; i < NUM_MAPPINGS; i++)
+   {
+      sr_nat_mapping_t *mapping = sr_nat_lookup_internal(&standby, htonl(0x0A000164 + i), 
+         htons(1000 + i), nat_mapping_icmp);
+      CHECK(mapping);
+      LONGS_EQUAL(STARTING_PORT_NUMBER + i, ntohs(mapping->aux_ext));
+      free(mapping);
+   }
+   
+   /* Timers restart on takeover. */
+   CHECK(difftime(time(NULL), standby.mappings->last_updated) < 2);
+}
+
+TEST(NatSyncTests, StandbyFollowsReplacedActive)
+{
+   int status;
+   pid_t oldActive = startActive(NUM_MAPPINGS, 0);
+   /* A hot-upgraded process opens the socket shortly after the old one exits. */
+   pid_t newActive = startActive(5, 1200);
+   
+   LONGS_EQUAL(0, sr_nat_sync_run_standby(&standby, syncSocketPath));
+   waitpid(oldActive, &status, 0);
+   waitpid(newActive, &status, 0);
+   
+   /* The table was resynced from the new active, not merged. */
+   LONGS_EQUAL(5, countMappings(&standby));
+}
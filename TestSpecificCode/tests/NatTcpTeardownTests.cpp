@@ -0,0 +1,201 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTestExt/MockSupport.h"
+#include <cstdlib>
+
+#include "TestRouter.h"
+
+extern "C"
+{
+#include "sr_clock.h"
+#include "sr_nat.h"
+}
+
+#define CLIENT_PORT (4000)
+#define SERVER_PORT (80)
+#define CLIENT_ISN  (1000)
+#define SERVER_ISN  (5000)
+
+TEST_GROUP(NatTcpTeardownTests)
+{
+   struct sr_instance sr;
+   uint16_t externalPort;
+   
+   void setup()
+   {
+      sr.cache.persistFile = NULL;
+      TestRouterSetup(&sr, true);
+      mock().ignoreOtherCalls();
+   }
+   
+   void teardown()
+   {
+      TestRouterTeardown(&sr);
+      mock().checkExpectations();
+      mock().clear();
+   }
+   
+   /** Opens a connection from host A to server one; returns its external port. */
+   uint16_t openConnection()
+   {
+      sr_nat_mapping_t *mapping;
+      uint16_t port;
+      
+      TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+         SERVER_PORT, TCP_SYN_M, CLIENT_ISN, 0);
+      mapping = sr_nat_lookup_internal(sr.nat, htonl(TEST_HOST_A), htons(CLIENT_PORT), nat_mapping_tcp);
+      CHECK(mapping);
+      port = ntohs(mapping->aux_ext);
+      free(mapping);
+      
+      TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+         port, TCP_SYN_M | TCP_ACK_M, SERVER_ISN, CLIENT_ISN + 1);
+      TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+         SERVER_PORT, TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 1);
+      LONGS_EQUAL(nat_conn_connected, connectionState());
+      return port;
+   }
+   
+   sr_nat_tcp_conn_state_t connectionState()
+   {
+      CHECK(sr.nat->mappings && sr.nat->mappings->conns);
+      return sr.nat->mappings->conns->connectionState;
+   }
+   
+   void tick(unsigned int seconds)
+   {
+      sr_clock_advance(seconds);
+      sr_nat_tick(sr.nat);
+   }
+   
+   bool portMapped(uint16_t port)
+   {
+      sr_nat_mapping_t *mapping = sr_nat_lookup_external(sr.nat, htons(port), nat_mapping_tcp);
+      bool mapped = (mapping != NULL);
+      
+      free(mapping);
+      return mapped;
+   }
+};
+
+TEST(NatTcpTeardownTests, FinHandshakeClosesConnection)
+{
+   externalPort = openConnection();
+   
+   /* Client closes first; the server acknowledges and closes too. */
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 1);
+   LONGS_EQUAL(nat_conn_time_wait, connectionState());
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_FIN_M | TCP_ACK_M, SERVER_ISN + 1, CLIENT_ISN + 2);
+   LONGS_EQUAL(nat_conn_time_wait, connectionState());
+   
+   /* The last ACK, of the server's FIN, completes the close. */
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_ACK_M, CLIENT_ISN + 2, SERVER_ISN + 2);
+   LONGS_EQUAL(nat_conn_closed, connectionState());
+   LONGS_EQUAL(1, sr.nat->portStats.closedByFin);
+   LONGS_EQUAL(0, sr.nat->portStats.closedByReset);
+}
+
+TEST(NatTcpTeardownTests, FinWithoutFinalAckStaysInTimeWait)
+{
+   externalPort = openConnection();
+   
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 1);
+   /* Acknowledges data short of the client's FIN. */
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_FIN_M | TCP_ACK_M, SERVER_ISN + 1, CLIENT_ISN + 1);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_ACK_M, CLIENT_ISN + 2, SERVER_ISN + 2);
+   
+   LONGS_EQUAL(nat_conn_time_wait, connectionState());
+   LONGS_EQUAL(0, sr.nat->portStats.closedByFin);
+   
+   /* Only the transitory timeout frees the port then. */
+   tick(sr.nat->tcpTimeWaitTimeout + 1);
+   CHECK(portMapped(externalPort));
+}
+
+TEST(NatTcpTeardownTests, ClosedPortReclaimedAfterTimeWait)
+{
+   externalPort = openConnection();
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_FIN_M | TCP_ACK_M, CLIENT_ISN + 1, SERVER_ISN + 1);
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_FIN_M | TCP_ACK_M, SERVER_ISN + 1, CLIENT_ISN + 2);
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_ACK_M, CLIENT_ISN + 2, SERVER_ISN + 2);
+   LONGS_EQUAL(nat_conn_closed, connectionState());
+   
+   /* Held for the whole TIME_WAIT timeout: a new mapping looking for a
+    * port from the closed one skips it. */
+   tick(sr.nat->tcpTimeWaitTimeout);
+   CHECK(portMapped(externalPort));
+   sr.nat->nextTcpPortNumber = externalPort;
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_B, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_SYN_M, CLIENT_ISN, 0);
+   sr_nat_mapping_t *mapping = sr_nat_lookup_internal(sr.nat, htonl(TEST_HOST_B), htons(CLIENT_PORT),
+      nat_mapping_tcp);
+   CHECK(mapping);
+   CHECK(ntohs(mapping->aux_ext) != externalPort);
+   free(mapping);
+   
+   /* Then given back, and handed out again. */
+   tick(1);
+   LONGS_EQUAL(1, sr.nat->portStats.reclaimed);
+   CHECK_FALSE(portMapped(externalPort));
+   mapping = sr_nat_lookup_internal(sr.nat, htonl(TEST_HOST_A), htons(CLIENT_PORT), nat_mapping_tcp);
+   CHECK(mapping == NULL);
+   
+   sr.nat->nextTcpPortNumber = externalPort;
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT + 1, TEST_SERVER_TWO,
+      SERVER_PORT, TCP_SYN_M, CLIENT_ISN, 0);
+   mapping = sr_nat_lookup_internal(sr.nat, htonl(TEST_HOST_A), htons(CLIENT_PORT + 1),
+      nat_mapping_tcp);
+   CHECK(mapping);
+   LONGS_EQUAL(externalPort, ntohs(mapping->aux_ext));
+   free(mapping);
+}
+
+TEST(NatTcpTeardownTests, RstInWindowClosesConnection)
+{
+   externalPort = openConnection();
+   
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_RST_M, SERVER_ISN + 1 + 1000, 0);
+   
+   LONGS_EQUAL(nat_conn_closed, connectionState());
+   LONGS_EQUAL(1, sr.nat->portStats.closedByReset);
+   
+   tick(sr.nat->tcpTimeWaitTimeout + 1);
+   LONGS_EQUAL(1, sr.nat->portStats.reclaimed);
+   CHECK_FALSE(portMapped(externalPort));
+}
+
+TEST(NatTcpTeardownTests, RstOutsideWindowIgnored)
+{
+   externalPort = openConnection();
+   
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_RST_M, SERVER_ISN + 1 + SR_NAT_RST_WINDOW + 1, 0);
+   TestRouterSendTcp(&sr, TEST_EXTERNAL_IFACE, TEST_SERVER_ONE, SERVER_PORT, TEST_EXTERNAL_IP,
+      externalPort, TCP_RST_M, SERVER_ISN + 1 - SR_NAT_RST_WINDOW - 1, 0);
+   
+   LONGS_EQUAL(nat_conn_connected, connectionState());
+   LONGS_EQUAL(0, sr.nat->portStats.closedByReset);
+   
+   tick(sr.nat->tcpTimeWaitTimeout + 1);
+   CHECK(portMapped(externalPort));
+}
+
+TEST(NatTcpTeardownTests, OutboundRstClosesConnection)
+{
+   externalPort = openConnection();
+   
+   TestRouterSendTcp(&sr, TEST_INTERNAL_IFACE, TEST_HOST_A, CLIENT_PORT, TEST_SERVER_ONE,
+      SERVER_PORT, TCP_RST_M, CLIENT_ISN + 1, 0);
+   
+   LONGS_EQUAL(nat_conn_closed, connectionState());
+   LONGS_EQUAL(1, sr.nat->portStats.closedByReset);
+}
@@ -0,0 +1,250 @@
+#include "CppUTest/TestHarness.h"
+#include <cstdlib>
+#include <arpa/inet.h>
+
+extern "C"
+{
+#include "sr_clock.h"
+#include "sr_nat.h"
+#include "sr_policer.h"
+}
+
+#define HOST_ONE (0x0A000164) /* 10.0.1.100 */
+#define HOST_TWO (0x0A000165) /* 10.0.1.101 */
+
+TEST_GROUP(PolicerTests)
+{
+   sr_policer_t *policer;
+   
+   void setup()
+   {
+      sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+      policer = NULL;
+   }
+   
+   void teardown()
+   {
+      sr_policer_destroy(policer);
+      sr_clock_use_wall();
+   }
+   
+   void create(const char *spec)
+   {
+      sr_policer_limits_t limits;
+      
+      LONGS_EQUAL(0, sr_policer_parse_limits(spec, &limits));
+      policer = sr_policer_create(&limits);
+   }
+   
+   /** The i'th of many hosts, network byte order. */
+   uint32_t host(unsigned int i)
+   {
+      return htonl(0x0A000000 + i + 1);
+   }
+   
+   sr_policer_host_t state(uint32_t ip)
+   {
+      sr_policer_host_t copy;
+      
+      CHECK(sr_policer_host(policer, ip, &copy));
+      return copy;
+   }
+   
+   bool tracked(uint32_t ip)
+   {
+      sr_policer_host_t copy;
+      
+      return sr_policer_host(policer, ip, &copy);
+   }
+   
+   /** Tracks hosts 0 to count - 1, holding no mappings, the first seen first. */
+   void fill(unsigned int count)
+   {
+      for (unsigned int i = 0; i < count; i++)
+      {
+         CHECK(sr_policer_admit_packet(policer, host(i), 64));
+         if (i == 0)
+         {
+            sr_clock_advance(1);
+         }
+      }
+      LONGS_EQUAL(count, policer->hostCount);
+   }
+};
+
+TEST(PolicerTests, ParsesLimits)
+{
+   sr_policer_limits_t limits;
+   
+   LONGS_EQUAL(0, sr_policer_parse_limits("100:1m:8:2k", &limits));
+   LONGS_EQUAL(100, limits.packetsPerS);
+   LONGS_EQUAL(1000000, limits.bitsPerS);
+   LONGS_EQUAL(8, limits.mappings);
+   LONGS_EQUAL(2000, limits.mappingsPerS);
+   
+   LONGS_EQUAL(0, sr_policer_parse_limits("0:1G", &limits));
+   LONGS_EQUAL(0, limits.packetsPerS);
+   LONGS_EQUAL(1000000000, limits.bitsPerS);
+   LONGS_EQUAL(0, limits.mappings);
+   LONGS_EQUAL(0, limits.mappingsPerS);
+   
+   LONGS_EQUAL(-1, sr_policer_parse_limits("100", &limits));
+   LONGS_EQUAL(-1, sr_policer_parse_limits("x:1m", &limits));
+   LONGS_EQUAL(-1, sr_policer_parse_limits("100:1m:", &limits));
+   LONGS_EQUAL(-1, sr_policer_parse_limits("100:1m:8:2k:1", &limits));
+   LONGS_EQUAL(-1, sr_policer_parse_limits("100:1q", &limits));
+}
+
+TEST(PolicerTests, PacketRateAllowsOneSecondBurst)
+{
+   create("10:0");
+   
+   for (unsigned int i = 0; i < 10; i++)
+   {
+      CHECK(sr_policer_admit_packet(policer, htonl(HOST_ONE), 64));
+   }
+   CHECK_FALSE(sr_policer_admit_packet(policer, htonl(HOST_ONE), 64));
+   LONGS_EQUAL(1, state(htonl(HOST_ONE)).violations[SR_POLICER_PACKET_RATE]);
+   
+   /* Each host has buckets of its own, and they refill with the clock. */
+   CHECK(sr_policer_admit_packet(policer, htonl(HOST_TWO), 64));
+   sr_clock_advance(1);
+   CHECK(sr_policer_admit_packet(policer, htonl(HOST_ONE), 64));
+}
+
+TEST(PolicerTests, BitRateRefusalChargesNeitherBucket)
+{
+   /* Two packets a second; 1000 bytes is a second's worth of bits. */
+   create("2:8k");
+   
+   CHECK(sr_policer_admit_packet(policer, htonl(HOST_ONE), 500));
+   CHECK_FALSE(sr_policer_admit_packet(policer, htonl(HOST_ONE), 1000));
+   LONGS_EQUAL(1, state(htonl(HOST_ONE)).violations[SR_POLICER_BIT_RATE]);
+   
+   /* The refused packet took no packet token, so a second one still fits. */
+   CHECK(sr_policer_admit_packet(policer, htonl(HOST_ONE), 1));
+   CHECK_FALSE(sr_policer_admit_packet(policer, htonl(HOST_ONE), 1));
+   LONGS_EQUAL(1, state(htonl(HOST_ONE)).violations[SR_POLICER_PACKET_RATE]);
+}
+
+TEST(PolicerTests, MappingCapHeldUntilMappingRemoved)
+{
+   create("0:0:2");
+   
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   CHECK_FALSE(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   LONGS_EQUAL(2, state(htonl(HOST_ONE)).mappings);
+   LONGS_EQUAL(1, policer->violations[SR_POLICER_MAPPING_LIMIT]);
+   
+   /* The cap is per host. */
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_TWO)));
+   
+   sr_policer_remove_mapping(policer, htonl(HOST_ONE));
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+}
+
+TEST(PolicerTests, MappingRateRefillsWithClock)
+{
+   create("0:0:0:2");
+   
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   CHECK_FALSE(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   LONGS_EQUAL(1, state(htonl(HOST_ONE)).violations[SR_POLICER_MAPPING_RATE]);
+   
+   /* A refunded mapping gives its token back. */
+   sr_policer_refund_mapping(policer, htonl(HOST_ONE));
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   CHECK_FALSE(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   
+   sr_clock_advance(1);
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+}
+
+TEST(PolicerTests, MappingRefundedWhenPortsRunOut)
+{
+   sr_nat_t nat;
+   sr_nat_mapping_t *mapping;
+   
+   sr_nat_init_state(&nat);
+   LONGS_EQUAL(0, sr_nat_set_deterministic(&nat, HOST_ONE, 1, 1));
+   create("0:0:2:2");
+   nat.policer = policer;
+   
+   mapping = sr_nat_insert_mapping(&nat, htonl(HOST_ONE), htons(1), nat_mapping_icmp);
+   CHECK(mapping);
+   free(mapping);
+   
+   /* The host's only port is taken: refused, but not held against it. */
+   CHECK(sr_nat_insert_mapping(&nat, htonl(HOST_ONE), htons(2), nat_mapping_icmp) == NULL);
+   LONGS_EQUAL(1, state(htonl(HOST_ONE)).mappings);
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_ONE)));
+   sr_policer_refund_mapping(policer, htonl(HOST_ONE));
+   
+   /* The NAT owns the policer now. */
+   sr_nat_destroy(&nat);
+   policer = NULL;
+}
+
+TEST(PolicerTests, FullTableFailsClosed)
+{
+   create("0:0");
+   
+   for (unsigned int i = 0; i < SR_POLICER_MAX_HOSTS; i++)
+   {
+      CHECK(sr_policer_admit_mapping(policer, host(i)));
+   }
+   
+   /* Every host holds a mapping, so none can be evicted. */
+   CHECK_FALSE(sr_policer_admit_packet(policer, host(SR_POLICER_MAX_HOSTS), 64));
+   CHECK_FALSE(sr_policer_admit_mapping(policer, host(SR_POLICER_MAX_HOSTS)));
+   LONGS_EQUAL(2, policer->noSlot);
+   LONGS_EQUAL(0, policer->evicted);
+   CHECK_FALSE(tracked(host(SR_POLICER_MAX_HOSTS)));
+   
+   /* Tracked hosts carry on. */
+   CHECK(sr_policer_admit_packet(policer, host(0), 64));
+}
+
+TEST(PolicerTests, FullTableEvictsLeastRecentIdleHost)
+{
+   create("0:0");
+   fill(SR_POLICER_MAX_HOSTS);
+   
+   CHECK(sr_policer_admit_packet(policer, host(SR_POLICER_MAX_HOSTS), 64));
+   LONGS_EQUAL(1, policer->evicted);
+   CHECK_FALSE(tracked(host(0)));
+   CHECK(tracked(host(1)));
+   LONGS_EQUAL(SR_POLICER_MAX_HOSTS, policer->hostCount);
+   
+   /* Hosts holding mappings keep their slot, however quiet. */
+   sr_policer_add_mapping(policer, host(1));
+   sr_clock_advance(1);
+   for (unsigned int i = 3; i <= SR_POLICER_MAX_HOSTS; i++)
+   {
+      CHECK(sr_policer_admit_packet(policer, host(i), 64));
+   }
+   CHECK(sr_policer_admit_packet(policer, host(SR_POLICER_MAX_HOSTS + 1), 64));
+   LONGS_EQUAL(2, policer->evicted);
+   CHECK(tracked(host(1)));
+   CHECK_FALSE(tracked(host(2)));
+}
+
+TEST(PolicerTests, TickForgetsIdleHostsWithoutMappings)
+{
+   create("0:0");
+   CHECK(sr_policer_admit_packet(policer, htonl(HOST_ONE), 64));
+   CHECK(sr_policer_admit_mapping(policer, htonl(HOST_TWO)));
+   
+   sr_clock_advance(SR_POLICER_IDLE_S);
+   sr_policer_tick(policer);
+   CHECK(tracked(htonl(HOST_ONE)));
+   
+   sr_clock_advance(1);
+   sr_policer_tick(policer);
+   CHECK_FALSE(tracked(htonl(HOST_ONE)));
+   CHECK(tracked(htonl(HOST_TWO)));
+   LONGS_EQUAL(1, policer->hostCount);
+   LONGS_EQUAL(0, policer->evicted);
+}
@@ -0,0 +1,167 @@
+/**
+ * @file TestRouter.cpp
+ * @brief Router fixture shared by the unit tests.
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+
+#include "TestRouter.h"
+
+extern "C"
+{
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_utils.h"
+}
+
+static const uint8_t internalMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x01 };
+static const uint8_t externalMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x02, 0x01 };
+static const uint8_t neighbourMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x09, 0x09 };
+
+static void testAddRoute(struct sr_instance *sr, uint32_t dest, uint32_t gw, uint32_t mask,
+   const char *interface)
+{
+   struct in_addr destAddr, gwAddr, maskAddr;
+   
+   destAddr.s_addr = htonl(dest);
+   gwAddr.s_addr = htonl(gw);
+   maskAddr.s_addr = htonl(mask);
+   sr_add_rt_entry(sr, destAddr, gwAddr, maskAddr, (char *) interface);
+}
+
+/**
+ * TestRouterSetup()
+ * @brief Builds the fixture router, with a NAT (eth1 internal) if asked.
+ *        Also switches to the virtual clock.
+ * @note Set sr->cache.persistFile before calling to restore an ARP snapshot;
+ *       the neighbours are cached on top of it.
+ */
+void TestRouterSetup(struct sr_instance *sr, bool natEnabled)
+{
+   const char *persistFile = sr->cache.persistFile;
+   
+   sr_clock_use_virtual(SR_CLOCK_VIRTUAL_EPOCH);
+   
+   memset(sr, 0, sizeof(*sr));
+   sr->sockfd = -1;
+   sr->cache.persistFile = persistFile;
+   
+   sr_add_interface(sr, TEST_INTERNAL_IFACE);
+   sr_set_ether_addr(sr, internalMac);
+   sr_set_ether_ip(sr, htonl(TEST_INTERNAL_IP));
+   sr_add_interface(sr, TEST_EXTERNAL_IFACE);
+   sr_set_ether_addr(sr, externalMac);
+   sr_set_ether_ip(sr, htonl(TEST_EXTERNAL_IP));
+   
+   /* Host routes, as in the lab's rtable: the router ARPs the gateway. */
+   testAddRoute(sr, TEST_HOST_A, TEST_HOST_A, 0xFFFFFFFF, TEST_INTERNAL_IFACE);
+   testAddRoute(sr, TEST_HOST_B, TEST_HOST_B, 0xFFFFFFFF, TEST_INTERNAL_IFACE);
+   testAddRoute(sr, 0, TEST_EXTERNAL_GATEWAY, 0, TEST_EXTERNAL_IFACE);
+   
+   if (natEnabled)
+   {
+      sr->nat = (sr_nat_t *) malloc(sizeof(sr_nat_t));
+      assert(sr->nat);
+      sr_nat_init_state(sr->nat);
+      sr->nat->routerState = sr;
+      sr->nat->icmpTimeout = 60;
+      sr->nat->tcpEstablishedTimeout = 7440;
+      sr->nat->tcpTransitoryTimeout = 300;
+      sr->nat->tcpTimeWaitTimeout = 4;
+   }
+   
+   /* Not sr_init(): no ARP timer thread, the tests tick the cache. */
+   sr_arpcache_init(&(sr->cache));
+   sr_arpcache_insert(&(sr->cache), (unsigned char *) neighbourMac, TEST_HOST_A, TEST_INTERNAL_IFACE);
+   sr_arpcache_insert(&(sr->cache), (unsigned char *) neighbourMac, TEST_HOST_B, TEST_INTERNAL_IFACE);
+   sr_arpcache_insert(&(sr->cache), (unsigned char *) neighbourMac, TEST_EXTERNAL_GATEWAY,
+      TEST_EXTERNAL_IFACE);
+}
+
+/**
+ * TestRouterTeardown()
+ * @brief Frees everything TestRouterSetup() built and restores the wall
+ *        clock.
+ */
+void TestRouterTeardown(struct sr_instance *sr)
+{
+   while (sr->if_list)
+   {
+      struct sr_if *next = sr->if_list->next;
+      free(sr->if_list);
+      sr->if_list = next;
+   }
+   while (sr->routing_table)
+   {
+      struct sr_rt *next = sr->routing_table->next;
+      free(sr->routing_table);
+      sr->routing_table = next;
+   }
+   while (sr->cache.requests)
+   {
+      sr_arpreq_destroy(&(sr->cache), sr->cache.requests);
+   }
+   sr_arpcache_destroy(&(sr->cache));
+   
+   if (sr->nat)
+   {
+      sr_nat_destroy(sr->nat);
+      free(sr->nat);
+      sr->nat = NULL;
+   }
+   
+   sr_clock_use_wall();
+}
+
+/**
+ * TestRouterSendTcp()
+ * @brief Hands the router a checksummed TCP segment with no payload, as if
+ *        it arrived on receivingInterface from a neighbour.
+ * @note Addresses, ports and sequence numbers are in host byte order.
+ */
+void TestRouterSendTcp(struct sr_instance *sr, const char *receivingInterface, uint32_t sourceIp,
+   uint16_t sourcePort, uint32_t destinationIp, uint16_t destinationPort, uint16_t controlBits,
+   uint32_t sequence, uint32_t acknowledgment)
+{
+   uint8_t frame[TEST_TCP_FRAME_LEN];
+   uint8_t pseudo[sizeof(sr_tcp_ip_pseudo_hdr_t) + sizeof(sr_tcp_hdr_t)];
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_tcp_hdr_t *tcpHeader = (sr_tcp_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+   sr_tcp_ip_pseudo_hdr_t *pseudoHeader = (sr_tcp_ip_pseudo_hdr_t *) pseudo;
+   
+   memset(frame, 0, sizeof(frame));
+   memcpy(ethernetHeader->ether_dhost, sr_get_interface(sr, receivingInterface)->addr, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, neighbourMac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_ip);
+   
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t));
+   ipHeader->ip_ttl = 64;
+   ipHeader->ip_p = ip_protocol_tcp;
+   ipHeader->ip_src = htonl(sourceIp);
+   ipHeader->ip_dst = htonl(destinationIp);
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+   
+   tcpHeader->sourcePort = htons(sourcePort);
+   tcpHeader->destinationPort = htons(destinationPort);
+   tcpHeader->sequenceNumber = htonl(sequence);
+   tcpHeader->acknowledgmentNumber = htonl(acknowledgment);
+   tcpHeader->offset_controlBits = htons((5 << 12) | controlBits);
+   tcpHeader->window = htons(65535);
+   
+   pseudoHeader->sourceAddress = ipHeader->ip_src;
+   pseudoHeader->destinationAddress = ipHeader->ip_dst;
+   pseudoHeader->zeros = 0;
+   pseudoHeader->protocol = ip_protocol_tcp;
+   pseudoHeader->tcpLength = htons(sizeof(sr_tcp_hdr_t));
+   memcpy(pseudo + sizeof(sr_tcp_ip_pseudo_hdr_t), tcpHeader, sizeof(sr_tcp_hdr_t));
+   tcpHeader->checksum = cksum(pseudo, sizeof(pseudo));
+   
+   sr_handlepacket(sr, frame, sizeof(frame), (char *) receivingInterface);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file TestRouter.h
+ * @brief Router fixture shared by the unit tests.
+ *
+ * Builds a router without a VNS connection or timer threads: eth1
+ * (internal, 10.0.1.1) with host routes to two internal hosts, and eth2
+ * (external, 172.64.3.1, default route via 172.64.3.10), with every
+ * neighbour already in the ARP cache. Frames the router sends go to the
+ * "SendPacket" mock (LabThreeTests.cpp), and time is virtual, so tests
+ * drive the timeouts with sr_clock_advance() and the ticks themselves.
+ */
+
+#ifndef TEST_ROUTER_H
+#define TEST_ROUTER_H
+
+extern "C"
+{
+#include "sr_router.h"
+}
+
+#define TEST_INTERNAL_IFACE   "eth1"
+#define TEST_EXTERNAL_IFACE   "eth2"
+#define TEST_INTERNAL_IP      (0x0A000101) /* 10.0.1.1 */
+#define TEST_HOST_A           (0x0A000164) /* 10.0.1.100 */
+#define TEST_HOST_B           (0x0A000165) /* 10.0.1.101 */
+#define TEST_EXTERNAL_IP      (0xAC400301) /* 172.64.3.1 */
+#define TEST_EXTERNAL_GATEWAY (0xAC40030A) /* 172.64.3.10 */
+#define TEST_SERVER_ONE       (0x6B177383) /* 107.23.115.131 */
+#define TEST_SERVER_TWO       (0x6B177213) /* 107.23.114.19 */
+
+#define TEST_TCP_FRAME_LEN    (sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_tcp_hdr_t))
+
+void TestRouterSetup(struct sr_instance *sr, bool natEnabled);
+void TestRouterTeardown(struct sr_instance *sr);
+void TestRouterSendTcp(struct sr_instance *sr, const char *receivingInterface, uint32_t sourceIp,
+   uint16_t sourcePort, uint32_t destinationIp, uint16_t destinationPort, uint16_t controlBits,
+   uint32_t sequence, uint32_t acknowledgment);
+
+#endif /* TEST_ROUTER_H */
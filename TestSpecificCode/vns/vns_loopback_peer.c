@@ -0,0 +1,78 @@
+/**
+ * @file vns_loopback_peer.c
+ * @brief Stands in for the VNS server for one session of the real router.
+ *
+ * Usage: vns_loopback_peer [-p port] [-c] [-n requests] [-w window] [-s frame length]
+ *    -c  classic protocol only: don't offer the batching extension.
+ *
+ * Then, from a directory with an auth_key file and a routing table with a
+ * default route via 10.0.1.100 on eth1:
+ *    ./sr -s localhost -p <port> -r rtable
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "vns_peer.h"
+
+#define DEFAULT_PORT    (8888)
+
+int main(int argc, char **argv)
+{
+   vns_peer_options_t options = { true, 1000, 16, 98, true };
+   vns_peer_stats_t stats;
+   unsigned short port = DEFAULT_PORT;
+   int listenFd;
+   int c;
+
+   while ((c = getopt(argc, argv, "p:cn:w:s:")) != EOF)
+   {
+      switch (c)
+      {
+         case 'p':
+            port = atoi(optarg);
+            break;
+         case 'c':
+            options.offerBatching = false;
+            break;
+         case 'n':
+            options.requests = atoi(optarg);
+            break;
+         case 'w':
+            options.window = atoi(optarg);
+            break;
+         case 's':
+            options.frameLength = atoi(optarg);
+            break;
+         default:
+            fprintf(stderr, "Usage: %s [-p port] [-c] [-n requests] [-w window] [-s frame length]\n",
+               argv[0]);
+            return 1;
+      }
+   }
+   if (options.window == 0)
+   {
+      options.window = 1;
+   }
+
+   listenFd = VnsPeerListen(&port);
+   if (listenFd < 0)
+   {
+      return 1;
+   }
+   printf("VnsPeer: listening on 127.0.0.1:%u\n", port);
+   fflush(stdout);
+
+   if (VnsPeerServe(listenFd, &options, &stats) != 0)
+   {
+      close(listenFd);
+      return 1;
+   }
+   close(listenFd);
+
+   printf("VnsPeer: %.0f pings/s, %" PRIu64 " messages out, %" PRIu64 " in, "
+      "%" PRIu64 " frames out, %" PRIu64 " in\n", stats.replies / stats.seconds,
+      stats.messagesOut, stats.messagesIn, stats.framesOut, stats.framesIn);
+   return 0;
+}
@@ -0,0 +1,532 @@
+/**
+ * @file vns_peer.c
+ * @brief Minimal VNS server side, for testing the client without VNS.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "vns_peer.h"
+#include "vnscommand.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+
+#define PEER_CAPABILITY_WAIT_MS  (1000)
+#define PEER_REPLY_WAIT_MS       (5000)
+#define PEER_ECHO_ID             (0x5652)
+
+typedef struct
+{
+   int fd;
+   const vns_peer_options_t *options;
+   vns_peer_stats_t *stats;
+   uint8_t routerMac[ETHER_ADDR_LEN];
+   bool counting;
+
+   /* Batch being built, when batching. */
+   uint8_t batch[VNS_PEER_MAX_MESSAGE];
+   unsigned int batchLength;
+   uint32_t batchCount;
+} peer_t;
+
+static const uint8_t hostMac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x0A, 0x64 };
+static const uint8_t eth1Mac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x01 };
+static const uint8_t eth2Mac[ETHER_ADDR_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x02, 0x01 };
+
+static double peerNow(void)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int peerWrite(peer_t *peer, const void *buf, unsigned int length)
+{
+   const uint8_t *bytes = buf;
+   unsigned int written = 0;
+
+   while (written < length)
+   {
+      ssize_t ret = write(peer->fd, bytes + written, length - written);
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("write(..):VnsPeer");
+         return -1;
+      }
+      written += ret;
+   }
+
+   if (peer->counting)
+   {
+      peer->stats->messagesOut++;
+      peer->stats->bytesOut += length;
+   }
+   return 0;
+}
+
+static int peerReadFully(int fd, uint8_t *buf, unsigned int length)
+{
+   unsigned int received = 0;
+
+   while (received < length)
+   {
+      ssize_t ret = read(fd, buf + received, length - received);
+      if (ret == 0)
+      {
+         return -1;
+      }
+      if (ret < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      received += ret;
+   }
+   return 0;
+}
+
+/** Reads one message; returns its length, 0 on timeout, -1 on error. */
+static int peerRead(peer_t *peer, uint8_t *buf, int timeoutMs)
+{
+   struct pollfd descriptor = { peer->fd, POLLIN, 0 };
+   uint32_t length;
+
+   if (timeoutMs >= 0)
+   {
+      int ready = poll(&descriptor, 1, timeoutMs);
+      if (ready <= 0)
+      {
+         return ready;
+      }
+   }
+
+   if (peerReadFully(peer->fd, buf, 4) != 0)
+   {
+      return -1;
+   }
+   length = ntohl(*(uint32_t *) buf);
+   if ((length < sizeof(c_base)) || (length > VNS_PEER_MAX_MESSAGE))
+   {
+      fprintf(stderr, "VnsPeer: bad message length %u\n", length);
+      return -1;
+   }
+   if (peerReadFully(peer->fd, buf + 4, length - 4) != 0)
+   {
+      return -1;
+   }
+
+   if (peer->counting)
+   {
+      peer->stats->messagesIn++;
+      peer->stats->bytesIn += length;
+   }
+   return length;
+}
+
+static int peerFlush(peer_t *peer)
+{
+   c_packet_batch *header = (c_packet_batch *) peer->batch;
+   int ret = 0;
+
+   if (peer->batchCount > 0)
+   {
+      header->mLen = htonl(peer->batchLength);
+      header->mType = htonl(VNSPACKET_BATCH);
+      header->mCount = htonl(peer->batchCount);
+      ret = peerWrite(peer, peer->batch, peer->batchLength);
+   }
+   peer->batchLength = sizeof(c_packet_batch);
+   peer->batchCount = 0;
+   return ret;
+}
+
+/** Sends a frame on eth1, or adds it to the batch. */
+static int peerSendFrame(peer_t *peer, const uint8_t *frame, unsigned int length)
+{
+   if (peer->counting)
+   {
+      peer->stats->framesOut++;
+   }
+
+   if (peer->stats->batching)
+   {
+      c_packet_batch_frame *record;
+
+      if (peer->batchLength + sizeof(c_packet_batch_frame) + length > VNS_PEER_MAX_MESSAGE)
+      {
+         if (peerFlush(peer) != 0)
+         {
+            return -1;
+         }
+      }
+      record = (c_packet_batch_frame *) (peer->batch + peer->batchLength);
+      record->mLen = htons(length);
+      record->mInterfaceId = 0; /* eth1 */
+      record->mReserved = 0;
+      memcpy(peer->batch + peer->batchLength + sizeof(c_packet_batch_frame), frame, length);
+      peer->batchLength += sizeof(c_packet_batch_frame) + length;
+      peer->batchCount++;
+      return 0;
+   }
+   else
+   {
+      uint8_t message[sizeof(c_packet_header) + VNS_PEER_MAX_MESSAGE];
+      c_packet_header *header = (c_packet_header *) message;
+
+      header->mLen = htonl(sizeof(c_packet_header) + length);
+      header->mType = htonl(VNSPACKET);
+      memset(header->mInterfaceName, 0, sizeof(header->mInterfaceName));
+      strcpy(header->mInterfaceName, "eth1");
+      memcpy(message + sizeof(c_packet_header), frame, length);
+      return peerWrite(peer, message, sizeof(c_packet_header) + length);
+   }
+}
+
+static int peerHandshake(peer_t *peer)
+{
+   uint8_t buf[VNS_PEER_MAX_MESSAGE];
+   c_auth_request *request = (c_auth_request *) buf;
+   c_auth_status *status = (c_auth_status *) buf;
+   c_capabilities *capabilities = (c_capabilities *) buf;
+   c_hwinfo *hwinfo = (c_hwinfo *) buf;
+   unsigned int entries = 0;
+   uint32_t ip;
+   int length;
+
+   request->mLen = htonl(sizeof(c_auth_request) + 8);
+   request->mType = htonl(VNS_AUTH_REQUEST);
+   memcpy(request->salt, "vnspeer!", 8);
+   if ((peerWrite(peer, buf, sizeof(c_auth_request) + 8) != 0)
+      || (peerRead(peer, buf, -1) <= 0) || (ntohl(((c_base *) buf)->mType) != VNS_AUTH_REPLY))
+   {
+      fprintf(stderr, "VnsPeer: no authentication reply\n");
+      return -1;
+   }
+
+   status->mLen = htonl(sizeof(c_auth_status));
+   status->mType = htonl(VNS_AUTH_STATUS);
+   status->auth_ok = 1;
+   if ((peerWrite(peer, buf, sizeof(c_auth_status)) != 0) || (peerRead(peer, buf, -1) <= 0)
+      || (ntohl(((c_base *) buf)->mType) != VNSOPEN))
+   {
+      fprintf(stderr, "VnsPeer: no open request\n");
+      return -1;
+   }
+
+   if (peer->options->offerBatching)
+   {
+      capabilities->mLen = htonl(sizeof(c_capabilities));
+      capabilities->mType = htonl(VNS_CAPABILITIES);
+      capabilities->mVersion = htonl(VNS_CAP_VERSION);
+      capabilities->mCapabilities = htonl(VNS_CAP_PACKET_BATCH);
+      capabilities->mMaxBatchLen = htonl(VNS_PEER_MAX_MESSAGE);
+      if (peerWrite(peer, buf, sizeof(c_capabilities)) != 0)
+      {
+         return -1;
+      }
+
+      /* A client that doesn't know the extension ignores the offer. */
+      length = peerRead(peer, buf, PEER_CAPABILITY_WAIT_MS);
+      if (length < 0)
+      {
+         return -1;
+      }
+      if ((length >= (int) sizeof(c_capabilities))
+         && (ntohl(capabilities->mType) == VNS_CAPABILITIES))
+      {
+         peer->stats->batching = (ntohl(capabilities->mCapabilities) & VNS_CAP_PACKET_BATCH) != 0;
+      }
+   }
+
+   memset(buf, 0, sizeof(buf));
+   hwinfo->mHWInfo[entries].mKey = htonl(HWINTERFACE);
+   strcpy(hwinfo->mHWInfo[entries++].value, "eth1");
+   hwinfo->mHWInfo[entries].mKey = htonl(HWETHER);
+   memcpy(hwinfo->mHWInfo[entries++].value, eth1Mac, ETHER_ADDR_LEN);
+   hwinfo->mHWInfo[entries].mKey = htonl(HWETHIP);
+   ip = htonl(VNS_PEER_ROUTER_IP);
+   memcpy(hwinfo->mHWInfo[entries++].value, &ip, sizeof(ip));
+   hwinfo->mHWInfo[entries].mKey = htonl(HWINTERFACE);
+   strcpy(hwinfo->mHWInfo[entries++].value, "eth2");
+   hwinfo->mHWInfo[entries].mKey = htonl(HWETHER);
+   memcpy(hwinfo->mHWInfo[entries++].value, eth2Mac, ETHER_ADDR_LEN);
+   hwinfo->mHWInfo[entries].mKey = htonl(HWETHIP);
+   ip = htonl(0xAC400301);
+   memcpy(hwinfo->mHWInfo[entries++].value, &ip, sizeof(ip));
+   hwinfo->mLen = htonl(2 * sizeof(uint32_t) + entries * sizeof(c_hw_entry));
+   hwinfo->mType = htonl(VNSHWINFO);
+
+   memcpy(peer->routerMac, eth1Mac, ETHER_ADDR_LEN);
+   return peerWrite(peer, buf, 2 * sizeof(uint32_t) + entries * sizeof(c_hw_entry));
+}
+
+static void peerBuildEcho(peer_t *peer, uint8_t *frame, uint16_t sequence)
+{
+   unsigned int length = peer->options->frameLength;
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) frame;
+   sr_ip_hdr_t *ipHeader = (sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   sr_icmp_t0_hdr_t *icmpHeader = (sr_icmp_t0_hdr_t *) (((uint8_t *) ipHeader) + sizeof(sr_ip_hdr_t));
+   unsigned int ipLength = length - sizeof(sr_ethernet_hdr_t);
+
+   memset(frame, 0, length);
+   memcpy(ethernetHeader->ether_dhost, peer->routerMac, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, hostMac, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(ethertype_ip);
+
+   ipHeader->ip_v = 4;
+   ipHeader->ip_hl = sizeof(sr_ip_hdr_t) / 4;
+   ipHeader->ip_len = htons(ipLength);
+   ipHeader->ip_ttl = 64;
+   ipHeader->ip_p = ip_protocol_icmp;
+   ipHeader->ip_src = htonl(VNS_PEER_HOST_IP);
+   ipHeader->ip_dst = htonl(VNS_PEER_ROUTER_IP);
+   ipHeader->ip_sum = cksum(ipHeader, sizeof(sr_ip_hdr_t));
+
+   icmpHeader->icmp_type = icmp_type_echo_request;
+   icmpHeader->icmp_code = 0;
+   icmpHeader->ident = htons(PEER_ECHO_ID);
+   icmpHeader->seq_num = htons(sequence);
+   icmpHeader->icmp_sum = cksum(icmpHeader, ipLength - sizeof(sr_ip_hdr_t));
+}
+
+/** Handles a frame from the router; counts echo replies. */
+static int peerReceiveFrame(peer_t *peer, const uint8_t *frame, unsigned int length)
+{
+   const sr_ethernet_hdr_t *ethernetHeader = (const sr_ethernet_hdr_t *) frame;
+
+   if (peer->counting)
+   {
+      peer->stats->framesIn++;
+   }
+
+   if ((ntohs(ethernetHeader->ether_type) == ethertype_arp)
+      && (length >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)))
+   {
+      const sr_arp_hdr_t *request = (const sr_arp_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+      uint8_t reply[sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)];
+      sr_ethernet_hdr_t *replyEthernet = (sr_ethernet_hdr_t *) reply;
+      sr_arp_hdr_t *replyArp = (sr_arp_hdr_t *) (reply + sizeof(sr_ethernet_hdr_t));
+
+      if (ntohs(request->ar_op) != arp_op_request)
+      {
+         return 0;
+      }
+
+      /* Every address on eth1 is one of our hosts. */
+      memcpy(replyEthernet->ether_dhost, request->ar_sha, ETHER_ADDR_LEN);
+      memcpy(replyEthernet->ether_shost, hostMac, ETHER_ADDR_LEN);
+      replyEthernet->ether_type = htons(ethertype_arp);
+      replyArp->ar_hrd = htons(arp_hrd_ethernet);
+      replyArp->ar_pro = htons(ethertype_ip);
+      replyArp->ar_hln = ETHER_ADDR_LEN;
+      replyArp->ar_pln = IP_ADDR_LEN;
+      replyArp->ar_op = htons(arp_op_reply);
+      memcpy(replyArp->ar_sha, hostMac, ETHER_ADDR_LEN);
+      replyArp->ar_sip = request->ar_tip;
+      memcpy(replyArp->ar_tha, request->ar_sha, ETHER_ADDR_LEN);
+      replyArp->ar_tip = request->ar_sip;
+      return peerSendFrame(peer, reply, sizeof(reply));
+   }
+
+   if ((ntohs(ethernetHeader->ether_type) == ethertype_ip)
+      && (length >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t0_hdr_t)))
+   {
+      const sr_ip_hdr_t *ipHeader = (const sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+      const sr_icmp_t0_hdr_t *icmpHeader = (const sr_icmp_t0_hdr_t *) (((const uint8_t *) ipHeader)
+         + sizeof(sr_ip_hdr_t));
+
+      if ((ipHeader->ip_p == ip_protocol_icmp) && (icmpHeader->icmp_type == icmp_type_echo_reply)
+         && (ntohs(icmpHeader->ident) == PEER_ECHO_ID))
+      {
+         peer->stats->replies++;
+      }
+   }
+   return 0;
+}
+
+static int peerReceiveMessage(peer_t *peer, uint8_t *buf, int length)
+{
+   uint32_t type = ntohl(((c_base *) buf)->mType);
+
+   if (type == VNSPACKET)
+   {
+      if (length < (int) sizeof(c_packet_header))
+      {
+         return -1;
+      }
+      return peerReceiveFrame(peer, buf + sizeof(c_packet_header), length - sizeof(c_packet_header));
+   }
+   else if (type == VNSPACKET_BATCH)
+   {
+      uint32_t count = ntohl(((c_packet_batch *) buf)->mCount);
+      unsigned int offset = sizeof(c_packet_batch);
+      uint32_t i;
+
+      for (i = 0; i < count; i++)
+      {
+         c_packet_batch_frame *record = (c_packet_batch_frame *) (buf + offset);
+         unsigned int frameLength;
+
+         if (offset + sizeof(c_packet_batch_frame) > (unsigned int) length)
+         {
+            return -1;
+         }
+         frameLength = ntohs(record->mLen);
+         offset += sizeof(c_packet_batch_frame);
+         if (offset + frameLength > (unsigned int) length)
+         {
+            return -1;
+         }
+         if (peerReceiveFrame(peer, buf + offset, frameLength) != 0)
+         {
+            return -1;
+         }
+         offset += frameLength;
+      }
+   }
+   return 0;
+}
+
+/**
+ * VnsPeerListen()
+ * @brief Opens a listening socket on the loopback interface.
+ * @param port in: port to listen on (0 for any); out: the port used.
+ * @return the socket, or -1 on error.
+ */
+int VnsPeerListen(unsigned short *port)
+{
+   struct sockaddr_in address;
+   socklen_t addressLength = sizeof(address);
+   int on = 1;
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+   if (fd < 0)
+   {
+      perror("socket(..):VnsPeerListen");
+      return -1;
+   }
+   setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   address.sin_port = htons(*port);
+   if ((bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) || (listen(fd, 1) != 0)
+      || (getsockname(fd, (struct sockaddr *) &address, &addressLength) != 0))
+   {
+      perror("bind(..):VnsPeerListen");
+      close(fd);
+      return -1;
+   }
+
+   *port = ntohs(address.sin_port);
+   return fd;
+}
+
+/**
+ * VnsPeerServe()
+ * @brief Accepts one router session and runs it to completion.
+ * @return 0 if every echo request was answered, -1 otherwise.
+ */
+int VnsPeerServe(int listenFd, const vns_peer_options_t *options, vns_peer_stats_t *stats)
+{
+   peer_t *peer = calloc(1, sizeof(peer_t));
+   uint8_t *buf = malloc(VNS_PEER_MAX_MESSAGE);
+   uint8_t frame[VNS_PEER_MAX_MESSAGE];
+   unsigned int sent = 0;
+   double start;
+   c_close *goodbye = (c_close *) buf;
+   int result = 0;
+
+   memset(stats, 0, sizeof(*stats));
+   if ((peer == NULL) || (buf == NULL) || (options->frameLength > sizeof(frame))
+      || (options->frameLength < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)
+         + sizeof(sr_icmp_t0_hdr_t)))
+   {
+      free(peer);
+      free(buf);
+      return -1;
+   }
+
+   peer->options = options;
+   peer->stats = stats;
+   peer->batchLength = sizeof(c_packet_batch);
+   peer->fd = accept(listenFd, NULL, NULL);
+   if ((peer->fd < 0) || (peerHandshake(peer) != 0))
+   {
+      result = -1;
+   }
+
+   peer->counting = true;
+   start = peerNow();
+   while ((result == 0) && (stats->replies < options->requests))
+   {
+      int length;
+
+      while ((sent < options->requests) && (sent - stats->replies < options->window))
+      {
+         peerBuildEcho(peer, frame, (uint16_t) sent);
+         if (peerSendFrame(peer, frame, options->frameLength) != 0)
+         {
+            result = -1;
+            break;
+         }
+         sent++;
+      }
+      if ((result != 0) || (peerFlush(peer) != 0))
+      {
+         result = -1;
+         break;
+      }
+
+      length = peerRead(peer, buf, PEER_REPLY_WAIT_MS);
+      if (length <= 0)
+      {
+         fprintf(stderr, "VnsPeer: router stopped answering after %u of %u replies\n",
+            stats->replies, options->requests);
+         result = -1;
+      }
+      else if ((peerReceiveMessage(peer, buf, length) != 0) || (peerFlush(peer) != 0))
+      {
+         fprintf(stderr, "VnsPeer: malformed message from router\n");
+         result = -1;
+      }
+   }
+   stats->seconds = peerNow() - start;
+   peer->counting = false;
+
+   if (peer->fd >= 0)
+   {
+      memset(goodbye, 0, sizeof(c_close));
+      goodbye->mLen = htonl(sizeof(c_close));
+      goodbye->mType = htonl(VNSCLOSE);
+      strcpy(goodbye->mErrorMessage, "loopback peer done");
+      peerWrite(peer, goodbye, sizeof(c_close));
+      close(peer->fd);
+   }
+
+   if (options->verbose)
+   {
+      printf("VnsPeer: %s, %u/%u replies\n", stats->batching ? "batched" : "classic",
+         stats->replies, options->requests);
+   }
+
+   free(peer);
+   free(buf);
+   return result;
+}
@@ -0,0 +1,54 @@
+/**
+ * @file vns_peer.h
+ * @brief Minimal VNS server side, for testing the client without VNS.
+ *
+ * Serves one router session on an accepted TCP connection: authenticates
+ * it (accepting any key), reads its open request, offers the packet
+ * batching extension (unless told not to) and sends hardware information for
+ * two interfaces:
+ *    - eth1 10.0.1.1, the side traffic is sent to,
+ *    - eth2 172.64.3.1.
+ * It then plays every host on eth1: it answers the router's ARP requests
+ * and sends ICMP echo requests from VNS_PEER_HOST_IP to eth1's address,
+ * keeping a window of them outstanding, until every one has been answered.
+ * Frames go out as one VNSPACKET each, or as one VNSPACKET_BATCH per window
+ * when the router accepted the extension. The router needs a default route
+ * via VNS_PEER_HOST_IP on eth1.
+ */
+
+#ifndef VNS_PEER_H
+#define VNS_PEER_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#define VNS_PEER_HOST_IP        (0x0A000164) /* 10.0.1.100 */
+#define VNS_PEER_ROUTER_IP      (0x0A000101) /* 10.0.1.1 */
+#define VNS_PEER_MAX_MESSAGE    (10000)
+
+typedef struct
+{
+   bool offerBatching;
+   unsigned int requests; /**< Echo requests to send. */
+   unsigned int window; /**< Echo requests outstanding at once. */
+   unsigned int frameLength; /**< Length of each echo request frame. */
+   bool verbose;
+} vns_peer_options_t;
+
+typedef struct
+{
+   bool batching; /**< The router accepted the extension. */
+   unsigned int replies;
+   uint64_t messagesOut;
+   uint64_t messagesIn;
+   uint64_t bytesOut;
+   uint64_t bytesIn;
+   uint64_t framesOut;
+   uint64_t framesIn;
+   double seconds; /**< From the first echo request to the last reply. */
+} vns_peer_stats_t;
+
+int VnsPeerListen(unsigned short *port);
+int VnsPeerServe(int listenFd, const vns_peer_options_t *options, vns_peer_stats_t *stats);
+
+#endif /* VNS_PEER_H */
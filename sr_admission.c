@@ -0,0 +1,165 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "sr_admission.h"
+#include "sr_protocol.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static bool admissionIsControl(struct sr_instance *sr, const uint8_t *frame, unsigned int length);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_admission_init()\n
+ * @brief Resets the counters and sets the watermarks.
+ * @param admission pointer to the instance's admission state.
+ * @param highWatermark backlog in bytes that starts shedding transit frames,
+ *        or 0 to admit everything.
+ * @param lowWatermark backlog in bytes below which shedding stops; 0 (or a
+ *        value above the high watermark) means half the high watermark.
+ */
+void sr_admission_init(sr_admission_t *admission, uint32_t highWatermark, uint32_t lowWatermark)
+{
+   assert(admission);
+
+   memset(admission, 0, sizeof(*admission));
+   admission->highWatermark = highWatermark;
+   admission->lowWatermark = ((lowWatermark == 0) || (lowWatermark > highWatermark)) ?
+      highWatermark / 2 : lowWatermark;
+}
+
+/**
+ * sr_admission_update()\n
+ * @brief Measures the VNS backlog before a message is handled.
+ * @param admission pointer to the instance's admission state.
+ * @param sockfd the instance's VNS socket.
+ * @param buffered bytes already read from the socket but not yet handled.
+ */
+void sr_admission_update(sr_admission_t *admission, int sockfd, unsigned int buffered)
+{
+   int queued = 0;
+
+   if (admission->highWatermark == 0)
+   {
+      return;
+   }
+
+   if (ioctl(sockfd, FIONREAD, &queued) != 0)
+   {
+      queued = 0;
+   }
+   admission->backlog = (uint32_t) queued + buffered;
+   if (admission->backlog > admission->peakBacklog)
+   {
+      admission->peakBacklog = admission->backlog;
+   }
+
+   if (!admission->overloaded && (admission->backlog >= admission->highWatermark))
+   {
+      admission->overloaded = true;
+      admission->overloadEpisodes++;
+   }
+   else if (admission->overloaded && (admission->backlog < admission->lowWatermark))
+   {
+      admission->overloaded = false;
+   }
+}
+
+/**
+ * sr_admission_admit()\n
+ * @brief Decides whether a received frame gets handled at all.
+ * @param sr pointer to the router instance.
+ * @param frame the received ethernet frame.
+ * @param length length of the frame in bytes.
+ * @return true to handle the frame, false to drop it.
+ */
+bool sr_admission_admit(struct sr_instance *sr, const uint8_t *frame, unsigned int length)
+{
+   sr_admission_t *admission = &sr->admission;
+
+   if (admissionIsControl(sr, frame, length))
+   {
+      admission->admittedControl++;
+      return true;
+   }
+
+   if (admission->overloaded)
+   {
+      admission->droppedTransit++;
+      return false;
+   }
+
+   admission->admittedTransit++;
+   return true;
+}
+
+/**
+ * sr_admission_print()\n
+ * @brief Writes the overload state and counters on one line.
+ * @param sr pointer to the router instance.
+ * @param out stream to write to.
+ */
+void sr_admission_print(const struct sr_instance *sr, FILE *out)
+{
+   const sr_admission_t *admission = &sr->admission;
+
+   fprintf(out, "topology %u: %s, backlog %" PRIu32 " (peak %" PRIu32 ", watermarks %" PRIu32
+      "/%" PRIu32 "), control %" PRIu64 ", transit %" PRIu64 " admitted %" PRIu64
+      " dropped, %" PRIu64 " overload episodes\n", sr->topo_id,
+      admission->overloaded ? "OVERLOADED" : "ok", admission->backlog, admission->peakBacklog,
+      admission->highWatermark, admission->lowWatermark, admission->admittedControl,
+      admission->admittedTransit, admission->droppedTransit, admission->overloadEpisodes);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * admissionIsControl()\n
+ * @brief Classifies a frame using nothing past the IP header.
+ * @return true for ARP and for IP datagrams addressed to one of our
+ *         interfaces (with NAT this includes replies to translated flows).
+ */
+static bool admissionIsControl(struct sr_instance *sr, const uint8_t *frame, unsigned int length)
+{
+   const sr_ethernet_hdr_t *ethernetHeader = (const sr_ethernet_hdr_t *) frame;
+
+   if (length < sizeof(sr_ethernet_hdr_t))
+   {
+      return false;
+   }
+
+   switch (ntohs(ethernetHeader->ether_type))
+   {
+      case ethertype_arp:
+         return true;
+
+      case ethertype_ip:
+         return (length >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+            && IpDestinationIsUs(sr, (const sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t)));
+
+      default:
+         return false;
+   }
+}
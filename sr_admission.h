@@ -0,0 +1,65 @@
+/**
+ * @file sr_admission.h
+ * @brief Overload admission control for frames received from VNS.
+ *
+ * When frames arrive faster than the router handles them, they queue up in
+ * the VNS socket, and ARP and traffic for the router itself wait behind the
+ * flood like everything else. Before each VNS message is handled the bytes
+ * still queued on the socket (or already read ahead by the adaptive reader)
+ * are measured. Once they reach the high watermark the instance is
+ * overloaded: transit frames are dropped before they are parsed any further,
+ * while ARP and IP addressed to one of our interfaces are always let through.
+ * The instance recovers once the queue has drained below the low watermark.
+ *
+ * Counters are only touched by the thread reading the instance's VNS
+ * socket, which is also where SIGUSR1 has them printed.
+ */
+
+#ifndef SR_ADMISSION_H
+#define SR_ADMISSION_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_ADMISSION_DEFAULT_HIGH_WATERMARK  (64 * 1024) /**< Bytes queued on the VNS socket. */
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef struct sr_admission
+{
+   uint32_t highWatermark; /**< Backlog (bytes) that starts shedding; 0 disables it. */
+   uint32_t lowWatermark; /**< Backlog (bytes) below which shedding stops. */
+   bool overloaded;
+
+   uint32_t backlog; /**< Bytes queued when the current message was read. */
+   uint32_t peakBacklog;
+
+   uint64_t admittedControl; /**< ARP and IP to us, overloaded or not. */
+   uint64_t admittedTransit;
+   uint64_t droppedTransit;
+   uint64_t overloadEpisodes;
+} sr_admission_t;
+
+/*
+ * Public Function Declarations
+ */
+
+void sr_admission_init(sr_admission_t *admission, uint32_t highWatermark, uint32_t lowWatermark);
+void sr_admission_update(sr_admission_t *admission, int sockfd, unsigned int buffered);
+bool sr_admission_admit(struct sr_instance *sr, const uint8_t *frame, unsigned int length);
+void sr_admission_print(const struct sr_instance *sr, FILE *out);
+
+#endif /* SR_ADMISSION_H */
@@ -6,13 +6,21 @@
 #include <pthread.h>
 #include <sched.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
 #include "sr_arpcache.h"
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_clock.h"
+#include "sr_watchdog.h"
+#include "sr_probe.h"
 
 #define MAX_NUM_ARP_TRANSMISSIONS   (5)
 
+static int sr_arpcache_restore(struct sr_arpcache *cache);
+static void sr_arpcache_revalidate(struct sr_instance *sr);
+
 /* 
  This function gets called every second. For each request sent out, we keep
  checking whether we should resend an request or destroy the arp request.
@@ -22,11 +30,14 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr)
 {
    /* Fill this in */
    struct sr_arpreq* requestIterator;
+   struct sr_arpreq* nextRequest;
    
-   /* Iterate over all requests and resend as necessary. */
+   /* Iterate over all requests and resend as necessary. The next request is 
+    * saved first, since a request that timed out is freed. */
    for (requestIterator = sr->cache.requests; requestIterator != NULL; requestIterator =
-      requestIterator->next)
+      nextRequest)
    {
+      nextRequest = requestIterator->next;
       if (requestIterator->times_sent < MAX_NUM_ARP_TRANSMISSIONS)
       {
          /* Try, try again. */
@@ -38,17 +49,21 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr)
          /* We've tried and failed. Send destination unreachable to the source 
           * of all packets pending on this ARP request. */
          struct sr_packet * packetIterator;
+         unsigned int packets = 0;
          fprintf(stderr, "ARP request timed out. Sending unreachable packets.\n");
          
          for (packetIterator = requestIterator->packets; packetIterator != NULL; packetIterator =
             packetIterator->next)
          {
+            SR_PROBE_DROP("arp_timeout", packetIterator->len);
+            packets++;
             IpSendTypeThreeIcmpPacket(sr, icmp_code_destination_host_unreachable,
                (sr_ip_hdr_t*) (packetIterator->buf + sizeof(sr_ethernet_hdr_t)));
             
             /* We do not have to free all memory associated with this packet. 
              * arpreq_destroy will do this for us. */
          }
+         SR_PROBE2(arp_timeout, requestIterator->ip, packets);
          
          /* Bye bye ARP request. */
          sr_arpreq_destroy(&sr->cache, requestIterator);
@@ -62,7 +77,7 @@ void sr_arpcache_sweepreqs(struct sr_instance *sr)
  You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip)
 {
-   pthread_mutex_lock(&(cache->lock));
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    struct sr_arpentry *entry = NULL, *copy = NULL;
    
@@ -83,7 +98,7 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip)
       memcpy(copy, entry, sizeof(struct sr_arpentry));
    }
    
-   pthread_mutex_unlock(&(cache->lock));
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    return copy;
 }
@@ -97,7 +112,7 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip)
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache, uint32_t ip, uint8_t *packet, /* borrowed */
    unsigned int packet_len, const char *iface)
 {
-   pthread_mutex_lock(&(cache->lock));
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    struct sr_arpreq *req;
    for (req = cache->requests; req != NULL; req = req->next)
@@ -131,12 +146,13 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache, uint32_t ip, u
       memcpy(new_pkt->buf, packet, packet_len);
       new_pkt->len = packet_len;
       new_pkt->iface = (char *) malloc(sr_IFACE_NAMELEN);
-      strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+      strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN - 1);
+      new_pkt->iface[sr_IFACE_NAMELEN - 1] = '\0';
       new_pkt->next = req->packets;
       req->packets = new_pkt;
    }
    
-   pthread_mutex_unlock(&(cache->lock));
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    return req;
 }
@@ -145,9 +161,10 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache, uint32_t ip, u
  1) Looks up this IP in the request queue. If it is found, returns a pointer
  to the sr_arpreq with this IP. Otherwise, returns NULL.
  2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
-struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache, unsigned char *mac, uint32_t ip)
+struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache, unsigned char *mac, uint32_t ip,
+   const char *iface)
 {
-   pthread_mutex_lock(&(cache->lock));
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    struct sr_arpreq *req, *prev = NULL, *next = NULL;
    for (req = cache->requests; req != NULL ; req = req->next)
@@ -170,23 +187,40 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache, unsigned char *m
       prev = req;
    }
    
+   /* Refresh an existing (possibly stale) entry rather than duplicating it. */
    int i;
    for (i = 0; i < SR_ARPCACHE_SZ; i++)
    {
-      if (!(cache->entries[i].valid))
+      if ((cache->entries[i].valid) && (cache->entries[i].ip == ip))
          break;
    }
    
-   if (i != SR_ARPCACHE_SZ)
+   if (i == SR_ARPCACHE_SZ)
+   {
+      for (i = 0; i < SR_ARPCACHE_SZ; i++)
+      {
+         if (!(cache->entries[i].valid))
+            break;
+      }
+   }
+   
+   if (i == SR_ARPCACHE_SZ)
    {
-      memcpy(cache->entries[i].mac, mac, 6);
-      cache->entries[i].ip = ip;
-      cache->entries[i].added = time(NULL);
-      cache->entries[i].valid = 1;
+      /* Table full. Kick out a random entry. */
+      i = rand_r(&cache->randSeed) % SR_ARPCACHE_SZ;
    }
    
-   pthread_mutex_unlock(&(cache->lock));
+   memcpy(cache->entries[i].mac, mac, 6);
+   cache->entries[i].ip = ip;
+   cache->entries[i].added = sr_clock_now();
+   cache->entries[i].valid = 1;
+   cache->entries[i].stale = 0;
+   strncpy(cache->entries[i].iface, iface, sr_IFACE_NAMELEN);
+   cache->entries[i].iface[sr_IFACE_NAMELEN - 1] = '\0';
    
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   
+   SR_PROBE2(arp_insert, ip, req != NULL);
    return req;
 }
 
@@ -194,7 +228,7 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache, unsigned char *m
  entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry)
 {
-   pthread_mutex_lock(&(cache->lock));
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
    
    if (entry)
    {
@@ -234,7 +268,7 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry)
       free(entry);
    }
    
-   pthread_mutex_unlock(&(cache->lock));
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
 }
 
 /* Prints out the ARP table. */
@@ -258,57 +292,259 @@ void sr_arpcache_dump(struct sr_arpcache *cache)
 /* Initialize table + table lock. Returns 0 on success. */
 int sr_arpcache_init(struct sr_arpcache *cache)
 {
-   /* Seed RNG to kick out a random entry if all entries full. */
-   srand(time(NULL ));
+   /* Seed this cache's RNG to kick out a random entry if all entries full. 
+    * Each cache has its own state so instances sharing a process do not 
+    * perturb each other's eviction order. */
+   cache->randSeed = (unsigned int) time(NULL) ^ (unsigned int) (uintptr_t) cache;
    
    /* Invalidate all entries */
    memset(cache->entries, 0, sizeof(cache->entries));
    cache->requests = NULL;
+   cache->lastSaved = sr_clock_now();
    
    /* Acquire mutex lock */
    pthread_mutexattr_init(&(cache->attr));
    pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
    int success = pthread_mutex_init(&(cache->lock), &(cache->attr));
    
+   /* Warm start from the previous run's snapshot, if any. */
+   if (cache->persistFile)
+   {
+      int restored = sr_arpcache_restore(cache);
+      if (restored > 0)
+      {
+         fprintf(stderr, "Restored %d stale ARP entries from %s\n", restored, cache->persistFile);
+      }
+   }
+   
    return success;
 }
 
+/**
+ * sr_arpcache_save()\n
+ * @brief Writes all valid ARP entries to the cache's snapshot file.
+ * @param cache pointer to the ARP cache.
+ * @return 0 on success or when persistence is disabled, -1 on error.
+ * @note The cache lock is only held while copying the table. The file is 
+ *       written to a temporary name and renamed so a crash mid-write never 
+ *       leaves a truncated snapshot behind.
+ */
+int sr_arpcache_save(struct sr_arpcache *cache)
+{
+   sr_arpcache_file_rec_t records[SR_ARPCACHE_SZ];
+   sr_arpcache_file_hdr_t header;
+   char tempFileName[FILENAME_MAX];
+   uint16_t count = 0;
+   FILE *fp;
+   int i;
+   
+   if (cache->persistFile == NULL)
+   {
+      return 0;
+   }
+   
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   for (i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      if (cache->entries[i].valid)
+      {
+         sr_arpcache_file_rec_t *rec = &records[count++];
+         rec->ip = htonl(cache->entries[i].ip);
+         memcpy(rec->mac, cache->entries[i].mac, ETHER_ADDR_LEN);
+         memcpy(rec->iface, cache->entries[i].iface, sr_IFACE_NAMELEN);
+         rec->added = htonl((uint32_t) cache->entries[i].added);
+      }
+   }
+   cache->lastSaved = sr_clock_now();
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   
+   header.magic = htonl(SR_ARPCACHE_FILE_MAGIC);
+   header.version = htons(SR_ARPCACHE_FILE_VERSION);
+   header.count = htons(count);
+   
+   snprintf(tempFileName, sizeof(tempFileName), "%s.tmp", cache->persistFile);
+   fp = fopen(tempFileName, "wb");
+   if (fp == NULL)
+   {
+      perror("fopen(..):sr_arpcache.c::sr_arpcache_save");
+      return -1;
+   }
+   
+   if ((fwrite(&header, sizeof(header), 1, fp) != 1)
+      || (fwrite(records, sizeof(sr_arpcache_file_rec_t), count, fp) != count))
+   {
+      fprintf(stderr, "Error writing ARP cache snapshot %s\n", tempFileName);
+      fclose(fp);
+      unlink(tempFileName);
+      return -1;
+   }
+   
+   if ((fclose(fp) != 0) || (rename(tempFileName, cache->persistFile) != 0))
+   {
+      perror("rename(..):sr_arpcache.c::sr_arpcache_save");
+      unlink(tempFileName);
+      return -1;
+   }
+   
+   return 0;
+}
+
+/**
+ * sr_arpcache_restore()\n
+ * @brief Loads a snapshot written by sr_arpcache_save() as stale entries.
+ * @param cache pointer to an initialized, empty ARP cache.
+ * @return number of entries restored, or -1 if the snapshot is unusable.
+ * @note Restored entries forward immediately, but are marked stale so the 
+ *       timeout thread re-ARPs them. They get a full SR_ARPCACHE_TO window 
+ *       to be confirmed before they expire like any other entry.
+ */
+static int sr_arpcache_restore(struct sr_arpcache *cache)
+{
+   sr_arpcache_file_hdr_t header;
+   sr_arpcache_file_rec_t rec;
+   time_t curtime = sr_clock_now();
+   int restored = 0;
+   int i;
+   FILE *fp = fopen(cache->persistFile, "rb");
+   
+   if (fp == NULL)
+   {
+      /* A missing snapshot is normal for a first start. */
+      if (errno != ENOENT)
+      {
+         perror("fopen(..):sr_arpcache.c::sr_arpcache_restore");
+      }
+      return -1;
+   }
+   
+   if ((fread(&header, sizeof(header), 1, fp) != 1)
+      || (ntohl(header.magic) != SR_ARPCACHE_FILE_MAGIC)
+      || (ntohs(header.version) != SR_ARPCACHE_FILE_VERSION))
+   {
+      fprintf(stderr, "Ignoring invalid ARP cache snapshot %s\n", cache->persistFile);
+      fclose(fp);
+      return -1;
+   }
+   
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   for (i = 0; (i < ntohs(header.count)) && (restored < SR_ARPCACHE_SZ); i++)
+   {
+      if (fread(&rec, sizeof(rec), 1, fp) != 1)
+      {
+         break;
+      }
+      
+      if (difftime(curtime, (time_t) ntohl(rec.added)) > SR_ARPCACHE_RESTORE_MAX_AGE)
+      {
+         continue;
+      }
+      
+      sr_arpentry_t *entry = &(cache->entries[restored++]);
+      entry->ip = ntohl(rec.ip);
+      memcpy(entry->mac, rec.mac, ETHER_ADDR_LEN);
+      memcpy(entry->iface, rec.iface, sr_IFACE_NAMELEN);
+      entry->iface[sr_IFACE_NAMELEN - 1] = '\0';
+      entry->added = curtime;
+      entry->valid = 1;
+      entry->stale = 1;
+   }
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   
+   fclose(fp);
+   return restored;
+}
+
+/**
+ * sr_arpcache_revalidate()\n
+ * @brief Sends ARP requests for restored entries that have not been confirmed.
+ * @param sr pointer to simple router state.
+ * @note Called from the timeout thread with the cache locked. A confirming 
+ *       reply refreshes the entry through sr_arpcache_insert(). Entries that 
+ *       are never confirmed simply age out.
+ */
+static void sr_arpcache_revalidate(struct sr_instance *sr)
+{
+   struct sr_arpcache *cache = &(sr->cache);
+   int i;
+   
+   for (i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      sr_arpentry_t *entry = &(cache->entries[i]);
+      if (entry->valid && entry->stale && (entry->stale <= MAX_NUM_ARP_TRANSMISSIONS))
+      {
+         struct sr_arpreq probe;
+         
+         memset(&probe, 0, sizeof(probe));
+         probe.ip = entry->ip;
+         probe.requestedInterface = sr_get_interface(sr, entry->iface);
+         
+         if (probe.requestedInterface == NULL)
+         {
+            /* Interface went away across the restart. Can't trust it. */
+            entry->valid = 0;
+            continue;
+         }
+         
+         LinkSendArpRequest(sr, &probe);
+         entry->stale++;
+      }
+   }
+}
+
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache)
 {
    return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
- more than SR_ARPCACHE_TO seconds ago. */
+/* Runs one second's worth of cache maintenance: invalidates entries that were 
+ added more than SR_ARPCACHE_TO seconds ago, revalidates stale entries, resends 
+ pending requests and periodically writes the snapshot file. */
+void sr_arpcache_tick(struct sr_instance *sr)
+{
+   struct sr_arpcache *cache = &(sr->cache);
+   sr_watchdog_stage_t stage = sr_watchdog_stage(SR_WATCHDOG_ARP_SWEEP);
+   
+   sr_watchdog_lock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   
+   time_t curtime = sr_clock_now();
+   
+   int i;
+   for (i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      if ((cache->entries[i].valid)
+         && (difftime(curtime, cache->entries[i].added) > SR_ARPCACHE_TO))
+      {
+         SR_PROBE1(arp_expire, cache->entries[i].ip);
+         cache->entries[i].valid = 0;
+      }
+   }
+   
+   sr_arpcache_revalidate(sr);
+   sr_arpcache_sweepreqs(sr);
+   
+   sr_watchdog_unlock(&(cache->lock), SR_WATCHDOG_LOCK_ARP);
+   
+   if (cache->persistFile && (difftime(curtime, cache->lastSaved) >= SR_ARPCACHE_SAVE_INTERVAL))
+   {
+      sr_arpcache_save(cache);
+   }
+   
+   sr_watchdog_stage(stage);
+}
+
+/* Thread which ticks the router (the cache first) once a second. */
 void *sr_arpcache_timeout(void *sr_ptr)
 {
    struct sr_instance *sr = sr_ptr;
-   struct sr_arpcache *cache = &(sr->cache);
    
+   sr_watchdog_register("arp timer");
    while (1)
    {
+      sr_watchdog_idle();
       sleep(1.0);
-      
-      pthread_mutex_lock(&(cache->lock));
-      
-      time_t curtime = time(NULL );
-      
-      int i;
-      for (i = 0; i < SR_ARPCACHE_SZ; i++)
-      {
-         if ((cache->entries[i].valid)
-            && (difftime(curtime, cache->entries[i].added) > SR_ARPCACHE_TO))
-         {
-            cache->entries[i].valid = 0;
-         }
-      }
-      
-      sr_arpcache_sweepreqs(sr);
-      
-      pthread_mutex_unlock(&(cache->lock));
+      sr_router_tick(sr);
    }
    
    return NULL ;
 }
-
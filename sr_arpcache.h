@@ -74,6 +74,11 @@
 #define SR_ARPCACHE_SZ    100  
 #define SR_ARPCACHE_TO    15.0
 
+#define SR_ARPCACHE_SAVE_INTERVAL      10.0   /* Seconds between cache snapshots */
+#define SR_ARPCACHE_RESTORE_MAX_AGE    300.0  /* Older snapshot entries are ignored */
+#define SR_ARPCACHE_FILE_MAGIC         0x41525043 /* "ARPC" */
+#define SR_ARPCACHE_FILE_VERSION       1
+
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
@@ -86,6 +91,9 @@ typedef struct sr_arpentry {
     uint32_t ip;                /* IP addr in network byte order */
     time_t added;         
     int valid;
+    char iface[sr_IFACE_NAMELEN]; /* Interface the mapping was learned on */
+    uint32_t stale;             /* Non-zero if restored from disk and not yet 
+                                   confirmed. Counts revalidation ARPs sent. */
 } sr_arpentry_t;
 
 typedef struct sr_arpreq {
@@ -105,8 +113,25 @@ struct sr_arpcache {
     struct sr_arpreq *requests;
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
+    const char *persistFile;    /* Snapshot file for restarts. NULL disables. */
+    time_t lastSaved;           /* Last time the snapshot file was written. */
+    unsigned int randSeed;      /* rand_r() state for evicting from a full table. */
 };
 
+/* On-disk snapshot of the ARP cache. All fields in network byte order. */
+typedef struct __attribute__ ((packed)) sr_arpcache_file_hdr {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;             /* Number of records following the header */
+} sr_arpcache_file_hdr_t;
+
+typedef struct __attribute__ ((packed)) sr_arpcache_file_rec {
+    uint32_t ip;
+    uint8_t  mac[6];
+    char     iface[sr_IFACE_NAMELEN];
+    uint32_t added;             /* Seconds since the epoch */
+} sr_arpcache_file_rec_t;
+
 /* Checks if an IP->MAC mapping is in the cache. IP is in network byte order. 
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
@@ -116,8 +141,11 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
    that corresponds to this ARP request. The packet argument should not be
    freed by the caller.
 
-   A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   A pointer to the ARP request is returned; it should not be freed. The 
+   caller can remove the ARP request from the queue by calling 
+   sr_arpreq_destroy. The timeout thread resends and destroys requests, so 
+   the pointer is only safe to use while the caller holds cache->lock (it is 
+   recursive, so lock it before the call). */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
                          uint8_t *packet,               /* borrowed */
@@ -127,10 +155,12 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
       to the sr_arpreq with this IP. Otherwise, returns NULL.
-   2) Inserts this IP to MAC mapping in the cache, and marks it valid. */
+   2) Inserts this IP to MAC mapping in the cache, and marks it valid. An 
+      existing entry for the IP is refreshed in place. */
 struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
-                                     uint32_t ip);
+                                     uint32_t ip,
+                                     const char *iface);
 
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
@@ -139,13 +169,24 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
+/* Writes all valid entries to cache->persistFile so a restarted router can 
+   forward without waiting on ARP. Returns 0 on success (or if persistence is 
+   disabled). */
+int sr_arpcache_save(struct sr_arpcache *cache);
+
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
    a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   seconds. If cache->persistFile is set before init, entries saved by a 
+   previous run are loaded as stale entries. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
+/* One pass of the timeout thread's work. Called once a second, either by the 
+   instance's own timeout thread or by a timer thread shared between several 
+   router instances. */
+void  sr_arpcache_tick(struct sr_instance *sr);
+
 #endif
@@ -0,0 +1,63 @@
+/**
+ * @file sr_clock.h
+ * @brief Pluggable time source for the router's timers.
+ *
+ * Everything that stamps or ages router state (ARP requests and cache
+ * entries, NAT mappings and connections) reads the time through
+ * sr_clock_now() instead of time(NULL). By default that is the wall clock.
+ *
+ * Tests and benchmarks can switch to a virtual clock that only moves when
+ * told to. Combined with an sr_multi without a timer thread, the harness
+ * owns both the clock and the timer driver: sr_multi_advance() moves the
+ * virtual clock one second at a time and runs every instance's ARP and NAT
+ * timeouts synchronously after each step, so hours of timeouts take as long
+ * as the work they do and always happen in the same order.
+ *
+ * sr_clock_now_ns() serves timers that need more than a second's
+ * resolution (rate limits). On the wall clock it reads CLOCK_MONOTONIC, so
+ * it is only good for intervals; on any other source it is that source's
+ * seconds, scaled.
+ *
+ * The source is process wide. Change it only while no router threads are
+ * reading it (e.g. before sr_init() and after the last instance is gone).
+ */
+
+#ifndef SR_CLOCK_H
+#define SR_CLOCK_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_CLOCK_VIRTUAL_EPOCH   ((time_t) 1000000000) /**< Suggested start for virtual clocks. */
+#define SR_CLOCK_NS_PER_S        (1000000000ULL)
+
+/*
+ * Public Types
+ */
+
+/** Returns the current time in seconds; context is the pointer given with it. */
+typedef time_t (*sr_clock_source_t)(void *context);
+
+/*
+ * Public Function Declarations
+ */
+
+time_t sr_clock_now(void);
+uint64_t sr_clock_now_ns(void);
+void sr_clock_set_source(sr_clock_source_t source, void *context);
+
+void sr_clock_use_virtual(time_t start);
+void sr_clock_use_wall(void);
+bool sr_clock_is_virtual(void);
+void sr_clock_advance(unsigned int seconds);
+
+#endif /* SR_CLOCK_H */
@@ -0,0 +1,622 @@
+/**
+ * @file sr_codec.c
+ * @brief Byte-level formats of the NAT log and the flow exporter.
+ *
+ * See sr_codec.h for the formats.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sr_codec.h"
+#include "sr_nat.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define NATLOG_EVENT_MASK          (0x03)
+#define NATLOG_FLAG_TCP            (0x04)
+#define NATLOG_FLAG_SAME_INTERNAL  (0x08) /**< ipInt unchanged from previous record */
+#define NATLOG_FLAG_SAME_EXTERNAL  (0x10) /**< ipExt unchanged from previous record */
+
+#define FLOW_IPFIX_VERSION         (10)
+#define FLOW_TEMPLATE_SET_ID       (2)
+#define FLOW_ENTERPRISE_BIT        (0x8000)
+#define FLOW_REVERSE_PEN           (29305) /**< RFC 5103 reverse information elements. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+typedef struct
+{
+   uint16_t id;
+   uint16_t length;
+   bool reverse; /**< Enterprise FLOW_REVERSE_PEN. */
+} flowTemplateField_t;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables & Constants
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const natLogEventNames[SR_NATLOG_EVENTS] =
+{
+   "create", "delete", "block-allocate", "block-release"
+};
+
+/* In record order; flowPutRecord() and flowGetRecord() must agree. */
+static const flowTemplateField_t flowTemplateFields[SR_CODEC_FLOW_TEMPLATE_FIELDS] =
+{
+   { 8, 4, false }, /* sourceIPv4Address */
+   { 12, 4, false }, /* destinationIPv4Address */
+   { 7, 2, false }, /* sourceTransportPort */
+   { 11, 2, false }, /* destinationTransportPort */
+   { 225, 4, false }, /* postNATSourceIPv4Address */
+   { 227, 2, false }, /* postNAPTSourceTransportPort */
+   { 4, 1, false }, /* protocolIdentifier */
+   { 136, 1, false }, /* flowEndReason */
+   { 150, 4, false }, /* flowStartSeconds */
+   { 151, 4, false }, /* flowEndSeconds */
+   { 1, 8, false }, /* octetDeltaCount */
+   { 2, 8, false }, /* packetDeltaCount */
+   { 1, 8, true }, /* reverseOctetDeltaCount */
+   { 2, 8, true } /* reversePacketDeltaCount */
+};
+
+static const char * const flowEndReasonNames[] =
+{
+   "?", "idle", "active", "end", "forced"
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void natLogPrintRecord(FILE *out, const sr_natlog_record_t *record);
+
+static uint8_t *flowPutRecord(uint8_t *cursor, const sr_flow_record_t *record);
+static void flowGetRecord(const uint8_t *cursor, sr_flow_record_t *record);
+static void flowPrintRecord(FILE *out, const sr_flow_record_t *record);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+uint8_t *sr_codec_put16(uint8_t *cursor, uint16_t value)
+{
+   cursor[0] = (uint8_t) (value >> 8);
+   cursor[1] = (uint8_t) value;
+   return cursor + 2;
+}
+
+uint8_t *sr_codec_put32(uint8_t *cursor, uint32_t value)
+{
+   cursor = sr_codec_put16(cursor, (uint16_t) (value >> 16));
+   return sr_codec_put16(cursor, (uint16_t) value);
+}
+
+uint8_t *sr_codec_put64(uint8_t *cursor, uint64_t value)
+{
+   cursor = sr_codec_put32(cursor, (uint32_t) (value >> 32));
+   return sr_codec_put32(cursor, (uint32_t) value);
+}
+
+uint16_t sr_codec_get16(const uint8_t *cursor)
+{
+   return (uint16_t) ((cursor[0] << 8) | cursor[1]);
+}
+
+uint32_t sr_codec_get32(const uint8_t *cursor)
+{
+   return ((uint32_t) sr_codec_get16(cursor) << 16) | sr_codec_get16(cursor + 2);
+}
+
+uint64_t sr_codec_get64(const uint8_t *cursor)
+{
+   return ((uint64_t) sr_codec_get32(cursor) << 32) | sr_codec_get32(cursor + 4);
+}
+
+/**
+ * sr_codec_put_varint()\n
+ * @brief Writes a LEB128 varint, at most 10 bytes.
+ * @return the byte after it.
+ */
+uint8_t *sr_codec_put_varint(uint8_t *cursor, uint64_t value)
+{
+   while (value >= 0x80)
+   {
+      *cursor++ = (uint8_t) (value | 0x80);
+      value >>= 7;
+   }
+   *cursor++ = (uint8_t) value;
+   return cursor;
+}
+
+/**
+ * sr_codec_get_varint()\n
+ * @brief Reads a LEB128 varint.
+ * @return the byte after it, or NULL if it runs past end or is longer than
+ *         64 bits.
+ */
+const uint8_t *sr_codec_get_varint(const uint8_t *cursor, const uint8_t *end, uint64_t *value)
+{
+   unsigned int shift = 0;
+
+   *value = 0;
+   while ((cursor < end) && (shift <= 63))
+   {
+      uint8_t byte = *cursor++;
+
+      *value |= (uint64_t) (byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0)
+      {
+         return cursor;
+      }
+      shift += 7;
+   }
+   return NULL;
+}
+
+/**
+ * sr_codec_natlog_frame_header()\n
+ * @brief Fills in the SR_CODEC_NATLOG_FRAME_HDR_LEN bytes before a frame's
+ *        records.
+ */
+void sr_codec_natlog_frame_header(uint8_t *header, uint32_t length, uint16_t count,
+   uint64_t baseTimeUs)
+{
+   header = sr_codec_put32(header, length);
+   header = sr_codec_put16(header, count);
+   sr_codec_put64(header, baseTimeUs);
+}
+
+/**
+ * sr_codec_natlog_put_record()\n
+ * @brief Encodes one NAT log record, at most SR_CODEC_NATLOG_MAX_RECORD_LEN
+ *        bytes.
+ * @param base what the record is encoded against; updated to the record.
+ *        Zero it, with the frame's base time, before a frame's first record.
+ * @param first true for a frame's first record, which repeats both
+ *        addresses.
+ * @return the byte after the record.
+ */
+uint8_t *sr_codec_natlog_put_record(uint8_t *cursor, sr_codec_natlog_base_t *base, bool first,
+   const sr_natlog_record_t *record)
+{
+   uint8_t *start = cursor++;
+   uint8_t flags = record->event & NATLOG_EVENT_MASK;
+   int64_t timeDelta = (int64_t) (record->timeUs - base->timeUs);
+   int32_t portDelta = (int32_t) record->auxExt - (int32_t) base->auxExt;
+
+   if (record->type == nat_mapping_tcp)
+   {
+      flags |= NATLOG_FLAG_TCP;
+   }
+
+   cursor = sr_codec_put_varint(cursor, ((uint64_t) timeDelta << 1) ^ (uint64_t) (timeDelta >> 63));
+   if (!first && (record->ipInt == base->ipInt))
+   {
+      flags |= NATLOG_FLAG_SAME_INTERNAL;
+   }
+   else
+   {
+      cursor = sr_codec_put_varint(cursor, record->ipInt);
+   }
+   cursor = sr_codec_put_varint(cursor, record->auxInt);
+   cursor = sr_codec_put_varint(cursor, ((uint32_t) portDelta << 1) ^ (uint32_t) (portDelta >> 31));
+   if (!first && (record->ipExt == base->ipExt))
+   {
+      flags |= NATLOG_FLAG_SAME_EXTERNAL;
+   }
+   else
+   {
+      cursor = sr_codec_put_varint(cursor, record->ipExt);
+   }
+   if (record->event >= SR_NATLOG_BLOCK_ALLOCATE)
+   {
+      cursor = sr_codec_put_varint(cursor, record->blockSize);
+   }
+   *start = flags;
+
+   base->timeUs = record->timeUs;
+   base->ipInt = record->ipInt;
+   base->auxExt = record->auxExt;
+   base->ipExt = record->ipExt;
+   return cursor;
+}
+
+/**
+ * sr_codec_natlog_decode()\n
+ * @brief Prints the records of one NAT log file, one per line.
+ * @param in log file, positioned at its start.
+ * @param out stream to print to.
+ * @param records if not NULL, receives the number of records printed.
+ * @return 0 if the whole file decoded, -1 if it isn't a NAT log or is
+ *         corrupt. A frame cut short at the end of the file (the writer was
+ *         killed mid-write) is not an error.
+ */
+int sr_codec_natlog_decode(FILE *in, FILE *out, uint64_t *records)
+{
+   uint8_t header[SR_CODEC_NATLOG_FRAME_HDR_LEN];
+   uint8_t *payload = malloc(SR_NATLOG_MAX_FRAME);
+   uint64_t decoded = 0;
+   int ret = 0;
+
+   assert(payload);
+
+   if ((fread(header, 1, SR_CODEC_NATLOG_MAGIC_LEN, in) != SR_CODEC_NATLOG_MAGIC_LEN)
+      || (memcmp(header, SR_NATLOG_MAGIC, SR_CODEC_NATLOG_MAGIC_LEN) != 0))
+   {
+      free(payload);
+      return -1;
+   }
+
+   while (fread(header, 1, SR_CODEC_NATLOG_FRAME_HDR_LEN, in) == SR_CODEC_NATLOG_FRAME_HDR_LEN)
+   {
+      uint32_t length = sr_codec_get32(header);
+      uint16_t count = sr_codec_get16(header + 4);
+      sr_codec_natlog_base_t base;
+      const uint8_t *cursor = payload, *end;
+      unsigned int i;
+
+      if (length > SR_NATLOG_MAX_FRAME)
+      {
+         ret = -1;
+         break;
+      }
+      if (fread(payload, 1, length, in) != length)
+      {
+         break;
+      }
+
+      memset(&base, 0, sizeof(base));
+      base.timeUs = sr_codec_get64(header + 6);
+      end = payload + length;
+      for (i = 0; (i < count) && cursor; i++)
+      {
+         sr_natlog_record_t record;
+         uint64_t value;
+         uint8_t flags;
+
+         if (cursor >= end)
+         {
+            cursor = NULL;
+            break;
+         }
+         memset(&record, 0, sizeof(record));
+         flags = *cursor++;
+         record.event = flags & NATLOG_EVENT_MASK;
+         record.type = (flags & NATLOG_FLAG_TCP) ? nat_mapping_tcp : nat_mapping_icmp;
+
+         cursor = sr_codec_get_varint(cursor, end, &value);
+         base.timeUs += (int64_t) ((value >> 1) ^ -(value & 1));
+         record.timeUs = base.timeUs;
+         if (cursor && !(flags & NATLOG_FLAG_SAME_INTERNAL))
+         {
+            cursor = sr_codec_get_varint(cursor, end, &value);
+            base.ipInt = (uint32_t) value;
+         }
+         record.ipInt = base.ipInt;
+         if (cursor)
+         {
+            cursor = sr_codec_get_varint(cursor, end, &value);
+            record.auxInt = (uint16_t) value;
+         }
+         if (cursor)
+         {
+            cursor = sr_codec_get_varint(cursor, end, &value);
+            base.auxExt = (uint16_t) (base.auxExt + (int32_t) ((value >> 1) ^ -(value & 1)));
+            record.auxExt = base.auxExt;
+         }
+         if (cursor && !(flags & NATLOG_FLAG_SAME_EXTERNAL))
+         {
+            cursor = sr_codec_get_varint(cursor, end, &value);
+            base.ipExt = (uint32_t) value;
+         }
+         record.ipExt = base.ipExt;
+         if (cursor && (record.event >= SR_NATLOG_BLOCK_ALLOCATE))
+         {
+            cursor = sr_codec_get_varint(cursor, end, &value);
+            record.blockSize = (uint16_t) value;
+         }
+
+         if (cursor)
+         {
+            natLogPrintRecord(out, &record);
+            decoded++;
+         }
+      }
+      if ((cursor == NULL) || (cursor != end))
+      {
+         ret = -1;
+         break;
+      }
+   }
+
+   if (records)
+   {
+      *records = decoded;
+   }
+   free(payload);
+   return ret;
+}
+
+/**
+ * sr_codec_flow_message()\n
+ * @brief Builds one IPFIX message.
+ * @param message room for the message: SR_CODEC_FLOW_MESSAGE_HDR_LEN, the
+ *        template set if asked for, SR_CODEC_FLOW_SET_HDR_LEN and count
+ *        records of SR_CODEC_FLOW_RECORD_LEN bytes.
+ * @param withTemplate put the template set before the records.
+ * @return the message length.
+ */
+size_t sr_codec_flow_message(uint8_t *message, const sr_flow_record_t *records, unsigned int count,
+   bool withTemplate, uint32_t exportTime, uint32_t sequence, uint32_t domain)
+{
+   uint8_t *cursor = message + SR_CODEC_FLOW_MESSAGE_HDR_LEN;
+   uint8_t *dataSet;
+   size_t length;
+   unsigned int i;
+
+   if (withTemplate)
+   {
+      cursor = sr_codec_put16(cursor, FLOW_TEMPLATE_SET_ID);
+      cursor = sr_codec_put16(cursor, SR_CODEC_FLOW_TEMPLATE_SET_LEN);
+      cursor = sr_codec_put16(cursor, SR_FLOW_TEMPLATE_ID);
+      cursor = sr_codec_put16(cursor, SR_CODEC_FLOW_TEMPLATE_FIELDS);
+      for (i = 0; i < SR_CODEC_FLOW_TEMPLATE_FIELDS; i++)
+      {
+         cursor = sr_codec_put16(cursor, flowTemplateFields[i].id
+            | (flowTemplateFields[i].reverse ? FLOW_ENTERPRISE_BIT : 0));
+         cursor = sr_codec_put16(cursor, flowTemplateFields[i].length);
+         if (flowTemplateFields[i].reverse)
+         {
+            cursor = sr_codec_put32(cursor, FLOW_REVERSE_PEN);
+         }
+      }
+   }
+
+   dataSet = cursor;
+   cursor = sr_codec_put16(cursor, SR_FLOW_TEMPLATE_ID);
+   cursor = sr_codec_put16(cursor, SR_CODEC_FLOW_SET_HDR_LEN + count * SR_CODEC_FLOW_RECORD_LEN);
+   for (i = 0; i < count; i++)
+   {
+      cursor = flowPutRecord(cursor, &records[i]);
+   }
+   assert(cursor - dataSet == (ptrdiff_t) (SR_CODEC_FLOW_SET_HDR_LEN + count * SR_CODEC_FLOW_RECORD_LEN));
+
+   length = cursor - message;
+   cursor = message;
+   cursor = sr_codec_put16(cursor, FLOW_IPFIX_VERSION);
+   cursor = sr_codec_put16(cursor, (uint16_t) length);
+   cursor = sr_codec_put32(cursor, exportTime);
+   cursor = sr_codec_put32(cursor, sequence);
+   sr_codec_put32(cursor, domain);
+   return length;
+}
+
+/**
+ * sr_codec_flow_decode()\n
+ * @brief Reads a file of messages written by the exporter (or datagrams
+ *        received by a collector, one after another).
+ * @param in stream positioned at the start of a message.
+ * @param out if not NULL, gets one line per record.
+ * @param records if not NULL, receives the number of records read.
+ * @param totals if not NULL, receives the sums of the records' counters.
+ * @return 0 if every message decoded, -1 if one is malformed, or data comes
+ *         before its template.
+ */
+int sr_codec_flow_decode(FILE *in, FILE *out, uint64_t *records, sr_flow_record_t *totals)
+{
+   uint8_t message[UINT16_MAX];
+   uint64_t decoded = 0;
+   bool haveTemplate = false;
+   sr_flow_record_t record;
+   size_t messageLength, offset;
+   uint16_t setId, setLength;
+
+   if (totals)
+   {
+      memset(totals, 0, sizeof(*totals));
+   }
+
+   while (fread(message, 1, SR_CODEC_FLOW_MESSAGE_HDR_LEN, in) == SR_CODEC_FLOW_MESSAGE_HDR_LEN)
+   {
+      messageLength = sr_codec_get16(message + 2);
+      if ((sr_codec_get16(message) != FLOW_IPFIX_VERSION)
+         || (messageLength < SR_CODEC_FLOW_MESSAGE_HDR_LEN)
+         || (fread(message + SR_CODEC_FLOW_MESSAGE_HDR_LEN, 1,
+            messageLength - SR_CODEC_FLOW_MESSAGE_HDR_LEN, in)
+            != messageLength - SR_CODEC_FLOW_MESSAGE_HDR_LEN))
+      {
+         goto malformed;
+      }
+
+      for (offset = SR_CODEC_FLOW_MESSAGE_HDR_LEN; offset < messageLength; offset += setLength)
+      {
+         if (offset + SR_CODEC_FLOW_SET_HDR_LEN > messageLength)
+         {
+            goto malformed;
+         }
+         setId = sr_codec_get16(message + offset);
+         setLength = sr_codec_get16(message + offset + 2);
+         if ((setLength < SR_CODEC_FLOW_SET_HDR_LEN) || (offset + setLength > messageLength))
+         {
+            goto malformed;
+         }
+
+         if (setId == FLOW_TEMPLATE_SET_ID)
+         {
+            /* Only ever our own template. */
+            if ((setLength != SR_CODEC_FLOW_TEMPLATE_SET_LEN)
+               || (sr_codec_get16(message + offset + 4) != SR_FLOW_TEMPLATE_ID)
+               || (sr_codec_get16(message + offset + 6) != SR_CODEC_FLOW_TEMPLATE_FIELDS))
+            {
+               goto malformed;
+            }
+            haveTemplate = true;
+         }
+         else if (setId == SR_FLOW_TEMPLATE_ID)
+         {
+            size_t recordOffset;
+
+            if (!haveTemplate
+               || ((setLength - SR_CODEC_FLOW_SET_HDR_LEN) % SR_CODEC_FLOW_RECORD_LEN != 0))
+            {
+               goto malformed;
+            }
+            for (recordOffset = offset + SR_CODEC_FLOW_SET_HDR_LEN;
+               recordOffset < offset + setLength; recordOffset += SR_CODEC_FLOW_RECORD_LEN)
+            {
+               flowGetRecord(message + recordOffset, &record);
+               if (out)
+               {
+                  flowPrintRecord(out, &record);
+               }
+               if (totals)
+               {
+                  totals->octets += record.octets;
+                  totals->packets += record.packets;
+                  totals->reverseOctets += record.reverseOctets;
+                  totals->reversePackets += record.reversePackets;
+               }
+               decoded++;
+            }
+         }
+      }
+   }
+
+   if (records)
+   {
+      *records = decoded;
+   }
+   return 0;
+
+malformed:
+   if (records)
+   {
+      *records = decoded;
+   }
+   return -1;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void natLogPrintRecord(FILE *out, const sr_natlog_record_t *record)
+{
+   time_t seconds = (time_t) (record->timeUs / 1000000);
+   struct in_addr internal = { htonl(record->ipInt) };
+   struct in_addr external = { htonl(record->ipExt) };
+   char internalText[INET_ADDRSTRLEN], externalText[INET_ADDRSTRLEN];
+   char stamp[32];
+   struct tm utc;
+
+   gmtime_r(&seconds, &utc);
+   strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+   inet_ntop(AF_INET, &internal, internalText, sizeof(internalText));
+   inet_ntop(AF_INET, &external, externalText, sizeof(externalText));
+
+   if (record->event >= SR_NATLOG_BLOCK_ALLOCATE)
+   {
+      fprintf(out, "%s.%06uZ %s %s %s -> %s:%u-%u\n", stamp,
+         (unsigned int) (record->timeUs % 1000000), natLogEventNames[record->event],
+         (record->type == nat_mapping_tcp) ? "tcp" : "icmp", internalText, externalText,
+         record->auxExt, record->auxExt + record->blockSize - 1);
+   }
+   else
+   {
+      fprintf(out, "%s.%06uZ %s %s %s:%u -> %s:%u\n", stamp,
+         (unsigned int) (record->timeUs % 1000000), natLogEventNames[record->event],
+         (record->type == nat_mapping_tcp) ? "tcp" : "icmp", internalText, record->auxInt,
+         externalText, record->auxExt);
+   }
+}
+
+static uint8_t *flowPutRecord(uint8_t *cursor, const sr_flow_record_t *record)
+{
+   cursor = sr_codec_put32(cursor, record->sourceIp);
+   cursor = sr_codec_put32(cursor, record->destinationIp);
+   cursor = sr_codec_put16(cursor, record->sourcePort);
+   cursor = sr_codec_put16(cursor, record->destinationPort);
+   cursor = sr_codec_put32(cursor, record->postNatSourceIp);
+   cursor = sr_codec_put16(cursor, record->postNatSourcePort);
+   *cursor++ = record->protocol;
+   *cursor++ = record->endReason;
+   cursor = sr_codec_put32(cursor, record->startS);
+   cursor = sr_codec_put32(cursor, record->endS);
+   cursor = sr_codec_put64(cursor, record->octets);
+   cursor = sr_codec_put64(cursor, record->packets);
+   cursor = sr_codec_put64(cursor, record->reverseOctets);
+   return sr_codec_put64(cursor, record->reversePackets);
+}
+
+static void flowGetRecord(const uint8_t *cursor, sr_flow_record_t *record)
+{
+   record->sourceIp = sr_codec_get32(cursor);
+   record->destinationIp = sr_codec_get32(cursor + 4);
+   record->sourcePort = sr_codec_get16(cursor + 8);
+   record->destinationPort = sr_codec_get16(cursor + 10);
+   record->postNatSourceIp = sr_codec_get32(cursor + 12);
+   record->postNatSourcePort = sr_codec_get16(cursor + 16);
+   record->protocol = cursor[18];
+   record->endReason = cursor[19];
+   record->startS = sr_codec_get32(cursor + 20);
+   record->endS = sr_codec_get32(cursor + 24);
+   record->octets = sr_codec_get64(cursor + 28);
+   record->packets = sr_codec_get64(cursor + 36);
+   record->reverseOctets = sr_codec_get64(cursor + 44);
+   record->reversePackets = sr_codec_get64(cursor + 52);
+}
+
+static void flowPrintRecord(FILE *out, const sr_flow_record_t *record)
+{
+   struct in_addr source = { htonl(record->sourceIp) };
+   struct in_addr destination = { htonl(record->destinationIp) };
+   struct in_addr translated = { htonl(record->postNatSourceIp) };
+   char sourceText[INET_ADDRSTRLEN], destinationText[INET_ADDRSTRLEN];
+   char translatedText[INET_ADDRSTRLEN];
+
+   inet_ntop(AF_INET, &source, sourceText, sizeof(sourceText));
+   inet_ntop(AF_INET, &destination, destinationText, sizeof(destinationText));
+   inet_ntop(AF_INET, &translated, translatedText, sizeof(translatedText));
+
+   fprintf(out, "%u-%u %s proto %u %s:%u", record->startS, record->endS,
+      (record->endReason <= SR_FLOW_END_FORCED) ? flowEndReasonNames[record->endReason] : "?",
+      record->protocol, sourceText, record->sourcePort);
+   if (record->postNatSourceIp)
+   {
+      fprintf(out, " (%s:%u)", translatedText, record->postNatSourcePort);
+   }
+   fprintf(out, " -> %s:%u %" PRIu64 "/%" PRIu64 " packets/bytes", destinationText,
+      record->destinationPort, record->packets, record->octets);
+   if (record->reversePackets)
+   {
+      fprintf(out, ", %" PRIu64 "/%" PRIu64 " back", record->reversePackets, record->reverseOctets);
+   }
+   fprintf(out, "\n");
+}
@@ -0,0 +1,99 @@
+/**
+ * @file sr_codec.h
+ * @brief Byte-level formats of the NAT log and the flow exporter.
+ *
+ * Big endian fields and LEB128 varints (also used by the NAT sync stream),
+ * the frames of NAT log files (sr_natlog.c) and the IPFIX messages of the
+ * flow exporter (sr_flow.c). Each format's encoder and decoder sit side by
+ * side so they can't drift apart.
+ *
+ * The unit needs nothing but the C library: tools/natlog_decode and
+ * tools/flow_decode link it alone, without the router's threads,
+ * scheduler or watchdog.
+ */
+
+#ifndef SR_CODEC_H
+#define SR_CODEC_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sr_flow.h"
+#include "sr_natlog.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+/* NAT log files. A file starts with the 8 byte SR_NATLOG_MAGIC, followed by
+ * frames:
+ *
+ *    uint32_t payload length | uint16_t record count | uint64_t base time us | records...
+ *
+ * all in network byte order. Each record starts with a flags byte holding
+ * the event, the mapping type and "same as previous record" bits, followed
+ * by varints: the zig-zag time delta in microseconds, the internal address
+ * (unless unchanged), the internal port, the zig-zag external port delta,
+ * the external address (unless unchanged) and, for blocks, the block size.
+ * Deltas start from the frame's base time and zero at every frame. */
+#define SR_CODEC_NATLOG_MAGIC_LEN       (8)
+#define SR_CODEC_NATLOG_FRAME_HDR_LEN   (14)
+#define SR_CODEC_NATLOG_MAX_RECORD_LEN  (32)
+
+/* IPFIX (RFC 7011) messages, all in network byte order:
+ *
+ *    message header: version 10 | length | export time | sequence | domain
+ *    template set:   set id 2 | length | template id | field count | fields
+ *    data set:       set id SR_FLOW_TEMPLATE_ID | length | records...
+ *
+ * Every record has the same fields, so records are fixed length. */
+#define SR_CODEC_FLOW_MESSAGE_HDR_LEN   (16)
+#define SR_CODEC_FLOW_SET_HDR_LEN       (4)
+#define SR_CODEC_FLOW_RECORD_LEN        (60)
+#define SR_CODEC_FLOW_TEMPLATE_FIELDS   (14)
+#define SR_CODEC_FLOW_TEMPLATE_SET_LEN  (SR_CODEC_FLOW_SET_HDR_LEN + 4 \
+   + SR_CODEC_FLOW_TEMPLATE_FIELDS * 4 + 2 * 4)
+
+/*
+ * Public Types
+ */
+
+/** What NAT log records are encoded against; restarted at every frame. */
+typedef struct
+{
+   uint64_t timeUs;
+   uint32_t ipInt;
+   uint16_t auxExt;
+   uint32_t ipExt;
+} sr_codec_natlog_base_t;
+
+/*
+ * Public Function Declarations
+ */
+
+uint8_t *sr_codec_put16(uint8_t *cursor, uint16_t value);
+uint8_t *sr_codec_put32(uint8_t *cursor, uint32_t value);
+uint8_t *sr_codec_put64(uint8_t *cursor, uint64_t value);
+uint16_t sr_codec_get16(const uint8_t *cursor);
+uint32_t sr_codec_get32(const uint8_t *cursor);
+uint64_t sr_codec_get64(const uint8_t *cursor);
+
+uint8_t *sr_codec_put_varint(uint8_t *cursor, uint64_t value);
+const uint8_t *sr_codec_get_varint(const uint8_t *cursor, const uint8_t *end, uint64_t *value);
+
+void sr_codec_natlog_frame_header(uint8_t *header, uint32_t length, uint16_t count,
+   uint64_t baseTimeUs);
+uint8_t *sr_codec_natlog_put_record(uint8_t *cursor, sr_codec_natlog_base_t *base, bool first,
+   const sr_natlog_record_t *record);
+int sr_codec_natlog_decode(FILE *in, FILE *out, uint64_t *records);
+
+size_t sr_codec_flow_message(uint8_t *message, const sr_flow_record_t *records, unsigned int count,
+   bool withTemplate, uint32_t exportTime, uint32_t sequence, uint32_t domain);
+int sr_codec_flow_decode(FILE *in, FILE *out, uint64_t *records, sr_flow_record_t *totals);
+
+#endif /* SR_CODEC_H */
@@ -0,0 +1,629 @@
+/**
+ * @file sr_flow.c
+ * @brief Per-flow accounting, exported as IPFIX-style flow records.
+ *
+ * See sr_flow.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sr_flow.h"
+#include "sr_clock.h"
+#include "sr_codec.h"
+#include "sr_router.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define FLOW_RING_MASK             (SR_FLOW_RING_RECORDS - 1)
+#define FLOW_TABLE_MASK            (SR_FLOW_TABLE_SIZE - 1)
+#define FLOW_TABLE_MAX_USED        (SR_FLOW_TABLE_SIZE * 3 / 4) /**< Keeps probe runs short. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *flowWriterThread(void *flowsPtr);
+static void flowDrain(sr_flow_t *flows, uint64_t head);
+static void flowWriteMessage(sr_flow_t *flows, const sr_flow_record_t *records, unsigned int count,
+   bool withTemplate);
+static int flowOpenDestination(sr_flow_t *flows);
+
+static uint32_t flowHash(uint32_t sourceIp, uint32_t destinationIp, uint16_t sourcePort,
+   uint16_t destinationPort, uint8_t protocol);
+static void flowExportEntry(sr_flow_t *flows, sr_flow_entry_t *entry, sr_flow_end_reason_t reason,
+   uint32_t now);
+static void flowTableRemove(sr_flow_t *flows, unsigned int index);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_flow_parse()\n
+ * @brief Parses "destination[,active timeout s]", where the destination is
+ *        a file or "udp:host:port".
+ * @param spec option argument.
+ * @param destination receives the destination.
+ * @param destinationSize size of the destination buffer.
+ * @param activeTimeoutS receives the active timeout;
+ *        SR_FLOW_DEFAULT_ACTIVE_TIMEOUT when not given.
+ * @return 0 on success, -1 if the specification is malformed.
+ */
+int sr_flow_parse(const char *spec, char *destination, size_t destinationSize,
+   unsigned int *activeTimeoutS)
+{
+   const char *field = strchr(spec, ',');
+   size_t length = field ? (size_t) (field - spec) : strlen(spec);
+   char *end;
+   unsigned long value;
+
+   *activeTimeoutS = SR_FLOW_DEFAULT_ACTIVE_TIMEOUT;
+   if ((length == 0) || (length >= destinationSize))
+   {
+      return -1;
+   }
+   memcpy(destination, spec, length);
+   destination[length] = '\0';
+   if (field == NULL)
+   {
+      return 0;
+   }
+
+   field++;
+   value = strtoul(field, &end, 10);
+   if ((end == field) || (*end != '\0') || (value == 0))
+   {
+      return -1;
+   }
+   *activeTimeoutS = (unsigned int) value;
+   return 0;
+}
+
+/**
+ * sr_flow_create()\n
+ * @brief Opens the destination and starts the writer thread.
+ * @param destination file to append messages to, or "udp:host:port".
+ * @param activeTimeoutS seconds between records of a flow that goes on.
+ * @param observationDomain IPFIX observation domain of the messages.
+ * @return exporter state, or NULL if the destination couldn't be opened.
+ */
+sr_flow_t *sr_flow_create(const char *destination, unsigned int activeTimeoutS,
+   uint32_t observationDomain)
+{
+   sr_flow_t *flows;
+
+   assert(destination);
+
+   if (posix_memalign((void **) &flows, SR_FLOW_CACHE_LINE, sizeof(sr_flow_t)) != 0)
+   {
+      return NULL;
+   }
+   memset(flows, 0, sizeof(sr_flow_t));
+   flows->ring = malloc(SR_FLOW_RING_RECORDS * sizeof(sr_flow_record_t));
+   flows->table = calloc(SR_FLOW_TABLE_SIZE, sizeof(sr_flow_entry_t));
+   assert(flows->ring && flows->table);
+   strncpy(flows->destination, destination, SR_FLOW_MAX_DESTINATION - 1);
+   flows->activeTimeoutS = activeTimeoutS;
+   flows->observationDomain = observationDomain;
+   flows->socket = -1;
+
+   if (flowOpenDestination(flows) != 0)
+   {
+      free(flows->ring);
+      free(flows->table);
+      free(flows);
+      return NULL;
+   }
+
+   pthread_mutex_init(&flows->pushLock, NULL);
+   pthread_mutex_init(&flows->tableLock, NULL);
+   pthread_create(&(flows->thread), NULL, flowWriterThread, flows);
+   sr_sched_apply(flows->thread, SR_SCHED_SYNC);
+
+   printf("Exporting flow records to %s, active timeout %u s\n", flows->destination,
+      activeTimeoutS);
+   return flows;
+}
+
+/**
+ * sr_flow_destroy()\n
+ * @brief Ends the forwarded flows still in the table, writes out every
+ *        record, stops the writer thread and releases the exporter.
+ * @param flows exporter state. May be NULL.
+ * @warning The NAT must not export any more records.
+ */
+void sr_flow_destroy(sr_flow_t *flows)
+{
+   unsigned int i;
+   uint32_t now;
+
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   now = (uint32_t) sr_clock_now();
+   pthread_mutex_lock(&flows->tableLock);
+   for (i = 0; i < SR_FLOW_TABLE_SIZE; i++)
+   {
+      if (flows->table[i].used)
+      {
+         flowExportEntry(flows, &flows->table[i], SR_FLOW_END_FORCED, now);
+      }
+   }
+   pthread_mutex_unlock(&flows->tableLock);
+
+   sr_flow_release(flows);
+}
+
+/**
+ * sr_flow_release()\n
+ * @brief Writes out the records already queued, stops the writer thread and
+ *        releases the exporter, without ending the flows still in the table.
+ *        After a hot upgrade the new process carries on with them.
+ * @param flows exporter state. May be NULL.
+ * @warning The NAT must not export any more records.
+ */
+void sr_flow_release(sr_flow_t *flows)
+{
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   __atomic_store_n(&flows->stopRequested, true, __ATOMIC_RELEASE);
+   pthread_join(flows->thread, NULL);
+
+   if (flows->file)
+   {
+      fclose(flows->file);
+   }
+   if (flows->socket >= 0)
+   {
+      close(flows->socket);
+   }
+   pthread_mutex_destroy(&flows->pushLock);
+   pthread_mutex_destroy(&flows->tableLock);
+   free(flows->ring);
+   free(flows->table);
+   free(flows);
+}
+
+/**
+ * sr_flow_count()\n
+ * @brief Counts a datagram the router sends on untranslated against its flow.
+ *        Only datagrams that made it past the TTL check and route lookup
+ *        get here, so drops are not billed.
+ * @param flows exporter state. May be NULL, in which case nothing is kept.
+ * @param packet pointer to the validated IP header.
+ * @param length bytes of IP header and payload.
+ */
+void sr_flow_count(sr_flow_t *flows, const sr_ip_hdr_t *packet, unsigned int length)
+{
+   unsigned int headerLength = packet->ip_hl * 4;
+   uint16_t sourcePort = 0, destinationPort = 0;
+   uint32_t index, now;
+   sr_flow_entry_t *entry;
+
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   /* Only the first fragment has the ports. */
+   if (((packet->ip_p == ip_protocol_tcp) || (packet->ip_p == ip_protocol_udp))
+      && ((ntohs(packet->ip_off) & IP_OFFMASK) == 0)
+      && (length >= headerLength + sizeof(sr_udp_hdr_t)))
+   {
+      const sr_udp_hdr_t *ports = (const sr_udp_hdr_t *) (((const uint8_t *) packet) + headerLength);
+
+      sourcePort = ports->sourcePort;
+      destinationPort = ports->destinationPort;
+   }
+
+   now = (uint32_t) sr_clock_now();
+   index = flowHash(packet->ip_src, packet->ip_dst, sourcePort, destinationPort, packet->ip_p)
+      & FLOW_TABLE_MASK;
+
+   pthread_mutex_lock(&flows->tableLock);
+   for (entry = &flows->table[index]; entry->used; entry = &flows->table[index])
+   {
+      if ((entry->sourceIp == packet->ip_src) && (entry->destinationIp == packet->ip_dst)
+         && (entry->sourcePort == sourcePort) && (entry->destinationPort == destinationPort)
+         && (entry->protocol == packet->ip_p))
+      {
+         break;
+      }
+      index = (index + 1) & FLOW_TABLE_MASK;
+   }
+
+   if (!entry->used)
+   {
+      if (flows->tableUsed >= FLOW_TABLE_MAX_USED)
+      {
+         flows->untracked++;
+         pthread_mutex_unlock(&flows->tableLock);
+         return;
+      }
+      entry->sourceIp = packet->ip_src;
+      entry->destinationIp = packet->ip_dst;
+      entry->sourcePort = sourcePort;
+      entry->destinationPort = destinationPort;
+      entry->protocol = packet->ip_p;
+      entry->startS = now;
+      entry->packets = 0;
+      entry->octets = 0;
+      entry->used = true;
+      flows->tableUsed++;
+   }
+
+   entry->packets++;
+   entry->octets += length;
+   entry->lastS = now;
+   pthread_mutex_unlock(&flows->tableLock);
+}
+
+/**
+ * sr_flow_export()\n
+ * @brief Queues a record for the writer thread.
+ * @param flows exporter state. May be NULL, in which case nothing is exported.
+ * @param record record to copy into the ring.
+ */
+void sr_flow_export(sr_flow_t *flows, const sr_flow_record_t *record)
+{
+   uint64_t head;
+
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&flows->pushLock);
+   head = flows->head;
+   if (head - __atomic_load_n(&flows->tail, __ATOMIC_ACQUIRE) >= SR_FLOW_RING_RECORDS)
+   {
+      __atomic_add_fetch(&flows->lost, 1, __ATOMIC_RELAXED);
+   }
+   else
+   {
+      flows->ring[head & FLOW_RING_MASK] = *record;
+      __atomic_store_n(&flows->head, head + 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&flows->pushLock);
+}
+
+/**
+ * sr_flow_tick()\n
+ * @brief Once a second: ends forwarded flows idle for SR_FLOW_IDLE_TIMEOUT
+ *        and reports those open for an active timeout. NAT connections are
+ *        handled by the NAT's own tick.
+ * @param sr pointer to simple router state structure.
+ */
+void sr_flow_tick(struct sr_instance *sr)
+{
+   sr_flow_t *flows = sr->flows;
+   sr_flow_entry_t *entry;
+   unsigned int i;
+   uint32_t now;
+
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   now = (uint32_t) sr_clock_now();
+   pthread_mutex_lock(&flows->tableLock);
+   for (i = 0; i < SR_FLOW_TABLE_SIZE; i++)
+   {
+      entry = &flows->table[i];
+      if (!entry->used)
+      {
+         continue;
+      }
+      if (now - entry->lastS >= SR_FLOW_IDLE_TIMEOUT)
+      {
+         flowExportEntry(flows, entry, SR_FLOW_END_IDLE, entry->lastS);
+         flowTableRemove(flows, i);
+         /* An entry further along may have moved into this slot. */
+         i--;
+      }
+      else if (now - entry->startS >= flows->activeTimeoutS)
+      {
+         flowExportEntry(flows, entry, SR_FLOW_END_ACTIVE, now);
+         entry->packets = 0;
+         entry->octets = 0;
+         entry->startS = now;
+      }
+   }
+   pthread_mutex_unlock(&flows->tableLock);
+}
+
+/**
+ * sr_flow_print()\n
+ * @brief Prints how much has been exported and lost.
+ * @param sr pointer to simple router state structure. Nothing is printed
+ *        without flow export.
+ * @param out stream to print to.
+ */
+void sr_flow_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_flow_t *flows = sr->flows;
+   uint64_t head, tail, exported, messages, bytes;
+   unsigned int tracked;
+   uint64_t untracked;
+
+   if (flows == NULL)
+   {
+      return;
+   }
+
+   head = __atomic_load_n(&flows->head, __ATOMIC_ACQUIRE);
+   tail = __atomic_load_n(&flows->tail, __ATOMIC_ACQUIRE);
+   exported = __atomic_load_n(&flows->exported, __ATOMIC_RELAXED);
+   messages = __atomic_load_n(&flows->messages, __ATOMIC_RELAXED);
+   bytes = __atomic_load_n(&flows->bytesWritten, __ATOMIC_RELAXED);
+   pthread_mutex_lock(&flows->tableLock);
+   tracked = flows->tableUsed;
+   untracked = flows->untracked;
+   pthread_mutex_unlock(&flows->tableLock);
+
+   fprintf(out, "Flow export: topology %u, %" PRIu64 " records in %" PRIu64 " messages (%" PRIu64
+      " bytes) to %s, %" PRIu64 " queued, %" PRIu64 " lost\n", sr->topo_id, exported, messages,
+      bytes, flows->destination, head - tail, __atomic_load_n(&flows->lost, __ATOMIC_RELAXED));
+   fprintf(out, "   forwarded flows: %u tracked of %u, %" PRIu64 " packets untracked\n", tracked,
+      FLOW_TABLE_MAX_USED, untracked);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void *flowWriterThread(void *flowsPtr)
+{
+   sr_flow_t *flows = (sr_flow_t *) flowsPtr;
+   const struct timespec drainInterval = { 0, SR_FLOW_DRAIN_MS * 1000000L };
+
+   sr_watchdog_register("flow export");
+
+   while (1)
+   {
+      /* Read the stop flag first: everything pushed before it was set is
+       * then visible below. */
+      bool stop = __atomic_load_n(&flows->stopRequested, __ATOMIC_ACQUIRE);
+      uint64_t head = __atomic_load_n(&flows->head, __ATOMIC_ACQUIRE);
+
+      if (head != flows->tail)
+      {
+         sr_watchdog_stage(SR_WATCHDOG_FLOW_EXPORT);
+         flowDrain(flows, head);
+      }
+      else if (stop)
+      {
+         break;
+      }
+      else
+      {
+         sr_watchdog_idle();
+         nanosleep(&drainInterval, NULL);
+      }
+   }
+
+   sr_watchdog_unregister();
+   return NULL;
+}
+
+/**
+ * flowDrain()\n
+ * @brief Writes out the records up to head as full messages, then gives
+ *        their slots back.
+ */
+static void flowDrain(sr_flow_t *flows, uint64_t head)
+{
+   sr_flow_record_t batch[(SR_FLOW_MAX_MESSAGE - SR_CODEC_FLOW_MESSAGE_HDR_LEN
+      - SR_CODEC_FLOW_SET_HDR_LEN) / SR_CODEC_FLOW_RECORD_LEN];
+   unsigned int count, capacity, i;
+   bool withTemplate;
+
+   while (flows->tail != head)
+   {
+      withTemplate = (flows->messages % SR_FLOW_TEMPLATE_EVERY) == 0;
+      capacity = (SR_FLOW_MAX_MESSAGE - SR_CODEC_FLOW_MESSAGE_HDR_LEN - SR_CODEC_FLOW_SET_HDR_LEN
+         - (withTemplate ? SR_CODEC_FLOW_TEMPLATE_SET_LEN : 0)) / SR_CODEC_FLOW_RECORD_LEN;
+      count = (head - flows->tail < capacity) ? (unsigned int) (head - flows->tail) : capacity;
+
+      for (i = 0; i < count; i++)
+      {
+         batch[i] = flows->ring[(flows->tail + i) & FLOW_RING_MASK];
+      }
+      __atomic_store_n(&flows->tail, flows->tail + count, __ATOMIC_RELEASE);
+
+      flowWriteMessage(flows, batch, count, withTemplate);
+   }
+   if (flows->file)
+   {
+      fflush(flows->file);
+   }
+}
+
+/**
+ * flowWriteMessage()\n
+ * @brief Builds one IPFIX message and appends it to the file or sends it to
+ *        the collector. A collector that isn't listening loses the message.
+ */
+static void flowWriteMessage(sr_flow_t *flows, const sr_flow_record_t *records, unsigned int count,
+   bool withTemplate)
+{
+   uint8_t message[SR_FLOW_MAX_MESSAGE];
+   size_t length = sr_codec_flow_message(message, records, count, withTemplate,
+      (uint32_t) sr_clock_now(), flows->sequence, flows->observationDomain);
+
+   if (flows->file)
+   {
+      if (fwrite(message, 1, length, flows->file) != length)
+      {
+         perror(flows->destination);
+      }
+   }
+   else
+   {
+      sendto(flows->socket, message, length, 0, (struct sockaddr *) &flows->collector,
+         sizeof(flows->collector));
+   }
+
+   flows->sequence += count;
+   __atomic_add_fetch(&flows->exported, count, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&flows->messages, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&flows->bytesWritten, length, __ATOMIC_RELAXED);
+}
+
+/**
+ * flowOpenDestination()\n
+ * @brief Opens the file for appending, or a UDP socket to "udp:host:port".
+ * @return 0 on success, -1 on failure.
+ */
+static int flowOpenDestination(sr_flow_t *flows)
+{
+   struct addrinfo hints, *result;
+   char host[SR_FLOW_MAX_DESTINATION];
+   const char *port;
+
+   if (strncmp(flows->destination, "udp:", 4) != 0)
+   {
+      flows->file = fopen(flows->destination, "ab");
+      if (flows->file == NULL)
+      {
+         perror(flows->destination);
+         return -1;
+      }
+      return 0;
+   }
+
+   port = strrchr(flows->destination + 4, ':');
+   if ((port == NULL) || (port == flows->destination + 4))
+   {
+      fprintf(stderr, "%s: expected udp:host:port\n", flows->destination);
+      return -1;
+   }
+   snprintf(host, sizeof(host), "%.*s", (int) (port - flows->destination - 4), flows->destination + 4);
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   if (getaddrinfo(host, port + 1, &hints, &result) != 0)
+   {
+      fprintf(stderr, "%s: unknown collector\n", flows->destination);
+      return -1;
+   }
+   memcpy(&flows->collector, result->ai_addr, sizeof(flows->collector));
+   freeaddrinfo(result);
+
+   flows->socket = socket(AF_INET, SOCK_DGRAM, 0);
+   if (flows->socket < 0)
+   {
+      perror("flow export socket");
+      return -1;
+   }
+   return 0;
+}
+
+static uint32_t flowHash(uint32_t sourceIp, uint32_t destinationIp, uint16_t sourcePort,
+   uint16_t destinationPort, uint8_t protocol)
+{
+   uint64_t key = ((uint64_t) sourceIp << 32) ^ destinationIp
+      ^ ((uint64_t) ((sourcePort << 16) | destinationPort) << 13) ^ protocol;
+
+   key ^= key >> 33;
+   key *= 0xFF51AFD7ED558CCDULL;
+   key ^= key >> 33;
+   return (uint32_t) key;
+}
+
+/**
+ * flowExportEntry()\n
+ * @brief Exports a forwarded flow's counts since its last record.
+ * @warning Assumes the table lock is held.
+ */
+static void flowExportEntry(sr_flow_t *flows, sr_flow_entry_t *entry, sr_flow_end_reason_t reason,
+   uint32_t now)
+{
+   sr_flow_record_t record;
+
+   if (entry->packets == 0)
+   {
+      return;
+   }
+
+   memset(&record, 0, sizeof(record));
+   record.sourceIp = ntohl(entry->sourceIp);
+   record.destinationIp = ntohl(entry->destinationIp);
+   record.sourcePort = ntohs(entry->sourcePort);
+   record.destinationPort = ntohs(entry->destinationPort);
+   record.protocol = entry->protocol;
+   record.endReason = reason;
+   record.startS = entry->startS;
+   record.endS = now;
+   record.packets = entry->packets;
+   record.octets = entry->octets;
+   sr_flow_export(flows, &record);
+}
+
+/**
+ * flowTableRemove()\n
+ * @brief Empties a slot, moving back later entries of the same probe run
+ *        that could no longer be found past the hole.
+ * @warning Assumes the table lock is held.
+ */
+static void flowTableRemove(sr_flow_t *flows, unsigned int index)
+{
+   unsigned int next = index, home;
+   sr_flow_entry_t *entry;
+
+   while (1)
+   {
+      next = (next + 1) & FLOW_TABLE_MASK;
+      entry = &flows->table[next];
+      if (!entry->used)
+      {
+         break;
+      }
+
+      home = flowHash(entry->sourceIp, entry->destinationIp, entry->sourcePort,
+         entry->destinationPort, entry->protocol) & FLOW_TABLE_MASK;
+      /* Stays put if its home lies cyclically in (index, next]. */
+      if ((index <= next) ? ((index < home) && (home <= next)) : ((index < home) || (home <= next)))
+      {
+         continue;
+      }
+      flows->table[index] = *entry;
+      index = next;
+   }
+
+   flows->table[index].used = false;
+   flows->tableUsed--;
+}
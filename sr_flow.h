@@ -0,0 +1,157 @@
+/**
+ * @file sr_flow.h
+ * @brief Per-flow accounting, exported as IPFIX-style flow records.
+ *
+ * Two sources of flows feed one exporter per router:
+ *    - NAT connections keep packet and byte counts per direction in
+ *      sr_nat_connection_t, next to the state the NAT already updates, and
+ *      are exported as one bidirectional record (internal host as source,
+ *      with its translated address and port);
+ *    - without NAT, forwarded datagrams are counted in a small open
+ *      addressing table keyed on protocol, addresses and ports, one
+ *      unidirectional flow per key.
+ * A record is emitted when a flow ends (NAT teardown or timeout, or
+ * SR_FLOW_IDLE_TIMEOUT without packets for a forwarded flow) and, for
+ * flows that last, once per active timeout with the counts since the last
+ * record (delta counters).
+ *
+ * Records go through a ring to a writer thread, which every
+ * SR_FLOW_DRAIN_MS packs them into IPFIX messages (RFC 7011): a template
+ * set describing the record (sent in the first message and every
+ * SR_FLOW_TEMPLATE_EVERY messages after) and a data set of fixed length
+ * records, at most SR_FLOW_MAX_MESSAGE bytes a message. Messages are
+ * appended to a file or sent to a UDP collector. If the writer falls
+ * SR_FLOW_RING_RECORDS behind, further records are counted as lost.
+ */
+
+#ifndef SR_FLOW_H
+#define SR_FLOW_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "sr_protocol.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_FLOW_RING_BITS              (14)
+#define SR_FLOW_RING_RECORDS           (1 << SR_FLOW_RING_BITS)
+#define SR_FLOW_TABLE_BITS             (12)
+#define SR_FLOW_TABLE_SIZE             (1 << SR_FLOW_TABLE_BITS) /**< Forwarded flows tracked at once. */
+#define SR_FLOW_DEFAULT_ACTIVE_TIMEOUT (60) /**< Seconds between records of a long flow. */
+#define SR_FLOW_IDLE_TIMEOUT           (15) /**< Seconds without packets that end a forwarded flow. */
+#define SR_FLOW_DRAIN_MS               (100)
+#define SR_FLOW_MAX_MESSAGE            (1400) /**< Fits a UDP datagram on Ethernet. */
+#define SR_FLOW_TEMPLATE_ID            (256)
+#define SR_FLOW_TEMPLATE_EVERY         (32) /**< Messages between template sets. */
+#define SR_FLOW_MAX_DESTINATION        (256)
+#define SR_FLOW_CACHE_LINE             (64)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+/** IPFIX flowEndReason. */
+typedef enum
+{
+   SR_FLOW_END_IDLE = 1,
+   SR_FLOW_END_ACTIVE = 2, /**< Still going; counts since the last record. */
+   SR_FLOW_END_OF_FLOW = 3, /**< TCP FIN or RST. */
+   SR_FLOW_END_FORCED = 4 /**< Router shutting down. */
+} sr_flow_end_reason_t;
+
+/** One exported record. Addresses and ports in host byte order. */
+typedef struct
+{
+   uint64_t octets; /**< Source to destination, IP header included. */
+   uint64_t packets;
+   uint64_t reverseOctets; /**< Destination to source. 0 for forwarded flows. */
+   uint64_t reversePackets;
+   uint32_t startS; /**< First packet counted, or the previous record. */
+   uint32_t endS;
+   uint32_t sourceIp;
+   uint32_t destinationIp;
+   uint32_t postNatSourceIp; /**< 0 if not translated. */
+   uint16_t sourcePort;
+   uint16_t destinationPort;
+   uint16_t postNatSourcePort;
+   uint8_t protocol;
+   uint8_t endReason; /**< sr_flow_end_reason_t */
+} sr_flow_record_t;
+
+/** A forwarded flow. Network byte order, as in the packet. */
+typedef struct
+{
+   uint32_t sourceIp;
+   uint32_t destinationIp;
+   uint16_t sourcePort;
+   uint16_t destinationPort;
+   uint8_t protocol;
+   bool used;
+   uint32_t startS;
+   uint32_t lastS;
+   uint64_t packets;
+   uint64_t octets;
+} sr_flow_entry_t;
+
+typedef struct sr_flow
+{
+   /* Producer side: the NAT (under its lock) and the forwarded flow table. */
+   pthread_mutex_t pushLock;
+   uint64_t head __attribute__((aligned(SR_FLOW_CACHE_LINE)));
+   uint64_t lost; /**< Records dropped with the ring full. */
+
+   /* Consumer side, written by the writer thread. */
+   uint64_t tail __attribute__((aligned(SR_FLOW_CACHE_LINE)));
+   uint64_t exported; /**< Records in messages written. */
+   uint64_t messages;
+   uint64_t bytesWritten;
+   uint32_t sequence; /**< IPFIX sequence number: data records sent before. */
+
+   sr_flow_record_t *ring;
+
+   /* Forwarded flows. */
+   pthread_mutex_t tableLock;
+   sr_flow_entry_t *table;
+   unsigned int tableUsed;
+   uint64_t untracked; /**< Packets of flows that didn't fit in the table. */
+
+   unsigned int activeTimeoutS;
+   uint32_t observationDomain;
+   char destination[SR_FLOW_MAX_DESTINATION];
+   FILE *file; /**< Messages appended here, or */
+   int socket; /**< sent from here to the collector. -1 for a file. */
+   struct sockaddr_in collector;
+   bool stopRequested;
+   pthread_t thread;
+} sr_flow_t;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_flow_parse(const char *spec, char *destination, size_t destinationSize,
+   unsigned int *activeTimeoutS);
+sr_flow_t *sr_flow_create(const char *destination, unsigned int activeTimeoutS,
+   uint32_t observationDomain);
+void sr_flow_destroy(sr_flow_t *flows);
+void sr_flow_release(sr_flow_t *flows);
+
+void sr_flow_count(sr_flow_t *flows, const sr_ip_hdr_t *packet, unsigned int length);
+void sr_flow_export(sr_flow_t *flows, const sr_flow_record_t *record);
+void sr_flow_tick(struct sr_instance *sr);
+void sr_flow_print(const struct sr_instance *sr, FILE *out);
+
+#endif /* SR_FLOW_H */
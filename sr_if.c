@@ -76,7 +76,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
-        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN - 1);
+        sr->if_list->name[sr_IFACE_NAMELEN - 1] = '\0';
         return;
     }
 
@@ -88,7 +89,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
     assert(if_walker->next);
     if_walker = if_walker->next;
-    strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    strncpy(if_walker->name,name,sr_IFACE_NAMELEN - 1);
+    if_walker->name[sr_IFACE_NAMELEN - 1] = '\0';
     if_walker->next = 0;
 } /* -- sr_add_interface -- */ 
 
@@ -191,4 +193,5 @@ void sr_print_if(struct sr_if* iface)
     DebugMAC(iface->addr);
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    (void) ip_addr; /* unused when Debug() compiles out */
 } /* -- sr_print_if -- */
@@ -31,6 +31,7 @@
 #include <pwd.h>
 #include <sys/types.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -39,6 +40,21 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_upgrade.h"
+#include "sr_nat_sync.h"
+#include "sr_multi.h"
+#include "sr_admission.h"
+#include "sr_vns_reader.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+#include "sr_flow.h"
+#include "sr_mirror.h"
+#include "sr_routestat.h"
+#include "sr_sample.h"
+#include "sr_sketch.h"
+#include "sr_trace.h"
+#include "sr_policer.h"
+#include "sr_natlog.h"
 
 /*
  *-----------------------------------------------------------------------------
@@ -56,6 +72,8 @@
 #define DEFAULT_TCP_ESTABLISHED_TIMEOUT   (7440)
 #define MINIMUM_TCP_ESTABLISHED_TIMEOUT   (4*60);
 #define DEFAULT_TCP_TRANSITORY_TIMEOUT    (300)
+#define DEFAULT_TCP_TIME_WAIT_TIMEOUT     (4)
+#define MAX_CONFIG_LINE_ARGS              (64)
 
 /*
  *-----------------------------------------------------------------------------
@@ -83,6 +101,31 @@ typedef struct sr_command_args
    unsigned int icmpQueryTimeout;
    unsigned int tcpEstablishedTimeout;
    unsigned int tcpTransitioryTimeout;
+   unsigned int tcpTimeWaitTimeout;
+   char *arpCacheFile;
+   int upgradeChannel;
+   char *natSyncSocket;
+   char *natStandbySocket;
+   char *multiConfig;
+   unsigned int overloadHighWatermark;
+   unsigned int overloadLowWatermark;
+   int spinBudget;
+   char *schedProfile;
+   unsigned int watchdogThresholdMs;
+   char *watchdogLog;
+   int sketchIntervalS;
+   char *sketchLog;
+   char *policerLimits;
+   char *natLog;
+   bool natEndpointIndependent;
+   char *natDeterministic;
+   char *flowExport;
+   char *sampleSpec;
+   int routeStatsIntervalS;
+   char *routeStatsLog;
+   char *mirrorConfig;
+   char *traceConfig;
+   char *traceLog;
 } sr_command_args_t;
 
 /*
@@ -104,7 +147,32 @@ static const sr_command_args_t sr_default_config =
    false, /* natEnabled */
    DEFAULT_ICMP_TIMEOUT, /* icmpQueryTimeout */    
    DEFAULT_TCP_ESTABLISHED_TIMEOUT, /* tcpEstablishedTimeout */
-   DEFAULT_TCP_TRANSITORY_TIMEOUT /* tcpTransitioryTimeout */
+   DEFAULT_TCP_TRANSITORY_TIMEOUT, /* tcpTransitioryTimeout */
+   DEFAULT_TCP_TIME_WAIT_TIMEOUT, /* tcpTimeWaitTimeout */
+   NULL, /* arpCacheFile */
+   -1, /* upgradeChannel */
+   NULL, /* natSyncSocket */
+   NULL, /* natStandbySocket */
+   NULL, /* multiConfig */
+   SR_ADMISSION_DEFAULT_HIGH_WATERMARK, /* overloadHighWatermark */
+   0, /* overloadLowWatermark */
+   -1, /* spinBudget */
+   NULL, /* schedProfile */
+   0, /* watchdogThresholdMs */
+   SR_WATCHDOG_DEFAULT_LOG, /* watchdogLog */
+   -1, /* sketchIntervalS */
+   SR_SKETCH_DEFAULT_LOG, /* sketchLog */
+   NULL, /* policerLimits */
+   NULL, /* natLog */
+   false, /* natEndpointIndependent */
+   NULL, /* natDeterministic */
+   NULL, /* flowExport */
+   NULL, /* sampleSpec */
+   -1, /* routeStatsIntervalS */
+   SR_ROUTESTAT_DEFAULT_LOG, /* routeStatsLog */
+   NULL, /* mirrorConfig */
+   NULL, /* traceConfig */
+   SR_TRACE_DEFAULT_LOG /* traceLog */
 };
 
 #ifdef _CYGWIN_
@@ -112,6 +180,14 @@ extern char* __attribute__((dllimport)) optarg;
 #else
 extern char* optarg;
 #endif
+extern int optind;
+
+/** Set from signal context when the router has been asked to exit. */
+volatile sig_atomic_t srShutdownRequested = 0;
+/** Set from signal context when SIGUSR1 asks for the counters. */
+volatile sig_atomic_t srStatsRequested = 0;
+/** Counts SIGHUPs, each asking for configuration files to be read again. */
+volatile sig_atomic_t srReloadRequests = 0;
 
 /*
  *-----------------------------------------------------------------------------
@@ -121,9 +197,20 @@ extern char* optarg;
 
 static void usage(char*);
 static void sr_init_instance(struct sr_instance*);
-static void sr_destroy_instance(struct sr_instance*);
+static void sr_destroy_instance(struct sr_instance*, bool handedOff);
 static void sr_set_user(struct sr_instance*);
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
+static void sr_shutdown_handler(int signum);
+static void sr_stats_handler(int signum);
+static void sr_reload_handler(int signum);
+static void sr_install_request_handlers(void);
+static void sr_block_control_signals(bool block);
+static void sr_parse_args(int argc, char **argv, sr_command_args_t *cmdArgs);
+static void sr_setup_instance(struct sr_instance* sr, sr_command_args_t *cmdArgs);
+static int sr_connect_instance(struct sr_instance* sr, sr_command_args_t *cmdArgs);
+static int sr_run_multi(const sr_command_args_t *defaults);
+static void sr_configure_sched(const sr_command_args_t *cmdArgs);
+static void sr_verify_sched(void);
 
 /*
  *-----------------------------------------------------------------------------
@@ -133,149 +220,122 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
 
 int main(int argc, char **argv)
 {
-   int c;
    sr_command_args_t cmdArgs = sr_default_config;
    struct sr_instance sr;
+   bool handedOff = false;
    
    printf("Using %s\n", VERSION_INFO);
    
-   while ((c = getopt(argc, argv, "hns:v:p:u:t:r:l:T:I:E:R:")) != EOF)
-   {
-      switch (c)
-      {
-         case 'h':
-            usage(argv[0]);
-            exit(0);
-            break;
-         case 'p':
-            cmdArgs.port = atoi((char *) optarg);
-            break;
-         case 't':
-            cmdArgs.topo = atoi((char *) optarg);
-            break;
-         case 'v':
-            cmdArgs.host = optarg;
-            break;
-         case 'u':
-            cmdArgs.user = optarg;
-            break;
-         case 's':
-            cmdArgs.server = optarg;
-            break;
-         case 'l':
-            cmdArgs.logfile = optarg;
-            break;
-         case 'r':
-            cmdArgs.rtable = optarg;
-            break;
-         case 'T':
-            cmdArgs.template = optarg;
-            break;
-         case 'n':
-            cmdArgs.natEnabled = true;
-            break;
-         case 'I':
-            cmdArgs.icmpQueryTimeout = atoi(optarg);
-            break;
-         case 'E':
-            cmdArgs.tcpEstablishedTimeout = atoi(optarg);
-            break;
-         case 'R':
-            cmdArgs.tcpTransitioryTimeout = atoi(optarg);
-            break;
-         default:
-            /* This case should be caught for us by getopt, but it's good form 
-             * to have a default in every switch statement. */
-            break;
-      } /* switch */
-   } /* -- while -- */
+   sr_upgrade_init(argc, argv);
+   sr_install_request_handlers();
    
-   /* -- zero out sr instance -- */
-   sr_init_instance(&sr);
+   sr_parse_args(argc, argv, &cmdArgs);
+   sr_configure_sched(&cmdArgs);
    
-   /* -- set up routing table from file -- */
-   if (cmdArgs.template == NULL)
+   /* Before any thread exists, so each one can register itself. */
+   if (cmdArgs.watchdogThresholdMs
+      && (sr_watchdog_start(cmdArgs.watchdogThresholdMs, cmdArgs.watchdogLog) != 0))
    {
-      sr.template_name[0] = '\0';
-      sr_load_rt_wrap(&sr, cmdArgs.rtable);
+      exit(1);
    }
-   else
-      strncpy(sr.template_name, cmdArgs.template, 30);
-   
-   sr.topo_id = cmdArgs.topo;
-   strncpy(sr.host, cmdArgs.host, 32);
    
-   if (!cmdArgs.user)
+   if (cmdArgs.multiConfig)
    {
-      sr_set_user(&sr);
-   }
-   else
-   {
-      strncpy(sr.user, cmdArgs.user, 32);
+      return sr_run_multi(&cmdArgs);
    }
    
-   /* -- set up file pointer for logging of raw packets -- */
-   if (cmdArgs.logfile != NULL)
+   /* Worker threads inherit this mask, so control signals are only ever 
+    * delivered to the main thread where they can interrupt the read loop. */
+   sr_block_control_signals(true);
+   
+   /* -- zero out sr instance -- */
+   sr_init_instance(&sr);
+   sr_setup_instance(&sr, &cmdArgs);
+   
+   if (cmdArgs.natStandbySocket)
    {
-      sr.logfile = sr_dump_open(cmdArgs.logfile, 0, PACKET_DUMP_SIZE);
-      if (!sr.logfile)
+      if (sr.nat == NULL)
       {
-         fprintf(stderr, "Error opening up dump file %s\n", cmdArgs.logfile);
+         fprintf(stderr, "Standby mode (-b) requires NAT (-n)\n");
          exit(1);
       }
+      
+      /* Mirror the active router until it fails. Shutdown signals are 
+       * unblocked meanwhile so the standby can still be stopped; the NAT 
+       * thread was created with them blocked. */
+      sr.nat->timeoutsSuspended = true;
+      sr_block_control_signals(false);
+      if (sr_nat_sync_run_standby(sr.nat, cmdArgs.natStandbySocket) != 0)
+      {
+         exit(1);
+      }
+      sr_block_control_signals(true);
+      sr.nat->timeoutsSuspended = false;
+      
+      /* We're the active router now. Let the old one come back as standby. */
+      cmdArgs.natSyncSocket = cmdArgs.natStandbySocket;
    }
-   
-   Debug("Client %s connecting to Server %s:%d\n", sr.user, cmdArgs.server, cmdArgs.port);
-   if (cmdArgs.template)
-      Debug("Requesting topology template %s\n", cmdArgs.template);
-   else
-      Debug("Requesting topology %d\n", cmdArgs.topo);
-   
-   /* connect to server and negotiate session */
-   if (sr_connect_to_server(&sr, cmdArgs.port, cmdArgs.server) == -1)
+
+   if (cmdArgs.upgradeChannel >= 0)
    {
-      fprintf(stderr, "Error opening up connection to %s:%u\n", cmdArgs.server, cmdArgs.port);
-      return 1;
+      /* Hot upgrade: the VNS session, interfaces and routing table are 
+       * adopted from the previous process below, after sr_init(). */
+      Debug("Taking over from previous router instance\n");
    }
-   
-   if ((cmdArgs.template != NULL) && (strcmp(cmdArgs.rtable, "rtable.vrhost") == 0))
+   else if (sr_connect_instance(&sr, &cmdArgs) != 0)
    {
-      /* we've recv'd the rtable now, so read it in */
-      Debug("Connected to new instantiation of topology template %s\n", cmdArgs.template);
-      sr_load_rt_wrap(&sr, "rtable.vrhost");
-   }
-   else
-   {  
-      /* Read from specified routing table */
-      sr_load_rt_wrap(&sr, cmdArgs.rtable);
+      return 1;
    }
    
-   if (cmdArgs.natEnabled)
+   /* call router init (for arp subsystem etc.) */
+   sr_init(&sr);
+   
+   /* Started before adopting a hot upgrade so the replication socket is 
+    * already ours when the old process exits and the standby reconnects. */
+   if (cmdArgs.natSyncSocket && sr.nat)
    {
-      sr.nat = malloc(sizeof(sr_nat_t));
-      assert(sr.nat);
-      
-      sr_nat_init(sr.nat);
-      
-      sr.nat->routerState = &sr;
-      sr.nat->icmpTimeout = cmdArgs.icmpQueryTimeout;
-      sr.nat->tcpEstablishedTimeout = cmdArgs.tcpEstablishedTimeout;
-      sr.nat->tcpTransitoryTimeout = cmdArgs.tcpTransitioryTimeout;
+      sr.nat->sync = sr_nat_sync_start_active(sr.nat, cmdArgs.natSyncSocket);
    }
-   else
+   
+   /* Last, so none of the threads above inherit the reader's settings. */
+   sr_sched_apply(pthread_self(), SR_SCHED_READER);
+   sr_verify_sched();
+   sr_watchdog_register("reader");
+   
+   if ((cmdArgs.upgradeChannel >= 0) && (sr_upgrade_adopt(&sr, cmdArgs.upgradeChannel) != 0))
    {
-      sr.nat = NULL;
+      /* The old process is still serving; just go away. */
+      fprintf(stderr, "Error adopting state from previous router instance\n");
+      return 1;
    }
-
-   /* call router init (for arp subsystem etc.) */
-   sr_init(&sr);
+   
+   sr_block_control_signals(false);
    
    /* -- whizbang main loop ;-) */
    while (sr_read_from_server(&sr) == 1)
    {
+      if (srStatsRequested)
+      {
+         srStatsRequested = 0;
+         sr_router_print(&sr, stdout);
+         sr_watchdog_print(stdout);
+      }
+      /* Commands already read ahead are handled before the socket moves. */
+      if (srUpgradeRequested && !sr_vns_reader_pending(sr.reader))
+      {
+         srUpgradeRequested = 0;
+         sr_watchdog_stage(SR_WATCHDOG_UPGRADE);
+         if (sr_upgrade_handoff(&sr) == 0)
+         {
+            handedOff = true;
+            break;
+         }
+      }
    }
    
-   sr_destroy_instance(&sr);
+   sr_watchdog_unregister();
+   sr_watchdog_stop();
+   sr_destroy_instance(&sr, handedOff);
    
    return 0;
 }/* -- main -- */
@@ -299,6 +359,35 @@ static void usage(char* argv0)
    printf("           [-t topo id] [-r routing table] \n");
    printf("           [-l log file] [-I ICMP Timeout] \n");
    printf("           [-E TCP Established Timeout] [-R TCP Transitory Timeout] \n");
+   printf("           [-W TCP TIME_WAIT Timeout after FIN/ACK or RST, default %d] \n",
+      DEFAULT_TCP_TIME_WAIT_TIMEOUT);
+   printf("           [-F NAT endpoint independent filtering: any host may use a mapping] \n");
+   printf("           [-a ARP cache snapshot file] \n");
+   printf("           [-m NAT replication socket] [-b standby for NAT replication socket] \n");
+   printf("           [-C config file with one line of options per hosted router] \n");
+   printf("           [-O overload watermarks in KB: high[:low], 0 disables] \n");
+   printf("           [-P adaptive VNS reads, busy-polling up to this many us] \n");
+   printf("           [-S scheduling profile, e.g. reader=1:50,timer=0,sync=0,lock,prefault=8192] \n");
+   printf("           [-D stall watchdog threshold ms[:log file], default log %s] \n",
+      SR_WATCHDOG_DEFAULT_LOG);
+   printf("           [-H heavy hitter log interval s (0: SIGUSR1 only)[:log file], default log %s] \n",
+      SR_SKETCH_DEFAULT_LOG);
+   printf("           [-L NAT limits per internal host: packets/s:bits/s[:mappings[:mappings/s]], 0: none] \n");
+   printf("           [-G NAT mapping log: path[:MB per file[:ports per block]], default %d MB] \n",
+      SR_NATLOG_DEFAULT_ROTATE / (1024 * 1024));
+   printf("           [-K deterministic NAT ports per internal host: a.b.c.d/len[:ports per host]] \n");
+   printf("           [-X flow records to file or udp:host:port[,active timeout s], default %d s] \n",
+      SR_FLOW_DEFAULT_ACTIVE_TIMEOUT);
+   printf("           [-Y sample 1 in N frames to an sFlow collector: N[,host:port], default %s] \n",
+      SR_SAMPLE_DEFAULT_COLLECTOR);
+   printf("           [-Z per-route counter log interval s (0: SIGUSR1 only)[:log file], default log %s] \n",
+      SR_ROUTESTAT_DEFAULT_LOG);
+   printf("           [-M port mirror sessions file, one per line: source in|out|both match interface|ring:path bits/s] \n");
+   printf("           [-A packet trace filters file, one per line: interface|any count match[:trace log], default log %s] \n",
+      SR_TRACE_DEFAULT_LOG);
+   printf("   send SIGUSR1 to print overload, NAT port, NAT log, heavy hitter, flow export, sampling, route, mirror, policer and stall counters, and write packet traces \n");
+   printf("   send SIGHUP to read the port mirror sessions and packet trace filters again \n");
+   printf("   send SIGUSR2 to hand the session over to a freshly started binary \n");
    printf("   defaults server=%s port=%d host=%s  \n", DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST);
 } /* -- usage -- */
 
@@ -331,10 +420,14 @@ void sr_set_user(struct sr_instance* sr)
  * Method: sr_destroy_instance(..)
  * Scope: Local
  *
+ * After a hot upgrade (handedOff) the new process carries on with the same 
+ * ARP cache, NAT connections and flows, so nothing is saved or ended here: 
+ * records and samples already queued are written out and the rest is only 
+ * released. The ARP and NAT locks are still held from the handoff.
  *
  *----------------------------------------------------------------------------*/
 
-static void sr_destroy_instance(struct sr_instance* sr)
+static void sr_destroy_instance(struct sr_instance* sr, bool handedOff)
 {
    /* REQUIRES */
    assert(sr);
@@ -344,6 +437,50 @@ static void sr_destroy_instance(struct sr_instance* sr)
       sr_dump_close(sr->logfile);
    }
    
+   if (!handedOff)
+   {
+      /* Leave a warm ARP cache behind for the next run. */
+      sr_arpcache_save(&(sr->cache));
+   }
+   
+   if (sr->nat)
+   {
+      sr_nat_sync_stop(sr->nat->sync);
+      sr_nat_log_stop(sr->nat);
+      if (sr->flows && !handedOff)
+      {
+         sr_nat_flush_flows(sr->nat);
+      }
+   }
+   
+   if (handedOff)
+   {
+      sr_flow_release(sr->flows);
+   }
+   else
+   {
+      sr_flow_destroy(sr->flows);
+   }
+   sr->flows = NULL;
+   
+   sr_vns_reader_destroy(sr->reader);
+   sr->reader = 0;
+   
+   sr_sketch_destroy(sr->sketch);
+   sr->sketch = NULL;
+   
+   sr_sample_destroy(sr->sampler);
+   sr->sampler = NULL;
+   
+   sr_routestat_destroy(sr->routeStats);
+   sr->routeStats = NULL;
+   
+   sr_mirror_destroy(sr->mirror);
+   sr->mirror = NULL;
+   
+   sr_trace_destroy(sr->trace);
+   sr->trace = NULL;
+   
    /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -365,12 +502,650 @@ static void sr_init_instance(struct sr_instance* sr)
    sr->user[0] = 0;
    sr->host[0] = 0;
    sr->topo_id = 0;
+   sr->vnsCapabilities = 0;
+   sr->vnsMaxBatchLen = 0;
+   sr->reader = 0;
    sr->if_list = 0;
    sr->routing_table = 0;
    sr->logfile = 0;
    sr->nat = NULL;
+   sr->cache.persistFile = NULL;
+   sr->ipIdentifyNumber = 0;
+   sr->multi = NULL;
+   sr_admission_init(&sr->admission, 0, 0);
+   sr->sketch = NULL;
+   sr->flows = NULL;
+   sr->sampler = NULL;
+   sr->routeStats = NULL;
+   sr->mirror = NULL;
+   sr->trace = NULL;
 } /* -- sr_init_instance -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_args(..)
+ * Scope: Local
+ *
+ * Applies command line options on top of whatever is already in cmdArgs. 
+ * Used for the process's own command line and for each line of a -C 
+ * configuration file.
+ *
+ *----------------------------------------------------------------------------*/
+
+static void sr_parse_args(int argc, char **argv, sr_command_args_t *cmdArgs)
+{
+   int c;
+   
+   /* -- restart the scan; GNU getopt also resets its internal state on 0 -- */
+#ifdef _LINUX_
+   optind = 0;
+#else
+   optind = 1;
+#endif
+   
+   while ((c = getopt(argc, argv, "hnFs:v:p:u:t:r:l:T:I:E:R:W:a:U:m:b:C:O:P:S:D:H:L:G:K:M:X:Y:Z:A:")) != EOF)
+   {
+      switch (c)
+      {
+         case 'h':
+            usage(argv[0]);
+            exit(0);
+            break;
+         case 'p':
+            cmdArgs->port = atoi((char *) optarg);
+            break;
+         case 't':
+            cmdArgs->topo = atoi((char *) optarg);
+            break;
+         case 'v':
+            cmdArgs->host = optarg;
+            break;
+         case 'u':
+            cmdArgs->user = optarg;
+            break;
+         case 's':
+            cmdArgs->server = optarg;
+            break;
+         case 'l':
+            cmdArgs->logfile = optarg;
+            break;
+         case 'r':
+            cmdArgs->rtable = optarg;
+            break;
+         case 'T':
+            cmdArgs->template = optarg;
+            break;
+         case 'n':
+            cmdArgs->natEnabled = true;
+            break;
+         case 'F':
+            cmdArgs->natEndpointIndependent = true;
+            break;
+         case 'I':
+            cmdArgs->icmpQueryTimeout = atoi(optarg);
+            break;
+         case 'E':
+            cmdArgs->tcpEstablishedTimeout = atoi(optarg);
+            break;
+         case 'R':
+            cmdArgs->tcpTransitioryTimeout = atoi(optarg);
+            break;
+         case 'W':
+            cmdArgs->tcpTimeWaitTimeout = atoi(optarg);
+            break;
+         case 'a':
+            cmdArgs->arpCacheFile = optarg;
+            break;
+         case 'U':
+            cmdArgs->upgradeChannel = atoi(optarg);
+            break;
+         case 'm':
+            cmdArgs->natSyncSocket = optarg;
+            break;
+         case 'b':
+            cmdArgs->natStandbySocket = optarg;
+            break;
+         case 'C':
+            cmdArgs->multiConfig = optarg;
+            break;
+         case 'O':
+         {
+            char *low = strchr(optarg, ':');
+            
+            cmdArgs->overloadHighWatermark = atoi(optarg) * 1024;
+            cmdArgs->overloadLowWatermark = low ? atoi(low + 1) * 1024 : 0;
+            break;
+         }
+         case 'P':
+            cmdArgs->spinBudget = atoi(optarg);
+            break;
+         case 'S':
+            cmdArgs->schedProfile = optarg;
+            break;
+         case 'H':
+         {
+            char *logPath = strchr(optarg, ':');
+            
+            cmdArgs->sketchIntervalS = atoi(optarg);
+            if (logPath)
+            {
+               cmdArgs->sketchLog = logPath + 1;
+            }
+            break;
+         }
+         case 'L':
+            cmdArgs->policerLimits = optarg;
+            break;
+         case 'G':
+            cmdArgs->natLog = optarg;
+            break;
+         case 'K':
+            cmdArgs->natDeterministic = optarg;
+            break;
+         case 'M':
+            cmdArgs->mirrorConfig = optarg;
+            break;
+         case 'A':
+         {
+            char *logPath = strchr(optarg, ':');
+            
+            cmdArgs->traceConfig = optarg;
+            if (logPath)
+            {
+               cmdArgs->traceLog = logPath + 1;
+            }
+            break;
+         }
+         case 'X':
+            cmdArgs->flowExport = optarg;
+            break;
+         case 'Y':
+            cmdArgs->sampleSpec = optarg;
+            break;
+         case 'Z':
+         {
+            char *logPath = strchr(optarg, ':');
+            
+            cmdArgs->routeStatsIntervalS = atoi(optarg);
+            if (logPath)
+            {
+               cmdArgs->routeStatsLog = logPath + 1;
+            }
+            break;
+         }
+         case 'D':
+         {
+            char *logPath = strchr(optarg, ':');
+            
+            cmdArgs->watchdogThresholdMs = atoi(optarg);
+            if (logPath)
+            {
+               cmdArgs->watchdogLog = logPath + 1;
+            }
+            break;
+         }
+         default:
+            /* This case should be caught for us by getopt, but it's good form 
+             * to have a default in every switch statement. */
+            break;
+      } /* switch */
+   } /* -- while -- */
+} /* -- sr_parse_args -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_setup_instance(..)
+ * Scope: Local
+ *
+ * Loads the routing table, identity, packet log and NAT state for a freshly 
+ * initialized instance. Instances hosted by sr_multi (sr->multi set) get a 
+ * NAT without its own timeout thread.
+ *
+ *----------------------------------------------------------------------------*/
+
+static void sr_setup_instance(struct sr_instance* sr, sr_command_args_t *cmdArgs)
+{
+   /* REQUIRES */
+   assert(sr);
+   
+   sr->cache.persistFile = cmdArgs->arpCacheFile;
+   sr_admission_init(&sr->admission, cmdArgs->overloadHighWatermark,
+      cmdArgs->overloadLowWatermark);
+   
+   if (cmdArgs->spinBudget >= 0)
+   {
+      /* Hosted instances share one thread; spinning on one starves the rest. */
+      sr->reader = sr_vns_reader_create(sr->multi ? 0 : cmdArgs->spinBudget);
+      assert(sr->reader);
+   }
+   
+   if (cmdArgs->sketchIntervalS >= 0)
+   {
+      sr->sketch = sr_sketch_create(cmdArgs->sketchIntervalS, cmdArgs->sketchLog);
+      if (sr->sketch == NULL)
+      {
+         exit(1);
+      }
+   }
+   
+   if (cmdArgs->routeStatsIntervalS >= 0)
+   {
+      sr->routeStats = sr_routestat_create(cmdArgs->routeStatsIntervalS, cmdArgs->routeStatsLog);
+      if (sr->routeStats == NULL)
+      {
+         exit(1);
+      }
+   }
+   
+   /* -- set up routing table from file -- */
+   if (cmdArgs->template == NULL)
+   {
+      sr->template_name[0] = '\0';
+      sr_load_rt_wrap(sr, cmdArgs->rtable);
+   }
+   else
+      strncpy(sr->template_name, cmdArgs->template, 30);
+   
+   sr->topo_id = cmdArgs->topo;
+   strncpy(sr->host, cmdArgs->host, 32);
+   
+   if (!cmdArgs->user)
+   {
+      sr_set_user(sr);
+   }
+   else
+   {
+      strncpy(sr->user, cmdArgs->user, 32);
+   }
+   
+   /* -- set up file pointer for logging of raw packets -- */
+   if (cmdArgs->logfile != NULL)
+   {
+      sr->logfile = sr_dump_open(cmdArgs->logfile, 0, PACKET_DUMP_SIZE);
+      if (!sr->logfile)
+      {
+         fprintf(stderr, "Error opening up dump file %s\n", cmdArgs->logfile);
+         exit(1);
+      }
+   }
+   
+   if (cmdArgs->natEnabled)
+   {
+      sr->nat = malloc(sizeof(sr_nat_t));
+      assert(sr->nat);
+      
+      if (sr->multi)
+      {
+         sr_nat_init_state(sr->nat);
+      }
+      else
+      {
+         sr_nat_init(sr->nat);
+      }
+      
+      sr->nat->routerState = sr;
+      sr->nat->icmpTimeout = cmdArgs->icmpQueryTimeout;
+      sr->nat->tcpEstablishedTimeout = cmdArgs->tcpEstablishedTimeout;
+      sr->nat->tcpTransitoryTimeout = cmdArgs->tcpTransitioryTimeout;
+      sr->nat->tcpTimeWaitTimeout = cmdArgs->tcpTimeWaitTimeout;
+      sr->nat->endpointIndependentFiltering = cmdArgs->natEndpointIndependent;
+      
+      if (cmdArgs->policerLimits)
+      {
+         sr_policer_limits_t limits;
+         
+         if (sr_policer_parse_limits(cmdArgs->policerLimits, &limits) != 0)
+         {
+            fprintf(stderr, "Bad per host limits \"%s\", expected "
+               "packets/s:bits/s[:mappings[:mappings/s]]\n", cmdArgs->policerLimits);
+            exit(1);
+         }
+         sr->nat->policer = sr_policer_create(&limits);
+      }
+      
+      if (cmdArgs->natDeterministic)
+      {
+         uint32_t firstHost;
+         unsigned int hosts, portsPerHost;
+         
+         if ((sr_nat_deterministic_parse(cmdArgs->natDeterministic, &firstHost, &hosts,
+            &portsPerHost) != 0) || (sr_nat_set_deterministic(sr->nat, firstHost, hosts,
+            portsPerHost) != 0))
+         {
+            fprintf(stderr, "Bad deterministic NAT \"%s\", expected a.b.c.d/len[:ports per host] "
+               "with at most %d ports in all\n", cmdArgs->natDeterministic, SR_NAT_PORT_POOL_SIZE);
+            exit(1);
+         }
+      }
+      
+      if (cmdArgs->natLog)
+      {
+         char path[SR_NATLOG_MAX_PATH];
+         uint64_t rotateBytes;
+         unsigned int blockSize;
+         
+         if (sr_natlog_parse(cmdArgs->natLog, path, sizeof(path), &rotateBytes, &blockSize) != 0)
+         {
+            fprintf(stderr, "Bad NAT log \"%s\", expected path[:MB per file[:ports per block]]\n",
+               cmdArgs->natLog);
+            exit(1);
+         }
+         /* Hosted routers each get their own series of files. */
+         if (sr->multi)
+         {
+            size_t length = strlen(path);
+            snprintf(path + length, sizeof(path) - length, ".%u", sr->topo_id);
+         }
+         if (sr_nat_log_start(sr->nat, path, rotateBytes, blockSize) != 0)
+         {
+            exit(1);
+         }
+      }
+   }
+   else
+   {
+      sr->nat = NULL;
+   }
+   
+   if (cmdArgs->flowExport)
+   {
+      char destination[SR_FLOW_MAX_DESTINATION];
+      unsigned int activeTimeoutS;
+      
+      if (sr_flow_parse(cmdArgs->flowExport, destination, sizeof(destination),
+         &activeTimeoutS) != 0)
+      {
+         fprintf(stderr, "Bad flow export \"%s\", expected file or udp:host:port"
+            "[,active timeout s]\n", cmdArgs->flowExport);
+         exit(1);
+      }
+      /* Hosted routers each get their own file; a collector tells them 
+       * apart by observation domain. */
+      if (sr->multi && strncmp(destination, "udp:", 4))
+      {
+         size_t length = strlen(destination);
+         snprintf(destination + length, sizeof(destination) - length, ".%u", sr->topo_id);
+      }
+      sr->flows = sr_flow_create(destination, activeTimeoutS, sr->topo_id);
+      if (sr->flows == NULL)
+      {
+         exit(1);
+      }
+   }
+   
+   if (cmdArgs->sampleSpec)
+   {
+      char collector[SR_SAMPLE_MAX_COLLECTOR];
+      unsigned int rate;
+      
+      if (sr_sample_parse(cmdArgs->sampleSpec, &rate, collector, sizeof(collector)) != 0)
+      {
+         fprintf(stderr, "Bad sampling \"%s\", expected N[,host:port]\n", cmdArgs->sampleSpec);
+         exit(1);
+      }
+      /* Hosted routers share the collector; it tells them apart by sub-agent. */
+      sr->sampler = sr_sample_create(rate, collector, sr->topo_id);
+      if (sr->sampler == NULL)
+      {
+         exit(1);
+      }
+   }
+   
+   if (cmdArgs->mirrorConfig)
+   {
+      char path[SR_MIRROR_MAX_PATH];
+      
+      /* Hosted routers have the same interface names, so each reads its own file. */
+      if (sr->multi)
+      {
+         snprintf(path, sizeof(path), "%s.%u", cmdArgs->mirrorConfig, sr->topo_id);
+      }
+      else
+      {
+         snprintf(path, sizeof(path), "%s", cmdArgs->mirrorConfig);
+      }
+      sr->mirror = sr_mirror_create(sr, path);
+      if (sr->mirror == NULL)
+      {
+         exit(1);
+      }
+   }
+   
+   if (cmdArgs->traceConfig)
+   {
+      char path[SR_TRACE_MAX_PATH];
+      int length = strcspn(cmdArgs->traceConfig, ":");
+      
+      /* As with mirror sessions; the log is shared, traces name the topology. */
+      if (sr->multi)
+      {
+         snprintf(path, sizeof(path), "%.*s.%u", length, cmdArgs->traceConfig, sr->topo_id);
+      }
+      else
+      {
+         snprintf(path, sizeof(path), "%.*s", length, cmdArgs->traceConfig);
+      }
+      sr->trace = sr_trace_create(path, cmdArgs->traceLog, sr->topo_id);
+      if (sr->trace == NULL)
+      {
+         exit(1);
+      }
+   }
+} /* -- sr_setup_instance -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_connect_instance(..)
+ * Scope: Local
+ *
+ * Opens the instance's VNS session and reads in its routing table.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  something other than zero on error
+ *
+ *----------------------------------------------------------------------------*/
+
+static int sr_connect_instance(struct sr_instance* sr, sr_command_args_t *cmdArgs)
+{
+   Debug("Client %s connecting to Server %s:%d\n", sr->user, cmdArgs->server, cmdArgs->port);
+   if (cmdArgs->template)
+      Debug("Requesting topology template %s\n", cmdArgs->template);
+   else
+      Debug("Requesting topology %d\n", cmdArgs->topo);
+   
+   /* connect to server and negotiate session */
+   if (sr_connect_to_server(sr, cmdArgs->port, cmdArgs->server) == -1)
+   {
+      fprintf(stderr, "Error opening up connection to %s:%u\n", cmdArgs->server, cmdArgs->port);
+      return 1;
+   }
+   
+   if ((cmdArgs->template != NULL) && (strcmp(cmdArgs->rtable, "rtable.vrhost") == 0))
+   {
+      /* we've recv'd the rtable now, so read it in */
+      Debug("Connected to new instantiation of topology template %s\n", cmdArgs->template);
+      sr_load_rt_wrap(sr, "rtable.vrhost");
+   }
+   else
+   {  
+      /* Read from specified routing table */
+      sr_load_rt_wrap(sr, cmdArgs->rtable);
+   }
+   
+   return 0;
+} /* -- sr_connect_instance -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_run_multi(..)
+ * Scope: Local
+ *
+ * Hosts one router instance per line of the -C configuration file in this 
+ * process. Each line holds command line options for one topology (e.g. 
+ * "-t 301 -r rtable.301 -n"); options given on the real command line act as 
+ * defaults. Blank lines and lines starting with '#' are ignored. Hot 
+ * upgrade and NAT replication are single instance features and are refused.
+ *
+ *----------------------------------------------------------------------------*/
+
+static int sr_run_multi(const sr_command_args_t *defaults)
+{
+   FILE *config;
+   char line[1024];
+   unsigned int lineNumber = 0;
+   unsigned int i;
+   sr_multi_t multi;
+   
+   config = fopen(defaults->multiConfig, "r");
+   if (config == NULL)
+   {
+      perror(defaults->multiConfig);
+      return 1;
+   }
+   
+   if ((defaults->upgradeChannel >= 0) || defaults->natSyncSocket || defaults->natStandbySocket)
+   {
+      fprintf(stderr, "Options -U, -m and -b cannot be used with -C\n");
+      fclose(config);
+      return 1;
+   }
+   
+   /* Hot upgrade hands over a single session; not supported here. */
+   signal(SIGUSR2, SIG_IGN);
+   
+   sr_block_control_signals(true);
+   
+   if (sr_multi_init(&multi, true) != 0)
+   {
+      fclose(config);
+      return 1;
+   }
+   
+   while (fgets(line, sizeof(line), config))
+   {
+      char *argv[MAX_CONFIG_LINE_ARGS + 1];
+      int argc = 0;
+      char *copy, *token, *savePtr;
+      sr_command_args_t cmdArgs = *defaults;
+      struct sr_instance *sr;
+      
+      lineNumber++;
+      
+      /* Option strings point into the line, which lives as long as the 
+       * instance does. */
+      copy = strdup(line);
+      assert(copy);
+      
+      argv[argc++] = "sr";
+      for (token = strtok_r(copy, " \t\r\n", &savePtr); token && (argc < MAX_CONFIG_LINE_ARGS);
+         token = strtok_r(NULL, " \t\r\n", &savePtr))
+      {
+         argv[argc++] = token;
+      }
+      argv[argc] = NULL;
+      
+      if ((argc == 1) || (argv[1][0] == '#'))
+      {
+         free(copy);
+         continue;
+      }
+      
+      cmdArgs.multiConfig = NULL;
+      sr_parse_args(argc, argv, &cmdArgs);
+      if (cmdArgs.multiConfig || (cmdArgs.upgradeChannel >= 0) || cmdArgs.natSyncSocket
+         || cmdArgs.natStandbySocket || (cmdArgs.schedProfile != defaults->schedProfile)
+         || (cmdArgs.watchdogThresholdMs != defaults->watchdogThresholdMs))
+      {
+         fprintf(stderr, "%s:%u: options -C, -U, -m, -b, -S and -D are not allowed\n",
+            defaults->multiConfig, lineNumber);
+         exit(1);
+      }
+      
+      sr = malloc(sizeof(struct sr_instance));
+      assert(sr);
+      sr_init_instance(sr);
+      sr->multi = &multi;
+      sr_setup_instance(sr, &cmdArgs);
+      
+      if (sr_connect_instance(sr, &cmdArgs) != 0)
+      {
+         exit(1);
+      }
+      
+      sr_init(sr);
+      sr_multi_add(&multi, sr);
+   }
+   
+   fclose(config);
+   
+   printf("Hosting %u router instances\n", multi.count);
+   
+   sr_sched_apply(pthread_self(), SR_SCHED_READER);
+   sr_verify_sched();
+   sr_watchdog_register("reader");
+   
+   sr_block_control_signals(false);
+   
+   sr_multi_run(&multi);
+   
+   sr_watchdog_unregister();
+   sr_watchdog_stop();
+   sr_multi_destroy(&multi);
+   for (i = 0; i < multi.count; i++)
+   {
+      sr_destroy_instance(multi.instances[i], false);
+   }
+   
+   return 0;
+} /* -- sr_run_multi -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_configure_sched(..)
+ * Scope: Local
+ *
+ * Installs the -S scheduling profile before any router thread exists, then 
+ * locks and prefaults memory as it asks. Threads pick up their settings as 
+ * they are created; the main thread takes the reader's once they all are.
+ *
+ *----------------------------------------------------------------------------*/
+
+static void sr_configure_sched(const sr_command_args_t *cmdArgs)
+{
+   sr_sched_profile_t profile;
+   
+   if (cmdArgs->schedProfile == NULL)
+   {
+      return;
+   }
+   
+   sr_sched_profile_init(&profile);
+   if (sr_sched_parse(&profile, cmdArgs->schedProfile) != 0)
+   {
+      fprintf(stderr, "Error parsing scheduling profile %s\n", cmdArgs->schedProfile);
+      exit(1);
+   }
+   sr_sched_configure(&profile);
+   
+   /* Failures are reported by sr_verify_sched(). */
+   sr_sched_lock_memory();
+} /* -- sr_configure_sched -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_verify_sched(..)
+ * Scope: Local
+ *
+ * Prints what the scheduling profile asked for and what was granted, and 
+ * refuses to run with only part of it in effect.
+ *
+ *----------------------------------------------------------------------------*/
+
+static void sr_verify_sched(void)
+{
+   if (sr_sched_verify(stdout) != 0)
+   {
+      fprintf(stderr, "Scheduling profile could not be applied\n");
+      exit(1);
+   }
+} /* -- sr_verify_sched -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_verify_routing_table()
  * Scope: Global
@@ -439,3 +1214,104 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable)
    sr_print_routing_table(sr);
    printf("---------------------------------------------\n");
 }
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_shutdown_handler(..)
+ * Scope: Local
+ *
+ * Flags a graceful shutdown. The read loop notices the interrupted recv and 
+ * returns so the instance can be torn down (and state saved) normally.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_shutdown_handler(int signum)
+{
+   (void) signum;
+   srShutdownRequested = 1;
+} /* -- sr_shutdown_handler -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_stats_handler(..)
+ * Scope: Local
+ *
+ * Asks for the counters (SIGUSR1). The read loop prints them.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_stats_handler(int signum)
+{
+   (void) signum;
+   srStatsRequested = 1;
+} /* -- sr_stats_handler -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_reload_handler(..)
+ * Scope: Local
+ *
+ * Asks for the configuration files (-M, -A) to be read again (SIGHUP). The 
+ * timer thread reads them, each instance once per SIGHUP, so the handler 
+ * only counts.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_reload_handler(int signum)
+{
+   (void) signum;
+   srReloadRequests++;
+} /* -- sr_reload_handler -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_install_request_handlers(..)
+ * Scope: Local
+ *
+ * Installs the SIGUSR1 and SIGHUP handlers. SIGUSR1 goes without 
+ * SA_RESTART so a blocked read from VNS returns and the counters get 
+ * printed; SIGHUP restarts whatever it interrupts.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_install_request_handlers(void)
+{
+   struct sigaction action;
+   
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = sr_stats_handler;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGUSR1, &action, NULL);
+   
+   action.sa_handler = sr_reload_handler;
+   action.sa_flags = SA_RESTART;
+   sigaction(SIGHUP, &action, NULL);
+} /* -- sr_install_request_handlers -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_block_control_signals(..)
+ * Scope: Local
+ *
+ * Installs the shutdown handler (without SA_RESTART, so a blocked recv 
+ * returns EINTR) and blocks or unblocks SIGINT/SIGTERM, the SIGUSR1 
+ * counter dump and the SIGUSR2 upgrade trigger for the calling thread.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_block_control_signals(bool block)
+{
+   struct sigaction action;
+   sigset_t signals;
+   
+   if (block)
+   {
+      memset(&action, 0, sizeof(action));
+      action.sa_handler = sr_shutdown_handler;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGINT, &action, NULL);
+      sigaction(SIGTERM, &action, NULL);
+   }
+   
+   sigemptyset(&signals);
+   sigaddset(&signals, SIGINT);
+   sigaddset(&signals, SIGTERM);
+   sigaddset(&signals, SIGUSR1);
+   sigaddset(&signals, SIGUSR2);
+   pthread_sigmask(block ? SIG_BLOCK : SIG_UNBLOCK, &signals, NULL);
+} /* -- sr_block_control_signals -- */
@@ -0,0 +1,697 @@
+/**
+ * @file sr_mirror.c
+ * @brief Port mirroring to another interface or to a capture ring.
+ *
+ * See sr_mirror.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+
+#include "sr_mirror.h"
+#include "sr_if.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define MIRROR_NS_PER_S    (1000000000ULL)
+#define MIRROR_BURST_NS    (MIRROR_NS_PER_S) /**< Caps allow a second's worth at once. */
+#define MIRROR_RING_PREFIX "ring:"
+#define MIRROR_MAX_LINE    (512)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static int mirrorParseSession(sr_mirror_t *mirror, char *line, sr_mirror_session_t *session);
+static int mirrorParseRate(const char *rate, uint64_t *bitsPerS);
+static sr_mirror_ring_t *mirrorMapRing(sr_mirror_t *mirror, const char *path);
+static bool mirrorAdmit(sr_mirror_session_t *session, unsigned int length);
+static void mirrorToRing(sr_mirror_session_t *session, uint8_t sessionIndex,
+   sr_mirror_direction_t direction, const uint8_t *frame, unsigned int length);
+static void mirrorToInterface(sr_mirror_t *mirror, sr_mirror_session_t *session,
+   uint8_t sessionIndex, sr_mirror_direction_t direction, const uint8_t *frame,
+   unsigned int length);
+static void mirrorFreeConfig(sr_mirror_config_t *config);
+static uint64_t mirrorNowNs(clockid_t clock);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const mirrorDirectionNames[] = { "", "in", "out", "both" };
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_mirror_create()\n
+ * @brief Reads the mirror sessions, which are read again after SIGHUP
+ *        (srReloadRequests).
+ * @param sr instance whose frames are mirrored, and out of which copies for
+ *        an interface are sent.
+ * @param path file of sessions, one per line.
+ * @return mirror state, or NULL if the file couldn't be read.
+ */
+sr_mirror_t *sr_mirror_create(struct sr_instance *sr, const char *path)
+{
+   sr_mirror_t *mirror = calloc(1, sizeof(sr_mirror_t));
+
+   assert(mirror);
+   if (strlen(path) >= sizeof(mirror->path))
+   {
+      fprintf(stderr, "%s: path too long\n", path);
+      free(mirror);
+      return NULL;
+   }
+   strcpy(mirror->path, path);
+   mirror->sr = sr;
+   mirror->config = calloc(1, sizeof(sr_mirror_config_t));
+   assert(mirror->config);
+
+   mirror->reloads = srReloadRequests;
+   if (sr_mirror_reload(mirror) != 0)
+   {
+      sr_mirror_destroy(mirror);
+      return NULL;
+   }
+   return mirror;
+}
+
+/**
+ * sr_mirror_destroy()\n
+ * @brief Frees the sessions, current and replaced, and unmaps the rings.
+ * @param mirror may be NULL.
+ * @warning No thread may be mirroring a frame.
+ */
+void sr_mirror_destroy(sr_mirror_t *mirror)
+{
+   sr_mirror_ring_map_t *map;
+
+   if (mirror == NULL)
+   {
+      return;
+   }
+
+   mirrorFreeConfig(mirror->config);
+   while ((map = mirror->rings) != NULL)
+   {
+      mirror->rings = map->next;
+      munmap(map->ring, map->size);
+      free(map);
+   }
+   free(mirror);
+}
+
+/**
+ * sr_mirror_reload()\n
+ * @brief Reads the sessions file and, if every line is good, replaces the
+ *        sessions with it.
+ * @param mirror mirror state.
+ * @return 0 on success, -1 if the file couldn't be read or a line is bad,
+ *         in which case the sessions are left as they were.
+ */
+int sr_mirror_reload(sr_mirror_t *mirror)
+{
+   FILE *in = fopen(mirror->path, "r");
+   sr_mirror_config_t *config;
+   char line[MIRROR_MAX_LINE];
+   unsigned int lineNumber = 0, i;
+   int status = 0;
+
+   if (in == NULL)
+   {
+      perror(mirror->path);
+      return -1;
+   }
+
+   config = calloc(1, sizeof(sr_mirror_config_t));
+   assert(config);
+   while ((status == 0) && fgets(line, sizeof(line), in))
+   {
+      char *start = line;
+
+      lineNumber++;
+      while (isspace((unsigned char) *start))
+      {
+         start++;
+      }
+      if ((*start == '\0') || (*start == '#'))
+      {
+         continue;
+      }
+      if (config->count == SR_MIRROR_MAX_SESSIONS)
+      {
+         fprintf(stderr, "%s:%u: more than %d sessions\n", mirror->path, lineNumber,
+            SR_MIRROR_MAX_SESSIONS);
+         status = -1;
+      }
+      else if (mirrorParseSession(mirror, start, &config->sessions[config->count]) != 0)
+      {
+         fprintf(stderr, "%s:%u: expected \"source in|out|both any|address[/length]"
+            "[:protocol[:port]] interface|ring:path bits/s\"\n", mirror->path, lineNumber);
+         status = -1;
+      }
+      else
+      {
+         config->directions |= config->sessions[config->count].directions;
+         config->count++;
+      }
+   }
+   fclose(in);
+
+   if (status != 0)
+   {
+      mirrorFreeConfig(config);
+      return -1;
+   }
+
+   for (i = 0; i < config->count; i++)
+   {
+      if (config->sessions[i].ring == NULL)
+      {
+         config->sessions[i].transmit = malloc(SR_MIRROR_TX_SLOTS * SR_MIRROR_MAX_FRAME);
+         assert(config->sessions[i].transmit);
+      }
+   }
+   config->retired = mirror->config;
+   __atomic_store_n(&mirror->config, config, __ATOMIC_RELEASE);
+   printf("Mirroring %u sessions from %s\n", config->count, mirror->path);
+   return 0;
+}
+
+/**
+ * sr_mirror_frames()\n
+ * @brief Offers a frame to every session; sr_mirror_frame() once some
+ *        session mirrors the direction.
+ */
+void sr_mirror_frames(sr_mirror_t *mirror, sr_mirror_direction_t direction,
+   const char *interface, const uint8_t *frame, unsigned int length)
+{
+   sr_mirror_config_t *config = __atomic_load_n(&mirror->config, __ATOMIC_ACQUIRE);
+   sr_mirror_session_t *session;
+   unsigned int i;
+
+   for (i = 0; i < config->count; i++)
+   {
+      session = &config->sessions[i];
+      if (!(session->directions & direction) || strcmp(session->source, interface)
+         || !sr_mirror_match_frame(&session->match, frame, length))
+      {
+         continue;
+      }
+      if (!mirrorAdmit(session, length))
+      {
+         __atomic_add_fetch(&session->capped, 1, __ATOMIC_RELAXED);
+         continue;
+      }
+
+      if (session->ring)
+      {
+         mirrorToRing(session, i, direction, frame, length);
+      }
+      else
+      {
+         mirrorToInterface(mirror, session, i, direction, frame, length);
+      }
+   }
+}
+
+/**
+ * sr_mirror_tick()\n
+ * @brief Called once a second by the timer thread: reads the sessions again
+ *        after a SIGHUP.
+ */
+void sr_mirror_tick(struct sr_instance *sr)
+{
+   sr_mirror_t *mirror = sr->mirror;
+   sig_atomic_t reloads = srReloadRequests;
+
+   if ((mirror == NULL) || (mirror->reloads == reloads))
+   {
+      return;
+   }
+   mirror->reloads = reloads;
+   sr_mirror_reload(mirror);
+}
+
+/**
+ * sr_mirror_print()\n
+ * @brief Prints each session and its counts. Does nothing if the instance
+ *        doesn't mirror.
+ */
+void sr_mirror_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_mirror_config_t *config;
+   sr_mirror_session_t *session;
+   char address[INET_ADDRSTRLEN];
+   unsigned int i;
+
+   if (sr->mirror == NULL)
+   {
+      return;
+   }
+
+   config = __atomic_load_n(&sr->mirror->config, __ATOMIC_ACQUIRE);
+   fprintf(out, "Mirroring: topology %u, %u sessions from %s\n", sr->topo_id, config->count,
+      sr->mirror->path);
+   for (i = 0; i < config->count; i++)
+   {
+      session = &config->sessions[i];
+      inet_ntop(AF_INET, &session->match.address, address, sizeof(address));
+      fprintf(out, "   %u %s %s %s/%d proto %u port %u -> %s, %" PRIu64 " bit/s: %" PRIu64
+         " frames, %" PRIu64 " bytes mirrored, %" PRIu64 " over the cap, %" PRIu64
+         " ring full\n", i, session->source, mirrorDirectionNames[session->directions], address,
+         __builtin_popcount(session->match.mask), session->match.protocol,
+         ntohs(session->match.port),
+         session->ring ? "ring" : session->destination, session->bitsPerS,
+         __atomic_load_n(&session->mirrored, __ATOMIC_RELAXED),
+         __atomic_load_n(&session->mirroredBytes, __ATOMIC_RELAXED),
+         __atomic_load_n(&session->capped, __ATOMIC_RELAXED),
+         __atomic_load_n(&session->ringFull, __ATOMIC_RELAXED));
+   }
+   fflush(out);
+}
+
+/**
+ * sr_mirror_match_parse()\n
+ * @brief Parses "any" or "address[/length][:tcp|udp|icmp[:port]]".
+ * @param text filter to parse.
+ * @param match set to the filter.
+ * @return 0 on success, -1 if text isn't a filter.
+ */
+int sr_mirror_match_parse(const char *text, sr_mirror_match_t *match)
+{
+   char address[INET_ADDRSTRLEN], protocol[8];
+   const char *colon = strchr(text, ':');
+   const char *slash = strchr(text, '/');
+   const char *addressEnd = colon ? colon : text + strlen(text);
+   unsigned long length = 32, port;
+   char *end;
+
+   memset(match, 0, sizeof(*match));
+   if (strcmp(text, "any") == 0)
+   {
+      return 0;
+   }
+
+   if (slash && (slash < addressEnd))
+   {
+      length = strtoul(slash + 1, &end, 10);
+      if ((end != addressEnd) || (length > 32))
+      {
+         return -1;
+      }
+      addressEnd = slash;
+   }
+   if ((size_t) (addressEnd - text) >= sizeof(address))
+   {
+      return -1;
+   }
+   snprintf(address, sizeof(address), "%.*s", (int) (addressEnd - text), text);
+   if (inet_pton(AF_INET, address, &match->address) != 1)
+   {
+      return -1;
+   }
+   match->mask = length ? htonl(0xFFFFFFFFU << (32 - length)) : 0;
+   match->address &= match->mask;
+
+   if (colon == NULL)
+   {
+      return 0;
+   }
+   text = colon + 1;
+   colon = strchr(text, ':');
+   snprintf(protocol, sizeof(protocol), "%.*s",
+      (int) (colon ? (size_t) (colon - text) : strlen(text)), text);
+   if (strcmp(protocol, "tcp") == 0)
+   {
+      match->protocol = ip_protocol_tcp;
+   }
+   else if (strcmp(protocol, "udp") == 0)
+   {
+      match->protocol = ip_protocol_udp;
+   }
+   else if ((strcmp(protocol, "icmp") == 0) && (colon == NULL))
+   {
+      match->protocol = ip_protocol_icmp;
+   }
+   else
+   {
+      return -1;
+   }
+
+   if (colon)
+   {
+      port = strtoul(colon + 1, &end, 10);
+      if ((*end != '\0') || (port == 0) || (port > UINT16_MAX))
+      {
+         return -1;
+      }
+      match->port = htons((uint16_t) port);
+   }
+   return 0;
+}
+
+/**
+ * sr_mirror_match_frame()\n
+ * @brief Tells whether a frame passes a filter.
+ * @param match filter from sr_mirror_match_parse().
+ * @param frame Ethernet frame.
+ * @param length of the frame in bytes.
+ * @return true if it passes.
+ */
+bool sr_mirror_match_frame(const sr_mirror_match_t *match, const uint8_t *frame,
+   unsigned int length)
+{
+   const sr_ip_hdr_t *packet = (const sr_ip_hdr_t *) (frame + sizeof(sr_ethernet_hdr_t));
+   const sr_udp_hdr_t *ports;
+   unsigned int headerLength;
+
+   if ((match->mask == 0) && (match->protocol == 0))
+   {
+      return true;
+   }
+   if ((length < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+      || (((const sr_ethernet_hdr_t *) frame)->ether_type != htons(ethertype_ip)))
+   {
+      return false;
+   }
+   if (((packet->ip_src & match->mask) != match->address)
+      && ((packet->ip_dst & match->mask) != match->address))
+   {
+      return false;
+   }
+   if (match->protocol && (packet->ip_p != match->protocol))
+   {
+      return false;
+   }
+   if (match->port == 0)
+   {
+      return true;
+   }
+
+   /* Only the first fragment has the ports. */
+   headerLength = packet->ip_hl * 4;
+   ports = (const sr_udp_hdr_t *) (((const uint8_t *) packet) + headerLength);
+   return ((ntohs(packet->ip_off) & IP_OFFMASK) == 0)
+      && (length >= sizeof(sr_ethernet_hdr_t) + headerLength + 4)
+      && ((ports->sourcePort == match->port) || (ports->destinationPort == match->port));
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/** Parses "source direction match destination rate". */
+static int mirrorParseSession(sr_mirror_t *mirror, char *line, sr_mirror_session_t *session)
+{
+   char *fields[5], *save = NULL;
+   unsigned int count, direction;
+
+   for (count = 0; count < 5; count++)
+   {
+      fields[count] = strtok_r(count ? NULL : line, " \t\r\n", &save);
+      if (fields[count] == NULL)
+      {
+         break;
+      }
+   }
+   if ((count != 5) || (strtok_r(NULL, " \t\r\n", &save) != NULL)
+      || (strlen(fields[0]) >= sizeof(session->source)))
+   {
+      return -1;
+   }
+
+   memset(session, 0, sizeof(*session));
+   strcpy(session->source, fields[0]);
+   for (direction = SR_MIRROR_IN; direction <= SR_MIRROR_BOTH; direction++)
+   {
+      if (strcmp(fields[1], mirrorDirectionNames[direction]) == 0)
+      {
+         session->directions = direction;
+      }
+   }
+   if ((session->directions == 0) || (sr_mirror_match_parse(fields[2], &session->match) != 0)
+      || (mirrorParseRate(fields[4], &session->bitsPerS) != 0))
+   {
+      return -1;
+   }
+
+   if (strncmp(fields[3], MIRROR_RING_PREFIX, strlen(MIRROR_RING_PREFIX)) == 0)
+   {
+      session->ring = mirrorMapRing(mirror, fields[3] + strlen(MIRROR_RING_PREFIX));
+      return (session->ring == NULL) ? -1 : 0;
+   }
+   if (strlen(fields[3]) >= sizeof(session->destination))
+   {
+      return -1;
+   }
+   strcpy(session->destination, fields[3]);
+   return 0;
+}
+
+/** Parses bits/s with an optional k, m or g suffix. */
+static int mirrorParseRate(const char *rate, uint64_t *bitsPerS)
+{
+   char *end;
+   unsigned long long value = strtoull(rate, &end, 10);
+
+   switch (tolower((unsigned char) *end))
+   {
+      case 'g':
+         value *= 1000;
+         /* fall through */
+      case 'm':
+         value *= 1000;
+         /* fall through */
+      case 'k':
+         value *= 1000;
+         end++;
+         break;
+      default:
+         break;
+   }
+   if ((end == rate) || (*end != '\0') || (value == 0))
+   {
+      return -1;
+   }
+   *bitsPerS = value;
+   return 0;
+}
+
+/**
+ * mirrorMapRing()\n
+ * @brief Maps the ring at path, creating it, unless it already is.
+ * @return the ring, or NULL if the file couldn't be created or mapped.
+ */
+static sr_mirror_ring_t *mirrorMapRing(sr_mirror_t *mirror, const char *path)
+{
+   sr_mirror_ring_map_t *map;
+   sr_mirror_ring_t *ring;
+   size_t size = sizeof(sr_mirror_ring_t) + SR_MIRROR_RING_SLOTS * sizeof(sr_mirror_slot_t);
+   unsigned int i;
+   int fd;
+
+   for (map = mirror->rings; map; map = map->next)
+   {
+      if (strcmp(map->path, path) == 0)
+      {
+         return map->ring;
+      }
+   }
+   if (strlen(path) >= sizeof(map->path))
+   {
+      return NULL;
+   }
+
+   fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if ((fd < 0) || (ftruncate(fd, size) != 0))
+   {
+      perror(path);
+      if (fd >= 0)
+      {
+         close(fd);
+      }
+      return NULL;
+   }
+   ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (ring == MAP_FAILED)
+   {
+      perror(path);
+      return NULL;
+   }
+
+   ring->version = SR_MIRROR_RING_VERSION;
+   ring->slotCount = SR_MIRROR_RING_SLOTS;
+   ring->slotSize = sizeof(sr_mirror_slot_t);
+   for (i = 0; i < SR_MIRROR_RING_SLOTS; i++)
+   {
+      ring->slots[i].sequence = i;
+   }
+   /* A capture process waits for the magic. */
+   __atomic_store_n(&ring->magic, SR_MIRROR_RING_MAGIC, __ATOMIC_RELEASE);
+
+   map = calloc(1, sizeof(sr_mirror_ring_map_t));
+   assert(map);
+   strcpy(map->path, path);
+   map->ring = ring;
+   map->size = size;
+   map->next = mirror->rings;
+   mirror->rings = map;
+   return ring;
+}
+
+/** Charges a frame to the session's cap, if the cap has room for it. */
+static bool mirrorAdmit(sr_mirror_session_t *session, unsigned int length)
+{
+   uint64_t costNs = (uint64_t) length * 8 * MIRROR_NS_PER_S / session->bitsPerS;
+   uint64_t nowNs = mirrorNowNs(CLOCK_MONOTONIC);
+   uint64_t fullAtNs = __atomic_load_n(&session->fullAtNs, __ATOMIC_RELAXED);
+   uint64_t startNs;
+
+   do
+   {
+      startNs = (fullAtNs > nowNs) ? fullAtNs : nowNs;
+      if (startNs + costNs - nowNs > MIRROR_BURST_NS)
+      {
+         return false;
+      }
+   } while (!__atomic_compare_exchange_n(&session->fullAtNs, &fullAtNs, startNs + costNs, true,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+   return true;
+}
+
+/** Copies a frame into the session's ring, or counts it if the ring is full. */
+static void mirrorToRing(sr_mirror_session_t *session, uint8_t sessionIndex,
+   sr_mirror_direction_t direction, const uint8_t *frame, unsigned int length)
+{
+   sr_mirror_ring_t *ring = session->ring;
+   sr_mirror_slot_t *slot;
+   uint64_t position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+   uint64_t sequence;
+
+   while (1)
+   {
+      slot = &ring->slots[position % SR_MIRROR_RING_SLOTS];
+      sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+      if (sequence == position)
+      {
+         if (__atomic_compare_exchange_n(&ring->head, &position, position + 1, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            break;
+         }
+      }
+      else if (sequence < position)
+      {
+         /* The reader hasn't given this slot back from the last lap. */
+         __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&session->ringFull, 1, __ATOMIC_RELAXED);
+         return;
+      }
+      else
+      {
+         position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+      }
+   }
+
+   slot->timestampNs = mirrorNowNs(CLOCK_REALTIME);
+   slot->length = length;
+   slot->captured = (length < SR_MIRROR_RING_SNAPLEN) ? length : SR_MIRROR_RING_SNAPLEN;
+   slot->session = sessionIndex;
+   slot->direction = direction;
+   memcpy(slot->data, frame, slot->captured);
+   __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+
+   __atomic_add_fetch(&session->mirrored, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&session->mirroredBytes, length, __ATOMIC_RELAXED);
+}
+
+/** Sends a copy of a frame, with the mirror header, out of the session's interface. */
+static void mirrorToInterface(sr_mirror_t *mirror, sr_mirror_session_t *session,
+   uint8_t sessionIndex, sr_mirror_direction_t direction, const uint8_t *frame,
+   unsigned int length)
+{
+   const unsigned int room = SR_MIRROR_MAX_FRAME - sizeof(sr_ethernet_hdr_t)
+      - sizeof(sr_mirror_encap_hdr_t);
+   unsigned int slot = __atomic_fetch_add(&session->nextTransmit, 1, __ATOMIC_RELAXED);
+   uint8_t *copy = session->transmit[slot % SR_MIRROR_TX_SLOTS];
+   sr_ethernet_hdr_t *ethernetHeader = (sr_ethernet_hdr_t *) copy;
+   sr_mirror_encap_hdr_t *header = (sr_mirror_encap_hdr_t *) (ethernetHeader + 1);
+   unsigned int captured = (length < room) ? length : room;
+   struct sr_if *interface = sr_get_interface(mirror->sr, session->destination);
+
+   if (interface == NULL)
+   {
+      return;
+   }
+
+   memset(ethernetHeader->ether_dhost, 0xFF, ETHER_ADDR_LEN);
+   memcpy(ethernetHeader->ether_shost, interface->addr, ETHER_ADDR_LEN);
+   ethernetHeader->ether_type = htons(SR_MIRROR_ETHERTYPE);
+   header->version = SR_MIRROR_RING_VERSION;
+   header->session = sessionIndex;
+   header->direction = direction;
+   header->truncated = (captured < length);
+   header->length = htonl(length);
+   memcpy(header + 1, frame, captured);
+
+   sr_send_packet(mirror->sr, copy, sizeof(sr_ethernet_hdr_t) + sizeof(sr_mirror_encap_hdr_t)
+      + captured, session->destination);
+   __atomic_add_fetch(&session->mirrored, 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&session->mirroredBytes, length, __ATOMIC_RELAXED);
+}
+
+/** Frees a set of sessions and every set it replaced. */
+static void mirrorFreeConfig(sr_mirror_config_t *config)
+{
+   sr_mirror_config_t *retired;
+   unsigned int i;
+
+   while (config)
+   {
+      retired = config->retired;
+      for (i = 0; i < config->count; i++)
+      {
+         free(config->sessions[i].transmit);
+      }
+      free(config);
+      config = retired;
+   }
+}
+
+static uint64_t mirrorNowNs(clockid_t clock)
+{
+   struct timespec now;
+
+   clock_gettime(clock, &now);
+   return (uint64_t) now.tv_sec * MIRROR_NS_PER_S + now.tv_nsec;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file sr_mirror.h
+ * @brief Port mirroring: copies of the frames of an interface, or of one
+ *        flow, sent to an analyzer.
+ *
+ * Mirror sessions are read from a file at start-up and again on SIGHUP, so
+ * they can be changed while the router runs. Each line of the file is
+ *
+ *    source direction match destination rate
+ *
+ * source is an interface; direction is in, out or both; match is "any" or
+ * address[/length][:tcp|udp|icmp[:port]], matching frames with the address
+ * (or one in the prefix) as source or destination, and the port as either
+ * port; rate caps the session's copies in bits/s, with k, m or g suffixes.
+ * The destination is either
+ *    - another interface, out of which the copy is sent inside an Ethernet
+ *      frame of type SR_MIRROR_ETHERTYPE with a short header in front
+ *      (sr_mirror_encap_hdr_t), truncated to fit a frame; or
+ *    - "ring:path", a ring of SR_MIRROR_RING_SLOTS slots in a file mapped
+ *      shared, read by a capture process (tools/mirror_capture writes it to
+ *      a pcap file). Sessions naming the same path share the ring.
+ *
+ * A frame is copied once, straight into a ring slot or into one of the
+ * session's preallocated transmit buffers; nothing is allocated per frame.
+ * The ring takes several writers and one reader without locks: a writer
+ * claims a slot by advancing the head with compare-and-swap once the
+ * reader has given the slot back, and publishes it by setting its sequence.
+ * Frames over the cap, or that find the ring full, are dropped and counted.
+ * A token bucket holding one second's worth enforces the cap, kept as the
+ * time at which it would be full again, as the policer's are.
+ *
+ * Sessions are replaced as a whole on reload. Frames being mirrored may
+ * still be reading the old sessions, so they are kept until the router
+ * stops, as are rings no longer named.
+ */
+
+#ifndef SR_MIRROR_H
+#define SR_MIRROR_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "sr_protocol.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_MIRROR_MAX_SESSIONS      (8)
+#define SR_MIRROR_MAX_PATH          (256)
+#define SR_MIRROR_MAX_FRAME         (1514) /**< Of a copy sent out of an interface. */
+#define SR_MIRROR_TX_SLOTS          (16) /**< Transmit buffers per session. */
+#define SR_MIRROR_ETHERTYPE         (0x88B5) /**< IEEE 802 local experimental. */
+#define SR_MIRROR_RING_MAGIC        (0x53524D52) /* "SRMR" */
+#define SR_MIRROR_RING_VERSION      (1)
+#define SR_MIRROR_RING_SLOTS        (4096)
+#define SR_MIRROR_RING_SNAPLEN      (1600) /**< Bytes of a frame a ring slot holds. */
+#define SR_MIRROR_CACHE_LINE        (64)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef enum
+{
+   SR_MIRROR_IN = 1,
+   SR_MIRROR_OUT = 2,
+   SR_MIRROR_BOTH = SR_MIRROR_IN | SR_MIRROR_OUT
+} sr_mirror_direction_t;
+
+/** In front of a copy sent out of an interface. */
+typedef struct __attribute__((packed))
+{
+   uint8_t version; /**< SR_MIRROR_RING_VERSION */
+   uint8_t session; /**< Line of the session, from 0. */
+   uint8_t direction; /**< SR_MIRROR_IN or SR_MIRROR_OUT */
+   uint8_t truncated; /**< 1 if the frame didn't fit. */
+   uint32_t length; /**< Of the frame mirrored, network byte order. */
+} sr_mirror_encap_hdr_t;
+
+/** A ring slot. */
+typedef struct
+{
+   uint64_t sequence; /**< Position + 1 once written; position + slots once read. */
+   uint64_t timestampNs; /**< Wall clock. */
+   uint32_t length; /**< Of the frame. */
+   uint32_t captured; /**< Bytes in data. */
+   uint8_t session;
+   uint8_t direction;
+   uint8_t data[SR_MIRROR_RING_SNAPLEN];
+} sr_mirror_slot_t;
+
+/** Start of a ring file, followed by its slots. */
+typedef struct
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t slotCount;
+   uint32_t slotSize;
+   uint64_t head __attribute__((aligned(SR_MIRROR_CACHE_LINE))); /**< Next slot to write. */
+   uint64_t dropped; /**< Frames that found the ring full. */
+   uint64_t tail __attribute__((aligned(SR_MIRROR_CACHE_LINE))); /**< Next slot to read. */
+   sr_mirror_slot_t slots[] __attribute__((aligned(SR_MIRROR_CACHE_LINE)));
+} sr_mirror_ring_t;
+
+/** Which frames a session takes; also used by traces (sr_trace.h). */
+typedef struct
+{
+   uint32_t address; /**< Network byte order; with mask 0, any frame. */
+   uint32_t mask;
+   uint8_t protocol; /**< 0: any. */
+   uint16_t port; /**< Network byte order; 0: any. */
+} sr_mirror_match_t;
+
+typedef struct sr_mirror_ring_map
+{
+   char path[SR_MIRROR_MAX_PATH];
+   sr_mirror_ring_t *ring;
+   size_t size;
+   struct sr_mirror_ring_map *next;
+} sr_mirror_ring_map_t;
+
+typedef struct
+{
+   /* What is mirrored */
+   char source[sr_IFACE_NAMELEN];
+   uint8_t directions; /**< sr_mirror_direction_t */
+   sr_mirror_match_t match;
+
+   /* Where to */
+   char destination[sr_IFACE_NAMELEN]; /**< Empty for a ring. */
+   sr_mirror_ring_t *ring;
+   uint8_t (*transmit)[SR_MIRROR_MAX_FRAME]; /**< SR_MIRROR_TX_SLOTS buffers. */
+   unsigned int nextTransmit;
+
+   uint64_t bitsPerS;
+   uint64_t fullAtNs; /**< Cap bucket. */
+
+   uint64_t mirrored;
+   uint64_t mirroredBytes;
+   uint64_t capped; /**< Dropped over the cap. */
+   uint64_t ringFull;
+} sr_mirror_session_t;
+
+typedef struct sr_mirror_config
+{
+   sr_mirror_session_t sessions[SR_MIRROR_MAX_SESSIONS];
+   unsigned int count;
+   uint8_t directions; /**< Of all sessions. */
+   struct sr_mirror_config *retired; /**< Replaced before this one. */
+} sr_mirror_config_t;
+
+typedef struct sr_mirror
+{
+   sr_mirror_config_t *config;
+   struct sr_instance *sr;
+   char path[SR_MIRROR_MAX_PATH];
+   sr_mirror_ring_map_t *rings;
+   sig_atomic_t reloads; /**< srReloadRequests when last read. */
+} sr_mirror_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_mirror_t *sr_mirror_create(struct sr_instance *sr, const char *path);
+void sr_mirror_destroy(sr_mirror_t *mirror);
+int sr_mirror_reload(sr_mirror_t *mirror);
+void sr_mirror_frames(sr_mirror_t *mirror, sr_mirror_direction_t direction,
+   const char *interface, const uint8_t *frame, unsigned int length);
+void sr_mirror_tick(struct sr_instance *sr);
+void sr_mirror_print(const struct sr_instance *sr, FILE *out);
+int sr_mirror_match_parse(const char *text, sr_mirror_match_t *match);
+bool sr_mirror_match_frame(const sr_mirror_match_t *match, const uint8_t *frame,
+   unsigned int length);
+
+/*
+ * Inline Function Definitions
+ */
+
+/**
+ * Mirrors a frame received on or sent out of an interface, if a session
+ * wants it.
+ * @param mirror may be NULL, in which case nothing is done.
+ */
+static inline void sr_mirror_frame(sr_mirror_t *mirror, sr_mirror_direction_t direction,
+   const char *interface, const uint8_t *frame, unsigned int length)
+{
+   if (mirror
+      && (__atomic_load_n(&mirror->config, __ATOMIC_ACQUIRE)->directions & direction))
+   {
+      sr_mirror_frames(mirror, direction, interface, frame, length);
+   }
+}
+
+/**
+ * Takes the next frame from a ring, for a capture process.
+ * @return the slot, or NULL if the ring is empty. Hand it back with
+ *         sr_mirror_ring_release().
+ */
+static inline const sr_mirror_slot_t *sr_mirror_ring_next(sr_mirror_ring_t *ring)
+{
+   sr_mirror_slot_t *slot = &ring->slots[ring->tail % ring->slotCount];
+
+   if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->tail + 1)
+   {
+      return NULL;
+   }
+   return slot;
+}
+
+static inline void sr_mirror_ring_release(sr_mirror_ring_t *ring, const sr_mirror_slot_t *slot)
+{
+   sr_mirror_slot_t *writable = &ring->slots[ring->tail % ring->slotCount];
+
+   (void) slot;
+   __atomic_store_n(&writable->sequence, ring->tail + ring->slotCount, __ATOMIC_RELEASE);
+   __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* SR_MIRROR_H */
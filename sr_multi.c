@@ -0,0 +1,372 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sr_multi.h"
+#include "sr_router.h"
+#include "sr_clock.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+#include "sr_vns_reader.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define MULTI_TICK_INTERVAL_S    (1)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Macros
+ *-----------------------------------------------------------------------------
+ */
+
+#ifdef DONT_DEFINE_UNLESS_DEBUGGING
+# define LOG_MESSAGE(...) fprintf(stderr, __VA_ARGS__)
+#else
+# define LOG_MESSAGE(...)
+#endif
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *multiTimerThread(void *multi_ptr);
+static void multiTrustedTick(sr_multi_t *multi);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_multi_init()\n
+ * @brief Initializes an empty set of router instances and, optionally,
+ *        starts the shared timer thread.
+ * @param multi pointer to the structure to initialize.
+ * @param startTimer false if the caller drives sr_multi_tick() itself (e.g.
+ *        from a simulated clock).
+ * @return 0 on success, -1 on error.
+ */
+int sr_multi_init(sr_multi_t *multi, bool startTimer)
+{
+   assert(multi);
+
+   multi->instances = malloc(SR_MULTI_INITIAL_CAPACITY * sizeof(struct sr_instance *));
+   if (multi->instances == NULL)
+   {
+      return -1;
+   }
+   multi->count = 0;
+   multi->capacity = SR_MULTI_INITIAL_CAPACITY;
+   multi->stopRequested = false;
+   multi->timerRunning = false;
+
+   pthread_mutex_init(&multi->lock, NULL);
+
+   if (startTimer)
+   {
+      multi->timerRunning = (pthread_create(&multi->timerThread, NULL, multiTimerThread, multi) == 0);
+      if (!multi->timerRunning)
+      {
+         perror("pthread_create(..):sr_multi_init");
+         pthread_mutex_destroy(&multi->lock);
+         free(multi->instances);
+         return -1;
+      }
+      sr_sched_apply(multi->timerThread, SR_SCHED_TIMER);
+   }
+
+   return 0;
+}
+
+/**
+ * sr_multi_destroy()\n
+ * @brief Stops the shared timer thread and releases the instance list.
+ * @param multi pointer to the multi-instance state.
+ * @note The instances themselves belong to the caller.
+ */
+void sr_multi_destroy(sr_multi_t *multi)
+{
+   assert(multi);
+
+   pthread_mutex_lock(&multi->lock);
+   multi->stopRequested = true;
+   pthread_mutex_unlock(&multi->lock);
+
+   if (multi->timerRunning)
+   {
+      pthread_join(multi->timerThread, NULL);
+      multi->timerRunning = false;
+   }
+
+   pthread_mutex_destroy(&multi->lock);
+   free(multi->instances);
+   multi->instances = NULL;
+   multi->count = 0;
+}
+
+/**
+ * sr_multi_add()\n
+ * @brief Registers an initialized router instance with the shared threads.
+ * @param multi pointer to the multi-instance state.
+ * @param sr pointer to the instance. sr->multi must already point at multi.
+ * @return 0 on success, -1 on error.
+ */
+int sr_multi_add(sr_multi_t *multi, struct sr_instance *sr)
+{
+   int result = 0;
+
+   assert(multi);
+   assert(sr);
+   assert(sr->multi == multi);
+
+   pthread_mutex_lock(&multi->lock);
+
+   if (multi->count == multi->capacity)
+   {
+      struct sr_instance **grown = realloc(multi->instances,
+         2 * multi->capacity * sizeof(struct sr_instance *));
+      if (grown == NULL)
+      {
+         result = -1;
+      }
+      else
+      {
+         multi->instances = grown;
+         multi->capacity *= 2;
+      }
+   }
+
+   if (result == 0)
+   {
+      multi->instances[multi->count++] = sr;
+   }
+
+   pthread_mutex_unlock(&multi->lock);
+
+   return result;
+}
+
+/**
+ * sr_multi_tick()\n
+ * @brief Runs one second's worth of ARP and NAT timeouts for every instance.
+ * @param multi pointer to the multi-instance state.
+ * @note Called by the shared timer thread. Exposed for tests and benchmarks.
+ */
+void sr_multi_tick(sr_multi_t *multi)
+{
+   pthread_mutex_lock(&multi->lock);
+   multiTrustedTick(multi);
+   pthread_mutex_unlock(&multi->lock);
+}
+
+/**
+ * sr_multi_advance()\n
+ * @brief Moves the virtual clock forward, ticking every instance after each
+ *        second, as the timer thread would have.
+ * @param multi pointer to multi-instance state without a timer thread.
+ * @param seconds virtual seconds to run.
+ * @note Requires sr_clock_use_virtual(). Timers fire on the calling thread
+ *       before this returns.
+ */
+void sr_multi_advance(sr_multi_t *multi, unsigned int seconds)
+{
+   unsigned int i;
+
+   assert(multi);
+   assert(!multi->timerRunning);
+   assert(sr_clock_is_virtual());
+
+   pthread_mutex_lock(&multi->lock);
+   for (i = 0; i < seconds; i += MULTI_TICK_INTERVAL_S)
+   {
+      sr_clock_advance(MULTI_TICK_INTERVAL_S);
+      multiTrustedTick(multi);
+   }
+   pthread_mutex_unlock(&multi->lock);
+}
+
+/**
+ * sr_multi_run()\n
+ * @brief Services every instance's VNS session from the calling thread.
+ * @param multi pointer to the multi-instance state.
+ * @return 0 once every session has closed or a shutdown was requested,
+ *         -1 on error.
+ * @note Reads whole commands, one instance at a time, as each socket
+ *       becomes readable. Every instance reads through a non-blocking
+ *       adaptive reader (one is created for instances without, and freed
+ *       with the instance), so a session that has sent only part of a
+ *       command is left for the next poll instead of stalling the others.
+ *       An instance whose session fails is closed without affecting the
+ *       others.
+ */
+int sr_multi_run(sr_multi_t *multi)
+{
+   struct pollfd *descriptors;
+   unsigned int active;
+   unsigned int i;
+   int result = 0;
+   int status;
+
+   assert(multi);
+
+   descriptors = calloc(multi->count, sizeof(struct pollfd));
+   if ((descriptors == NULL) && (multi->count > 0))
+   {
+      return -1;
+   }
+
+   active = 0;
+   for (i = 0; i < multi->count; i++)
+   {
+      struct sr_instance *sr = multi->instances[i];
+
+      if (sr->reader == NULL)
+      {
+         sr->reader = sr_vns_reader_create(0);
+         if (sr->reader == NULL)
+         {
+            free(descriptors);
+            return -1;
+         }
+      }
+      sr_vns_reader_set_nonblocking(sr->reader, true);
+
+      if (sr->sockfd >= 0)
+      {
+         active++;
+      }
+   }
+
+   while ((active > 0) && !srShutdownRequested)
+   {
+      if (srStatsRequested)
+      {
+         srStatsRequested = 0;
+         for (i = 0; i < multi->count; i++)
+         {
+            sr_router_print(multi->instances[i], stdout);
+         }
+         sr_watchdog_print(stdout);
+      }
+
+      for (i = 0; i < multi->count; i++)
+      {
+         /* poll() skips negative descriptors. */
+         descriptors[i].fd = multi->instances[i]->sockfd;
+         descriptors[i].events = POLLIN;
+         descriptors[i].revents = 0;
+      }
+
+      sr_watchdog_idle();
+      if (poll(descriptors, multi->count, -1) < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         perror("poll(..):sr_multi_run");
+         result = -1;
+         break;
+      }
+
+      for (i = 0; (i < multi->count) && !srShutdownRequested; i++)
+      {
+         struct sr_instance *sr = multi->instances[i];
+
+         if ((descriptors[i].fd < 0) || (descriptors[i].revents == 0))
+         {
+            continue;
+         }
+
+         /* poll() can't see commands the adaptive reader has read ahead. */
+         do
+         {
+            status = sr_read_from_server(sr);
+         } while ((status == 1) && sr_vns_reader_has_message(sr->reader) && !srShutdownRequested);
+
+         if (status != 1)
+         {
+            if (srShutdownRequested)
+            {
+               break;
+            }
+
+            fprintf(stderr, "Session for topology %u closed.\n", sr->topo_id);
+            close(sr->sockfd);
+            sr->sockfd = -1;
+            active--;
+         }
+      }
+   }
+
+   free(descriptors);
+
+   return result;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * multiTimerThread()\n
+ * @brief Shared replacement for every instance's ARP and NAT timeout threads.
+ * @param multi_ptr pointer to the multi-instance state.
+ */
+static void *multiTimerThread(void *multi_ptr)
+{
+   sr_multi_t *multi = (sr_multi_t *) multi_ptr;
+
+   sr_watchdog_register("timer");
+   pthread_mutex_lock(&multi->lock);
+   while (!multi->stopRequested)
+   {
+      pthread_mutex_unlock(&multi->lock);
+      sr_watchdog_idle();
+      sleep(MULTI_TICK_INTERVAL_S);
+      pthread_mutex_lock(&multi->lock);
+
+      if (!multi->stopRequested)
+      {
+         multiTrustedTick(multi);
+      }
+   }
+   pthread_mutex_unlock(&multi->lock);
+   sr_watchdog_unregister();
+
+   return NULL;
+}
+
+/**
+ * multiTrustedTick()\n
+ * @brief Ticks every registered instance.
+ * @param multi pointer to the multi-instance state.
+ * @warning Assumes the multi-instance lock is held.
+ */
+static void multiTrustedTick(sr_multi_t *multi)
+{
+   unsigned int i;
+
+   for (i = 0; i < multi->count; i++)
+   {
+      sr_router_tick(multi->instances[i]);
+   }
+}
@@ -0,0 +1,67 @@
+/**
+ * @file sr_multi.h
+ * @brief Hosts several virtual routers in one process.
+ *
+ * Each router is a complete sr_instance with its own VNS session,
+ * interfaces, routing table, ARP cache and NAT table; nothing mutable is
+ * shared between instances. What is shared is the machinery: one thread
+ * services every instance's VNS socket (and its receive buffer), and one
+ * timer thread runs the once-a-second ARP and NAT timeouts for all of them
+ * instead of two threads per router.
+ *
+ * Set sr->multi before sr_init() (so the instance does not start its own ARP
+ * thread) and before initializing the NAT with sr_nat_init_state(), then
+ * register the instance with sr_multi_add() once it is initialized.
+ *
+ * Without the timer thread, the caller drives the timeouts: sr_multi_tick()
+ * on its own schedule, or sr_multi_advance() under the virtual clock
+ * (sr_clock.h).
+ */
+
+#ifndef SR_MULTI_H
+#define SR_MULTI_H
+
+/*
+ * Include Files
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_MULTI_INITIAL_CAPACITY   (8)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef struct sr_multi
+{
+   struct sr_instance **instances;
+   unsigned int count;
+   unsigned int capacity;
+
+   /* threading */
+   bool stopRequested;
+   bool timerRunning;
+   pthread_mutex_t lock;
+   pthread_t timerThread;
+} sr_multi_t;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_multi_init(sr_multi_t *multi, bool startTimer);
+void sr_multi_destroy(sr_multi_t *multi);
+int sr_multi_add(sr_multi_t *multi, struct sr_instance *sr);
+void sr_multi_tick(sr_multi_t *multi);
+void sr_multi_advance(sr_multi_t *multi, unsigned int seconds);
+int sr_multi_run(sr_multi_t *multi);
+
+#endif /* SR_MULTI_H */
@@ -11,11 +11,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "sr_nat.h"
+#include "sr_flow.h"
+#include "sr_nat_sync.h"
+#include "sr_natlog.h"
+#include "sr_policer.h"
+#include "sr_probe.h"
 #include "sr_protocol.h"
 #include "sr_router.h"
 #include "sr_utils.h"
+#include "sr_clock.h"
+#include "sr_sched.h"
+#include "sr_trace.h"
+#include "sr_watchdog.h"
 
 /*
  *-----------------------------------------------------------------------------
@@ -32,7 +42,8 @@
 #ifdef DONT_DEFINE_UNLESS_DEBUGGING
 # define LOG_MESSAGE(...) fprintf(stderr, __VA_ARGS__)
 #else 
-# define LOG_MESSAGE(...)
+/* Kept in the trace of the packet being handled, if it is traced. */
+# define LOG_MESSAGE(...) SR_TRACE(SR_TRACE_NAT, __VA_ARGS__)
 #endif
 
 /*
@@ -47,7 +58,11 @@
  *-----------------------------------------------------------------------------
  */
 
-static const char internalInterfaceName[] = "eth1";
+/** Indexed by sr_nat_tcp_conn_state_t, for traces. */
+static const char * const natConnectionStateNames[] =
+{
+   "outbound SYN", "inbound SYN pending", "connected", "time wait", "closed"
+};
 
 /*
  *-----------------------------------------------------------------------------
@@ -60,14 +75,29 @@ static const char internalInterfaceName[] = "eth1";
  * Description:\n
  *    From assignment web page: For this assignment, interface "eth1" will 
  *    always be the internal interface and all other interfaces will always 
- *    be external interfaces.
+ *    be external interfaces. The name is held in the NAT state so every 
+ *    router instance in the process has its own.
  * @brief Returns the interface pointer for the internal NAT interface.
  * @param sr pointer to simple router state structure.
  * @return pointer to the internal router interface. 
  */
 static inline sr_if_t* getInternalInterface(sr_instance_t *sr)
 {
-   return sr_get_interface(sr, internalInterfaceName);
+   return sr_get_interface(sr, sr->nat->internalInterfaceName);
+}
+
+/**
+ * natSyncRecord()\n
+ * @brief Hands a NAT table change to the replication subsystem, if enabled.
+ * @warning Assumes the NAT structure is locked.
+ */
+static inline void natSyncRecord(sr_nat_t *nat, sr_nat_sync_op_t op, const sr_nat_mapping_t *mapping,
+   const sr_nat_connection_t *connection)
+{
+   if (nat->sync)
+   {
+      NatSyncTrustedRecord(nat->sync, op, mapping, connection);
+   }
 }
 
 /*
@@ -76,10 +106,46 @@ static inline sr_if_t* getInternalInterface(sr_instance_t *sr)
  *-----------------------------------------------------------------------------
  */
 
+/** Counts a packet a connection carried, for flow export. */
+static inline void natFlowCount(sr_nat_connection_t *connection, sr_nat_conn_endpoint_t from,
+   unsigned int length)
+{
+   connection->packets[from]++;
+   connection->bytes[from] += length;
+}
+
+/** Moves a connection to a new state, noting it in the packet's trace. */
+static inline void natSetConnectionState(sr_nat_connection_t *connection,
+   sr_nat_tcp_conn_state_t state)
+{
+   SR_TRACE(SR_TRACE_NAT, "connection with " SR_TRACE_IP_FORMAT ":%u: %s -> %s",
+      SR_TRACE_IP(connection->external.ipAddress), ntohs(connection->external.portNumber),
+      natConnectionStateNames[connection->connectionState], natConnectionStateNames[state]);
+   SR_PROBE4(nat_conn_state, connection->external.ipAddress, connection->external.portNumber,
+      (int) connection->connectionState, (int) state);
+   connection->connectionState = state;
+}
+
 static void sr_nat_destroy_mapping(sr_nat_t* nat, sr_nat_mapping_t* natMapping);
-static void sr_nat_destroy_connection(sr_nat_mapping_t* natMapping, sr_nat_connection_t* connection);
+static void sr_nat_destroy_connection(sr_nat_t* nat, sr_nat_mapping_t* natMapping,
+   sr_nat_connection_t* connection);
 
 static uint16_t natNextMappingNumber(sr_nat_t* nat, sr_nat_mapping_type mappingType);
+static uint16_t natNextBlockPort(sr_nat_t *nat, sr_nat_mapping_type mappingType, uint32_t ip_int);
+static uint16_t natNextDeterministicPort(sr_nat_t *nat, sr_nat_mapping_type mappingType,
+   uint32_t ip_int);
+static void natIndexDeterministic(sr_nat_t *nat, sr_nat_mapping_t *mapping, bool added);
+static sr_nat_port_block_t *natPortBlock(sr_nat_t *nat, const sr_nat_mapping_t *mapping);
+static void natLogMapping(sr_nat_t *nat, const sr_nat_mapping_t *mapping, sr_natlog_event_t event);
+static void natLogPortBlock(sr_nat_t *nat, sr_nat_mapping_type type, const sr_nat_port_block_t *block,
+   sr_natlog_event_t event);
+static void natLogPush(sr_nat_t *nat, sr_natlog_record_t *record);
+static uint32_t natLogExternalIp(sr_nat_t *nat);
+static void natFlowExport(sr_nat_t *nat, const sr_nat_mapping_t *mapping,
+   sr_nat_connection_t *connection, sr_flow_end_reason_t reason);
+static sr_if_t *natHairpinInterface(sr_instance_t *sr, uint32_t ip_dst);
+static bool natIsHairpinPacket(sr_instance_t *sr, const sr_ip_hdr_t *ipPacket, uint16_t aux_ext,
+   sr_nat_mapping_type mappingType);
 
 static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet, 
    unsigned int length, const struct sr_if* const receivedInterface, sr_nat_mapping_t * natMapping);
@@ -99,6 +165,12 @@ static sr_nat_mapping_t * natTrustedCreateMapping(sr_nat_t *nat, uint32_t ip_int
    sr_nat_mapping_type type);
 static sr_nat_connection_t * natTrustedFindConnection(sr_nat_mapping_t *natEntry, uint32_t ip_ext, 
    uint16_t port_ext);
+static sr_nat_mapping_t * natLookupOutboundTcp(sr_nat_t *nat, const sr_ip_hdr_t *ipPacket,
+   unsigned int length);
+static void natTrustedTrackTeardown(sr_nat_t *nat, sr_nat_mapping_t *mapping,
+   sr_nat_connection_t *connection, sr_ip_hdr_t *ipPacket, unsigned int length,
+   sr_nat_conn_endpoint_t sender);
+static void natSamplePortUse(sr_nat_t *nat);
 
 static void natRecalculateTcpChecksum(sr_ip_hdr_t * tcpPacket, unsigned int length);
 
@@ -110,7 +182,7 @@ static void natRecalculateTcpChecksum(sr_ip_hdr_t * tcpPacket, unsigned int leng
 
 /**
  * sr_nat_init()\n
- * @brief Initializes the NAT state machine.
+ * @brief Initializes the NAT state machine and starts its timeout thread.
  * @param nat pointer to the NAT state structure for initialization.
  * @return status value of creating the NAT's mutex object.
  * @note command line NAT options are deferred to the main routine.
@@ -118,12 +190,7 @@ static void natRecalculateTcpChecksum(sr_ip_hdr_t * tcpPacket, unsigned int leng
 int sr_nat_init(struct sr_nat *nat)
 { /* Initializes the nat */
    
-   assert(nat);
-   
-   /* Acquire mutex lock */
-   pthread_mutexattr_init(&(nat->attr));
-   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
-   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
+   int success = sr_nat_init_state(nat);
    
    /* Initialize timeout thread */
 
@@ -132,6 +199,27 @@ int sr_nat_init(struct sr_nat *nat)
    pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
    pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
    pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, nat);
+   sr_sched_apply(nat->thread, SR_SCHED_TIMER);
+   nat->hasTimeoutThread = true;
+
+   return success;
+}
+
+/**
+ * sr_nat_init_state()\n
+ * @brief Initializes the NAT state machine without starting a timeout thread.
+ * @param nat pointer to the NAT state structure for initialization.
+ * @return status value of creating the NAT's mutex object.
+ * @note The caller is responsible for calling sr_nat_tick() once a second.
+ */
+int sr_nat_init_state(struct sr_nat *nat)
+{
+   assert(nat);
+   
+   /* Acquire mutex lock */
+   pthread_mutexattr_init(&(nat->attr));
+   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
+   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
    
    /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
@@ -140,6 +228,25 @@ int sr_nat_init(struct sr_nat *nat)
    
    nat->nextIcmpIdentNumber = STARTING_PORT_NUMBER;
    nat->nextTcpPortNumber = STARTING_PORT_NUMBER;
+   
+   /* From assignment web page: interface "eth1" will always be the internal 
+    * interface. Kept per instance so routers sharing a process can differ. */
+   strncpy(nat->internalInterfaceName, DEFAULT_INTERNAL_INTERFACE_NAME, sr_IFACE_NAMELEN);
+   nat->internalInterfaceName[sr_IFACE_NAMELEN - 1] = '\0';
+   
+   nat->sync = NULL;
+   nat->policer = NULL;
+   nat->log = NULL;
+   nat->logExternalIp = 0;
+   nat->portBlockSize = 0;
+   nat->portBlockCount = 0;
+   memset(nat->portBlocks, 0, sizeof(nat->portBlocks));
+   memset(nat->nextPortBlock, 0, sizeof(nat->nextPortBlock));
+   memset(&nat->portStats, 0, sizeof(sr_nat_port_stats_t));
+   nat->endpointIndependentFiltering = false;
+   nat->deterministic = NULL;
+   nat->timeoutsSuspended = false;
+   nat->hasTimeoutThread = false;
 
    return success;
 }
@@ -153,15 +260,36 @@ int sr_nat_init(struct sr_nat *nat)
 int sr_nat_destroy(struct sr_nat *nat)
 { /* Destroys the nat (free memory) */
    
-   pthread_mutex_lock(&(nat->lock));
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    
    /* free nat memory here */
    while (nat->mappings)
    {
       sr_nat_destroy_mapping(nat, nat->mappings);
    }
+   sr_policer_destroy(nat->policer);
+   nat->policer = NULL;
+   free(nat->portBlocks[nat_mapping_icmp]);
+   free(nat->portBlocks[nat_mapping_tcp]);
+   memset(nat->portBlocks, 0, sizeof(nat->portBlocks));
+   nat->portBlockSize = 0;
+   if (nat->deterministic)
+   {
+      for (unsigned int type = 0; type < SR_NAT_MAPPING_TYPES; type++)
+      {
+         free(nat->deterministic->slots[type]);
+         free(nat->deterministic->nextSlot[type]);
+      }
+      free(nat->deterministic);
+      nat->deterministic = NULL;
+   }
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   sr_nat_log_stop(nat);
 
-   pthread_kill(nat->thread, SIGKILL);
+   if (nat->hasTimeoutThread)
+   {
+      pthread_kill(nat->thread, SIGKILL);
+   }
    return pthread_mutex_destroy(&(nat->lock)) && pthread_mutexattr_destroy(&(nat->attr));
 }
 
@@ -173,134 +301,541 @@ int sr_nat_destroy(struct sr_nat *nat)
 void *sr_nat_timeout(void *nat_ptr)
 { /* Periodic Timout handling */
    struct sr_nat *nat = (struct sr_nat *) nat_ptr;
+   sr_watchdog_register("nat timer");
    while (1)
    {
+      sr_watchdog_idle();
       sleep(1.0);
-      pthread_mutex_lock(&(nat->lock));
-      
-      /* handle periodic tasks here */
+      sr_nat_tick(nat);
+   }
+   return NULL;
+}
 
-      time_t curtime = time(NULL);
-      sr_nat_mapping_t *mappingWalker = nat->mappings;
-      
-      while (mappingWalker)
+/**
+ * sr_nat_tick()\n
+ * @brief Times out idle NAT mappings and connections. Called once a second.
+ * @param nat pointer to the NAT state structure.
+ * @note Called from the NAT's own timeout thread, or from a timer thread 
+ *       shared by every instance when hosted by sr_multi.
+ */
+void sr_nat_tick(struct sr_nat *nat)
+{
+   sr_watchdog_stage_t stage = sr_watchdog_stage(SR_WATCHDOG_NAT_SWEEP);
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   
+   /* A standby mirrors the active router's table; it does not age it. */
+   if (nat->timeoutsSuspended)
+   {
+      sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+      sr_watchdog_stage(stage);
+      return;
+   }
+   
+   /* handle periodic tasks here */
+
+   time_t curtime = sr_clock_now();
+   sr_nat_mapping_t *mappingWalker = nat->mappings;
+   
+   while (mappingWalker)
+   {
+      if (mappingWalker->type == nat_mapping_icmp)
       {
-         if (mappingWalker->type == nat_mapping_icmp)
+         if (difftime(curtime, mappingWalker->last_updated) > nat->icmpTimeout)
          {
-            if (difftime(curtime, mappingWalker->last_updated) > nat->icmpTimeout)
+            sr_nat_mapping_t* next = mappingWalker->next;
+            LOG_MESSAGE("ICMP mapping %u.%u.%u.%u:%u <-> %u timed out.\n",
+               (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
+               (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
+               (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
+               ntohl(mappingWalker->ip_int) & 0xFF,
+               ntohs(mappingWalker->aux_int), ntohs(mappingWalker->aux_ext));
+            sr_nat_destroy_mapping(nat, mappingWalker);
+            mappingWalker = next;
+         }
+         else
+         {
+            mappingWalker = mappingWalker->next;
+         }
+      }
+      else if (mappingWalker->type == nat_mapping_tcp)
+      {
+         sr_nat_connection_t * connectionIterator = mappingWalker->conns;
+         while (connectionIterator)
+         {
+            if ((connectionIterator->connectionState == nat_conn_connected)
+               && (difftime(curtime, connectionIterator->lastAccessed)
+                  > nat->tcpEstablishedTimeout))
             {
-               sr_nat_mapping_t* next = mappingWalker->next;
-               LOG_MESSAGE("ICMP mapping %u.%u.%u.%u:%u <-> %u timed out.\n",
+               sr_nat_connection_t* next = connectionIterator->next;
+               LOG_MESSAGE("Open TCP connection from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed idle.\n",
                   (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
                   (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
                   (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
-                  ntohl(mappingWalker->ip_int) & 0xFF,
-                  ntohs(mappingWalker->aux_int), ntohs(mappingWalker->aux_ext));
-               sr_nat_destroy_mapping(nat, mappingWalker);
-               mappingWalker = next;
+                  ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
+                  (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
+                  ntohl(connectionIterator->external.ipAddress) & 0xFF,
+                  ntohs(connectionIterator->external.portNumber));
+               sr_nat_destroy_connection(nat, mappingWalker, connectionIterator);
+               connectionIterator = next;
             }
-            else
+            else if (((connectionIterator->connectionState == nat_conn_outbound_syn)
+               || (connectionIterator->connectionState == nat_conn_time_wait))
+               && (difftime(curtime, connectionIterator->lastAccessed)
+                  > nat->tcpTransitoryTimeout))
             {
-               mappingWalker = mappingWalker->next;
+               sr_nat_connection_t* next = connectionIterator->next;
+               LOG_MESSAGE("Transitory TCP connection from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed idle.\n",
+                  (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
+                  (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
+                  (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
+                  ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
+                  (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
+                  ntohl(connectionIterator->external.ipAddress) & 0xFF,
+                  ntohs(connectionIterator->external.portNumber));
+               sr_nat_destroy_connection(nat, mappingWalker, connectionIterator);
+               connectionIterator = next;
             }
-         }
-         else if (mappingWalker->type == nat_mapping_tcp)
-         {
-            sr_nat_connection_t * connectionIterator = mappingWalker->conns;
-            while (connectionIterator)
+            else if ((connectionIterator->connectionState == nat_conn_closed)
+               && (difftime(curtime, connectionIterator->lastAccessed)
+                  > nat->tcpTimeWaitTimeout))
             {
-               if ((connectionIterator->connectionState == nat_conn_connected)
-                  && (difftime(curtime, connectionIterator->lastAccessed)
-                     > nat->tcpEstablishedTimeout))
-               {
-                  sr_nat_connection_t* next = connectionIterator->next;
-                  LOG_MESSAGE("Open TCP connection from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed idle.\n",
-                     (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
-                     ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
-                     (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
-                     ntohl(connectionIterator->external.ipAddress) & 0xFF,
-                     ntohs(connectionIterator->external.portNumber));
-                  sr_nat_destroy_connection(mappingWalker, connectionIterator);
-                  connectionIterator = next;
-               }
-               else if (((connectionIterator->connectionState == nat_conn_outbound_syn)
-                  || (connectionIterator->connectionState == nat_conn_time_wait))
-                  && (difftime(curtime, connectionIterator->lastAccessed)
-                     > nat->tcpTransitoryTimeout))
-               {
-                  sr_nat_connection_t* next = connectionIterator->next;
-                  LOG_MESSAGE("Transitory TCP connection from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed idle.\n",
-                     (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
-                     ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
-                     (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
-                     ntohl(connectionIterator->external.ipAddress) & 0xFF,
-                     ntohs(connectionIterator->external.portNumber));
-                  sr_nat_destroy_connection(mappingWalker, connectionIterator);
-                  connectionIterator = next;
-               }
-               else if ((connectionIterator->connectionState == nat_conn_inbound_syn_pending)
-                  && (difftime(curtime, connectionIterator->lastAccessed)
-                     > nat->tcpTransitoryTimeout))
-               {
-                  sr_nat_connection_t* next = connectionIterator->next;
-                  LOG_MESSAGE("Pending TCP simultaneous open from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed invalid.\n",
-                     (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
-                     (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
-                     ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
-                     (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
-                     (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
-                     ntohl(connectionIterator->external.ipAddress) & 0xFF,
-                     ntohs(connectionIterator->external.portNumber));
-                  if (connectionIterator->queuedInboundSyn)
-                  {
-                     IpSendTypeThreeIcmpPacket(nat->routerState,
-                        icmp_code_destination_port_unreachable,
-                        connectionIterator->queuedInboundSyn);
-                  }
-                  sr_nat_destroy_connection(mappingWalker, connectionIterator);
-                  connectionIterator = next;
-               }
-               else
-               {
-                  connectionIterator = connectionIterator->next;
-               }
+               sr_nat_connection_t* next = connectionIterator->next;
+               LOG_MESSAGE("Closed TCP connection from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u left TIME_WAIT.\n",
+                  (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
+                  (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
+                  (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
+                  ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
+                  (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
+                  ntohl(connectionIterator->external.ipAddress) & 0xFF,
+                  ntohs(connectionIterator->external.portNumber));
+               sr_nat_destroy_connection(nat, mappingWalker, connectionIterator);
+               nat->portStats.reclaimed++;
+               connectionIterator = next;
             }
-            
-            if (mappingWalker->conns == NULL)
+            else if ((connectionIterator->connectionState == nat_conn_inbound_syn_pending)
+               && (difftime(curtime, connectionIterator->lastAccessed)
+                  > nat->tcpTransitoryTimeout))
             {
-               sr_nat_mapping_t* next = mappingWalker->next;
-               LOG_MESSAGE("No more active TCP connections on %u.%u.%u.%u:%u <-> %u. Closing.\n",
+               sr_nat_connection_t* next = connectionIterator->next;
+               LOG_MESSAGE("Pending TCP simultaneous open from %u.%u.%u.%u:%u to %u.%u.%u.%u:%u deemed invalid.\n",
                   (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
                   (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
                   (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
-                  ntohl(mappingWalker->ip_int) & 0xFF,
-                  ntohs(mappingWalker->aux_int), ntohs(mappingWalker->aux_ext));
-               sr_nat_destroy_mapping(nat, mappingWalker);
-               mappingWalker = next;
+                  ntohl(mappingWalker->ip_int) & 0xFF, ntohs(mappingWalker->aux_int),
+                  (ntohl(connectionIterator->external.ipAddress) >> 24) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 16) & 0xFF,
+                  (ntohl(connectionIterator->external.ipAddress) >> 8) & 0xFF,
+                  ntohl(connectionIterator->external.ipAddress) & 0xFF,
+                  ntohs(connectionIterator->external.portNumber));
+               if (connectionIterator->queuedInboundSyn)
+               {
+                  IpSendTypeThreeIcmpPacket(nat->routerState,
+                     icmp_code_destination_port_unreachable,
+                     connectionIterator->queuedInboundSyn);
+               }
+               sr_nat_destroy_connection(nat, mappingWalker, connectionIterator);
+               connectionIterator = next;
             }
             else
             {
-               mappingWalker = mappingWalker->next;
+               if (nat->routerState && (nat->routerState->flows != NULL) && (difftime(curtime,
+                  connectionIterator->flowStarted) >= nat->routerState->flows->activeTimeoutS))
+               {
+                  natFlowExport(nat, mappingWalker, connectionIterator, SR_FLOW_END_ACTIVE);
+               }
+               connectionIterator = connectionIterator->next;
             }
          }
+         
+         if (mappingWalker->conns == NULL)
+         {
+            sr_nat_mapping_t* next = mappingWalker->next;
+            LOG_MESSAGE("No more active TCP connections on %u.%u.%u.%u:%u <-> %u. Closing.\n",
+               (ntohl(mappingWalker->ip_int) >> 24) & 0xFF,
+               (ntohl(mappingWalker->ip_int) >> 16) & 0xFF,
+               (ntohl(mappingWalker->ip_int) >> 8) & 0xFF,
+               ntohl(mappingWalker->ip_int) & 0xFF,
+               ntohs(mappingWalker->aux_int), ntohs(mappingWalker->aux_ext));
+            sr_nat_destroy_mapping(nat, mappingWalker);
+            mappingWalker = next;
+         }
          else
          {
             mappingWalker = mappingWalker->next;
          }
       }
-      pthread_mutex_unlock(&(nat->lock));
+      else
+      {
+         mappingWalker = mappingWalker->next;
+      }
    }
-   return NULL;
+   
+   natSamplePortUse(nat);
+   sr_policer_tick(nat->policer);
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+}
+
+/**
+ * sr_nat_print()\n
+ * @brief Prints external port use over the last SR_NAT_PORT_HISTORY seconds
+ *        and how TCP connections were torn down.
+ * @param sr pointer to simple router state structure. Nothing is printed 
+ *        without NAT.
+ * @param out stream to print to.
+ */
+void sr_nat_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_nat_t *nat = sr->nat;
+   const sr_nat_port_stats_t *stats;
+   unsigned int tcpMin = SR_NAT_PORT_POOL_SIZE, tcpMax = 0, icmpMin = SR_NAT_PORT_POOL_SIZE, icmpMax = 0;
+   unsigned long tcpSum = 0, icmpSum = 0;
+   unsigned int i;
+   
+   if (nat == NULL)
+   {
+      return;
+   }
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   stats = &nat->portStats;
+   if (stats->samples == 0)
+   {
+      sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+      return;
+   }
+   for (i = 0; i < stats->samples; i++)
+   {
+      tcpMin = (stats->tcp[i] < tcpMin) ? stats->tcp[i] : tcpMin;
+      tcpMax = (stats->tcp[i] > tcpMax) ? stats->tcp[i] : tcpMax;
+      tcpSum += stats->tcp[i];
+      icmpMin = (stats->icmp[i] < icmpMin) ? stats->icmp[i] : icmpMin;
+      icmpMax = (stats->icmp[i] > icmpMax) ? stats->icmp[i] : icmpMax;
+      icmpSum += stats->icmp[i];
+   }
+   
+   i = (stats->next + SR_NAT_PORT_HISTORY - 1) % SR_NAT_PORT_HISTORY;
+   fprintf(out, "NAT ports: topology %u, of %u per type, last %u s now/min/avg/max, peak\n",
+      sr->topo_id, SR_NAT_PORT_POOL_SIZE, stats->samples);
+   fprintf(out, "   tcp  %u/%u/%.1f/%u, %u\n", stats->tcp[i], tcpMin,
+      (double) tcpSum / stats->samples, tcpMax, stats->peakTcp);
+   fprintf(out, "   icmp %u/%u/%.1f/%u, %u\n", stats->icmp[i], icmpMin,
+      (double) icmpSum / stats->samples, icmpMax, stats->peakIcmp);
+   fprintf(out, "   tcp closed: %" PRIu64 " by FIN, %" PRIu64 " by RST, %" PRIu64
+      " ports back after TIME_WAIT (%u s)\n", stats->closedByFin, stats->closedByReset,
+      stats->reclaimed, nat->tcpTimeWaitTimeout);
+   if (nat->deterministic)
+   {
+      fprintf(out, "   deterministic: %u hosts from %u.%u.%u.%u, %u ports each\n",
+         nat->deterministic->hosts, nat->deterministic->firstHost >> 24,
+         (nat->deterministic->firstHost >> 16) & 0xFF, (nat->deterministic->firstHost >> 8) & 0xFF,
+         nat->deterministic->firstHost & 0xFF, nat->deterministic->portsPerHost);
+   }
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   fflush(out);
+}
+
+/**
+ * sr_nat_update_closing()\n
+ * @brief Recounts the connections of a mapping waiting for the last ACK of 
+ *        a close.
+ * @param mapping mapping whose connections changed state.
+ * @note Copies of the mapping carry the count, so packets of mappings with 
+ *       nothing closing can skip the teardown tracking without the lock.
+ * @warning Assumes the NAT structure is locked.
+ */
+void sr_nat_update_closing(struct sr_nat_mapping *mapping)
+{
+   sr_nat_connection_t *connection;
+   
+   mapping->closingConnections = 0;
+   for (connection = mapping->conns; connection != NULL; connection = connection->next)
+   {
+      if (connection->connectionState == nat_conn_time_wait)
+      {
+         mapping->closingConnections++;
+      }
+   }
+}
+
+/**
+ * sr_nat_start_flow()\n
+ * @brief Zeroes a new connection's packet and byte counts, and notes the
+ *        connection in the trace of the packet that made it.
+ * @param connection connection just created.
+ */
+void sr_nat_start_flow(struct sr_nat_connection *connection)
+{
+   SR_TRACE(SR_TRACE_NAT, "new connection with " SR_TRACE_IP_FORMAT ":%u, %s",
+      SR_TRACE_IP(connection->external.ipAddress), ntohs(connection->external.portNumber),
+      natConnectionStateNames[connection->connectionState]);
+   SR_PROBE4(nat_conn_state, connection->external.ipAddress, connection->external.portNumber,
+      SR_PROBE_NO_STATE, (int) connection->connectionState);
+   memset(connection->packets, 0, sizeof(connection->packets));
+   memset(connection->bytes, 0, sizeof(connection->bytes));
+   connection->flowStarted = sr_clock_now();
+}
+
+/**
+ * sr_nat_flush_flows()\n
+ * @brief Exports what every TCP connection has carried since its last flow 
+ *        record, with end reason "forced".
+ * @param nat pointer to the NAT state structure.
+ */
+void sr_nat_flush_flows(struct sr_nat *nat)
+{
+   sr_nat_mapping_t *mapping;
+   sr_nat_connection_t *connection;
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next)
+   {
+      for (connection = mapping->conns; connection != NULL; connection = connection->next)
+      {
+         natFlowExport(nat, mapping, connection, SR_FLOW_END_FORCED);
+      }
+   }
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+}
+
+/**
+ * sr_nat_log_start()\n
+ * @brief Starts the compliance log of NAT mappings.
+ * @param nat pointer to the NAT state structure, with no mappings yet.
+ * @param path log files are named path.000001, path.000002, ...
+ * @param rotateBytes size after which the next file is started.
+ * @param blockSize 0 to log every mapping. Otherwise each internal host is 
+ *        given blocks of this many external ports to map from, and only 
+ *        blocks are logged. Ports left over after the last whole block go 
+ *        unused.
+ * @return 0 on success, -1 if the log could not be opened.
+ * @note A deterministic NAT logs each host's fixed block once, here, and 
+ *       nothing per mapping; blockSize is then ignored.
+ */
+int sr_nat_log_start(struct sr_nat *nat, const char *path, uint64_t rotateBytes,
+   unsigned int blockSize)
+{
+   sr_natlog_record_t record;
+   unsigned int type, host;
+   
+   assert(nat->mappings == NULL);
+   
+   if (nat->deterministic)
+   {
+      blockSize = nat->deterministic->portsPerHost;
+   }
+   nat->log = sr_natlog_start(path, rotateBytes, blockSize);
+   if (nat->log == NULL)
+   {
+      return -1;
+   }
+   
+   if (nat->deterministic)
+   {
+      for (type = 0; type < SR_NAT_MAPPING_TYPES; type++)
+      {
+         for (host = 0; host < nat->deterministic->hosts; host++)
+         {
+            memset(&record, 0, sizeof(record));
+            record.event = SR_NATLOG_BLOCK_ALLOCATE;
+            record.type = type;
+            record.ipInt = nat->deterministic->firstHost + host;
+            record.auxExt = STARTING_PORT_NUMBER + host * blockSize;
+            record.blockSize = blockSize;
+            natLogPush(nat, &record);
+         }
+      }
+   }
+   else if (blockSize)
+   {
+      nat->portBlockSize = blockSize;
+      nat->portBlockCount = SR_NAT_PORT_POOL_SIZE / blockSize;
+      for (type = 0; type < SR_NAT_MAPPING_TYPES; type++)
+      {
+         nat->portBlocks[type] = calloc(nat->portBlockCount, sizeof(sr_nat_port_block_t));
+         assert(nat->portBlocks[type]);
+      }
+   }
+   return 0;
+}
+
+/**
+ * sr_nat_log_stop()\n
+ * @brief Writes out and closes the compliance log. Port block mode stays 
+ *        on, so mappings keep to their blocks.
+ * @param nat pointer to the NAT state structure.
+ */
+void sr_nat_log_stop(struct sr_nat *nat)
+{
+   sr_natlog_t *log;
+   
+   if (nat == NULL)
+   {
+      return;
+   }
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   log = nat->log;
+   nat->log = NULL;
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   
+   sr_natlog_stop(log);
+}
+
+/**
+ * sr_nat_mapping_added()\n
+ * Description:\n
+ *    Called wherever a mapping enters the table: created for a packet, 
+ *    replicated from the active router or adopted in a hot upgrade. A 
+ *    deterministic NAT only indexes it by external port; its blocks are 
+ *    fixed and were logged when the log started. Otherwise the mapping is 
+ *    counted against its port block, if blocks are on, and then logged: 
+ *    the mapping itself without blocks, only a block's first mapping 
+ *    (allocation) with them. A standby keeps its blocks in step but logs 
+ *    nothing; the active router does. Neither is logged for an adopted 
+ *    mapping: the process that handed it over logged it already.
+ * @brief Tracks and logs a mapping entering the NAT table.
+ * @param nat pointer to the NAT state structure.
+ * @param mapping the mapping.
+ * @param adopted true if the mapping was handed over by a hot upgrade.
+ * @warning Assumes the NAT structure is locked.
+ */
+void sr_nat_mapping_added(struct sr_nat *nat, struct sr_nat_mapping *mapping, bool adopted)
+{
+   sr_nat_port_block_t *block;
+   
+   if (nat->deterministic)
+   {
+      natIndexDeterministic(nat, mapping, true);
+   }
+   else if (nat->portBlockSize == 0)
+   {
+      if (!adopted)
+      {
+         natLogMapping(nat, mapping, SR_NATLOG_MAPPING_CREATE);
+      }
+   }
+   else if (((block = natPortBlock(nat, mapping)) != NULL) && (block->used++ == 0))
+   {
+      block->owner = mapping->ip_int;
+      if (!adopted)
+      {
+         natLogPortBlock(nat, mapping->type, block, SR_NATLOG_BLOCK_ALLOCATE);
+      }
+   }
+}
+
+/**
+ * sr_nat_mapping_removed()\n
+ * Description:\n
+ *    The counterpart of sr_nat_mapping_added(), called wherever a mapping 
+ *    leaves the table (timed out, or deleted on the active router and 
+ *    replicated) before it is freed. Only a block's last mapping logs its 
+ *    release.
+ * @brief Tracks and logs a mapping leaving the NAT table.
+ * @param nat pointer to the NAT state structure.
+ * @param mapping the mapping.
+ * @warning Assumes the NAT structure is locked.
+ */
+void sr_nat_mapping_removed(struct sr_nat *nat, struct sr_nat_mapping *mapping)
+{
+   sr_nat_port_block_t *block;
+   
+   if (nat->deterministic)
+   {
+      natIndexDeterministic(nat, mapping, false);
+   }
+   else if (nat->portBlockSize == 0)
+   {
+      natLogMapping(nat, mapping, SR_NATLOG_MAPPING_DELETE);
+   }
+   else if (((block = natPortBlock(nat, mapping)) != NULL) && (block->used > 0)
+      && (--block->used == 0))
+   {
+      natLogPortBlock(nat, mapping->type, block, SR_NATLOG_BLOCK_RELEASE);
+   }
+}
+
+/**
+ * sr_nat_deterministic_parse()\n
+ * @brief Parses the internal hosts of a deterministic NAT.
+ * @param spec "a.b.c.d/len[:ports per host]".
+ * @param firstHost set to the first address of the prefix, host byte order.
+ * @param hosts set to the number of addresses in the prefix.
+ * @param portsPerHost set to the ports given, or the pool shared out evenly.
+ * @return 0, or -1 if malformed or the pool is too small.
+ */
+int sr_nat_deterministic_parse(const char *spec, uint32_t *firstHost, unsigned int *hosts,
+   unsigned int *portsPerHost)
+{
+   char address[16];
+   struct in_addr parsed;
+   unsigned int prefixLength, ports = 0;
+   int fields;
+   
+   fields = sscanf(spec, "%15[0-9.]/%u:%u", address, &prefixLength, &ports);
+   if ((fields < 2) || (inet_pton(AF_INET, address, &parsed) != 1) || (prefixLength < 18)
+      || (prefixLength > 32))
+   {
+      return -1;
+   }
+   
+   *hosts = 1u << (32 - prefixLength);
+   *firstHost = ntohl(parsed.s_addr) & ~(*hosts - 1);
+   *portsPerHost = (fields == 3) ? ports : SR_NAT_PORT_POOL_SIZE / *hosts;
+   if ((*portsPerHost == 0) || (*hosts * *portsPerHost > SR_NAT_PORT_POOL_SIZE))
+   {
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * sr_nat_set_deterministic()\n
+ * @brief Switches the NAT to deterministic port assignment. Addresses 
+ *        outside the range get no mappings.
+ * @param nat pointer to the NAT state structure, with no mappings yet.
+ * @param firstHost first internal address, host byte order.
+ * @param hosts internal addresses from firstHost on.
+ * @param portsPerHost external ports fixed to each.
+ * @return 0, or -1 if the blocks don't fit in the pool.
+ */
+int sr_nat_set_deterministic(struct sr_nat *nat, uint32_t firstHost, unsigned int hosts,
+   unsigned int portsPerHost)
+{
+   sr_nat_deterministic_t *deterministic;
+   unsigned int type;
+   
+   assert(nat->mappings == NULL);
+   assert(nat->log == NULL);
+   
+   if ((hosts == 0) || (portsPerHost == 0) || (hosts * portsPerHost > SR_NAT_PORT_POOL_SIZE))
+   {
+      return -1;
+   }
+   
+   deterministic = malloc(sizeof(sr_nat_deterministic_t));
+   assert(deterministic);
+   deterministic->firstHost = firstHost;
+   deterministic->hosts = hosts;
+   deterministic->portsPerHost = portsPerHost;
+   for (type = 0; type < SR_NAT_MAPPING_TYPES; type++)
+   {
+      deterministic->slots[type] = calloc(hosts * portsPerHost, sizeof(sr_nat_mapping_t *));
+      deterministic->nextSlot[type] = calloc(hosts, sizeof(uint16_t));
+      assert(deterministic->slots[type] && deterministic->nextSlot[type]);
+   }
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   nat->deterministic = deterministic;
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   return 0;
 }
 
 /**
@@ -317,7 +852,7 @@ void *sr_nat_timeout(void *nat_ptr)
 struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat, uint16_t aux_ext,
    sr_nat_mapping_type type)
 {
-   pthread_mutex_lock(&(nat->lock));
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    
    /* handle lookup here, malloc and assign to copy */
    sr_nat_mapping_t *copy = NULL;
@@ -325,12 +860,12 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat, uint16_t aux_e
    
    if (lookupResult != NULL)
    {
-      lookupResult->last_updated = time(NULL);
+      lookupResult->last_updated = sr_clock_now();
       copy = malloc(sizeof(sr_nat_mapping_t));
       memcpy(copy, lookupResult, sizeof(sr_nat_mapping_t));
    }
    
-   pthread_mutex_unlock(&(nat->lock));
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    return copy;
 }
 
@@ -349,7 +884,7 @@ struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat, uint16_t aux_e
 struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
    sr_nat_mapping_type type)
 {
-   pthread_mutex_lock(&(nat->lock));
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    
    /* handle lookup here, malloc and assign to copy. */
    struct sr_nat_mapping *copy = NULL;
@@ -357,13 +892,13 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat, uint32_t ip_in
       
    if (lookupResult != NULL)
    {
-      lookupResult->last_updated = time(NULL);
+      lookupResult->last_updated = sr_clock_now();
       copy = malloc(sizeof(sr_nat_mapping_t));
       assert(copy);
       memcpy(copy, lookupResult, sizeof(sr_nat_mapping_t));
    }
    
-   pthread_mutex_unlock(&(nat->lock));
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    return copy;
 }
 
@@ -377,16 +912,24 @@ struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat, uint32_t ip_in
  * @param ip_int IP address of the internal source of the mapping.
  * @param aux_int identifier or port of the mapping internal to the NAT.
  * @param type Specifies a TCP or ICMP mapping.
- * @return copy of the mapping stored in the NAT state structure.
+ * @return copy of the mapping stored in the NAT state structure. NULL if 
+ *         the internal host is over its mapping quota.
  */
 struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int, uint16_t aux_int,
    sr_nat_mapping_type type)
 {
-   pthread_mutex_lock(&(nat->lock));
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    
    /* handle insert here, create a mapping, and then return a copy of it */
    struct sr_nat_mapping *mapping = natTrustedCreateMapping(nat, ip_int, aux_int, type);
-   struct sr_nat_mapping *copy = malloc(sizeof(sr_nat_mapping_t));
+   struct sr_nat_mapping *copy;
+   
+   if (mapping == NULL)
+   {
+      sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+      return NULL;
+   }
+   copy = malloc(sizeof(sr_nat_mapping_t));
    
    if (type == nat_mapping_icmp)
    {
@@ -405,7 +948,7 @@ struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int
    
    memcpy(copy, mapping, sizeof(sr_nat_mapping_t));
    
-   pthread_mutex_unlock(&(nat->lock));
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
    return copy;
 }
 
@@ -431,6 +974,7 @@ void NatHandleRecievedIpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
    else
    {
       LOG_MESSAGE("Received packet of unknown IP protocol type %u. Dropping.\n", ipPacket->ip_p);
+      SR_PROBE_DROP("nat_protocol", length);
    }
 }
 
@@ -530,51 +1074,365 @@ void NatUndoPacketMapping(sr_instance_t* sr, sr_ip_hdr_t* mutatedPacket, unsigne
    }
 }
 
-/*
- *-----------------------------------------------------------------------------
- * Private Function Definitions
- *-----------------------------------------------------------------------------
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * natNextMappingNumber()\n
+ * @brief Finds a free external port or ICMP identifier, round robin.
+ * @return the number, or 0 if every one in the pool is taken.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static uint16_t natNextMappingNumber(sr_nat_t* nat, sr_nat_mapping_type mappingType)
+{
+   uint16_t startIndex = nat->nextTcpPortNumber;
+   unsigned int taken = 0;
+   sr_nat_mapping_t * mappingIterator = nat->mappings;
+   if (mappingType == nat_mapping_icmp)
+   {
+      startIndex = nat->nextIcmpIdentNumber;
+   }
+   
+   /* Look to see if a mapping already exists for this port number */
+   while (mappingIterator)
+   {
+      if ((mappingIterator->type == mappingType) && (htons(startIndex) == mappingIterator->aux_ext))
+      {
+         /* Mapping already exists for this value. Go to the next one and start the search over. */
+         if (++taken == SR_NAT_PORT_POOL_SIZE)
+         {
+            return 0;
+         }
+         startIndex = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
+         mappingIterator = nat->mappings;
+      }
+      else
+      {
+         mappingIterator = mappingIterator->next;
+      }
+   }
+   
+   /* Setup the next search start location for the next mapping */
+   if (mappingType == nat_mapping_icmp)
+   {
+      nat->nextIcmpIdentNumber = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
+   }
+   else if (mappingType == nat_mapping_tcp)
+   {
+      nat->nextTcpPortNumber = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
+   }
+   
+   return startIndex;
+}
+
+/**
+ * natNextBlockPort()\n
+ * @brief Finds a free external port or ICMP identifier for an internal host 
+ *        in port block mode: in one of the host's blocks if it has room, 
+ *        otherwise the first port of the next unused block, round robin.
+ * @return the number, or 0 if the host's blocks are full and no block is free.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static uint16_t natNextBlockPort(sr_nat_t *nat, sr_nat_mapping_type mappingType, uint32_t ip_int)
+{
+   sr_nat_port_block_t *blocks = nat->portBlocks[mappingType];
+   unsigned int block, i;
+   uint16_t port;
+   
+   for (block = 0; block < nat->portBlockCount; block++)
+   {
+      if ((blocks[block].used == 0) || (blocks[block].owner != ip_int)
+         || (blocks[block].used == nat->portBlockSize))
+      {
+         continue;
+      }
+      
+      /* Blocks fill from the front, so the port after the last one used is 
+       * usually free. */
+      for (i = 0; i < nat->portBlockSize; i++)
+      {
+         port = STARTING_PORT_NUMBER + block * nat->portBlockSize
+            + (blocks[block].used + i) % nat->portBlockSize;
+         if (natTrustedLookupExternal(nat, htons(port), mappingType) == NULL)
+         {
+            return port;
+         }
+      }
+   }
+   
+   for (i = 0; i < nat->portBlockCount; i++)
+   {
+      block = (nat->nextPortBlock[mappingType] + i) % nat->portBlockCount;
+      if (blocks[block].used == 0)
+      {
+         nat->nextPortBlock[mappingType] = (block + 1) % nat->portBlockCount;
+         return STARTING_PORT_NUMBER + block * nat->portBlockSize;
+      }
+   }
+   
+   return 0;
+}
+
+/**
+ * natNextDeterministicPort()\n
+ * @brief Finds a free external port or ICMP identifier in an internal 
+ *        host's own block of a deterministic NAT, carrying on from the last 
+ *        one handed out.
+ * @return the number, or 0 if the host is outside the NAT's range or its 
+ *         block is full.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static uint16_t natNextDeterministicPort(sr_nat_t *nat, sr_nat_mapping_type mappingType,
+   uint32_t ip_int)
+{
+   sr_nat_deterministic_t *deterministic = nat->deterministic;
+   unsigned int host = ntohl(ip_int) - deterministic->firstHost;
+   sr_nat_mapping_t **slots;
+   unsigned int i, slot;
+   
+   if (host >= deterministic->hosts)
+   {
+      return 0;
+   }
+   
+   slots = deterministic->slots[mappingType] + host * deterministic->portsPerHost;
+   for (i = 0; i < deterministic->portsPerHost; i++)
+   {
+      slot = (deterministic->nextSlot[mappingType][host] + i) % deterministic->portsPerHost;
+      if (slots[slot] == NULL)
+      {
+         deterministic->nextSlot[mappingType][host] = (slot + 1) % deterministic->portsPerHost;
+         return STARTING_PORT_NUMBER + host * deterministic->portsPerHost + slot;
+      }
+   }
+   return 0;
+}
+
+/**
+ * natIndexDeterministic()\n
+ * @brief Keeps a deterministic NAT's table of mappings by external port in 
+ *        step with the mapping list.
+ * @param nat pointer to NAT structure.
+ * @param mapping mapping entering or leaving the list.
+ * @param added true if it is entering.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static void natIndexDeterministic(sr_nat_t *nat, sr_nat_mapping_t *mapping, bool added)
+{
+   sr_nat_deterministic_t *deterministic = nat->deterministic;
+   unsigned int slot = ntohs(mapping->aux_ext) - STARTING_PORT_NUMBER;
+   sr_nat_mapping_t **entry;
+   
+   if (slot >= deterministic->hosts * deterministic->portsPerHost)
+   {
+      return;
+   }
+   
+   entry = &deterministic->slots[mapping->type][slot];
+   if (added)
+   {
+      *entry = mapping;
+   }
+   else if (*entry == mapping)
+   {
+      *entry = NULL;
+   }
+}
+
+/**
+ * natPortBlock()\n
+ * @return the port block a mapping's external port falls in, or NULL.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static sr_nat_port_block_t *natPortBlock(sr_nat_t *nat, const sr_nat_mapping_t *mapping)
+{
+   unsigned int index = (ntohs(mapping->aux_ext) - STARTING_PORT_NUMBER) / nat->portBlockSize;
+   
+   return (index < nat->portBlockCount) ? &nat->portBlocks[mapping->type][index] : NULL;
+}
+
+/**
+ * natLogMapping()\n
+ * @brief Logs a single mapping's creation or deletion.
+ * @warning Assumes that NAT structure is already locked!
  */
+static void natLogMapping(sr_nat_t *nat, const sr_nat_mapping_t *mapping, sr_natlog_event_t event)
+{
+   sr_natlog_record_t record;
+   
+   if (nat->log == NULL)
+   {
+      return;
+   }
+   memset(&record, 0, sizeof(record));
+   record.event = event;
+   record.type = mapping->type;
+   record.ipInt = ntohl(mapping->ip_int);
+   record.auxInt = ntohs(mapping->aux_int);
+   record.auxExt = ntohs(mapping->aux_ext);
+   natLogPush(nat, &record);
+}
 
-static uint16_t natNextMappingNumber(sr_nat_t* nat, sr_nat_mapping_type mappingType)
+/**
+ * natLogPortBlock()\n
+ * @brief Logs a port block being given to or taken back from its owner.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static void natLogPortBlock(sr_nat_t *nat, sr_nat_mapping_type type, const sr_nat_port_block_t *block,
+   sr_natlog_event_t event)
 {
-   uint16_t startIndex;
-   sr_nat_mapping_t * mappingIterator = nat->mappings;
-   if (mappingType == nat_mapping_icmp)
+   sr_natlog_record_t record;
+   
+   if (nat->log == NULL)
    {
-      startIndex = nat->nextIcmpIdentNumber;
+      return;
    }
-   else if (mappingType == nat_mapping_tcp)
+   memset(&record, 0, sizeof(record));
+   record.event = event;
+   record.type = type;
+   record.ipInt = ntohl(block->owner);
+   record.auxExt = STARTING_PORT_NUMBER + (block - nat->portBlocks[type]) * nat->portBlockSize;
+   record.blockSize = nat->portBlockSize;
+   natLogPush(nat, &record);
+}
+
+/**
+ * natLogPush()\n
+ * @brief Stamps a record with the time and external address and hands it to 
+ *        the log writer. Nothing is logged without a log, or on a standby.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static void natLogPush(sr_nat_t *nat, sr_natlog_record_t *record)
+{
+   struct timespec now;
+   
+   if ((nat->log == NULL) || nat->timeoutsSuspended)
    {
-      startIndex = nat->nextTcpPortNumber;
+      return;
    }
+   clock_gettime(CLOCK_REALTIME, &now);
+   record->timeUs = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+   record->ipExt = ntohl(natLogExternalIp(nat));
+   sr_natlog_push(nat->log, record);
+}
+
+/**
+ * natLogExternalIp()\n
+ * @brief Returns the external address logged with mappings: that of the 
+ *        interface the default route leaves by. Looked up once it is known.
+ * @return the address in network byte order, or 0 if there is no default 
+ *         route yet.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static uint32_t natLogExternalIp(sr_nat_t *nat)
+{
+   sr_rt_t *route;
+   sr_if_t *externalInterface;
    
-   /* Look to see if a mapping already exists for this port number */
-   while (mappingIterator)
+   if ((nat->logExternalIp == 0) && nat->routerState)
    {
-      if ((mappingIterator->type == mappingType) && (htons(startIndex) == mappingIterator->aux_ext))
-      {
-         /* Mapping already exists for this value. Go to the next one and start the search over. */
-         startIndex = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
-         mappingIterator = nat->mappings;
-      }
-      else
+      route = IpGetPacketRoute(nat->routerState, 0);
+      externalInterface = route ? sr_get_interface(nat->routerState, route->interface) : NULL;
+      if (externalInterface)
       {
-         mappingIterator = mappingIterator->next;
+         nat->logExternalIp = externalInterface->ip;
       }
    }
+   return nat->logExternalIp;
+}
+
+/**
+ * natFlowExport()\n
+ * @brief Exports a connection's counts since its last flow record and 
+ *        starts counting afresh. A standby, or a connection that carried 
+ *        nothing since, exports nothing.
+ * @warning Assumes that NAT structure is already locked!
+ */
+static void natFlowExport(sr_nat_t *nat, const sr_nat_mapping_t *mapping,
+   sr_nat_connection_t *connection, sr_flow_end_reason_t reason)
+{
+   sr_flow_t *flows = nat->routerState ? nat->routerState->flows : NULL;
+   sr_flow_record_t record;
+   time_t now;
    
-   /* Setup the next search start location for the next mapping */
-   if (mappingType == nat_mapping_icmp)
+   if ((flows == NULL) || nat->timeoutsSuspended
+      || ((connection->packets[nat_conn_internal] | connection->packets[nat_conn_external]) == 0))
    {
-      nat->nextIcmpIdentNumber = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
+      return;
    }
-   else if (mappingType == nat_mapping_tcp)
+   
+   now = sr_clock_now();
+   memset(&record, 0, sizeof(record));
+   record.sourceIp = ntohl(mapping->ip_int);
+   record.sourcePort = ntohs(mapping->aux_int);
+   record.destinationIp = ntohl(connection->external.ipAddress);
+   record.destinationPort = ntohs(connection->external.portNumber);
+   record.postNatSourceIp = ntohl(natLogExternalIp(nat));
+   record.postNatSourcePort = ntohs(mapping->aux_ext);
+   record.protocol = ip_protocol_tcp;
+   record.endReason = reason;
+   record.startS = (uint32_t) connection->flowStarted;
+   record.endS = (uint32_t) now;
+   record.packets = connection->packets[nat_conn_internal];
+   record.octets = connection->bytes[nat_conn_internal];
+   record.reversePackets = connection->packets[nat_conn_external];
+   record.reverseOctets = connection->bytes[nat_conn_external];
+   sr_flow_export(flows, &record);
+   
+   memset(connection->packets, 0, sizeof(connection->packets));
+   memset(connection->bytes, 0, sizeof(connection->bytes));
+   connection->flowStarted = now;
+}
+
+/**
+ * natHairpinInterface()\n
+ * @brief Finds out whether a packet leaving the NAT is addressed to the NAT 
+ *        itself, i.e. to the external interface it would be sent out of.
+ * @param sr pointer to simple router structure.
+ * @param ip_dst destination of the packet, network byte order.
+ * @return the external interface to loop the packet back in on, or NULL if 
+ *         the packet should be forwarded.
+ */
+static sr_if_t *natHairpinInterface(sr_instance_t *sr, uint32_t ip_dst)
+{
+   sr_rt_t *route = IpGetPacketRoute(sr, ntohl(ip_dst));
+   sr_if_t *routeInterface = route ? sr_get_interface(sr, route->interface) : NULL;
+   
+   if (routeInterface && (routeInterface->ip == ip_dst)
+      && (routeInterface->ip != getInternalInterface(sr)->ip))
    {
-      nat->nextTcpPortNumber = (startIndex == LAST_PORT_NUMBER) ? STARTING_PORT_NUMBER : (startIndex + 1);
+      return routeInterface;
+   }
+   return NULL;
+}
+
+/**
+ * natIsHairpinPacket()\n
+ * @brief Tells a packet from an internal host to a mapped port on our 
+ *        external address (to be hairpinned) from one for the router itself.
+ * @param sr pointer to simple router structure.
+ * @param ipPacket packet received on the internal interface, addressed to us.
+ * @param aux_ext destination port or identifier, network byte order.
+ * @param mappingType type of mapping the destination would be.
+ * @return true if the NAT should translate and loop the packet back.
+ */
+static bool natIsHairpinPacket(sr_instance_t *sr, const sr_ip_hdr_t *ipPacket, uint16_t aux_ext,
+   sr_nat_mapping_type mappingType)
+{
+   bool mapped;
+   
+   if (natHairpinInterface(sr, ipPacket->ip_dst) == NULL)
+   {
+      return false;
    }
    
-   return startIndex;
+   sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+   mapped = (natTrustedLookupExternal(sr->nat, aux_ext, mappingType) != NULL);
+   sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+   return mapped;
 }
 
 /**
@@ -588,6 +1446,12 @@ static void sr_nat_destroy_mapping(sr_nat_t* nat, sr_nat_mapping_t* natMapping)
 {
    if (natMapping)
    {
+      natSyncRecord(nat, nat_sync_mapping_delete, natMapping, NULL);
+      SR_PROBE4(nat_mapping_destroy, natMapping->ip_int, natMapping->aux_int, natMapping->aux_ext,
+         (int) natMapping->type);
+      sr_policer_remove_mapping(nat->policer, natMapping->ip_int);
+      sr_nat_mapping_removed(nat, natMapping);
+      
       sr_nat_mapping_t *req, *prev = NULL, *next = NULL;
       for (req = nat->mappings; req != NULL; req = req->next)
       {
@@ -614,6 +1478,10 @@ static void sr_nat_destroy_mapping(sr_nat_t* nat, sr_nat_mapping_t* natMapping)
          sr_nat_connection_t * curr = natMapping->conns;
          natMapping->conns = curr->next;
          
+         SR_PROBE4(nat_conn_state, curr->external.ipAddress, curr->external.portNumber,
+            (int) curr->connectionState, SR_PROBE_NO_STATE);
+         natFlowExport(nat, natMapping, curr, SR_FLOW_END_FORCED);
+         free(curr->queuedInboundSyn);
          free(curr);
       }
       
@@ -624,16 +1492,24 @@ static void sr_nat_destroy_mapping(sr_nat_t* nat, sr_nat_mapping_t* natMapping)
 /**
  * sr_nat_destroy_connection()\n
  * @brief destroys a specified connection in the specified natMapping.
+ * @param nat pointer to NAT structure.
  * @param natMapping pointer to the natMapping with the connection.
  * @param connection pointer to the connection to destroy.
  * @warning assumes shared pointers and that the NAT mutex is locked.
  */
-static void sr_nat_destroy_connection(sr_nat_mapping_t* natMapping, sr_nat_connection_t* connection)
+static void sr_nat_destroy_connection(sr_nat_t* nat, sr_nat_mapping_t* natMapping,
+   sr_nat_connection_t* connection)
 {
    sr_nat_connection_t *req, *prev = NULL, *next = NULL;
    
    if (natMapping && connection)
    {
+      natSyncRecord(nat, nat_sync_connection_delete, natMapping, connection);
+      SR_PROBE4(nat_conn_state, connection->external.ipAddress, connection->external.portNumber,
+         (int) connection->connectionState, SR_PROBE_NO_STATE);
+      natFlowExport(nat, natMapping, connection, (connection->connectionState == nat_conn_closed)
+         ? SR_FLOW_END_OF_FLOW : SR_FLOW_END_IDLE);
+      
       for (req = natMapping->conns; req != NULL; req = req->next)
       {
          if (req == connection)
@@ -660,6 +1536,7 @@ static void sr_nat_destroy_connection(sr_nat_mapping_t* natMapping, sr_nat_conne
       }
       
       free(connection);
+      sr_nat_update_closing(natMapping);
    }
 }
 
@@ -671,25 +1548,49 @@ static void sr_nat_destroy_connection(sr_nat_mapping_t* natMapping, sr_nat_conne
  * @param aux_int the port or identifier of the source internal to the NAT.
  * @param type specifies if creating a TCP or ICMP mapping.
  * @return returns a shared pointer to the created mapping in the NAT state structure. 
+ *         NULL if the internal host may not create another mapping yet, or 
+ *         if no external port is free.
  */
 static sr_nat_mapping_t * natTrustedCreateMapping(sr_nat_t *nat, uint32_t ip_int, uint16_t aux_int,
    sr_nat_mapping_type type)
 {
-   struct sr_nat_mapping *mapping = malloc(sizeof(sr_nat_mapping_t));
+   struct sr_nat_mapping *mapping;
+   
+   if (!sr_policer_admit_mapping(nat->policer, ip_int))
+   {
+      return NULL;
+   }
+   
+   uint16_t externalNumber = nat->deterministic ? natNextDeterministicPort(nat, type, ip_int)
+      : nat->portBlockSize ? natNextBlockPort(nat, type, ip_int) : natNextMappingNumber(nat, type);
+   if (externalNumber == 0)
+   {
+      LOG_MESSAGE("Out of NAT external ports. Refusing mapping.\n");
+      sr_policer_refund_mapping(nat->policer, ip_int);
+      return NULL;
+   }
+   
+   mapping = malloc(sizeof(sr_nat_mapping_t));
+   assert(mapping);
    
-   mapping->aux_ext = htons(natNextMappingNumber(nat, type));
+   mapping->aux_ext = htons(externalNumber);
    mapping->conns = NULL;
+   mapping->closingConnections = 0;
    
    /* Store mapping information */
    mapping->aux_int = aux_int;
    mapping->ip_int = ip_int;
-   mapping->last_updated = time(NULL);
+   mapping->last_updated = sr_clock_now();
    mapping->type = type;
    
    /* Add mapping to the front of the list. */
    mapping->next = nat->mappings;
    nat->mappings = mapping;
    
+   natSyncRecord(nat, nat_sync_mapping_create, mapping, NULL);
+   SR_PROBE4(nat_mapping_create, ip_int, aux_int, mapping->aux_ext, (int) type);
+   sr_nat_mapping_added(nat, mapping, false);
+   
    return mapping;
 }
 
@@ -709,6 +1610,29 @@ static sr_nat_mapping_t * natTrustedLookupInternal(sr_nat_t *nat, uint32_t ip_in
    sr_nat_mapping_type type)
 {
    sr_nat_mapping_t *mappingWalker;
+   
+   if (nat->deterministic)
+   {
+      /* Only the host's own block needs searching. */
+      sr_nat_deterministic_t *deterministic = nat->deterministic;
+      unsigned int host = ntohl(ip_int) - deterministic->firstHost;
+      sr_nat_mapping_t **slots;
+      unsigned int slot;
+      
+      if (host >= deterministic->hosts)
+      {
+         return NULL;
+      }
+      slots = deterministic->slots[type] + host * deterministic->portsPerHost;
+      for (slot = 0; slot < deterministic->portsPerHost; slot++)
+      {
+         if (slots[slot] && (slots[slot]->aux_int == aux_int) && (slots[slot]->ip_int == ip_int))
+         {
+            return slots[slot];
+         }
+      }
+      return NULL;
+   }
       
    for (mappingWalker = nat->mappings; mappingWalker != NULL; mappingWalker = mappingWalker->next)
    {
@@ -736,6 +1660,15 @@ static sr_nat_mapping_t * natTrustedLookupInternal(sr_nat_t *nat, uint32_t ip_in
 static sr_nat_mapping_t * natTrustedLookupExternal(sr_nat_t * nat, uint16_t aux_ext,
    sr_nat_mapping_type type)
 {
+   if (nat->deterministic)
+   {
+      /* The port alone gives the host and the slot. */
+      unsigned int slot = ntohs(aux_ext) - STARTING_PORT_NUMBER;
+      
+      return (slot < nat->deterministic->hosts * nat->deterministic->portsPerHost)
+         ? nat->deterministic->slots[type][slot] : NULL;
+   }
+   
    for (sr_nat_mapping_t * mappingWalker = nat->mappings; mappingWalker != NULL ; mappingWalker =
       mappingWalker->next)
    {
@@ -766,7 +1699,7 @@ static sr_nat_connection_t * natTrustedFindConnection(sr_nat_mapping_t *natEntry
       if ((connectionIterator->external.ipAddress == ip_ext) 
          && (connectionIterator->external.portNumber == port_ext))
       {
-         connectionIterator->lastAccessed = time(NULL);
+         connectionIterator->lastAccessed = sr_clock_now();
          break;
       }
       
@@ -775,6 +1708,186 @@ static sr_nat_connection_t * natTrustedFindConnection(sr_nat_mapping_t *natEntry
    return connectionIterator;
 }
 
+/**
+ * natLookupOutboundTcp()\n
+ * @brief sr_nat_lookup_internal() for a TCP segment from an internal host 
+ *        which, when flows are exported, also counts the segment against 
+ *        its connection under the same lock.
+ * @param nat pointer to the NAT state structure.
+ * @param ipPacket the outbound segment, not yet translated.
+ * @param length length of the IP datagram.
+ * @return a copy of the NAT mapping (must be freed by calling code), or NULL.
+ * @note A SYN opening a connection is counted where the connection is made.
+ */
+static sr_nat_mapping_t * natLookupOutboundTcp(sr_nat_t *nat, const sr_ip_hdr_t *ipPacket,
+   unsigned int length)
+{
+   const sr_tcp_hdr_t *tcpHeader = (const sr_tcp_hdr_t *) (((const uint8_t *) ipPacket)
+      + getIpHeaderLength(ipPacket));
+   sr_nat_mapping_t *copy = NULL;
+   sr_nat_connection_t *connection;
+   
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   sr_nat_mapping_t *lookupResult = natTrustedLookupInternal(nat, ipPacket->ip_src,
+      tcpHeader->sourcePort, nat_mapping_tcp);
+   
+   if (lookupResult != NULL)
+   {
+      lookupResult->last_updated = sr_clock_now();
+      copy = malloc(sizeof(sr_nat_mapping_t));
+      assert(copy);
+      memcpy(copy, lookupResult, sizeof(sr_nat_mapping_t));
+      
+      if (nat->routerState && nat->routerState->flows)
+      {
+         connection = natTrustedFindConnection(lookupResult, ipPacket->ip_dst,
+            tcpHeader->destinationPort);
+         if (connection)
+         {
+            natFlowCount(connection, nat_conn_internal, length);
+         }
+      }
+   }
+   
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   return copy;
+}
+
+/**
+ * natTrustedTrackTeardown()\n
+ * Description:\n
+ *    Follows a connection's close. A FIN moves it to nat_conn_time_wait and 
+ *    records the sequence number just past the FIN. Once each endpoint has 
+ *    acknowledged the other's FIN, or on a RST, the connection is closed: 
+ *    it keeps its external port for the short TIME_WAIT timeout only, 
+ *    instead of the transitory one, so the port goes back to the allocator 
+ *    soon after the close. An inbound RST only closes the connection if its 
+ *    sequence number is within SR_NAT_RST_WINDOW of the next one expected 
+ *    from the external endpoint, so a stray or spoofed RST can't take the 
+ *    port of a live connection. Until that is known (a connection adopted 
+ *    from another router), a RST leaves the connection on the transitory 
+ *    timeout, as RFC 7857 section 2.2 recommends.
+ * @brief Tracks FINs, their final ACKs and RSTs of a TCP connection.
+ * @param nat pointer to NAT structure.
+ * @param mapping shared pointer to the connection's mapping.
+ * @param connection shared pointer to the connection the segment belongs to.
+ * @param ipPacket IP datagram carrying the segment, not yet translated.
+ * @param length length of the IP datagram.
+ * @param sender endpoint that sent the segment.
+ * @warning Assumes the NAT structure is locked.
+ */
+static void natTrustedTrackTeardown(sr_nat_t *nat, sr_nat_mapping_t *mapping,
+   sr_nat_connection_t *connection, sr_ip_hdr_t *ipPacket, unsigned int length,
+   sr_nat_conn_endpoint_t sender)
+{
+   sr_tcp_hdr_t *tcpHeader = getTcpHeaderFromIpHeader(ipPacket);
+   uint16_t controlBits = ntohs(tcpHeader->offset_controlBits);
+   sr_nat_conn_endpoint_t receiver = (sender == nat_conn_internal) ? nat_conn_external : nat_conn_internal;
+   sr_nat_tcp_conn_state_t previousState = connection->connectionState;
+   uint8_t previousFinSent = connection->finSent;
+   uint8_t previousFinAcked = connection->finAcked;
+   uint32_t sequence = ntohl(tcpHeader->sequenceNumber);
+   unsigned int payload = length - getIpHeaderLength(ipPacket) - ((controlBits >> 12) * 4);
+   
+   if (previousState == nat_conn_closed)
+   {
+      return;
+   }
+   
+   if (controlBits & TCP_RST_M)
+   {
+      if ((sender == nat_conn_internal) || (connection->externalSequenceKnown
+         && ((uint32_t) (sequence - connection->externalSequence + SR_NAT_RST_WINDOW)
+            <= 2 * SR_NAT_RST_WINDOW)))
+      {
+         natSetConnectionState(connection, nat_conn_closed);
+         nat->portStats.closedByReset++;
+      }
+      else if (!connection->externalSequenceKnown)
+      {
+         natSetConnectionState(connection, nat_conn_time_wait);
+      }
+   }
+   else
+   {
+      if (sender == nat_conn_external)
+      {
+         connection->externalSequence = sequence + payload + ((controlBits & TCP_FIN_M) ? 1 : 0);
+         connection->externalSequenceKnown = true;
+      }
+      
+      if (controlBits & TCP_FIN_M)
+      {
+         /* The FIN takes the sequence number after the segment's data. */
+         connection->finSequence[sender] = sequence + payload + 1;
+         connection->finSent |= (1 << sender);
+         natSetConnectionState(connection, nat_conn_time_wait);
+      }
+      
+      if ((controlBits & TCP_ACK_M) && (connection->finSent & (1 << receiver))
+         && ((int32_t) (ntohl(tcpHeader->acknowledgmentNumber) - connection->finSequence[receiver]) >= 0))
+      {
+         connection->finAcked |= (1 << receiver);
+      }
+      
+      if (connection->finAcked == ((1 << nat_conn_internal) | (1 << nat_conn_external)))
+      {
+         natSetConnectionState(connection, nat_conn_closed);
+         nat->portStats.closedByFin++;
+      }
+   }
+   
+   if (connection->connectionState != previousState)
+   {
+      /* TIME_WAIT counts from the close. */
+      connection->lastAccessed = sr_clock_now();
+      sr_nat_update_closing(mapping);
+   }
+   
+   /* The standby needs the FIN progress too, or it could not close a 
+    * connection it takes over in TIME_WAIT. */
+   if ((connection->connectionState != previousState) || (connection->finSent != previousFinSent)
+      || (connection->finAcked != previousFinAcked))
+   {
+      natSyncRecord(nat, nat_sync_connection_update, mapping, connection);
+   }
+}
+
+/**
+ * natSamplePortUse()\n
+ * @brief Records how many external ports each mapping type holds. Called 
+ *        once a second from the timeout sweep.
+ * @warning Assumes the NAT structure is locked.
+ */
+static void natSamplePortUse(sr_nat_t *nat)
+{
+   sr_nat_port_stats_t *stats = &nat->portStats;
+   sr_nat_mapping_t *mapping;
+   unsigned int tcp = 0, icmp = 0;
+   
+   for (mapping = nat->mappings; mapping != NULL; mapping = mapping->next)
+   {
+      if (mapping->type == nat_mapping_tcp)
+      {
+         tcp++;
+      }
+      else if (mapping->type == nat_mapping_icmp)
+      {
+         icmp++;
+      }
+   }
+   
+   stats->tcp[stats->next] = tcp;
+   stats->icmp[stats->next] = icmp;
+   stats->next = (stats->next + 1) % SR_NAT_PORT_HISTORY;
+   if (stats->samples < SR_NAT_PORT_HISTORY)
+   {
+      stats->samples++;
+   }
+   stats->peakTcp = (tcp > stats->peakTcp) ? tcp : stats->peakTcp;
+   stats->peakIcmp = (icmp > stats->peakIcmp) ? icmp : stats->peakIcmp;
+}
+
 /**
  * natHandleTcpPacket()\n
  * @brief Function processes a TCP packet when NAT functionality is enabled. 
@@ -791,48 +1904,72 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
    if (!TcpPerformIntegrityCheck(ipPacket, length))
    {
       LOG_MESSAGE("Received TCP packet with bad checksum. Dropping.\n");
+      SR_PROBE_DROP("tcp_checksum", length);
       return;
    }
    
-   if ((getInternalInterface(sr)->ip == receivedInterface->ip) && (IpDestinationIsUs(sr, ipPacket)))
+   /* Internal hosts reaching each other through an external address and 
+    * mapped port go through the NAT (hairpinning) rather than to us. */
+   if ((getInternalInterface(sr)->ip == receivedInterface->ip) && (IpDestinationIsUs(sr, ipPacket))
+      && !natIsHairpinPacket(sr, ipPacket, tcpHeader->destinationPort, nat_mapping_tcp))
    {
       IpHandleReceivedPacketToUs(sr, ipPacket, length, receivedInterface);
    }
    else if (getInternalInterface(sr)->ip == receivedInterface->ip)
    {
-      sr_nat_mapping_t * natMapping = sr_nat_lookup_internal(sr->nat, ipPacket->ip_src,
-         tcpHeader->sourcePort, nat_mapping_tcp);
+      if (!sr_policer_admit_packet(sr->nat->policer, ipPacket->ip_src, length))
+      {
+         LOG_MESSAGE("Outbound TCP packet over its host's rate. Dropping.\n");
+         SR_PROBE_DROP("nat_rate", length);
+         return;
+      }
+      
+      sr_nat_mapping_t * natMapping = natLookupOutboundTcp(sr->nat, ipPacket, length);
       
       if (ntohs(tcpHeader->offset_controlBits) & TCP_SYN_M)
       {
          if (natMapping == NULL)
          {
             /* Outbound SYN with no prior mapping. Create one! */
-            pthread_mutex_lock(&(sr->nat->lock));
-            sr_nat_connection_t *firstConnection = malloc(sizeof(sr_nat_connection_t));
+            sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+            sr_nat_connection_t *firstConnection;
             sr_nat_mapping_t *sharedNatMapping;
-            natMapping = malloc(sizeof(sr_nat_mapping_t));
-            assert(firstConnection); assert(natMapping);
             
             sharedNatMapping = natTrustedCreateMapping(sr->nat, ipPacket->ip_src,
                tcpHeader->sourcePort, nat_mapping_tcp);
-            assert(sharedNatMapping);
+            if (sharedNatMapping == NULL)
+            {
+               sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+               LOG_MESSAGE("Outbound SYN over its host's NAT mapping quota. Dropping.\n");
+               SR_PROBE_DROP("nat_quota", length);
+               return;
+            }
+            
+            firstConnection = malloc(sizeof(sr_nat_connection_t));
+            natMapping = malloc(sizeof(sr_nat_mapping_t));
+            assert(firstConnection); assert(natMapping);
             
             /* Fill in first connection information. */
             firstConnection->connectionState = nat_conn_outbound_syn;
-            firstConnection->lastAccessed = time(NULL);
+            firstConnection->lastAccessed = sr_clock_now();
             firstConnection->queuedInboundSyn = NULL;
+            firstConnection->finSent = 0;
+            firstConnection->finAcked = 0;
+            firstConnection->externalSequenceKnown = false;
             firstConnection->external.ipAddress = ipPacket->ip_dst;
             firstConnection->external.portNumber = tcpHeader->destinationPort;
+            sr_nat_start_flow(firstConnection);
+            natFlowCount(firstConnection, nat_conn_internal, length);
             
             /* Add to the list of connections. */
             firstConnection->next = sharedNatMapping->conns;
             sharedNatMapping->conns = firstConnection;
+            natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, firstConnection);
             
             /* Create a copy so we can keep using it after we unlock the NAT table. */
             memcpy(natMapping, sharedNatMapping, sizeof(sr_nat_mapping_t));
             
-            pthread_mutex_unlock(&(sr->nat->lock));
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
             
             LOG_MESSAGE("Added new TCP mapping %u.%u.%u.%u:%u <-> %u.\n", 
                (ntohl(natMapping->ip_int) >> 24) & 0xFF, (ntohl(natMapping->ip_int) >> 16) & 0xFF, 
@@ -842,10 +1979,20 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
          else
          {
             /* Outbound SYN with prior mapping. Add the connection if one doesn't exist */
-            pthread_mutex_lock(&(sr->nat->lock));
+            sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
             sr_nat_mapping_t *sharedNatMapping = natTrustedLookupInternal(sr->nat, ipPacket->ip_src,
                tcpHeader->sourcePort, nat_mapping_tcp);
-            assert(sharedNatMapping);
+            
+            if (sharedNatMapping == NULL)
+            {
+               /* The mapping timed out since it was looked up. Drop the SYN; 
+                * the retry will create a new one. */
+               sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+               LOG_MESSAGE("TCP mapping expired while handling outbound SYN. Dropping.\n");
+               SR_PROBE_DROP("nat_no_mapping", length);
+               free(natMapping);
+               return;
+            }
             
             sr_nat_connection_t *connection = natTrustedFindConnection(sharedNatMapping,
                ipPacket->ip_dst, tcpHeader->destinationPort);
@@ -858,35 +2005,54 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
                
                /* Fill in connection information. */
                connection->connectionState = nat_conn_outbound_syn;
+               connection->lastAccessed = sr_clock_now();
+               connection->queuedInboundSyn = NULL;
+               connection->finSent = 0;
+               connection->finAcked = 0;
+               connection->externalSequenceKnown = false;
                connection->external.ipAddress = ipPacket->ip_dst;
                connection->external.portNumber = tcpHeader->destinationPort;
+               sr_nat_start_flow(connection);
+               natFlowCount(connection, nat_conn_internal, length);
                
                /* Add to the list of connections. */
                connection->next = sharedNatMapping->conns;
                sharedNatMapping->conns = connection;
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
                
                LOG_MESSAGE("Added new connection to TCP mapping %u.%u.%u.%u:%u <-> %u.\n", 
                   (ntohl(natMapping->ip_int) >> 24) & 0xFF, (ntohl(natMapping->ip_int) >> 16) & 0xFF, 
                   (ntohl(natMapping->ip_int) >> 8) & 0xFF, ntohl(natMapping->ip_int) & 0xFF, 
                   ntohs(natMapping->aux_int), ntohs(natMapping->aux_ext));
             }
-            else if (connection->connectionState == nat_conn_time_wait)
+            else if ((connection->connectionState == nat_conn_time_wait)
+               || (connection->connectionState == nat_conn_closed))
             {
                /* Give client opportunity to reopen the connection. */
-               connection->connectionState = nat_conn_outbound_syn;
+               natSetConnectionState(connection, nat_conn_outbound_syn);
+               connection->finSent = 0;
+               connection->finAcked = 0;
+               connection->externalSequenceKnown = false;
+               sr_nat_update_closing(sharedNatMapping);
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
             }
             else if (connection->connectionState == nat_conn_inbound_syn_pending)
             {
-               connection->connectionState = nat_conn_connected;
+               natSetConnectionState(connection, nat_conn_connected);
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
                
                /* As per lab instructions, silently drop the original 
                 * unsolicited inbound SYN */
-               if (connection->queuedInboundSyn) { free(connection->queuedInboundSyn); }
+               if (connection->queuedInboundSyn) 
+               { 
+                  free(connection->queuedInboundSyn); 
+                  connection->queuedInboundSyn = NULL;
+               }
             }
             /* Only other options are connected and outbound syn, in which we 
              * assume this is a retried packet. */
             
-            pthread_mutex_unlock(&(sr->nat->lock));
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          }
       }
       else if (natMapping == NULL)
@@ -895,23 +2061,26 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
           * connection. What to do? Silently drop the packet. */
          LOG_MESSAGE("Outbound non-SYN TCP packet attempted to traverse NAT "
             "when no mapping existed. Dropping.\n");
+         SR_PROBE_DROP("nat_no_mapping", length);
          return;
       }
-      else if (ntohs(tcpHeader->offset_controlBits) & TCP_FIN_M)
+      else if ((ntohs(tcpHeader->offset_controlBits) & (TCP_FIN_M | TCP_RST_M))
+         || ((ntohs(tcpHeader->offset_controlBits) & TCP_ACK_M) && natMapping->closingConnections))
       {
-         /* Outbound FIN detected. Put connection into TIME_WAIT state. */
-         pthread_mutex_lock(&(sr->nat->lock));
+         /* Outbound FIN or RST, or an ACK that may finish a close. */
+         sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          sr_nat_mapping_t *sharedNatMapping = natTrustedLookupInternal(sr->nat, ipPacket->ip_src,
             tcpHeader->sourcePort, nat_mapping_tcp);
-         sr_nat_connection_t *associatedConnection = natTrustedFindConnection(sharedNatMapping, 
-            ipPacket->ip_dst, tcpHeader->destinationPort);
+         sr_nat_connection_t *associatedConnection = sharedNatMapping ? natTrustedFindConnection(
+            sharedNatMapping, ipPacket->ip_dst, tcpHeader->destinationPort) : NULL;
          
          if (associatedConnection)
          {
-            associatedConnection->connectionState = nat_conn_time_wait;
+            natTrustedTrackTeardown(sr->nat, sharedNatMapping, associatedConnection, ipPacket, length,
+               nat_conn_internal);
          }
          
-         pthread_mutex_unlock(&(sr->nat->lock));
+         sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
       }
       
       /* All NAT state updating done by this point. Translate and forward. */
@@ -932,22 +2101,55 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
             /* In the case that there is no mapping, no hole can be blown 
              * through the NAT for simultaneous open. Thus we immediately call 
              * the port as closed. */
+            SR_PROBE_DROP("nat_no_mapping", length);
             IpSendTypeThreeIcmpPacket(sr, icmp_code_destination_port_unreachable, ipPacket);
             return;
          }
          else
          {
             /* Potential simultaneous open */
-            pthread_mutex_lock(&(sr->nat->lock));
+            sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
             
             sr_nat_mapping_t *sharedNatMapping = natTrustedLookupExternal(sr->nat, 
                tcpHeader->destinationPort, nat_mapping_tcp);
-            assert(sharedNatMapping);
+            
+            if (sharedNatMapping == NULL)
+            {
+               /* The mapping timed out since it was looked up, so there is 
+                * no longer a hole for this SYN. */
+               sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+               SR_PROBE_DROP("nat_no_mapping", length);
+               IpSendTypeThreeIcmpPacket(sr, icmp_code_destination_port_unreachable, ipPacket);
+               free(natMapping);
+               return;
+            }
             
             sr_nat_connection_t *connection = natTrustedFindConnection(sharedNatMapping,
                ipPacket->ip_src, tcpHeader->sourcePort);
             
-            if (connection == NULL)
+            if ((connection == NULL) && sr->nat->endpointIndependentFiltering)
+            {
+               /* Endpoint independent filtering: any peer may open a 
+                * connection to a mapped port. Track it, with nothing queued, 
+                * until the internal host answers, and let the SYN through. */
+               connection = malloc(sizeof(sr_nat_connection_t));
+               assert(connection);
+               
+               connection->connectionState = nat_conn_inbound_syn_pending;
+               connection->lastAccessed = sr_clock_now();
+               connection->queuedInboundSyn = NULL;
+               connection->finSent = 0;
+               connection->finAcked = 0;
+               connection->externalSequenceKnown = false;
+               connection->external.ipAddress = ipPacket->ip_src;
+               connection->external.portNumber = tcpHeader->sourcePort;
+               sr_nat_start_flow(connection);
+               
+               connection->next = sharedNatMapping->conns;
+               sharedNatMapping->conns = connection;
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
+            }
+            else if (connection == NULL)
             {
                /* Potential simultaneous open. */
                connection = malloc(sizeof(sr_nat_connection_t));
@@ -955,33 +2157,56 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
                
                /* Fill in connection information. */
                connection->connectionState = nat_conn_inbound_syn_pending;
+               connection->lastAccessed = sr_clock_now();
                connection->queuedInboundSyn = malloc(length);
+               connection->finSent = 0;
+               connection->finAcked = 0;
+               connection->externalSequenceKnown = false;
                memcpy(connection->queuedInboundSyn, ipPacket, length);
                connection->external.ipAddress = ipPacket->ip_src;
                connection->external.portNumber = tcpHeader->sourcePort;
+               sr_nat_start_flow(connection);
                
                /* Add to the list of connections. */
                connection->next = sharedNatMapping->conns;
                sharedNatMapping->conns = connection;
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
                
                LOG_MESSAGE("Added new connection to TCP mapping %u.%u.%u.%u:%u <-> %u.\n", 
                   (ntohl(natMapping->ip_int) >> 24) & 0xFF, (ntohl(natMapping->ip_int) >> 16) & 0xFF, 
                   (ntohl(natMapping->ip_int) >> 8) & 0xFF, ntohl(natMapping->ip_int) & 0xFF, 
                   ntohs(natMapping->aux_int), ntohs(natMapping->aux_ext));
+               sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+               free(natMapping);
                return;
             }
+            else if ((connection->connectionState == nat_conn_inbound_syn_pending)
+               && (connection->queuedInboundSyn == NULL) && sr->nat->endpointIndependentFiltering)
+            {
+               /* Retry of an inbound SYN already let through. Pass it on too. */
+               connection->lastAccessed = sr_clock_now();
+            }
             else if (connection->connectionState == nat_conn_inbound_syn_pending)
             {
                /* Retry of inbound SYN. Silently drop. */
+               SR_PROBE_DROP("nat_syn_retry", length);
+               sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+               free(natMapping);
                return;
             }
             else if (connection->connectionState == nat_conn_outbound_syn)
             {
                /* Connection UP! */
-               connection->connectionState = nat_conn_connected;
+               natSetConnectionState(connection, nat_conn_connected);
+               natSyncRecord(sr->nat, nat_sync_connection_update, sharedNatMapping, connection);
             }
+            /* Inbound RSTs are checked against the peer's sequence numbers 
+             * from here on. */
+            connection->externalSequence = ntohl(tcpHeader->sequenceNumber) + 1;
+            connection->externalSequenceKnown = true;
+            natFlowCount(connection, nat_conn_external, length);
             
-            pthread_mutex_unlock(&(sr->nat->lock));
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          }
       }
       else if (natMapping == NULL)
@@ -990,45 +2215,70 @@ static void natHandleTcpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsigne
           * connection. What to do? LOUDLY drop the packet. */
          LOG_MESSAGE("Inbound non-SYN TCP packet attempted to traverse NAT "
             "when no mapping existed. Dropping.\n");
+         SR_PROBE_DROP("nat_no_mapping", length);
          IpSendTypeThreeIcmpPacket(sr, icmp_code_destination_port_unreachable, ipPacket);
          return;
       }
-      else if (ntohs(tcpHeader->offset_controlBits) & TCP_FIN_M)
+      else if (ntohs(tcpHeader->offset_controlBits) & (TCP_FIN_M | TCP_RST_M))
       {
-         /* Inbound FIN detected. Put connection into TIME_WAIT state. */
-         pthread_mutex_lock(&(sr->nat->lock));
+         /* Inbound FIN or RST. Follow the teardown. */
+         sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          sr_nat_mapping_t *sharedNatMapping = natTrustedLookupExternal(sr->nat, 
             tcpHeader->destinationPort, nat_mapping_tcp);
-         sr_nat_connection_t *associatedConnection = natTrustedFindConnection(sharedNatMapping, 
-            ipPacket->ip_src, tcpHeader->sourcePort);
+         sr_nat_connection_t *associatedConnection = sharedNatMapping ? natTrustedFindConnection(
+            sharedNatMapping, ipPacket->ip_src, tcpHeader->sourcePort) : NULL;
          
          if (associatedConnection)
          {
-            associatedConnection->connectionState = nat_conn_time_wait;
+            natFlowCount(associatedConnection, nat_conn_external, length);
+            natTrustedTrackTeardown(sr->nat, sharedNatMapping, associatedConnection, ipPacket, length,
+               nat_conn_external);
          }
          
-         pthread_mutex_unlock(&(sr->nat->lock));
+         sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
       }
       else
       {
          /* Lookup the associated connection to "touch" it and keep it alive. */
-         pthread_mutex_lock(&(sr->nat->lock));
+         sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          sr_nat_mapping_t *sharedNatMapping = natTrustedLookupExternal(sr->nat, 
             tcpHeader->destinationPort, nat_mapping_tcp);
-         sr_nat_connection_t *associatedConnection = natTrustedFindConnection(sharedNatMapping, 
-            ipPacket->ip_src, tcpHeader->sourcePort);
+         sr_nat_connection_t *associatedConnection = sharedNatMapping ? natTrustedFindConnection(
+            sharedNatMapping, ipPacket->ip_src, tcpHeader->sourcePort) : NULL;
          
-         if (associatedConnection == NULL)
+         if (sharedNatMapping == NULL)
+         {
+            /* The mapping timed out since it was looked up. */
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+            
+            LOG_MESSAGE("Inbound TCP packet's mapping expired. Dropping.\n");
+            SR_PROBE_DROP("nat_no_mapping", length);
+            free(natMapping);
+            return;
+         }
+         else if ((associatedConnection == NULL) && sr->nat->endpointIndependentFiltering)
+         {
+            /* Filtering is on the mapping alone; the connection simply isn't 
+             * tracked (e.g. it predates a NAT restart). */
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+         }
+         else if (associatedConnection == NULL)
          {
             /* Received unsolicited non-SYN packet when no active connection was found. */
-            pthread_mutex_unlock(&(sr->nat->lock));
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
             
             LOG_MESSAGE("Received non-SYN inbound TCP packet, but no active associated connection. Dropping.\n");
+            SR_PROBE_DROP("nat_no_connection", length);
+            free(natMapping);
             return;
          }
          else
          {
-            pthread_mutex_unlock(&(sr->nat->lock));
+            /* May be the ACK that finishes a close. */
+            natFlowCount(associatedConnection, nat_conn_external, length);
+            natTrustedTrackTeardown(sr->nat, sharedNatMapping, associatedConnection, ipPacket, length,
+               nat_conn_external);
+            sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
          }
       }
       
@@ -1055,6 +2305,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
    if (!IcmpPerformIntegrityCheck(icmpHeader, length - getIpHeaderLength(ipPacket)))
    {
       LOG_MESSAGE("Received ICMP packet with bad checksum. Dropping.\n");
+      SR_PROBE_DROP("icmp_checksum", length);
       return;
    }
    
@@ -1064,6 +2315,13 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
    }
    else if (getInternalInterface(sr)->ip == receivedInterface->ip)
    {
+      if (!sr_policer_admit_packet(sr->nat->policer, ipPacket->ip_src, length))
+      {
+         LOG_MESSAGE("Outbound ICMP packet over its host's rate. Dropping.\n");
+         SR_PROBE_DROP("nat_rate", length);
+         return;
+      }
+      
       if ((icmpHeader->icmp_type == icmp_type_echo_request)
          || (icmpHeader->icmp_type == icmp_type_echo_reply))
       {
@@ -1076,6 +2334,12 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
          {
             natLookupResult = sr_nat_insert_mapping(sr->nat, ipPacket->ip_src, icmpPingHdr->ident,
                nat_mapping_icmp);
+            if (natLookupResult == NULL)
+            {
+               LOG_MESSAGE("Outbound echo over its host's NAT mapping quota. Dropping.\n");
+               SR_PROBE_DROP("nat_quota", length);
+               return;
+            }
          }
          
          natHandleReceivedOutboundIpPacket(sr, ipPacket, length, receivedInterface, natLookupResult);
@@ -1103,6 +2367,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
              * assignment is hard enough as it is. */
             LOG_MESSAGE("Dropping unsupported outbound ICMP packet Type: %u Code: %u.\n",
                icmpHeader->icmp_type, icmpHeader->icmp_code);
+            SR_PROBE_DROP("nat_icmp_type", length);
             return;
          }
          
@@ -1132,6 +2397,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
          {
             /* No way we have a mapping for an unsupported protocol. 
              * Silently drop the packet. */
+            SR_PROBE_DROP("nat_protocol", length);
             return;
          }
          
@@ -1141,6 +2407,10 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
                natLookupResult);
             free(natLookupResult);
          }
+         else
+         {
+            SR_PROBE_DROP("nat_no_mapping", length);
+         }
       }
    }
    else /* Inbound ICMP packet */
@@ -1157,6 +2427,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
          else
          {
             LOG_MESSAGE("Unsolicited inbound ICMP packet received attempting to send to internal IP. Dropping.\n");
+            SR_PROBE_DROP("nat_unsolicited", length);
          }
          return;
       }
@@ -1164,6 +2435,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
       {
          /* Disallow sending packet to our internal interface. */
          LOG_MESSAGE("Received ICMP packet to our internal interface. Dropping.\n");
+         SR_PROBE_DROP("nat_internal_address", length);
          //TODO: Type 3 ICMP response?
          return;
       }
@@ -1208,6 +2480,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
              * assignment is hard enough as it is. */
             LOG_MESSAGE("Dropping unsupported inbound ICMP packet Type: %u Code: %u.\n",
                icmpHeader->icmp_type, icmpHeader->icmp_code);
+            SR_PROBE_DROP("nat_icmp_type", length);
             return;
          }
          
@@ -1236,6 +2509,7 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
          {
             /* No way we have a mapping for an unsupported protocol. 
              * Silently drop the packet. */
+            SR_PROBE_DROP("nat_protocol", length);
             return;
          }
          
@@ -1245,6 +2519,10 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
                natLookupResult);
             free(natLookupResult);
          }
+         else
+         {
+            SR_PROBE_DROP("nat_no_mapping", length);
+         }
       }
    }
 }
@@ -1262,6 +2540,11 @@ static void natHandleIcmpPacket(sr_instance_t* sr, sr_ip_hdr_t* ipPacket, unsign
 static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
    unsigned int length, const struct sr_if* const receivedInterface, sr_nat_mapping_t * natMapping)
 {
+   if (natMapping)
+   {
+      SR_TRACE(SR_TRACE_NAT, "outbound by mapping " SR_TRACE_IP_FORMAT ":%u <-> %u",
+         SR_TRACE_IP(natMapping->ip_int), ntohs(natMapping->aux_int), ntohs(natMapping->aux_ext));
+   }
    if (packet->ip_p == ip_protocol_icmp)
    {
       sr_icmp_hdr_t *icmpPacketHeader = (sr_icmp_hdr_t *) (((uint8_t*) packet)
@@ -1289,7 +2572,7 @@ static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_
       else
       {
          int icmpLength = length - getIpHeaderLength(packet);
-         sr_ip_hdr_t * originalDatagram;
+         sr_ip_hdr_t * originalDatagram = NULL;
          if (icmpPacketHeader->icmp_type == icmp_type_desination_unreachable)
          {
             /* This packet is actually associated with a stream. */
@@ -1301,6 +2584,13 @@ static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_
             sr_icmp_t11_hdr_t *unreachablePacketHeader = (sr_icmp_t11_hdr_t *) icmpPacketHeader;
             originalDatagram = (sr_ip_hdr_t*) (unreachablePacketHeader->data);
          }
+         
+         if (originalDatagram == NULL)
+         {
+            /* Only errors that quote a datagram are translated. */
+            SR_PROBE_DROP("nat_icmp_type", length);
+            return;
+         }
             
          assert(natMapping);
          
@@ -1338,13 +2628,25 @@ static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_
    else if (packet->ip_p == ip_protocol_tcp)
    {
       sr_tcp_hdr_t* tcpHeader = (sr_tcp_hdr_t *) (((uint8_t*) packet) + getIpHeaderLength(packet));
+      sr_if_t *externalInterface = sr_get_interface(sr,
+         IpGetPacketRoute(sr, ntohl(packet->ip_dst))->interface);
       
       tcpHeader->sourcePort = natMapping->aux_ext;
-      packet->ip_src = sr_get_interface(sr,
-         IpGetPacketRoute(sr, ntohl(packet->ip_dst))->interface)->ip;
+      packet->ip_src = externalInterface->ip;
       
       natRecalculateTcpChecksum(packet, length);
-      IpForwardIpPacket(sr, packet, length, receivedInterface);
+      
+      if (packet->ip_dst == packet->ip_src)
+      {
+         /* Addressed to another internal host's mapping. Loop the 
+          * translated packet back in as though it arrived from outside, 
+          * so it's filtered and translated like any inbound packet. */
+         natHandleTcpPacket(sr, packet, length, externalInterface);
+      }
+      else
+      {
+         IpForwardIpPacket(sr, packet, length, receivedInterface);
+      }
    }
    /* If another protocol, should have been dropped by now. */
 }
@@ -1362,6 +2664,11 @@ static void natHandleReceivedOutboundIpPacket(struct sr_instance* sr, sr_ip_hdr_
 static void natHandleReceivedInboundIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet, 
    unsigned int length, const struct sr_if* const receivedInterface, sr_nat_mapping_t * natMapping)
 {
+   if (natMapping)
+   {
+      SR_TRACE(SR_TRACE_NAT, "inbound by mapping " SR_TRACE_IP_FORMAT ":%u <-> %u",
+         SR_TRACE_IP(natMapping->ip_int), ntohs(natMapping->aux_int), ntohs(natMapping->aux_ext));
+   }
    if (packet->ip_p == ip_protocol_icmp)
    {
       sr_icmp_hdr_t *icmpPacketHeader = getIcmpHeaderFromIpHeader(packet);
@@ -1387,7 +2694,7 @@ static void natHandleReceivedInboundIpPacket(struct sr_instance* sr, sr_ip_hdr_t
       else 
       {
          int icmpLength = length - getIpHeaderLength(packet);
-         sr_ip_hdr_t * originalDatagram;
+         sr_ip_hdr_t * originalDatagram = NULL;
          if (icmpPacketHeader->icmp_type == icmp_type_desination_unreachable)
          {
             /* This packet is actually associated with a stream. */
@@ -1399,6 +2706,13 @@ static void natHandleReceivedInboundIpPacket(struct sr_instance* sr, sr_ip_hdr_t
             sr_icmp_t11_hdr_t *unreachablePacketHeader = (sr_icmp_t11_hdr_t *) icmpPacketHeader;
             originalDatagram = (sr_ip_hdr_t*) (unreachablePacketHeader->data);
          }
+         
+         if (originalDatagram == NULL)
+         {
+            /* Only errors that quote a datagram are translated. */
+            SR_PROBE_DROP("nat_icmp_type", length);
+            return;
+         }
             
          assert(natMapping);
          
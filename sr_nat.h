@@ -13,6 +13,8 @@
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 #include "sr_protocol.h"
 
@@ -25,12 +27,25 @@
 
 #define SIMULTANIOUS_OPEN_WAIT_TIME (6)
 
+/** How far an inbound RST's sequence number may be from the one expected 
+ (the largest unscaled TCP window) for it to close the connection. */
+#define SR_NAT_RST_WINDOW     (65535)
+
+#define SR_NAT_PORT_POOL_SIZE (LAST_PORT_NUMBER - STARTING_PORT_NUMBER + 1) /**< Per mapping type. */
+#define SR_NAT_PORT_HISTORY   (60) /**< One second samples of port use kept. */
+#define SR_NAT_MAPPING_TYPES  (2)
+
+#define DEFAULT_INTERNAL_INTERFACE_NAME "eth1"
+
 /*
  * Public Types
  */
 
 struct sr_instance;
 struct sr_if;
+struct sr_nat_sync;
+struct sr_policer;
+struct sr_natlog;
 
 typedef enum
 {
@@ -43,9 +58,17 @@ typedef enum
    nat_conn_outbound_syn, /**< outbound SYN sent. */
    nat_conn_inbound_syn_pending, /**< inbound SYN received (and queued). */
    nat_conn_connected, /**< SYNs sent in both directions. Connection established. */
-   nat_conn_time_wait /**< One of the endpoints has sent a FIN. */
+   nat_conn_time_wait, /**< One of the endpoints has sent a FIN, or an unverifiable RST was seen. */
+   nat_conn_closed /**< Both FINs acknowledged, or reset. Held for the TIME_WAIT timeout. */
 } sr_nat_tcp_conn_state_t;
 
+typedef enum
+{
+   nat_conn_internal, /**< The host behind the NAT. */
+   nat_conn_external, /**< The host it is talking to. */
+   nat_conn_endpoints
+} sr_nat_conn_endpoint_t;
+
 typedef struct sr_nat_connection
 {
    /* add TCP connection state data members here */
@@ -59,6 +82,18 @@ typedef struct sr_nat_connection
       uint16_t portNumber;
    } external;
    
+   /* teardown, indexed by sr_nat_conn_endpoint_t */
+   uint8_t finSent; /**< Bit per endpoint that has sent a FIN. */
+   uint8_t finAcked; /**< Bit per endpoint whose FIN the other has acknowledged. */
+   uint32_t finSequence[nat_conn_endpoints]; /**< Sequence number just past each FIN. */
+   uint32_t externalSequence; /**< Next sequence number expected from the external endpoint. */
+   bool externalSequenceKnown; /**< False until an inbound segment has been seen. */
+   
+   /* flow export (sr_flow.h), indexed by sr_nat_conn_endpoint_t */
+   uint64_t packets[nat_conn_endpoints]; /**< Sent by each endpoint since the last flow record. */
+   uint64_t bytes[nat_conn_endpoints];
+   time_t flowStarted; /**< Connection created, or the last flow record. */
+   
    struct sr_nat_connection *next;
 } sr_nat_connection_t;
 
@@ -71,9 +106,49 @@ typedef struct sr_nat_mapping
    uint16_t aux_ext; /* external port or icmp id */
    time_t last_updated; /* use to timeout mappings */
    struct sr_nat_connection *conns; /* list of connections. null for ICMP */
+   unsigned int closingConnections; /* connections in nat_conn_time_wait */
    struct sr_nat_mapping *next;
 } sr_nat_mapping_t;
 
+/** External ports in use over time, and how TCP connections gave theirs back. */
+typedef struct
+{
+   uint16_t tcp[SR_NAT_PORT_HISTORY]; /**< Ring of samples, one a second. */
+   uint16_t icmp[SR_NAT_PORT_HISTORY];
+   unsigned int next;
+   unsigned int samples;
+   unsigned int peakTcp;
+   unsigned int peakIcmp;
+   
+   uint64_t closedByFin; /**< Both FINs acknowledged. */
+   uint64_t closedByReset;
+   uint64_t reclaimed; /**< Closed connections removed after TIME_WAIT. */
+} sr_nat_port_stats_t;
+
+/** External ports handed to one internal host at a time in port block mode. */
+typedef struct
+{
+   uint32_t owner; /**< Internal address, network byte order. Meaningless while unused. */
+   uint16_t used; /**< Mappings in the block. */
+} sr_nat_port_block_t;
+
+/** 
+ * Deterministic NAT (RFC 7422): internal host firstHost + n may only map 
+ * from external ports STARTING_PORT_NUMBER + n * portsPerHost onwards, so 
+ * an external port names its internal host without a lookup, and the port 
+ * assignment never needs logging mapping by mapping.
+ */
+typedef struct
+{
+   uint32_t firstHost; /**< Host byte order. */
+   unsigned int hosts;
+   unsigned int portsPerHost;
+   /* Mappings by external port - STARTING_PORT_NUMBER, so hosts * 
+    * portsPerHost entries; a host's own ports are its slice. */
+   struct sr_nat_mapping **slots[SR_NAT_MAPPING_TYPES];
+   uint16_t *nextSlot[SR_NAT_MAPPING_TYPES]; /**< Per host, where the search for a free port starts. */
+} sr_nat_deterministic_t;
+
 typedef struct sr_nat
 {
    /* add any fields here */
@@ -86,6 +161,33 @@ typedef struct sr_nat
    unsigned int tcpTransitoryTimeout;
    unsigned int tcpEstablishedTimeout;
    unsigned int icmpTimeout;
+   unsigned int tcpTimeWaitTimeout; /**< Seconds a closed connection keeps its port. */
+   
+   sr_nat_port_stats_t portStats;
+   
+   struct sr_nat_sync *sync; /**< Replication to a standby router. NULL if disabled. */
+   struct sr_policer *policer; /**< Per internal host limits. NULL if hosts aren't policed. */
+   struct sr_natlog *log; /**< Compliance log. NULL if mappings aren't logged. */
+   uint32_t logExternalIp; /**< Logged external address, network byte order. 0 until known. */
+   
+   /* Port block mode: each internal host maps from blocks of portBlockSize 
+    * ports of its own, and only blocks are logged. Off while portBlockSize 
+    * is 0. */
+   unsigned int portBlockSize;
+   unsigned int portBlockCount; /**< Per mapping type. */
+   sr_nat_port_block_t *portBlocks[SR_NAT_MAPPING_TYPES];
+   unsigned int nextPortBlock[SR_NAT_MAPPING_TYPES];
+   
+   /* Endpoint independent filtering (RFC 4787 REQ-8, RFC 5382 REQ-3): once 
+    * an internal socket has a mapping, any external host may reach it through 
+    * that port, not only the hosts it has contacted. Mappings are always 
+    * endpoint independent, one external port per internal socket. */
+   bool endpointIndependentFiltering;
+   
+   sr_nat_deterministic_t *deterministic; /**< NULL unless ports are assigned per host. */
+   bool timeoutsSuspended; /**< Set while this router is a standby. */
+   bool hasTimeoutThread; /**< False if sr_nat_tick() is driven by the caller. */
+   char internalInterfaceName[sr_IFACE_NAMELEN]; /**< Interface facing the private network. */
    
    /* threading */
    pthread_mutex_t lock;
@@ -103,8 +205,50 @@ typedef struct sr_nat
  */
 
 int sr_nat_init(struct sr_nat *nat); /* Initializes the nat */
+int sr_nat_init_state(struct sr_nat *nat); /* Initializes the nat without a timeout thread */
 int sr_nat_destroy(struct sr_nat *nat); /* Destroys the nat (free memory) */
 void *sr_nat_timeout(void *nat_ptr); /* Periodic Timeout */
+void sr_nat_tick(struct sr_nat *nat); /* One pass of the periodic timeout */
+void sr_nat_print(const struct sr_instance *sr, FILE *out); /* Port use and teardown counters */
+
+/* Starts logging mapping (or, with blockSize, port block) creation and 
+ deletion to numbered files at path. Returns 0, or -1 if the log couldn't be 
+ opened. */
+int sr_nat_log_start(struct sr_nat *nat, const char *path, uint64_t rotateBytes,
+   unsigned int blockSize);
+void sr_nat_log_stop(struct sr_nat *nat); /* Flushes and closes the log */
+
+/* Parses "a.b.c.d/len[:ports per host]" into the hosts of a deterministic 
+ NAT. Without a port count, the pool is shared out evenly. Returns 0, or -1 
+ if malformed or the hosts need more ports than the pool has. */
+int sr_nat_deterministic_parse(const char *spec, uint32_t *firstHost, unsigned int *hosts,
+   unsigned int *portsPerHost);
+
+/* Fixes each of hosts internal addresses from firstHost (host byte order) 
+ to a block of portsPerHost external ports. Must come before any mapping 
+ and before the log is started. Returns 0, or -1 if the blocks don't fit. */
+int sr_nat_set_deterministic(struct sr_nat *nat, uint32_t firstHost, unsigned int hosts,
+   unsigned int portsPerHost);
+
+/* Hooks for a mapping entering or leaving the table: keep the deterministic 
+ port index and the port block counts in step, then log the mapping or its 
+ block (not for mappings adopted in a hot upgrade, which the old process 
+ logged). Every path that adds or removes mappings calls them. Assume the 
+ NAT is locked. */
+void sr_nat_mapping_added(struct sr_nat *nat, struct sr_nat_mapping *mapping, bool adopted);
+void sr_nat_mapping_removed(struct sr_nat *nat, struct sr_nat_mapping *mapping);
+
+/* Starts a new connection's flow counters. Every path that creates a 
+ connection calls it. */
+void sr_nat_start_flow(struct sr_nat_connection *connection);
+
+/* Exports a flow record for every connection with unreported packets, as 
+ when the router shuts down. */
+void sr_nat_flush_flows(struct sr_nat *nat);
+
+/* Recounts the mapping's closing connections after any of their states 
+ changed. Assumes the NAT is locked. */
+void sr_nat_update_closing(struct sr_nat_mapping *mapping);
 
 /* Get the mapping associated with given external port.
  You must free the returned structure if it is not NULL. */
@@ -0,0 +1,1093 @@
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "sr_nat_sync.h"
+#include "sr_policer.h"
+#include "sr_router.h"
+#include "sr_clock.h"
+#include "sr_codec.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+/* Wire format. Each batch is a frame:
+ *
+ *    uint32_t payload length | uint16_t record count | records...
+ *
+ * Each record starts with a flags byte holding the op, the mapping type and
+ * "same as previous record" bits, followed by varints. The external port or
+ * ident is always sent as a zig-zag delta from the previous record, so runs
+ * of events for neighbouring mappings cost a byte or two. A connection
+ * update carries its state, a byte of FIN sent/acked bits and the sequence
+ * number of every FIN sent, so a standby can finish a close it takes over
+ * in TIME_WAIT. The delta base
+ * resets at every frame, so frames can be decoded independently. A frame
+ * with no records is a heartbeat. */
+#define NAT_SYNC_FRAME_HDR_LEN      (6)
+#define NAT_SYNC_MAX_RECORD_LEN     (28)
+
+#define NAT_SYNC_OP_MASK            (0x07)
+#define NAT_SYNC_FLAG_TCP           (0x08)
+#define NAT_SYNC_FLAG_SAME_INTERNAL (0x10) /**< ip_int/aux_int unchanged from previous record */
+#define NAT_SYNC_FLAG_SAME_EXTERNAL (0x20) /**< externalIp unchanged from previous record */
+
+#define NAT_SYNC_LISTEN_BACKLOG     (1)
+#define NAT_SYNC_ACCEPT_POLL_MS     (200)
+#define NAT_SYNC_RECONNECT_POLL_MS  (100)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Macros
+ *-----------------------------------------------------------------------------
+ */
+
+#ifdef DONT_DEFINE_UNLESS_DEBUGGING
+# define LOG_MESSAGE(...) fprintf(stderr, __VA_ARGS__)
+#else
+# define LOG_MESSAGE(...)
+#endif
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+/** Delta base shared by the encoder and decoder. Each field only changes
+ * on the record kinds that carry it. */
+typedef struct
+{
+   uint16_t auxExt;
+   uint32_t ipInt;
+   uint16_t auxInt;
+   uint32_t externalIp;
+} natSyncDeltaBase_t;
+
+typedef struct
+{
+   uint8_t buffer[SR_NAT_SYNC_MAX_FRAME];
+   size_t length;
+   uint16_t count;
+   natSyncDeltaBase_t base;
+} natSyncEncoder_t;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *natSyncSenderThread(void *syncPtr);
+static void natSyncAcceptPeer(sr_nat_sync_t *sync);
+static bool natSyncSendEvents(sr_nat_sync_t *sync, const sr_nat_sync_event_t *events, unsigned int count);
+static bool natSyncSendSnapshot(sr_nat_sync_t *sync);
+
+static void natSyncCopyConnection(sr_nat_sync_event_t *event, const sr_nat_connection_t *connection);
+static void natSyncEncoderReset(natSyncEncoder_t *encoder);
+static void natSyncEncode(natSyncEncoder_t *encoder, const sr_nat_sync_event_t *event);
+static bool natSyncFlush(sr_nat_sync_t *sync, natSyncEncoder_t *encoder);
+static int natSyncConnect(const struct sockaddr_un *address);
+static int natSyncReconnect(const struct sockaddr_un *address);
+static void natSyncClearTable(sr_nat_t *nat);
+static int natSyncApplyFrame(sr_nat_t *nat, const uint8_t *payload, size_t length, uint16_t count);
+static void natSyncApplyEvent(sr_nat_t *nat, const sr_nat_sync_event_t *event);
+
+static bool natSyncWriteAll(int fd, const uint8_t *buffer, size_t length);
+static int natSyncReadAll(int fd, uint8_t *buffer, size_t length);
+static unsigned int natSyncMillisecondsSince(const struct timespec *then);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_nat_sync_start_active()\n
+ * @brief Starts replicating the NAT table to a standby router.
+ * @param nat pointer to the (initialized) NAT state structure.
+ * @param socketPath path of the Unix socket the standby connects to.
+ * @return replication state, or NULL if the socket could not be created.
+ */
+sr_nat_sync_t *sr_nat_sync_start_active(sr_nat_t *nat, const char *socketPath)
+{
+   sr_nat_sync_t *sync;
+
+   assert(nat);
+   assert(socketPath);
+
+   sync = calloc(1, sizeof(sr_nat_sync_t));
+   assert(sync);
+   sync->nat = nat;
+   sync->peerFd = -1;
+   sync->pending = malloc(SR_NAT_SYNC_PENDING_MAX * sizeof(sr_nat_sync_event_t));
+   sync->sending = malloc(SR_NAT_SYNC_PENDING_MAX * sizeof(sr_nat_sync_event_t));
+   assert(sync->pending && sync->sending);
+
+   sync->address.sun_family = AF_UNIX;
+   strncpy(sync->address.sun_path, socketPath, sizeof(sync->address.sun_path) - 1);
+
+   sync->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (sync->listenFd < 0)
+   {
+      perror("socket(..):sr_nat_sync.c::sr_nat_sync_start_active");
+      goto fail;
+   }
+
+   /* A previous active (or a process we were hot-upgraded from) may have
+    * left the path behind. */
+   unlink(sync->address.sun_path);
+   if ((bind(sync->listenFd, (struct sockaddr *) &(sync->address), sizeof(sync->address)) != 0)
+      || (listen(sync->listenFd, NAT_SYNC_LISTEN_BACKLOG) != 0))
+   {
+      perror("bind(..):sr_nat_sync.c::sr_nat_sync_start_active");
+      close(sync->listenFd);
+      goto fail;
+   }
+
+   pthread_mutex_init(&(sync->lock), NULL);
+   pthread_cond_init(&(sync->wakeup), NULL);
+   pthread_create(&(sync->thread), NULL, natSyncSenderThread, sync);
+   sr_sched_apply(sync->thread, SR_SCHED_SYNC);
+
+   printf("Replicating NAT state to standby on %s\n", sync->address.sun_path);
+   return sync;
+
+fail:
+   free(sync->pending);
+   free(sync->sending);
+   free(sync);
+   return NULL;
+}
+
+/**
+ * sr_nat_sync_stop()\n
+ * @brief Stops the sender thread and releases replication state.
+ * @param sync replication state from sr_nat_sync_start_active().
+ * @note The socket path is intentionally left in place; a process that
+ *       took over from us may already own it.
+ */
+void sr_nat_sync_stop(sr_nat_sync_t *sync)
+{
+   if (sync == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&(sync->lock));
+   sync->stopRequested = true;
+   pthread_cond_signal(&(sync->wakeup));
+   pthread_mutex_unlock(&(sync->lock));
+   pthread_join(sync->thread, NULL);
+
+   /* Stop listening first, or a standby that sees the peer socket close
+    * could reconnect to us and mistake this for a replaced active. */
+   close(sync->listenFd);
+   if (sync->peerFd >= 0)
+   {
+      close(sync->peerFd);
+   }
+
+   pthread_cond_destroy(&(sync->wakeup));
+   pthread_mutex_destroy(&(sync->lock));
+   free(sync->pending);
+   free(sync->sending);
+   free(sync);
+}
+
+/**
+ * sr_nat_sync_run_standby()\n
+ * Description:\n
+ *    Connects to the active router (retrying until it is up) and applies
+ *    its replication stream to the local NAT table. Blocks until the active
+ *    router goes away: its socket closes or it misses heartbeats for
+ *    SR_NAT_SYNC_DEAD_INTERVAL_MS. All mapping and connection timers are
+ *    then restarted, since idle times are not replicated.
+ * @brief Runs this router as a hot standby for the NAT table.
+ * @param nat pointer to the (initialized) NAT state structure.
+ * @param socketPath path of the active router's replication socket.
+ * @return 0 when it is time to take over, -1 on shutdown or a protocol error.
+ */
+int sr_nat_sync_run_standby(sr_nat_t *nat, const char *socketPath)
+{
+   struct sockaddr_un address;
+   uint8_t *payload = malloc(SR_NAT_SYNC_MAX_FRAME);
+   bool announced = false;
+   int fd = -1;
+   int ret = 0;
+
+   assert(nat);
+   assert(payload);
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+
+   /* Wait for the active router to come up. */
+   while ((fd = natSyncConnect(&address)) < 0)
+   {
+      if (!announced)
+      {
+         printf("Standby waiting for active router on %s\n", address.sun_path);
+         announced = true;
+      }
+      if (srShutdownRequested || (sleep(1) != 0))
+      {
+         free(payload);
+         return -1;
+      }
+   }
+
+   printf("Standby connected. Mirroring NAT state.\n");
+
+   while (1)
+   {
+      struct pollfd activePoll = { .fd = fd, .events = POLLIN };
+      uint8_t header[NAT_SYNC_FRAME_HDR_LEN];
+      uint32_t length;
+      uint16_t count;
+      int pollResult = poll(&activePoll, 1, SR_NAT_SYNC_DEAD_INTERVAL_MS);
+
+      if ((pollResult < 0) && (errno == EINTR) && !srShutdownRequested)
+      {
+         continue;
+      }
+      else if (pollResult < 0)
+      {
+         ret = -1;
+         break;
+      }
+      else if (pollResult == 0)
+      {
+         printf("Active router missed its heartbeats.\n");
+         break;
+      }
+
+      length = 0;
+      if ((natSyncReadAll(fd, header, sizeof(header)) != 0)
+         || ((length = ntohl(*((uint32_t *) header))) > SR_NAT_SYNC_MAX_FRAME)
+         || (natSyncReadAll(fd, payload, length) != 0))
+      {
+         /* A hot-upgraded active re-opens the socket right away. Only take
+          * over if nobody does within the dead interval. */
+         close(fd);
+         if ((fd = natSyncReconnect(&address)) < 0)
+         {
+            printf("Active router closed the replication socket.\n");
+            break;
+         }
+         printf("Active router was replaced. Resyncing.\n");
+         natSyncClearTable(nat);
+         continue;
+      }
+      count = ntohs(*((uint16_t *) (header + sizeof(uint32_t))));
+
+      if (natSyncApplyFrame(nat, payload, length, count) != 0)
+      {
+         fprintf(stderr, "Malformed NAT replication frame. Refusing to take over.\n");
+         ret = -1;
+         break;
+      }
+   }
+
+   if (fd >= 0)
+   {
+      close(fd);
+   }
+   free(payload);
+
+   if (ret == 0)
+   {
+      time_t now = sr_clock_now();
+      sr_nat_mapping_t *mappingIterator;
+      sr_nat_connection_t *connectionIterator;
+      unsigned int mappings = 0;
+
+      sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+      for (mappingIterator = nat->mappings; mappingIterator; mappingIterator = mappingIterator->next)
+      {
+         mappingIterator->last_updated = now;
+         for (connectionIterator = mappingIterator->conns; connectionIterator;
+            connectionIterator = connectionIterator->next)
+         {
+            connectionIterator->lastAccessed = now;
+         }
+         mappings++;
+      }
+      sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+
+      printf("Standby taking over with %u NAT mappings.\n", mappings);
+   }
+
+   return ret;
+}
+
+/**
+ * NatSyncTrustedRecord()\n
+ * @brief Records a NAT table change for replication.
+ * @param sync replication state.
+ * @param op kind of change.
+ * @param mapping mapping that changed (or that owns the connection).
+ * @param connection connection that changed. NULL for mapping operations.
+ * @warning Assumes the NAT lock is held. Only copies the event; encoding and
+ *          sending happen on the sender thread.
+ */
+void NatSyncTrustedRecord(sr_nat_sync_t *sync, sr_nat_sync_op_t op, const sr_nat_mapping_t *mapping,
+   const sr_nat_connection_t *connection)
+{
+   sr_nat_sync_event_t *event;
+
+   pthread_mutex_lock(&(sync->lock));
+
+   /* Nobody to replicate to, or the standby will be resynced anyway. */
+   if ((sync->peerFd < 0) || sync->resyncNeeded)
+   {
+      pthread_mutex_unlock(&(sync->lock));
+      return;
+   }
+
+   if (sync->pendingCount == SR_NAT_SYNC_PENDING_MAX)
+   {
+      /* Standby fell behind. Drop the backlog and send a full snapshot. */
+      sync->pendingCount = 0;
+      sync->resyncNeeded = true;
+      pthread_cond_signal(&(sync->wakeup));
+      pthread_mutex_unlock(&(sync->lock));
+      return;
+   }
+
+   event = &(sync->pending[sync->pendingCount++]);
+   event->op = op;
+   event->type = (uint8_t) mapping->type;
+   event->ip_int = mapping->ip_int;
+   event->aux_int = mapping->aux_int;
+   event->aux_ext = mapping->aux_ext;
+   if (connection)
+   {
+      natSyncCopyConnection(event, connection);
+   }
+   else
+   {
+      event->connectionState = 0;
+      event->finSent = 0;
+      event->finAcked = 0;
+      event->externalIp = 0;
+      event->externalPort = 0;
+   }
+   sync->eventsRecorded++;
+
+   if (sync->pendingCount == SR_NAT_SYNC_BATCH_EVENTS)
+   {
+      pthread_cond_signal(&(sync->wakeup));
+   }
+
+   pthread_mutex_unlock(&(sync->lock));
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * natSyncSenderThread()\n
+ * @brief Accepts the standby and streams batched events to it.
+ * @param syncPtr pointer to the replication state.
+ */
+static void *natSyncSenderThread(void *syncPtr)
+{
+   sr_nat_sync_t *sync = (sr_nat_sync_t *) syncPtr;
+   struct timespec lastSent;
+
+   clock_gettime(CLOCK_MONOTONIC, &lastSent);
+   sr_watchdog_register("nat sync");
+
+   while (1)
+   {
+      struct timespec deadline;
+      sr_nat_sync_event_t *swap;
+      unsigned int count;
+      bool resync;
+      bool sent = true;
+
+      sr_watchdog_idle();
+      if (sync->peerFd < 0)
+      {
+         if (sync->stopRequested)
+         {
+            break;
+         }
+         natSyncAcceptPeer(sync);
+         continue;
+      }
+
+      pthread_mutex_lock(&(sync->lock));
+      if ((sync->pendingCount < SR_NAT_SYNC_BATCH_EVENTS) && !sync->resyncNeeded
+         && !sync->stopRequested)
+      {
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += SR_NAT_SYNC_BATCH_INTERVAL_MS * 1000000L;
+         if (deadline.tv_nsec >= 1000000000L)
+         {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+         }
+         pthread_cond_timedwait(&(sync->wakeup), &(sync->lock), &deadline);
+      }
+
+      if (sync->stopRequested)
+      {
+         pthread_mutex_unlock(&(sync->lock));
+         break;
+      }
+
+      swap = sync->sending;
+      sync->sending = sync->pending;
+      sync->pending = swap;
+      count = sync->pendingCount;
+      sync->pendingCount = 0;
+      resync = sync->resyncNeeded;
+      sync->resyncNeeded = false;
+      pthread_mutex_unlock(&(sync->lock));
+
+      sr_watchdog_stage(SR_WATCHDOG_NAT_SYNC);
+      if (resync)
+      {
+         /* Everything just swapped out predates the snapshot. */
+         sent = natSyncSendSnapshot(sync);
+         clock_gettime(CLOCK_MONOTONIC, &lastSent);
+      }
+      else if (count > 0)
+      {
+         sent = natSyncSendEvents(sync, sync->sending, count);
+         clock_gettime(CLOCK_MONOTONIC, &lastSent);
+      }
+      else if (natSyncMillisecondsSince(&lastSent) >= SR_NAT_SYNC_HEARTBEAT_MS)
+      {
+         sent = natSyncSendEvents(sync, NULL, 0);
+         clock_gettime(CLOCK_MONOTONIC, &lastSent);
+      }
+
+      if (!sent)
+      {
+         fprintf(stderr, "Lost NAT standby. Waiting for it to reconnect.\n");
+         pthread_mutex_lock(&(sync->lock));
+         close(sync->peerFd);
+         sync->peerFd = -1;
+         sync->pendingCount = 0;
+         pthread_mutex_unlock(&(sync->lock));
+      }
+   }
+
+   sr_watchdog_unregister();
+   return NULL;
+}
+
+/**
+ * natSyncAcceptPeer()\n
+ * @brief Waits briefly for a standby to connect and schedules a full resync.
+ */
+static void natSyncAcceptPeer(sr_nat_sync_t *sync)
+{
+   struct pollfd listenPoll = { .fd = sync->listenFd, .events = POLLIN };
+   int peerFd;
+
+   if (poll(&listenPoll, 1, NAT_SYNC_ACCEPT_POLL_MS) != 1)
+   {
+      return;
+   }
+
+   peerFd = accept(sync->listenFd, NULL, NULL);
+   if (peerFd < 0)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&(sync->lock));
+   sync->peerFd = peerFd;
+   sync->pendingCount = 0;
+   sync->resyncNeeded = true;
+   pthread_mutex_unlock(&(sync->lock));
+
+   printf("NAT standby connected.\n");
+}
+
+/**
+ * natSyncSendSnapshot()\n
+ * @brief Sends the whole NAT table as a series of create/update events.
+ * @note The table is copied under the NAT lock and encoded after it is
+ *       released, so the packet path is only held up for the copy.
+ */
+static bool natSyncSendSnapshot(sr_nat_sync_t *sync)
+{
+   sr_nat_mapping_t *mappingIterator;
+   sr_nat_connection_t *connectionIterator;
+   sr_nat_sync_event_t *events;
+   unsigned int count = 0;
+   unsigned int capacity = 0;
+   bool ret;
+
+   sr_watchdog_lock(&(sync->nat->lock), SR_WATCHDOG_LOCK_NAT);
+
+   for (mappingIterator = sync->nat->mappings; mappingIterator; mappingIterator = mappingIterator->next)
+   {
+      capacity++;
+      for (connectionIterator = mappingIterator->conns; connectionIterator;
+         connectionIterator = connectionIterator->next)
+      {
+         capacity++;
+      }
+   }
+
+   events = malloc((capacity + 1) * sizeof(sr_nat_sync_event_t));
+   assert(events);
+
+   for (mappingIterator = sync->nat->mappings; mappingIterator; mappingIterator = mappingIterator->next)
+   {
+      sr_nat_sync_event_t *event = &events[count++];
+      memset(event, 0, sizeof(sr_nat_sync_event_t));
+      event->op = nat_sync_mapping_create;
+      event->type = (uint8_t) mappingIterator->type;
+      event->ip_int = mappingIterator->ip_int;
+      event->aux_int = mappingIterator->aux_int;
+      event->aux_ext = mappingIterator->aux_ext;
+
+      for (connectionIterator = mappingIterator->conns; connectionIterator;
+         connectionIterator = connectionIterator->next)
+      {
+         sr_nat_sync_event_t *connectionEvent = &events[count++];
+         *connectionEvent = *event;
+         connectionEvent->op = nat_sync_connection_update;
+         natSyncCopyConnection(connectionEvent, connectionIterator);
+      }
+   }
+
+   sr_watchdog_unlock(&(sync->nat->lock), SR_WATCHDOG_LOCK_NAT);
+
+   sync->resyncs++;
+   ret = natSyncSendEvents(sync, events, count);
+   free(events);
+   return ret;
+}
+
+/**
+ * natSyncSendEvents()\n
+ * @brief Encodes events into as many frames as needed and writes them out.
+ * @return false if the standby went away.
+ */
+static bool natSyncSendEvents(sr_nat_sync_t *sync, const sr_nat_sync_event_t *events, unsigned int count)
+{
+   static natSyncEncoder_t encoder; /* Only ever used by the sender thread. */
+   unsigned int i;
+
+   natSyncEncoderReset(&encoder);
+   for (i = 0; i < count; i++)
+   {
+      if (encoder.length + NAT_SYNC_MAX_RECORD_LEN > SR_NAT_SYNC_MAX_FRAME)
+      {
+         if (!natSyncFlush(sync, &encoder))
+         {
+            return false;
+         }
+      }
+      natSyncEncode(&encoder, &events[i]);
+   }
+
+   sync->eventsSent += count;
+   return natSyncFlush(sync, &encoder);
+}
+
+/**
+ * natSyncCopyConnection()\n
+ * @brief Fills in the connection part of an event.
+ */
+static void natSyncCopyConnection(sr_nat_sync_event_t *event, const sr_nat_connection_t *connection)
+{
+   event->connectionState = (uint8_t) connection->connectionState;
+   event->finSent = connection->finSent;
+   event->finAcked = connection->finAcked;
+   event->externalIp = connection->external.ipAddress;
+   event->externalPort = connection->external.portNumber;
+   memcpy(event->finSequence, connection->finSequence, sizeof(event->finSequence));
+}
+
+static void natSyncEncoderReset(natSyncEncoder_t *encoder)
+{
+   encoder->length = NAT_SYNC_FRAME_HDR_LEN;
+   encoder->count = 0;
+   memset(&(encoder->base), 0, sizeof(natSyncDeltaBase_t));
+}
+
+/**
+ * natSyncEncode()\n
+ * @brief Appends one delta-encoded record to the frame being built.
+ */
+static void natSyncEncode(natSyncEncoder_t *encoder, const sr_nat_sync_event_t *event)
+{
+   uint8_t *cursor = encoder->buffer + encoder->length;
+   uint8_t *flags = cursor++;
+   int32_t delta = (int32_t) ntohs(event->aux_ext) - (int32_t) ntohs(encoder->base.auxExt);
+
+   *flags = event->op & NAT_SYNC_OP_MASK;
+   if (event->type == nat_mapping_tcp)
+   {
+      *flags |= NAT_SYNC_FLAG_TCP;
+   }
+   cursor = sr_codec_put_varint(cursor, (uint32_t) ((delta << 1) ^ (delta >> 31)));
+   encoder->base.auxExt = event->aux_ext;
+
+   if (event->op == nat_sync_mapping_create)
+   {
+      if ((event->ip_int == encoder->base.ipInt) && (event->aux_int == encoder->base.auxInt))
+      {
+         *flags |= NAT_SYNC_FLAG_SAME_INTERNAL;
+      }
+      else
+      {
+         memcpy(cursor, &(event->ip_int), sizeof(uint32_t));
+         cursor += sizeof(uint32_t);
+         cursor = sr_codec_put_varint(cursor, ntohs(event->aux_int));
+         encoder->base.ipInt = event->ip_int;
+         encoder->base.auxInt = event->aux_int;
+      }
+   }
+   else if ((event->op == nat_sync_connection_update) || (event->op == nat_sync_connection_delete))
+   {
+      if (event->externalIp == encoder->base.externalIp)
+      {
+         *flags |= NAT_SYNC_FLAG_SAME_EXTERNAL;
+      }
+      else
+      {
+         memcpy(cursor, &(event->externalIp), sizeof(uint32_t));
+         cursor += sizeof(uint32_t);
+         encoder->base.externalIp = event->externalIp;
+      }
+      cursor = sr_codec_put_varint(cursor, ntohs(event->externalPort));
+
+      if (event->op == nat_sync_connection_update)
+      {
+         int endpoint;
+
+         *cursor++ = event->connectionState;
+         *cursor++ = (uint8_t) (event->finSent | (event->finAcked << nat_conn_endpoints));
+         for (endpoint = 0; endpoint < nat_conn_endpoints; endpoint++)
+         {
+            if (event->finSent & (1 << endpoint))
+            {
+               uint32_t finSequence = htonl(event->finSequence[endpoint]);
+               memcpy(cursor, &finSequence, sizeof(uint32_t));
+               cursor += sizeof(uint32_t);
+            }
+         }
+      }
+   }
+
+   encoder->length = cursor - encoder->buffer;
+   encoder->count++;
+}
+
+/**
+ * natSyncFlush()\n
+ * @brief Writes the frame being built (possibly empty, i.e. a heartbeat).
+ */
+static bool natSyncFlush(sr_nat_sync_t *sync, natSyncEncoder_t *encoder)
+{
+   uint32_t payloadLength = htonl(encoder->length - NAT_SYNC_FRAME_HDR_LEN);
+   uint16_t count = htons(encoder->count);
+   bool ret;
+
+   memcpy(encoder->buffer, &payloadLength, sizeof(uint32_t));
+   memcpy(encoder->buffer + sizeof(uint32_t), &count, sizeof(uint16_t));
+
+   ret = natSyncWriteAll(sync->peerFd, encoder->buffer, encoder->length);
+   if (ret)
+   {
+      sync->batchesSent++;
+      sync->bytesSent += encoder->length;
+   }
+
+   natSyncEncoderReset(encoder);
+   return ret;
+}
+
+/**
+ * natSyncConnect()\n
+ * @return connected socket, or -1 if nobody is listening.
+ */
+static int natSyncConnect(const struct sockaddr_un *address)
+{
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+   if ((fd >= 0) && (connect(fd, (const struct sockaddr *) address, sizeof(*address)) != 0))
+   {
+      close(fd);
+      fd = -1;
+   }
+   return fd;
+}
+
+/**
+ * natSyncReconnect()\n
+ * @brief Retries the active router's socket for up to SR_NAT_SYNC_DEAD_INTERVAL_MS.
+ * @return connected socket, or -1 if the active router is really gone.
+ */
+static int natSyncReconnect(const struct sockaddr_un *address)
+{
+   struct timespec start;
+   int fd;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while ((fd = natSyncConnect(address)) < 0)
+   {
+      if (srShutdownRequested || (natSyncMillisecondsSince(&start) >= SR_NAT_SYNC_DEAD_INTERVAL_MS))
+      {
+         break;
+      }
+      poll(NULL, 0, NAT_SYNC_RECONNECT_POLL_MS);
+   }
+   return fd;
+}
+
+/**
+ * natSyncClearTable()\n
+ * @brief Drops the mirrored table before a new active router resyncs it.
+ */
+static void natSyncClearTable(sr_nat_t *nat)
+{
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   while (nat->mappings)
+   {
+      sr_nat_mapping_t *mapping = nat->mappings;
+      nat->mappings = mapping->next;
+      sr_policer_remove_mapping(nat->policer, mapping->ip_int);
+      sr_nat_mapping_removed(nat, mapping);
+      while (mapping->conns)
+      {
+         sr_nat_connection_t *connection = mapping->conns;
+         mapping->conns = connection->next;
+         free(connection);
+      }
+      free(mapping);
+   }
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+}
+
+/**
+ * natSyncApplyFrame()\n
+ * @brief Decodes a frame and applies it to the standby's NAT table.
+ * @return 0 on success, -1 if the frame is malformed.
+ */
+static int natSyncApplyFrame(sr_nat_t *nat, const uint8_t *payload, size_t length, uint16_t count)
+{
+   const uint8_t *cursor = payload;
+   const uint8_t *end = payload + length;
+   natSyncDeltaBase_t base;
+   sr_nat_sync_event_t event;
+   uint16_t i;
+
+   memset(&base, 0, sizeof(base));
+
+   sr_watchdog_lock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   for (i = 0; i < count; i++)
+   {
+      uint64_t value;
+      int32_t delta;
+      uint8_t flags;
+
+      if (cursor >= end)
+      {
+         goto malformed;
+      }
+      flags = *cursor++;
+
+      memset(&event, 0, sizeof(event));
+      event.op = flags & NAT_SYNC_OP_MASK;
+      event.type = (flags & NAT_SYNC_FLAG_TCP) ? nat_mapping_tcp : nat_mapping_icmp;
+
+      if ((cursor = sr_codec_get_varint(cursor, end, &value)) == NULL)
+      {
+         goto malformed;
+      }
+      delta = (int32_t) (value >> 1) ^ -((int32_t) (value & 1));
+      event.aux_ext = htons((uint16_t) (ntohs(base.auxExt) + delta));
+      base.auxExt = event.aux_ext;
+
+      if (event.op == nat_sync_mapping_create)
+      {
+         if (!(flags & NAT_SYNC_FLAG_SAME_INTERNAL))
+         {
+            if (end - cursor < (ptrdiff_t) sizeof(uint32_t))
+            {
+               goto malformed;
+            }
+            memcpy(&(base.ipInt), cursor, sizeof(uint32_t));
+            cursor += sizeof(uint32_t);
+            if ((cursor = sr_codec_get_varint(cursor, end, &value)) == NULL)
+            {
+               goto malformed;
+            }
+            base.auxInt = htons((uint16_t) value);
+         }
+         event.ip_int = base.ipInt;
+         event.aux_int = base.auxInt;
+      }
+      else if ((event.op == nat_sync_connection_update) || (event.op == nat_sync_connection_delete))
+      {
+         if (!(flags & NAT_SYNC_FLAG_SAME_EXTERNAL))
+         {
+            if (end - cursor < (ptrdiff_t) sizeof(uint32_t))
+            {
+               goto malformed;
+            }
+            memcpy(&(base.externalIp), cursor, sizeof(uint32_t));
+            cursor += sizeof(uint32_t);
+         }
+         event.externalIp = base.externalIp;
+         if ((cursor = sr_codec_get_varint(cursor, end, &value)) == NULL)
+         {
+            goto malformed;
+         }
+         event.externalPort = htons((uint16_t) value);
+
+         if (event.op == nat_sync_connection_update)
+         {
+            int endpoint;
+
+            if (end - cursor < 2)
+            {
+               goto malformed;
+            }
+            event.connectionState = *cursor++;
+            event.finSent = *cursor & ((1 << nat_conn_endpoints) - 1);
+            event.finAcked = *cursor++ >> nat_conn_endpoints;
+            for (endpoint = 0; endpoint < nat_conn_endpoints; endpoint++)
+            {
+               event.finSequence[endpoint] = 0;
+               if (event.finSent & (1 << endpoint))
+               {
+                  if (end - cursor < (ptrdiff_t) sizeof(uint32_t))
+                  {
+                     goto malformed;
+                  }
+                  memcpy(&(event.finSequence[endpoint]), cursor, sizeof(uint32_t));
+                  event.finSequence[endpoint] = ntohl(event.finSequence[endpoint]);
+                  cursor += sizeof(uint32_t);
+               }
+            }
+         }
+      }
+      else if (event.op != nat_sync_mapping_delete)
+      {
+         goto malformed;
+      }
+
+      natSyncApplyEvent(nat, &event);
+   }
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+
+   return (cursor == end) ? 0 : -1;
+
+malformed:
+   sr_watchdog_unlock(&(nat->lock), SR_WATCHDOG_LOCK_NAT);
+   return -1;
+}
+
+/**
+ * natSyncApplyEvent()\n
+ * @brief Applies one replicated change to the local NAT table.
+ * @warning Assumes the NAT lock is held.
+ * @note Events are idempotent: a create for an existing mapping updates it,
+ *       deletes of unknown entries are ignored. This lets a resync snapshot
+ *       overlap with events that were already sent.
+ */
+static void natSyncApplyEvent(sr_nat_t *nat, const sr_nat_sync_event_t *event)
+{
+   sr_nat_mapping_t *mapping, *prevMapping = NULL;
+   sr_nat_connection_t *connection, *prevConnection = NULL;
+
+   for (mapping = nat->mappings; mapping != NULL; prevMapping = mapping, mapping = mapping->next)
+   {
+      if ((mapping->type == event->type) && (mapping->aux_ext == event->aux_ext))
+      {
+         break;
+      }
+   }
+
+   switch (event->op)
+   {
+      case nat_sync_mapping_create:
+         if (mapping == NULL)
+         {
+            mapping = malloc(sizeof(sr_nat_mapping_t));
+            assert(mapping);
+            mapping->conns = NULL;
+            mapping->closingConnections = 0;
+            mapping->next = nat->mappings;
+            nat->mappings = mapping;
+            sr_policer_add_mapping(nat->policer, event->ip_int);
+         }
+         else
+         {
+            if (mapping->ip_int != event->ip_int)
+            {
+               sr_policer_remove_mapping(nat->policer, mapping->ip_int);
+               sr_policer_add_mapping(nat->policer, event->ip_int);
+            }
+            sr_nat_mapping_removed(nat, mapping);
+         }
+         mapping->type = (sr_nat_mapping_type) event->type;
+         mapping->ip_int = event->ip_int;
+         mapping->ip_ext = 0;
+         mapping->aux_int = event->aux_int;
+         mapping->aux_ext = event->aux_ext;
+         mapping->last_updated = sr_clock_now();
+         sr_nat_mapping_added(nat, mapping, false);
+         break;
+
+      case nat_sync_mapping_delete:
+         if (mapping)
+         {
+            if (prevMapping) { prevMapping->next = mapping->next; }
+            else { nat->mappings = mapping->next; }
+            sr_policer_remove_mapping(nat->policer, mapping->ip_int);
+            sr_nat_mapping_removed(nat, mapping);
+
+            while (mapping->conns)
+            {
+               connection = mapping->conns;
+               mapping->conns = connection->next;
+               free(connection);
+            }
+            free(mapping);
+         }
+         break;
+
+      case nat_sync_connection_update:
+      case nat_sync_connection_delete:
+         if (mapping == NULL)
+         {
+            LOG_MESSAGE("Replicated connection for unknown mapping %u. Ignoring.\n",
+               ntohs(event->aux_ext));
+            break;
+         }
+
+         for (connection = mapping->conns; connection != NULL;
+            prevConnection = connection, connection = connection->next)
+         {
+            if ((connection->external.ipAddress == event->externalIp)
+               && (connection->external.portNumber == event->externalPort))
+            {
+               break;
+            }
+         }
+
+         if (event->op == nat_sync_connection_update)
+         {
+            if (connection == NULL)
+            {
+               connection = malloc(sizeof(sr_nat_connection_t));
+               assert(connection);
+               connection->queuedInboundSyn = NULL;
+               connection->external.ipAddress = event->externalIp;
+               connection->external.portNumber = event->externalPort;
+               sr_nat_start_flow(connection);
+               connection->next = mapping->conns;
+               mapping->conns = connection;
+            }
+            connection->connectionState = (sr_nat_tcp_conn_state_t) event->connectionState;
+            connection->finSent = event->finSent;
+            connection->finAcked = event->finAcked;
+            connection->externalSequenceKnown = false;
+            memcpy(connection->finSequence, event->finSequence, sizeof(connection->finSequence));
+            connection->lastAccessed = sr_clock_now();
+         }
+         else if (connection)
+         {
+            if (prevConnection) { prevConnection->next = connection->next; }
+            else { mapping->conns = connection->next; }
+            free(connection);
+         }
+         sr_nat_update_closing(mapping);
+         break;
+
+      default:
+         break;
+   }
+}
+
+static bool natSyncWriteAll(int fd, const uint8_t *buffer, size_t length)
+{
+   while (length > 0)
+   {
+      ssize_t written = send(fd, buffer, length, MSG_NOSIGNAL);
+      if (written < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return false;
+      }
+      buffer += written;
+      length -= written;
+   }
+   return true;
+}
+
+/**
+ * natSyncReadAll()\n
+ * @return 0 once all bytes were read, -1 on EOF or error.
+ */
+static int natSyncReadAll(int fd, uint8_t *buffer, size_t length)
+{
+   while (length > 0)
+   {
+      ssize_t bytesRead = read(fd, buffer, length);
+      if (bytesRead < 0)
+      {
+         if (errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      else if (bytesRead == 0)
+      {
+         return -1;
+      }
+      buffer += bytesRead;
+      length -= bytesRead;
+   }
+   return 0;
+}
+
+static unsigned int natSyncMillisecondsSince(const struct timespec *then)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (unsigned int) ((now.tv_sec - then->tv_sec) * 1000
+      + (now.tv_nsec - then->tv_nsec) / 1000000);
+}
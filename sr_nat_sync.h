@@ -0,0 +1,110 @@
+/**
+ * @file sr_nat_sync.h
+ * @brief Active/standby replication of the NAT table between two routers.
+ *
+ * The active router records NAT mapping and connection changes into a
+ * pending buffer while it already holds the NAT lock. A sender thread
+ * periodically swaps the buffer out, delta-encodes the events into a batch
+ * and writes it to the standby over a local (Unix domain) socket, so the
+ * packet path never touches the socket. A standby that connects (or that
+ * falls behind) gets a full snapshot of the table first.
+ *
+ * The standby keeps a hot copy of the table with its timeouts suspended.
+ * When the active's socket closes (or goes silent for longer than
+ * SR_NAT_SYNC_DEAD_INTERVAL_MS) the standby refreshes all timers and takes
+ * over.
+ */
+
+#ifndef SR_NAT_SYNC_H
+#define SR_NAT_SYNC_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/un.h>
+
+#include "sr_nat.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_NAT_SYNC_PENDING_MAX        (4096)  /**< Events buffered before a resync is forced. */
+#define SR_NAT_SYNC_BATCH_EVENTS       (256)   /**< Wake the sender early at this many events. */
+#define SR_NAT_SYNC_BATCH_INTERVAL_MS  (10)    /**< Longest an event waits before being sent. */
+#define SR_NAT_SYNC_HEARTBEAT_MS       (500)   /**< Empty batch sent when idle. */
+#define SR_NAT_SYNC_DEAD_INTERVAL_MS   (2000)  /**< Standby takes over after this much silence. */
+#define SR_NAT_SYNC_MAX_FRAME          (16384) /**< Largest encoded batch in bytes. */
+
+/*
+ * Public Types
+ */
+
+typedef enum
+{
+   nat_sync_mapping_create = 1,
+   nat_sync_mapping_delete = 2,
+   nat_sync_connection_update = 3, /**< Connection created or changed state. */
+   nat_sync_connection_delete = 4
+} sr_nat_sync_op_t;
+
+/** One replicated change. Addresses and ports in network byte order, as in the NAT table. */
+typedef struct sr_nat_sync_event
+{
+   uint8_t op;
+   uint8_t type; /**< sr_nat_mapping_type */
+   uint8_t connectionState; /**< sr_nat_tcp_conn_state_t */
+   uint8_t finSent;  /**< as in sr_nat_connection_t */
+   uint8_t finAcked; /**< as in sr_nat_connection_t */
+   uint32_t ip_int;
+   uint16_t aux_int;
+   uint16_t aux_ext;
+   uint32_t externalIp;
+   uint16_t externalPort;
+   uint32_t finSequence[nat_conn_endpoints];
+} sr_nat_sync_event_t;
+
+typedef struct sr_nat_sync
+{
+   sr_nat_t *nat;
+   struct sockaddr_un address;
+   int listenFd;
+   int peerFd;
+
+   /* Double buffered event queue. "pending" is filled under the NAT lock,
+    * "sending" is owned by the sender thread. */
+   sr_nat_sync_event_t *pending;
+   sr_nat_sync_event_t *sending;
+   unsigned int pendingCount;
+   bool resyncNeeded;
+   bool stopRequested;
+
+   /* Statistics */
+   uint64_t eventsRecorded;
+   uint64_t eventsSent;
+   uint64_t batchesSent;
+   uint64_t bytesSent;
+   uint64_t resyncs;
+
+   /* threading */
+   pthread_mutex_t lock;
+   pthread_cond_t wakeup;
+   pthread_t thread;
+} sr_nat_sync_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_nat_sync_t *sr_nat_sync_start_active(sr_nat_t *nat, const char *socketPath);
+void sr_nat_sync_stop(sr_nat_sync_t *sync);
+int sr_nat_sync_run_standby(sr_nat_t *nat, const char *socketPath);
+
+void NatSyncTrustedRecord(sr_nat_sync_t *sync, sr_nat_sync_op_t op, const sr_nat_mapping_t *mapping,
+   const sr_nat_connection_t *connection);
+
+#endif /* SR_NAT_SYNC_H */
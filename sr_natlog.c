@@ -0,0 +1,420 @@
+/**
+ * @file sr_natlog.c
+ * @brief Compliance log of NAT mappings, written in the background.
+ *
+ * See sr_natlog.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sr_natlog.h"
+#include "sr_codec.h"
+#include "sr_nat.h"
+#include "sr_router.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define NATLOG_FILE_NAME_LEN       (16) /**< ".NNNNNN" and then some. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Macros
+ *-----------------------------------------------------------------------------
+ */
+
+#define NATLOG_RING_MASK           (SR_NATLOG_RING_RECORDS - 1)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+typedef struct
+{
+   uint8_t buffer[SR_NATLOG_MAX_FRAME];
+   size_t length;
+   uint16_t count;
+   uint64_t frameTimeUs; /**< Time of the frame's first record. */
+   sr_codec_natlog_base_t base;
+} natLogEncoder_t;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *natLogWriterThread(void *logPtr);
+static void natLogDrain(sr_natlog_t *log, natLogEncoder_t *encoder, uint64_t head);
+static void natLogFlush(sr_natlog_t *log, natLogEncoder_t *encoder);
+static int natLogOpenNext(sr_natlog_t *log);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_natlog_parse()\n
+ * @brief Parses "path[:megabytes per file[:ports per block]]".
+ * @param spec option argument.
+ * @param path receives the path.
+ * @param pathSize size of the path buffer.
+ * @param rotateBytes receives the file size limit; SR_NATLOG_DEFAULT_ROTATE
+ *        when not given.
+ * @param blockSize receives the port block size; 0 (log every mapping)
+ *        when not given.
+ * @return 0 on success, -1 if the specification is malformed.
+ */
+int sr_natlog_parse(const char *spec, char *path, size_t pathSize, uint64_t *rotateBytes,
+   unsigned int *blockSize)
+{
+   const char *field = strchr(spec, ':');
+   size_t pathLength = field ? (size_t) (field - spec) : strlen(spec);
+   char *end;
+   unsigned long value;
+
+   *rotateBytes = SR_NATLOG_DEFAULT_ROTATE;
+   *blockSize = 0;
+   if ((pathLength == 0) || (pathLength >= pathSize))
+   {
+      return -1;
+   }
+   memcpy(path, spec, pathLength);
+   path[pathLength] = '\0';
+   if (field == NULL)
+   {
+      return 0;
+   }
+
+   field++;
+   value = strtoul(field, &end, 10);
+   if ((end == field) || (value == 0) || ((*end != '\0') && (*end != ':')))
+   {
+      return -1;
+   }
+   *rotateBytes = (uint64_t) value * 1024 * 1024;
+   if (*end == '\0')
+   {
+      return 0;
+   }
+
+   field = end + 1;
+   value = strtoul(field, &end, 10);
+   if ((end == field) || (*end != '\0') || (value == 0) || (value > SR_NAT_PORT_POOL_SIZE))
+   {
+      return -1;
+   }
+   *blockSize = (unsigned int) value;
+   return 0;
+}
+
+/**
+ * sr_natlog_start()\n
+ * @brief Opens the first log file and starts the writer thread.
+ * @param path log files are named path.000001, path.000002, ... continuing
+ *        after any already there.
+ * @param rotateBytes size after which the next file is started.
+ * @param blockSize ports per block in port block mode, 0 to log mappings.
+ * @return log state, or NULL if no file could be opened.
+ */
+sr_natlog_t *sr_natlog_start(const char *path, uint64_t rotateBytes, unsigned int blockSize)
+{
+   sr_natlog_t *log;
+
+   assert(path);
+
+   if (posix_memalign((void **) &log, SR_NATLOG_CACHE_LINE, sizeof(sr_natlog_t)) != 0)
+   {
+      return NULL;
+   }
+   memset(log, 0, sizeof(sr_natlog_t));
+   log->ring = malloc(SR_NATLOG_RING_RECORDS * sizeof(sr_natlog_record_t));
+   log->path = strdup(path);
+   assert(log->ring && log->path);
+   log->rotateBytes = rotateBytes;
+   log->blockSize = blockSize;
+
+   if (natLogOpenNext(log) != 0)
+   {
+      free(log->ring);
+      free(log->path);
+      free(log);
+      return NULL;
+   }
+
+   pthread_create(&(log->thread), NULL, natLogWriterThread, log);
+   sr_sched_apply(log->thread, SR_SCHED_SYNC);
+
+   printf("Logging NAT %s to %s.%06u\n", blockSize ? "port blocks" : "mappings", log->path,
+      log->fileNumber);
+   return log;
+}
+
+/**
+ * sr_natlog_stop()\n
+ * @brief Writes out everything pushed so far, stops the writer thread and
+ *        releases the log.
+ * @param log log state from sr_natlog_start(). May be NULL.
+ * @warning Nothing may push to the log any more.
+ */
+void sr_natlog_stop(sr_natlog_t *log)
+{
+   if (log == NULL)
+   {
+      return;
+   }
+
+   __atomic_store_n(&log->stopRequested, true, __ATOMIC_RELEASE);
+   pthread_join(log->thread, NULL);
+
+   if (log->file)
+   {
+      fclose(log->file);
+   }
+   free(log->ring);
+   free(log->path);
+   free(log);
+}
+
+/**
+ * sr_natlog_push()\n
+ * @brief Queues a record for the writer thread.
+ * @param log log state. May be NULL, in which case nothing is logged.
+ * @param record record to copy into the ring.
+ * @warning Only one thread may push at a time; the NAT pushes under its lock.
+ */
+void sr_natlog_push(sr_natlog_t *log, const sr_natlog_record_t *record)
+{
+   uint64_t head;
+
+   if (log == NULL)
+   {
+      return;
+   }
+
+   head = log->head;
+   if (head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) >= SR_NATLOG_RING_RECORDS)
+   {
+      __atomic_add_fetch(&log->lost, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   log->ring[head & NATLOG_RING_MASK] = *record;
+   __atomic_store_n(&log->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * sr_natlog_print()\n
+ * @brief Prints how much has been logged and lost.
+ * @param sr pointer to simple router state structure. Nothing is printed
+ *        without a NAT log.
+ * @param out stream to print to.
+ */
+void sr_natlog_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_natlog_t *log = sr->nat ? sr->nat->log : NULL;
+   uint64_t head, tail, written, bytes;
+
+   if (log == NULL)
+   {
+      return;
+   }
+
+   head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+   tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+   written = __atomic_load_n(&log->written, __ATOMIC_RELAXED);
+   bytes = __atomic_load_n(&log->bytesWritten, __ATOMIC_RELAXED);
+   fprintf(out, "NAT log: topology %u, %" PRIu64 " %s written in %" PRIu64 " bytes (%.1f per record), "
+      "%" PRIu64 " queued, %" PRIu64 " lost, file %s.%06u\n", sr->topo_id, written,
+      log->blockSize ? "block records" : "records", bytes,
+      written ? (double) bytes / written : 0.0, head - tail,
+      __atomic_load_n(&log->lost, __ATOMIC_RELAXED), log->path,
+      __atomic_load_n(&log->fileNumber, __ATOMIC_RELAXED));
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void *natLogWriterThread(void *logPtr)
+{
+   sr_natlog_t *log = (sr_natlog_t *) logPtr;
+   natLogEncoder_t *encoder = malloc(sizeof(natLogEncoder_t));
+   const struct timespec drainInterval = { 0, SR_NATLOG_DRAIN_MS * 1000000L };
+
+   assert(encoder);
+   sr_watchdog_register("nat log");
+
+   while (1)
+   {
+      /* Read the stop flag first: everything pushed before it was set is
+       * then visible below. */
+      bool stop = __atomic_load_n(&log->stopRequested, __ATOMIC_ACQUIRE);
+      uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+
+      if (head != log->tail)
+      {
+         sr_watchdog_stage(SR_WATCHDOG_NAT_LOG);
+         natLogDrain(log, encoder, head);
+      }
+      else if (stop)
+      {
+         break;
+      }
+      else
+      {
+         sr_watchdog_idle();
+         nanosleep(&drainInterval, NULL);
+      }
+   }
+
+   sr_watchdog_unregister();
+   free(encoder);
+   return NULL;
+}
+
+/**
+ * natLogDrain()\n
+ * @brief Writes out the records up to head, then gives their slots back.
+ */
+static void natLogDrain(sr_natlog_t *log, natLogEncoder_t *encoder, uint64_t head)
+{
+   uint64_t tail;
+
+   encoder->length = 0;
+   encoder->count = 0;
+   for (tail = log->tail; tail != head; tail++)
+   {
+      const sr_natlog_record_t *record = &log->ring[tail & NATLOG_RING_MASK];
+
+      if ((encoder->length + SR_CODEC_NATLOG_MAX_RECORD_LEN > SR_NATLOG_MAX_FRAME)
+         || (encoder->count == UINT16_MAX))
+      {
+         natLogFlush(log, encoder);
+      }
+      if (encoder->count == 0)
+      {
+         memset(&encoder->base, 0, sizeof(encoder->base));
+         encoder->base.timeUs = record->timeUs;
+         encoder->frameTimeUs = record->timeUs;
+      }
+      encoder->length = sr_codec_natlog_put_record(encoder->buffer + encoder->length,
+         &encoder->base, encoder->count == 0, record) - encoder->buffer;
+      encoder->count++;
+   }
+   __atomic_store_n(&log->tail, head, __ATOMIC_RELEASE);
+
+   natLogFlush(log, encoder);
+   if (log->file)
+   {
+      fflush(log->file);
+   }
+}
+
+/**
+ * natLogFlush()\n
+ * @brief Appends the encoded frame to the current file, moving on to the
+ *        next file once this one is full.
+ * @note A write error is reported and the frame counted as lost; the next
+ *       frame tries a fresh file.
+ */
+static void natLogFlush(sr_natlog_t *log, natLogEncoder_t *encoder)
+{
+   uint8_t header[SR_CODEC_NATLOG_FRAME_HDR_LEN];
+
+   if (encoder->count == 0)
+   {
+      return;
+   }
+
+   sr_codec_natlog_frame_header(header, (uint32_t) encoder->length, encoder->count,
+      encoder->frameTimeUs);
+
+   if ((log->file == NULL) && (natLogOpenNext(log) != 0))
+   {
+      __atomic_add_fetch(&log->lost, encoder->count, __ATOMIC_RELAXED);
+   }
+   else if ((fwrite(header, 1, sizeof(header), log->file) != sizeof(header))
+      || (fwrite(encoder->buffer, 1, encoder->length, log->file) != encoder->length))
+   {
+      perror(log->path);
+      __atomic_add_fetch(&log->lost, encoder->count, __ATOMIC_RELAXED);
+      fclose(log->file);
+      log->file = NULL;
+   }
+   else
+   {
+      log->fileBytes += sizeof(header) + encoder->length;
+      __atomic_add_fetch(&log->written, encoder->count, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&log->bytesWritten, sizeof(header) + encoder->length, __ATOMIC_RELAXED);
+      if (log->fileBytes >= log->rotateBytes)
+      {
+         fclose(log->file);
+         log->file = NULL;
+         natLogOpenNext(log);
+      }
+   }
+
+   encoder->length = 0;
+   encoder->count = 0;
+}
+
+/**
+ * natLogOpenNext()\n
+ * @brief Opens the first numbered file after the current one that doesn't
+ *        exist yet, and writes its magic.
+ * @return 0 on success, -1 if it couldn't be created.
+ */
+static int natLogOpenNext(sr_natlog_t *log)
+{
+   size_t nameLength = strlen(log->path) + NATLOG_FILE_NAME_LEN;
+   char *name = malloc(nameLength);
+   unsigned int number = log->fileNumber;
+
+   assert(name);
+   do
+   {
+      snprintf(name, nameLength, "%s.%06u", log->path, ++number);
+   } while (access(name, F_OK) == 0);
+
+   log->file = fopen(name, "wb");
+   if ((log->file == NULL)
+      || (fwrite(SR_NATLOG_MAGIC, 1, SR_CODEC_NATLOG_MAGIC_LEN, log->file) != SR_CODEC_NATLOG_MAGIC_LEN))
+   {
+      perror(name);
+      if (log->file)
+      {
+         fclose(log->file);
+         log->file = NULL;
+      }
+      free(name);
+      return -1;
+   }
+
+   __atomic_store_n(&log->fileNumber, number, __ATOMIC_RELAXED);
+   log->fileBytes = SR_CODEC_NATLOG_MAGIC_LEN;
+   free(name);
+   return 0;
+}
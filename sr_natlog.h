@@ -0,0 +1,115 @@
+/**
+ * @file sr_natlog.h
+ * @brief Compliance log of NAT mappings, written in the background.
+ *
+ * Every NAT mapping created or deleted (or, in port block mode, every
+ * block of external ports handed to or taken back from an internal host)
+ * becomes a fixed size record. The NAT pushes records into a single
+ * producer, single consumer ring while it already holds its lock; pushing
+ * is a copy and a release store, with no system call and no other lock. A
+ * writer thread drains the ring every SR_NATLOG_DRAIN_MS, packs records
+ * into frames and appends them to the current log file, starting a new
+ * numbered file ("<path>.000001", "<path>.000002", ...) once one passes
+ * its size limit.
+ *
+ * Frames are compressed the way NAT replication batches are: a flags byte
+ * per record, then varints, with the time, internal address, external
+ * port and external address given relative to the previous record, so a
+ * record typically costs 7 to 10 bytes against 32 in the ring. Each frame
+ * restarts the deltas, so a file can be decoded from any frame boundary.
+ * sr_codec_natlog_decode() (and tools/natlog_decode) turns files back into
+ * text.
+ *
+ * If the writer falls SR_NATLOG_RING_RECORDS behind, further records are
+ * counted as lost rather than holding up the NAT.
+ */
+
+#ifndef SR_NATLOG_H
+#define SR_NATLOG_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_NATLOG_RING_BITS        (15)
+#define SR_NATLOG_RING_RECORDS     (1 << SR_NATLOG_RING_BITS) /**< 1 MB of records. */
+#define SR_NATLOG_DRAIN_MS         (10)
+#define SR_NATLOG_MAX_FRAME        (16384) /**< Largest encoded frame in bytes. */
+#define SR_NATLOG_DEFAULT_ROTATE   (64 * 1024 * 1024) /**< Bytes per file. */
+#define SR_NATLOG_MAGIC            "SRNATLG1"
+#define SR_NATLOG_CACHE_LINE       (64)
+#define SR_NATLOG_MAX_PATH         (256)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef enum
+{
+   SR_NATLOG_MAPPING_CREATE, /**< One external port mapped to an internal socket. */
+   SR_NATLOG_MAPPING_DELETE,
+   SR_NATLOG_BLOCK_ALLOCATE, /**< Ports auxExt..auxExt+blockSize-1 given to ipInt. */
+   SR_NATLOG_BLOCK_RELEASE,
+   SR_NATLOG_EVENTS
+} sr_natlog_event_t;
+
+/** One logged event. Addresses and ports in host byte order. */
+typedef struct
+{
+   uint64_t timeUs; /**< Wall clock, microseconds since the epoch. */
+   uint32_t ipInt;
+   uint32_t ipExt;
+   uint16_t auxInt; /**< Internal port or ICMP identifier. 0 for blocks. */
+   uint16_t auxExt; /**< External port or identifier; the first of a block. */
+   uint16_t blockSize; /**< Ports in the block. 0 for mappings. */
+   uint8_t event; /**< sr_natlog_event_t */
+   uint8_t type; /**< sr_nat_mapping_type */
+   uint8_t reserved[8];
+} sr_natlog_record_t;
+
+typedef struct sr_natlog
+{
+   /* Producer side, written under the NAT lock. */
+   uint64_t head __attribute__((aligned(SR_NATLOG_CACHE_LINE)));
+   uint64_t lost; /**< Records dropped with the ring full. */
+
+   /* Consumer side, written by the writer thread. */
+   uint64_t tail __attribute__((aligned(SR_NATLOG_CACHE_LINE)));
+   uint64_t written; /**< Records appended to files. */
+   uint64_t bytesWritten;
+   unsigned int fileNumber;
+   FILE *file;
+   uint64_t fileBytes;
+
+   sr_natlog_record_t *ring;
+   char *path;
+   uint64_t rotateBytes;
+   unsigned int blockSize; /**< Ports per block in port block mode; 0 logs every mapping. */
+   bool stopRequested;
+   pthread_t thread;
+} sr_natlog_t;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_natlog_parse(const char *spec, char *path, size_t pathSize, uint64_t *rotateBytes,
+   unsigned int *blockSize);
+sr_natlog_t *sr_natlog_start(const char *path, uint64_t rotateBytes, unsigned int blockSize);
+void sr_natlog_stop(sr_natlog_t *log);
+
+void sr_natlog_push(sr_natlog_t *log, const sr_natlog_record_t *record);
+void sr_natlog_print(const struct sr_instance *sr, FILE *out);
+
+#endif /* SR_NATLOG_H */
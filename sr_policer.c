@@ -0,0 +1,640 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_policer.h"
+#include "sr_clock.h"
+#include "sr_nat.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define POLICER_NS_PER_S   (SR_CLOCK_NS_PER_S)
+#define POLICER_BURST_NS   (POLICER_NS_PER_S) /**< Buckets hold a second's worth. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static int policerParseRate(const char **cursor, uint64_t *rate);
+static sr_policer_host_t *policerFindHost(sr_policer_t *policer, uint32_t ip, bool create);
+static void policerForgetHost(sr_policer_t *policer, unsigned int slot);
+static bool policerEvictHost(sr_policer_t *policer);
+static unsigned int policerHome(uint32_t ip);
+static bool policerFits(const sr_policer_bucket_t *bucket, uint64_t costNs, uint64_t nowNs);
+static void policerCharge(sr_policer_bucket_t *bucket, uint64_t costNs, uint64_t nowNs);
+static void policerViolation(sr_policer_t *policer, sr_policer_host_t *host,
+   sr_policer_violation_t violation);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const policerViolationNames[SR_POLICER_VIOLATIONS] =
+{
+   "packet rate", "bit rate", "mapping cap", "mapping rate"
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_policer_parse_limits()\n
+ * @brief Parses "packets/s:bits/s[:mappings[:mappings/s]]".
+ * @param spec limits as given on the command line. Rates take a k, m or g
+ *        suffix (powers of 1000) and 0 leaves a quantity unlimited.
+ * @param limits filled in on success.
+ * @return 0 on success, -1 if the string is malformed.
+ */
+int sr_policer_parse_limits(const char *spec, sr_policer_limits_t *limits)
+{
+   const char *cursor = spec;
+   uint64_t mappings = 0;
+
+   memset(limits, 0, sizeof(sr_policer_limits_t));
+
+   if ((policerParseRate(&cursor, &limits->packetsPerS) != 0) || (*cursor++ != ':')
+      || (policerParseRate(&cursor, &limits->bitsPerS) != 0))
+   {
+      return -1;
+   }
+   if (*cursor == ':')
+   {
+      cursor++;
+      if ((policerParseRate(&cursor, &mappings) != 0) || (mappings > UINT32_MAX))
+      {
+         return -1;
+      }
+      limits->mappings = (unsigned int) mappings;
+   }
+   if (*cursor == ':')
+   {
+      cursor++;
+      if (policerParseRate(&cursor, &limits->mappingsPerS) != 0)
+      {
+         return -1;
+      }
+   }
+   return (*cursor == '\0') ? 0 : -1;
+}
+
+/**
+ * sr_policer_create()\n
+ * @brief Allocates a policer with no hosts.
+ * @param limits applied to every internal host.
+ * @return the policer.
+ */
+sr_policer_t *sr_policer_create(const sr_policer_limits_t *limits)
+{
+   sr_policer_t *policer = calloc(1, sizeof(sr_policer_t));
+
+   assert(policer);
+
+   pthread_mutex_init(&policer->lock, NULL);
+   policer->limits = *limits;
+   return policer;
+}
+
+/**
+ * sr_policer_destroy()\n
+ * @brief Releases a policer. NULL is ignored.
+ */
+void sr_policer_destroy(sr_policer_t *policer)
+{
+   if (policer == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_destroy(&policer->lock);
+   free(policer);
+}
+
+/**
+ * sr_policer_admit_packet()\n
+ * @brief Charges a packet sent through the NAT to its internal host.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ * @param ip internal source address, network byte order.
+ * @param length length of the IP datagram.
+ * @return true if the packet may be forwarded, false if it is over one of
+ *         the host's rates, or the host can't be tracked, and must be
+ *         dropped.
+ */
+bool sr_policer_admit_packet(sr_policer_t *policer, uint32_t ip, unsigned int length)
+{
+   sr_policer_host_t *host;
+   uint64_t nowNs, packetCostNs = 0, bitCostNs = 0;
+   bool admitted = true;
+
+   if (policer == NULL)
+   {
+      return true;
+   }
+
+   nowNs = sr_clock_now_ns();
+   if (policer->limits.packetsPerS)
+   {
+      packetCostNs = POLICER_NS_PER_S / policer->limits.packetsPerS;
+   }
+   if (policer->limits.bitsPerS)
+   {
+      bitCostNs = (uint64_t) length * 8 * POLICER_NS_PER_S / policer->limits.bitsPerS;
+   }
+
+   pthread_mutex_lock(&policer->lock);
+   host = policerFindHost(policer, ip, true);
+   if (host == NULL)
+   {
+      policer->noSlot++;
+      admitted = false;
+   }
+   else
+   {
+      host->lastSeenNs = nowNs;
+
+      /* Charge neither bucket unless both have room. */
+      if (policer->limits.packetsPerS && !policerFits(&host->packets, packetCostNs, nowNs))
+      {
+         policerViolation(policer, host, SR_POLICER_PACKET_RATE);
+         admitted = false;
+      }
+      else if (policer->limits.bitsPerS && !policerFits(&host->bits, bitCostNs, nowNs))
+      {
+         policerViolation(policer, host, SR_POLICER_BIT_RATE);
+         admitted = false;
+      }
+      else
+      {
+         policerCharge(&host->packets, packetCostNs, nowNs);
+         policerCharge(&host->bits, bitCostNs, nowNs);
+      }
+   }
+   pthread_mutex_unlock(&policer->lock);
+
+   return admitted;
+}
+
+/**
+ * sr_policer_admit_mapping()\n
+ * @brief Asks whether an internal host may create another NAT mapping, and
+ *        counts it against the host if so.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ * @param ip internal address of the mapping, network byte order.
+ * @return true if the mapping may be created. Its removal must then be
+ *         reported with sr_policer_remove_mapping(), or, if it can't be
+ *         created after all, sr_policer_refund_mapping().
+ * @note Called with the NAT lock held, so the check and the creation of the
+ *       mapping are one step.
+ */
+bool sr_policer_admit_mapping(sr_policer_t *policer, uint32_t ip)
+{
+   sr_policer_host_t *host;
+   uint64_t nowNs, costNs = 0;
+   bool admitted = true;
+
+   if (policer == NULL)
+   {
+      return true;
+   }
+
+   nowNs = sr_clock_now_ns();
+   if (policer->limits.mappingsPerS)
+   {
+      costNs = POLICER_NS_PER_S / policer->limits.mappingsPerS;
+   }
+
+   pthread_mutex_lock(&policer->lock);
+   host = policerFindHost(policer, ip, true);
+   if (host == NULL)
+   {
+      policer->noSlot++;
+      admitted = false;
+   }
+   else
+   {
+      host->lastSeenNs = nowNs;
+
+      if (policer->limits.mappings && (host->mappings >= policer->limits.mappings))
+      {
+         policerViolation(policer, host, SR_POLICER_MAPPING_LIMIT);
+         admitted = false;
+      }
+      else if (policer->limits.mappingsPerS && !policerFits(&host->newMappings, costNs, nowNs))
+      {
+         policerViolation(policer, host, SR_POLICER_MAPPING_RATE);
+         admitted = false;
+      }
+      else
+      {
+         policerCharge(&host->newMappings, costNs, nowNs);
+         host->mappings++;
+      }
+   }
+   pthread_mutex_unlock(&policer->lock);
+
+   return admitted;
+}
+
+/**
+ * sr_policer_refund_mapping()\n
+ * @brief Takes back a mapping admitted by sr_policer_admit_mapping() that
+ *        was never created (e.g. no external port was free), returning its
+ *        new mapping token as well as its place under the cap.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ * @param ip internal address of the mapping, network byte order.
+ */
+void sr_policer_refund_mapping(sr_policer_t *policer, uint32_t ip)
+{
+   sr_policer_host_t *host;
+   uint64_t costNs;
+
+   if (policer == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&policer->lock);
+   host = policerFindHost(policer, ip, false);
+   if (host && (host->mappings > 0))
+   {
+      host->mappings--;
+      if (policer->limits.mappingsPerS)
+      {
+         costNs = POLICER_NS_PER_S / policer->limits.mappingsPerS;
+         host->newMappings.fullAtNs -= (host->newMappings.fullAtNs > costNs) ? costNs
+            : host->newMappings.fullAtNs;
+      }
+   }
+   pthread_mutex_unlock(&policer->lock);
+}
+
+/**
+ * sr_policer_add_mapping()\n
+ * @brief Counts a mapping against its host without asking, for mappings
+ *        replicated from an active router or handed over by an upgrade.
+ *        If the host can't be given a slot the mapping goes uncounted.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ * @param ip internal address of the mapping, network byte order.
+ */
+void sr_policer_add_mapping(sr_policer_t *policer, uint32_t ip)
+{
+   sr_policer_host_t *host;
+
+   if (policer == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&policer->lock);
+   host = policerFindHost(policer, ip, true);
+   if (host)
+   {
+      host->mappings++;
+      host->lastSeenNs = sr_clock_now_ns();
+   }
+   else
+   {
+      policer->noSlot++;
+   }
+   pthread_mutex_unlock(&policer->lock);
+}
+
+/**
+ * sr_policer_remove_mapping()\n
+ * @brief Gives back a mapping counted against its host.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ * @param ip internal address of the mapping, network byte order.
+ * @note Mappings of hosts that had no slot when they were counted may be
+ *       given back to a host that has one since, so the count stops at 0.
+ */
+void sr_policer_remove_mapping(sr_policer_t *policer, uint32_t ip)
+{
+   sr_policer_host_t *host;
+
+   if (policer == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&policer->lock);
+   host = policerFindHost(policer, ip, false);
+   if (host && (host->mappings > 0))
+   {
+      host->mappings--;
+   }
+   pthread_mutex_unlock(&policer->lock);
+}
+
+/**
+ * sr_policer_host()\n
+ * @brief Copies out the state of one host.
+ * @return false if the host is not tracked.
+ */
+bool sr_policer_host(sr_policer_t *policer, uint32_t ip, sr_policer_host_t *host)
+{
+   sr_policer_host_t *found;
+
+   pthread_mutex_lock(&policer->lock);
+   found = policerFindHost(policer, ip, false);
+   if (found)
+   {
+      *host = *found;
+   }
+   pthread_mutex_unlock(&policer->lock);
+
+   return found != NULL;
+}
+
+/**
+ * sr_policer_tick()\n
+ * @brief Forgets hosts that hold no mappings and have been quiet for
+ *        SR_POLICER_IDLE_S. Called once a second with the NAT's timeouts.
+ * @param policer the NAT's policer, or NULL if hosts are not policed.
+ */
+void sr_policer_tick(sr_policer_t *policer)
+{
+   uint64_t nowNs;
+   unsigned int slot = 0;
+
+   if (policer == NULL)
+   {
+      return;
+   }
+
+   nowNs = sr_clock_now_ns();
+   pthread_mutex_lock(&policer->lock);
+   while (slot < SR_POLICER_HOSTS)
+   {
+      const sr_policer_host_t *host = &policer->hosts[slot];
+
+      if ((host->ip != 0) && (host->mappings == 0)
+         && (nowNs - host->lastSeenNs > SR_POLICER_IDLE_S * POLICER_NS_PER_S))
+      {
+         /* Another host may have moved into this slot; look at it again. */
+         policerForgetHost(policer, slot);
+      }
+      else
+      {
+         slot++;
+      }
+   }
+   pthread_mutex_unlock(&policer->lock);
+}
+
+/**
+ * sr_policer_print()\n
+ * @brief Prints the limits, the refusals and the hosts that were refused.
+ */
+void sr_policer_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_policer_t *policer;
+   unsigned int slot, violation;
+
+   if ((sr->nat == NULL) || (sr->nat->policer == NULL))
+   {
+      return;
+   }
+   policer = sr->nat->policer;
+
+   pthread_mutex_lock(&policer->lock);
+   fprintf(out, "policer: topology %u, %" PRIu64 " packets/s, %" PRIu64 " bits/s, %u mappings, %"
+      PRIu64 " mappings/s per host (0: unlimited), %u hosts, %" PRIu64 " evicted, %" PRIu64
+      " refused for want of a slot\n",
+      sr->topo_id, policer->limits.packetsPerS, policer->limits.bitsPerS,
+      policer->limits.mappings, policer->limits.mappingsPerS, policer->hostCount,
+      policer->evicted, policer->noSlot);
+   fprintf(out, "   refused:");
+   for (violation = 0; violation < SR_POLICER_VIOLATIONS; violation++)
+   {
+      fprintf(out, "%s %s %" PRIu64, (violation == 0) ? "" : ",", policerViolationNames[violation],
+         policer->violations[violation]);
+   }
+   fprintf(out, "\n");
+
+   for (slot = 0; slot < SR_POLICER_HOSTS; slot++)
+   {
+      const sr_policer_host_t *host = &policer->hosts[slot];
+      uint32_t ip = ntohl(host->ip);
+      uint64_t refused = 0;
+
+      for (violation = 0; violation < SR_POLICER_VIOLATIONS; violation++)
+      {
+         refused += host->violations[violation];
+      }
+      if ((host->ip == 0) || (refused == 0))
+      {
+         continue;
+      }
+
+      fprintf(out, "   %u.%u.%u.%u: %u mappings, refused", (ip >> 24) & 0xFF, (ip >> 16) & 0xFF,
+         (ip >> 8) & 0xFF, ip & 0xFF, host->mappings);
+      for (violation = 0; violation < SR_POLICER_VIOLATIONS; violation++)
+      {
+         fprintf(out, "%s %s %" PRIu64, (violation == 0) ? "" : ",",
+            policerViolationNames[violation], host->violations[violation]);
+      }
+      fprintf(out, "\n");
+   }
+   pthread_mutex_unlock(&policer->lock);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static int policerParseRate(const char **cursor, uint64_t *rate)
+{
+   char *end;
+
+   if (!isdigit((unsigned char) **cursor))
+   {
+      return -1;
+   }
+   *rate = strtoull(*cursor, &end, 10);
+   switch (tolower((unsigned char) *end))
+   {
+      case 'k':
+         *rate *= 1000ULL;
+         end++;
+         break;
+      case 'm':
+         *rate *= 1000000ULL;
+         end++;
+         break;
+      case 'g':
+         *rate *= 1000000000ULL;
+         end++;
+         break;
+      default:
+         break;
+   }
+   *cursor = end;
+   return 0;
+}
+
+/**
+ * policerFindHost()\n
+ * @brief Finds a host's slot by linear probing from its home slot.
+ * @param create take a free slot for a host not yet tracked, evicting
+ *        another host if the table is full.
+ * @return the host, or NULL if it isn't tracked (and can't be).
+ * @warning Assumes the policer is locked.
+ */
+static sr_policer_host_t *policerFindHost(sr_policer_t *policer, uint32_t ip, bool create)
+{
+   unsigned int slot = policerHome(ip);
+   sr_policer_host_t *host;
+
+   if (ip == 0)
+   {
+      return NULL;
+   }
+
+   while (policer->hosts[slot].ip != 0)
+   {
+      if (policer->hosts[slot].ip == ip)
+      {
+         return &policer->hosts[slot];
+      }
+      slot = (slot + 1) & (SR_POLICER_HOSTS - 1);
+   }
+
+   if (!create)
+   {
+      return NULL;
+   }
+
+   /* Keep free slots around so probes stay short. */
+   if (policer->hostCount >= SR_POLICER_MAX_HOSTS)
+   {
+      if (!policerEvictHost(policer))
+      {
+         return NULL;
+      }
+
+      /* Hosts may have moved back into the probe run; look again. */
+      return policerFindHost(policer, ip, true);
+   }
+
+   host = &policer->hosts[slot];
+   memset(host, 0, sizeof(sr_policer_host_t));
+   host->ip = ip;
+   policer->hostCount++;
+   return host;
+}
+
+/**
+ * policerForgetHost()\n
+ * @brief Frees a slot, moving back later hosts of the same probe run that
+ *        could no longer be found past the hole.
+ * @warning Assumes the policer is locked.
+ */
+static void policerForgetHost(sr_policer_t *policer, unsigned int slot)
+{
+   unsigned int hole = slot;
+   unsigned int next = slot;
+
+   for (;;)
+   {
+      unsigned int home;
+
+      next = (next + 1) & (SR_POLICER_HOSTS - 1);
+      if (policer->hosts[next].ip == 0)
+      {
+         break;
+      }
+
+      /* A host whose home lies cyclically in (hole, next] is still reachable. */
+      home = policerHome(policer->hosts[next].ip);
+      if ((hole <= next) ? ((hole < home) && (home <= next)) : ((hole < home) || (home <= next)))
+      {
+         continue;
+      }
+      policer->hosts[hole] = policer->hosts[next];
+      hole = next;
+   }
+
+   memset(&policer->hosts[hole], 0, sizeof(sr_policer_host_t));
+   policer->hostCount--;
+}
+
+/**
+ * policerEvictHost()\n
+ * @brief Forgets the least recently seen host holding no mappings. Its
+ *        refusals stay in the policer's totals.
+ * @return false if every host holds mappings.
+ * @warning Assumes the policer is locked.
+ */
+static bool policerEvictHost(sr_policer_t *policer)
+{
+   unsigned int slot, oldest = SR_POLICER_HOSTS;
+
+   for (slot = 0; slot < SR_POLICER_HOSTS; slot++)
+   {
+      const sr_policer_host_t *host = &policer->hosts[slot];
+
+      if ((host->ip != 0) && (host->mappings == 0) && ((oldest == SR_POLICER_HOSTS)
+         || (host->lastSeenNs < policer->hosts[oldest].lastSeenNs)))
+      {
+         oldest = slot;
+      }
+   }
+
+   if (oldest == SR_POLICER_HOSTS)
+   {
+      return false;
+   }
+
+   policerForgetHost(policer, oldest);
+   policer->evicted++;
+   return true;
+}
+
+static unsigned int policerHome(uint32_t ip)
+{
+   return (uint32_t) (ip * 2654435761U) >> (32 - SR_POLICER_HOSTS_BITS);
+}
+
+/** True if the bucket holds costNs worth of tokens. */
+static bool policerFits(const sr_policer_bucket_t *bucket, uint64_t costNs, uint64_t nowNs)
+{
+   uint64_t fullAtNs = (bucket->fullAtNs > nowNs) ? bucket->fullAtNs : nowNs;
+
+   return fullAtNs + costNs - nowNs <= POLICER_BURST_NS;
+}
+
+static void policerCharge(sr_policer_bucket_t *bucket, uint64_t costNs, uint64_t nowNs)
+{
+   uint64_t fullAtNs = (bucket->fullAtNs > nowNs) ? bucket->fullAtNs : nowNs;
+
+   bucket->fullAtNs = fullAtNs + costNs;
+}
+
+static void policerViolation(sr_policer_t *policer, sr_policer_host_t *host,
+   sr_policer_violation_t violation)
+{
+   host->violations[violation]++;
+   policer->violations[violation]++;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file sr_policer.h
+ * @brief Per internal host rate policing and NAT mapping quotas.
+ *
+ * With NAT enabled, each internal host may be held to a packet rate and a
+ * bit rate for what it sends through the NAT, to a number of mappings held
+ * at once and to a rate of new mappings. A packet over a rate is dropped; a
+ * mapping over the cap or the rate is refused, dropping the packet that
+ * asked for it. A limit of 0 leaves that quantity unpoliced.
+ *
+ * The rates are token buckets holding one second's worth of tokens, so a
+ * host that has been quiet may burst that much. A bucket is kept as the
+ * time at which it would be full again (the virtual scheduling form of a
+ * token bucket), which is a single word that can't overflow whatever the
+ * rate.
+ *
+ * Hosts live in a fixed open-addressed table keyed by internal address, so
+ * finding one costs the same however many there are. A host holding no
+ * mappings that has been quiet for SR_POLICER_IDLE_S gives its slot up.
+ * A host arriving while the table is full takes the slot of the host
+ * holding no mappings that was seen least recently; if every host holds
+ * mappings, its packets and mappings are refused and counted. Refusals are
+ * counted per host and printed on SIGUSR1.
+ *
+ * Time is read with sr_clock_now_ns(), so under a virtual clock the
+ * buckets fill as the harness advances it.
+ */
+
+#ifndef SR_POLICER_H
+#define SR_POLICER_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_POLICER_HOSTS_BITS (10)
+#define SR_POLICER_HOSTS      (1 << SR_POLICER_HOSTS_BITS) /**< Slots in the host table. */
+#define SR_POLICER_MAX_HOSTS  ((SR_POLICER_HOSTS * 3) / 4) /**< Hosts tracked at once. */
+#define SR_POLICER_IDLE_S     (60)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef enum
+{
+   SR_POLICER_PACKET_RATE, /**< Packet dropped over the packet rate. */
+   SR_POLICER_BIT_RATE, /**< Packet dropped over the bit rate. */
+   SR_POLICER_MAPPING_LIMIT, /**< Mapping refused, the host holds its cap. */
+   SR_POLICER_MAPPING_RATE, /**< Mapping refused over the new mapping rate. */
+   SR_POLICER_VIOLATIONS
+} sr_policer_violation_t;
+
+/** Limits applied to every internal host. 0: unlimited. */
+typedef struct
+{
+   uint64_t packetsPerS;
+   uint64_t bitsPerS;
+   unsigned int mappings;
+   uint64_t mappingsPerS;
+} sr_policer_limits_t;
+
+typedef struct
+{
+   uint64_t fullAtNs; /**< sr_clock_now_ns() time the bucket is full again. */
+} sr_policer_bucket_t;
+
+typedef struct
+{
+   uint32_t ip; /**< Network byte order. 0 marks a free slot. */
+   unsigned int mappings; /**< Held now. */
+   sr_policer_bucket_t packets;
+   sr_policer_bucket_t bits;
+   sr_policer_bucket_t newMappings;
+   uint64_t lastSeenNs; /**< sr_clock_now_ns() time it last sent or asked for a mapping. */
+   uint64_t violations[SR_POLICER_VIOLATIONS];
+} sr_policer_host_t;
+
+typedef struct sr_policer
+{
+   pthread_mutex_t lock; /**< Taken inside the NAT lock, never around it. */
+   sr_policer_limits_t limits;
+
+   sr_policer_host_t hosts[SR_POLICER_HOSTS];
+   unsigned int hostCount;
+
+   uint64_t noSlot; /**< Packets and mappings refused for want of a slot. */
+   uint64_t evicted; /**< Hosts that gave their slot to a newer one. */
+   uint64_t violations[SR_POLICER_VIOLATIONS]; /**< Including hosts since forgotten. */
+} sr_policer_t;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_policer_parse_limits(const char *spec, sr_policer_limits_t *limits);
+sr_policer_t *sr_policer_create(const sr_policer_limits_t *limits);
+void sr_policer_destroy(sr_policer_t *policer);
+
+bool sr_policer_admit_packet(sr_policer_t *policer, uint32_t ip, unsigned int length);
+bool sr_policer_admit_mapping(sr_policer_t *policer, uint32_t ip);
+void sr_policer_refund_mapping(sr_policer_t *policer, uint32_t ip);
+void sr_policer_add_mapping(sr_policer_t *policer, uint32_t ip);
+void sr_policer_remove_mapping(sr_policer_t *policer, uint32_t ip);
+
+bool sr_policer_host(sr_policer_t *policer, uint32_t ip, sr_policer_host_t *host);
+void sr_policer_tick(sr_policer_t *policer);
+void sr_policer_print(const struct sr_instance *sr, FILE *out);
+
+#endif /* SR_POLICER_H */
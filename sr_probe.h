@@ -0,0 +1,83 @@
+/**
+ * @file sr_probe.h
+ * @brief Static probes (USDT) for bpftrace, perf and SystemTap.
+ *
+ * Where systemtap's <sys/sdt.h> is installed the Makefile builds with
+ * SR_HAVE_SDT, and each probe becomes a single nop plus a note in the
+ * binary saying where it is and where its arguments live. A tool that
+ * attaches to a probe turns its nop into a breakpoint; until then the
+ * probe costs the nop and whatever its arguments take to have at hand,
+ * which is why they are all values the code already holds. Without
+ * <sys/sdt.h> the probes compile to nothing.
+ *
+ * Probes, all of provider "sr" (usdt:./sr:sr:name in bpftrace); addresses
+ * are in network byte order unless marked host order:
+ *
+ *    rx(frame, length, interface)        sr_handlepacket() begins.
+ *    handled(frame, length, interface)   sr_handlepacket() is done with it.
+ *    drop(reason, length)                A packet is dropped. reason is a
+ *                                        short string ("ip_checksum", ...);
+ *                                        length is of the frame or
+ *                                        datagram where it was dropped.
+ *    route(dest, gateway, interface)     Route looked up; dest host order.
+ *                                        interface is "" with no route.
+ *    arp_miss(ip, timesSent, interface)  Next hop not in the ARP cache;
+ *                                        ip host order, timesSent 0 if the
+ *                                        request is new.
+ *    arp_insert(ip, waiting)             ARP reply cached; ip host order,
+ *                                        waiting 1 if packets were queued.
+ *    arp_timeout(ip, packets)            ARP request given up; ip host
+ *                                        order, packets dropped with it.
+ *    arp_expire(ip)                      Cache entry aged out; host order.
+ *    nat_mapping_create(ipInt, auxInt, auxExt, type)
+ *    nat_mapping_destroy(ipInt, auxInt, auxExt, type)
+ *                                        type is sr_nat_mapping_type.
+ *    nat_conn_state(ipExt, portExt, from, to)
+ *                                        A TCP connection changes state
+ *                                        (sr_nat_tcp_conn_state_t); from
+ *                                        is -1 when it is created, to -1
+ *                                        when it is destroyed.
+ *    tx(frame, length, interface)        sr_send_packet() is called.
+ *
+ * tools/sr_latency.bt and tools/sr_drops.bt are examples.
+ */
+
+#ifndef SR_PROBE_H
+#define SR_PROBE_H
+
+/*
+ * Include Files
+ */
+
+#ifdef SR_HAVE_SDT
+# include <sys/sdt.h>
+#endif
+
+/*
+ * Public Defines & Macros
+ */
+
+/** Probe argument standing for no connection state (nat_conn_state). */
+#define SR_PROBE_NO_STATE     (-1)
+
+#ifdef SR_HAVE_SDT
+# define SR_PROBE1(name, a)            DTRACE_PROBE1(sr, name, a)
+# define SR_PROBE2(name, a, b)         DTRACE_PROBE2(sr, name, a, b)
+# define SR_PROBE3(name, a, b, c)      DTRACE_PROBE3(sr, name, a, b, c)
+# define SR_PROBE4(name, a, b, c, d)   DTRACE_PROBE4(sr, name, a, b, c, d)
+#else
+/* Arguments are compiled, so they stay checked, but never evaluated. */
+# define SR_PROBE1(name, a) \
+   do { if (0) { (void) (a); } } while (0)
+# define SR_PROBE2(name, a, b) \
+   do { if (0) { (void) (a); (void) (b); } } while (0)
+# define SR_PROBE3(name, a, b, c) \
+   do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+# define SR_PROBE4(name, a, b, c, d) \
+   do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while (0)
+#endif
+
+/** A packet dropped at this point, for the reason given as a string literal. */
+#define SR_PROBE_DROP(reason, length)  SR_PROBE2(drop, reason, length)
+
+#endif /* SR_PROBE_H */
@@ -29,6 +29,20 @@
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
 #include "sr_utils.h"
+#include "sr_clock.h"
+#include "sr_admission.h"
+#include "sr_flow.h"
+#include "sr_mirror.h"
+#include "sr_natlog.h"
+#include "sr_policer.h"
+#include "sr_probe.h"
+#include "sr_routestat.h"
+#include "sr_sample.h"
+#include "sr_sched.h"
+#include "sr_sketch.h"
+#include "sr_trace.h"
+#include "sr_vns_reader.h"
+#include "sr_watchdog.h"
 
 /*
  *-----------------------------------------------------------------------------
@@ -51,7 +65,8 @@
 #ifdef DONT_DEFINE_UNLESS_DEBUGGING
 # define LOG_MESSAGE(...) fprintf(stderr, __VA_ARGS__)
 #else 
-# define LOG_MESSAGE(...)
+/* Kept in the trace of the packet being handled, if it is traced. */
+# define LOG_MESSAGE(...) SR_TRACE(SR_TRACE_ROUTER, __VA_ARGS__)
 #endif
 
 /*
@@ -66,8 +81,6 @@
  *-----------------------------------------------------------------------------
  */
 
-static uint16_t ipIdentifyNumber = 0;
-
 static const uint8_t broadcastEthernetAddress[ETHER_ADDR_LEN] =
    { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
 
@@ -100,6 +113,8 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t* pa
    unsigned int length, sr_if_t const * const interface);
 static void linkArpAndSendPacket(struct sr_instance* sr, sr_ethernet_hdr_t* packet,
    unsigned int length, sr_rt_t const * const route);
+static void linkSendFrame(struct sr_instance* sr, uint8_t* frame, unsigned int length,
+   const char* interface);
 static void networkHandleReceivedIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
    unsigned int length, sr_if_t const * const interface);
 static void networkHandleIcmpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
@@ -139,13 +154,74 @@ void sr_init(struct sr_instance* sr)
    pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
    pthread_t thread;
    
-   pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+   /* Instances hosted by sr_multi share one timer thread instead. */
+   if (sr->multi == NULL)
+   {
+      pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+      sr_sched_apply(thread, SR_SCHED_TIMER);
+   }
    
    /* Add initialization code here! */
    
 
 } /* -- sr_init -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_router_tick(struct sr_instance* sr)
+ * Scope:  Global
+ *
+ * One second of the router's periodic work: ARP cache maintenance, then
+ * every optional subsystem's timers, and the NAT's timeouts unless it
+ * has a thread of its own. Called by the instance's timeout thread, or by
+ * the timer thread shared between instances (sr_multi.c). A new
+ * subsystem with periodic work adds its tick here.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_router_tick(struct sr_instance* sr)
+{
+   sr_arpcache_tick(sr);
+   sr_sketch_tick(sr);
+   sr_flow_tick(sr);
+   sr_sample_tick(sr);
+   sr_routestat_tick(sr);
+   sr_mirror_tick(sr);
+   sr_trace_tick(sr);
+   
+   if (sr->nat && !sr->nat->hasTimeoutThread)
+   {
+      sr_nat_tick(sr->nat);
+   }
+} /* -- sr_router_tick -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_router_print(const struct sr_instance* sr, FILE* out)
+ * Scope:  Global
+ *
+ * Prints every subsystem's statistics for one instance, as asked for by 
+ * SIGUSR1. Process-wide statistics (the watchdog's) are the caller's. A 
+ * new subsystem with statistics adds its print here.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_router_print(const struct sr_instance* sr, FILE* out)
+{
+   sr_admission_print(sr, out);
+   if (sr->reader)
+   {
+      sr_vns_reader_print(sr->reader, out);
+   }
+   sr_nat_print(sr, out);
+   sr_natlog_print(sr, out);
+   sr_sketch_print(sr, out);
+   sr_flow_print(sr, out);
+   sr_sample_print(sr, out);
+   sr_routestat_print(sr, out);
+   sr_mirror_print(sr, out);
+   sr_trace_print(sr, out);
+   sr_policer_print(sr, out);
+} /* -- sr_router_print -- */
+
 /*---------------------------------------------------------------------
  * Method: sr_handlepacket(uint8_t* p,char* interface)
  * Scope:  Global
@@ -166,6 +242,8 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t * packet/* lent */, unsigne
    char* interface/* lent */)
 {
    struct sr_if* receivedInterfaceEntry = NULL;
+   bool sampled;
+   bool traced;
    
    /* REQUIRES */
    assert(sr);
@@ -177,10 +255,13 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t * packet/* lent */, unsigne
    
    /* fill in code here */
    
+   SR_PROBE3(rx, packet, length, interface);
+   
    if (length < sizeof(sr_ethernet_hdr_t))
    {
       /* Ummm...this packet doesn't appear to be long enough to 
        * process... Drop it like it's hot! */
+      SR_PROBE_DROP("short_frame", length);
       return;
    }
    
@@ -192,9 +273,14 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t * packet/* lent */, unsigne
    {
       /* Packet not sent to our Ethernet address? */
       LOG_MESSAGE("Dropping packet due to invalid Ethernet receive parameters.\n");
+      SR_PROBE_DROP("not_for_us", length);
       return;
    }
    
+   sampled = sr_sample_received(sr->sampler, receivedInterfaceEntry, packet, length);
+   sr_mirror_frame(sr->mirror, SR_MIRROR_IN, receivedInterfaceEntry->name, packet, length);
+   traced = sr_trace_begin(sr->trace, receivedInterfaceEntry->name, packet, length);
+   
    switch (ethertype(packet))
    {
       case ethertype_arp:
@@ -212,8 +298,19 @@ void sr_handlepacket(struct sr_instance* sr, uint8_t * packet/* lent */, unsigne
       default:
          /* We have no logic to handle other packet types. Drop the packet! */
          LOG_MESSAGE("Dropping packet due to invalid Ethernet message type: 0x%X.\n", ethertype(packet));
-         return;
+         SR_PROBE_DROP("ethertype", length);
+         break;
    }
+   
+   if (sampled)
+   {
+      sr_sample_end(sr->sampler);
+   }
+   if (traced)
+   {
+      sr_trace_end(sr->trace);
+   }
+   SR_PROBE3(handled, packet, length, interface);
 
 }/* end sr_handlepacket */
 
@@ -253,7 +350,7 @@ void LinkSendArpRequest(struct sr_instance* sr, struct sr_arpreq* request)
    arpHdr->ar_tip = htonl(request->ip);
    
    /* Ship it! */
-   sr_send_packet(sr, arpPacket, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t),
+   linkSendFrame(sr, arpPacket, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t),
       request->requestedInterface->name);
    
    free(arpPacket);
@@ -298,7 +395,7 @@ void IpSendTypeThreeIcmpPacket(struct sr_instance* sr, sr_icmp_code_t icmpCode,
    replyIpHeader->ip_hl = MIN_IP_HEADER_LENGTH;
    replyIpHeader->ip_tos = 0;
    replyIpHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
-   replyIpHeader->ip_id = htons(ipIdentifyNumber); ipIdentifyNumber++;
+   replyIpHeader->ip_id = htons(sr->ipIdentifyNumber++);
    replyIpHeader->ip_off = htons(IP_DF);
    replyIpHeader->ip_ttl = DEFAULT_TTL;
    replyIpHeader->ip_p = ip_protocol_icmp;
@@ -374,6 +471,7 @@ void IpForwardIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
    if (packetTtl == 0)
    {
       /* Uh oh... someone's just about run out of time. */
+      SR_PROBE_DROP("ttl_expired", length);
       networkSendIcmpTtlExpired(sr, packet, length, receivedInterface);
       return;
    }
@@ -409,6 +507,7 @@ void IpForwardIpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
        * That's probably wrong, so we assume the host is actually 
        * unreachable. */
       LOG_MESSAGE("Routing decision could not be made. Sending ICMP network unreachable.\n");
+      SR_PROBE_DROP("no_route", length);
       IpSendTypeThreeIcmpPacket(sr, icmp_code_network_unreachable, packet);
    }
 }
@@ -444,6 +543,17 @@ sr_rt_t* IpGetPacketRoute(struct sr_instance* sr, in_addr_t destIp)
       }
    }
    
+   if (ret)
+   {
+      SR_TRACE(SR_TRACE_ROUTE, SR_TRACE_IP_FORMAT " by " SR_TRACE_IP_FORMAT "/%d via "
+         SR_TRACE_IP_FORMAT " on %s", SR_TRACE_IP(htonl(destIp)), SR_TRACE_IP(ret->dest.s_addr),
+         networkMaskLength, SR_TRACE_IP(ret->gw.s_addr), ret->interface);
+   }
+   else
+   {
+      SR_TRACE(SR_TRACE_ROUTE, SR_TRACE_IP_FORMAT " has no route", SR_TRACE_IP(htonl(destIp)));
+   }
+   SR_PROBE3(route, destIp, ret ? ret->gw.s_addr : 0, ret ? ret->interface : "");
    return ret;
 }
 
@@ -562,6 +672,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
    if (length < sizeof(sr_arp_hdr_t))
    {
       /* Not big enough to be an ARP packet... */
+      SR_PROBE_DROP("arp_short", length);
       return;
    }
    
@@ -572,6 +683,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
    {
       /* Received unsupported packet argument */
       LOG_MESSAGE("ARP packet received with invalid parameters. Dropping.\n");
+      SR_PROBE_DROP("arp_invalid", length);
       return;
    }
    
@@ -604,7 +716,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
             memcpy(arpHdr->ar_tha, packet->ar_sha, ETHER_ADDR_LEN);
             arpHdr->ar_tip = packet->ar_sip;
             
-            sr_send_packet(sr, replyPacket, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t),
+            linkSendFrame(sr, replyPacket, sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t),
                interface->name);
             
             free(replyPacket);
@@ -620,7 +732,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
          if (packet->ar_tip == interface->ip)
          {
             struct sr_arpreq* requestPointer = sr_arpcache_insert(
-               &sr->cache, packet->ar_sha, ntohl(packet->ar_sip));
+               &sr->cache, packet->ar_sha, ntohl(packet->ar_sip), interface->name);
             
             if (requestPointer != NULL)
             {
@@ -635,7 +747,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
                      packet->ar_sha, ETHER_ADDR_LEN);
                   
                   /* The last piece of the pie is now complete. Ship it. */
-                  sr_send_packet(sr, curr->buf, curr->len, curr->iface);
+                  linkSendFrame(sr, curr->buf, curr->len, curr->iface);
                   
                   /* Forward list of packets. */
                   requestPointer->packets = requestPointer->packets->next;
@@ -662,6 +774,7 @@ static void linkHandleReceivedArpPacket(struct sr_instance* sr, sr_arp_hdr_t * p
       {
          /* Unrecognized ARP type */
          LOG_MESSAGE("Received packet with invalid ARP type: 0x%X.\n", ntohs(packet->ar_op));
+         SR_PROBE_DROP("arp_op", length);
          break;
       }
    }
@@ -683,6 +796,7 @@ static void networkHandleReceivedIpPacket(struct sr_instance* sr, sr_ip_hdr_t* p
    {
       /* Not big enough to be an IP packet... */
       LOG_MESSAGE("Received IP packet with invalid length. Dropping.\n");
+      SR_PROBE_DROP("ip_short", length);
       return;
    }
    
@@ -708,6 +822,7 @@ static void networkHandleReceivedIpPacket(struct sr_instance* sr, sr_ip_hdr_t* p
       {
          /* Bad checksum... */
          LOG_MESSAGE("IP checksum failed. Dropping received packet.\n");
+         SR_PROBE_DROP("ip_checksum", length);
          return;
       }
       else
@@ -721,6 +836,7 @@ static void networkHandleReceivedIpPacket(struct sr_instance* sr, sr_ip_hdr_t* p
    {
       /* Something is way wrong with this packet. Throw it out. */
       LOG_MESSAGE("Received IP packet with invalid length in header. Dropping.\n");
+      SR_PROBE_DROP("ip_header", length);
       return;
    }
    
@@ -729,9 +845,15 @@ static void networkHandleReceivedIpPacket(struct sr_instance* sr, sr_ip_hdr_t* p
       /* What do you think we are? Some fancy, IPv6 router? Guess again! 
        * Process IPv4 packets only.*/
       LOG_MESSAGE("Received non-IPv4 packet. Dropping.\n");
+      SR_PROBE_DROP("ip_version", length);
       return;
    }
    
+   if (sr->sketch)
+   {
+      sr_sketch_count(sr->sketch, interface, SR_SKETCH_IN, packet, length);
+   }
+   
    if (!natEnabled(sr))
    {
       if (IpDestinationIsUs(sr, packet))
@@ -767,6 +889,7 @@ static void networkHandleIcmpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
    if (!IcmpPerformIntegrityCheck(icmpHeader, icmpLength))
    {
       LOG_MESSAGE("ICMP checksum failed. Dropping received packet.\n");
+      SR_PROBE_DROP("icmp_checksum", length);
       return;
    }
    
@@ -780,6 +903,7 @@ static void networkHandleIcmpPacket(struct sr_instance* sr, sr_ip_hdr_t* packet,
       /* I don't send any non-ICMP packets...How did I receive another ICMP type? */
       LOG_MESSAGE("Received unexpected ICMP message. Type: %u, Code: %u\n", 
          icmpHeader->icmp_type, icmpHeader->icmp_code);
+      SR_PROBE_DROP("icmp_type", length);
    }
 }
 
@@ -806,8 +930,7 @@ static void networkSendIcmpEchoReply(struct sr_instance* sr, sr_ip_hdr_t* echoRe
    replyIpHeader->ip_hl = MIN_IP_HEADER_LENGTH;
    replyIpHeader->ip_tos = 0;
    replyIpHeader->ip_len = htons((uint16_t) length);
-   replyIpHeader->ip_id = htons(ipIdentifyNumber);
-   ipIdentifyNumber++;
+   replyIpHeader->ip_id = htons(sr->ipIdentifyNumber++);
    replyIpHeader->ip_off = htons(IP_DF);
    replyIpHeader->ip_ttl = DEFAULT_TTL;
    replyIpHeader->ip_p = ip_protocol_icmp;
@@ -865,8 +988,7 @@ static void networkSendIcmpTtlExpired(struct sr_instance* sr, sr_ip_hdr_t* origi
    replyIpHeader->ip_hl = MIN_IP_HEADER_LENGTH;
    replyIpHeader->ip_tos = 0;
    replyIpHeader->ip_len = htons(sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t));
-   replyIpHeader->ip_id = htons(ipIdentifyNumber);
-   ipIdentifyNumber++;
+   replyIpHeader->ip_id = htons(sr->ipIdentifyNumber++);
    replyIpHeader->ip_off = htons(IP_DF);
    replyIpHeader->ip_ttl = DEFAULT_TTL;
    replyIpHeader->ip_p = ip_protocol_icmp;
@@ -909,44 +1031,88 @@ static void linkArpAndSendPacket(sr_instance_t *sr, sr_ethernet_hdr_t* packet,
 {
    uint32_t nextHopIpAddress;
    sr_arpentry_t *arpEntry;
+   sr_if_t *sendInterface;
    
    assert(route);
    
+   sendInterface = sr_get_interface(sr, route->interface);
+   if (sr->sketch)
+   {
+      sr_sketch_count(sr->sketch, sendInterface, SR_SKETCH_OUT, (sr_ip_hdr_t*) (packet + 1),
+         length - sizeof(sr_ethernet_hdr_t));
+   }
+   sr_sample_sent(sr->sampler, sendInterface, route->gw.s_addr, (sr_ip_hdr_t*) (packet + 1), length);
+   sr_routestat_count(sr->routeStats, route, length - sizeof(sr_ethernet_hdr_t));
+   if (!natEnabled(sr))
+   {
+      /* The NAT counts its own flows per connection. */
+      sr_flow_count(sr->flows, (sr_ip_hdr_t*) (packet + 1), length - sizeof(sr_ethernet_hdr_t));
+   }
+   
    /* Need the gateway IP to do the ARP cache lookup. */
    nextHopIpAddress = ntohl(route->gw.s_addr);
    arpEntry = sr_arpcache_lookup(&sr->cache, nextHopIpAddress);
    
    /* This function is only for IP packets, fill in the type */
    packet->ether_type = htons(ethertype_ip);
-   memcpy(packet->ether_shost, sr_get_interface(sr, route->interface)->addr, ETHER_ADDR_LEN);
+   memcpy(packet->ether_shost, sendInterface->addr, ETHER_ADDR_LEN);
    
    if (arpEntry != NULL)
    {
+      SR_TRACE(SR_TRACE_ARP, "next hop " SR_TRACE_IP_FORMAT " at %02X:%02X:%02X:%02X:%02X:%02X",
+         SR_TRACE_IP(route->gw.s_addr), arpEntry->mac[0], arpEntry->mac[1], arpEntry->mac[2],
+         arpEntry->mac[3], arpEntry->mac[4], arpEntry->mac[5]);
       memcpy(packet->ether_dhost, arpEntry->mac, ETHER_ADDR_LEN);
-      sr_send_packet(sr, (uint8_t*) packet, length, route->interface);
+      linkSendFrame(sr, (uint8_t*) packet, length, route->interface);
       
       /* Lookup made a copy, so we must free it to prevent leaks. */
       free(arpEntry);
    }
    else
    {
-      /* We need to ARP our next hop. Setup the request and send the ARP packet. */
+      /* We need to ARP our next hop. Setup the request and send the ARP packet. 
+       * The request belongs to the cache, and the timeout thread resends and 
+       * frees requests, so keep the (recursive) cache lock until we're done 
+       * with it. */
+      sr_watchdog_lock(&sr->cache.lock, SR_WATCHDOG_LOCK_ARP);
       struct sr_arpreq* arpRequestPtr = sr_arpcache_queuereq(&sr->cache, nextHopIpAddress,
          (uint8_t*) packet, length, route->interface);
       
+      SR_PROBE3(arp_miss, nextHopIpAddress, arpRequestPtr->times_sent, route->interface);
+      SR_TRACE(SR_TRACE_ARP, "next hop " SR_TRACE_IP_FORMAT " unresolved, queued; %u ARP"
+         " requests sent before", SR_TRACE_IP(route->gw.s_addr), arpRequestPtr->times_sent);
+      
       if (arpRequestPtr->times_sent == 0)
       {
          /* New request. Send the first ARP NOW! */
-         arpRequestPtr->requestedInterface = sr_get_interface(sr, route->interface);
+         arpRequestPtr->requestedInterface = sendInterface;
          
          LinkSendArpRequest(sr, arpRequestPtr);
          
          arpRequestPtr->times_sent = 1;
-         arpRequestPtr->sent = time(NULL);
+         arpRequestPtr->sent = sr_clock_now();
       }
+      sr_watchdog_unlock(&sr->cache.lock, SR_WATCHDOG_LOCK_ARP);
    }
 }
 
+/**
+ * linkSendFrame()\n
+ * IP Stack Level: Link Layer (Ethernet)\n
+ * @brief Function sends a complete frame, mirroring it first if a session wants it.
+ * @param sr pointer to simple router state.
+ * @param frame pointer to Ethernet frame.
+ * @param length length of frame in bytes.
+ * @param interface name of interface to send the frame on.
+ */
+static void linkSendFrame(struct sr_instance* sr, uint8_t* frame, unsigned int length,
+   const char* interface)
+{
+   SR_TRACE(SR_TRACE_TX, "%u bytes out of %s", length, interface);
+   sr_mirror_frame(sr->mirror, SR_MIRROR_OUT, interface, frame, length);
+   sr_send_packet(sr, frame, length, interface);
+}
+
 /**
  * networkIpSourceIsUs()\n
  * IP Stack Level: Network (IP)\n
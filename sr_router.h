@@ -13,8 +13,10 @@
 #include <sys/time.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <signal.h>
 
 #include "sr_protocol.h"
+#include "sr_admission.h"
 #include "sr_arpcache.h"
 #include "sr_nat.h"
 #include "sr_rt.h"
@@ -35,6 +37,14 @@
 
 /* forward declare */
 struct sr_if;
+struct sr_flow;
+struct sr_mirror;
+struct sr_multi;
+struct sr_routestat;
+struct sr_sample;
+struct sr_sketch;
+struct sr_trace;
+struct sr_vns_reader;
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -51,12 +61,24 @@ typedef struct sr_instance
    char template_name[30]; /* template name if any */
    unsigned short topo_id;
    struct sockaddr_in sr_addr; /* address to server */
+   uint32_t vnsCapabilities; /* VNS_CAP_* extensions agreed with the server */
+   uint32_t vnsMaxBatchLen; /* largest VNSPACKET_BATCH the server accepts */
+   struct sr_vns_reader* reader; /* adaptive receive loop, or 0 for two reads per command */
    struct sr_if* if_list; /* list of interfaces */
    struct sr_rt* routing_table; /* routing table */
    struct sr_arpcache cache; /* ARP cache */
    pthread_attr_t attr;
    FILE* logfile;
    struct sr_nat* nat; /**< Pointer to NAT state structure. */
+   uint16_t ipIdentifyNumber; /**< Next IP ID for datagrams we originate. */
+   struct sr_multi* multi; /**< Host process state if one of several instances, else NULL. */
+   sr_admission_t admission; /**< Overload state and counters for received frames. */
+   struct sr_sketch* sketch; /**< Heavy-hitter counts, or NULL if not kept. */
+   struct sr_flow* flows; /**< Flow record exporter, or NULL if not exporting. */
+   struct sr_sample* sampler; /**< Packet sampler, or NULL if not sampling. */
+   struct sr_routestat* routeStats; /**< Per-route counters, or NULL if not kept. */
+   struct sr_mirror* mirror; /**< Port mirror sessions, or NULL if not mirroring. */
+   struct sr_trace* trace; /**< Packet trace filters and records, or NULL if not tracing. */
 } sr_instance_t;
 
 /**
@@ -82,6 +104,12 @@ static inline sr_tcp_hdr_t * getTcpHeaderFromIpHeader(sr_ip_hdr_t * packetPtr)
 }
 
 /* -- sr_main.c -- */
+extern volatile sig_atomic_t srShutdownRequested;
+/* Set when SIGUSR1 asks for the counters. */
+extern volatile sig_atomic_t srStatsRequested;
+/* Counts SIGHUPs, each asking for configuration files (-M, -A) to be read 
+ again. */
+extern volatile sig_atomic_t srReloadRequests;
 int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
@@ -91,6 +119,8 @@ int sr_read_from_server(struct sr_instance*);
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance*);
+void sr_router_tick(struct sr_instance* sr);
+void sr_router_print(const struct sr_instance* sr, FILE* out);
 void sr_handlepacket(struct sr_instance*, uint8_t *, unsigned int, char*);
 void LinkSendArpRequest(struct sr_instance* sr, struct sr_arpreq* request);
 void IpSendTypeThreeIcmpPacket(struct sr_instance* sr, sr_icmp_code_t icmpCode,
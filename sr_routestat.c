@@ -0,0 +1,411 @@
+/**
+ * @file sr_routestat.c
+ * @brief Packet and byte counters per routing table entry.
+ *
+ * See sr_routestat.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_routestat.h"
+#include "sr_clock.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+typedef struct sr_routestat_retired
+{
+   sr_routestat_counts_t *counts;
+   struct sr_routestat_retired *next;
+} sr_routestat_retired_t;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public variables
+ *-----------------------------------------------------------------------------
+ */
+
+__thread uint64_t srRoutestatGeneration = 0;
+__thread sr_routestat_block_t *srRoutestatBlock = NULL;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64_t routestatGenerations = 0;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void routestatGrow(sr_routestat_block_t *block, uint32_t id);
+static void routestatOffer(sr_routestat_entry_t *entries, unsigned int *used, unsigned int count,
+   const sr_routestat_entry_t *entry);
+static void routestatWrite(const struct sr_instance *sr, FILE *out,
+   const sr_routestat_entry_t *entries, unsigned int count, uint64_t totalPackets,
+   uint64_t totalBytes);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_routestat_create()\n
+ * @brief Allocates counters with nothing counted.
+ * @param intervalS seconds between dumps to the log; 0 never logs.
+ * @param logPath file the dumps are appended to.
+ * @return the counters, or NULL if the log could not be opened.
+ */
+sr_routestat_t *sr_routestat_create(unsigned int intervalS, const char *logPath)
+{
+   sr_routestat_t *stats = calloc(1, sizeof(sr_routestat_t));
+
+   assert(stats);
+
+   if (intervalS > 0)
+   {
+      assert(logPath);
+      stats->log = fopen(logPath, "a");
+      if (stats->log == NULL)
+      {
+         perror(logPath);
+         free(stats);
+         return NULL;
+      }
+   }
+
+   pthread_mutex_init(&stats->lock, NULL);
+   stats->generation = __atomic_add_fetch(&routestatGenerations, 1, __ATOMIC_RELAXED);
+   stats->intervalS = intervalS;
+   stats->intervalStart = sr_clock_now();
+   return stats;
+}
+
+/**
+ * sr_routestat_destroy()\n
+ * @brief Frees the counters and every thread's arrays.
+ * @param stats may be NULL.
+ * @warning No thread may be counting.
+ */
+void sr_routestat_destroy(sr_routestat_t *stats)
+{
+   sr_routestat_block_t *block;
+   sr_routestat_retired_t *retired;
+
+   if (stats == NULL)
+   {
+      return;
+   }
+
+   while ((block = stats->blocks) != NULL)
+   {
+      stats->blocks = block->next;
+      while ((retired = block->retired) != NULL)
+      {
+         block->retired = retired->next;
+         free(retired->counts);
+         free(retired);
+      }
+      free(block->counts);
+      free(block);
+   }
+   if (stats->log)
+   {
+      fclose(stats->log);
+   }
+   free(stats->previous);
+   pthread_mutex_destroy(&stats->lock);
+   free(stats);
+}
+
+/**
+ * sr_routestat_block()\n
+ * @brief sr_routestat_count() when the calling thread's cached block isn't
+ *        for these counters or doesn't hold the route: finds or adds the
+ *        thread's block, grows it to hold the route and caches it.
+ * @param stats the counters.
+ * @param id route about to be counted.
+ * @return the thread's block.
+ */
+sr_routestat_block_t *sr_routestat_block(sr_routestat_t *stats, uint32_t id)
+{
+   sr_routestat_block_t *block;
+   pthread_t self = pthread_self();
+
+   for (block = __atomic_load_n(&stats->blocks, __ATOMIC_ACQUIRE); block; block = block->next)
+   {
+      if (pthread_equal(block->thread, self))
+      {
+         break;
+      }
+   }
+
+   if (block == NULL)
+   {
+      block = calloc(1, sizeof(sr_routestat_block_t));
+      assert(block);
+      block->thread = self;
+
+      pthread_mutex_lock(&stats->lock);
+      block->next = stats->blocks;
+      __atomic_store_n(&stats->blocks, block, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&stats->lock);
+   }
+
+   if (id >= block->capacity)
+   {
+      routestatGrow(block, id);
+   }
+
+   srRoutestatGeneration = stats->generation;
+   srRoutestatBlock = block;
+   return block;
+}
+
+/**
+ * sr_routestat_total()\n
+ * @brief Adds up a route's counts over all threads.
+ * @param stats the counters.
+ * @param id the route's id.
+ * @param total receives the packets and bytes.
+ */
+void sr_routestat_total(const sr_routestat_t *stats, uint32_t id, sr_routestat_counts_t total)
+{
+   const sr_routestat_block_t *block;
+   const sr_routestat_counts_t *counts;
+   unsigned int metric;
+
+   memset(total, 0, sizeof(sr_routestat_counts_t));
+   for (block = __atomic_load_n(&stats->blocks, __ATOMIC_ACQUIRE); block; block = block->next)
+   {
+      /* The array is published before the capacity that covers it. */
+      if (id >= __atomic_load_n(&block->capacity, __ATOMIC_ACQUIRE))
+      {
+         continue;
+      }
+      counts = __atomic_load_n(&block->counts, __ATOMIC_ACQUIRE);
+      for (metric = 0; metric < SR_ROUTESTAT_METRICS; metric++)
+      {
+         total[metric] += __atomic_load_n(&counts[id][metric], __ATOMIC_RELAXED);
+      }
+   }
+}
+
+/**
+ * sr_routestat_top()\n
+ * @brief Finds the routes that carried most bytes since start-up.
+ * @param stats the counters.
+ * @param routes the routing table.
+ * @param entries receives the routes, most bytes first.
+ * @param count entries wanted.
+ * @return entries filled in, fewer than count if fewer routes carried any.
+ */
+unsigned int sr_routestat_top(const sr_routestat_t *stats, const struct sr_rt *routes,
+   sr_routestat_entry_t *entries, unsigned int count)
+{
+   sr_routestat_entry_t entry;
+   sr_routestat_counts_t total;
+   unsigned int used = 0;
+
+   for (; routes; routes = routes->next)
+   {
+      sr_routestat_total(stats, routes->id, total);
+      if (total[SR_ROUTESTAT_PACKETS] != 0)
+      {
+         entry.route = routes;
+         entry.packets = total[SR_ROUTESTAT_PACKETS];
+         entry.bytes = total[SR_ROUTESTAT_BYTES];
+         routestatOffer(entries, &used, count, &entry);
+      }
+   }
+   return used;
+}
+
+/**
+ * sr_routestat_tick()\n
+ * @brief Called once a second by the timer thread: at the end of each
+ *        interval appends the routes that carried most bytes during it to
+ *        the log.
+ */
+void sr_routestat_tick(struct sr_instance *sr)
+{
+   sr_routestat_t *stats = sr->routeStats;
+   sr_routestat_entry_t entries[SR_ROUTESTAT_TOP_N], entry;
+   sr_routestat_counts_t total;
+   const struct sr_rt *route;
+   uint64_t totalPackets = 0, totalBytes = 0;
+   unsigned int used = 0;
+
+   if ((stats == NULL) || (stats->intervalS == 0)
+      || (difftime(sr_clock_now(), stats->intervalStart) < stats->intervalS))
+   {
+      return;
+   }
+
+   for (route = sr->routing_table; route; route = route->next)
+   {
+      if (route->id >= stats->previousCapacity)
+      {
+         unsigned int capacity = route->id + SR_ROUTESTAT_MIN_ROUTES;
+
+         stats->previous = realloc(stats->previous, capacity * sizeof(sr_routestat_counts_t));
+         assert(stats->previous);
+         memset(stats->previous + stats->previousCapacity, 0,
+            (capacity - stats->previousCapacity) * sizeof(sr_routestat_counts_t));
+         stats->previousCapacity = capacity;
+      }
+
+      sr_routestat_total(stats, route->id, total);
+      entry.route = route;
+      entry.packets = total[SR_ROUTESTAT_PACKETS] - stats->previous[route->id][SR_ROUTESTAT_PACKETS];
+      entry.bytes = total[SR_ROUTESTAT_BYTES] - stats->previous[route->id][SR_ROUTESTAT_BYTES];
+      memcpy(stats->previous[route->id], total, sizeof(sr_routestat_counts_t));
+      if (entry.packets != 0)
+      {
+         totalPackets += entry.packets;
+         totalBytes += entry.bytes;
+         routestatOffer(entries, &used, SR_ROUTESTAT_TOP_N, &entry);
+      }
+   }
+
+   fprintf(stats->log, "routes: topology %u, interval %" PRIu64 ", %.0f s\n", sr->topo_id,
+      stats->intervals, difftime(sr_clock_now(), stats->intervalStart));
+   routestatWrite(sr, stats->log, entries, used, totalPackets, totalBytes);
+   fflush(stats->log);
+   stats->intervals++;
+   stats->intervalStart = sr_clock_now();
+}
+
+/**
+ * sr_routestat_print()\n
+ * @brief Writes the routes that carried most bytes since start-up. Does
+ *        nothing if the instance doesn't count routes.
+ */
+void sr_routestat_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_routestat_entry_t entries[SR_ROUTESTAT_TOP_N];
+   sr_routestat_counts_t total;
+   const struct sr_rt *route;
+   uint64_t totalPackets = 0, totalBytes = 0;
+   unsigned int used;
+
+   if (sr->routeStats == NULL)
+   {
+      return;
+   }
+
+   for (route = sr->routing_table; route; route = route->next)
+   {
+      sr_routestat_total(sr->routeStats, route->id, total);
+      totalPackets += total[SR_ROUTESTAT_PACKETS];
+      totalBytes += total[SR_ROUTESTAT_BYTES];
+   }
+   used = sr_routestat_top(sr->routeStats, sr->routing_table, entries, SR_ROUTESTAT_TOP_N);
+
+   fprintf(out, "routes: topology %u, since start-up\n", sr->topo_id);
+   routestatWrite(sr, out, entries, used, totalPackets, totalBytes);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * routestatGrow()\n
+ * @brief Moves a block's counts to an array that holds route id. Readers
+ *        may still be reading the old array, so it is kept until the block
+ *        is freed; arrays at least double, so that is under twice the
+ *        memory of the last.
+ * @note Called by the block's thread only.
+ */
+static void routestatGrow(sr_routestat_block_t *block, uint32_t id)
+{
+   unsigned int capacity = block->capacity ? block->capacity : SR_ROUTESTAT_MIN_ROUTES;
+   sr_routestat_counts_t *counts;
+   sr_routestat_retired_t *retired;
+
+   while (capacity <= id)
+   {
+      capacity *= 2;
+   }
+   counts = calloc(capacity, sizeof(sr_routestat_counts_t));
+   assert(counts);
+
+   if (block->counts)
+   {
+      memcpy(counts, block->counts, block->capacity * sizeof(sr_routestat_counts_t));
+      retired = malloc(sizeof(sr_routestat_retired_t));
+      assert(retired);
+      retired->counts = block->counts;
+      retired->next = block->retired;
+      block->retired = retired;
+   }
+
+   __atomic_store_n(&block->counts, counts, __ATOMIC_RELEASE);
+   __atomic_store_n(&block->capacity, capacity, __ATOMIC_RELEASE);
+}
+
+/** Keeps the count entries with most bytes, sorted, in entries. */
+static void routestatOffer(sr_routestat_entry_t *entries, unsigned int *used, unsigned int count,
+   const sr_routestat_entry_t *entry)
+{
+   unsigned int i;
+
+   if ((*used == count) && ((count == 0) || (entry->bytes <= entries[count - 1].bytes)))
+   {
+      return;
+   }
+
+   i = (*used < count) ? (*used)++ : count - 1;
+   for (; (i > 0) && (entries[i - 1].bytes < entry->bytes); i--)
+   {
+      entries[i] = entries[i - 1];
+   }
+   entries[i] = *entry;
+}
+
+/** Writes the totals and the routes in entries. */
+static void routestatWrite(const struct sr_instance *sr, FILE *out,
+   const sr_routestat_entry_t *entries, unsigned int count, uint64_t totalPackets,
+   uint64_t totalBytes)
+{
+   char destination[INET_ADDRSTRLEN], mask[INET_ADDRSTRLEN], gateway[INET_ADDRSTRLEN];
+   unsigned int i;
+
+   (void) sr;
+   fprintf(out, "   %" PRIu64 " packets, %" PRIu64 " bytes sent by route\n", totalPackets,
+      totalBytes);
+   for (i = 0; i < count; i++)
+   {
+      inet_ntop(AF_INET, &entries[i].route->dest, destination, sizeof(destination));
+      inet_ntop(AF_INET, &entries[i].route->mask, mask, sizeof(mask));
+      inet_ntop(AF_INET, &entries[i].route->gw, gateway, sizeof(gateway));
+      fprintf(out, "   %-15s %-15s via %-15s %-6s %12" PRIu64 " packets %15" PRIu64
+         " bytes %5.1f%%\n", destination, mask, gateway, entries[i].route->interface,
+         entries[i].packets, entries[i].bytes,
+         totalBytes ? 100.0 * entries[i].bytes / totalBytes : 0.0);
+   }
+}
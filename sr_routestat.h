@@ -0,0 +1,139 @@
+/**
+ * @file sr_routestat.h
+ * @brief Packet and byte counters per routing table entry.
+ *
+ * Every datagram the router sends is counted against the route it was sent
+ * by. Routes are numbered as they are added (sr_rt_t.id), and the counts
+ * live in arrays indexed by that number, apart from the routing table, so
+ * the lookup walks no more memory than before.
+ *
+ * Each thread counts into arrays of its own, so counting takes no lock and
+ * shares no cache lines; a thread's arrays grow as it meets routes beyond
+ * their end. Readers add up all threads' arrays. On SIGUSR1 the routes
+ * that carried most bytes since start-up are printed, and with an interval
+ * the routes that carried most bytes during each interval are appended to
+ * a file.
+ */
+
+#ifndef SR_ROUTESTAT_H
+#define SR_ROUTESTAT_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sr_rt.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_ROUTESTAT_TOP_N          (10)
+#define SR_ROUTESTAT_MIN_ROUTES     (64) /**< Routes a thread's first arrays hold. */
+#define SR_ROUTESTAT_DEFAULT_LOG    "sr_routes.log"
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef enum
+{
+   SR_ROUTESTAT_PACKETS,
+   SR_ROUTESTAT_BYTES,
+   SR_ROUTESTAT_METRICS
+} sr_routestat_metric_t;
+
+typedef uint64_t sr_routestat_counts_t[SR_ROUTESTAT_METRICS];
+
+/** One thread's counts. Only that thread writes them. */
+typedef struct sr_routestat_block
+{
+   sr_routestat_counts_t *counts; /**< Indexed by route id. */
+   unsigned int capacity; /**< Routes counts holds. */
+   pthread_t thread;
+   struct sr_routestat_block *next;
+   struct sr_routestat_retired *retired; /**< Arrays outgrown, freed with the block. */
+} sr_routestat_block_t;
+
+/** What a route carried. */
+typedef struct
+{
+   const struct sr_rt *route;
+   uint64_t packets;
+   uint64_t bytes;
+} sr_routestat_entry_t;
+
+typedef struct sr_routestat
+{
+   uint64_t generation; /**< Tells this instance's blocks from a freed one's. */
+   sr_routestat_block_t *blocks; /**< Only ever prepended to. */
+   pthread_mutex_t lock; /**< Serializes adding blocks. */
+
+   /* Interval dumps, by the timer thread only. */
+   unsigned int intervalS; /**< 0: never dumped to the log. */
+   time_t intervalStart;
+   uint64_t intervals;
+   sr_routestat_counts_t *previous; /**< Totals at the start of the interval. */
+   unsigned int previousCapacity;
+   FILE *log;
+} sr_routestat_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_routestat_t *sr_routestat_create(unsigned int intervalS, const char *logPath);
+void sr_routestat_destroy(sr_routestat_t *stats);
+sr_routestat_block_t *sr_routestat_block(sr_routestat_t *stats, uint32_t id);
+void sr_routestat_total(const sr_routestat_t *stats, uint32_t id, sr_routestat_counts_t total);
+unsigned int sr_routestat_top(const sr_routestat_t *stats, const struct sr_rt *routes,
+   sr_routestat_entry_t *entries, unsigned int count);
+void sr_routestat_tick(struct sr_instance *sr);
+void sr_routestat_print(const struct sr_instance *sr, FILE *out);
+
+/*
+ * Inline Function Definitions
+ */
+
+/** The instance srRoutestatBlock belongs to, by generation. */
+extern __thread uint64_t srRoutestatGeneration;
+/** This thread's block of the instance it last counted for. */
+extern __thread sr_routestat_block_t *srRoutestatBlock;
+
+/**
+ * Counts a datagram sent by a route.
+ * @param stats may be NULL, in which case nothing is done.
+ * @param length bytes of IP header and payload.
+ */
+static inline void sr_routestat_count(sr_routestat_t *stats, const struct sr_rt *route,
+   unsigned int length)
+{
+   sr_routestat_block_t *block = srRoutestatBlock;
+   uint64_t *counts;
+
+   if (stats == NULL)
+   {
+      return;
+   }
+   if ((srRoutestatGeneration != stats->generation) || (route->id >= block->capacity))
+   {
+      block = sr_routestat_block(stats, route->id);
+   }
+
+   /* Only this thread writes, so no read-modify-write is needed; the atomic
+    * stores keep readers from seeing torn values. */
+   counts = block->counts[route->id];
+   __atomic_store_n(&counts[SR_ROUTESTAT_PACKETS], counts[SR_ROUTESTAT_PACKETS] + 1,
+      __ATOMIC_RELAXED);
+   __atomic_store_n(&counts[SR_ROUTESTAT_BYTES], counts[SR_ROUTESTAT_BYTES] + length,
+      __ATOMIC_RELAXED);
+}
+
+#endif /* SR_ROUTESTAT_H */
@@ -105,10 +105,12 @@ struct in_addr gw, struct in_addr mask,char* if_name)
         sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
         assert(sr->routing_table);
         sr->routing_table->next = 0;
+        sr->routing_table->id = 0;
         sr->routing_table->dest = dest;
         sr->routing_table->gw   = gw;
         sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN - 1);
+        sr->routing_table->interface[sr_IFACE_NAMELEN - 1] = '\0';
 
         return;
     }
@@ -121,13 +123,15 @@ struct in_addr gw, struct in_addr mask,char* if_name)
 
     rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
     assert(rt_walker->next);
+    rt_walker->next->id = rt_walker->id + 1;
     rt_walker = rt_walker->next;
 
     rt_walker->next = 0;
     rt_walker->dest = dest;
     rt_walker->gw   = gw;
     rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN - 1);
+    rt_walker->interface[sr_IFACE_NAMELEN - 1] = '\0';
 
 } /* -- sr_add_entry -- */
 
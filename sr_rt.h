@@ -33,6 +33,7 @@ typedef struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    uint32_t id; /* order added, from 0; indexes sr_routestat.h counters */
     struct sr_rt* next;
 } sr_rt_t;
 
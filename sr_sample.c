@@ -0,0 +1,834 @@
+/**
+ * @file sr_sample.c
+ * @brief Random packet sampling exported as sFlow version 5 datagrams.
+ *
+ * See sr_sample.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sr_sample.h"
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_router.h"
+#include "sr_sched.h"
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+/* sFlow version 5 (sflow_version_5.txt), XDR encoded: big endian 32-bit
+ * words, opaque data padded to a word. Structures are tagged with
+ * enterprise << 12 | format, all standard (enterprise 0) here. */
+#define SAMPLE_SFLOW_VERSION        (5)
+#define SAMPLE_ADDRESS_IPV4         (1)
+#define SAMPLE_FLOW_SAMPLE          (1)
+#define SAMPLE_COUNTERS_SAMPLE      (2)
+#define SAMPLE_RAW_HEADER           (1)
+#define SAMPLE_EXTENDED_ROUTER      (1002)
+#define SAMPLE_EXTENDED_NAT         (1007)
+#define SAMPLE_EXTENDED_NAT_PORT    (1020)
+#define SAMPLE_GENERIC_INTERFACE    (1)
+#define SAMPLE_PROTOCOL_ETHERNET    (1)
+#define SAMPLE_IF_TYPE_ETHERNET     (6)
+#define SAMPLE_IF_FULL_DUPLEX       (1)
+#define SAMPLE_IF_UP                (3) /**< Admin and operationally up. */
+
+#define SAMPLE_DATAGRAM_HDR_LEN     (28)
+#define SAMPLE_GENERIC_INTERFACE_LEN (88)
+/** Largest flow sample: header, raw header, router, NAT and NAT port records. */
+#define SAMPLE_MAX_FLOW_LEN         (8 + 32 + 8 + 16 + SR_SAMPLE_HEADER_BYTES + 8 + 16 + 8 + 16 + 8 + 8)
+#define SAMPLE_COUNTERS_LEN         (8 + 12 + 8 + SAMPLE_GENERIC_INTERFACE_LEN)
+
+#define SAMPLE_RING_MASK            (SR_SAMPLE_RING_RECORDS - 1)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public variables
+ *-----------------------------------------------------------------------------
+ */
+
+__thread uint32_t srSampleSkip = 0;
+__thread sr_sample_flow_t *srSamplePending = NULL;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static __thread sr_sample_flow_t sampleCurrent;
+static __thread bool sampleSentOn; /**< The sampled datagram has been sent on. */
+static __thread uint64_t sampleRandom;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *sampleWriterThread(void *samplerPtr);
+static void sampleDrain(sr_sample_t *sampler, uint64_t head);
+static void samplePush(sr_sample_t *sampler, sr_sample_record_t *record);
+static uint32_t sampleNextSkip(unsigned int rate);
+static uint8_t *samplePutFlow(uint8_t *cursor, const sr_sample_t *sampler,
+   const sr_sample_flow_t *flow, uint32_t drops);
+static uint8_t *samplePutCounters(uint8_t *cursor, const sr_sample_counters_t *counters);
+static bool samplePorts(const sr_ip_hdr_t *packet, size_t available, uint16_t *sourcePort,
+   uint16_t *destinationPort);
+
+static uint8_t *samplePut32(uint8_t *cursor, uint32_t value);
+static uint8_t *samplePut64(uint8_t *cursor, uint64_t value);
+static uint32_t sampleGet32(const uint8_t *cursor);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_sample_parse()\n
+ * @brief Parses "rate[,host:port]".
+ * @param spec option argument.
+ * @param rate receives the sampling rate, one frame in rate.
+ * @param collector receives the collector; SR_SAMPLE_DEFAULT_COLLECTOR when
+ *        not given.
+ * @param collectorSize size of the collector buffer.
+ * @return 0 on success, -1 if the specification is malformed.
+ */
+int sr_sample_parse(const char *spec, unsigned int *rate, char *collector, size_t collectorSize)
+{
+   char *end;
+   unsigned long value = strtoul(spec, &end, 10);
+
+   if ((end == spec) || (value == 0) || (value > UINT32_MAX / 2) || ((*end != '\0') && (*end != ',')))
+   {
+      return -1;
+   }
+   *rate = (unsigned int) value;
+
+   if (*end == '\0')
+   {
+      end = SR_SAMPLE_DEFAULT_COLLECTOR;
+   }
+   else
+   {
+      end++;
+   }
+   if ((strchr(end, ':') == NULL) || (strlen(end) >= collectorSize))
+   {
+      return -1;
+   }
+   strcpy(collector, end);
+   return 0;
+}
+
+/**
+ * sr_sample_create()\n
+ * @brief Opens a socket to the collector and starts the writer thread.
+ * @param rate one frame in rate is sampled; 1 samples every frame.
+ * @param collector "host:port".
+ * @param subAgentId tells the collector hosted routers apart.
+ * @return sampler state, or NULL if the collector couldn't be resolved.
+ */
+sr_sample_t *sr_sample_create(unsigned int rate, const char *collector, uint32_t subAgentId)
+{
+   struct addrinfo hints, *result;
+   char host[SR_SAMPLE_MAX_COLLECTOR];
+   const char *port = strrchr(collector, ':');
+   sr_sample_t *sampler;
+
+   assert(rate > 0);
+   if ((port == NULL) || (port == collector) || (strlen(collector) >= sizeof(host)))
+   {
+      fprintf(stderr, "%s: expected host:port\n", collector);
+      return NULL;
+   }
+   snprintf(host, sizeof(host), "%.*s", (int) (port - collector), collector);
+
+   if (posix_memalign((void **) &sampler, SR_SAMPLE_CACHE_LINE, sizeof(sr_sample_t)) != 0)
+   {
+      return NULL;
+   }
+   memset(sampler, 0, sizeof(sr_sample_t));
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   if (getaddrinfo(host, port + 1, &hints, &result) != 0)
+   {
+      fprintf(stderr, "%s: unknown collector\n", collector);
+      free(sampler);
+      return NULL;
+   }
+   memcpy(&sampler->collector, result->ai_addr, sizeof(sampler->collector));
+   freeaddrinfo(result);
+
+   sampler->socket = socket(AF_INET, SOCK_DGRAM, 0);
+   if (sampler->socket < 0)
+   {
+      perror("sample socket");
+      free(sampler);
+      return NULL;
+   }
+
+   sampler->ring = malloc(SR_SAMPLE_RING_RECORDS * sizeof(sr_sample_record_t));
+   assert(sampler->ring);
+   strcpy(sampler->collectorName, collector);
+   sampler->rate = rate;
+   sampler->subAgentId = subAgentId;
+   sampler->started = sampler->lastCounters = sr_clock_now();
+
+   pthread_mutex_init(&sampler->pushLock, NULL);
+   pthread_create(&(sampler->thread), NULL, sampleWriterThread, sampler);
+   sr_sched_apply(sampler->thread, SR_SCHED_SYNC);
+
+   printf("Sampling 1 in %u frames to %s\n", rate, collector);
+   return sampler;
+}
+
+/**
+ * sr_sample_destroy()\n
+ * @brief Sends what is queued, stops the writer thread and releases the
+ *        sampler.
+ * @param sampler sampler state. May be NULL.
+ * @warning No thread may be sampling a frame.
+ */
+void sr_sample_destroy(sr_sample_t *sampler)
+{
+   if (sampler == NULL)
+   {
+      return;
+   }
+
+   __atomic_store_n(&sampler->stopRequested, true, __ATOMIC_RELEASE);
+   pthread_join(sampler->thread, NULL);
+
+   close(sampler->socket);
+   pthread_mutex_destroy(&sampler->pushLock);
+   free(sampler->ring);
+   free(sampler);
+}
+
+/**
+ * sr_sample_flush()\n
+ * @brief Waits for the writer thread to send every sample queued so far.
+ * @param sampler sampler state.
+ * @param timeoutMs longest wait, in (real) milliseconds.
+ * @return true once they are all out in datagrams, false on timeout.
+ */
+bool sr_sample_flush(sr_sample_t *sampler, unsigned int timeoutMs)
+{
+   const struct timespec pollInterval = { 0, 1000000L };
+   uint64_t queued = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+   unsigned int waited;
+
+   for (waited = 0; __atomic_load_n(&sampler->exported, __ATOMIC_ACQUIRE) < queued; waited++)
+   {
+      if (waited == timeoutMs)
+      {
+         return false;
+      }
+      nanosleep(&pollInterval, NULL);
+   }
+   return true;
+}
+
+/**
+ * sr_sample_add_interface()\n
+ * @brief sr_sample_count() for an interface not seen before: numbers it,
+ *        unless SR_SAMPLE_MAX_INTERFACES already are, and counts the frame.
+ */
+unsigned int sr_sample_add_interface(sr_sample_t *sampler, const struct sr_if *interface,
+   sr_sample_direction_t direction, unsigned int length)
+{
+   unsigned int i;
+
+   pthread_mutex_lock(&sampler->pushLock);
+   for (i = 0; i < sampler->interfaceCount; i++)
+   {
+      if (sampler->interfaces[i] == interface)
+      {
+         break;
+      }
+   }
+   if ((i == sampler->interfaceCount) && (i < SR_SAMPLE_MAX_INTERFACES))
+   {
+      sampler->interfaces[i] = interface;
+      __atomic_store_n(&sampler->interfaceCount, i + 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&sampler->pushLock);
+
+   if (i == SR_SAMPLE_MAX_INTERFACES)
+   {
+      __atomic_add_fetch(&sampler->untracked, 1, __ATOMIC_RELAXED);
+      return 0;
+   }
+   __atomic_add_fetch(&sampler->packets[i][direction], 1, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&sampler->octets[i][direction], length, __ATOMIC_RELAXED);
+   return i + 1;
+}
+
+/**
+ * sr_sample_take()\n
+ * @brief Starts sampling a received frame and draws the thread's next
+ *        countdown. Called by sr_sample_received() only.
+ * @return true.
+ */
+bool sr_sample_take(sr_sample_t *sampler, unsigned int ifIndex, const uint8_t *frame,
+   unsigned int length)
+{
+   sr_sample_flow_t *flow = &sampleCurrent;
+   uint32_t pool = 0;
+   unsigned int i;
+
+   for (i = 0; i < __atomic_load_n(&sampler->interfaceCount, __ATOMIC_ACQUIRE); i++)
+   {
+      pool += (uint32_t) __atomic_load_n(&sampler->packets[i][SR_SAMPLE_IN], __ATOMIC_RELAXED);
+   }
+
+   memset(flow, 0, offsetof(sr_sample_flow_t, header));
+   flow->samplePool = pool;
+   flow->inputIndex = ifIndex;
+   flow->frameLength = length;
+   flow->headerLength = (length < SR_SAMPLE_HEADER_BYTES) ? length : SR_SAMPLE_HEADER_BYTES;
+   memcpy(flow->header, frame, flow->headerLength);
+
+   sampleSentOn = false;
+   srSamplePending = flow;
+   srSampleSkip = sampleNextSkip(sampler->rate);
+   return true;
+}
+
+/**
+ * sr_sample_forwarded()\n
+ * @brief Adds where the frame being sampled went, if packet is its
+ *        datagram: output interface, next hop and any NAT translation.
+ *        Called by sr_sample_sent() only.
+ */
+void sr_sample_forwarded(sr_sample_t *sampler, unsigned int ifIndex, uint32_t nextHop,
+   const sr_ip_hdr_t *packet)
+{
+   sr_sample_flow_t *flow = srSamplePending;
+   const sr_ip_hdr_t *received = (const sr_ip_hdr_t *) (flow->header + sizeof(sr_ethernet_hdr_t));
+   size_t available;
+   uint16_t sourcePort, destinationPort, receivedSource, receivedDestination;
+
+   (void) sampler;
+   if (sampleSentOn || (flow->headerLength < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+      || (((const sr_ethernet_hdr_t *) flow->header)->ether_type != htons(ethertype_ip)) || (received->ip_p != packet->ip_p)
+      || (received->ip_id != packet->ip_id))
+   {
+      return;
+   }
+   sampleSentOn = true;
+   flow->outputIndex = ifIndex;
+   flow->nextHop = nextHop;
+
+   available = flow->headerLength - sizeof(sr_ethernet_hdr_t);
+   if ((received->ip_src != packet->ip_src) || (received->ip_dst != packet->ip_dst)
+      || (samplePorts(received, available, &receivedSource, &receivedDestination)
+         && samplePorts(packet, UINT16_MAX, &sourcePort, &destinationPort)
+         && ((receivedSource != sourcePort) || (receivedDestination != destinationPort))))
+   {
+      flow->natSourceIp = packet->ip_src;
+      flow->natDestinationIp = packet->ip_dst;
+      if (samplePorts(packet, UINT16_MAX, &sourcePort, &destinationPort))
+      {
+         flow->natSourcePort = sourcePort;
+         flow->natDestinationPort = destinationPort;
+      }
+   }
+}
+
+/**
+ * sr_sample_end()\n
+ * @brief Queues the frame this thread was sampling for the writer thread.
+ * @param sampler sampler the frame was taken by.
+ */
+void sr_sample_end(sr_sample_t *sampler)
+{
+   sr_sample_record_t record;
+
+   if (srSamplePending == NULL)
+   {
+      return;
+   }
+   record.kind = SR_SAMPLE_FLOW;
+   record.flow = *srSamplePending;
+   srSamplePending = NULL;
+   samplePush(sampler, &record);
+}
+
+/**
+ * sr_sample_tick()\n
+ * @brief Once a second: every SR_SAMPLE_COUNTER_INTERVAL, queues a counter
+ *        sample for each interface.
+ * @param sr pointer to simple router state structure.
+ */
+void sr_sample_tick(struct sr_instance *sr)
+{
+   sr_sample_t *sampler = sr->sampler;
+   sr_sample_record_t record;
+   unsigned int i, direction;
+   time_t now;
+
+   if (sampler == NULL)
+   {
+      return;
+   }
+
+   if ((sampler->agentIp == 0) && sr->if_list)
+   {
+      __atomic_store_n(&sampler->agentIp, sr->if_list->ip, __ATOMIC_RELAXED);
+   }
+
+   now = sr_clock_now();
+   if (now - sampler->lastCounters < SR_SAMPLE_COUNTER_INTERVAL)
+   {
+      return;
+   }
+   sampler->lastCounters = now;
+
+   memset(&record, 0, sizeof(record));
+   record.kind = SR_SAMPLE_COUNTERS;
+   for (i = 0; i < __atomic_load_n(&sampler->interfaceCount, __ATOMIC_ACQUIRE); i++)
+   {
+      record.counters.ifIndex = i + 1;
+      for (direction = 0; direction < SR_SAMPLE_DIRECTIONS; direction++)
+      {
+         record.counters.packets[direction] = __atomic_load_n(&sampler->packets[i][direction],
+            __ATOMIC_RELAXED);
+         record.counters.octets[direction] = __atomic_load_n(&sampler->octets[i][direction],
+            __ATOMIC_RELAXED);
+      }
+      samplePush(sampler, &record);
+   }
+}
+
+/**
+ * sr_sample_print()\n
+ * @brief Prints the sampler's counts.
+ * @param sr pointer to simple router state structure. Nothing is printed
+ *        without sampling.
+ * @param out stream to print to.
+ */
+void sr_sample_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_sample_t *sampler = sr->sampler;
+   uint64_t head, tail;
+   unsigned int i;
+
+   if (sampler == NULL)
+   {
+      return;
+   }
+
+   head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+   tail = __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE);
+   fprintf(out, "Sampling: topology %u, 1 in %u frames, %" PRIu64 " samples in %" PRIu64
+      " datagrams to %s, %" PRIu64 " queued, %" PRIu64 " dropped\n", sr->topo_id, sampler->rate,
+      __atomic_load_n(&sampler->exported, __ATOMIC_RELAXED),
+      __atomic_load_n(&sampler->datagrams, __ATOMIC_RELAXED), sampler->collectorName, head - tail,
+      __atomic_load_n(&sampler->dropped, __ATOMIC_RELAXED));
+   for (i = 0; i < __atomic_load_n(&sampler->interfaceCount, __ATOMIC_ACQUIRE); i++)
+   {
+      fprintf(out, "   %u %-6s in %" PRIu64 "/%" PRIu64 " out %" PRIu64 "/%" PRIu64
+         " frames/bytes\n", i + 1, sampler->interfaces[i]->name,
+         __atomic_load_n(&sampler->packets[i][SR_SAMPLE_IN], __ATOMIC_RELAXED),
+         __atomic_load_n(&sampler->octets[i][SR_SAMPLE_IN], __ATOMIC_RELAXED),
+         __atomic_load_n(&sampler->packets[i][SR_SAMPLE_OUT], __ATOMIC_RELAXED),
+         __atomic_load_n(&sampler->octets[i][SR_SAMPLE_OUT], __ATOMIC_RELAXED));
+   }
+   fflush(out);
+}
+
+/**
+ * sr_sample_decode()\n
+ * @brief Decodes one sFlow datagram as sent by the sampler.
+ * @param datagram the datagram.
+ * @param length its length.
+ * @param out if not NULL, gets one line per sample.
+ * @param totals if not NULL, what was found is added to it.
+ * @return 0 on success, -1 if the datagram is malformed.
+ */
+int sr_sample_decode(const uint8_t *datagram, size_t length, FILE *out,
+   sr_sample_totals_t *totals)
+{
+   const uint8_t *cursor = datagram + SAMPLE_DATAGRAM_HDR_LEN;
+   const uint8_t *end = datagram + length;
+   uint32_t samples, i;
+
+   if ((length < SAMPLE_DATAGRAM_HDR_LEN) || (sampleGet32(datagram) != SAMPLE_SFLOW_VERSION)
+      || (sampleGet32(datagram + 4) != SAMPLE_ADDRESS_IPV4))
+   {
+      return -1;
+   }
+   samples = sampleGet32(datagram + 24);
+   if (totals)
+   {
+      totals->datagrams++;
+   }
+
+   for (i = 0; i < samples; i++)
+   {
+      uint32_t tag, sampleLength;
+      const uint8_t *sample;
+
+      if (end - cursor < 8)
+      {
+         return -1;
+      }
+      tag = sampleGet32(cursor);
+      sampleLength = sampleGet32(cursor + 4);
+      sample = cursor + 8;
+      if ((uint32_t) (end - sample) < sampleLength)
+      {
+         return -1;
+      }
+      cursor = sample + sampleLength;
+
+      if ((tag == SAMPLE_FLOW_SAMPLE) && (sampleLength >= 32))
+      {
+         const uint8_t *record = sample + 32;
+         uint32_t records = sampleGet32(sample + 28), r;
+         bool translated = false, forwarded = false;
+         uint32_t frameLength = 0;
+
+         for (r = 0; r < records; r++)
+         {
+            uint32_t recordTag, recordLength;
+
+            if (cursor - record < 8)
+            {
+               return -1;
+            }
+            recordTag = sampleGet32(record);
+            recordLength = sampleGet32(record + 4);
+            if ((uint32_t) (cursor - record - 8) < recordLength)
+            {
+               return -1;
+            }
+            if ((recordTag == SAMPLE_RAW_HEADER) && (recordLength >= 16))
+            {
+               frameLength = sampleGet32(record + 8 + 4);
+            }
+            translated |= (recordTag == SAMPLE_EXTENDED_NAT);
+            forwarded |= (recordTag == SAMPLE_EXTENDED_ROUTER);
+            record += 8 + recordLength;
+         }
+
+         if (out)
+         {
+            fprintf(out, "flow %u: %u bytes in on %u out on %u, 1 in %u, pool %u, drops %u%s\n",
+               sampleGet32(sample), frameLength, sampleGet32(sample + 20),
+               sampleGet32(sample + 24), sampleGet32(sample + 8), sampleGet32(sample + 12),
+               sampleGet32(sample + 16), translated ? ", translated" : "");
+         }
+         if (totals)
+         {
+            totals->flowSamples++;
+            totals->translated += translated;
+            totals->forwarded += forwarded;
+            totals->samplingRate = sampleGet32(sample + 8);
+            totals->samplePool = sampleGet32(sample + 12);
+            totals->drops = sampleGet32(sample + 16);
+         }
+      }
+      else if ((tag == SAMPLE_COUNTERS_SAMPLE)
+         && (sampleLength >= 12 + 8 + SAMPLE_GENERIC_INTERFACE_LEN)
+         && (sampleGet32(sample + 12) == SAMPLE_GENERIC_INTERFACE))
+      {
+         const uint8_t *counters = sample + 20;
+         uint32_t ifIndex = sampleGet32(counters);
+
+         if (out)
+         {
+            fprintf(out, "counters %u: interface %u in %u frames out %u frames\n",
+               sampleGet32(sample), ifIndex, sampleGet32(counters + 32), sampleGet32(counters + 64));
+         }
+         if (totals)
+         {
+            totals->counterSamples++;
+            if ((ifIndex >= 1) && (ifIndex <= SR_SAMPLE_MAX_INTERFACES))
+            {
+               totals->inPackets[ifIndex - 1] = sampleGet32(counters + 32);
+            }
+         }
+      }
+   }
+   return 0;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void *sampleWriterThread(void *samplerPtr)
+{
+   sr_sample_t *sampler = (sr_sample_t *) samplerPtr;
+   const struct timespec drainInterval = { 0, SR_SAMPLE_DRAIN_MS * 1000000L };
+
+   sr_watchdog_register("sample export");
+
+   while (1)
+   {
+      /* Read the stop flag first: everything pushed before it was set is
+       * then visible below. */
+      bool stop = __atomic_load_n(&sampler->stopRequested, __ATOMIC_ACQUIRE);
+      uint64_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+
+      if (head != sampler->tail)
+      {
+         sr_watchdog_stage(SR_WATCHDOG_SAMPLE_EXPORT);
+         sampleDrain(sampler, head);
+      }
+      else if (stop)
+      {
+         break;
+      }
+      else
+      {
+         sr_watchdog_idle();
+         nanosleep(&drainInterval, NULL);
+      }
+   }
+
+   sr_watchdog_unregister();
+   return NULL;
+}
+
+/**
+ * sampleDrain()\n
+ * @brief Sends the samples up to head in as few datagrams as they fit.
+ */
+static void sampleDrain(sr_sample_t *sampler, uint64_t head)
+{
+   uint8_t datagram[SR_SAMPLE_MAX_DATAGRAM];
+   uint8_t *cursor;
+   uint32_t samples, drops;
+   sr_sample_record_t *record;
+
+   while (sampler->tail != head)
+   {
+      cursor = datagram + SAMPLE_DATAGRAM_HDR_LEN;
+      samples = 0;
+      drops = (uint32_t) __atomic_load_n(&sampler->dropped, __ATOMIC_RELAXED);
+
+      while ((sampler->tail != head)
+         && (cursor + SAMPLE_MAX_FLOW_LEN <= datagram + sizeof(datagram)))
+      {
+         record = &sampler->ring[sampler->tail & SAMPLE_RING_MASK];
+         if (record->kind == SR_SAMPLE_FLOW)
+         {
+            cursor = samplePutFlow(cursor, sampler, &record->flow, drops);
+         }
+         else
+         {
+            cursor = samplePutCounters(cursor, &record->counters);
+         }
+         samples++;
+         __atomic_store_n(&sampler->tail, sampler->tail + 1, __ATOMIC_RELEASE);
+      }
+
+      samplePut32(samplePut32(samplePut32(samplePut32(samplePut32(samplePut32(samplePut32(datagram,
+         SAMPLE_SFLOW_VERSION), SAMPLE_ADDRESS_IPV4), ntohl(__atomic_load_n(&sampler->agentIp,
+         __ATOMIC_RELAXED))), sampler->subAgentId), ++sampler->datagramSequence),
+         (uint32_t) ((sr_clock_now() - sampler->started) * 1000)), samples);
+
+      sendto(sampler->socket, datagram, cursor - datagram, 0,
+         (struct sockaddr *) &sampler->collector, sizeof(sampler->collector));
+      __atomic_add_fetch(&sampler->datagrams, 1, __ATOMIC_RELAXED);
+      /* Last: sr_sample_flush() waits on it. */
+      __atomic_add_fetch(&sampler->exported, samples, __ATOMIC_RELEASE);
+   }
+}
+
+/** Queues a record, or counts it dropped if the ring is full. */
+static void samplePush(sr_sample_t *sampler, sr_sample_record_t *record)
+{
+   uint64_t head;
+
+   pthread_mutex_lock(&sampler->pushLock);
+   head = sampler->head;
+   if (head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE) >= SR_SAMPLE_RING_RECORDS)
+   {
+      __atomic_add_fetch(&sampler->dropped, 1, __ATOMIC_RELAXED);
+   }
+   else
+   {
+      if (record->kind == SR_SAMPLE_FLOW)
+      {
+         record->flow.sequence = ++sampler->flowSequence;
+      }
+      else
+      {
+         record->counters.sequence = ++sampler->counterSequence;
+      }
+      sampler->ring[head & SAMPLE_RING_MASK] = *record;
+      __atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&sampler->pushLock);
+}
+
+/** Frames to skip before the next sample: uniform over 0 .. 2 * rate - 2. */
+static uint32_t sampleNextSkip(unsigned int rate)
+{
+   if (sampleRandom == 0)
+   {
+      /* Threads must not sample in step. */
+      sampleRandom = ((uint64_t) (uintptr_t) &sampleCurrent * 0x9E3779B97F4A7C15ULL)
+         ^ (uint64_t) time(NULL);
+      sampleRandom |= 1;
+   }
+   /* xorshift64* */
+   sampleRandom ^= sampleRandom >> 12;
+   sampleRandom ^= sampleRandom << 25;
+   sampleRandom ^= sampleRandom >> 27;
+   return (uint32_t) (((sampleRandom * 0x2545F4914F6CDD1DULL) >> 32) % (2 * rate - 1));
+}
+
+static uint8_t *samplePutFlow(uint8_t *cursor, const sr_sample_t *sampler,
+   const sr_sample_flow_t *flow, uint32_t drops)
+{
+   uint8_t *lengthField;
+   uint32_t records = 1, padded = (flow->headerLength + 3) & ~3U;
+
+   cursor = samplePut32(cursor, SAMPLE_FLOW_SAMPLE);
+   lengthField = cursor;
+   cursor += 4;
+   cursor = samplePut32(cursor, flow->sequence);
+   cursor = samplePut32(cursor, flow->inputIndex); /* source id: type 0, ifIndex */
+   cursor = samplePut32(cursor, sampler->rate);
+   cursor = samplePut32(cursor, flow->samplePool);
+   cursor = samplePut32(cursor, drops);
+   cursor = samplePut32(cursor, flow->inputIndex);
+   cursor = samplePut32(cursor, flow->outputIndex);
+   records += (flow->outputIndex != 0) + 2 * (flow->natSourceIp != 0);
+   cursor = samplePut32(cursor, records);
+
+   cursor = samplePut32(cursor, SAMPLE_RAW_HEADER);
+   cursor = samplePut32(cursor, 16 + padded);
+   cursor = samplePut32(cursor, SAMPLE_PROTOCOL_ETHERNET);
+   cursor = samplePut32(cursor, flow->frameLength);
+   cursor = samplePut32(cursor, 0); /* stripped */
+   cursor = samplePut32(cursor, flow->headerLength);
+   memcpy(cursor, flow->header, flow->headerLength);
+   memset(cursor + flow->headerLength, 0, padded - flow->headerLength);
+   cursor += padded;
+
+   if (flow->outputIndex != 0)
+   {
+      cursor = samplePut32(cursor, SAMPLE_EXTENDED_ROUTER);
+      cursor = samplePut32(cursor, 16);
+      cursor = samplePut32(cursor, SAMPLE_ADDRESS_IPV4);
+      cursor = samplePut32(cursor, ntohl(flow->nextHop));
+      cursor = samplePut32(cursor, 0); /* source mask */
+      cursor = samplePut32(cursor, 0); /* destination mask */
+   }
+   if (flow->natSourceIp != 0)
+   {
+      cursor = samplePut32(cursor, SAMPLE_EXTENDED_NAT);
+      cursor = samplePut32(cursor, 16);
+      cursor = samplePut32(cursor, SAMPLE_ADDRESS_IPV4);
+      cursor = samplePut32(cursor, ntohl(flow->natSourceIp));
+      cursor = samplePut32(cursor, SAMPLE_ADDRESS_IPV4);
+      cursor = samplePut32(cursor, ntohl(flow->natDestinationIp));
+
+      cursor = samplePut32(cursor, SAMPLE_EXTENDED_NAT_PORT);
+      cursor = samplePut32(cursor, 8);
+      cursor = samplePut32(cursor, ntohs(flow->natSourcePort));
+      cursor = samplePut32(cursor, ntohs(flow->natDestinationPort));
+   }
+
+   samplePut32(lengthField, (uint32_t) (cursor - lengthField - 4));
+   return cursor;
+}
+
+static uint8_t *samplePutCounters(uint8_t *cursor, const sr_sample_counters_t *counters)
+{
+   cursor = samplePut32(cursor, SAMPLE_COUNTERS_SAMPLE);
+   cursor = samplePut32(cursor, SAMPLE_COUNTERS_LEN - 8);
+   cursor = samplePut32(cursor, counters->sequence);
+   cursor = samplePut32(cursor, counters->ifIndex); /* source id: type 0, ifIndex */
+   cursor = samplePut32(cursor, 1);
+
+   cursor = samplePut32(cursor, SAMPLE_GENERIC_INTERFACE);
+   cursor = samplePut32(cursor, SAMPLE_GENERIC_INTERFACE_LEN);
+   cursor = samplePut32(cursor, counters->ifIndex);
+   cursor = samplePut32(cursor, SAMPLE_IF_TYPE_ETHERNET);
+   cursor = samplePut64(cursor, 0); /* speed unknown */
+   cursor = samplePut32(cursor, SAMPLE_IF_FULL_DUPLEX);
+   cursor = samplePut32(cursor, SAMPLE_IF_UP);
+   cursor = samplePut64(cursor, counters->octets[SR_SAMPLE_IN]);
+   cursor = samplePut32(cursor, (uint32_t) counters->packets[SR_SAMPLE_IN]);
+   memset(cursor, 0, 5 * 4); /* multicast, broadcast, discards, errors, unknown protocols */
+   cursor += 5 * 4;
+   cursor = samplePut64(cursor, counters->octets[SR_SAMPLE_OUT]);
+   cursor = samplePut32(cursor, (uint32_t) counters->packets[SR_SAMPLE_OUT]);
+   memset(cursor, 0, 5 * 4); /* multicast, broadcast, discards, errors, promiscuous */
+   return cursor + 5 * 4;
+}
+
+/**
+ * samplePorts()\n
+ * @brief Reads a TCP or UDP datagram's ports, if they are in the first
+ *        available bytes.
+ * @return false for other protocols and later fragments.
+ */
+static bool samplePorts(const sr_ip_hdr_t *packet, size_t available, uint16_t *sourcePort,
+   uint16_t *destinationPort)
+{
+   size_t headerLength = packet->ip_hl * 4;
+   const sr_udp_hdr_t *ports = (const sr_udp_hdr_t *) (((const uint8_t *) packet) + headerLength);
+
+   if (((packet->ip_p != ip_protocol_tcp) && (packet->ip_p != ip_protocol_udp))
+      || ((ntohs(packet->ip_off) & IP_OFFMASK) != 0) || (available < headerLength + 4))
+   {
+      return false;
+   }
+   *sourcePort = ports->sourcePort;
+   *destinationPort = ports->destinationPort;
+   return true;
+}
+
+static uint8_t *samplePut32(uint8_t *cursor, uint32_t value)
+{
+   cursor[0] = (uint8_t) (value >> 24);
+   cursor[1] = (uint8_t) (value >> 16);
+   cursor[2] = (uint8_t) (value >> 8);
+   cursor[3] = (uint8_t) value;
+   return cursor + 4;
+}
+
+static uint8_t *samplePut64(uint8_t *cursor, uint64_t value)
+{
+   cursor = samplePut32(cursor, (uint32_t) (value >> 32));
+   return samplePut32(cursor, (uint32_t) value);
+}
+
+static uint32_t sampleGet32(const uint8_t *cursor)
+{
+   return ((uint32_t) cursor[0] << 24) | ((uint32_t) cursor[1] << 16) | ((uint32_t) cursor[2] << 8)
+      | cursor[3];
+}
@@ -0,0 +1,262 @@
+/**
+ * @file sr_sample.h
+ * @brief Random packet sampling exported as sFlow version 5 datagrams.
+ *
+ * Each thread handling frames keeps a countdown of frames to skip. When it
+ * reaches zero the frame is sampled and the countdown is drawn afresh from
+ * a per-thread random generator, uniform over 0 .. 2 * rate - 2, so one
+ * frame in rate is sampled on average without any periodic pattern. A
+ * skipped frame costs the decrement.
+ *
+ * A sampled frame keeps its first SR_SAMPLE_HEADER_BYTES bytes and input
+ * interface. If the router then sends the same datagram on (same protocol
+ * and IP identification), the output interface, next hop and, if the NAT
+ * changed them, the translated addresses and ports are added. The sample
+ * then goes through a ring to a writer thread, which every
+ * SR_SAMPLE_DRAIN_MS packs samples into sFlow datagrams for the collector.
+ *
+ * Every SR_SAMPLE_COUNTER_INTERVAL seconds, a counter sample for each
+ * interface (frames and bytes in and out, counted for every frame) goes
+ * the same way. Samples the writer can't keep up with are counted as
+ * dropped and reported in the next flow sample, as sFlow does.
+ */
+
+#ifndef SR_SAMPLE_H
+#define SR_SAMPLE_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "sr_protocol.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_SAMPLE_HEADER_BYTES         (128) /**< Of each sampled frame. */
+#define SR_SAMPLE_RING_BITS            (10)
+#define SR_SAMPLE_RING_RECORDS         (1 << SR_SAMPLE_RING_BITS)
+#define SR_SAMPLE_MAX_INTERFACES       (8) /**< Further interfaces aren't counted. */
+#define SR_SAMPLE_COUNTER_INTERVAL     (20) /**< Seconds between counter samples. */
+#define SR_SAMPLE_DRAIN_MS             (50)
+#define SR_SAMPLE_MAX_DATAGRAM         (1400) /**< Fits a UDP datagram on Ethernet. */
+#define SR_SAMPLE_MAX_COLLECTOR        (256)
+#define SR_SAMPLE_DEFAULT_COLLECTOR    "127.0.0.1:6343"
+#define SR_SAMPLE_CACHE_LINE           (64)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+struct sr_if;
+
+typedef enum
+{
+   SR_SAMPLE_IN,
+   SR_SAMPLE_OUT,
+   SR_SAMPLE_DIRECTIONS
+} sr_sample_direction_t;
+
+typedef enum
+{
+   SR_SAMPLE_FLOW, /**< A sampled frame. */
+   SR_SAMPLE_COUNTERS /**< An interface's counters. */
+} sr_sample_kind_t;
+
+/** A sampled frame. Addresses in network byte order. */
+typedef struct
+{
+   uint32_t sequence;
+   uint32_t samplePool; /**< Frames seen on all interfaces when sampled. */
+   uint32_t inputIndex; /**< sFlow ifIndex: position among counted interfaces, from 1. */
+   uint32_t outputIndex; /**< 0 if not sent on. */
+   uint32_t frameLength;
+   uint32_t nextHop; /**< 0 if not sent on. */
+   uint32_t natSourceIp; /**< Addresses after translation; 0 if not translated. */
+   uint32_t natDestinationIp;
+   uint16_t natSourcePort;
+   uint16_t natDestinationPort;
+   uint16_t headerLength;
+   uint8_t header[SR_SAMPLE_HEADER_BYTES];
+} sr_sample_flow_t;
+
+/** An interface's counters, since start-up. */
+typedef struct
+{
+   uint32_t sequence;
+   uint32_t ifIndex;
+   uint64_t packets[SR_SAMPLE_DIRECTIONS];
+   uint64_t octets[SR_SAMPLE_DIRECTIONS];
+} sr_sample_counters_t;
+
+typedef struct
+{
+   uint8_t kind; /**< sr_sample_kind_t */
+   union
+   {
+      sr_sample_flow_t flow;
+      sr_sample_counters_t counters;
+   };
+} sr_sample_record_t;
+
+/** What sr_sample_decode() found. */
+typedef struct
+{
+   uint64_t datagrams;
+   uint64_t flowSamples;
+   uint64_t counterSamples;
+   uint64_t translated; /**< Flow samples with NAT records. */
+   uint64_t forwarded; /**< Flow samples with a next hop. */
+   uint32_t samplingRate; /**< Of the last flow sample. */
+   uint32_t samplePool; /**< Of the last flow sample. */
+   uint32_t drops; /**< Of the last flow sample. */
+   uint32_t inPackets[SR_SAMPLE_MAX_INTERFACES]; /**< By ifIndex - 1, from the last counter sample. */
+} sr_sample_totals_t;
+
+typedef struct sr_sample
+{
+   /* Producers: the threads handling frames and the tick. */
+   pthread_mutex_t pushLock;
+   uint64_t head __attribute__((aligned(SR_SAMPLE_CACHE_LINE)));
+   uint64_t dropped; /**< Samples lost with the ring full. */
+   uint32_t flowSequence;
+   uint32_t counterSequence;
+
+   /* Consumer side, written by the writer thread. */
+   uint64_t tail __attribute__((aligned(SR_SAMPLE_CACHE_LINE)));
+   uint64_t exported; /**< Samples in datagrams sent. */
+   uint64_t datagrams;
+   uint32_t datagramSequence;
+
+   sr_sample_record_t *ring;
+
+   /* Interface counters, updated with relaxed atomics for every frame.
+    * Interfaces are only ever added, under the push lock. */
+   const struct sr_if *interfaces[SR_SAMPLE_MAX_INTERFACES] __attribute__((aligned(SR_SAMPLE_CACHE_LINE)));
+   unsigned int interfaceCount;
+   uint64_t packets[SR_SAMPLE_MAX_INTERFACES][SR_SAMPLE_DIRECTIONS];
+   uint64_t octets[SR_SAMPLE_MAX_INTERFACES][SR_SAMPLE_DIRECTIONS];
+   uint64_t untracked; /**< Frames on interfaces beyond the limit. */
+
+   unsigned int rate; /**< One frame in rate is sampled. */
+   uint32_t agentIp; /**< Network byte order; the first interface's, once known. */
+   uint32_t subAgentId;
+   time_t started;
+   time_t lastCounters;
+   char collectorName[SR_SAMPLE_MAX_COLLECTOR];
+   int socket;
+   struct sockaddr_in collector;
+   bool stopRequested;
+   pthread_t thread;
+} sr_sample_t;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_sample_parse(const char *spec, unsigned int *rate, char *collector, size_t collectorSize);
+sr_sample_t *sr_sample_create(unsigned int rate, const char *collector, uint32_t subAgentId);
+void sr_sample_destroy(sr_sample_t *sampler);
+bool sr_sample_flush(sr_sample_t *sampler, unsigned int timeoutMs);
+
+unsigned int sr_sample_add_interface(sr_sample_t *sampler, const struct sr_if *interface,
+   sr_sample_direction_t direction, unsigned int length);
+bool sr_sample_take(sr_sample_t *sampler, unsigned int ifIndex, const uint8_t *frame,
+   unsigned int length);
+void sr_sample_forwarded(sr_sample_t *sampler, unsigned int ifIndex, uint32_t nextHop,
+   const sr_ip_hdr_t *packet);
+void sr_sample_end(sr_sample_t *sampler);
+void sr_sample_tick(struct sr_instance *sr);
+void sr_sample_print(const struct sr_instance *sr, FILE *out);
+
+int sr_sample_decode(const uint8_t *datagram, size_t length, FILE *out,
+   sr_sample_totals_t *totals);
+
+/*
+ * Inline Function Definitions
+ */
+
+/** Frames this thread still skips before the next sample. */
+extern __thread uint32_t srSampleSkip;
+/** The frame being sampled by this thread, if any. */
+extern __thread sr_sample_flow_t *srSamplePending;
+
+/**
+ * Counts a frame on an interface. Interfaces are numbered as first seen.
+ * @return the interface's sFlow ifIndex, 0 if it isn't counted.
+ */
+static inline unsigned int sr_sample_count(sr_sample_t *sampler, const struct sr_if *interface,
+   sr_sample_direction_t direction, unsigned int length)
+{
+   unsigned int count = __atomic_load_n(&sampler->interfaceCount, __ATOMIC_ACQUIRE);
+   unsigned int i;
+
+   for (i = 0; i < count; i++)
+   {
+      if (sampler->interfaces[i] == interface)
+      {
+         __atomic_add_fetch(&sampler->packets[i][direction], 1, __ATOMIC_RELAXED);
+         __atomic_add_fetch(&sampler->octets[i][direction], length, __ATOMIC_RELAXED);
+         return i + 1;
+      }
+   }
+   return sr_sample_add_interface(sampler, interface, direction, length);
+}
+
+/**
+ * Counts a received frame and, if this thread's countdown has run out,
+ * samples it.
+ * @param sampler may be NULL, in which case nothing is done.
+ * @return true if the frame is being sampled: call sr_sample_end() once
+ *         the router is done with it.
+ */
+static inline bool sr_sample_received(sr_sample_t *sampler, const struct sr_if *interface,
+   const uint8_t *frame, unsigned int length)
+{
+   unsigned int ifIndex;
+
+   if (sampler == NULL)
+   {
+      return false;
+   }
+   ifIndex = sr_sample_count(sampler, interface, SR_SAMPLE_IN, length);
+   if (srSampleSkip != 0)
+   {
+      srSampleSkip--;
+      return false;
+   }
+   return sr_sample_take(sampler, ifIndex, frame, length);
+}
+
+/**
+ * Counts a datagram sent out of an interface, and completes the sample if
+ * it is the datagram being sampled.
+ * @param sampler may be NULL, in which case nothing is done.
+ * @param nextHop network byte order.
+ */
+static inline void sr_sample_sent(sr_sample_t *sampler, const struct sr_if *interface,
+   uint32_t nextHop, const sr_ip_hdr_t *packet, unsigned int length)
+{
+   unsigned int ifIndex;
+
+   if (sampler == NULL)
+   {
+      return;
+   }
+   ifIndex = sr_sample_count(sampler, interface, SR_SAMPLE_OUT, length);
+   if (srSamplePending)
+   {
+      sr_sample_forwarded(sampler, ifIndex, nextHop, packet);
+   }
+}
+
+#endif /* SR_SAMPLE_H */
@@ -0,0 +1,474 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "sr_sched.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Types
+ *-----------------------------------------------------------------------------
+ */
+
+typedef struct
+{
+   unsigned int threads; /**< Threads sr_sched_apply() was called on. */
+   unsigned int applied; /**< Threads whose settings read back as asked. */
+   int error; /**< errno of the first failure, or 0 if the readback differed. */
+} schedRoleStatus_t;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static bool schedRoleConfigured(sr_sched_role_t role);
+static int schedParseThread(sr_sched_thread_t *thread, const char *value);
+static void schedPrefault(unsigned int bytes);
+static long schedLockedKB(void);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const schedRoleNames[SR_SCHED_ROLE_COUNT] = { "reader", "timer", "sync" };
+
+static pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
+static sr_sched_profile_t schedProfile =
+{
+   { { SR_SCHED_ANY_CPU, 0 }, { SR_SCHED_ANY_CPU, 0 }, { SR_SCHED_ANY_CPU, 0 } }, false, 0
+};
+static schedRoleStatus_t schedStatus[SR_SCHED_ROLE_COUNT];
+static int schedLockError = -1; /**< -1 until sr_sched_lock_memory() has run. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_sched_profile_init()\n
+ * @brief Fills in a profile that changes nothing.
+ */
+void sr_sched_profile_init(sr_sched_profile_t *profile)
+{
+   unsigned int role;
+
+   assert(profile);
+
+   for (role = 0; role < SR_SCHED_ROLE_COUNT; role++)
+   {
+      profile->threads[role].cpu = SR_SCHED_ANY_CPU;
+      profile->threads[role].priority = 0;
+   }
+   profile->lockMemory = false;
+   profile->prefaultKB = 0;
+}
+
+/**
+ * sr_sched_parse()\n
+ * @brief Adds the settings in a profile specification to a profile.
+ * @param profile pointer to the profile to update.
+ * @param spec comma separated items: "ROLE=CPU[:PRIORITY]" where ROLE is
+ *        reader, timer or sync and CPU is a number or "any"; "lock"; and
+ *        "prefault=KB". For example "reader=1:50,timer=0,lock,prefault=8192".
+ * @return 0 on success, -1 if an item is not understood.
+ */
+int sr_sched_parse(sr_sched_profile_t *profile, const char *spec)
+{
+   char *copy = strdup(spec);
+   char *item, *savePtr;
+   int result = 0;
+
+   assert(profile);
+
+   if (copy == NULL)
+   {
+      return -1;
+   }
+
+   for (item = strtok_r(copy, ",", &savePtr); item && (result == 0);
+      item = strtok_r(NULL, ",", &savePtr))
+   {
+      char *value = strchr(item, '=');
+      unsigned int role;
+
+      if (value)
+      {
+         *value++ = '\0';
+      }
+
+      if (strcmp(item, "lock") == 0)
+      {
+         profile->lockMemory = true;
+         result = value ? -1 : 0;
+         continue;
+      }
+      if (strcmp(item, "prefault") == 0)
+      {
+         result = (value && (atoi(value) > 0)) ? 0 : -1;
+         profile->prefaultKB = value ? atoi(value) : 0;
+         continue;
+      }
+
+      for (role = 0; role < SR_SCHED_ROLE_COUNT; role++)
+      {
+         if (strcmp(item, schedRoleNames[role]) == 0)
+         {
+            break;
+         }
+      }
+      result = ((role < SR_SCHED_ROLE_COUNT) && value) ?
+         schedParseThread(&profile->threads[role], value) : -1;
+   }
+
+   free(copy);
+   return result;
+}
+
+/**
+ * sr_sched_profile_empty()\n
+ * @return true if the profile leaves every thread and the memory alone.
+ */
+bool sr_sched_profile_empty(const sr_sched_profile_t *profile)
+{
+   unsigned int role;
+
+   for (role = 0; role < SR_SCHED_ROLE_COUNT; role++)
+   {
+      if ((profile->threads[role].cpu != SR_SCHED_ANY_CPU) || (profile->threads[role].priority > 0))
+      {
+         return false;
+      }
+   }
+   return !profile->lockMemory && (profile->prefaultKB == 0);
+}
+
+/**
+ * sr_sched_configure()\n
+ * @brief Makes a profile the process's and forgets what was applied so far.
+ * @note Call before any router thread is created.
+ */
+void sr_sched_configure(const sr_sched_profile_t *profile)
+{
+   pthread_mutex_lock(&schedLock);
+   schedProfile = *profile;
+   memset(schedStatus, 0, sizeof(schedStatus));
+   schedLockError = -1;
+   pthread_mutex_unlock(&schedLock);
+}
+
+/**
+ * sr_sched_apply()\n
+ * @brief Pins a thread and sets its priority as the profile asks for its
+ *        role, then reads both back.
+ * @param thread the thread, which needn't be the caller.
+ * @param role what the thread does.
+ * @return 0 if the settings took (or the role is unconfigured), -1 if not.
+ */
+int sr_sched_apply(pthread_t thread, sr_sched_role_t role)
+{
+   sr_sched_thread_t settings;
+   schedRoleStatus_t *status = &schedStatus[role];
+   int error = 0;
+   bool applied = true;
+
+   assert(role < SR_SCHED_ROLE_COUNT);
+
+   pthread_mutex_lock(&schedLock);
+   if (!schedRoleConfigured(role))
+   {
+      pthread_mutex_unlock(&schedLock);
+      return 0;
+   }
+   settings = schedProfile.threads[role];
+
+   if (settings.cpu != SR_SCHED_ANY_CPU)
+   {
+      cpu_set_t cpus;
+
+      CPU_ZERO(&cpus);
+      CPU_SET(settings.cpu, &cpus);
+      error = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+      if (error == 0)
+      {
+         error = pthread_getaffinity_np(thread, sizeof(cpus), &cpus);
+         applied = (error == 0) && (CPU_COUNT(&cpus) == 1) && CPU_ISSET(settings.cpu, &cpus);
+      }
+   }
+
+   if ((error == 0) && applied && (settings.priority > 0))
+   {
+      struct sched_param parameters;
+      int policy;
+
+      memset(&parameters, 0, sizeof(parameters));
+      parameters.sched_priority = settings.priority;
+      error = pthread_setschedparam(thread, SCHED_FIFO, &parameters);
+      if (error == 0)
+      {
+         error = pthread_getschedparam(thread, &policy, &parameters);
+         applied = (error == 0) && (policy == SCHED_FIFO)
+            && (parameters.sched_priority == settings.priority);
+      }
+   }
+
+   status->threads++;
+   if ((error == 0) && applied)
+   {
+      status->applied++;
+   }
+   else if (status->applied == status->threads - 1)
+   {
+      /* Keep the first failure; later ones are usually the same. */
+      status->error = error;
+   }
+   pthread_mutex_unlock(&schedLock);
+
+   return ((error == 0) && applied) ? 0 : -1;
+}
+
+/**
+ * sr_sched_lock_memory()\n
+ * @brief Locks the process's memory and prefaults the heap and stack as the
+ *        profile asks.
+ * @note Prefaulting turns off heap trimming and mmap()ed allocations, so
+ *       freed memory stays resident for the next packet.
+ * @return 0 on success (or if nothing was asked), -1 if mlockall() failed.
+ */
+int sr_sched_lock_memory(void)
+{
+   sr_sched_profile_t profile;
+   int error = 0;
+
+   pthread_mutex_lock(&schedLock);
+   profile = schedProfile;
+   pthread_mutex_unlock(&schedLock);
+
+   if (profile.lockMemory && (mlockall(MCL_CURRENT | MCL_FUTURE) != 0))
+   {
+      error = errno;
+   }
+
+   if (profile.prefaultKB > 0)
+   {
+      mallopt(M_TRIM_THRESHOLD, -1);
+      mallopt(M_MMAP_MAX, 0);
+      schedPrefault(profile.prefaultKB * 1024);
+   }
+
+   pthread_mutex_lock(&schedLock);
+   schedLockError = error;
+   pthread_mutex_unlock(&schedLock);
+
+   return (error == 0) ? 0 : -1;
+}
+
+/**
+ * sr_sched_verify()\n
+ * @brief Reports, for each configured role and for memory locking, what was
+ *        asked for and whether it was granted.
+ * @param out stream to report to, one line per item.
+ * @return 0 if everything asked for is in effect, -1 if not.
+ */
+int sr_sched_verify(FILE *out)
+{
+   unsigned int role;
+   int result = 0;
+
+   pthread_mutex_lock(&schedLock);
+
+   for (role = 0; role < SR_SCHED_ROLE_COUNT; role++)
+   {
+      const sr_sched_thread_t *settings = &schedProfile.threads[role];
+      const schedRoleStatus_t *status = &schedStatus[role];
+      bool ok = (status->applied == status->threads);
+
+      if (!schedRoleConfigured(role))
+      {
+         continue;
+      }
+
+      fprintf(out, "sched: %-6s ", schedRoleNames[role]);
+      if (settings->cpu != SR_SCHED_ANY_CPU)
+      {
+         fprintf(out, "CPU %d", settings->cpu);
+      }
+      else
+      {
+         fprintf(out, "any CPU");
+      }
+      if (settings->priority > 0)
+      {
+         fprintf(out, ", SCHED_FIFO %d", settings->priority);
+      }
+      fprintf(out, ": %u/%u threads", status->applied, status->threads);
+      if (!ok)
+      {
+         fprintf(out, " FAILED (%s)", status->error ? strerror(status->error) :
+            "settings did not read back");
+         result = -1;
+      }
+      fprintf(out, "\n");
+   }
+
+   if (schedProfile.lockMemory)
+   {
+      long lockedKB = schedLockedKB();
+
+      fprintf(out, "sched: memory locked: ");
+      if (schedLockError == -1)
+      {
+         fprintf(out, "FAILED (never attempted)\n");
+         result = -1;
+      }
+      else if (schedLockError != 0)
+      {
+         fprintf(out, "FAILED (%s)\n", strerror(schedLockError));
+         result = -1;
+      }
+      else if (lockedKB == 0)
+      {
+         fprintf(out, "FAILED (VmLck is 0 kB)\n");
+         result = -1;
+      }
+      else if (lockedKB < 0)
+      {
+         fprintf(out, "yes\n");
+      }
+      else
+      {
+         fprintf(out, "%ld kB\n", lockedKB);
+      }
+   }
+   if (schedProfile.prefaultKB > 0)
+   {
+      fprintf(out, "sched: heap prefaulted: %u kB%s\n", schedProfile.prefaultKB,
+         (schedLockError == -1) ? " FAILED (never attempted)" : "");
+      if (schedLockError == -1)
+      {
+         result = -1;
+      }
+   }
+
+   pthread_mutex_unlock(&schedLock);
+   fflush(out);
+   return result;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static bool schedRoleConfigured(sr_sched_role_t role)
+{
+   return (schedProfile.threads[role].cpu != SR_SCHED_ANY_CPU)
+      || (schedProfile.threads[role].priority > 0);
+}
+
+/**
+ * schedParseThread()\n
+ * @brief Parses "CPU[:PRIORITY]" where CPU is a number or "any".
+ * @return 0 on success, -1 if malformed or out of range.
+ */
+static int schedParseThread(sr_sched_thread_t *thread, const char *value)
+{
+   const char *priority = strchr(value, ':');
+   char *end;
+
+   if (strncmp(value, "any", 3) == 0)
+   {
+      thread->cpu = SR_SCHED_ANY_CPU;
+      end = (char *) value + 3;
+   }
+   else
+   {
+      thread->cpu = (int) strtol(value, &end, 10);
+      if ((end == value) || (thread->cpu < 0) || (thread->cpu >= CPU_SETSIZE))
+      {
+         return -1;
+      }
+   }
+   if (end != (priority ? priority : value + strlen(value)))
+   {
+      return -1;
+   }
+
+   thread->priority = 0;
+   if (priority)
+   {
+      thread->priority = (int) strtol(priority + 1, &end, 10);
+      if ((*end != '\0') || (thread->priority < sched_get_priority_min(SCHED_FIFO))
+         || (thread->priority > sched_get_priority_max(SCHED_FIFO)))
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/**
+ * schedPrefault()\n
+ * @brief Faults in a heap block (left in the allocator when freed) and the
+ *        top of the calling thread's stack.
+ */
+static void schedPrefault(unsigned int bytes)
+{
+   volatile uint8_t stack[SR_SCHED_STACK_PREFAULT];
+   long pageSize = sysconf(_SC_PAGESIZE);
+   uint8_t *heap = malloc(bytes);
+   unsigned int offset;
+
+   if (heap)
+   {
+      for (offset = 0; offset < bytes; offset += pageSize)
+      {
+         heap[offset] = 0;
+      }
+      free(heap);
+   }
+   for (offset = 0; offset < sizeof(stack); offset += pageSize)
+   {
+      stack[offset] = 0;
+   }
+}
+
+/** @return VmLck from /proc/self/status in kB, or -1 if unavailable. */
+static long schedLockedKB(void)
+{
+   FILE *status = fopen("/proc/self/status", "r");
+   char line[256];
+   long lockedKB = -1;
+
+   if (status == NULL)
+   {
+      return -1;
+   }
+   while (fgets(line, sizeof(line), status))
+   {
+      if (sscanf(line, "VmLck: %ld kB", &lockedKB) == 1)
+      {
+         break;
+      }
+   }
+   fclose(status);
+   return lockedKB;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file sr_sched.h
+ * @brief CPU pinning, real-time priorities and memory locking for deployment.
+ *
+ * By default every router thread is created with default attributes: the
+ * kernel migrates them freely and the first touch of a heap page is a page
+ * fault on the packet path. A scheduling profile (the -S option) assigns
+ * each thread role a CPU and optionally a SCHED_FIFO priority, and can lock
+ * the process's memory with mlockall() and prefault the heap and stack.
+ *
+ * Roles:
+ *    - reader: the thread reading VNS and handling packets (the main thread,
+ *      which also hosts the -C instances).
+ *    - timer: the ARP and NAT timeout threads, or the shared sr_multi timer.
+ *    - sync: the NAT replication sender.
+ *
+ * The profile is process wide. Whoever creates a thread calls
+ * sr_sched_apply() on it, which applies the role's settings and reads them
+ * back. sr_sched_verify() then reports what was asked for and what the
+ * kernel actually granted, so a deployment can refuse to run half
+ * isolated. Roles left unconfigured are not touched.
+ */
+
+#ifndef SR_SCHED_H
+#define SR_SCHED_H
+
+/*
+ * Include Files
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_SCHED_ANY_CPU         (-1)
+#define SR_SCHED_STACK_PREFAULT  (256 * 1024) /**< Bytes of stack touched by sr_sched_lock_memory(). */
+
+/*
+ * Public Types
+ */
+
+typedef enum
+{
+   SR_SCHED_READER,
+   SR_SCHED_TIMER,
+   SR_SCHED_SYNC,
+   SR_SCHED_ROLE_COUNT
+} sr_sched_role_t;
+
+typedef struct sr_sched_thread
+{
+   int cpu; /**< CPU to pin to, or SR_SCHED_ANY_CPU. */
+   int priority; /**< SCHED_FIFO priority, or 0 for the default policy. */
+} sr_sched_thread_t;
+
+typedef struct sr_sched_profile
+{
+   sr_sched_thread_t threads[SR_SCHED_ROLE_COUNT];
+   bool lockMemory; /**< mlockall(MCL_CURRENT | MCL_FUTURE). */
+   unsigned int prefaultKB; /**< Heap to fault in and keep, or 0. */
+} sr_sched_profile_t;
+
+/*
+ * Public Function Declarations
+ */
+
+void sr_sched_profile_init(sr_sched_profile_t *profile);
+int sr_sched_parse(sr_sched_profile_t *profile, const char *spec);
+bool sr_sched_profile_empty(const sr_sched_profile_t *profile);
+void sr_sched_configure(const sr_sched_profile_t *profile);
+int sr_sched_apply(pthread_t thread, sr_sched_role_t role);
+int sr_sched_lock_memory(void);
+int sr_sched_verify(FILE *out);
+
+#endif /* SR_SCHED_H */
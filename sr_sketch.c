@@ -0,0 +1,531 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_sketch.h"
+#include "sr_clock.h"
+#include "sr_if.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define SKETCH_SEED  (0x9E3779B97F4A7C15ULL)
+
+/* Each row is indexed by its own bits of one 64-bit hash. */
+#if (SR_SKETCH_DEPTH * SR_SKETCH_WIDTH_BITS) > 64
+#error "sketch rows need more bits than one hash has"
+#endif
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static unsigned int sketchInterfaceIndex(sr_sketch_t *sketch, const struct sr_if *interface);
+static void sketchAdd(sr_sketch_t *sketch, const sr_sketch_key_t *key, unsigned int bytes);
+static void sketchOffer(sr_sketch_top_t *top, const sr_sketch_key_t *key, uint64_t estimate);
+static void sketchFindSmallest(sr_sketch_top_t *top);
+static bool sketchSameKey(const sr_sketch_key_t *first, const sr_sketch_key_t *second);
+static unsigned int sketchSorted(const sr_sketch_top_t *top, sr_sketch_entry_t *entries);
+static void sketchWrite(const struct sr_instance *sr, FILE *out);
+static void sketchWriteKey(const sr_sketch_key_t *key, FILE *out);
+static void sketchReset(sr_sketch_t *sketch);
+static uint64_t sketchMix(uint64_t value);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const sketchDirectionNames[SR_SKETCH_DIRECTIONS] = { "in", "out" };
+static const char * const sketchKindNames[SR_SKETCH_KINDS] = { "sources", "destinations", "flows" };
+static const char * const sketchMetricNames[SR_SKETCH_METRICS] = { "packets", "bytes" };
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_sketch_create()\n
+ * @brief Allocates an empty sketch.
+ * @param intervalS seconds between dumps to the log, after each of which
+ *        counting starts over; 0 counts from start-up and never logs.
+ * @param logPath file the dumps are appended to.
+ * @return the sketch, or NULL if the log could not be opened.
+ */
+sr_sketch_t *sr_sketch_create(unsigned int intervalS, const char *logPath)
+{
+   sr_sketch_t *sketch = calloc(1, sizeof(sr_sketch_t));
+
+   assert(sketch);
+
+   if (intervalS > 0)
+   {
+      assert(logPath);
+      sketch->log = fopen(logPath, "a");
+      if (sketch->log == NULL)
+      {
+         perror(logPath);
+         free(sketch);
+         return NULL;
+      }
+   }
+
+   pthread_mutex_init(&sketch->lock, NULL);
+   sketch->intervalS = intervalS;
+   sketch->intervalStart = sr_clock_now();
+   return sketch;
+}
+
+void sr_sketch_destroy(sr_sketch_t *sketch)
+{
+   if (sketch == NULL)
+   {
+      return;
+   }
+
+   if (sketch->log)
+   {
+      fclose(sketch->log);
+   }
+   pthread_mutex_destroy(&sketch->lock);
+   free(sketch);
+}
+
+/**
+ * sr_sketch_count()\n
+ * @brief Counts an IP datagram under its source, destination and flow.
+ * @param sketch pointer to the sketch.
+ * @param interface interface the datagram was received on or is sent out of.
+ * @param direction SR_SKETCH_IN or SR_SKETCH_OUT.
+ * @param packet pointer to the IP header, already validated for "in".
+ * @param length bytes of IP header and payload.
+ */
+void sr_sketch_count(sr_sketch_t *sketch, const struct sr_if *interface,
+   sr_sketch_direction_t direction, const sr_ip_hdr_t *packet, unsigned int length)
+{
+   sr_sketch_key_t key;
+   unsigned int index;
+   unsigned int headerLength = packet->ip_hl * 4;
+   uint16_t sourcePort = 0, destinationPort = 0;
+
+   /* Only the first fragment has the ports. */
+   if (((packet->ip_p == ip_protocol_tcp) || (packet->ip_p == ip_protocol_udp))
+      && ((ntohs(packet->ip_off) & IP_OFFMASK) == 0)
+      && (length >= headerLength + sizeof(sr_udp_hdr_t)))
+   {
+      const sr_udp_hdr_t *ports = (const sr_udp_hdr_t *) (((const uint8_t *) packet) + headerLength);
+
+      sourcePort = ports->sourcePort;
+      destinationPort = ports->destinationPort;
+   }
+
+   pthread_mutex_lock(&sketch->lock);
+
+   index = sketchInterfaceIndex(sketch, interface);
+   if (index == SR_SKETCH_MAX_INTERFACES)
+   {
+      sketch->untracked++;
+      pthread_mutex_unlock(&sketch->lock);
+      return;
+   }
+   sketch->packets[index][direction]++;
+   sketch->bytes[index][direction] += length;
+
+   memset(&key, 0, sizeof(key));
+   key.interface = index;
+   key.direction = direction;
+
+   key.kind = SR_SKETCH_SOURCE;
+   key.source = packet->ip_src;
+   sketchAdd(sketch, &key, length);
+
+   key.kind = SR_SKETCH_DESTINATION;
+   key.source = 0;
+   key.destination = packet->ip_dst;
+   sketchAdd(sketch, &key, length);
+
+   key.kind = SR_SKETCH_FLOW;
+   key.source = packet->ip_src;
+   key.protocol = packet->ip_p;
+   key.sourcePort = sourcePort;
+   key.destinationPort = destinationPort;
+   sketchAdd(sketch, &key, length);
+
+   pthread_mutex_unlock(&sketch->lock);
+}
+
+/**
+ * sr_sketch_top()\n
+ * @brief Copies out the heaviest keys of one table, largest first.
+ * @param entries room for SR_SKETCH_TOP_K entries.
+ * @return number of entries copied; 0 if the interface was never seen.
+ */
+unsigned int sr_sketch_top(sr_sketch_t *sketch, const struct sr_if *interface,
+   sr_sketch_direction_t direction, sr_sketch_kind_t kind, sr_sketch_metric_t metric,
+   sr_sketch_entry_t *entries)
+{
+   unsigned int count = 0;
+   unsigned int i;
+
+   pthread_mutex_lock(&sketch->lock);
+   for (i = 0; i < sketch->interfaceCount; i++)
+   {
+      if (sketch->interfaces[i] == interface)
+      {
+         count = sketchSorted(&sketch->top[i][direction][kind][metric], entries);
+         break;
+      }
+   }
+   pthread_mutex_unlock(&sketch->lock);
+
+   return count;
+}
+
+/**
+ * sr_sketch_tick()\n
+ * @brief Called once a second by the timer thread: at the end of each
+ *        interval appends the tables to the log and starts counting over.
+ */
+void sr_sketch_tick(struct sr_instance *sr)
+{
+   sr_sketch_t *sketch = sr->sketch;
+
+   if ((sketch == NULL) || (sketch->intervalS == 0))
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&sketch->lock);
+   if (difftime(sr_clock_now(), sketch->intervalStart) >= sketch->intervalS)
+   {
+      sketchWrite(sr, sketch->log);
+      fflush(sketch->log);
+      sketchReset(sketch);
+   }
+   pthread_mutex_unlock(&sketch->lock);
+}
+
+/**
+ * sr_sketch_print()\n
+ * @brief Writes the totals and tables counted so far. Does nothing if the
+ *        instance doesn't keep a sketch.
+ */
+void sr_sketch_print(const struct sr_instance *sr, FILE *out)
+{
+   if (sr->sketch == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&sr->sketch->lock);
+   sketchWrite(sr, out);
+   pthread_mutex_unlock(&sr->sketch->lock);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static unsigned int sketchInterfaceIndex(sr_sketch_t *sketch, const struct sr_if *interface)
+{
+   unsigned int i;
+
+   for (i = 0; i < sketch->interfaceCount; i++)
+   {
+      if (sketch->interfaces[i] == interface)
+      {
+         return i;
+      }
+   }
+   if (sketch->interfaceCount < SR_SKETCH_MAX_INTERFACES)
+   {
+      sketch->interfaces[sketch->interfaceCount] = interface;
+      return sketch->interfaceCount++;
+   }
+   return SR_SKETCH_MAX_INTERFACES;
+}
+
+/**
+ * sketchAdd()\n
+ * @brief Conservative update of the key's cells, then offers the new
+ *        estimates to the key's top tables.
+ * @note Rows index with disjoint bits of the hash. Deriving them as
+ *       h1 + row * h2 instead would make two keys collide in every row
+ *       once they collide in two.
+ */
+static void sketchAdd(sr_sketch_t *sketch, const sr_sketch_key_t *key, unsigned int bytes)
+{
+   sr_sketch_cell_t *cells[SR_SKETCH_DEPTH];
+   uint64_t words[2];
+   uint64_t hash;
+   uint64_t packets = UINT64_MAX, octets = UINT64_MAX;
+   unsigned int row;
+
+   /* Built from the fields rather than copied: the key was just written a
+    * field at a time, and wide loads of it would stall. */
+   words[0] = ((uint64_t) key->source << 32) | key->destination;
+   words[1] = ((uint64_t) key->sourcePort << 48) | ((uint64_t) key->destinationPort << 32)
+      | ((uint32_t) key->protocol << 24) | ((uint32_t) key->interface << 16)
+      | ((uint32_t) key->direction << 8) | key->kind;
+   hash = sketchMix(words[0] ^ sketchMix(words[1] ^ SKETCH_SEED));
+
+   for (row = 0; row < SR_SKETCH_DEPTH; row++)
+   {
+      cells[row] = &sketch->cells[row][hash & (SR_SKETCH_WIDTH - 1)];
+      hash >>= SR_SKETCH_WIDTH_BITS;
+      if (cells[row]->packets < packets)
+      {
+         packets = cells[row]->packets;
+      }
+      if (cells[row]->bytes < octets)
+      {
+         octets = cells[row]->bytes;
+      }
+   }
+
+   packets += 1;
+   octets += bytes;
+   for (row = 0; row < SR_SKETCH_DEPTH; row++)
+   {
+      if (cells[row]->packets < packets)
+      {
+         cells[row]->packets = packets;
+      }
+      if (cells[row]->bytes < octets)
+      {
+         cells[row]->bytes = octets;
+      }
+   }
+
+   sketchOffer(&sketch->top[key->interface][key->direction][key->kind][SR_SKETCH_PACKETS], key,
+      packets);
+   sketchOffer(&sketch->top[key->interface][key->direction][key->kind][SR_SKETCH_BYTES], key,
+      octets);
+}
+
+/**
+ * sketchOffer()\n
+ * @brief Updates the key's entry, or puts it in place of the smallest one
+ *        if its estimate is larger.
+ * @note A key already in the table has grown past its entry, so it can't be
+ *       at or below the smallest one; those are rejected without a search.
+ */
+static void sketchOffer(sr_sketch_top_t *top, const sr_sketch_key_t *key, uint64_t estimate)
+{
+   unsigned int i;
+
+   if ((top->used == SR_SKETCH_TOP_K) && (estimate <= top->entries[top->smallest].estimate))
+   {
+      return;
+   }
+
+   for (i = 0; i < top->used; i++)
+   {
+      if (sketchSameKey(&top->entries[i].key, key))
+      {
+         top->entries[i].estimate = estimate;
+         if ((top->used == SR_SKETCH_TOP_K) && (i == top->smallest))
+         {
+            sketchFindSmallest(top);
+         }
+         return;
+      }
+   }
+
+   if (top->used < SR_SKETCH_TOP_K)
+   {
+      i = top->used++;
+   }
+   else
+   {
+      i = top->smallest;
+   }
+   top->entries[i].key = *key;
+   top->entries[i].estimate = estimate;
+   if (top->used == SR_SKETCH_TOP_K)
+   {
+      sketchFindSmallest(top);
+   }
+}
+
+/** Keys in one table share their interface, direction and kind. */
+static bool sketchSameKey(const sr_sketch_key_t *first, const sr_sketch_key_t *second)
+{
+   return (first->source == second->source) && (first->destination == second->destination)
+      && (first->sourcePort == second->sourcePort)
+      && (first->destinationPort == second->destinationPort)
+      && (first->protocol == second->protocol);
+}
+
+static void sketchFindSmallest(sr_sketch_top_t *top)
+{
+   unsigned int i;
+
+   top->smallest = 0;
+   for (i = 1; i < top->used; i++)
+   {
+      if (top->entries[i].estimate < top->entries[top->smallest].estimate)
+      {
+         top->smallest = i;
+      }
+   }
+}
+
+static int sketchCompareEntries(const void *a, const void *b)
+{
+   const sr_sketch_entry_t *first = a;
+   const sr_sketch_entry_t *second = b;
+
+   if (first->estimate != second->estimate)
+   {
+      return (first->estimate < second->estimate) ? 1 : -1;
+   }
+   return 0;
+}
+
+static unsigned int sketchSorted(const sr_sketch_top_t *top, sr_sketch_entry_t *entries)
+{
+   memcpy(entries, top->entries, top->used * sizeof(sr_sketch_entry_t));
+   qsort(entries, top->used, sizeof(sr_sketch_entry_t), sketchCompareEntries);
+   return top->used;
+}
+
+/**
+ * sketchWrite()\n
+ * @brief Writes the totals and every non-empty table.
+ * @note Called with the sketch lock held.
+ */
+static void sketchWrite(const struct sr_instance *sr, FILE *out)
+{
+   const sr_sketch_t *sketch = sr->sketch;
+   sr_sketch_entry_t entries[SR_SKETCH_TOP_K];
+   uint64_t totalPackets = 0, totalBytes = 0;
+   unsigned int i, direction, kind, metric, j;
+
+   for (i = 0; i < sketch->interfaceCount; i++)
+   {
+      for (direction = 0; direction < SR_SKETCH_DIRECTIONS; direction++)
+      {
+         totalPackets += sketch->packets[i][direction];
+         totalBytes += sketch->bytes[i][direction];
+      }
+   }
+
+   /* Every datagram went into the sketch once per kind of key. */
+   fprintf(out, "heavy hitters: topology %u, %.0f s, estimates at most %.0f packets and %.0f "
+      "bytes high\n", sr->topo_id, difftime(sr_clock_now(), sketch->intervalStart),
+      ceil(M_E * SR_SKETCH_KINDS * totalPackets / SR_SKETCH_WIDTH),
+      ceil(M_E * SR_SKETCH_KINDS * totalBytes / SR_SKETCH_WIDTH));
+   if (sketch->untracked)
+   {
+      fprintf(out, "   %" PRIu64 " packets on untracked interfaces\n", sketch->untracked);
+   }
+
+   for (i = 0; i < sketch->interfaceCount; i++)
+   {
+      for (direction = 0; direction < SR_SKETCH_DIRECTIONS; direction++)
+      {
+         if (sketch->packets[i][direction] == 0)
+         {
+            continue;
+         }
+         fprintf(out, "   %s %s: %" PRIu64 " packets, %" PRIu64 " bytes\n",
+            sketch->interfaces[i]->name, sketchDirectionNames[direction],
+            sketch->packets[i][direction], sketch->bytes[i][direction]);
+
+         for (kind = 0; kind < SR_SKETCH_KINDS; kind++)
+         {
+            for (metric = 0; metric < SR_SKETCH_METRICS; metric++)
+            {
+               unsigned int count = sketchSorted(&sketch->top[i][direction][kind][metric], entries);
+
+               fprintf(out, "      %s by %s:\n", sketchKindNames[kind], sketchMetricNames[metric]);
+               for (j = 0; j < count; j++)
+               {
+                  fprintf(out, "         ");
+                  sketchWriteKey(&entries[j].key, out);
+                  fprintf(out, " %" PRIu64 "\n", entries[j].estimate);
+               }
+            }
+         }
+      }
+   }
+}
+
+static void sketchWriteKey(const sr_sketch_key_t *key, FILE *out)
+{
+   char source[INET_ADDRSTRLEN], destination[INET_ADDRSTRLEN];
+
+   inet_ntop(AF_INET, &key->source, source, sizeof(source));
+   inet_ntop(AF_INET, &key->destination, destination, sizeof(destination));
+
+   switch (key->kind)
+   {
+      case SR_SKETCH_SOURCE:
+         fprintf(out, "%-15s", source);
+         break;
+
+      case SR_SKETCH_DESTINATION:
+         fprintf(out, "%-15s", destination);
+         break;
+
+      default:
+         if ((key->protocol == ip_protocol_tcp) || (key->protocol == ip_protocol_udp))
+         {
+            fprintf(out, "%s %s:%u > %s:%u", (key->protocol == ip_protocol_tcp) ? "tcp" : "udp",
+               source, ntohs(key->sourcePort), destination, ntohs(key->destinationPort));
+         }
+         else if (key->protocol == ip_protocol_icmp)
+         {
+            fprintf(out, "icmp %s > %s", source, destination);
+         }
+         else
+         {
+            fprintf(out, "proto %u %s > %s", key->protocol, source, destination);
+         }
+         break;
+   }
+}
+
+static void sketchReset(sr_sketch_t *sketch)
+{
+   memset(sketch->cells, 0, sizeof(sketch->cells));
+   memset(sketch->top, 0, sizeof(sketch->top));
+   memset(sketch->packets, 0, sizeof(sketch->packets));
+   memset(sketch->bytes, 0, sizeof(sketch->bytes));
+   sketch->untracked = 0;
+   sketch->intervalStart = sr_clock_now();
+   sketch->intervals++;
+}
+
+/** 64-bit finalizer from MurmurHash3. */
+static uint64_t sketchMix(uint64_t value)
+{
+   value ^= value >> 33;
+   value *= 0xFF51AFD7ED558CCDULL;
+   value ^= value >> 33;
+   value *= 0xC4CEB9FE1A85EC53ULL;
+   value ^= value >> 33;
+   return value;
+}
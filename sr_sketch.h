@@ -0,0 +1,145 @@
+/**
+ * @file sr_sketch.h
+ * @brief Heavy-hitter detection with a count-min sketch.
+ *
+ * Every IP datagram is counted as it is received on an interface ("in") and
+ * again as it is sent out of one ("out"), under three keys: its source, its
+ * destination and its flow (protocol, addresses and TCP/UDP ports). The
+ * packet and byte counts of all keys share one count-min sketch of
+ * SR_SKETCH_DEPTH rows by SR_SKETCH_WIDTH cells, updated conservatively
+ * (only the rows at the minimum grow), so a key's estimate is never below
+ * its true count and exceeds it by at most about e / SR_SKETCH_WIDTH of
+ * everything counted, except with probability e^-SR_SKETCH_DEPTH.
+ *
+ * Next to the sketch, each interface, direction, kind of key and metric
+ * keeps the SR_SKETCH_TOP_K keys with the largest estimates. A key whose
+ * estimate doesn't beat the smallest of a full table is rejected without
+ * searching it, so most packets of small flows cost the sketch rows only.
+ *
+ * Memory is fixed at creation whatever the number of flows. The tables are
+ * dumped on SIGUSR1 and, with an interval, appended to a file once per
+ * interval, after which counting starts over.
+ */
+
+#ifndef SR_SKETCH_H
+#define SR_SKETCH_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sr_protocol.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_SKETCH_DEPTH          (4)
+#define SR_SKETCH_WIDTH_BITS     (12)
+#define SR_SKETCH_WIDTH          (1 << SR_SKETCH_WIDTH_BITS) /**< Cells per row. */
+#define SR_SKETCH_TOP_K          (10)
+#define SR_SKETCH_MAX_INTERFACES (8) /**< Further interfaces aren't tracked. */
+#define SR_SKETCH_DEFAULT_LOG    "sr_sketch.log"
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+struct sr_if;
+
+typedef enum
+{
+   SR_SKETCH_IN, /**< Received on the interface. */
+   SR_SKETCH_OUT, /**< Sent out of the interface. */
+   SR_SKETCH_DIRECTIONS
+} sr_sketch_direction_t;
+
+typedef enum
+{
+   SR_SKETCH_SOURCE,
+   SR_SKETCH_DESTINATION,
+   SR_SKETCH_FLOW,
+   SR_SKETCH_KINDS
+} sr_sketch_kind_t;
+
+typedef enum
+{
+   SR_SKETCH_PACKETS,
+   SR_SKETCH_BYTES,
+   SR_SKETCH_METRICS
+} sr_sketch_metric_t;
+
+/** What is counted. Fields a kind doesn't use are zero. */
+typedef struct
+{
+   uint32_t source; /**< Network byte order. */
+   uint32_t destination; /**< Network byte order. */
+   uint16_t sourcePort; /**< Network byte order. */
+   uint16_t destinationPort; /**< Network byte order. */
+   uint8_t protocol;
+   uint8_t interface; /**< Index into sr_sketch_t.interfaces. */
+   uint8_t direction;
+   uint8_t kind;
+} sr_sketch_key_t;
+
+typedef struct
+{
+   uint64_t packets;
+   uint64_t bytes;
+} sr_sketch_cell_t;
+
+typedef struct
+{
+   sr_sketch_key_t key;
+   uint64_t estimate; /**< When the key was last counted. */
+} sr_sketch_entry_t;
+
+typedef struct
+{
+   sr_sketch_entry_t entries[SR_SKETCH_TOP_K];
+   unsigned int used;
+   unsigned int smallest; /**< Index of the smallest estimate once full. */
+} sr_sketch_top_t;
+
+typedef struct sr_sketch
+{
+   pthread_mutex_t lock; /**< Packets are counted from the reader and timer threads. */
+
+   sr_sketch_cell_t cells[SR_SKETCH_DEPTH][SR_SKETCH_WIDTH];
+   sr_sketch_top_t top[SR_SKETCH_MAX_INTERFACES][SR_SKETCH_DIRECTIONS][SR_SKETCH_KINDS][SR_SKETCH_METRICS];
+
+   const struct sr_if *interfaces[SR_SKETCH_MAX_INTERFACES];
+   unsigned int interfaceCount;
+
+   /* exact totals for the current interval */
+   uint64_t packets[SR_SKETCH_MAX_INTERFACES][SR_SKETCH_DIRECTIONS];
+   uint64_t bytes[SR_SKETCH_MAX_INTERFACES][SR_SKETCH_DIRECTIONS];
+   uint64_t untracked; /**< Packets on interfaces beyond the limit. */
+
+   unsigned int intervalS; /**< 0: never dumped to the log or restarted. */
+   time_t intervalStart;
+   uint64_t intervals;
+   FILE *log;
+} sr_sketch_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_sketch_t *sr_sketch_create(unsigned int intervalS, const char *logPath);
+void sr_sketch_destroy(sr_sketch_t *sketch);
+void sr_sketch_count(sr_sketch_t *sketch, const struct sr_if *interface,
+   sr_sketch_direction_t direction, const sr_ip_hdr_t *packet, unsigned int length);
+unsigned int sr_sketch_top(sr_sketch_t *sketch, const struct sr_if *interface,
+   sr_sketch_direction_t direction, sr_sketch_kind_t kind, sr_sketch_metric_t metric,
+   sr_sketch_entry_t *entries);
+void sr_sketch_tick(struct sr_instance *sr);
+void sr_sketch_print(const struct sr_instance *sr, FILE *out);
+
+#endif /* SR_SKETCH_H */
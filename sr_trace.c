@@ -0,0 +1,553 @@
+/**
+ * @file sr_trace.c
+ * @brief Per-packet traces of the router's decisions.
+ *
+ * See sr_trace.h for the design.
+ */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_trace.h"
+#include "sr_router.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define TRACE_NS_PER_S     (1000000000ULL)
+#define TRACE_MAX_LINE     (512)
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public variables
+ *-----------------------------------------------------------------------------
+ */
+
+__thread sr_trace_packet_t *srTracePacket = NULL;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static int traceParseFilter(char *line, sr_trace_filter_t *filter);
+static bool traceTake(sr_trace_t *trace, sr_trace_filter_t *filter);
+static void traceDescribe(const uint8_t *frame, unsigned int length, char *text, size_t size);
+static void traceWrite(const sr_trace_t *trace, const sr_trace_packet_t *packet, FILE *out);
+static void traceFreeConfig(sr_trace_config_t *config);
+static uint64_t traceNowNs(void);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const traceStageNames[SR_TRACE_STAGES] =
+{
+   "rx", "router", "route", "arp", "nat", "tx"
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_trace_create()\n
+ * @brief Reads the trace filters, arming them, and opens the trace log.
+ * @param path file of filters, one per line.
+ * @param logPath file traces are appended to.
+ * @param topologyId written with each trace, to tell hosted routers apart.
+ * @return trace state, or NULL if either file couldn't be opened or a
+ *         filter is bad.
+ */
+sr_trace_t *sr_trace_create(const char *path, const char *logPath, unsigned short topologyId)
+{
+   sr_trace_t *trace = calloc(1, sizeof(sr_trace_t));
+
+   assert(trace);
+   if ((strlen(path) >= sizeof(trace->path)) || (strlen(logPath) >= sizeof(trace->logPath)))
+   {
+      fprintf(stderr, "%s: path too long\n", path);
+      free(trace);
+      return NULL;
+   }
+   strcpy(trace->path, path);
+   strcpy(trace->logPath, logPath);
+   trace->topologyId = topologyId;
+   pthread_mutex_init(&trace->lock, NULL);
+   trace->packets = calloc(SR_TRACE_MAX_PACKETS, sizeof(sr_trace_packet_t));
+   assert(trace->packets);
+   trace->config = calloc(1, sizeof(sr_trace_config_t));
+   assert(trace->config);
+
+   trace->log = fopen(logPath, "a");
+   if (trace->log == NULL)
+   {
+      perror(logPath);
+      sr_trace_destroy(trace);
+      return NULL;
+   }
+
+   trace->reloads = srReloadRequests;
+   if (sr_trace_reload(trace) != 0)
+   {
+      sr_trace_destroy(trace);
+      return NULL;
+   }
+   return trace;
+}
+
+/**
+ * sr_trace_destroy()\n
+ * @brief Writes the traces not yet dumped and frees everything.
+ * @param trace may be NULL.
+ * @warning No thread may be tracing a packet.
+ */
+void sr_trace_destroy(sr_trace_t *trace)
+{
+   if (trace == NULL)
+   {
+      return;
+   }
+
+   if (trace->log)
+   {
+      sr_trace_dump(trace);
+      fclose(trace->log);
+   }
+   traceFreeConfig(trace->config);
+   pthread_mutex_destroy(&trace->lock);
+   free(trace->packets);
+   free(trace);
+}
+
+/**
+ * sr_trace_reload()\n
+ * @brief Reads the filters file and, if every line is good, replaces the
+ *        filters with it, armed with the counts it gives.
+ * @param trace trace state.
+ * @return 0 on success, -1 if the file couldn't be read or a line is bad,
+ *         in which case the filters are left as they were.
+ */
+int sr_trace_reload(sr_trace_t *trace)
+{
+   FILE *in = fopen(trace->path, "r");
+   sr_trace_config_t *config;
+   char line[TRACE_MAX_LINE];
+   unsigned int lineNumber = 0, remaining = 0, i;
+   int status = 0;
+
+   if (in == NULL)
+   {
+      perror(trace->path);
+      return -1;
+   }
+
+   config = calloc(1, sizeof(sr_trace_config_t));
+   assert(config);
+   while ((status == 0) && fgets(line, sizeof(line), in))
+   {
+      char *start = line;
+
+      lineNumber++;
+      while (isspace((unsigned char) *start))
+      {
+         start++;
+      }
+      if ((*start == '\0') || (*start == '#'))
+      {
+         continue;
+      }
+      if (config->count == SR_TRACE_MAX_FILTERS)
+      {
+         fprintf(stderr, "%s:%u: more than %d filters\n", trace->path, lineNumber,
+            SR_TRACE_MAX_FILTERS);
+         status = -1;
+      }
+      else if (traceParseFilter(start, &config->filters[config->count]) != 0)
+      {
+         fprintf(stderr, "%s:%u: expected \"interface|any count any|address[/length]"
+            "[:protocol[:port]]\"\n", trace->path, lineNumber);
+         status = -1;
+      }
+      else
+      {
+         config->count++;
+      }
+   }
+   fclose(in);
+
+   if (status != 0)
+   {
+      traceFreeConfig(config);
+      return -1;
+   }
+
+   for (i = 0; i < config->count; i++)
+   {
+      remaining += config->filters[i].remaining;
+   }
+   config->retired = trace->config;
+   __atomic_store_n(&trace->config, config, __ATOMIC_RELEASE);
+   __atomic_store_n(&trace->remaining, remaining, __ATOMIC_RELAXED);
+   printf("Tracing %u packets by %u filters from %s\n", remaining, config->count, trace->path);
+   return 0;
+}
+
+/**
+ * sr_trace_start()\n
+ * @brief Starts tracing a frame if an armed filter matches it and a record
+ *        is free; sr_trace_begin() once some filter is armed.
+ * @return true if the frame is traced.
+ */
+bool sr_trace_start(sr_trace_t *trace, const char *interface, const uint8_t *frame,
+   unsigned int length)
+{
+   sr_trace_config_t *config = __atomic_load_n(&trace->config, __ATOMIC_ACQUIRE);
+   sr_trace_filter_t *filter;
+   sr_trace_packet_t *packet;
+   char description[SR_TRACE_DETAIL];
+   unsigned int i;
+
+   for (i = 0; i < config->count; i++)
+   {
+      filter = &config->filters[i];
+      if ((filter->interface[0] == '\0') || (strcmp(filter->interface, interface) == 0))
+      {
+         if (sr_mirror_match_frame(&filter->match, frame, length) && traceTake(trace, filter))
+         {
+            break;
+         }
+      }
+   }
+   if (i == config->count)
+   {
+      return false;
+   }
+
+   pthread_mutex_lock(&trace->lock);
+   if (trace->traced - trace->dumped == SR_TRACE_MAX_PACKETS)
+   {
+      trace->unrecorded++;
+      pthread_mutex_unlock(&trace->lock);
+      return false;
+   }
+   packet = &trace->packets[trace->traced % SR_TRACE_MAX_PACKETS];
+   trace->traced++;
+   packet->number = trace->traced;
+   pthread_mutex_unlock(&trace->lock);
+
+   clock_gettime(CLOCK_REALTIME, &packet->received);
+   packet->receivedNs = traceNowNs();
+   snprintf(packet->interface, sizeof(packet->interface), "%s", interface);
+   packet->length = length;
+   packet->filter = i;
+   packet->eventCount = 0;
+   packet->eventsLost = 0;
+   packet->done = false;
+   srTracePacket = packet;
+
+   traceDescribe(frame, length, description, sizeof(description));
+   sr_trace_record(SR_TRACE_RX, "%s", description);
+   return true;
+}
+
+/**
+ * sr_trace_end()\n
+ * @brief Ends the trace of the packet this thread is handling, leaving it
+ *        to be dumped.
+ */
+void sr_trace_end(sr_trace_t *trace)
+{
+   (void) trace;
+   __atomic_store_n(&srTracePacket->done, true, __ATOMIC_RELEASE);
+   srTracePacket = NULL;
+}
+
+/**
+ * sr_trace_record()\n
+ * @brief Adds an event to the packet this thread is tracing; SR_TRACE().
+ * @param stage stage making the decision.
+ * @param format printf format describing it; a trailing newline is dropped.
+ */
+void sr_trace_record(sr_trace_stage_t stage, const char *format, ...)
+{
+   sr_trace_packet_t *packet = srTracePacket;
+   sr_trace_event_t *event;
+   size_t length;
+   va_list arguments;
+
+   if (packet->eventCount == SR_TRACE_MAX_EVENTS)
+   {
+      packet->eventsLost++;
+      return;
+   }
+   event = &packet->events[packet->eventCount++];
+   event->offsetNs = traceNowNs() - packet->receivedNs;
+   event->stage = stage;
+
+   va_start(arguments, format);
+   vsnprintf(event->detail, sizeof(event->detail), format, arguments);
+   va_end(arguments);
+   length = strlen(event->detail);
+   if ((length > 0) && (event->detail[length - 1] == '\n'))
+   {
+      event->detail[length - 1] = '\0';
+   }
+}
+
+/**
+ * sr_trace_dump()\n
+ * @brief Appends the traces of packets done since the last dump to the
+ *        trace log and gives their records back. A packet still being
+ *        handled, and those traced after it, wait for the next dump.
+ * @return traces written.
+ */
+uint64_t sr_trace_dump(sr_trace_t *trace)
+{
+   sr_trace_packet_t *packet;
+   uint64_t written = 0;
+
+   pthread_mutex_lock(&trace->lock);
+   while (trace->dumped < trace->traced)
+   {
+      packet = &trace->packets[trace->dumped % SR_TRACE_MAX_PACKETS];
+      if (!__atomic_load_n(&packet->done, __ATOMIC_ACQUIRE))
+      {
+         break;
+      }
+      traceWrite(trace, packet, trace->log);
+      trace->dumped++;
+      written++;
+   }
+   pthread_mutex_unlock(&trace->lock);
+   fflush(trace->log);
+   return written;
+}
+
+/**
+ * sr_trace_tick()\n
+ * @brief Called once a second by the timer thread: reads the filters again
+ *        after a SIGHUP.
+ */
+void sr_trace_tick(struct sr_instance *sr)
+{
+   sr_trace_t *trace = sr->trace;
+   sig_atomic_t reloads = srReloadRequests;
+
+   if ((trace == NULL) || (trace->reloads == reloads))
+   {
+      return;
+   }
+   trace->reloads = reloads;
+   sr_trace_reload(trace);
+}
+
+/**
+ * sr_trace_print()\n
+ * @brief Dumps the traces done to the trace log and prints how many there
+ *        were. Does nothing if the instance doesn't trace.
+ */
+void sr_trace_print(const struct sr_instance *sr, FILE *out)
+{
+   sr_trace_t *trace = sr->trace;
+   uint64_t written;
+
+   if (trace == NULL)
+   {
+      return;
+   }
+
+   written = sr_trace_dump(trace);
+   pthread_mutex_lock(&trace->lock);
+   fprintf(out, "Tracing: topology %u, %u packets still to trace, %" PRIu64 " traced, %"
+      PRIu64 " written to %s now, %" PRIu64 " not traced with every record in use\n",
+      sr->topo_id, __atomic_load_n(&trace->remaining, __ATOMIC_RELAXED), trace->traced, written,
+      trace->logPath, trace->unrecorded);
+   pthread_mutex_unlock(&trace->lock);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/** Parses "interface count match". */
+static int traceParseFilter(char *line, sr_trace_filter_t *filter)
+{
+   char *interface, *count, *match, *end, *save = NULL;
+   unsigned long packets;
+
+   interface = strtok_r(line, " \t\r\n", &save);
+   count = strtok_r(NULL, " \t\r\n", &save);
+   match = strtok_r(NULL, " \t\r\n", &save);
+   if ((match == NULL) || (strtok_r(NULL, " \t\r\n", &save) != NULL)
+      || (strlen(interface) >= sizeof(filter->interface)))
+   {
+      return -1;
+   }
+
+   memset(filter, 0, sizeof(*filter));
+   if (strcmp(interface, "any") != 0)
+   {
+      strcpy(filter->interface, interface);
+   }
+   packets = strtoul(count, &end, 10);
+   if ((*end != '\0') || (packets == 0) || (packets > UINT32_MAX))
+   {
+      return -1;
+   }
+   filter->count = packets;
+   filter->remaining = packets;
+   return sr_mirror_match_parse(match, &filter->match);
+}
+
+/** Takes one of the packets a filter has left to trace, if any are. */
+static bool traceTake(sr_trace_t *trace, sr_trace_filter_t *filter)
+{
+   unsigned int remaining = __atomic_load_n(&filter->remaining, __ATOMIC_RELAXED);
+
+   do
+   {
+      if (remaining == 0)
+      {
+         return false;
+      }
+   } while (!__atomic_compare_exchange_n(&filter->remaining, &remaining, remaining - 1, true,
+      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+   /* A reload may have reset the total meanwhile; it never goes below 0. */
+   remaining = __atomic_load_n(&trace->remaining, __ATOMIC_RELAXED);
+   while ((remaining > 0) && !__atomic_compare_exchange_n(&trace->remaining, &remaining,
+      remaining - 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+   {
+   }
+   return true;
+}
+
+/** Describes a received frame in one line. */
+static void traceDescribe(const uint8_t *frame, unsigned int length, char *text, size_t size)
+{
+   const sr_ethernet_hdr_t *ethernetHeader = (const sr_ethernet_hdr_t *) frame;
+   const sr_ip_hdr_t *ipHeader = (const sr_ip_hdr_t *) (ethernetHeader + 1);
+   const uint8_t *transport;
+   unsigned int headerLength;
+   int used;
+
+   if ((length >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t))
+      && (ethernetHeader->ether_type == htons(ethertype_arp)))
+   {
+      const sr_arp_hdr_t *arpHeader = (const sr_arp_hdr_t *) (ethernetHeader + 1);
+
+      snprintf(text, size, "%u bytes, ARP op %u, " SR_TRACE_IP_FORMAT " asks for "
+         SR_TRACE_IP_FORMAT, length, ntohs(arpHeader->ar_op), SR_TRACE_IP(arpHeader->ar_sip),
+         SR_TRACE_IP(arpHeader->ar_tip));
+      return;
+   }
+   if ((length < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t))
+      || (ethernetHeader->ether_type != htons(ethertype_ip)))
+   {
+      snprintf(text, size, "%u bytes, ethertype 0x%04X", length,
+         ntohs(ethernetHeader->ether_type));
+      return;
+   }
+
+   used = snprintf(text, size, "%u bytes, IP " SR_TRACE_IP_FORMAT " -> " SR_TRACE_IP_FORMAT
+      " proto %u ttl %u length %u", length, SR_TRACE_IP(ipHeader->ip_src),
+      SR_TRACE_IP(ipHeader->ip_dst), ipHeader->ip_p, ipHeader->ip_ttl, ntohs(ipHeader->ip_len));
+   headerLength = ipHeader->ip_hl * 4;
+   transport = ((const uint8_t *) ipHeader) + headerLength;
+   if ((used < 0) || ((size_t) used >= size) || ((ntohs(ipHeader->ip_off) & IP_OFFMASK) != 0))
+   {
+      return;
+   }
+
+   if ((ipHeader->ip_p == ip_protocol_tcp)
+      && (length >= sizeof(sr_ethernet_hdr_t) + headerLength + sizeof(sr_tcp_hdr_t)))
+   {
+      const sr_tcp_hdr_t *tcpHeader = (const sr_tcp_hdr_t *) transport;
+
+      snprintf(text + used, size - used, ", TCP %u -> %u flags 0x%02X", ntohs(tcpHeader->sourcePort),
+         ntohs(tcpHeader->destinationPort), ntohs(tcpHeader->offset_controlBits) & 0x3F);
+   }
+   else if ((ipHeader->ip_p == ip_protocol_udp)
+      && (length >= sizeof(sr_ethernet_hdr_t) + headerLength + sizeof(sr_udp_hdr_t)))
+   {
+      const sr_udp_hdr_t *udpHeader = (const sr_udp_hdr_t *) transport;
+
+      snprintf(text + used, size - used, ", UDP %u -> %u", ntohs(udpHeader->sourcePort),
+         ntohs(udpHeader->destinationPort));
+   }
+   else if ((ipHeader->ip_p == ip_protocol_icmp)
+      && (length >= sizeof(sr_ethernet_hdr_t) + headerLength + sizeof(sr_icmp_hdr_t)))
+   {
+      const sr_icmp_hdr_t *icmpHeader = (const sr_icmp_hdr_t *) transport;
+
+      snprintf(text + used, size - used, ", ICMP type %u code %u", icmpHeader->icmp_type,
+         icmpHeader->icmp_code);
+   }
+}
+
+/** Writes a trace as text. */
+static void traceWrite(const sr_trace_t *trace, const sr_trace_packet_t *packet, FILE *out)
+{
+   const sr_trace_event_t *event;
+   struct tm received;
+   char when[32];
+   unsigned int i;
+
+   localtime_r(&packet->received.tv_sec, &received);
+   strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &received);
+   fprintf(out, "Packet %" PRIu64 ", topology %u, %s.%06ld on %s, %u bytes, filter %u\n",
+      packet->number, trace->topologyId, when, packet->received.tv_nsec / 1000,
+      packet->interface, packet->length, packet->filter);
+   for (i = 0; i < packet->eventCount; i++)
+   {
+      event = &packet->events[i];
+      fprintf(out, "   %+10.3f us  %-6s  %s\n", event->offsetNs / 1e3,
+         traceStageNames[event->stage], event->detail);
+   }
+   if (packet->eventsLost)
+   {
+      fprintf(out, "   ... %u events more\n", packet->eventsLost);
+   }
+}
+
+/** Frees a set of filters and every set it replaced. */
+static void traceFreeConfig(sr_trace_config_t *config)
+{
+   sr_trace_config_t *retired;
+
+   while (config)
+   {
+      retired = config->retired;
+      free(config);
+      config = retired;
+   }
+}
+
+static uint64_t traceNowNs(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * TRACE_NS_PER_S + now.tv_nsec;
+}
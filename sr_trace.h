@@ -0,0 +1,183 @@
+/**
+ * @file sr_trace.h
+ * @brief Per-packet traces: every decision the router makes about the next
+ *        few packets matching a filter, with timestamps.
+ *
+ * Filters are read from a file at start-up and again on SIGHUP, each
+ * reading arming them afresh. Each line of the file is
+ *
+ *    interface count match
+ *
+ * interface is where the packet is received, or "any"; count is how many
+ * packets to trace; match is a filter as for port mirroring
+ * (sr_mirror_match_parse()).
+ *
+ * A traced packet gets one of SR_TRACE_MAX_PACKETS preallocated records,
+ * and until sr_handlepacket() returns each stage adds an event to it: what
+ * was received, the route chosen, the ARP cache's answer, the NAT mapping
+ * used and connection state changes, and the frames sent, as well as what
+ * sr_router.c and sr_nat.c log with LOG_MESSAGE when built for debugging.
+ * The record being filled is kept per thread, so a stage pays one branch,
+ * on that pointer, for a packet not traced; with no filters armed a packet
+ * pays one test more, and without -A one pointer test.
+ *
+ * On SIGUSR1 the records of packets done since the last dump are appended
+ * to the trace log as text and their slots given back. While every slot
+ * holds a trace not yet dumped, further matches are counted and not traced.
+ */
+
+#ifndef SR_TRACE_H
+#define SR_TRACE_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "sr_mirror.h"
+#include "sr_protocol.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_TRACE_MAX_FILTERS        (8)
+#define SR_TRACE_MAX_PACKETS        (256) /**< Traces kept until dumped. */
+#define SR_TRACE_MAX_EVENTS         (32) /**< Per packet; later ones are counted. */
+#define SR_TRACE_DETAIL             (120) /**< Bytes of text per event. */
+#define SR_TRACE_MAX_PATH           (256)
+#define SR_TRACE_DEFAULT_LOG        "sr_trace.log"
+
+/** Formats an IP address in network byte order with SR_TRACE_IP_FORMAT. */
+#define SR_TRACE_IP_FORMAT          "%u.%u.%u.%u"
+#define SR_TRACE_IP(ip) \
+   (unsigned int) (ntohl(ip) >> 24), (unsigned int) ((ntohl(ip) >> 16) & 0xFF), \
+   (unsigned int) ((ntohl(ip) >> 8) & 0xFF), (unsigned int) (ntohl(ip) & 0xFF)
+
+/**
+ * Adds an event to the packet this thread is tracing, if it is tracing one.
+ * The arguments are only evaluated if it is.
+ */
+#define SR_TRACE(stage, ...) \
+   do \
+   { \
+      if (__builtin_expect(srTracePacket != NULL, 0)) \
+      { \
+         sr_trace_record(stage, __VA_ARGS__); \
+      } \
+   } while (0)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+typedef enum
+{
+   SR_TRACE_RX, /**< What was received. */
+   SR_TRACE_ROUTER, /**< sr_router.c's decisions (LOG_MESSAGE). */
+   SR_TRACE_ROUTE, /**< Routing table entry chosen. */
+   SR_TRACE_ARP, /**< Next hop resolved or queued. */
+   SR_TRACE_NAT, /**< Mapping used, connection state, sr_nat.c's decisions. */
+   SR_TRACE_TX, /**< A frame sent. */
+   SR_TRACE_STAGES
+} sr_trace_stage_t;
+
+typedef struct
+{
+   uint64_t offsetNs; /**< Since the packet was received. */
+   uint8_t stage; /**< sr_trace_stage_t */
+   char detail[SR_TRACE_DETAIL];
+} sr_trace_event_t;
+
+/** A traced packet. Only the thread handling it writes it until done. */
+typedef struct
+{
+   uint64_t number; /**< Counts traced packets from 1. */
+   struct timespec received; /**< Wall clock. */
+   uint64_t receivedNs; /**< Monotonic clock. */
+   char interface[sr_IFACE_NAMELEN];
+   unsigned int length;
+   unsigned int filter; /**< Line of the filter that matched, from 0. */
+   unsigned int eventCount;
+   unsigned int eventsLost; /**< Past SR_TRACE_MAX_EVENTS. */
+   bool done;
+   sr_trace_event_t events[SR_TRACE_MAX_EVENTS];
+} sr_trace_packet_t;
+
+typedef struct
+{
+   char interface[sr_IFACE_NAMELEN]; /**< Empty for any. */
+   sr_mirror_match_t match;
+   unsigned int count; /**< Packets asked for. */
+   unsigned int remaining; /**< Left to trace. */
+} sr_trace_filter_t;
+
+typedef struct sr_trace_config
+{
+   sr_trace_filter_t filters[SR_TRACE_MAX_FILTERS];
+   unsigned int count;
+   struct sr_trace_config *retired; /**< Replaced before this one. */
+} sr_trace_config_t;
+
+typedef struct sr_trace
+{
+   sr_trace_config_t *config;
+   unsigned int remaining; /**< Sum of the filters' remaining; 0 skips matching. */
+   char path[SR_TRACE_MAX_PATH];
+   sig_atomic_t reloads; /**< srReloadRequests when last read. */
+   unsigned short topologyId;
+
+   pthread_mutex_t lock; /**< Serializes claiming and dumping records. */
+   sr_trace_packet_t *packets; /**< SR_TRACE_MAX_PACKETS, used as a ring. */
+   uint64_t traced; /**< Records claimed; the next is packets[traced % MAX]. */
+   uint64_t dumped; /**< Records written to the log. */
+   uint64_t unrecorded; /**< Matched while every record was in use. */
+   char logPath[SR_TRACE_MAX_PATH];
+   FILE *log;
+} sr_trace_t;
+
+/*
+ * Public Function Declarations
+ */
+
+/** The packet this thread is tracing, or NULL. */
+extern __thread sr_trace_packet_t *srTracePacket;
+
+sr_trace_t *sr_trace_create(const char *path, const char *logPath, unsigned short topologyId);
+void sr_trace_destroy(sr_trace_t *trace);
+int sr_trace_reload(sr_trace_t *trace);
+bool sr_trace_start(sr_trace_t *trace, const char *interface, const uint8_t *frame,
+   unsigned int length);
+void sr_trace_end(sr_trace_t *trace);
+void sr_trace_record(sr_trace_stage_t stage, const char *format, ...)
+   __attribute__((format(printf, 2, 3)));
+uint64_t sr_trace_dump(sr_trace_t *trace);
+void sr_trace_tick(struct sr_instance *sr);
+void sr_trace_print(const struct sr_instance *sr, FILE *out);
+
+/*
+ * Inline Function Definitions
+ */
+
+/**
+ * Starts tracing a received frame if an armed filter matches it.
+ * @param trace may be NULL, in which case nothing is done.
+ * @return true if the frame is traced; end it with sr_trace_end().
+ */
+static inline bool sr_trace_begin(sr_trace_t *trace, const char *interface,
+   const uint8_t *frame, unsigned int length)
+{
+   return trace && __atomic_load_n(&trace->remaining, __ATOMIC_RELAXED)
+      && (srTracePacket == NULL) && sr_trace_start(trace, interface, frame, length);
+}
+
+#endif /* SR_TRACE_H */
@@ -0,0 +1,826 @@
+
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sr_upgrade.h"
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_nat.h"
+#include "sr_policer.h"
+#include "sr_arpcache.h"
+#include "sr_clock.h"
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define UPGRADE_ACK_BYTE      ('K')
+#define UPGRADE_FD_COUNT      (2) /* VNS socket + snapshot */
+#define UPGRADE_SHM_TEMPLATE  "/dev/shm/sr_upgrade.XXXXXX"
+#define UPGRADE_TMP_TEMPLATE  "/tmp/sr_upgrade.XXXXXX"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Macros
+ *-----------------------------------------------------------------------------
+ */
+
+#ifdef DONT_DEFINE_UNLESS_DEBUGGING
+# define LOG_MESSAGE(...) fprintf(stderr, __VA_ARGS__)
+#else
+# define LOG_MESSAGE(...)
+#endif
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables & Constants
+ *-----------------------------------------------------------------------------
+ */
+
+volatile sig_atomic_t srUpgradeRequested = 0;
+
+/** Original command line, used to exec the replacement binary. */
+static char **upgradeArgv = NULL;
+static int upgradeArgc = 0;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void upgradeSignalHandler(int signum);
+static size_t upgradeSnapshotSize(struct sr_instance *sr);
+static void upgradeWriteSnapshot(struct sr_instance *sr, uint8_t *buffer, size_t length);
+static int upgradeRestoreSnapshot(struct sr_instance *sr, const uint8_t *buffer, size_t length);
+static int upgradeCreateSnapshotFile(void);
+static int upgradeSendFds(int channel, int *fds, uint32_t length);
+static void upgradeLock(struct sr_instance *sr);
+static void upgradeUnlock(struct sr_instance *sr);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_upgrade_init()\n
+ * @brief Remembers the command line and installs the SIGUSR2 upgrade trigger.
+ * @param argc argument count passed to main.
+ * @param argv argument vector passed to main.
+ * @note The handler is installed without SA_RESTART so a blocked read from
+ *       VNS is interrupted and the main loop can start the handoff.
+ */
+void sr_upgrade_init(int argc, char **argv)
+{
+   struct sigaction action;
+
+   upgradeArgc = argc;
+   upgradeArgv = argv;
+
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = upgradeSignalHandler;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGUSR2, &action, NULL);
+}
+
+/**
+ * sr_upgrade_handoff()\n
+ * Description:\n
+ *    Called by the main loop between VNS messages. Snapshots all router state
+ *    into shared memory, starts the replacement binary and hands it the VNS
+ *    socket and the snapshot. The ARP and NAT locks are held from the moment
+ *    the snapshot is taken so no thread of this process touches the socket
+ *    again. They are only released if the handoff fails.
+ * @brief Hands the data plane over to a freshly exec'd router process.
+ * @param sr pointer to simple router state.
+ * @return 0 if the new process took over (caller should exit without
+ *         touching the VNS socket), -1 if this process should keep running.
+ */
+int sr_upgrade_handoff(struct sr_instance *sr)
+{
+   int channel[2];
+   int fds[UPGRADE_FD_COUNT];
+   char channelArg[16];
+   char **newArgv;
+   size_t snapshotLength;
+   uint8_t *snapshot;
+   struct pollfd ackPoll;
+   char ack = 0;
+   pid_t child;
+   int i, j;
+
+   assert(sr);
+
+   if (upgradeArgv == NULL)
+   {
+      fprintf(stderr, "Hot upgrade requested, but not initialized.\n");
+      return -1;
+   }
+
+   fprintf(stderr, "Hot upgrade requested. Starting %s.\n", upgradeArgv[0]);
+
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) != 0)
+   {
+      perror("socketpair(..):sr_upgrade.c::sr_upgrade_handoff");
+      return -1;
+   }
+
+   /* The new binary must only get the VNS socket through SCM_RIGHTS. */
+   fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+   fcntl(sr->sockfd, F_SETFD, FD_CLOEXEC);
+
+   /* Build the child's argument vector now; we can't allocate after fork. */
+   snprintf(channelArg, sizeof(channelArg), "%d", channel[1]);
+   newArgv = calloc(upgradeArgc + 3, sizeof(char*));
+   assert(newArgv);
+   for (i = 0, j = 0; i < upgradeArgc; i++)
+   {
+      /* Drop the channel of any earlier upgrade. */
+      if (strcmp(upgradeArgv[i], "-U") == 0)
+      {
+         i++;
+         continue;
+      }
+      else if (strncmp(upgradeArgv[i], "-U", 2) == 0)
+      {
+         continue;
+      }
+      newArgv[j++] = upgradeArgv[i];
+   }
+   newArgv[j++] = "-U";
+   newArgv[j++] = channelArg;
+   newArgv[j] = NULL;
+
+   /* Freeze the data plane. From here on nothing in this process sends. */
+   upgradeLock(sr);
+
+   snapshotLength = upgradeSnapshotSize(sr);
+   fds[0] = sr->sockfd;
+   fds[1] = upgradeCreateSnapshotFile();
+   if ((fds[1] < 0) || (ftruncate(fds[1], snapshotLength) != 0))
+   {
+      perror("ftruncate(..):sr_upgrade.c::sr_upgrade_handoff");
+      goto abort_handoff;
+   }
+
+   snapshot = mmap(NULL, snapshotLength, PROT_READ | PROT_WRITE, MAP_SHARED, fds[1], 0);
+   if (snapshot == MAP_FAILED)
+   {
+      perror("mmap(..):sr_upgrade.c::sr_upgrade_handoff");
+      goto abort_handoff;
+   }
+   upgradeWriteSnapshot(sr, snapshot, snapshotLength);
+   munmap(snapshot, snapshotLength);
+
+   if (sr->logfile)
+   {
+      fflush(sr->logfile);
+   }
+
+   child = fork();
+   if (child < 0)
+   {
+      perror("fork(..):sr_upgrade.c::sr_upgrade_handoff");
+      goto abort_handoff;
+   }
+   else if (child == 0)
+   {
+      execvp(newArgv[0], newArgv);
+      _exit(127);
+   }
+
+   close(channel[1]);
+   channel[1] = -1;
+
+   if (upgradeSendFds(channel[0], fds, (uint32_t) snapshotLength) != 0)
+   {
+      kill(child, SIGTERM);
+      waitpid(child, NULL, 0);
+      goto abort_handoff;
+   }
+
+   /* Wait for the new process to adopt the state. */
+   ackPoll.fd = channel[0];
+   ackPoll.events = POLLIN;
+   if ((poll(&ackPoll, 1, SR_UPGRADE_ACK_TIMEOUT_MS) != 1)
+      || (read(channel[0], &ack, 1) != 1) || (ack != UPGRADE_ACK_BYTE))
+   {
+      fprintf(stderr, "Replacement router did not take over. Continuing.\n");
+      kill(child, SIGTERM);
+      waitpid(child, NULL, 0);
+      goto abort_handoff;
+   }
+
+   fprintf(stderr, "Replacement router (pid %d) took over. Exiting.\n", (int) child);
+   close(channel[0]);
+   close(fds[1]);
+   free(newArgv);
+
+   /* Locks intentionally stay held; this process is about to exit. The NAT
+    * replication thread may be blocked on them, so don't try to stop it. */
+   if (sr->nat)
+   {
+      sr->nat->sync = NULL;
+   }
+   return 0;
+
+abort_handoff:
+   if (fds[1] >= 0) { close(fds[1]); }
+   if (channel[1] >= 0) { close(channel[1]); }
+   close(channel[0]);
+   free(newArgv);
+   upgradeUnlock(sr);
+   return -1;
+}
+
+/**
+ * sr_upgrade_adopt()\n
+ * @brief Takes over from a router that handed its state over with sr_upgrade_handoff().
+ * @param sr pointer to simple router state. The ARP cache (and NAT, if
+ *        enabled) must already be initialized.
+ * @param channelFd Unix socket inherited from the old process.
+ * @return 0 on success, -1 on failure (the old process keeps running).
+ */
+int sr_upgrade_adopt(struct sr_instance *sr, int channelFd)
+{
+   char control[CMSG_SPACE(sizeof(int) * UPGRADE_FD_COUNT)];
+   struct msghdr message;
+   struct cmsghdr *cmsg;
+   struct iovec iov;
+   uint32_t length;
+   int fds[UPGRADE_FD_COUNT];
+   uint8_t *snapshot;
+   char ack = UPGRADE_ACK_BYTE;
+   int ret;
+
+   assert(sr);
+
+   memset(&message, 0, sizeof(message));
+   iov.iov_base = &length;
+   iov.iov_len = sizeof(length);
+   message.msg_iov = &iov;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+
+   if (recvmsg(channelFd, &message, 0) != sizeof(length))
+   {
+      perror("recvmsg(..):sr_upgrade.c::sr_upgrade_adopt");
+      return -1;
+   }
+
+   cmsg = CMSG_FIRSTHDR(&message);
+   if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)
+      || (cmsg->cmsg_len != CMSG_LEN(sizeof(int) * UPGRADE_FD_COUNT)))
+   {
+      fprintf(stderr, "Upgrade channel did not carry the expected descriptors.\n");
+      return -1;
+   }
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+   length = ntohl(length);
+
+   snapshot = mmap(NULL, length, PROT_READ, MAP_SHARED, fds[1], 0);
+   close(fds[1]);
+   if (snapshot == MAP_FAILED)
+   {
+      perror("mmap(..):sr_upgrade.c::sr_upgrade_adopt");
+      close(fds[0]);
+      return -1;
+   }
+
+   ret = upgradeRestoreSnapshot(sr, snapshot, length);
+   munmap(snapshot, length);
+
+   if (ret != 0)
+   {
+      close(fds[0]);
+      return -1;
+   }
+
+   sr->sockfd = fds[0];
+   fcntl(sr->sockfd, F_SETFD, 0);
+
+   if (write(channelFd, &ack, 1) != 1)
+   {
+      perror("write(..):sr_upgrade.c::sr_upgrade_adopt");
+      return -1;
+   }
+   close(channelFd);
+
+   printf("Adopted VNS session from previous router instance.\n");
+   sr_print_if_list(sr);
+   return 0;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void upgradeSignalHandler(int signum)
+{
+   (void) signum;
+   srUpgradeRequested = 1;
+}
+
+/**
+ * upgradeLock()\n
+ * @brief Acquires the NAT and ARP locks (in that order, matching the NAT
+ *        timeout thread) so no other thread can send or mutate state.
+ */
+static void upgradeLock(struct sr_instance *sr)
+{
+   if (sr->nat)
+   {
+      sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+   }
+   sr_watchdog_lock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+}
+
+static void upgradeUnlock(struct sr_instance *sr)
+{
+   sr_watchdog_unlock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+   if (sr->nat)
+   {
+      sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+   }
+}
+
+/**
+ * upgradeCreateSnapshotFile()\n
+ * @brief Creates an anonymous (already unlinked) file to back the snapshot.
+ * @return file descriptor, or -1 on error.
+ */
+static int upgradeCreateSnapshotFile(void)
+{
+   char fileName[] = UPGRADE_SHM_TEMPLATE;
+   char fallbackName[] = UPGRADE_TMP_TEMPLATE;
+   int fd = mkstemp(fileName);
+
+   if (fd < 0)
+   {
+      fd = mkstemp(fallbackName);
+      if (fd < 0)
+      {
+         perror("mkstemp(..):sr_upgrade.c::upgradeCreateSnapshotFile");
+         return -1;
+      }
+      unlink(fallbackName);
+   }
+   else
+   {
+      unlink(fileName);
+   }
+
+   fcntl(fd, F_SETFD, FD_CLOEXEC);
+   return fd;
+}
+
+/**
+ * upgradeSendFds()\n
+ * @brief Sends the VNS socket and snapshot descriptors over the upgrade channel.
+ */
+static int upgradeSendFds(int channel, int *fds, uint32_t length)
+{
+   char control[CMSG_SPACE(sizeof(int) * UPGRADE_FD_COUNT)];
+   struct msghdr message;
+   struct cmsghdr *cmsg;
+   struct iovec iov;
+   uint32_t networkLength = htonl(length);
+
+   memset(&message, 0, sizeof(message));
+   memset(control, 0, sizeof(control));
+   iov.iov_base = &networkLength;
+   iov.iov_len = sizeof(networkLength);
+   message.msg_iov = &iov;
+   message.msg_iovlen = 1;
+   message.msg_control = control;
+   message.msg_controllen = sizeof(control);
+
+   cmsg = CMSG_FIRSTHDR(&message);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(int) * UPGRADE_FD_COUNT);
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * UPGRADE_FD_COUNT);
+
+   if (sendmsg(channel, &message, 0) != sizeof(networkLength))
+   {
+      perror("sendmsg(..):sr_upgrade.c::upgradeSendFds");
+      return -1;
+   }
+   return 0;
+}
+
+/**
+ * upgradeSnapshotSize()\n
+ * @brief Computes the number of bytes needed to snapshot the router.
+ * @warning Assumes the ARP and NAT locks are held.
+ */
+static size_t upgradeSnapshotSize(struct sr_instance *sr)
+{
+   size_t length = sizeof(sr_upgrade_hdr_t);
+   struct sr_if *interfaceIterator;
+   struct sr_rt *routeIterator;
+   struct sr_arpreq *requestIterator;
+   struct sr_packet *packetIterator;
+   int i;
+
+   for (interfaceIterator = sr->if_list; interfaceIterator; interfaceIterator = interfaceIterator->next)
+   {
+      length += sizeof(sr_upgrade_if_rec_t);
+   }
+
+   for (routeIterator = sr->routing_table; routeIterator; routeIterator = routeIterator->next)
+   {
+      length += sizeof(sr_upgrade_rt_rec_t);
+   }
+
+   for (i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      if (sr->cache.entries[i].valid)
+      {
+         length += sizeof(sr_arpcache_file_rec_t);
+      }
+   }
+
+   for (requestIterator = sr->cache.requests; requestIterator; requestIterator = requestIterator->next)
+   {
+      for (packetIterator = requestIterator->packets; packetIterator; packetIterator = packetIterator->next)
+      {
+         length += sizeof(sr_upgrade_pkt_rec_t) + packetIterator->len;
+      }
+   }
+
+   if (sr->nat)
+   {
+      sr_nat_mapping_t *mappingIterator;
+      sr_nat_connection_t *connectionIterator;
+
+      for (mappingIterator = sr->nat->mappings; mappingIterator; mappingIterator = mappingIterator->next)
+      {
+         length += sizeof(sr_upgrade_mapping_rec_t);
+         for (connectionIterator = mappingIterator->conns; connectionIterator;
+            connectionIterator = connectionIterator->next)
+         {
+            length += sizeof(sr_upgrade_conn_rec_t);
+         }
+      }
+   }
+
+   return length;
+}
+
+/**
+ * upgradeWriteSnapshot()\n
+ * @brief Serializes the router state into the snapshot buffer.
+ * @warning Assumes the ARP and NAT locks are held and that the buffer was
+ *          sized with upgradeSnapshotSize().
+ */
+static void upgradeWriteSnapshot(struct sr_instance *sr, uint8_t *buffer, size_t length)
+{
+   sr_upgrade_hdr_t *header = (sr_upgrade_hdr_t *) buffer;
+   uint8_t *cursor = buffer + sizeof(sr_upgrade_hdr_t);
+   uint32_t count;
+   struct sr_if *interfaceIterator;
+   struct sr_rt *routeIterator;
+   struct sr_arpreq *requestIterator;
+   struct sr_packet *packetIterator;
+   int i;
+
+   memset(header, 0, sizeof(sr_upgrade_hdr_t));
+   header->magic = htonl(SR_UPGRADE_MAGIC);
+   header->version = htonl(SR_UPGRADE_VERSION);
+   header->length = htonl((uint32_t) length);
+
+   for (count = 0, interfaceIterator = sr->if_list; interfaceIterator;
+      interfaceIterator = interfaceIterator->next, count++)
+   {
+      sr_upgrade_if_rec_t *rec = (sr_upgrade_if_rec_t *) cursor;
+      memcpy(rec->name, interfaceIterator->name, sr_IFACE_NAMELEN);
+      memcpy(rec->addr, interfaceIterator->addr, ETHER_ADDR_LEN);
+      rec->ip = interfaceIterator->ip; /* Already in network byte order. */
+      rec->speed = htonl(interfaceIterator->speed);
+      cursor += sizeof(sr_upgrade_if_rec_t);
+   }
+   header->numInterfaces = htonl(count);
+
+   for (count = 0, routeIterator = sr->routing_table; routeIterator;
+      routeIterator = routeIterator->next, count++)
+   {
+      sr_upgrade_rt_rec_t *rec = (sr_upgrade_rt_rec_t *) cursor;
+      rec->dest = routeIterator->dest.s_addr;
+      rec->gw = routeIterator->gw.s_addr;
+      rec->mask = routeIterator->mask.s_addr;
+      memcpy(rec->interface, routeIterator->interface, sr_IFACE_NAMELEN);
+      cursor += sizeof(sr_upgrade_rt_rec_t);
+   }
+   header->numRoutes = htonl(count);
+
+   for (count = 0, i = 0; i < SR_ARPCACHE_SZ; i++)
+   {
+      sr_arpentry_t *entry = &(sr->cache.entries[i]);
+      if (entry->valid)
+      {
+         sr_arpcache_file_rec_t *rec = (sr_arpcache_file_rec_t *) cursor;
+         rec->ip = htonl(entry->ip);
+         memcpy(rec->mac, entry->mac, ETHER_ADDR_LEN);
+         memcpy(rec->iface, entry->iface, sr_IFACE_NAMELEN);
+         rec->added = htonl((uint32_t) entry->added);
+         cursor += sizeof(sr_arpcache_file_rec_t);
+         count++;
+      }
+   }
+   header->numArpEntries = htonl(count);
+
+   for (count = 0, requestIterator = sr->cache.requests; requestIterator;
+      requestIterator = requestIterator->next)
+   {
+      for (packetIterator = requestIterator->packets; packetIterator; packetIterator = packetIterator->next)
+      {
+         sr_upgrade_pkt_rec_t *rec = (sr_upgrade_pkt_rec_t *) cursor;
+         rec->nextHopIp = htonl(requestIterator->ip);
+         memcpy(rec->iface, packetIterator->iface, sr_IFACE_NAMELEN);
+         rec->length = htonl(packetIterator->len);
+         cursor += sizeof(sr_upgrade_pkt_rec_t);
+         memcpy(cursor, packetIterator->buf, packetIterator->len);
+         cursor += packetIterator->len;
+         count++;
+      }
+   }
+   header->numQueuedPackets = htonl(count);
+
+   if (sr->nat)
+   {
+      sr_nat_mapping_t *mappingIterator;
+      sr_nat_connection_t *connectionIterator;
+
+      header->nextTcpPortNumber = htons(sr->nat->nextTcpPortNumber);
+      header->nextIcmpIdentNumber = htons(sr->nat->nextIcmpIdentNumber);
+
+      for (count = 0, mappingIterator = sr->nat->mappings; mappingIterator;
+         mappingIterator = mappingIterator->next, count++)
+      {
+         sr_upgrade_mapping_rec_t *rec = (sr_upgrade_mapping_rec_t *) cursor;
+         uint32_t numConnections = 0;
+         cursor += sizeof(sr_upgrade_mapping_rec_t);
+
+         /* Mapping fields are already kept in network byte order. */
+         rec->type = (uint8_t) mappingIterator->type;
+         rec->ip_int = mappingIterator->ip_int;
+         rec->ip_ext = mappingIterator->ip_ext;
+         rec->aux_int = mappingIterator->aux_int;
+         rec->aux_ext = mappingIterator->aux_ext;
+         rec->last_updated = htonl((uint32_t) mappingIterator->last_updated);
+
+         for (connectionIterator = mappingIterator->conns; connectionIterator;
+            connectionIterator = connectionIterator->next, numConnections++)
+         {
+            sr_upgrade_conn_rec_t *connRec = (sr_upgrade_conn_rec_t *) cursor;
+            connRec->connectionState = (uint8_t) connectionIterator->connectionState;
+            connRec->finSent = connectionIterator->finSent;
+            connRec->finAcked = connectionIterator->finAcked;
+            connRec->finSequence[nat_conn_internal] = htonl(connectionIterator->finSequence[nat_conn_internal]);
+            connRec->finSequence[nat_conn_external] = htonl(connectionIterator->finSequence[nat_conn_external]);
+            connRec->lastAccessed = htonl((uint32_t) connectionIterator->lastAccessed);
+            connRec->externalIp = connectionIterator->external.ipAddress;
+            connRec->externalPort = connectionIterator->external.portNumber;
+            cursor += sizeof(sr_upgrade_conn_rec_t);
+         }
+         rec->numConnections = htonl(numConnections);
+      }
+      header->numMappings = htonl(count);
+   }
+
+   assert(cursor == buffer + length);
+}
+
+/**
+ * upgradeRestoreSnapshot()\n
+ * @brief Rebuilds router state from a snapshot written by upgradeWriteSnapshot().
+ * @return 0 on success, -1 if the snapshot is malformed or from an
+ *         incompatible version.
+ * @note Queued packets are re-queued and re-ARPed immediately, so nothing
+ *       that was in flight in the old process is lost.
+ */
+static int upgradeRestoreSnapshot(struct sr_instance *sr, const uint8_t *buffer, size_t length)
+{
+   const sr_upgrade_hdr_t *header = (const sr_upgrade_hdr_t *) buffer;
+   const uint8_t *cursor = buffer + sizeof(sr_upgrade_hdr_t);
+   const uint8_t *end = buffer + length;
+   struct sr_rt *routeIterator;
+   uint32_t count, i;
+
+   if ((length < sizeof(sr_upgrade_hdr_t)) || (ntohl(header->magic) != SR_UPGRADE_MAGIC)
+      || (ntohl(header->version) != SR_UPGRADE_VERSION) || (ntohl(header->length) != length))
+   {
+      fprintf(stderr, "Incompatible upgrade snapshot (version %u).\n", ntohl(header->version));
+      return -1;
+   }
+
+#define UPGRADE_NEED(bytes) do { if ((size_t)(end - cursor) < (size_t)(bytes)) goto truncated; } while (0)
+
+   /* Interfaces */
+   count = ntohl(header->numInterfaces);
+   for (i = 0; i < count; i++)
+   {
+      const sr_upgrade_if_rec_t *rec = (const sr_upgrade_if_rec_t *) cursor;
+      UPGRADE_NEED(sizeof(sr_upgrade_if_rec_t));
+      sr_add_interface(sr, rec->name);
+      sr_set_ether_addr(sr, rec->addr);
+      sr_set_ether_ip(sr, rec->ip);
+      cursor += sizeof(sr_upgrade_if_rec_t);
+   }
+
+   /* Routing table replaces whatever was loaded from the local file. */
+   while (sr->routing_table)
+   {
+      routeIterator = sr->routing_table;
+      sr->routing_table = routeIterator->next;
+      free(routeIterator);
+   }
+   count = ntohl(header->numRoutes);
+   for (i = 0; i < count; i++)
+   {
+      const sr_upgrade_rt_rec_t *rec = (const sr_upgrade_rt_rec_t *) cursor;
+      struct in_addr dest, gw, mask;
+      char interfaceName[sr_IFACE_NAMELEN];
+      UPGRADE_NEED(sizeof(sr_upgrade_rt_rec_t));
+      dest.s_addr = rec->dest;
+      gw.s_addr = rec->gw;
+      mask.s_addr = rec->mask;
+      memcpy(interfaceName, rec->interface, sr_IFACE_NAMELEN);
+      sr_add_rt_entry(sr, dest, gw, mask, interfaceName);
+      cursor += sizeof(sr_upgrade_rt_rec_t);
+   }
+
+   /* ARP cache entries are live, not stale: the old process just used them. */
+   sr_watchdog_lock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+   memset(sr->cache.entries, 0, sizeof(sr->cache.entries));
+   count = ntohl(header->numArpEntries);
+   for (i = 0; i < count; i++)
+   {
+      const sr_arpcache_file_rec_t *rec = (const sr_arpcache_file_rec_t *) cursor;
+      if ((size_t)(end - cursor) < sizeof(sr_arpcache_file_rec_t))
+      {
+         sr_watchdog_unlock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+         goto truncated;
+      }
+      if (i < SR_ARPCACHE_SZ)
+      {
+         sr_arpentry_t *entry = &(sr->cache.entries[i]);
+         entry->ip = ntohl(rec->ip);
+         memcpy(entry->mac, rec->mac, ETHER_ADDR_LEN);
+         memcpy(entry->iface, rec->iface, sr_IFACE_NAMELEN);
+         entry->iface[sr_IFACE_NAMELEN - 1] = '\0';
+         entry->added = (time_t) ntohl(rec->added);
+         entry->valid = 1;
+      }
+      cursor += sizeof(sr_arpcache_file_rec_t);
+   }
+   sr_watchdog_unlock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+
+   /* Packets that were waiting on ARP in the old process. */
+   count = ntohl(header->numQueuedPackets);
+   for (i = 0; i < count; i++)
+   {
+      const sr_upgrade_pkt_rec_t *rec = (const sr_upgrade_pkt_rec_t *) cursor;
+      struct sr_arpreq *request;
+      char interfaceName[sr_IFACE_NAMELEN];
+      uint32_t frameLength;
+
+      UPGRADE_NEED(sizeof(sr_upgrade_pkt_rec_t));
+      frameLength = ntohl(rec->length);
+      UPGRADE_NEED(sizeof(sr_upgrade_pkt_rec_t) + frameLength);
+
+      memcpy(interfaceName, rec->iface, sr_IFACE_NAMELEN);
+      interfaceName[sr_IFACE_NAMELEN - 1] = '\0';
+
+      /* The ARP timeout thread is already running; see sr_arpcache_queuereq(). */
+      sr_watchdog_lock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+      request = sr_arpcache_queuereq(&(sr->cache), ntohl(rec->nextHopIp),
+         (uint8_t *) (cursor + sizeof(sr_upgrade_pkt_rec_t)), frameLength, interfaceName);
+
+      if (request->times_sent == 0)
+      {
+         request->requestedInterface = sr_get_interface(sr, interfaceName);
+         if (request->requestedInterface)
+         {
+            LinkSendArpRequest(sr, request);
+            request->times_sent = 1;
+            request->sent = sr_clock_now();
+         }
+      }
+      sr_watchdog_unlock(&(sr->cache.lock), SR_WATCHDOG_LOCK_ARP);
+      cursor += sizeof(sr_upgrade_pkt_rec_t) + frameLength;
+   }
+
+   /* NAT table */
+   count = ntohl(header->numMappings);
+   if (sr->nat)
+   {
+      sr_watchdog_lock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+      sr->nat->nextTcpPortNumber = ntohs(header->nextTcpPortNumber);
+      sr->nat->nextIcmpIdentNumber = ntohs(header->nextIcmpIdentNumber);
+   }
+   for (i = 0; i < count; i++)
+   {
+      const sr_upgrade_mapping_rec_t *rec = (const sr_upgrade_mapping_rec_t *) cursor;
+      uint32_t numConnections, j;
+      sr_nat_mapping_t *mapping = NULL;
+
+      if ((size_t)(end - cursor) < sizeof(sr_upgrade_mapping_rec_t))
+      {
+         if (sr->nat) { sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT); }
+         goto truncated;
+      }
+      numConnections = ntohl(rec->numConnections);
+      cursor += sizeof(sr_upgrade_mapping_rec_t);
+
+      if (sr->nat)
+      {
+         mapping = malloc(sizeof(sr_nat_mapping_t));
+         assert(mapping);
+         mapping->type = (sr_nat_mapping_type) rec->type;
+         mapping->ip_int = rec->ip_int;
+         mapping->ip_ext = rec->ip_ext;
+         mapping->aux_int = rec->aux_int;
+         mapping->aux_ext = rec->aux_ext;
+         mapping->last_updated = (time_t) ntohl(rec->last_updated);
+         mapping->conns = NULL;
+         mapping->closingConnections = 0;
+         mapping->next = sr->nat->mappings;
+         sr->nat->mappings = mapping;
+         sr_policer_add_mapping(sr->nat->policer, mapping->ip_int);
+         sr_nat_mapping_added(sr->nat, mapping, true);
+      }
+
+      for (j = 0; j < numConnections; j++)
+      {
+         const sr_upgrade_conn_rec_t *connRec = (const sr_upgrade_conn_rec_t *) cursor;
+         if ((size_t)(end - cursor) < sizeof(sr_upgrade_conn_rec_t))
+         {
+            if (sr->nat) { sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT); }
+            goto truncated;
+         }
+
+         if (mapping)
+         {
+            sr_nat_connection_t *connection = malloc(sizeof(sr_nat_connection_t));
+            assert(connection);
+            connection->connectionState = (sr_nat_tcp_conn_state_t) connRec->connectionState;
+            connection->lastAccessed = (time_t) ntohl(connRec->lastAccessed);
+            connection->queuedInboundSyn = NULL;
+            connection->finSent = connRec->finSent;
+            connection->finAcked = connRec->finAcked;
+            connection->externalSequenceKnown = false;
+            connection->finSequence[nat_conn_internal] = ntohl(connRec->finSequence[nat_conn_internal]);
+            connection->finSequence[nat_conn_external] = ntohl(connRec->finSequence[nat_conn_external]);
+            connection->external.ipAddress = connRec->externalIp;
+            connection->external.portNumber = connRec->externalPort;
+            sr_nat_start_flow(connection);
+            connection->next = mapping->conns;
+            mapping->conns = connection;
+            sr_nat_update_closing(mapping);
+         }
+         cursor += sizeof(sr_upgrade_conn_rec_t);
+      }
+   }
+   if (sr->nat)
+   {
+      sr_watchdog_unlock(&(sr->nat->lock), SR_WATCHDOG_LOCK_NAT);
+   }
+   else if (count > 0)
+   {
+      fprintf(stderr, "Warning: dropping %u NAT mappings, NAT is not enabled.\n", count);
+   }
+
+#undef UPGRADE_NEED
+   return 0;
+
+truncated:
+   fprintf(stderr, "Upgrade snapshot is truncated.\n");
+   return -1;
+}
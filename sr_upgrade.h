@@ -0,0 +1,118 @@
+/**
+ * @file sr_upgrade.h
+ * @brief Zero-downtime binary upgrade (hot handoff) for the simple router.
+ *
+ * Sending SIGUSR2 to a running router makes it fork/exec its own binary
+ * (which may have been replaced on disk) with "-U <fd>" appended to the
+ * original command line. The old process stops reading from VNS at a
+ * message boundary, passes the VNS socket and a shared memory snapshot of
+ * its interfaces, routing table, ARP cache, ARP queues and NAT table to the
+ * new process with SCM_RIGHTS, waits for the new process to acknowledge, and
+ * exits. The VNS session never drops.
+ */
+
+#ifndef SR_UPGRADE_H
+#define SR_UPGRADE_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <signal.h>
+
+#include "sr_protocol.h"
+#include "sr_arpcache.h"
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_UPGRADE_MAGIC            (0x53525550) /* "SRUP" */
+#define SR_UPGRADE_VERSION          (2)
+#define SR_UPGRADE_ACK_TIMEOUT_MS   (10000)
+
+/*
+ * Public Types
+ */
+
+struct sr_instance;
+
+/* Snapshot layout. Every record is packed and in network byte order so that
+ * the new binary does not depend on the old binary's structure layouts. The
+ * sections follow the header in the order listed. */
+typedef struct __attribute__ ((packed))
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t length; /**< Total snapshot length in bytes. */
+   uint32_t numInterfaces;
+   uint32_t numRoutes;
+   uint32_t numArpEntries;
+   uint32_t numQueuedPackets;
+   uint32_t numMappings; /**< Each mapping is followed by its connections. */
+   uint16_t nextTcpPortNumber;
+   uint16_t nextIcmpIdentNumber;
+} sr_upgrade_hdr_t;
+
+typedef struct __attribute__ ((packed))
+{
+   char name[sr_IFACE_NAMELEN];
+   uint8_t addr[ETHER_ADDR_LEN];
+   uint32_t ip;
+   uint32_t speed;
+} sr_upgrade_if_rec_t;
+
+typedef struct __attribute__ ((packed))
+{
+   uint32_t dest;
+   uint32_t gw;
+   uint32_t mask;
+   char interface[sr_IFACE_NAMELEN];
+} sr_upgrade_rt_rec_t;
+
+typedef struct __attribute__ ((packed))
+{
+   uint32_t nextHopIp; /**< IP address being ARPed. */
+   char iface[sr_IFACE_NAMELEN];
+   uint32_t length; /**< Frame bytes that follow this record. */
+} sr_upgrade_pkt_rec_t;
+
+typedef struct __attribute__ ((packed))
+{
+   uint8_t type;
+   uint32_t ip_int;
+   uint32_t ip_ext;
+   uint16_t aux_int;
+   uint16_t aux_ext;
+   uint32_t last_updated;
+   uint32_t numConnections;
+} sr_upgrade_mapping_rec_t;
+
+typedef struct __attribute__ ((packed))
+{
+   uint8_t connectionState;
+   uint8_t finSent;
+   uint8_t finAcked;
+   uint32_t finSequence[2]; /**< Indexed by sr_nat_conn_endpoint_t. */
+   uint32_t lastAccessed;
+   uint32_t externalIp;
+   uint16_t externalPort;
+} sr_upgrade_conn_rec_t;
+
+/*
+ * Public Variables and Constants
+ */
+
+/** Set from signal context (SIGUSR2) when a hot upgrade has been requested. */
+extern volatile sig_atomic_t srUpgradeRequested;
+
+/*
+ * Public Function Declarations
+ */
+
+void sr_upgrade_init(int argc, char **argv);
+int sr_upgrade_handoff(struct sr_instance *sr);
+int sr_upgrade_adopt(struct sr_instance *sr, int channelFd);
+
+#endif /* SR_UPGRADE_H */
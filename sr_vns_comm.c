@@ -40,6 +40,11 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_upgrade.h"
+#include "sr_admission.h"
+#include "sr_probe.h"
+#include "sr_vns_reader.h"
+#include "sr_watchdog.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -50,6 +55,34 @@ static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   unsigned int len,
                                   char* interface  /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
+static int  sr_handle_capabilities(struct sr_instance* sr, c_capabilities* offer);
+static void sr_handle_packet_batch(struct sr_instance* sr, uint8_t* buf, int len);
+static void sr_deliver_packet(struct sr_instance* sr, uint8_t* packet /* lent */,
+                              unsigned int len, char* interface /* lent */);
+static int  sr_interface_id(struct sr_instance* sr, const char* name);
+static struct sr_if* sr_interface_by_id(struct sr_instance* sr, unsigned int id);
+static int  sr_tx_flush(void);
+static int  sr_read_command_buffered(struct sr_instance* sr, uint8_t* buf,
+                                     int* result);
+
+#define SR_VNS_MAX_COMMAND_LEN 10000
+
+/* -- protocol extensions this client accepts when a server offers them -- */
+#define SR_VNS_SUPPORTED_CAPABILITIES VNS_CAP_PACKET_BATCH
+
+/* -- receive buffer, reused for every command read on this thread. Packets
+ *    are lent to the router, which copies anything it keeps, so all router
+ *    instances served by one thread can share it -- */
+static __thread uint32_t sr_rx_buffer[(SR_VNS_MAX_COMMAND_LEN + 3) / 4];
+
+/* -- transmit batch. While the reader thread hands received frames to the
+ *    router, the frames the router sends in response are collected here and
+ *    written as one VNSPACKET_BATCH afterwards. Other threads (ARP and NAT
+ *    timers) never have an owner set and write directly -- */
+static __thread uint32_t sr_tx_buffer[(SR_VNS_MAX_COMMAND_LEN + 3) / 4];
+static __thread struct sr_instance* sr_tx_owner = 0;
+static __thread unsigned int sr_tx_len = 0;
+static __thread uint32_t sr_tx_count = 0;
 
 /*-----------------------------------------------------------------------------
  * Method: sr_session_closed_help(..)
@@ -341,71 +374,92 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
     /* REQUIRES */
     assert(sr);
 
+    /* -- the previous command is done; waiting for the next isn't a stall -- */
+    sr_watchdog_idle();
+
     /*---------------------------------------------------------------------------
       Read a command from the server
       -------------------------------------------------------------------------*/
 
-    bytes_read = 0;
+    buf = (unsigned char*)sr_rx_buffer;
 
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    if ( sr->reader )
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
-
+        /* -- adaptive reader: many commands per recv -- */
+        if ( (len = sr_read_command_buffered(sr, buf, &ret)) == 0 )
+        { return ret; }
     }
+    else
+    {
+        bytes_read = 0;
 
-    len = ntohl(len);
+        /* attempt to read the size of the incoming packet */
+        while( bytes_read < 4)
+        {
+            do
+            { /* -- just in case SIGALRM breaks recv -- */
+                errno = 0; /* -- hacky glibc workaround -- */
+                if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
+                                4 - bytes_read, 0)) == -1)
+                {
+                    if ( errno == EINTR )
+                    {
+                        /* -- only bail between commands, never mid-message -- */
+                        if ( srShutdownRequested && bytes_read == 0 )
+                        { return 0; }
+                        /* -- let the main loop start a hot upgrade -- */
+                        if ( srUpgradeRequested && bytes_read == 0 )
+                        { return 1; }
+                        /* -- ... or print the counters -- */
+                        if ( srStatsRequested && bytes_read == 0 )
+                        { return 1; }
+                        continue;
+                    }
+
+                    perror("recv(..):sr_client.c::sr_read_from_server");
+                    return -1;
+                }
+                bytes_read += ret;
+            } while ( errno == EINTR); /* be mindful of signals */
 
-    if ( len > 10000 || len < 0 )
-    {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
-        return -1;
-    }
+        }
 
-    if((buf = malloc(len)) == 0)
-    {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
-    }
+        len = ntohl(len);
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
+        if ( len > SR_VNS_MAX_COMMAND_LEN || len < 8 )
+        {
+            fprintf(stderr,"Error: command length to large %d\n",len);
+            close(sr->sockfd);
+            return -1;
+        }
 
-    bytes_read = 0;
+        /* set first field of command since we've already read it */
+        *((int *)buf) = htonl(len);
 
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
+        bytes_read = 0;
+
+        /* read the rest of the command */
+        while ( bytes_read < len - 4)
+        {
+            do
+            {/* -- just in case SIGALRM breaks recv -- */
+                errno = 0; /* -- hacky glibc workaround -- */
+                if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
+                        -1)
+                {
+                    if ( errno == EINTR )
+                    { continue; }
+                    fprintf(stderr,"Error: failed reading command body %d\n",ret);
+                    close(sr->sockfd);
+                    return -1;
+                }
+                bytes_read += ret;
+            } while (errno == EINTR); /* be mindful of signals */
+        }
     }
 
+    sr_watchdog_stage(SR_WATCHDOG_PACKET);
+
     /* My entry for most unreadable line of code - guido */
     /* ... you win - mc                                  */
     command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
@@ -425,26 +479,43 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
         case VNSPACKET:
             sr_pkt = (c_packet_ethernet_header *)buf;
+            sr_admission_update(&sr->admission, sr->sockfd,
+                                sr_vns_reader_buffered(sr->reader));
 
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+            if ( sr->vnsCapabilities & VNS_CAP_PACKET_BATCH )
+            { sr_tx_owner = sr; }
 
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
-
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
+            sr_deliver_packet(sr,
                     (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
+                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header),
                     (char*)(buf + sizeof(c_base)));
 
+            if ( sr_tx_flush() != 0 )
+            { ret = -1; }
+            break;
+
+            /* -------------    VNSPACKET_BATCH   -------------------- */
+
+        case VNSPACKET_BATCH:
+            /* -- accepted even if not negotiated (e.g. after a hot
+             *    upgrade, which does not repeat the handshake) -- */
+            sr_admission_update(&sr->admission, sr->sockfd,
+                                sr_vns_reader_buffered(sr->reader));
+            if ( sr->vnsCapabilities & VNS_CAP_PACKET_BATCH )
+            { sr_tx_owner = sr; }
+
+            sr_handle_packet_batch(sr, buf, len);
+
+            if ( sr_tx_flush() != 0 )
+            { ret = -1; }
+            break;
+
+            /* -------------   VNS_CAPABILITIES   -------------------- */
+
+        case VNS_CAPABILITIES:
+            if ( len < (int)sizeof(c_capabilities) ||
+                 !sr_handle_capabilities(sr, (c_capabilities*)buf) )
+            { ret = -1; }
             break;
 
             /* -------------        VNSCLOSE      -------------------- */
@@ -454,8 +525,6 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
             fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
             sr_session_closed_help();
 
-            if(buf)
-            { free(buf); }
             return 0;
             break;
 
@@ -501,11 +570,271 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
 
     }/* -- switch -- */
 
-    if(buf)
-    { free(buf); }
     return ret;
 }/* -- sr_read_from_server -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_command_buffered(..)
+ * Scope: Local
+ *
+ * Copy the next command from the instance's adaptive reader into buf (the
+ * reader's copy is not aligned).  Signals are honoured between commands as
+ * in the classic path, and once a hot upgrade is pending nothing is read
+ * past the current command so the socket can be handed over as is.  A
+ * non-blocking reader (sr_multi) may not have a whole command yet; the
+ * caller then returns 1 and is called again once the socket is readable.
+ *
+ * RETURN VALUES:
+ *
+ *  the command length, or
+ *  0 if the caller should return *result instead
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_read_command_buffered(struct sr_instance* sr, uint8_t* buf,
+                                    int* result)
+{
+    uint8_t* message = 0;
+    int len;
+
+    while ( (len = sr_vns_reader_next(sr->reader, sr->sockfd,
+                                      srUpgradeRequested != 0, &message))
+            == SR_VNS_READER_INTERRUPTED )
+    {
+        if ( srShutdownRequested )
+        { *result = 0; return 0; }
+        if ( srUpgradeRequested || srStatsRequested )
+        { *result = 1; return 0; }
+    }
+
+    if ( len == SR_VNS_READER_WOULD_BLOCK )
+    { *result = 1; return 0; }
+
+    if ( len == 0 )
+    {
+        fprintf(stderr,"VNS server closed the connection\n");
+        *result = 0;
+        return 0;
+    }
+    if ( len < 0 )
+    {
+        if ( errno )
+        { perror("recv(..):sr_client.c::sr_read_from_server"); }
+        else
+        { fprintf(stderr,"Error: bad command length\n"); }
+        close(sr->sockfd);
+        *result = -1;
+        return 0;
+    }
+
+    memcpy(buf, message, len);
+    return len;
+} /* -- sr_read_command_buffered -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_capabilities(..)
+ * Scope: Local
+ *
+ * Accept whichever offered extensions this client supports and tell the
+ * server which ones those are.  Returns 1 on success, 0 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_handle_capabilities(struct sr_instance* sr, c_capabilities* offer)
+{
+    c_capabilities reply;
+    uint32_t accepted = 0;
+    uint32_t max_batch_len;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(offer);
+
+    /* -- a newer version must stay compatible with the version 1 fields -- */
+    if ( ntohl(offer->mVersion) >= VNS_CAP_VERSION )
+    { accepted = ntohl(offer->mCapabilities) & SR_VNS_SUPPORTED_CAPABILITIES; }
+
+    max_batch_len = ntohl(offer->mMaxBatchLen);
+    if ( max_batch_len > SR_VNS_MAX_COMMAND_LEN )
+    { max_batch_len = SR_VNS_MAX_COMMAND_LEN; }
+    if ( max_batch_len < sizeof(c_packet_batch) + sizeof(c_packet_batch_frame) +
+                         sizeof(struct sr_ethernet_hdr) )
+    { accepted &= ~VNS_CAP_PACKET_BATCH; }
+
+    reply.mLen = htonl(sizeof(reply));
+    reply.mType = htonl(VNS_CAPABILITIES);
+    reply.mVersion = htonl(VNS_CAP_VERSION);
+    reply.mCapabilities = htonl(accepted);
+    reply.mMaxBatchLen = htonl(SR_VNS_MAX_COMMAND_LEN);
+
+    if ( send(sr->sockfd, &reply, sizeof(reply), 0) != sizeof(reply) )
+    {
+        perror("send(..):sr_client.c::sr_handle_capabilities()");
+        return 0;
+    }
+
+    sr->vnsCapabilities = accepted;
+    sr->vnsMaxBatchLen = max_batch_len;
+
+    printf("VNS extensions: %s\n",
+           (accepted & VNS_CAP_PACKET_BATCH) ? "packet batching" : "none");
+
+    return 1;
+} /* -- sr_handle_capabilities -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_packet_batch(..)
+ * Scope: Local
+ *
+ * Hand every frame of a VNSPACKET_BATCH to the router.  A malformed record
+ * ends the batch; the frames before it have already been delivered.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_handle_packet_batch(struct sr_instance* sr, uint8_t* buf, int len)
+{
+    c_packet_batch_frame* frame;
+    struct sr_if* iface;
+    uint32_t count, i;
+    unsigned int offset = sizeof(c_packet_batch);
+    unsigned int frame_len;
+
+    if ( len < (int)sizeof(c_packet_batch) )
+    {
+        fprintf(stderr, "** Error: batch too short\n");
+        return;
+    }
+
+    count = ntohl(((c_packet_batch*)buf)->mCount);
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( offset + sizeof(c_packet_batch_frame) > (unsigned int)len )
+        { break; }
+
+        frame = (c_packet_batch_frame*)(buf + offset);
+        frame_len = ntohs(frame->mLen);
+        offset += sizeof(c_packet_batch_frame);
+
+        if ( offset + frame_len > (unsigned int)len ||
+             frame_len < sizeof(struct sr_ethernet_hdr) )
+        { break; }
+
+        if ( (iface = sr_interface_by_id(sr, frame->mInterfaceId)) == 0 )
+        {
+            fprintf(stderr, "** Error: batch names unknown interface %u\n",
+                    frame->mInterfaceId);
+        }
+        else
+        { sr_deliver_packet(sr, buf + offset, frame_len, iface->name); }
+
+        offset += frame_len;
+    }
+
+    if ( i < count )
+    { fprintf(stderr, "** Error: malformed batch, %u of %u frames used\n", i, count); }
+} /* -- sr_handle_packet_batch -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_deliver_packet(..)
+ * Scope: Local
+ *
+ * Filter, log and pass one received frame to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_deliver_packet(struct sr_instance* sr, uint8_t* packet /* lent */,
+                              unsigned int len, char* interface /* lent */)
+{
+    /* -- shed transit traffic first when VNS is backing up -- */
+    if ( ! sr_admission_admit(sr, packet, len) )
+    {
+        SR_PROBE_DROP("admission", len);
+        return;
+    }
+
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( sr_arp_req_not_for_us(sr, packet, len, interface) )
+    {
+        SR_PROBE_DROP("arp_not_for_us", len);
+        return;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, packet, len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_handlepacket(sr, packet, len, interface);
+} /* -- sr_deliver_packet -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_interface_id(..) / sr_interface_by_id(..)
+ * Scope: Local
+ *
+ * Batched frames name interfaces by their position in VNSHWINFO, which is
+ * the order of sr->if_list.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_interface_id(struct sr_instance* sr, const char* name)
+{
+    struct sr_if* if_walker;
+    int id = 0;
+
+    for ( if_walker = sr->if_list; if_walker; if_walker = if_walker->next, id++ )
+    {
+        if ( strncmp(if_walker->name, name, sr_IFACE_NAMELEN) == 0 )
+        { return id; }
+    }
+    return -1;
+}
+
+static struct sr_if* sr_interface_by_id(struct sr_instance* sr, unsigned int id)
+{
+    struct sr_if* if_walker = sr->if_list;
+
+    while ( if_walker && id-- > 0 )
+    { if_walker = if_walker->next; }
+    return if_walker;
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_tx_flush(..)
+ * Scope: Local
+ *
+ * Write the frames collected for sr_tx_owner as one VNSPACKET_BATCH and stop
+ * collecting.  Returns 0 on success (or if there was nothing to send).
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_tx_flush(void)
+{
+    c_packet_batch* batch = (c_packet_batch*)sr_tx_buffer;
+    sr_watchdog_stage_t stage;
+    int ret = 0;
+
+    if ( sr_tx_owner && sr_tx_count > 0 )
+    {
+        batch->mLen = htonl(sr_tx_len);
+        batch->mType = htonl(VNSPACKET_BATCH);
+        batch->mCount = htonl(sr_tx_count);
+
+        stage = sr_watchdog_stage(SR_WATCHDOG_VNS_WRITE);
+        if ( write(sr_tx_owner->sockfd, batch, sr_tx_len) < (ssize_t)sr_tx_len )
+        {
+            fprintf(stderr, "Error writing packet batch\n");
+            ret = -1;
+        }
+        sr_watchdog_stage(stage);
+    }
+
+    sr_tx_owner = 0;
+    sr_tx_len = 0;
+    sr_tx_count = 0;
+
+    return ret;
+} /* -- sr_tx_flush -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
  * Scope: Local
@@ -565,43 +894,79 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          const char* iface /* borrowed */)
 {
     c_packet_header *sr_pkt;
+    c_packet_batch_frame *frame;
     unsigned int total_len =  len + (sizeof(c_packet_header));
+    sr_watchdog_stage_t stage;
+    int id;
 
     /* REQUIRES */
     assert(sr);
     assert(buf);
     assert(iface);
 
+    SR_PROBE3(tx, buf, len, iface);
+
     /* don't waste my time ... */
     if ( len < sizeof(struct sr_ethernet_hdr) ){
         fprintf(stderr , "** Error: packet is wayy to short \n");
         return -1;
     }
 
+    /* -- log packet -- */
+    sr_log_packet(sr,buf,len);
+
+    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return -1;
+    }
+
+    /* -- add to the batch being collected for this instance, if any -- */
+    if ( sr_tx_owner == sr &&
+         (id = sr_interface_id(sr, iface)) >= 0 && id <= UINT8_MAX &&
+         sizeof(c_packet_batch) + sizeof(c_packet_batch_frame) + len <=
+         sr->vnsMaxBatchLen )
+    {
+        if ( sr_tx_len + sizeof(c_packet_batch_frame) + len > sr->vnsMaxBatchLen )
+        {
+            if ( sr_tx_flush() != 0 )
+            { return -1; }
+            sr_tx_owner = sr;
+        }
+
+        if ( sr_tx_count == 0 )
+        { sr_tx_len = sizeof(c_packet_batch); }
+
+        frame = (c_packet_batch_frame*)(((uint8_t*)sr_tx_buffer) + sr_tx_len);
+        frame->mLen = htons(len);
+        frame->mInterfaceId = (uint8_t)id;
+        frame->mReserved = 0;
+        memcpy(((uint8_t*)frame) + sizeof(c_packet_batch_frame), buf, len);
+        sr_tx_len += sizeof(c_packet_batch_frame) + len;
+        sr_tx_count++;
+
+        return 0;
+    }
+
     /* Create packet */
     sr_pkt = (c_packet_header *)malloc(len +
             sizeof(c_packet_header));
     assert(sr_pkt);
     sr_pkt->mLen  = htonl(total_len);
     sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
+    /* fixed width, zero padded, not necessarily terminated */
+    memset(sr_pkt->mInterfaceName, 0, sizeof(sr_pkt->mInterfaceName));
+    memcpy(sr_pkt->mInterfaceName, iface, strnlen(iface, sizeof(sr_pkt->mInterfaceName)));
     memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
             buf,len);
 
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
-
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
-        return -1;
-    }
-
+    stage = sr_watchdog_stage(SR_WATCHDOG_VNS_WRITE);
     if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
         fprintf(stderr, "Error writing packet\n");
+        sr_watchdog_stage(stage);
         free(sr_pkt);
         return -1;
     }
+    sr_watchdog_stage(stage);
 
     free(sr_pkt);
 
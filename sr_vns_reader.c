@@ -0,0 +1,341 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "sr_vns_reader.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define VNS_HEADER_LEN     (8) /**< Length and type of every command. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64_t readerNowNs(void);
+static ssize_t readerRead(sr_vns_reader_t *reader, int fd, unsigned int length);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_vns_reader_create()\n
+ * @brief Allocates an adaptive reader with an empty buffer.
+ * @param spinBudgetUs how long to busy-poll for more data while traffic is
+ *        flowing, in microseconds; 0 always blocks.
+ * @return the reader, or NULL if out of memory.
+ */
+sr_vns_reader_t *sr_vns_reader_create(unsigned int spinBudgetUs)
+{
+   sr_vns_reader_t *reader = calloc(1, sizeof(sr_vns_reader_t));
+
+   if (reader == NULL)
+   {
+      return NULL;
+   }
+
+   reader->buffer = malloc(SR_VNS_READER_MAX_BATCH);
+   if (reader->buffer == NULL)
+   {
+      free(reader);
+      return NULL;
+   }
+   reader->batch = SR_VNS_READER_MIN_BATCH;
+   reader->spinBudgetUs = spinBudgetUs;
+
+   return reader;
+}
+
+/**
+ * sr_vns_reader_destroy()\n
+ * @brief Frees a reader and anything still buffered.
+ */
+void sr_vns_reader_destroy(sr_vns_reader_t *reader)
+{
+   if (reader)
+   {
+      free(reader->buffer);
+      free(reader);
+   }
+}
+
+/**
+ * sr_vns_reader_set_nonblocking()\n
+ * @brief Chooses whether sr_vns_reader_next() may wait for data.
+ * @param nonBlocking true to return SR_VNS_READER_WOULD_BLOCK instead of
+ *        waiting; spinning is skipped too.
+ */
+void sr_vns_reader_set_nonblocking(sr_vns_reader_t *reader, bool nonBlocking)
+{
+   assert(reader);
+   reader->nonBlocking = nonBlocking;
+}
+
+/**
+ * sr_vns_reader_next()\n
+ * @brief Gets the next complete VNS message, reading more if needed.
+ * @param reader pointer to the reader.
+ * @param fd the VNS socket.
+ * @param noReadAhead read only what the current message still needs, so
+ *        nothing is left buffered once it has been handed out (used before
+ *        the socket is passed on, e.g. to a hot upgrade).
+ * @param message out: the message, valid until the next call. It is not
+ *        aligned.
+ * @return the message length; 0 if the server closed the connection;
+ *         SR_VNS_READER_INTERRUPTED if a signal arrived while no part of a
+ *         message was buffered; SR_VNS_READER_WOULD_BLOCK if the reader is
+ *         non-blocking and no complete message has arrived; -1 on error (errno set) or if the stream
+ *         holds an impossible length (errno 0).
+ */
+int sr_vns_reader_next(sr_vns_reader_t *reader, int fd, bool noReadAhead, uint8_t **message)
+{
+   assert(reader);
+   assert(message);
+
+   if (reader->lastReturnNs)
+   {
+      reader->processNs += readerNowNs() - reader->lastReturnNs;
+      reader->lastReturnNs = 0;
+   }
+
+   for (;;)
+   {
+      unsigned int available = reader->end - reader->start;
+      unsigned int needed = 4;
+      unsigned int length;
+      ssize_t received;
+
+      if (available >= 4)
+      {
+         uint32_t messageLength;
+
+         memcpy(&messageLength, reader->buffer + reader->start, sizeof(messageLength));
+         messageLength = ntohl(messageLength);
+         if ((messageLength < VNS_HEADER_LEN) || (messageLength > SR_VNS_READER_MAX_MESSAGE))
+         {
+            errno = 0;
+            return -1;
+         }
+
+         if (available >= messageLength)
+         {
+            *message = reader->buffer + reader->start;
+            reader->start += messageLength;
+            reader->messages++;
+            reader->lastReturnNs = readerNowNs();
+            return messageLength;
+         }
+         needed = messageLength;
+      }
+      needed -= available;
+
+      /* Keep the unread tail at the front so a whole batch fits behind it. */
+      if (reader->start > 0)
+      {
+         memmove(reader->buffer, reader->buffer + reader->start, available);
+         reader->start = 0;
+         reader->end = available;
+      }
+
+      length = noReadAhead ? needed : reader->batch;
+      if (length < needed)
+      {
+         length = needed;
+      }
+      if (length > SR_VNS_READER_MAX_BATCH - reader->end)
+      {
+         length = SR_VNS_READER_MAX_BATCH - reader->end;
+      }
+
+      received = readerRead(reader, fd, length);
+      if (received == 0)
+      {
+         return 0;
+      }
+      if (received < 0)
+      {
+         if (reader->nonBlocking && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+         {
+            return SR_VNS_READER_WOULD_BLOCK;
+         }
+         if (errno != EINTR)
+         {
+            return -1;
+         }
+         if (available == 0)
+         {
+            return SR_VNS_READER_INTERRUPTED;
+         }
+         continue;
+      }
+      reader->end += received;
+
+      /* More than this message was waiting: traffic is queueing up. */
+      if (((unsigned int) received > needed) && !reader->busy && (reader->spinBudgetUs > 0))
+      {
+         reader->busy = true;
+         reader->busyEpisodes++;
+      }
+
+      if (!noReadAhead)
+      {
+         if (((unsigned int) received == length) && (reader->batch < SR_VNS_READER_MAX_BATCH))
+         {
+            reader->batch *= 2;
+         }
+         else if (((unsigned int) received < reader->batch / 4)
+            && (reader->batch > SR_VNS_READER_MIN_BATCH))
+         {
+            reader->batch /= 2;
+         }
+      }
+   }
+}
+
+/**
+ * sr_vns_reader_pending()\n
+ * @return true if any part of a message has been read but not handed out.
+ */
+bool sr_vns_reader_pending(const sr_vns_reader_t *reader)
+{
+   return reader && (reader->end > reader->start);
+}
+
+/**
+ * sr_vns_reader_has_message()\n
+ * @return true if a complete message is buffered, so the next call to
+ *         sr_vns_reader_next() won't read from the socket.
+ */
+bool sr_vns_reader_has_message(const sr_vns_reader_t *reader)
+{
+   uint32_t messageLength;
+
+   if (sr_vns_reader_buffered(reader) < sizeof(messageLength))
+   {
+      return false;
+   }
+   memcpy(&messageLength, reader->buffer + reader->start, sizeof(messageLength));
+   return reader->end - reader->start >= ntohl(messageLength);
+}
+
+/**
+ * sr_vns_reader_buffered()\n
+ * @return the number of bytes read but not handed out yet.
+ */
+unsigned int sr_vns_reader_buffered(const sr_vns_reader_t *reader)
+{
+   return reader ? reader->end - reader->start : 0;
+}
+
+/**
+ * sr_vns_reader_print()\n
+ * @brief Writes the reader's statistics on one line.
+ */
+void sr_vns_reader_print(const sr_vns_reader_t *reader, FILE *out)
+{
+   fprintf(out, "VNS reader: %" PRIu64 " messages in %" PRIu64 " reads (%" PRIu64
+      " blocking), batch %u, spin %u us, %" PRIu64 " busy episodes, %" PRIu64
+      " empty polls; polling %.1f ms, blocked %.1f ms, processing %.1f ms\n", reader->messages,
+      reader->reads, reader->blockingReads, reader->batch, reader->spinBudgetUs,
+      reader->busyEpisodes, reader->emptyPolls, reader->pollNs / 1e6, reader->blockNs / 1e6,
+      reader->processNs / 1e6);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64_t readerNowNs(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * readerRead()\n
+ * @brief Reads up to length bytes behind the buffered ones, spinning first if
+ *        busy.
+ * @return as recv(); a signal gives -1 with errno EINTR, and a non-blocking
+ *         reader with nothing to read gets -1 with errno EAGAIN.
+ */
+static ssize_t readerRead(sr_vns_reader_t *reader, int fd, unsigned int length)
+{
+   uint8_t *destination = reader->buffer + reader->end;
+   uint64_t started = readerNowNs();
+   ssize_t received;
+
+   if (reader->nonBlocking)
+   {
+      received = recv(fd, destination, length, MSG_DONTWAIT);
+      reader->pollNs += readerNowNs() - started;
+      if (received > 0)
+      {
+         reader->reads++;
+      }
+      else if ((received < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+      {
+         reader->emptyPolls++;
+      }
+      return received;
+   }
+
+   if (reader->busy)
+   {
+      uint64_t deadline = started + reader->spinBudgetUs * 1000ULL;
+      uint64_t now;
+
+      do
+      {
+         received = recv(fd, destination, length, MSG_DONTWAIT);
+         now = readerNowNs();
+         if ((received >= 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK)))
+         {
+            reader->pollNs += now - started;
+            if (received > 0)
+            {
+               reader->reads++;
+            }
+            return received;
+         }
+         reader->emptyPolls++;
+      } while (now < deadline);
+
+      /* Traffic stopped; sleep until it resumes. */
+      reader->pollNs += now - started;
+      reader->busy = false;
+      started = now;
+   }
+
+   received = recv(fd, destination, length, 0);
+   reader->blockNs += readerNowNs() - started;
+   reader->blockingReads++;
+   if (received > 0)
+   {
+      reader->reads++;
+   }
+   return received;
+}
@@ -0,0 +1,89 @@
+/**
+ * @file sr_vns_reader.h
+ * @brief Adaptive receive loop for the VNS socket.
+ *
+ * The classic client makes two blocking reads per VNS message. This reader
+ * instead reads as much as is available, up to a batch size, and hands out
+ * the complete messages one at a time, so under load one system call brings
+ * in many messages. The batch size doubles whenever a read fills it (up to
+ * SR_VNS_READER_MAX_BATCH) and halves when reads come back mostly empty.
+ *
+ * While traffic keeps arriving the reader busy-polls: it retries
+ * non-blocking reads for up to the spin budget before going back to sleep in
+ * a blocking read. A budget of 0 never spins. Larger budgets buy lower
+ * wake-up latency with CPU time; the budget is the only knob.
+ *
+ * A non-blocking reader never waits: it reads only what has already
+ * arrived, keeps any partial message buffered and returns
+ * SR_VNS_READER_WOULD_BLOCK. sr_multi uses it so that one thread can serve
+ * many sessions without a slow one holding up the rest.
+ *
+ * The time spent spinning, blocked and between calls (processing) is
+ * accumulated so the trade can be measured.
+ */
+
+#ifndef SR_VNS_READER_H
+#define SR_VNS_READER_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_VNS_READER_MIN_BATCH     (4 * 1024)
+#define SR_VNS_READER_MAX_BATCH     (256 * 1024)
+#define SR_VNS_READER_MAX_MESSAGE   (10000) /**< Must match the client's largest command. */
+
+/** sr_vns_reader_next() was interrupted by a signal between messages. */
+#define SR_VNS_READER_INTERRUPTED   (-2)
+
+/** A non-blocking sr_vns_reader_next() found no complete message. */
+#define SR_VNS_READER_WOULD_BLOCK   (-3)
+
+/*
+ * Public Types
+ */
+
+typedef struct sr_vns_reader
+{
+   uint8_t *buffer; /**< SR_VNS_READER_MAX_BATCH bytes. */
+   unsigned int start; /**< First byte not yet handed out. */
+   unsigned int end; /**< One past the last byte read. */
+   unsigned int batch; /**< Bytes asked for by the next read. */
+   unsigned int spinBudgetUs;
+   bool busy; /**< Traffic is flowing; poll before blocking. */
+   bool nonBlocking; /**< Never wait for data. */
+   uint64_t lastReturnNs; /**< When the last message was handed out. */
+
+   /* statistics */
+   uint64_t messages;
+   uint64_t reads; /**< Reads that returned data. */
+   uint64_t emptyPolls; /**< Non-blocking reads that found nothing. */
+   uint64_t blockingReads;
+   uint64_t busyEpisodes;
+   uint64_t pollNs;
+   uint64_t blockNs;
+   uint64_t processNs;
+} sr_vns_reader_t;
+
+/*
+ * Public Function Declarations
+ */
+
+sr_vns_reader_t *sr_vns_reader_create(unsigned int spinBudgetUs);
+void sr_vns_reader_destroy(sr_vns_reader_t *reader);
+void sr_vns_reader_set_nonblocking(sr_vns_reader_t *reader, bool nonBlocking);
+int sr_vns_reader_next(sr_vns_reader_t *reader, int fd, bool noReadAhead, uint8_t **message);
+bool sr_vns_reader_pending(const sr_vns_reader_t *reader);
+bool sr_vns_reader_has_message(const sr_vns_reader_t *reader);
+unsigned int sr_vns_reader_buffered(const sr_vns_reader_t *reader);
+void sr_vns_reader_print(const sr_vns_reader_t *reader, FILE *out);
+
+#endif /* SR_VNS_READER_H */
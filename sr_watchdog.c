@@ -0,0 +1,437 @@
+/*
+ *-----------------------------------------------------------------------------
+ * Include Files
+ *-----------------------------------------------------------------------------
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "sr_watchdog.h"
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Defines
+ *-----------------------------------------------------------------------------
+ */
+
+#define WATCHDOG_SIGNAL             (SIGRTMIN + 3)
+#define WATCHDOG_CHECKS_PER_PERIOD  (4)  /**< Checks per threshold. */
+#define WATCHDOG_CAPTURE_WAIT_MS    (100) /**< How long to wait for a stack. */
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Declarations
+ *-----------------------------------------------------------------------------
+ */
+
+static void *watchdogThread(void *arg);
+static void watchdogCheck(uint64_t nowMs);
+static void watchdogReport(sr_watchdog_thread_t *slot, uint64_t stalledMs);
+static void watchdogCaptureHandler(int signum);
+static uint64_t watchdogNowMs(void);
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public variables
+ *-----------------------------------------------------------------------------
+ */
+
+__thread sr_watchdog_thread_t *srWatchdogSelf = NULL;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private variables
+ *-----------------------------------------------------------------------------
+ */
+
+static const char * const watchdogStageNames[SR_WATCHDOG_STAGE_COUNT] =
+{
+   "idle", "packet", "vns write", "arp sweep", "nat sweep", "nat sync", "nat log", "flow export",
+   "sample export", "upgrade"
+};
+static const char * const watchdogLockNames[SR_WATCHDOG_LOCK_COUNT] = { "ARP", "NAT" };
+
+static pthread_mutex_t watchdogLock = PTHREAD_MUTEX_INITIALIZER;
+static sr_watchdog_thread_t watchdogSlots[SR_WATCHDOG_MAX_THREADS];
+static bool watchdogRunning = false;
+static bool watchdogStopRequested = false;
+static pthread_t watchdogThreadId;
+static unsigned int watchdogThresholdMs;
+static FILE *watchdogLog = NULL;
+
+/* statistics, under watchdogLock */
+static uint64_t watchdogStallsByStage[SR_WATCHDOG_STAGE_COUNT];
+static uint64_t watchdogStallsByLock[SR_WATCHDOG_LOCK_COUNT];
+static uint64_t watchdogLongestMs;
+
+/*
+ *-----------------------------------------------------------------------------
+ * Public Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+/**
+ * sr_watchdog_start()\n
+ * @brief Opens the log, installs the stack capture handler and starts the
+ *        watchdog thread.
+ * @param thresholdMs how long a busy thread may go without a heartbeat.
+ * @param logPath file stalls are appended to.
+ * @return 0 on success, -1 on error.
+ * @note Call before the threads to watch are created; they register
+ *       themselves with sr_watchdog_register().
+ */
+int sr_watchdog_start(unsigned int thresholdMs, const char *logPath)
+{
+   struct sigaction action;
+   void *frames[1];
+
+   assert(thresholdMs > 0);
+   assert(logPath);
+
+   if (watchdogRunning)
+   {
+      return -1;
+   }
+
+   watchdogLog = fopen(logPath, "a");
+   if (watchdogLog == NULL)
+   {
+      perror(logPath);
+      return -1;
+   }
+   setvbuf(watchdogLog, NULL, _IOLBF, 0);
+
+   /* The first backtrace() loads libgcc, which is not async-signal-safe. */
+   backtrace(frames, 1);
+
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = watchdogCaptureHandler;
+   action.sa_flags = SA_RESTART;
+   sigemptyset(&action.sa_mask);
+   sigaction(WATCHDOG_SIGNAL, &action, NULL);
+
+   memset(watchdogStallsByStage, 0, sizeof(watchdogStallsByStage));
+   memset(watchdogStallsByLock, 0, sizeof(watchdogStallsByLock));
+   watchdogLongestMs = 0;
+   watchdogThresholdMs = thresholdMs;
+   watchdogStopRequested = false;
+   fprintf(watchdogLog, "watchdog started, threshold %u ms\n", thresholdMs);
+   if (pthread_create(&watchdogThreadId, NULL, watchdogThread, NULL) != 0)
+   {
+      perror("pthread_create(..):sr_watchdog_start");
+      fclose(watchdogLog);
+      watchdogLog = NULL;
+      return -1;
+   }
+   watchdogRunning = true;
+
+   return 0;
+}
+
+/**
+ * sr_watchdog_stop()\n
+ * @brief Stops the watchdog thread and closes the log.
+ * @note Registered threads keep their slots; they just aren't checked.
+ */
+void sr_watchdog_stop(void)
+{
+   if (!watchdogRunning)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&watchdogLock);
+   watchdogStopRequested = true;
+   pthread_mutex_unlock(&watchdogLock);
+   pthread_join(watchdogThreadId, NULL);
+
+   watchdogRunning = false;
+   fclose(watchdogLog);
+   watchdogLog = NULL;
+}
+
+/**
+ * sr_watchdog_register()\n
+ * @brief Starts watching the calling thread. Does nothing if the watchdog
+ *        isn't running or every slot is taken.
+ * @param name how the thread is named in the log; must outlive the thread.
+ */
+void sr_watchdog_register(const char *name)
+{
+   unsigned int i;
+
+   if (!watchdogRunning || srWatchdogSelf)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&watchdogLock);
+   for (i = 0; i < SR_WATCHDOG_MAX_THREADS; i++)
+   {
+      sr_watchdog_thread_t *slot = &watchdogSlots[i];
+
+      if (!slot->active)
+      {
+         memset(slot, 0, sizeof(*slot));
+         slot->name = name;
+         slot->thread = pthread_self();
+         slot->tid = (pid_t) syscall(SYS_gettid);
+         slot->stage = SR_WATCHDOG_IDLE;
+         slot->waitingFor = SR_WATCHDOG_LOCK_NONE;
+         slot->lastProgressMs = watchdogNowMs();
+         slot->active = true;
+         srWatchdogSelf = slot;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&watchdogLock);
+}
+
+/**
+ * sr_watchdog_unregister()\n
+ * @brief Stops watching the calling thread; call before it exits.
+ */
+void sr_watchdog_unregister(void)
+{
+   if (srWatchdogSelf == NULL)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&watchdogLock);
+   srWatchdogSelf->active = false;
+   srWatchdogSelf = NULL;
+   pthread_mutex_unlock(&watchdogLock);
+}
+
+/**
+ * sr_watchdog_print()\n
+ * @brief Writes the stall counts by cause on one line.
+ */
+void sr_watchdog_print(FILE *out)
+{
+   uint64_t total = 0;
+   unsigned int i;
+
+   if (!watchdogRunning)
+   {
+      return;
+   }
+
+   pthread_mutex_lock(&watchdogLock);
+   for (i = 0; i < SR_WATCHDOG_STAGE_COUNT; i++)
+   {
+      total += watchdogStallsByStage[i];
+   }
+   for (i = 0; i < SR_WATCHDOG_LOCK_COUNT; i++)
+   {
+      total += watchdogStallsByLock[i];
+   }
+
+   fprintf(out, "watchdog: %" PRIu64 " stalls (longest %" PRIu64 " ms)", total, watchdogLongestMs);
+   for (i = 0; i < SR_WATCHDOG_LOCK_COUNT; i++)
+   {
+      if (watchdogStallsByLock[i])
+      {
+         fprintf(out, ", %s lock wait %" PRIu64, watchdogLockNames[i], watchdogStallsByLock[i]);
+      }
+   }
+   for (i = 0; i < SR_WATCHDOG_STAGE_COUNT; i++)
+   {
+      if (watchdogStallsByStage[i])
+      {
+         fprintf(out, ", %s %" PRIu64, watchdogStageNames[i], watchdogStallsByStage[i]);
+      }
+   }
+   fprintf(out, "\n");
+   pthread_mutex_unlock(&watchdogLock);
+   fflush(out);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ * Private Function Definitions
+ *-----------------------------------------------------------------------------
+ */
+
+static void *watchdogThread(void *arg)
+{
+   struct timespec period;
+   unsigned int periodMs = watchdogThresholdMs / WATCHDOG_CHECKS_PER_PERIOD;
+
+   (void) arg;
+   if (periodMs == 0)
+   {
+      periodMs = 1;
+   }
+   period.tv_sec = periodMs / 1000;
+   period.tv_nsec = (periodMs % 1000) * 1000000L;
+
+   for (;;)
+   {
+      nanosleep(&period, NULL);
+
+      pthread_mutex_lock(&watchdogLock);
+      if (watchdogStopRequested)
+      {
+         pthread_mutex_unlock(&watchdogLock);
+         break;
+      }
+      watchdogCheck(watchdogNowMs());
+      pthread_mutex_unlock(&watchdogLock);
+   }
+
+   return NULL;
+}
+
+/**
+ * watchdogCheck()\n
+ * @brief Looks for busy threads whose heartbeat hasn't moved.
+ * @note Called with watchdogLock held.
+ */
+static void watchdogCheck(uint64_t nowMs)
+{
+   unsigned int i;
+
+   for (i = 0; i < SR_WATCHDOG_MAX_THREADS; i++)
+   {
+      sr_watchdog_thread_t *slot = &watchdogSlots[i];
+      uint64_t heartbeat;
+      int stage;
+
+      if (!slot->active)
+      {
+         continue;
+      }
+
+      heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_RELAXED);
+      stage = __atomic_load_n(&slot->stage, __ATOMIC_RELAXED);
+      if ((heartbeat != slot->lastHeartbeat) || (stage == SR_WATCHDOG_IDLE))
+      {
+         if (slot->reported)
+         {
+            uint64_t stalledMs = nowMs - slot->lastProgressMs;
+
+            fprintf(watchdogLog, "thread \"%s\" (tid %d) resumed after about %" PRIu64 " ms\n",
+               slot->name, (int) slot->tid, stalledMs);
+            if (stalledMs > watchdogLongestMs)
+            {
+               watchdogLongestMs = stalledMs;
+            }
+         }
+         slot->lastHeartbeat = heartbeat;
+         slot->lastProgressMs = nowMs;
+         slot->reported = false;
+      }
+      else if (!slot->reported && (nowMs - slot->lastProgressMs >= watchdogThresholdMs))
+      {
+         watchdogReport(slot, nowMs - slot->lastProgressMs);
+         slot->reported = true;
+      }
+   }
+}
+
+/**
+ * watchdogReport()\n
+ * @brief Captures a stalled thread's stack and logs it with its stage and
+ *        locks, then counts the stall.
+ * @note Called with watchdogLock held; the stalled thread never takes it
+ *       from the signal handler.
+ */
+static void watchdogReport(sr_watchdog_thread_t *slot, uint64_t stalledMs)
+{
+   int stage = __atomic_load_n(&slot->stage, __ATOMIC_RELAXED);
+   int waitingFor = __atomic_load_n(&slot->waitingFor, __ATOMIC_RELAXED);
+   struct timespec now;
+   struct tm local;
+   char stamp[32];
+   unsigned int i, waitedMs = 0;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   localtime_r(&now.tv_sec, &local);
+   strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+   fprintf(watchdogLog, "%s.%03ld stall: thread \"%s\" (tid %d) no progress for %" PRIu64
+      " ms in stage \"%s\"", stamp, now.tv_nsec / 1000000L, slot->name, (int) slot->tid, stalledMs,
+      watchdogStageNames[stage]);
+   if (waitingFor != SR_WATCHDOG_LOCK_NONE)
+   {
+      fprintf(watchdogLog, ", waiting for the %s lock", watchdogLockNames[waitingFor]);
+   }
+   for (i = 0; i < SR_WATCHDOG_LOCK_COUNT; i++)
+   {
+      unsigned int depth = __atomic_load_n(&slot->held[i], __ATOMIC_RELAXED);
+
+      if (depth)
+      {
+         fprintf(watchdogLog, ", holding the %s lock (depth %u)", watchdogLockNames[i], depth);
+      }
+   }
+   fprintf(watchdogLog, "\n");
+
+   slot->captured = 0;
+   if (pthread_kill(slot->thread, WATCHDOG_SIGNAL) == 0)
+   {
+      struct timespec pause = { 0, 1000000L };
+
+      while (!slot->captured && (waitedMs < WATCHDOG_CAPTURE_WAIT_MS))
+      {
+         nanosleep(&pause, NULL);
+         waitedMs++;
+      }
+   }
+   if (slot->captured)
+   {
+      fflush(watchdogLog);
+      backtrace_symbols_fd(slot->frames, slot->frameCount, fileno(watchdogLog));
+   }
+   else
+   {
+      fprintf(watchdogLog, "   (no stack: the thread did not run the capture handler)\n");
+   }
+
+   if (waitingFor != SR_WATCHDOG_LOCK_NONE)
+   {
+      watchdogStallsByLock[waitingFor]++;
+   }
+   else
+   {
+      watchdogStallsByStage[stage]++;
+   }
+   if (stalledMs > watchdogLongestMs)
+   {
+      watchdogLongestMs = stalledMs;
+   }
+}
+
+/**
+ * watchdogCaptureHandler()\n
+ * @brief Runs on the stalled thread: records its stack into its slot.
+ */
+static void watchdogCaptureHandler(int signum)
+{
+   sr_watchdog_thread_t *self = srWatchdogSelf;
+   int savedErrno = errno;
+
+   (void) signum;
+   if (self)
+   {
+      self->frameCount = backtrace(self->frames, SR_WATCHDOG_MAX_FRAMES);
+      self->captured = 1;
+   }
+   errno = savedErrno;
+}
+
+static uint64_t watchdogNowMs(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000L;
+}
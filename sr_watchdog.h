@@ -0,0 +1,175 @@
+/**
+ * @file sr_watchdog.h
+ * @brief Detects and explains data-plane stalls.
+ *
+ * Each router thread registers itself and keeps a heartbeat counter, the
+ * stage it is in and which of the ARP and NAT locks it holds or is waiting
+ * for. It beats once per unit of work (a VNS message, a timer sweep, a
+ * replication batch) and marks itself idle before blocking for more work.
+ *
+ * A watchdog thread checks every thread a few times per threshold. A thread
+ * that is not idle and whose heartbeat hasn't moved for the threshold is
+ * stalled: the watchdog signals it, the signal handler captures its stack
+ * with backtrace(), and the watchdog appends the thread's name, stage,
+ * locks and symbolized stack to the log file. Stalls are counted by cause:
+ * the lock the thread was waiting for if any, otherwise its stage.
+ *
+ * Everything is per process and costs a thread-local load when the
+ * watchdog isn't running.
+ */
+
+#ifndef SR_WATCHDOG_H
+#define SR_WATCHDOG_H
+
+/*
+ * Include Files
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Public Defines & Macros
+ */
+
+#define SR_WATCHDOG_MAX_THREADS        (64)
+#define SR_WATCHDOG_MAX_FRAMES         (32)
+#define SR_WATCHDOG_DEFAULT_LOG        "sr_watchdog.log"
+
+/*
+ * Public Types
+ */
+
+typedef enum
+{
+   SR_WATCHDOG_IDLE, /**< Blocked waiting for work; never a stall. */
+   SR_WATCHDOG_PACKET, /**< Handling a message from VNS. */
+   SR_WATCHDOG_VNS_WRITE, /**< Writing to the VNS socket. */
+   SR_WATCHDOG_ARP_SWEEP,
+   SR_WATCHDOG_NAT_SWEEP,
+   SR_WATCHDOG_NAT_SYNC, /**< Replicating NAT state to the standby. */
+   SR_WATCHDOG_NAT_LOG, /**< Writing the NAT mapping log. */
+   SR_WATCHDOG_FLOW_EXPORT, /**< Writing flow records. */
+   SR_WATCHDOG_SAMPLE_EXPORT, /**< Sending packet samples. */
+   SR_WATCHDOG_UPGRADE, /**< Handing the session to a new binary. */
+   SR_WATCHDOG_STAGE_COUNT
+} sr_watchdog_stage_t;
+
+typedef enum
+{
+   SR_WATCHDOG_LOCK_ARP,
+   SR_WATCHDOG_LOCK_NAT,
+   SR_WATCHDOG_LOCK_COUNT,
+   SR_WATCHDOG_LOCK_NONE = SR_WATCHDOG_LOCK_COUNT
+} sr_watchdog_lock_t;
+
+typedef struct sr_watchdog_thread
+{
+   /* written by the thread itself */
+   uint64_t heartbeat;
+   int stage; /**< sr_watchdog_stage_t */
+   int waitingFor; /**< sr_watchdog_lock_t */
+   unsigned int held[SR_WATCHDOG_LOCK_COUNT]; /**< Recursion depth of each lock. */
+
+   /* filled in by the stack capture signal handler */
+   void *frames[SR_WATCHDOG_MAX_FRAMES];
+   int frameCount;
+   volatile sig_atomic_t captured;
+
+   /* watchdog bookkeeping */
+   const char *name;
+   pthread_t thread;
+   pid_t tid;
+   bool active;
+   uint64_t lastHeartbeat;
+   uint64_t lastProgressMs;
+   bool reported; /**< This stall has been logged already. */
+} sr_watchdog_thread_t;
+
+/*
+ * Public Variables
+ */
+
+/** The calling thread's slot, or NULL if it isn't watched. */
+extern __thread sr_watchdog_thread_t *srWatchdogSelf;
+
+/*
+ * Public Function Declarations
+ */
+
+int sr_watchdog_start(unsigned int thresholdMs, const char *logPath);
+void sr_watchdog_stop(void);
+void sr_watchdog_register(const char *name);
+void sr_watchdog_unregister(void);
+void sr_watchdog_print(FILE *out);
+
+/*
+ * Inline Function Definitions
+ */
+
+/** Records a unit of work done. */
+static inline void sr_watchdog_beat(void)
+{
+   sr_watchdog_thread_t *self = srWatchdogSelf;
+
+   if (self)
+   {
+      __atomic_add_fetch(&self->heartbeat, 1, __ATOMIC_RELAXED);
+   }
+}
+
+/**
+ * Enters a stage.
+ * @return the stage the thread was in, to go back to afterwards.
+ */
+static inline sr_watchdog_stage_t sr_watchdog_stage(sr_watchdog_stage_t stage)
+{
+   sr_watchdog_thread_t *self = srWatchdogSelf;
+
+   if (self == NULL)
+   {
+      return SR_WATCHDOG_IDLE;
+   }
+   return (sr_watchdog_stage_t) __atomic_exchange_n(&self->stage, (int) stage, __ATOMIC_RELAXED);
+}
+
+/** Beats and marks the thread idle; call before blocking for more work. */
+static inline void sr_watchdog_idle(void)
+{
+   sr_watchdog_beat();
+   sr_watchdog_stage(SR_WATCHDOG_IDLE);
+}
+
+/** pthread_mutex_lock() on the ARP or NAT lock, tracking the wait and the hold. */
+static inline void sr_watchdog_lock(pthread_mutex_t *mutex, sr_watchdog_lock_t which)
+{
+   sr_watchdog_thread_t *self = srWatchdogSelf;
+
+   if (self == NULL)
+   {
+      pthread_mutex_lock(mutex);
+      return;
+   }
+   __atomic_store_n(&self->waitingFor, (int) which, __ATOMIC_RELAXED);
+   pthread_mutex_lock(mutex);
+   __atomic_store_n(&self->waitingFor, (int) SR_WATCHDOG_LOCK_NONE, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&self->held[which], 1, __ATOMIC_RELAXED);
+}
+
+/** pthread_mutex_unlock() counterpart of sr_watchdog_lock(). */
+static inline void sr_watchdog_unlock(pthread_mutex_t *mutex, sr_watchdog_lock_t which)
+{
+   sr_watchdog_thread_t *self = srWatchdogSelf;
+
+   if (self)
+   {
+      __atomic_sub_fetch(&self->held[which], 1, __ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(mutex);
+}
+
+#endif /* SR_WATCHDOG_H */
@@ -0,0 +1,56 @@
+/**
+ * @file flow_decode.c
+ * @brief Prints flow records exported with -X to a file as text, one record
+ *        a line, then the totals:
+ *
+ *    1792306502-1792306517 end proto 6 10.0.1.100:40112 (172.64.3.1:50007) -> 107.23.115.131:443 12/1480 packets/bytes, 10/9320 back
+ *
+ * Usage: flow_decode file...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sr_codec.h"
+
+int main(int argc, char **argv)
+{
+   sr_flow_record_t totals, sum = { 0 };
+   uint64_t records, total = 0;
+   int status = 0;
+   int i;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: %s file...\n", argv[0]);
+      return 2;
+   }
+
+   for (i = 1; i < argc; i++)
+   {
+      FILE *in = fopen(argv[i], "rb");
+
+      if (in == NULL)
+      {
+         perror(argv[i]);
+         status = 1;
+         continue;
+      }
+      if (sr_codec_flow_decode(in, stdout, &records, &totals) != 0)
+      {
+         fprintf(stderr, "%s: not flow records, or corrupt after %" PRIu64 " records\n", argv[i],
+            records);
+         status = 1;
+      }
+      total += records;
+      sum.packets += totals.packets;
+      sum.octets += totals.octets;
+      sum.reversePackets += totals.reversePackets;
+      sum.reverseOctets += totals.reverseOctets;
+      fclose(in);
+   }
+
+   fprintf(stderr, "%" PRIu64 " records: %" PRIu64 "/%" PRIu64 " packets/bytes, %" PRIu64 "/%"
+      PRIu64 " back\n", total, sum.packets, sum.octets, sum.reversePackets, sum.reverseOctets);
+   return status;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file mirror_capture.c
+ * @brief Reads the frames a port mirror session (-M) puts in a ring and
+ *        writes them to a pcap file, until interrupted or until it has
+ *        written the number of frames asked for. Prints the frames written
+ *        and those the router dropped because the ring was full.
+ *
+ * Usage: mirror_capture ring pcap [frames]
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_dumper.h"
+#include "sr_mirror.h"
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void stopSignalHandler(int signal)
+{
+   (void) signal;
+   stopRequested = 1;
+}
+
+int main(int argc, char **argv)
+{
+   const struct timespec idle = { 0, 1000000 };
+   unsigned long long limit = 0, written = 0;
+   const sr_mirror_slot_t *slot;
+   struct pcap_pkthdr header;
+   sr_mirror_ring_t *ring;
+   struct stat status;
+   FILE *out;
+   int fd;
+
+   if ((argc < 3) || (argc > 4))
+   {
+      fprintf(stderr, "Usage: %s ring pcap [frames]\n", argv[0]);
+      return 2;
+   }
+   if (argc == 4)
+   {
+      limit = strtoull(argv[3], NULL, 10);
+   }
+
+   fd = open(argv[1], O_RDWR);
+   if ((fd < 0) || (fstat(fd, &status) != 0))
+   {
+      perror(argv[1]);
+      return 1;
+   }
+   ring = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if ((ring == MAP_FAILED) || ((size_t) status.st_size < sizeof(*ring))
+      || (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SR_MIRROR_RING_MAGIC)
+      || (ring->version != SR_MIRROR_RING_VERSION)
+      || (ring->slotSize != sizeof(sr_mirror_slot_t))
+      || ((size_t) status.st_size < sizeof(*ring) + (size_t) ring->slotCount * ring->slotSize))
+   {
+      fprintf(stderr, "%s: not a mirror ring of this version\n", argv[1]);
+      return 1;
+   }
+
+   out = sr_dump_open(argv[2], 0, SR_MIRROR_RING_SNAPLEN);
+   if (out == NULL)
+   {
+      perror(argv[2]);
+      return 1;
+   }
+   signal(SIGINT, stopSignalHandler);
+   signal(SIGTERM, stopSignalHandler);
+
+   while (!stopRequested && ((limit == 0) || (written < limit)))
+   {
+      slot = sr_mirror_ring_next(ring);
+      if (slot == NULL)
+      {
+         nanosleep(&idle, NULL);
+         continue;
+      }
+      header.ts.tv_sec = slot->timestampNs / 1000000000ULL;
+      header.ts.tv_usec = (slot->timestampNs % 1000000000ULL) / 1000;
+      header.caplen = slot->captured;
+      header.len = slot->length;
+      sr_dump(out, &header, slot->data);
+      sr_mirror_ring_release(ring, slot);
+      written++;
+   }
+
+   sr_dump_close(out);
+   fprintf(stderr, "%llu frames written, %llu dropped by the router with the ring full\n",
+      written, (unsigned long long) __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED));
+   return 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * @file natlog_decode.c
+ * @brief Prints NAT mapping logs written with -G as text, one event a line:
+ *
+ *    2026-10-18T09:15:02.113520Z create tcp 10.0.1.100:40112 -> 172.64.3.1:50007
+ *    2026-10-18T09:15:02.113871Z block-allocate tcp 10.0.1.101 -> 172.64.3.1:50064-50127
+ *
+ * Usage: natlog_decode file...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sr_codec.h"
+
+int main(int argc, char **argv)
+{
+   uint64_t records, total = 0;
+   int status = 0;
+   int i;
+
+   if (argc < 2)
+   {
+      fprintf(stderr, "Usage: %s file...\n", argv[0]);
+      return 2;
+   }
+
+   for (i = 1; i < argc; i++)
+   {
+      FILE *in = fopen(argv[i], "rb");
+
+      if (in == NULL)
+      {
+         perror(argv[i]);
+         status = 1;
+         continue;
+      }
+      if (sr_codec_natlog_decode(in, stdout, &records) != 0)
+      {
+         fprintf(stderr, "%s: not a NAT log, or corrupt after %" PRIu64 " records\n", argv[i],
+            records);
+         status = 1;
+      }
+      total += records;
+      fclose(in);
+   }
+
+   fprintf(stderr, "%" PRIu64 " records\n", total);
+   return status;
+}
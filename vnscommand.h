@@ -196,5 +196,42 @@ typedef struct
 
 }__attribute__ ((__packed__)) c_auth_status;
 
+/* ******* Batched packet extension ******** */
+
+/* A server that supports extensions offers them with VNS_CAPABILITIES
+ * (before VNSHWINFO); the client answers with the subset it accepts. Either
+ * side only uses an extension once it has been offered by the server and
+ * accepted by the client, so classic servers, which never offer, only ever
+ * see VNSPACKET. */
+#define VNS_CAPABILITIES 1024
+#define VNSPACKET_BATCH  2048
+
+#define VNS_CAP_VERSION       1
+#define VNS_CAP_PACKET_BATCH  0x00000001
+
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;         /* = VNS_CAPABILITIES */
+    uint32_t mVersion;      /* = VNS_CAP_VERSION */
+    uint32_t mCapabilities; /* VNS_CAP_* offered (server) or accepted (client) */
+    uint32_t mMaxBatchLen;  /* largest VNSPACKET_BATCH message the sender will accept */
+}__attribute__ ((__packed__)) c_capabilities;
+
+/* Several Ethernet frames in one message. The interface is identified by
+ * its position (from 0) among the HWINTERFACE entries of VNSHWINFO. */
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;         /* = VNSPACKET_BATCH */
+    uint32_t mCount;        /* number of frames that follow */
+}__attribute__ ((__packed__)) c_packet_batch;
+
+typedef struct
+{
+    uint16_t mLen;          /* length of the frame that follows */
+    uint8_t  mInterfaceId;
+    uint8_t  mReserved;
+}__attribute__ ((__packed__)) c_packet_batch_frame;
 
 #endif  /* __VNSCOMMAND_H */